@@ -594,6 +594,22 @@ extern int ptep_test_and_clear_young(struct vm_area_struct *vma,
 extern int ptep_clear_flush_young(struct vm_area_struct *vma,
 				  unsigned long address, pte_t *ptep);
 
+#ifndef CONFIG_KMEMCHECK
+/*
+ * Move hardware dirty bit to _PAGE_SOFTDIRTY, pte_dirty() stays true, and
+ * report whether the page was written since the previous call. Caller
+ * flushes TLB, otherwise cpu may not set _PAGE_DIRTY again.
+ */
+#define __HAVE_ARCH_PTEP_TEST_AND_FOLD_DIRTY
+extern int ptep_test_and_fold_dirty(struct vm_area_struct *vma,
+				    unsigned long addr, pte_t *ptep);
+
+static inline int pte_hwdirty(pte_t pte)
+{
+	return pte_flags(pte) & _PAGE_DIRTY;
+}
+#endif
+
 #define __HAVE_ARCH_PTEP_GET_AND_CLEAR
 static inline pte_t ptep_get_and_clear(struct mm_struct *mm, unsigned long addr,
 				       pte_t *ptep)
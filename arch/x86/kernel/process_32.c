@@ -502,6 +502,7 @@ unsigned long get_wchan(struct task_struct *p)
 	} while (count++ < 16);
 	return 0;
 }
+EXPORT_SYMBOL(get_wchan);
 
 static void modify_cs(struct mm_struct *mm, unsigned long limit)
 {
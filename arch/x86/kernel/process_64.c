@@ -616,6 +616,7 @@ unsigned long get_wchan(struct task_struct *p)
 	} while (count++ < 16);
 	return 0;
 }
+EXPORT_SYMBOL(get_wchan);
 
 long do_arch_prctl(struct task_struct *task, int code, unsigned long addr)
 {
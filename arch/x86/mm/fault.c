@@ -1084,6 +1084,16 @@ static inline void __do_page_fault(struct pt_regs *regs, unsigned long address,
 	if (error_code & PF_WRITE)
 		flags |= FAULT_FLAG_WRITE;
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/* plain not-present user faults may go without mmap_sem */
+	if ((error_code & (PF_USER | PF_PROT | PF_INSTR)) == PF_USER &&
+	    handle_speculative_fault(mm, address, flags) == 0) {
+		tsk->min_flt++;
+		perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1, regs, address);
+		return;
+	}
+#endif
+
 	/*
 	 * When running in the kernel we expect faults to occur only to
 	 * addresses in user space.  All other faults represent errors in
@@ -368,6 +368,26 @@ int ptep_test_and_clear_young(struct vm_area_struct *vma,
 }
 EXPORT_SYMBOL(ptep_test_and_clear_young);
 
+#ifdef __HAVE_ARCH_PTEP_TEST_AND_FOLD_DIRTY
+int ptep_test_and_fold_dirty(struct vm_area_struct *vma,
+			     unsigned long addr, pte_t *ptep)
+{
+	int ret = 0;
+
+	if (pte_hwdirty(*ptep)) {
+		set_bit(_PAGE_BIT_SOFTDIRTY, (unsigned long *) &ptep->pte);
+		ret = test_and_clear_bit(_PAGE_BIT_DIRTY,
+					 (unsigned long *) &ptep->pte);
+	}
+
+	if (ret)
+		pte_update(vma->vm_mm, addr, ptep);
+
+	return ret;
+}
+EXPORT_SYMBOL(ptep_test_and_fold_dirty);
+#endif
+
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 int pmdp_test_and_clear_young(struct vm_area_struct *vma,
 			      unsigned long addr, pmd_t *pmdp)
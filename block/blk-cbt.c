@@ -9,6 +9,9 @@
 #include <linux/spinlock.h>
 #include <linux/pagemap.h>
 #include <linux/vmalloc.h>
+#include <linux/notifier.h>
+#include <linux/reboot.h>
+#include <linux/pram.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
@@ -17,6 +20,7 @@
 #define BITS_PER_PAGE		(1UL << (PAGE_SHIFT + 3))
 
 static __cacheline_aligned_in_smp DEFINE_MUTEX(cbt_mutex);
+static LIST_HEAD(cbt_list);	/* all live cbt_info, under cbt_mutex */
 
 struct cbt_extent{
 	blkcnt_t start;
@@ -31,12 +35,22 @@ struct cbt_info {
 	unsigned long flags;
 
 	struct rcu_head rcu;
+	struct list_head list;
 	unsigned int count;
 	struct cbt_extent __percpu *cache;
 	struct page **map;
+	unsigned long *summary;	/* bit per map page: may have bits set */
 	spinlock_t lock;
+
+	/* Frozen generation, filled by BLKCBTSNAPCREATE */
+	struct page **snp_map;
+	unsigned long *snp_summary;
+	blkcnt_t snp_block_max;
 };
 
+/* page_private() of map page moved to frozen generation */
+#define CBT_PAGE_FROZEN	1UL
+
 
 enum CBT_FLAGS
 {
@@ -46,6 +60,11 @@ enum CBT_FLAGS
 };
 static void cbt_release_callback(struct rcu_head *head);
 static void cbt_flush_cache(struct cbt_info *cbt);
+#ifdef CONFIG_PRAM
+static void cbt_pram_load(struct cbt_info *cbt);
+#else
+static inline void cbt_pram_load(struct cbt_info *cbt) { }
+#endif
 
 static inline void spin_lock_page(struct page *page)
 {
@@ -100,7 +119,16 @@ static int __blk_cbt_set(struct cbt_info  *cbt, blkcnt_t block,
 		page = rcu_dereference(cbt->map[idx]);
 		if (page) {
 			spin_lock_page(page);
+			if (unlikely(page_private(page) == CBT_PAGE_FROZEN)) {
+				/* Raced with BLKCBTSNAPCREATE, reread map */
+				unlock_page(page);
+				cpu_relax();
+				continue;
+			}
 			set_bits(page_address(page), off, len, set);
+			/* Summary bit is dropped lazily by cbt_find_next_extent */
+			if (set)
+				set_bit(idx, cbt->summary);
 			unlock_page(page);
 			count -= len;
 			block += len;
@@ -136,7 +164,7 @@ static int __blk_cbt_set(struct cbt_info  *cbt, blkcnt_t block,
 		if (in_rcu)
 			rcu_read_lock();
 		spin_lock_irq(&cbt->lock);
-		if (unlikely(!cbt->count-- && test_bit(CBT_DEAD, &cbt->flags))) {
+		if (unlikely(!--cbt->count && test_bit(CBT_DEAD, &cbt->flags))) {
 			spin_unlock_irq(&cbt->lock);
 			call_rcu(&cbt->rcu, &cbt_release_callback);
 			if (page)
@@ -148,9 +176,13 @@ static int __blk_cbt_set(struct cbt_info  *cbt, blkcnt_t block,
 			spin_unlock_irq(&cbt->lock);
 			return -ENOMEM;
 		}
-		cbt->map[idx] = page;
-		page = NULL;
+		if (likely(!cbt->map[idx])) {
+			cbt->map[idx] = page;
+			page = NULL;
+		}
 		spin_unlock_irq(&cbt->lock);
+		if (page)
+			__free_page(page);
 	}
 	return 0;
 }
@@ -230,8 +262,17 @@ static struct cbt_info* do_cbt_alloc(struct request_queue *q, __u8 *uuid,
 		goto err_pcpu;
 
 	memset(cbt->map, 0, NR_PAGES(cbt->block_max) * sizeof(void*));
+
+	cbt->summary = vmalloc(BITS_TO_LONGS(NR_PAGES(cbt->block_max)) *
+			       sizeof(unsigned long));
+	if (!cbt->summary)
+		goto err_map;
+
+	bitmap_zero(cbt->summary, NR_PAGES(cbt->block_max));
 	cbt->queue = q;
 	return cbt;
+err_map:
+	vfree(cbt->map);
 err_pcpu:
 	free_percpu(cbt->cache);
 err_cbt:
@@ -268,7 +309,8 @@ void blk_cbt_update_size(struct block_device *bdev)
 		set_bit(CBT_ERROR, &cbt->flags);
 		goto err_mtx;
 	}
-	to_cpy = NR_PAGES(new->block_max);
+	/* the device grows, only the old map is there to copy */
+	to_cpy = min(NR_PAGES(cbt->block_max), NR_PAGES(new->block_max));
 	set_bit(CBT_NOCACHE, &cbt->flags);
 	cbt_flush_cache(cbt);
 	spin_lock_irq(&cbt->lock);
@@ -277,7 +319,15 @@ void blk_cbt_update_size(struct block_device *bdev)
 		new->map[idx] = cbt->map[idx];
 		if (new->map[idx])
 			get_page(new->map[idx]);
+		if (test_bit(idx, cbt->summary))
+			set_bit(idx, new->summary);
 	}
+	list_replace(&cbt->list, &new->list);
+	new->snp_map = cbt->snp_map;
+	new->snp_summary = cbt->snp_summary;
+	new->snp_block_max = cbt->snp_block_max;
+	cbt->snp_map = NULL;
+	cbt->snp_summary = NULL;
 	rcu_assign_pointer(q->cbt, new);
 	in_use = cbt->count;
 	spin_unlock(&cbt->lock);
@@ -311,30 +361,59 @@ static int cbt_ioc_init(struct block_device *bdev, struct blk_user_cbt_info __us
 	cbt = do_cbt_alloc(q, ci.ci_uuid, i_size_read(bdev->bd_inode), ci.ci_blksize);
 	if (IS_ERR(cbt))
 		ret = PTR_ERR(cbt);
-	else
+	else {
+		cbt_pram_load(cbt);
+		list_add(&cbt->list, &cbt_list);
 		rcu_assign_pointer(q->cbt, cbt);
+	}
 err_mtx:
 	mutex_unlock(&cbt_mutex);
 	return ret;
 }
 
+/*
+ * Writers may still hold frozen pages under rcu_read_lock(), so callers
+ * other than cbt_release_callback() wait for a grace period first.
+ */
+static void cbt_free_snap(struct cbt_info *cbt)
+{
+	int nr_pages, i;
+
+	if (!cbt->snp_map)
+		return;
+
+	nr_pages = NR_PAGES(cbt->snp_block_max);
+	for (i = 0; i < nr_pages; i++)
+		if (cbt->snp_map[i]) {
+			set_page_private(cbt->snp_map[i], 0);
+			__free_page(cbt->snp_map[i]);
+		}
+
+	vfree(cbt->snp_summary);
+	vfree(cbt->snp_map);
+	cbt->snp_map = NULL;
+	cbt->snp_summary = NULL;
+}
+
 static void cbt_release_callback(struct rcu_head *head)
 {
 	struct cbt_info *cbt;
 	int nr_pages, i;
 
 	cbt = container_of(head, struct cbt_info, rcu);
+	cbt_free_snap(cbt);
 	nr_pages = NR_PAGES(cbt->block_max);
 	for (i = 0; i < nr_pages; i++)
 		if (cbt->map[i])
 			__free_page(cbt->map[i]);
 
+	vfree(cbt->summary);
 	vfree(cbt->map);
 	free_percpu(cbt->cache);
 	kfree(cbt);
 }
 
-void blk_cbt_release(struct request_queue *q)
+static void __blk_cbt_release(struct request_queue *q)
 {
 	struct cbt_info *cbt;
 	int in_use = 0;
@@ -342,15 +421,27 @@ void blk_cbt_release(struct request_queue *q)
 	cbt = q->cbt;
 	if (!cbt)
 		return;
-	spin_lock(&cbt->lock);
+	list_del(&cbt->list);
+	spin_lock_irq(&cbt->lock);
 	set_bit(CBT_DEAD, &cbt->flags);
 	rcu_assign_pointer(q->cbt, NULL);
 	in_use = cbt->count;
-	spin_unlock(&cbt->lock);
-	if (in_use)
+	spin_unlock_irq(&cbt->lock);
+	/* Otherwise the last page allocator frees it */
+	if (!in_use)
 		call_rcu(&cbt->rcu, &cbt_release_callback);
 }
 
+void blk_cbt_release(struct request_queue *q)
+{
+	if (!q->cbt)
+		return;
+
+	mutex_lock(&cbt_mutex);
+	__blk_cbt_release(q);
+	mutex_unlock(&cbt_mutex);
+}
+
 static int cbt_ioc_stop(struct block_device *bdev)
 {
 	struct request_queue *q;
@@ -361,7 +452,7 @@ static int cbt_ioc_stop(struct block_device *bdev)
 		mutex_unlock(&cbt_mutex);
 		return -EINVAL;
 	}
-	blk_cbt_release(q);
+	__blk_cbt_release(q);
 	mutex_unlock(&cbt_mutex);
 	return 0;
 }
@@ -383,19 +474,40 @@ static void cbt_flush_cache(struct cbt_info *cbt)
 	on_each_cpu(__cbt_flush_cpu_cache, cbt, 1);
 }
 
-static void cbt_find_next_extent(struct cbt_info *cbt, blkcnt_t block, struct cbt_extent *ex)
+/*
+ * Two-level lookup: summary bitmap tells which map pages may have bits
+ * set, so that clean ranges are skipped without touching the pages.
+ * Summary bits are set together with page bits and are cleared here,
+ * under page lock, when the page is found clean.
+ */
+static void __cbt_find_next_extent(struct page **map, unsigned long *summary,
+				   blkcnt_t block_max, blkcnt_t block,
+				   struct cbt_extent *ex)
 {
 	unsigned long off, off2, idx;
+	unsigned long nr_pages = NR_PAGES(block_max);
 	struct page *page;
 	bool found = 0;
 
-	ex->start = cbt->block_max;
+	ex->start = block_max;
 	ex->len = 0;
 
 	idx = block >> (PAGE_SHIFT + 3);
-	while (block < cbt->block_max) {
+	while (block < block_max) {
+		if (!found) {
+			unsigned long next = find_next_bit(summary,
+							   nr_pages, idx);
+			if (next >= nr_pages)
+				break;
+			if (next != idx) {
+				idx = next;
+				block = idx << (PAGE_SHIFT + 3);
+			}
+		} else if (!test_bit(idx, summary))
+			break;
+
 		off = block & (BITS_PER_PAGE -1);
-		page = rcu_dereference(cbt->map[idx]);
+		page = rcu_dereference(map[idx]);
 		if (!page) {
 			if (found)
 				break;
@@ -410,6 +522,9 @@ static void cbt_find_next_extent(struct cbt_info *cbt, blkcnt_t block, struct cb
 				ex->start += idx << (PAGE_SHIFT + 3);
 				found = 1;
 			} else {
+				ex->start = block_max;
+				if (!off)
+					clear_bit(idx, summary);
 				unlock_page(page);
 				goto next;
 			}
@@ -430,6 +545,12 @@ static void cbt_find_next_extent(struct cbt_info *cbt, blkcnt_t block, struct cb
 	}
 }
 
+static void cbt_find_next_extent(struct cbt_info *cbt, blkcnt_t block, struct cbt_extent *ex)
+{
+	__cbt_find_next_extent(cbt->map, cbt->summary, cbt->block_max,
+			       block, ex);
+}
+
 static int cbt_ioc_get(struct block_device *bdev, struct blk_user_cbt_info __user *ucbt_ioc)
 {
 	struct request_queue *q;
@@ -438,12 +559,15 @@ static int cbt_ioc_get(struct block_device *bdev, struct blk_user_cbt_info __use
 	struct blk_user_cbt_extent u_ex;
 	struct cbt_info *cbt;
 	struct cbt_extent ex;
-	blkcnt_t block , end;
+	blkcnt_t block , end, block_max;
 	int ret = 0;
 
 	if (copy_from_user(&ci, ucbt_ioc, sizeof(ci)))
 		return -EFAULT;
-	if (ci.ci_flags &  ~CI_FLAG_ONCE)
+	if (ci.ci_flags &  ~(CI_FLAG_ONCE | CI_FLAG_SNAPSHOT))
+		return -EINVAL;
+	/* Frozen generation is read-only */
+	if ((ci.ci_flags & CI_FLAG_ONCE) && (ci.ci_flags & CI_FLAG_SNAPSHOT))
 		return -EINVAL;
 	if (ci.ci_extent_count > CBT_MAX_EXTENTS)
 		return -EINVAL;
@@ -463,7 +587,16 @@ static int cbt_ioc_get(struct block_device *bdev, struct blk_user_cbt_info __use
 		mutex_unlock(&cbt_mutex);
 		return -EINVAL;
 	}
-	if ((ci.ci_start >> cbt->block_bits) > cbt->block_max) {
+	if (ci.ci_flags & CI_FLAG_SNAPSHOT) {
+		if (!cbt->snp_map) {
+			mutex_unlock(&cbt_mutex);
+			return -EINVAL;
+		}
+		block_max = cbt->snp_block_max;
+	} else
+		block_max = cbt->block_max;
+
+	if ((ci.ci_start >> cbt->block_bits) > block_max) {
 		mutex_unlock(&cbt_mutex);
 		return -EINVAL;
 	}
@@ -471,17 +604,22 @@ static int cbt_ioc_get(struct block_device *bdev, struct blk_user_cbt_info __use
 		mutex_unlock(&cbt_mutex);
 		return -EIO;
 	}
-	cbt_flush_cache(cbt);
+	if (!(ci.ci_flags & CI_FLAG_SNAPSHOT))
+		cbt_flush_cache(cbt);
 
 	memcpy(&ci.ci_uuid, cbt->uuid, sizeof(cbt->uuid));
 	ci.ci_blksize = 1UL << cbt->block_bits;
 	block = ci.ci_start >> cbt->block_bits;
 	end = (ci.ci_start + ci.ci_length) >> cbt->block_bits;
-	if (end > cbt->block_max)
-		end = cbt->block_max;
+	if (end > block_max)
+		end = block_max;
 
 	while (ci.ci_mapped_extents < ci.ci_extent_count) {
-		cbt_find_next_extent(cbt, block, &ex);
+		if (ci.ci_flags & CI_FLAG_SNAPSHOT)
+			__cbt_find_next_extent(cbt->snp_map, cbt->snp_summary,
+					       block_max, block, &ex);
+		else
+			cbt_find_next_extent(cbt, block, &ex);
 		if (!ex.len || ex.start > end) {
 			ret = 0;
 			break;
@@ -572,6 +710,298 @@ static int cbt_ioc_set(struct block_device *bdev, struct blk_user_cbt_info __use
 	return ret;
 }
 
+/*
+ * Freeze current map as read-only generation and let new writes go to
+ * an empty one. Map pages are moved one by one under page lock, so any
+ * write is accounted either in frozen generation or in the new one.
+ */
+static int cbt_ioc_snap_create(struct block_device *bdev)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct cbt_info *cbt;
+	struct page **snp_map;
+	unsigned long *snp_summary;
+	unsigned long idx, nr_pages;
+	int ret = 0;
+
+	mutex_lock(&cbt_mutex);
+	cbt = q->cbt;
+	if (!cbt) {
+		ret = -EINVAL;
+		goto err_mtx;
+	}
+	if (cbt->snp_map) {
+		ret = -EBUSY;
+		goto err_mtx;
+	}
+	if (test_bit(CBT_ERROR, &cbt->flags)) {
+		ret = -EIO;
+		goto err_mtx;
+	}
+
+	nr_pages = NR_PAGES(cbt->block_max);
+	ret = -ENOMEM;
+	snp_map = vmalloc(nr_pages * sizeof(void*));
+	if (!snp_map)
+		goto err_mtx;
+	memset(snp_map, 0, nr_pages * sizeof(void*));
+
+	snp_summary = vmalloc(BITS_TO_LONGS(nr_pages) * sizeof(unsigned long));
+	if (!snp_summary) {
+		vfree(snp_map);
+		goto err_mtx;
+	}
+	bitmap_zero(snp_summary, nr_pages);
+
+	/* Writes queued before freeze must not stay in pcpu caches */
+	set_bit(CBT_NOCACHE, &cbt->flags);
+	cbt_flush_cache(cbt);
+
+	for (idx = 0; idx < nr_pages; idx++) {
+		struct page *page;
+
+		spin_lock_irq(&cbt->lock);
+		page = cbt->map[idx];
+		if (page) {
+			spin_lock_page(page);
+			set_page_private(page, CBT_PAGE_FROZEN);
+			snp_map[idx] = page;
+			cbt->map[idx] = NULL;
+			if (test_and_clear_bit(idx, cbt->summary))
+				set_bit(idx, snp_summary);
+			unlock_page(page);
+		}
+		spin_unlock_irq(&cbt->lock);
+	}
+
+	cbt->snp_block_max = cbt->block_max;
+	cbt->snp_summary = snp_summary;
+	cbt->snp_map = snp_map;
+	clear_bit(CBT_NOCACHE, &cbt->flags);
+	ret = 0;
+err_mtx:
+	mutex_unlock(&cbt_mutex);
+	return ret;
+}
+
+static int cbt_ioc_snap_drop(struct block_device *bdev)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct cbt_info *cbt;
+	int ret = 0;
+
+	mutex_lock(&cbt_mutex);
+	cbt = q->cbt;
+	if (!cbt || !cbt->snp_map)
+		ret = -EINVAL;
+	else {
+		synchronize_rcu();
+		cbt_free_snap(cbt);
+	}
+	mutex_unlock(&cbt_mutex);
+	return ret;
+}
+
+/* Return frozen generation back to current map, e.g. if backup failed */
+static void __cbt_snap_merge(struct cbt_info *cbt)
+{
+	unsigned long idx, nr_pages;
+
+	nr_pages = NR_PAGES(cbt->snp_block_max);
+	for (idx = 0; idx < nr_pages; idx++) {
+		struct page *snp = cbt->snp_map[idx];
+		struct page *page;
+
+		if (!snp)
+			continue;
+
+		spin_lock_irq(&cbt->lock);
+		page = cbt->map[idx];
+		if (!page) {
+			set_page_private(snp, 0);
+			cbt->map[idx] = snp;
+			cbt->snp_map[idx] = NULL;
+		} else {
+			spin_lock_page(page);
+			bitmap_or(page_address(page), page_address(page),
+				  page_address(snp), BITS_PER_PAGE);
+		}
+		if (test_bit(idx, cbt->snp_summary))
+			set_bit(idx, cbt->summary);
+		if (page)
+			unlock_page(page);
+		spin_unlock_irq(&cbt->lock);
+	}
+	synchronize_rcu();
+	cbt_free_snap(cbt);
+}
+
+static int cbt_ioc_snap_merge(struct block_device *bdev)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct cbt_info *cbt;
+	int ret = 0;
+
+	mutex_lock(&cbt_mutex);
+	cbt = q->cbt;
+	if (!cbt || !cbt->snp_map)
+		ret = -EINVAL;
+	else
+		__cbt_snap_merge(cbt);
+	mutex_unlock(&cbt_mutex);
+	return ret;
+}
+
+#ifdef CONFIG_PRAM
+/*
+ * Maps survive kexec in pram stream "cbt.<uuid>": header, array of
+ * indices of map pages and the map pages themselves, pushed as is.
+ */
+struct cbt_pram_hdr {
+	__u64	block_max;
+	__u32	block_bits;
+	__u32	nr_pages;
+};
+
+#define CBT_PRAM_NAME_LEN	64
+
+static void cbt_pram_name(struct cbt_info *cbt, char *name)
+{
+	snprintf(name, CBT_PRAM_NAME_LEN, "cbt.%pU", cbt->uuid);
+}
+
+static int cbt_pram_save(struct cbt_info *cbt)
+{
+	struct pram_stream stream;
+	struct cbt_pram_hdr hdr;
+	char name[CBT_PRAM_NAME_LEN];
+	unsigned long idx, nr_pages = NR_PAGES(cbt->block_max);
+	int err;
+
+	if (test_bit(CBT_ERROR, &cbt->flags))
+		return -EIO;
+
+	/* Backup in progress won't survive reboot, keep its bits */
+	if (cbt->snp_map)
+		__cbt_snap_merge(cbt);
+	set_bit(CBT_NOCACHE, &cbt->flags);
+	cbt_flush_cache(cbt);
+
+	hdr.block_max = cbt->block_max;
+	hdr.block_bits = cbt->block_bits;
+	hdr.nr_pages = 0;
+	for (idx = 0; idx < nr_pages; idx++)
+		if (cbt->map[idx])
+			hdr.nr_pages++;
+
+	cbt_pram_name(cbt, name);
+	err = pram_open(name, PRAM_WRITE, &stream);
+	if (err)
+		return err;
+
+	err = -EIO;
+	if (pram_write(&stream, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out_close_stream;
+
+	for (idx = 0; idx < nr_pages; idx++) {
+		__u32 i = idx;
+
+		if (!cbt->map[idx])
+			continue;
+		if (pram_write(&stream, &i, sizeof(i)) != sizeof(i))
+			goto out_close_stream;
+		if (pram_push_page(&stream, cbt->map[idx], NULL))
+			goto out_close_stream;
+	}
+	err = 0;
+
+out_close_stream:
+	pram_close(&stream, err);
+	return err;
+}
+
+static void cbt_pram_load(struct cbt_info *cbt)
+{
+	struct pram_stream stream;
+	struct cbt_pram_hdr hdr;
+	char name[CBT_PRAM_NAME_LEN];
+	struct page *page;
+	__u32 i, idx;
+	int err;
+
+	cbt_pram_name(cbt, name);
+	err = pram_open(name, PRAM_READ, &stream);
+	if (err)
+		return;
+
+	err = -EIO;
+	if (pram_read(&stream, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out_close_stream;
+
+	/* Device may have grown, but granularity must be the same */
+	err = -EINVAL;
+	if (hdr.block_bits != cbt->block_bits ||
+	    hdr.block_max > cbt->block_max)
+		goto out_close_stream;
+
+	err = -EIO;
+	for (i = 0; i < hdr.nr_pages; i++) {
+		if (pram_read(&stream, &idx, sizeof(idx)) != sizeof(idx))
+			goto out_close_stream;
+		page = pram_pop_page(&stream);
+		if (IS_ERR_OR_NULL(page))
+			goto out_close_stream;
+		page->mapping = NULL;
+		if (idx >= NR_PAGES(hdr.block_max) || cbt->map[idx]) {
+			put_page(page);
+			goto out_close_stream;
+		}
+		set_page_private(page, 0);
+		cbt->map[idx] = page;
+		set_bit(idx, cbt->summary);
+	}
+	err = 0;
+
+out_close_stream:
+	pram_close(&stream, 0);
+	if (err) {
+		/* Partial map is worse than none: force full backup */
+		printk(KERN_ERR "CBT: Failed to load %s: %d\n", name, err);
+		set_bit(CBT_ERROR, &cbt->flags);
+	}
+}
+
+static int cbt_reboot_notify(struct notifier_block *nb, unsigned long code,
+			     void *unused)
+{
+	struct cbt_info *cbt;
+	int err;
+
+	if (code != SYS_RESTART)
+		return NOTIFY_DONE;
+
+	mutex_lock(&cbt_mutex);
+	list_for_each_entry(cbt, &cbt_list, list) {
+		err = cbt_pram_save(cbt);
+		if (err && err != -ENODEV)
+			printk(KERN_ERR "CBT: Failed to save %pU: %d\n",
+			       cbt->uuid, err);
+	}
+	mutex_unlock(&cbt_mutex);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block cbt_reboot_nb = {
+	.notifier_call = cbt_reboot_notify,
+};
+
+static int __init blk_cbt_init(void)
+{
+	return register_reboot_notifier(&cbt_reboot_nb);
+}
+late_initcall(blk_cbt_init);
+#endif /* CONFIG_PRAM */
+
 int blk_cbt_ioctl(struct block_device *bdev, unsigned cmd, char __user *arg)
 {
 	struct blk_user_cbt_info __user *ucbt_ioc = (struct blk_user_cbt_info __user *) arg;
@@ -598,6 +1028,21 @@ int blk_cbt_ioctl(struct block_device *bdev, unsigned cmd, char __user *arg)
 			return -EACCES;
 
 		return cbt_ioc_set(bdev, ucbt_ioc, 0);
+	case BLKCBTSNAPCREATE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EACCES;
+
+		return cbt_ioc_snap_create(bdev);
+	case BLKCBTSNAPDROP:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EACCES;
+
+		return cbt_ioc_snap_drop(bdev);
+	case BLKCBTSNAPMERGE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EACCES;
+
+		return cbt_ioc_snap_merge(bdev);
 	default:
 		BUG();
 	}
@@ -17,6 +17,7 @@
 #include <linux/err.h>
 #include <linux/blkdev.h>
 #include "blk-cgroup.h"
+#include <bc/beancounter.h>
 #include <linux/genhd.h>
 
 #define MAX_KEY_LEN 100
@@ -424,6 +425,10 @@ void blkiocg_update_completion_stats(struct blkio_group *blkg,
 				io_start_time - start_time, direction, sync);
 	}
 	spin_unlock_irqrestore(&blkg->stats_lock, flags);
+#ifdef CONFIG_BC_IO_PRIORITY
+	if (blkg->blk_ub && time_after64(now, start_time))
+		ub_io_lat_account(blkg->blk_ub, direction, now - start_time);
+#endif
 }
 EXPORT_SYMBOL_GPL(blkiocg_update_completion_stats);
 
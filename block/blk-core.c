@@ -1836,6 +1836,7 @@ void submit_bio(int rw, struct bio *bio)
 			task_io_account_read(bio->bi_size);
 			count_vm_events(PGPGIN, count);
 		}
+		ub_io_account_bio(bio);
 
 		if (unlikely(block_dump)) {
 			char b[BDEVNAME_SIZE];
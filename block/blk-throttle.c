@@ -21,6 +21,35 @@ static int throtl_quantum = 32;
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
+/*
+ * Hierarchical mode: IO of a group is also charged to and limited by the
+ * groups of all its ancestor cgroups (except the root), so a parent's limit
+ * caps the sum of its children, and the parent's capacity not used by some
+ * child is available to its siblings.
+ */
+static bool throtl_hierarchy;
+module_param_named(hierarchy, throtl_hierarchy, bool, 0644);
+MODULE_PARM_DESC(hierarchy, "Limit IO of a cgroup by limits of its ancestors");
+
+/*
+ * Weighted mode: while a request queue is busy, the groups without rate
+ * limits share it in proportion to blkio.weight (what beancounter io
+ * priorities set), whatever the elevator is. This is start-time fair
+ * queueing: a group's virtual time advances by the cost of each bio it
+ * dispatches divided by its weight. A group ahead of the queue virtual
+ * time by more than a lag has its bios held, and the held bios go in
+ * the order of their groups' virtual time once the queue has room.
+ * Nothing is idled on.
+ */
+static bool throtl_weight;
+module_param_named(weight, throtl_weight, bool, 0644);
+MODULE_PARM_DESC(weight, "Share a busy queue between cgroups by blkio.weight");
+
+/* Per bio overhead in sectors, so that small random IO is not free */
+#define THROTL_W_IO_COST	8
+/* How far a group may run ahead of the queue, 1MB at default weight */
+#define THROTL_W_LAG		2048
+
 /* A workqueue to queue throttle related work */
 static struct workqueue_struct *kthrotld_workqueue;
 static void throtl_schedule_delayed_work(struct throtl_data *td,
@@ -80,6 +109,16 @@ struct throtl_grp {
 	/* Some throttle limits got updated for the group */
 	int limits_changed;
 
+	/* Group of the parent cgroup in hierarchical mode, holds a reference */
+	struct throtl_grp *parent;
+
+	/* Weighted mode: bios held for their turn, on td->w_list if any */
+	struct bio_list w_bios;
+	unsigned int nr_w_queued;
+	struct list_head w_node;
+	unsigned int weight;
+	u64 vtime;
+
 	struct rcu_head rcu_head;
 };
 
@@ -106,10 +145,16 @@ struct throtl_data
 	struct delayed_work throtl_work;
 
 	int limits_changed;
+
+	/* Weighted mode: queue virtual time and groups holding bios */
+	u64 vtime;
+	struct list_head w_list;
+	unsigned int nr_w_queued;
 };
 
 enum tg_state_flags {
 	THROTL_TG_FLAG_on_rr = 0,	/* on round-robin busy list */
+	THROTL_TG_FLAG_linked,		/* parent is looked up */
 };
 
 #define THROTL_TG_FNS(name)						\
@@ -127,6 +172,7 @@ static inline int throtl_tg_##name(const struct throtl_grp *tg)		\
 }
 
 THROTL_TG_FNS(on_rr);
+THROTL_TG_FNS(linked);
 
 #define throtl_log_tg(td, tg, fmt, args...)				\
 	blk_add_trace_msg((td)->queue, "throtl %s " fmt,		\
@@ -143,6 +189,16 @@ static inline struct throtl_grp *tg_of_blkg(struct blkio_group *blkg)
 	return NULL;
 }
 
+static inline struct throtl_grp *tg_parent(struct throtl_grp *tg)
+{
+	return throtl_hierarchy ? tg->parent : NULL;
+}
+
+static inline struct blkio_cgroup *blkcg_parent(struct blkio_cgroup *blkcg)
+{
+	return cgroup_to_blkio_cgroup(blkcg->css.cgroup->parent);
+}
+
 static inline int total_nr_queued(struct throtl_data *td)
 {
 	return (td->nr_queued[0] + td->nr_queued[1]);
@@ -154,11 +210,15 @@ static inline struct throtl_grp *throtl_ref_get_tg(struct throtl_grp *tg)
 	return tg;
 }
 
+static void throtl_put_tg(struct throtl_grp *tg);
+
 static void throtl_free_tg(struct rcu_head *head)
 {
 	struct throtl_grp *tg;
 
 	tg = container_of(head, struct throtl_grp, rcu_head);
+	if (tg->parent)
+		throtl_put_tg(tg->parent);
 	blkio_free_blkg_stats(&tg->blkg);
 	kfree(tg);
 }
@@ -187,6 +247,9 @@ static void throtl_init_group(struct throtl_grp *tg)
 	RB_CLEAR_NODE(&tg->rb_node);
 	bio_list_init(&tg->bio_lists[0]);
 	bio_list_init(&tg->bio_lists[1]);
+	bio_list_init(&tg->w_bios);
+	INIT_LIST_HEAD(&tg->w_node);
+	tg->weight = BLKIO_WEIGHT_DEFAULT;
 	tg->limits_changed = false;
 
 	/* Practically unlimited BW */
@@ -303,10 +366,55 @@ throtl_grp *throtl_find_tg(struct throtl_data *td, struct blkio_cgroup *blkcg)
 	return tg;
 }
 
+/*
+ * Returns the cgroup which needs a group allocated on this queue before IO
+ * of @blkcg can be throttled: @blkcg itself or, in hierarchical mode, the
+ * topmost of its ancestors without a group. Returns NULL if all are there.
+ */
+static struct blkio_cgroup *
+throtl_missing_blkcg(struct throtl_data *td, struct blkio_cgroup *blkcg)
+{
+	struct blkio_cgroup *missing = NULL;
+
+	if (!throtl_find_tg(td, blkcg))
+		missing = blkcg;
+
+	if (!throtl_hierarchy)
+		return missing;
+
+	for (; blkcg != &blkio_root_cgroup; blkcg = blkcg_parent(blkcg))
+		if (!throtl_find_tg(td, blkcg))
+			missing = blkcg;
+
+	return missing;
+}
+
+/* Call with queue lock and rcu read lock held */
+static void throtl_link_tg(struct throtl_data *td, struct throtl_grp *tg,
+			struct blkio_cgroup *blkcg)
+{
+	struct throtl_grp *parent;
+
+	if (!throtl_hierarchy || throtl_tg_linked(tg))
+		return;
+
+	if (tg != td->root_tg && blkcg != &blkio_root_cgroup &&
+	    blkcg_parent(blkcg) != &blkio_root_cgroup) {
+		parent = throtl_find_tg(td, blkcg_parent(blkcg));
+		if (!parent)
+			return;
+		tg->parent = throtl_ref_get_tg(parent);
+	}
+
+	/* Lockless readers check the flag before following tg->parent */
+	smp_wmb();
+	throtl_mark_tg_linked(tg);
+}
+
 static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
 {
-	struct throtl_grp *tg = NULL, *__tg = NULL;
-	struct blkio_cgroup *blkcg;
+	struct throtl_grp *tg = NULL;
+	struct blkio_cgroup *blkcg, *missing;
 	struct request_queue *q = td->queue;
 
 	/* no throttling for dead queue */
@@ -314,9 +422,11 @@ static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
 		return NULL;
 
 	rcu_read_lock();
+again:
 	blkcg = task_blkio_cgroup(current);
-	tg = throtl_find_tg(td, blkcg);
-	if (tg) {
+	if (!throtl_missing_blkcg(td, blkcg)) {
+		tg = throtl_find_tg(td, blkcg);
+		throtl_link_tg(td, tg, blkcg);
 		rcu_read_unlock();
 		return tg;
 	}
@@ -350,23 +460,24 @@ static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
 	 * If some other thread already allocated the group while we were
 	 * not holding queue lock, free up the group
 	 */
-	__tg = throtl_find_tg(td, blkcg);
+	missing = throtl_missing_blkcg(td, blkcg);
 
-	if (__tg) {
-		throtl_free_tg(&tg->rcu_head);
-		rcu_read_unlock();
-		return __tg;
+	if (!missing) {
+		if (tg)
+			throtl_free_tg(&tg->rcu_head);
+		goto again;
 	}
 
 	/* Group allocation failed. Account the IO to root group */
 	if (!tg) {
+		rcu_read_unlock();
 		tg = td->root_tg;
 		return tg;
 	}
 
-	throtl_init_add_tg_lists(td, tg, blkcg);
-	rcu_read_unlock();
-	return tg;
+	/* In hierarchical mode ancestors are added first, then retry */
+	throtl_init_add_tg_lists(td, tg, missing);
+	goto again;
 }
 
 static struct throtl_grp *throtl_rb_first(struct throtl_rb_root *root)
@@ -467,21 +578,28 @@ static void throtl_dequeue_tg(struct throtl_data *td, struct throtl_grp *tg)
 static void throtl_schedule_next_dispatch(struct throtl_data *td)
 {
 	struct throtl_rb_root *st = &td->tg_service_tree;
+	unsigned long delay = 1;
 
 	/*
-	 * If there are more bios pending, schedule more work.
+	 * If there are more bios pending, schedule more work. The bios
+	 * held in weighted mode are looked at every jiffy.
 	 */
-	if (!total_nr_queued(td))
+	if (!total_nr_queued(td)) {
+		if (td->nr_w_queued)
+			throtl_schedule_delayed_work(td, 1);
 		return;
+	}
 
 	BUG_ON(!st->count);
 
 	update_min_dispatch_time(st);
 
 	if (time_before_eq(st->min_disptime, jiffies))
-		throtl_schedule_delayed_work(td, 0);
-	else
-		throtl_schedule_delayed_work(td, (st->min_disptime - jiffies));
+		delay = 0;
+	else if (!td->nr_w_queued)
+		delay = st->min_disptime - jiffies;
+
+	throtl_schedule_delayed_work(td, delay);
 }
 
 static inline void
@@ -674,29 +792,25 @@ static bool tg_with_in_bps_limit(struct throtl_data *td, struct throtl_grp *tg,
 }
 
 static bool tg_no_rule_group(struct throtl_grp *tg, bool rw) {
-	if (tg->bps[rw] == -1 && tg->iops[rw] == -1)
-		return 1;
-	return 0;
+	if (throtl_hierarchy) {
+		/* Let the slow path look up the parent first */
+		if (!throtl_tg_linked(tg))
+			return 0;
+		smp_rmb();
+	}
+
+	for (; tg; tg = tg_parent(tg))
+		if (tg->bps[rw] != -1 || tg->iops[rw] != -1)
+			return 0;
+	return 1;
 }
 
-/*
- * Returns whether one can dispatch a bio or not. Also returns approx number
- * of jiffies to wait before this bio is with-in IO rate and can be dispatched
- */
-static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
+static bool __tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
 				struct bio *bio, unsigned long *wait)
 {
 	bool rw = bio_data_dir(bio);
 	unsigned long bps_wait = 0, iops_wait = 0, max_wait = 0;
 
-	/*
- 	 * Currently whole state machine of group depends on first bio
-	 * queued in the group bio list. So one should not be calling
-	 * this function with a different bio if there are other bios
-	 * queued.
-	 */
-	BUG_ON(tg->nr_queued[rw] && bio != bio_list_peek(&tg->bio_lists[rw]));
-
 	/* If tg->bps = -1, then BW is unlimited */
 	if (tg->bps[rw] == -1 && tg->iops[rw] == -1) {
 		if (wait)
@@ -734,16 +848,57 @@ static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
 	return 0;
 }
 
-static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
+/*
+ * Returns whether one can dispatch a bio or not. Also returns approx number
+ * of jiffies to wait before this bio is with-in IO rate and can be dispatched
+ */
+static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
+				struct bio *bio, unsigned long *wait)
+{
+	bool rw = bio_data_dir(bio);
+	unsigned long tg_wait, max_wait = 0;
+	bool ret = 1;
+
+	/*
+ 	 * Currently whole state machine of group depends on first bio
+	 * queued in the group bio list. So one should not be calling
+	 * this function with a different bio if there are other bios
+	 * queued.
+	 */
+	BUG_ON(tg->nr_queued[rw] && bio != bio_list_peek(&tg->bio_lists[rw]));
+
+	/* In hierarchical mode every ancestor must have room for the bio */
+	for (; tg; tg = tg_parent(tg)) {
+		if (!__tg_may_dispatch(td, tg, bio, &tg_wait)) {
+			max_wait = max(max_wait, tg_wait);
+			ret = 0;
+		}
+	}
+
+	if (wait)
+		*wait = max_wait;
+	return ret;
+}
+
+static void throtl_charge_bio(struct throtl_data *td, struct throtl_grp *tg,
+				struct bio *bio)
 {
 	bool rw = bio_data_dir(bio);
 	bool sync = bio->bi_rw & REQ_SYNC;
+	struct throtl_grp *parent;
 
 	/* Charge the bio to the group */
 	tg->bytes_disp[rw] += bio->bi_size;
 	tg->io_disp[rw]++;
 
 	blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size, rw, sync);
+
+	/* and to its ancestors, the group itself is trimmed by the caller */
+	for (parent = tg_parent(tg); parent; parent = tg_parent(parent)) {
+		parent->bytes_disp[rw] += bio->bi_size;
+		parent->io_disp[rw]++;
+		throtl_trim_slice(td, parent, rw);
+	}
 }
 
 static void throtl_add_bio_tg(struct throtl_data *td, struct throtl_grp *tg,
@@ -792,7 +947,7 @@ static void tg_dispatch_one_bio(struct throtl_data *td, struct throtl_grp *tg,
 	BUG_ON(td->nr_queued[rw] <= 0);
 	td->nr_queued[rw]--;
 
-	throtl_charge_bio(tg, bio);
+	throtl_charge_bio(td, tg, bio);
 	bio_list_add(bl, bio);
 	bio->bi_rw |= (1 << BIO_RW_THROTTLED);
 
@@ -863,6 +1018,116 @@ static int throtl_select_dispatch(struct throtl_data *td, struct bio_list *bl)
 	return nr_disp;
 }
 
+static inline bool throtl_w_queue(struct request_queue *q)
+{
+	/* bio based drivers have no idea of being busy, nor an elevator */
+	return throtl_weight && q->request_fn;
+}
+
+/* The queue is busy with half of its requests allocated */
+static inline int throtl_w_room(struct request_queue *q)
+{
+	struct request_list *rl = &q->rq;
+
+	return q->nr_requests / 2 -
+		(rl->count[BLK_RW_SYNC] + rl->count[BLK_RW_ASYNC]);
+}
+
+static inline u64 throtl_w_cost(struct bio *bio, unsigned int weight)
+{
+	return div_u64((u64)(bio_sectors(bio) + THROTL_W_IO_COST) *
+		       BLKIO_WEIGHT_DEFAULT, weight);
+}
+
+/* Virtual time the next bio of @tg starts at */
+static inline u64 tg_w_start(struct throtl_data *td, struct throtl_grp *tg)
+{
+	return max(tg->vtime, td->vtime);
+}
+
+static void tg_w_dispatch_one_bio(struct throtl_data *td,
+			struct throtl_grp *tg, struct bio_list *bl)
+{
+	struct bio *bio;
+
+	bio = bio_list_pop(&tg->w_bios);
+	tg->vtime = tg_w_start(td, tg) + throtl_w_cost(bio, tg->weight);
+	if (!--tg->nr_w_queued)
+		list_del_init(&tg->w_node);
+	td->nr_w_queued--;
+
+	blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size,
+			bio_data_dir(bio), bio->bi_rw & REQ_SYNC);
+	bio_list_add(bl, bio);
+	bio->bi_rw |= (1 << BIO_RW_THROTTLED);
+
+	/* Drop bio reference on tg */
+	throtl_put_tg(tg);
+}
+
+/*
+ * Release the held bios, the group the least ahead first, as long as the
+ * queue has room. One bio goes anyway, so that a queue kept busy by the
+ * rate limited groups does not starve the rest.
+ */
+static int throtl_w_dispatch(struct throtl_data *td, struct bio_list *bl)
+{
+	struct throtl_grp *tg, *min_tg;
+	int nr_disp = 0, room;
+
+	room = min(throtl_w_room(td->queue), throtl_quantum);
+	do {
+		min_tg = NULL;
+		list_for_each_entry(tg, &td->w_list, w_node)
+			if (!min_tg || tg->vtime < min_tg->vtime)
+				min_tg = tg;
+
+		td->vtime = tg_w_start(td, min_tg);
+		tg_w_dispatch_one_bio(td, min_tg, bl);
+		nr_disp++;
+	} while (td->nr_w_queued && nr_disp < room);
+
+	return nr_disp;
+}
+
+/*
+ * Weighted mode part of blk_throtl_bio(), returns true if the bio is held.
+ * Called with the queue lock held.
+ */
+static bool throtl_w_bio(struct throtl_data *td, struct throtl_grp *tg,
+			struct bio *bio, unsigned int weight)
+{
+	bool busy = throtl_w_room(td->queue) <= 0;
+	u64 start;
+
+	tg->weight = weight;
+	if (tg->nr_w_queued)
+		goto hold;
+
+	start = tg_w_start(td, tg);
+	if (busy && start > td->vtime + THROTL_W_LAG)
+		goto hold;
+
+	tg->vtime = start + throtl_w_cost(bio, weight);
+	/* an idle queue follows the groups, keeping them within the lag */
+	if (!busy && tg->vtime > td->vtime + THROTL_W_LAG)
+		td->vtime = tg->vtime - THROTL_W_LAG;
+
+	blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size,
+			bio_data_dir(bio), bio->bi_rw & REQ_SYNC);
+	return false;
+
+hold:
+	bio_list_add(&tg->w_bios, bio);
+	/* Take a bio reference on tg */
+	throtl_ref_get_tg(tg);
+	if (!tg->nr_w_queued++)
+		list_add_tail(&tg->w_node, &td->w_list);
+	if (!td->nr_w_queued++)
+		throtl_schedule_delayed_work(td, busy ? 1 : 0);
+	return true;
+}
+
 static void throtl_process_limit_change(struct throtl_data *td)
 {
 	struct throtl_grp *tg;
@@ -913,22 +1178,23 @@ static int throtl_dispatch(struct request_queue *q)
 
 	throtl_process_limit_change(td);
 
-	if (!total_nr_queued(td))
-		goto out;
-
 	bio_list_init(&bio_list_on_stack);
 
-	throtl_log(td, "dispatch nr_queued=%lu read=%u write=%u",
-			total_nr_queued(td), td->nr_queued[READ],
-			td->nr_queued[WRITE]);
+	if (td->nr_w_queued)
+		nr_disp = throtl_w_dispatch(td, &bio_list_on_stack);
 
-	nr_disp = throtl_select_dispatch(td, &bio_list_on_stack);
+	if (total_nr_queued(td)) {
+		throtl_log(td, "dispatch nr_queued=%lu read=%u write=%u",
+				total_nr_queued(td), td->nr_queued[READ],
+				td->nr_queued[WRITE]);
+
+		nr_disp += throtl_select_dispatch(td, &bio_list_on_stack);
+	}
 
 	if (nr_disp)
 		throtl_log(td, "bios disp=%u", nr_disp);
 
 	throtl_schedule_next_dispatch(td);
-out:
 	spin_unlock_irq(q->queue_lock);
 
 	/*
@@ -960,7 +1226,7 @@ throtl_schedule_delayed_work(struct throtl_data *td, unsigned long delay)
 	struct delayed_work *dwork = &td->throtl_work;
 
 	/* schedule work if limits changed even if no bio is queued */
-	if (total_nr_queued(td) > 0 || td->limits_changed) {
+	if (total_nr_queued(td) > 0 || td->nr_w_queued || td->limits_changed) {
 		/*
 		 * We might have a work scheduled to be executed in future.
 		 * Cancel that and schedule a new one.
@@ -1135,7 +1401,7 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 	if (tg) {
 		throtl_tg_fill_dev_details(td, tg);
 
-		if (tg_no_rule_group(tg, rw)) {
+		if (tg_no_rule_group(tg, rw) && !throtl_w_queue(q)) {
 			blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size,
 					rw, bio->bi_rw & REQ_SYNC);
 			rcu_read_unlock();
@@ -1153,6 +1419,17 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 	if (unlikely(!tg))
 		goto out_unlock;
 
+	if (throtl_w_queue(q) && tg_no_rule_group(tg, rw)) {
+		unsigned int weight;
+
+		rcu_read_lock();
+		weight = task_blkio_cgroup(current)->weight;
+		rcu_read_unlock();
+
+		throttled = throtl_w_bio(td, tg, bio, weight);
+		goto out_unlock;
+	}
+
 	if (tg->nr_queued[rw]) {
 		/*
 		 * There is already another bio queued in same dir. No
@@ -1165,7 +1442,7 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 
 	/* Bio is with-in rate limit of group */
 	if (tg_may_dispatch(td, tg, bio, NULL)) {
-		throtl_charge_bio(tg, bio);
+		throtl_charge_bio(td, tg, bio);
 
 		/*
 		 * We need to trim slice even when bios are not being queued
@@ -1231,6 +1508,11 @@ void blk_throtl_drain(struct request_queue *q)
 		while ((bio = bio_list_peek(&tg->bio_lists[WRITE])))
 			tg_dispatch_one_bio(td, tg, bio_data_dir(bio), &bl);
 	}
+
+	while (td->nr_w_queued) {
+		tg = list_first_entry(&td->w_list, struct throtl_grp, w_node);
+		tg_w_dispatch_one_bio(td, tg, &bl);
+	}
 	spin_unlock_irq(q->queue_lock);
 
 	while ((bio = bio_list_pop(&bl)))
@@ -1250,6 +1532,7 @@ int blk_throtl_init(struct request_queue *q)
 
 	INIT_HLIST_HEAD(&td->tg_list);
 	td->tg_service_tree = THROTL_RB_ROOT;
+	INIT_LIST_HEAD(&td->w_list);
 	td->limits_changed = false;
 	INIT_DELAYED_WORK(&td->throtl_work, blk_throtl_work);
 
@@ -214,6 +214,12 @@ struct cfq_group {
 #endif
 	/* number of requests that are on the dispatch list or inside driver */
 	int dispatched;
+
+	/* think time of the group, for group_idle_auto, in ns */
+	u64 last_end_request;
+	unsigned long ttime_samples;
+	u64 ttime_total;
+	u64 ttime_mean;
 };
 
 /*
@@ -287,6 +293,7 @@ struct cfq_data {
 	unsigned int cfq_slice_async_rq;
 	unsigned int cfq_slice_idle;
 	unsigned int cfq_group_idle;
+	unsigned int cfq_group_idle_auto;
 	unsigned int cfq_latency;
 	unsigned int cfq_group_isolation;
 
@@ -332,6 +339,15 @@ struct cfq_data {
 	 */
 	int cfq_fast_slow_expiration_rate;
 
+	/*
+	 * Service time of sync requests from sequential [0] and seeky [1]
+	 * queues, in ns. Their difference is the seek penalty which
+	 * group_idle_auto compares with think time of the group.
+	 */
+	unsigned long svc_samples[2];
+	u64 svc_total[2];
+	u64 svc_mean[2];
+
 	/*
 	 * Sum of vectors:
 	 * <cfqg->service_trees[0][0].count, ..., cfqg->service_tree_idle.count>
@@ -480,6 +496,50 @@ CFQ_CFQQ_FNS(wait_busy);
 			&cfqg->service_trees[i][j]: NULL) \
 
 
+static inline void cfq_update_mean(unsigned long *samples, u64 *total,
+				   u64 *mean, u64 val)
+{
+	*samples = (7 * *samples + 256) / 8;
+	*total = div_u64(7 * *total + 256 * val, 8);
+	*mean = div64_u64(*total + 128, *samples);
+}
+
+/*
+ * group_idle_auto: seeks cost almost nothing compared to service time,
+ * idling only wastes parallelism of the device.
+ */
+static inline bool cfq_disk_seek_free(struct cfq_data *cfqd)
+{
+	if (!cfqd->cfq_group_idle_auto ||
+	    !sample_valid(cfqd->svc_samples[0]) ||
+	    !sample_valid(cfqd->svc_samples[1]))
+		return false;
+
+	return cfqd->svc_mean[1] < cfqd->svc_mean[0] + cfqd->svc_mean[0] / 4;
+}
+
+/*
+ * group_idle_auto: idle on the group only if it usually comes back with
+ * next request sooner than a seek to another group's data would take.
+ * Without enough samples behave as if auto mode is off.
+ */
+static bool cfq_group_idle_worth(struct cfq_data *cfqd,
+				 struct cfq_group *cfqg)
+{
+	if (!cfqd->cfq_group_idle_auto ||
+	    !sample_valid(cfqd->svc_samples[0]) ||
+	    !sample_valid(cfqd->svc_samples[1]))
+		return true;
+
+	if (cfq_disk_seek_free(cfqd))
+		return false;
+
+	if (!sample_valid(cfqg->ttime_samples))
+		return true;
+
+	return cfqg->ttime_mean < cfqd->svc_mean[1] - cfqd->svc_mean[0];
+}
+
 static inline bool iops_mode(struct cfq_data *cfqd)
 {
 	/*
@@ -491,6 +551,8 @@ static inline bool iops_mode(struct cfq_data *cfqd)
 	 */
 	if (!cfqd->cfq_slice_idle && cfqd->hw_tag)
 		return true;
+	else if (cfq_disk_seek_free(cfqd) && cfqd->hw_tag)
+		return true;
 	else
 		return false;
 }
@@ -2110,6 +2172,9 @@ static bool cfq_should_idle(struct cfq_data *cfqd, struct cfq_queue *cfqq)
 	if (cfqd->cfq_slice_idle == 0)
 		return false;
 
+	if (!cfq_group_idle_worth(cfqd, cfqq->cfqg))
+		return false;
+
 	/* We do for queues that were marked with idle window flag. */
 	if (cfq_cfqq_idle_window(cfqq) &&
 	   !(blk_queue_nonrot(cfqd->queue) && cfqd->hw_tag))
@@ -2145,7 +2210,12 @@ static void cfq_arm_slice_timer(struct cfq_data *cfqd)
 	 * for devices that support queuing, otherwise we still have a problem
 	 * with sync vs async workloads.
 	 */
-	if (blk_queue_nonrot(cfqd->queue) && cfqd->hw_tag)
+	if (!cfqd->cfq_group_idle_auto &&
+	    blk_queue_nonrot(cfqd->queue) && cfqd->hw_tag)
+		return;
+
+	/* auto mode decides by measured seek penalty instead */
+	if (!cfq_group_idle_worth(cfqd, cfqq->cfqg))
 		return;
 
 	WARN_ON(!RB_EMPTY_ROOT(&cfqq->sort_list));
@@ -2569,7 +2639,8 @@ static struct cfq_queue *cfq_select_queue(struct cfq_data *cfqd)
 	 */
 check_group_idle:
 	if (cfqd->cfq_group_idle && cfqq->cfqg->nr_cfqq == 1
-	    && cfqq->cfqg->dispatched && !CFQD_DISK_LOOKS_FAST(cfqd)) {
+	    && cfqq->cfqg->dispatched && !CFQD_DISK_LOOKS_FAST(cfqd)
+	    && cfq_group_idle_worth(cfqd, cfqq->cfqg)) {
 		cfqq = NULL;
 		goto keep_queue;
 	}
@@ -3609,6 +3680,28 @@ cfq_rq_enqueued(struct cfq_data *cfqd, struct cfq_queue *cfqq,
 	}
 }
 
+/*
+ * Time from the last completion of an idle group to its next request,
+ * i.e. what group idling would have to wait for.
+ */
+static void cfq_update_group_thinktime(struct cfq_data *cfqd,
+				       struct cfq_group *cfqg)
+{
+	u64 now, ttime, max;
+
+	if (!cfqg->last_end_request || cfqg->nr_cfqq || cfqg->dispatched)
+		return;
+
+	now = sched_clock();
+	max = 2ULL * jiffies_to_usecs(cfqd->cfq_group_idle ? :
+				      cfqd->cfq_slice_idle) * NSEC_PER_USEC;
+	ttime = now > cfqg->last_end_request ?
+		now - cfqg->last_end_request : 0;
+	cfq_update_mean(&cfqg->ttime_samples, &cfqg->ttime_total,
+			&cfqg->ttime_mean, min(ttime, max));
+	cfqg->last_end_request = 0;
+}
+
 static void cfq_insert_request(struct request_queue *q, struct request *rq)
 {
 	struct cfq_data *cfqd = q->elevator->elevator_data;
@@ -3617,6 +3710,9 @@ static void cfq_insert_request(struct request_queue *q, struct request *rq)
 	cfq_log_cfqq(cfqd, cfqq, "insert_request");
 	cfq_init_prio_data(cfqq, RQ_CIC(rq)->ioc);
 
+	if (cfqd->cfq_group_idle_auto && rq_is_sync(rq))
+		cfq_update_group_thinktime(cfqd, cfqq->cfqg);
+
 	rq_set_fifo_time(rq, jiffies + cfqd->cfq_fifo_expire[rq_is_sync(rq)]);
 	list_add_tail(&rq->queuelist, &cfqq->fifo);
 	cfq_add_rq_rb(rq);
@@ -3761,6 +3857,18 @@ static void cfq_completed_request(struct request_queue *q, struct request *rq)
 
 	cfqd->rq_in_flight[cfq_cfqq_sync(cfqq)]--;
 
+	if (sync && cfqd->cfq_group_idle_auto) {
+		u64 now_ns = sched_clock();
+		u64 start = rq_io_start_time_ns(rq);
+		int seeky = CFQQ_SEEKY(cfqq) ? 1 : 0;
+
+		if (start && now_ns > start)
+			cfq_update_mean(&cfqd->svc_samples[seeky],
+					&cfqd->svc_total[seeky],
+					&cfqd->svc_mean[seeky], now_ns - start);
+		cfqq->cfqg->last_end_request = now_ns;
+	}
+
 	if (sync) {
 		RQ_CIC(rq)->last_end_request = now;
 		if (!time_after(rq->start_time + cfqd->cfq_fifo_expire[1], now))
@@ -4344,6 +4452,7 @@ SHOW_FUNCTION(cfq_back_seek_max_show, cfqd->cfq_back_max, 0);
 SHOW_FUNCTION(cfq_back_seek_penalty_show, cfqd->cfq_back_penalty, 0);
 SHOW_FUNCTION(cfq_slice_idle_show, cfqd->cfq_slice_idle, 1);
 SHOW_FUNCTION(cfq_group_idle_show, cfqd->cfq_group_idle, 1);
+SHOW_FUNCTION(cfq_group_idle_auto_show, cfqd->cfq_group_idle_auto, 0);
 SHOW_FUNCTION(cfq_slice_sync_show, cfqd->cfq_slice[1], 1);
 SHOW_FUNCTION(cfq_slice_async_show, cfqd->cfq_slice[0], 1);
 SHOW_FUNCTION(cfq_slice_async_rq_show, cfqd->cfq_slice_async_rq, 0);
@@ -4392,6 +4501,7 @@ STORE_FUNCTION(cfq_back_seek_penalty_store, &cfqd->cfq_back_penalty, 1,
 		UINT_MAX, 0);
 STORE_FUNCTION(cfq_slice_idle_store, &cfqd->cfq_slice_idle, 0, UINT_MAX, 1);
 STORE_FUNCTION(cfq_group_idle_store, &cfqd->cfq_group_idle, 0, UINT_MAX, 1);
+STORE_FUNCTION(cfq_group_idle_auto_store, &cfqd->cfq_group_idle_auto, 0, 1, 0);
 STORE_FUNCTION(cfq_slice_sync_store, &cfqd->cfq_slice[1], 1, UINT_MAX, 1);
 STORE_FUNCTION(cfq_slice_async_store, &cfqd->cfq_slice[0], 1, UINT_MAX, 1);
 STORE_FUNCTION(cfq_slice_async_rq_store, &cfqd->cfq_slice_async_rq, 1,
@@ -4421,6 +4531,7 @@ static struct elv_fs_entry cfq_attrs[] = {
 	CFQ_ATTR(slice_async_rq),
 	CFQ_ATTR(slice_idle),
 	CFQ_ATTR(group_idle),
+	CFQ_ATTR(group_idle_auto),
 	CFQ_ATTR(low_latency),
 	CFQ_ATTR(group_isolation),
 	CFQ_ATTR(enable_idle_for_deep),
@@ -402,6 +402,9 @@ int blkdev_ioctl(struct block_device *bdev, fmode_t mode, unsigned cmd,
 	case BLKCBTGET:
 	case BLKCBTSET:
 	case BLKCBTCLR:
+	case BLKCBTSNAPCREATE:
+	case BLKCBTSNAPDROP:
+	case BLKCBTSNAPMERGE:
 		lock_kernel();
 		ret = blk_cbt_ioctl(bdev, cmd, (char __user *)arg);
 		unlock_kernel();
@@ -10,6 +10,7 @@
 #include <linux/statfs.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/vmalloc.h>
 #include <asm/uaccess.h>
 
 #include <trace/events/block.h>
@@ -18,6 +19,8 @@
 #include "ploop_events.h"
 #include "freeblks.h"
 #include "discard.h"
+#include "push_backup.h"
+#include "io_cache.h"
 
 /* Structures and terms:
  *
@@ -50,6 +53,8 @@ static long user_threshold __read_mostly = 4L * 1024 * 1024; /* 4GB in KB */
 
 static int large_disk_support __read_mostly = 1; /* true */
 
+static int complete_threads __read_mostly = 4;
+
 static struct rb_root ploop_devices_tree = RB_ROOT;
 static DEFINE_MUTEX(ploop_devices_mutex);
 
@@ -485,7 +490,6 @@ ploop_bio_queue(struct ploop_device * plo, struct bio * bio,
 	list_del_init(&preq->list);
 
 	preq->req_cluster = bio->bi_sector >> plo->cluster_log;
-	bio->bi_next = NULL;
 	preq->req_sector = bio->bi_sector;
 	preq->req_size = bio->bi_size >> 9;
 	preq->req_rw = bio->bi_rw;
@@ -494,6 +498,7 @@ ploop_bio_queue(struct ploop_device * plo, struct bio * bio,
 	preq->state = 0;
 	preq->error = 0;
 	preq->tstamp = jiffies;
+	ploop_lat_start(preq);
 	preq->iblock = 0;
 	preq->prealloc_size = 0;
 
@@ -501,6 +506,14 @@ ploop_bio_queue(struct ploop_device * plo, struct bio * bio,
 		int clu_size = 1 << plo->cluster_log;
 		int i = (clu_size - 1) & bio->bi_sector;
 		int err = 0;
+		int nr = 1;
+		struct bio *b;
+
+		/* contiguous discards merged by process_discard_bio_queue */
+		for (b = bio->bi_next; b; b = b->bi_next) {
+			preq->req_size += b->bi_size >> 9;
+			nr++;
+		}
 
 		if (i) {
 			preq->req_cluster++;
@@ -515,18 +528,28 @@ ploop_bio_queue(struct ploop_device * plo, struct bio * bio,
 				bio->bi_bdev = plo->bdev;
 				clear_bit(BIO_BDEV_REUSED, &bio->bi_flags);
 			}
-			BIO_ENDIO(plo->queue, bio, err);
+			while (bio) {
+				b = bio->bi_next;
+				bio->bi_next = NULL;
+				BIO_ENDIO(plo->queue, bio, err);
+				bio = b;
+			}
 			list_add(&preq->list, &plo->free_list);
-			plo->bio_discard_qlen--;
-			plo->bio_total--;
+			plo->bio_discard_qlen -= nr;
+			plo->bio_total -= nr;
 			return;
 		}
 
-		preq->state = (1 << PLOOP_REQ_SYNC) | (1 << PLOOP_REQ_DISCARD);
+		/* Not SYNC: fstrim is background work, let the discard
+		 * preqs wait for the mitigation timer */
+		preq->state = (1 << PLOOP_REQ_DISCARD);
+		plo->bio_discard_qlen -= nr - 1;
 		preq->dst_iblock = 0;
 		preq->bl.head = preq->bl.tail = NULL;
-	} else
+	} else {
+		bio->bi_next = NULL;
 		preq->bl.head = preq->bl.tail = bio;
+	}
 
 	if (test_bit(BIO_BDEV_REUSED, &bio->bi_flags)) {
 		    preq->ioc = (struct io_context *)(bio->bi_bdev);
@@ -583,6 +606,15 @@ static struct ploop_delta * find_delta(struct ploop_device * plo, int level)
 	return NULL;
 }
 
+/* Under plo->lock, for every write counted in active_writes */
+static inline void ploop_write_done(struct ploop_device * plo)
+{
+	if (!--plo->active_writes && plo->drain_comp) {
+		complete(plo->drain_comp);
+		plo->drain_comp = NULL;
+	}
+}
+
 DEFINE_BIO_CB(ploop_fast_end_io)
 {
 	unsigned long flags;
@@ -600,6 +632,8 @@ DEFINE_BIO_CB(ploop_fast_end_io)
 	plo->active_reqs--;
 	plo->fastpath_reqs--;
 	plo->bio_total--;
+	if (bio->bi_rw & WRITE)
+		ploop_write_done(plo);
 
 	if (plo->active_reqs == 0 &&
 	    test_bit(PLOOP_S_WAIT_PROCESS, &plo->state) &&
@@ -687,6 +721,16 @@ static inline unsigned int block_vecs(struct ploop_device * plo)
 	return 1 << (plo->cluster_log + 9 - PAGE_SHIFT);
 }
 
+/* Bio for a whole cluster. Clusters above BIO_MAX_PAGES pages do not fit
+ * in bios of fs_bio_set and get kmalloc-ed ones. */
+static struct bio * alloc_block_bio(struct ploop_device * plo)
+{
+	if (block_vecs(plo) <= BIO_MAX_PAGES)
+		return bio_alloc(GFP_NOFS, block_vecs(plo));
+
+	return bio_kmalloc(GFP_NOFS, block_vecs(plo));
+}
+
 static int whole_block(struct ploop_device * plo, struct ploop_request *preq)
 {
 	if (preq->req_size != (1<<plo->cluster_log))
@@ -712,7 +756,9 @@ preallocate_bio(struct bio * orig_bio, struct ploop_device * plo)
 	}
 
 	if (nbio == NULL)
-		nbio = bio_alloc(GFP_NOIO, max(orig_bio->bi_max_vecs, block_vecs(plo)));
+		nbio = bio_alloc(GFP_NOIO, max_t(unsigned int, orig_bio->bi_max_vecs,
+					 min_t(unsigned int, block_vecs(plo),
+					       BIO_MAX_PAGES)));
 	return nbio;
 }
 
@@ -730,6 +776,36 @@ static void process_bio_queue(struct ploop_device * plo, struct list_head *drop_
 	}
 }
 
+/* fstrim sends lots of small discards of adjacent ranges. Chain the
+ * ones following bio back to back to it: they make up one preq, which
+ * looks up the clusters of the whole range at once */
+static void ploop_discard_merge(struct ploop_device * plo, struct bio *bio)
+{
+	sector_t end = bio->bi_sector + (bio->bi_size >> 9);
+	u64 sectors = bio->bi_size >> 9;
+	struct bio *tail = bio;
+	struct bio *next;
+
+	while ((next = bio_list_peek(&plo->bio_discard_list)) != NULL &&
+	       next->bi_sector == end &&
+	       sectors + (next->bi_size >> 9) <= UINT_MAX >> 1) {
+		bio_list_pop(&plo->bio_discard_list);
+
+		/* the preq takes io_context of the first one only */
+		if (test_bit(BIO_BDEV_REUSED, &next->bi_flags)) {
+			ioc_task_unlink((struct io_context *)(next->bi_bdev));
+			next->bi_bdev = plo->bdev;
+			clear_bit(BIO_BDEV_REUSED, &next->bi_flags);
+		}
+
+		tail->bi_next = next;
+		tail = next;
+		end += next->bi_size >> 9;
+		sectors += next->bi_size >> 9;
+		plo->st.bio_discard_merges++;
+	}
+}
+
 static void process_discard_bio_queue(struct ploop_device * plo, struct list_head *drop_list)
 {
 	bool discard = test_bit(PLOOP_S_DISCARD, &plo->state);
@@ -737,14 +813,22 @@ static void process_discard_bio_queue(struct ploop_device * plo, struct list_hea
 	while (!list_empty(&plo->free_list)) {
 		struct bio *tmp;
 
-		/* Only one discard bio can be handled concurrently */
+		/* Discards join the current batch until it is full */
 		if (discard && ploop_discard_is_inprogress(plo->fbd))
 			return;
 
+		/* and a new batch waits for the entry queue to drain */
+		if (discard && !ploop_discard_batch_open(plo->fbd) &&
+		    !list_empty(&plo->entry_queue))
+			return;
+
 		tmp = bio_list_pop(&plo->bio_discard_list);
 		if (tmp == NULL)
 			break;
 
+		if (discard)
+			ploop_discard_merge(plo, tmp);
+
 		/* If PLOOP_S_DISCARD isn't set, ploop_bio_queue
 		 * will complete it with a proper error.
 		 */
@@ -846,6 +930,10 @@ static int ploop_make_request(struct request_queue *q, struct bio *bio)
 		     (bio->bi_rw & WRITE)))
 		goto queue;
 
+	/* Writes must be checked against push backup map */
+	if (unlikely(plo->pbd && (bio->bi_rw & WRITE)))
+		goto queue;
+
 	/* No fast path, when maintenance is in progress.
 	 * (PLOOP_S_TRACK was checked immediately above) */
 	if (FAST_PATH_DISABLED(plo->maintenance_type))
@@ -859,6 +947,11 @@ static int ploop_make_request(struct request_queue *q, struct bio *bio)
 	if (unlikely(plo->barrier_reqs))
 		goto queue;
 
+	/* Snapshot holds new writes, see ploop_drain_writes() */
+	if (unlikely(test_bit(PLOOP_S_SNAP_DRAIN, &plo->state)) &&
+	    (bio->bi_rw & WRITE))
+		goto queue;
+
 	if (unlikely(nbio == NULL))
 		goto queue;
 
@@ -909,6 +1002,8 @@ static int ploop_make_request(struct request_queue *q, struct bio *bio)
 		nbio->bi_end_io = ploop_fast_end_io;
 		plo->active_reqs++;
 		plo->fastpath_reqs++;
+		if (nbio->bi_rw & WRITE)
+			plo->active_writes++;
 		plo->st.bio_fast++;
 		ploop_acc_ff_out_locked(plo, nbio->bi_rw);
 
@@ -1131,6 +1226,7 @@ static int check_lockout(struct ploop_request *preq)
 			n = n->rb_right;
 		else {
 			list_add_tail(&preq->list, &p->delay_list);
+			preq->lat_phase = PLOOP_LAT_LOCKOUT;
 			plo->st.bio_lockouts++;
 			trace_preq_lockout(preq, p);
 			return 1;
@@ -1186,15 +1282,61 @@ void del_lockout(struct ploop_request *preq)
 	rb_erase(&preq->lockout_link, &plo->lockout_tree);
 }
 
+static int ploop_lat_eng_phase(struct ploop_request * preq)
+{
+	switch (preq->eng_state) {
+	case PLOOP_E_ENTRY:
+		return PLOOP_LAT_QUEUE;
+	case PLOOP_E_INDEX_READ:
+	case PLOOP_E_TRANS_INDEX_READ:
+		return PLOOP_LAT_MAP;
+	case PLOOP_E_INDEX_DELAY:
+	case PLOOP_E_INDEX_WB:
+		return PLOOP_LAT_INDEX;
+	default:
+		return PLOOP_LAT_DATA;
+	}
+}
+
+static void ploop_lat_add(struct ploop_device * plo, int phase, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int n = min(fls64(us), PLOOP_LAT_BUCKETS - 1);
+
+	plo->lat.hist[phase][n]++;
+	plo->lat.sum[phase] += us;
+}
+
+/* Called under plo->lock when a wait of preq is over. The time since the
+ * previous call goes to the phase of the wait, which is either set
+ * explicitly or told by eng_state the request has slept in. Then the
+ * next phase starts, PLOOP_LAT_AUTO unless the caller knows better.
+ */
+void ploop_lat_account(struct ploop_request * preq, int next)
+{
+	u64 now = ktime_to_ns(ktime_get());
+	int phase = preq->lat_phase;
+
+	if (phase == PLOOP_LAT_AUTO)
+		phase = ploop_lat_eng_phase(preq);
+	ploop_lat_add(preq->plo, phase, now - preq->lat_stamp);
+
+	preq->lat_phase = next;
+	preq->lat_stamp = now;
+}
+EXPORT_SYMBOL(ploop_lat_account);
+
 static void ploop_discard_wakeup(struct ploop_request *preq, int err)
 {
 	struct ploop_device *plo = preq->plo;
 
-	if (err || !ploop_fb_get_n_free(plo->fbd)) {
-		/* Only one discard request is processed */
-		ploop_fb_reinit(plo->fbd, err);
-	} else
-		set_bit(PLOOP_S_DISCARD_LOADED, &plo->state);
+	/* Free blocks are relocated once the whole batch has been looked up */
+	if (ploop_discard_req_done(plo->fbd, &err)) {
+		if (err || !ploop_fb_get_n_free(plo->fbd))
+			ploop_fb_reinit(plo->fbd, err);
+		else
+			set_bit(PLOOP_S_DISCARD_LOADED, &plo->state);
+	}
 
 	if (atomic_dec_and_test(&plo->maintenance_cnt))
 		if (test_bit(PLOOP_S_DISCARD_LOADED, &plo->state) ||
@@ -1202,6 +1344,105 @@ static void ploop_discard_wakeup(struct ploop_request *preq, int err)
 			complete(&plo->maintenance_comp);
 }
 
+/* Time one cluster copy is charged against merge_iops and merge_kbps,
+ * or grow_iops and grow_kbps for relocation of online grow: the two never
+ * run together and share the budget and merge_wait_list */
+static u64 ploop_merge_cost(struct ploop_device * plo)
+{
+	int iops = plo->tune.merge_iops;
+	int kbps = plo->tune.merge_kbps;
+	u64 cost = 0;
+
+	if (plo->maintenance_type == PLOOP_MNTN_GROW) {
+		iops = plo->tune.grow_iops;
+		kbps = plo->tune.grow_kbps;
+	}
+
+	if (iops > 0)
+		cost = div_u64(NSEC_PER_SEC, iops);
+
+	if (kbps > 0) {
+		/* cluster is (512 << cluster_log) bytes */
+		u64 c = div_u64((u64)NSEC_PER_SEC << plo->cluster_log,
+				2 * kbps);
+		if (c > cost)
+			cost = c;
+	}
+
+	return cost;
+}
+
+/* Returns 0 and charges the budget if next cluster copy may start now,
+ * otherwise number of jiffies to wait. Called under plo->lock */
+static unsigned long ploop_merge_throttle(struct ploop_device * plo)
+{
+	u64 cost = ploop_merge_cost(plo);
+	u64 now;
+
+	if (!cost)
+		return 0;
+
+	now = ktime_to_ns(ktime_get());
+	if (plo->merge_next > now)
+		return usecs_to_jiffies(div_u64(plo->merge_next - now,
+						NSEC_PER_USEC)) ? : 1;
+
+	plo->merge_next = now + cost;
+	return 0;
+}
+
+/* Move merge requests which fit into the budget from merge_wait_list
+ * back to entry queue. Called under plo->lock */
+static void ploop_merge_release(struct ploop_device * plo)
+{
+	int kicked = 0;
+
+	if (test_bit(PLOOP_S_MERGE_PAUSED, &plo->state))
+		return;
+
+	while (!list_empty(&plo->merge_wait_list)) {
+		struct ploop_request * preq;
+		unsigned long delay;
+
+		delay = ploop_merge_throttle(plo);
+		if (delay) {
+			mod_timer(&plo->merge_timer, jiffies + delay);
+			break;
+		}
+
+		preq = list_entry(plo->merge_wait_list.next,
+				  struct ploop_request, list);
+		list_del(&preq->list);
+		ploop_entry_add(plo, preq);
+		kicked = 1;
+	}
+
+	if (kicked && test_bit(PLOOP_S_WAIT_PROCESS, &plo->state))
+		wake_up_interruptible(&plo->waitq);
+}
+
+static void merge_timeout(unsigned long data)
+{
+	struct ploop_device * plo = (void*)data;
+
+	spin_lock_irq(&plo->lock);
+	ploop_merge_release(plo);
+	spin_unlock_irq(&plo->lock);
+}
+
+/* Paused merge keeps its requests on merge_wait_list: they hold neither
+ * active_reqs nor lockout, so the device can be quiesced (and merge
+ * resumed afterwards) as usual */
+void ploop_merge_pause(struct ploop_device * plo, int pause)
+{
+	spin_lock_irq(&plo->lock);
+	if (pause)
+		set_bit(PLOOP_S_MERGE_PAUSED, &plo->state);
+	else if (test_and_clear_bit(PLOOP_S_MERGE_PAUSED, &plo->state))
+		ploop_merge_release(plo);
+	spin_unlock_irq(&plo->lock);
+}
+
 static void ploop_complete_request(struct ploop_request * preq)
 {
 	struct ploop_device * plo = preq->plo;
@@ -1230,6 +1471,9 @@ static void ploop_complete_request(struct ploop_request * preq)
 			complete(&plo->maintenance_comp);
 	} else if (test_bit(PLOOP_REQ_MERGE, &preq->state)) {
 		if (!preq->error) {
+			if (preq->req_cluster < plo->trans_map->max_index)
+				plo->merge_done++;
+
 			if (plo->merge_ptr < plo->trans_map->max_index) {
 				spin_lock_irq(&plo->lock);
 				if (preq->map) {
@@ -1250,7 +1494,8 @@ static void ploop_complete_request(struct ploop_request * preq)
 				plo->active_reqs--;
 
 				preq->eng_state = PLOOP_E_ENTRY;
-				ploop_entry_add(plo, preq);
+				list_add_tail(&preq->list, &plo->merge_wait_list);
+				ploop_merge_release(plo);
 				spin_unlock_irq(&plo->lock);
 				return;
 			}
@@ -1294,6 +1539,11 @@ static void ploop_complete_request(struct ploop_request * preq)
 	preq->ioc = NULL;
 
 	plo->active_reqs--;
+	if (test_and_clear_bit(PLOOP_REQ_ACTIVE_WRITE, &preq->state))
+		ploop_write_done(plo);
+
+	ploop_lat_add(plo, PLOOP_LAT_TOTAL,
+		      ktime_to_ns(ktime_get()) - preq->lat_start);
 
 	if (unlikely(test_bit(PLOOP_REQ_ZERO, &preq->state))) {
 		ploop_fb_put_zero_request(plo->fbd, preq);
@@ -1363,6 +1613,27 @@ static void ploop_fail_immediate(struct ploop_request * preq, int err)
 		ploop_fail_immediate(preq, err);	\
 	} while (0);
 
+/* Request has nothing left to do, but end bios and release itself.
+ * Such requests do not touch map or deltas and can be completed
+ * outside of main thread.
+ */
+static inline int ploop_req_plain_complete(struct ploop_request * preq)
+{
+	return preq->eng_state == PLOOP_E_COMPLETE && !preq->error &&
+	       !preq->prealloc_size &&
+	       !(preq->state & ((1 << PLOOP_REQ_BARRIER) |
+				(1 << PLOOP_REQ_TRACK) |
+				(1 << PLOOP_REQ_TRANS) |
+				(1 << PLOOP_REQ_MERGE) |
+				(1 << PLOOP_REQ_RELOC_A) |
+				(1 << PLOOP_REQ_RELOC_S) |
+				(1 << PLOOP_REQ_ZERO) |
+				(1 << PLOOP_REQ_DISCARD) |
+				(1 << PLOOP_REQ_FORCE_FUA) |
+				(1 << PLOOP_REQ_FORCE_FLUSH) |
+				(1 << PLOOP_REQ_KAIO_FSYNC)));
+}
+
 void ploop_complete_io_state(struct ploop_request * preq)
 {
 	struct ploop_device * plo = preq->plo;
@@ -1373,6 +1644,14 @@ void ploop_complete_io_state(struct ploop_request * preq)
 	if (preq->error)
 		set_bit(PLOOP_S_ABORT, &plo->state);
 
+	if (plo->nr_complete_threads && ploop_req_plain_complete(preq)) {
+		list_add_tail(&preq->list, &plo->complete_queue);
+		if (waitqueue_active(&plo->complete_waitq))
+			wake_up(&plo->complete_waitq);
+		spin_unlock_irqrestore(&plo->lock, flags);
+		return;
+	}
+
 	list_add_tail(&preq->list, &plo->ready_queue);
 	if (test_bit(PLOOP_S_WAIT_PROCESS, &plo->state) &&
 	    waitqueue_active(&plo->waitq))
@@ -1442,6 +1721,26 @@ static void bio_bcopy(struct bio *dst, struct bio *src, struct ploop_device *plo
 	}
 }
 
+/*
+ * Eight words are or-ed together per test: that cuts the branches per
+ * byte and lets the loads run in parallel, and non-zero data is
+ * still found within the first cacheline. Vector registers would cost
+ * a kernel_fpu_begin() per page, which is more than they save here.
+ */
+static inline int range_is_zero(const unsigned long * ptr, unsigned int k)
+{
+	for (; k >= 8; k -= 8, ptr += 8) {
+		if (ptr[0] | ptr[1] | ptr[2] | ptr[3] |
+		    ptr[4] | ptr[5] | ptr[6] | ptr[7])
+			return 0;
+	}
+	for (; k; k--, ptr++) {
+		if (*ptr)
+			return 0;
+	}
+	return 1;
+}
+
 int check_zeros(struct bio_list * bl)
 {
 	struct bio * bio;
@@ -1451,24 +1750,17 @@ int check_zeros(struct bio_list * bl)
 
 		for (i = 0; i < bio->bi_vcnt; i++) {
 			struct bio_vec * bv = bio->bi_io_vec + i;
-			unsigned long * ptr;
 			void * kaddr;
-			int k;
+			int zero;
 
 			if (bv->bv_page == ZERO_PAGE(0))
 				continue;
 
 			kaddr = kmap_atomic(bv->bv_page, KM_USER0);
-			ptr = kaddr + bv->bv_offset;
-			k = bv->bv_len/sizeof(unsigned long);
-			while (k) {
-				if (*ptr)
-					break;
-				ptr++;
-				k--;
-			}
+			zero = range_is_zero(kaddr + bv->bv_offset,
+					     bv->bv_len/sizeof(unsigned long));
 			kunmap_atomic(kaddr, KM_USER0);
-			if (k)
+			if (!zero)
 				return 0;
 		}
 	}
@@ -1542,6 +1834,7 @@ void ploop_queue_zero_request(struct ploop_device *plo,
 		preq->state |= (1 << PLOOP_REQ_SYNC);
 	preq->error = 0;
 	preq->tstamp = jiffies;
+	ploop_lat_start(preq);
 	preq->iblock = 0;
 
 	if (test_bit(PLOOP_REQ_RELOC_S, &orig_preq->state)) {
@@ -1578,7 +1871,7 @@ ploop_reloc_sched_read(struct ploop_request *preq, iblock_t iblk)
 	spin_unlock_irq(&plo->lock);
 
 	if (!preq->aux_bio) {
-		preq->aux_bio = bio_alloc(GFP_NOFS, block_vecs(plo));
+		preq->aux_bio = alloc_block_bio(plo);
 
 		if (!preq->aux_bio ||
 		    fill_bio(plo, preq->aux_bio, preq->req_cluster)) {
@@ -1851,6 +2144,15 @@ static int discard_get_index(struct ploop_request *preq)
 
 	preq->iblock = 0;
 
+	/* Map page of the previous cluster serves the following ones, it is
+	 * dropped on leaving it or by ploop_complete_request() */
+	if (preq->map && preq->req_cluster > map_get_mn_end(preq->map)) {
+		spin_lock_irq(&plo->lock);
+		map_release(preq->map);
+		preq->map = NULL;
+		spin_unlock_irq(&plo->lock);
+	}
+
 	err = ploop_find_map(&plo->map, preq);
 	if (err)
 		return err;
@@ -1859,13 +2161,6 @@ static int discard_get_index(struct ploop_request *preq)
 	if (level != top_delta->level)
 		preq->iblock = 0;
 
-	if (preq->map) {
-		spin_lock_irq(&plo->lock);
-		map_release(preq->map);
-		preq->map = NULL;
-		spin_unlock_irq(&plo->lock);
-	}
-
 	return 0;
 }
 
@@ -1969,6 +2264,11 @@ ploop_entry_request(struct ploop_request * preq)
 		return;
 	}
 
+	/* Copy-before-write: hold writes until their cluster is backed up */
+	if (unlikely(plo->pbd) && (preq->req_rw & (1<<BIO_RW)) &&
+	    ploop_pb_check_and_park(plo, preq))
+		return;
+
 restart:
 	if (test_bit(PLOOP_REQ_DISCARD, &preq->state)) {
 		err = ploop_entry_discard_req(preq);
@@ -2065,7 +2365,7 @@ restart:
 		plo->st.bio_cows++;
 
 		if (!preq->aux_bio)
-			preq->aux_bio = bio_alloc(GFP_NOFS, block_vecs(plo));
+			preq->aux_bio = alloc_block_bio(plo);
 
 		if (!preq->aux_bio ||
 		    fill_bio(plo, preq->aux_bio, preq->req_cluster)) {
@@ -2171,7 +2471,7 @@ delta_io:
 				plo->st.bio_cows++;
 
 				if (!preq->aux_bio)
-					preq->aux_bio = bio_alloc(GFP_NOFS, block_vecs(plo));
+					preq->aux_bio = alloc_block_bio(plo);
 
 				if (!preq->aux_bio ||
 				    fill_bio(plo, preq->aux_bio, preq->req_cluster)) {
@@ -2400,7 +2700,7 @@ restart:
 			int i;
 
 			if (!preq->aux_bio)
-				preq->aux_bio = bio_alloc(GFP_NOFS, block_vecs(plo));
+				preq->aux_bio = alloc_block_bio(plo);
 
 			if (!preq->aux_bio ||
 			    fill_bio(plo, preq->aux_bio, preq->req_cluster)) {
@@ -2485,9 +2785,30 @@ restart:
 			break;
 		}
 
-		del_lockout(preq);
 		preq->eng_state = PLOOP_E_ENTRY;
 		preq->req_cluster++;
+
+		spin_lock_irq(&plo->lock);
+		del_lockout(preq);
+		/* Requests which hit the cluster while it was moved must
+		 * not wait for the whole grow to finish */
+		if (!list_empty(&preq->delay_list))
+			list_splice_init(&preq->delay_list, plo->ready_queue.prev);
+
+		/* Throttled: wait for the budget on merge_wait_list,
+		 * holding neither active_reqs nor a map page */
+		if (ploop_merge_cost(plo)) {
+			if (preq->map) {
+				map_release(preq->map);
+				preq->map = NULL;
+			}
+			plo->active_reqs--;
+			list_add_tail(&preq->list, &plo->merge_wait_list);
+			ploop_merge_release(plo);
+			spin_unlock_irq(&plo->lock);
+			break;
+		}
+		spin_unlock_irq(&plo->lock);
 		goto restart;
 	}
 	case PLOOP_E_TRANS_DELTA_READ:
@@ -2567,9 +2888,20 @@ restart:
 	}
 }
 
+/* Push out requests the io module holds back for batched submission */
+static void ploop_submit_queued(struct ploop_device * plo)
+{
+	struct ploop_delta * top_delta = ploop_top_delta(plo);
+
+	if (top_delta->io.ops->submit_queued)
+		top_delta->io.ops->submit_queued(&top_delta->io);
+}
+
 static void ploop_wait(struct ploop_device * plo, int once)
 {
 	DEFINE_WAIT(_wait);
+	long timeout;
+
 	for (;;) {
 		prepare_to_wait(&plo->waitq, &_wait, TASK_INTERRUPTIBLE);
 
@@ -2577,6 +2909,11 @@ static void ploop_wait(struct ploop_device * plo, int once)
 		if (!list_empty(&plo->ready_queue))
 			break;
 
+		/* Index group commit is due */
+		timeout = ploop_map_wb_timeout(&plo->map);
+		if (!timeout)
+			break;
+
 		/* This is not. If we have something in entry queue... */
 		if (!list_empty(&plo->entry_queue)) {
 			/* And entry queue is not suspended due to barrier
@@ -2607,13 +2944,14 @@ static void ploop_wait(struct ploop_device * plo, int once)
 			set_bit(PLOOP_S_EXITING, &plo->state);
 		once = 0;
 		spin_unlock_irq(&plo->lock);
+		ploop_submit_queued(plo);
 		if (test_and_clear_bit(PLOOP_S_SYNC, &plo->state) &&
 		    plo->active_reqs != plo->fastpath_reqs) {
 			struct ploop_delta * top_delta = ploop_top_delta(plo);
 			if (top_delta->io.ops->unplug)
 				top_delta->io.ops->unplug(&top_delta->io);
 		}
-		schedule();
+		schedule_timeout(timeout);
 		spin_lock_irq(&plo->lock);
 		clear_bit(PLOOP_S_WAIT_PROCESS, &plo->state);
 	}
@@ -2630,6 +2968,10 @@ static void ploop_handle_enospc_req(struct ploop_request *preq)
 
 	mod_timer(&plo->freeze_timer, jiffies + HZ * 10);
 
+	spin_unlock_irq(&plo->lock);
+	ploop_submit_queued(plo);
+	spin_lock_irq(&plo->lock);
+
 	prepare_to_wait(&plo->freeze_waitq, &_wait, TASK_INTERRUPTIBLE);
 	spin_unlock_irq(&plo->lock);
 	schedule();
@@ -2699,9 +3041,23 @@ static int ploop_thread(void * data)
 			goto again;
 		}
 
+		/* Commit collected index updates, at once if someone
+		 * waits for active requests to drain */
+		if (!list_empty(&plo->map.wb_group)) {
+			int force = kthread_should_stop() ||
+				    test_bit(PLOOP_S_ATTENTION, &plo->state);
+
+			if (force || !ploop_map_wb_timeout(&plo->map)) {
+				spin_unlock_irq(&plo->lock);
+				ploop_map_wb_flush(&plo->map, force);
+				spin_lock_irq(&plo->lock);
+			}
+		}
+
 		if (!list_empty(&plo->ready_queue)) {
 			struct ploop_request * preq;
 			preq = ploop_get_request(plo, &plo->ready_queue);
+			ploop_lat_account(preq, PLOOP_LAT_AUTO);
 			if (preq->error == -ENOSPC)
 				ploop_handle_enospc_req(preq);
 			spin_unlock_irq(&plo->lock);
@@ -2723,6 +3079,14 @@ static int ploop_thread(void * data)
 
 			preq = ploop_get_request(plo, &plo->entry_queue);
 
+			/* Snapshot waits for writes in flight to drain */
+			if (unlikely(test_bit(PLOOP_S_SNAP_DRAIN, &plo->state)) &&
+			    preq->bl.head && (preq->req_rw & WRITE)) {
+				list_add_tail(&preq->list, &plo->drain_queue);
+				plo->st.snap_held_writes++;
+				continue;
+			}
+
 			if (test_bit(PLOOP_REQ_BARRIER, &preq->state)) {
 				set_bit(PLOOP_S_ATTENTION, &plo->state);
 				if (plo->active_reqs) {
@@ -2746,6 +3110,11 @@ static int ploop_thread(void * data)
 			plo->active_reqs++;
 			ploop_entry_qlen_dec(preq);
 
+			if (preq->bl.head && (preq->req_rw & WRITE)) {
+				__set_bit(PLOOP_REQ_ACTIVE_WRITE, &preq->state);
+				plo->active_writes++;
+			}
+
 			if (test_bit(PLOOP_REQ_DISCARD, &preq->state)) {
 				BUG_ON(plo->maintenance_type != PLOOP_MNTN_DISCARD);
 				atomic_inc(&plo->maintenance_cnt);
@@ -2756,6 +3125,7 @@ static int ploop_thread(void * data)
 				__clear_bit(PLOOP_REQ_SORTED, &preq->state);
 			}
 			preq->eng_state = PLOOP_E_ENTRY;
+			ploop_lat_account(preq, PLOOP_LAT_AUTO);
 			spin_unlock_irq(&plo->lock);
 
 			ploop_req_state_process(preq);
@@ -2784,6 +3154,93 @@ wait_more:
 	return 0;
 }
 
+/* Completion thread. Handles requests from complete_queue, which
+ * can be processed concurrently, see ploop_req_plain_complete().
+ */
+static int ploop_complete_thread(void * data)
+{
+	struct ploop_device * plo = data;
+	struct ploop_request * preq;
+	DEFINE_WAIT(_wait);
+
+	set_user_nice(current, -20);
+
+	spin_lock_irq(&plo->lock);
+	for (;;) {
+		preq = ploop_get_request(plo, &plo->complete_queue);
+		if (preq) {
+			ploop_lat_account(preq, PLOOP_LAT_AUTO);
+			spin_unlock_irq(&plo->lock);
+
+			ploop_req_state_process(preq);
+
+			spin_lock_irq(&plo->lock);
+
+			/* Main thread may wait for delayed requests we
+			 * released or for the end of active requests to
+			 * start barrier processing. */
+			if (test_bit(PLOOP_S_WAIT_PROCESS, &plo->state) &&
+			    waitqueue_active(&plo->waitq) &&
+			    (!list_empty(&plo->ready_queue) ||
+			     (!plo->active_reqs &&
+			      (test_bit(PLOOP_S_EXITING, &plo->state) ||
+			       !list_empty(&plo->entry_queue)))))
+				wake_up_interruptible(&plo->waitq);
+			continue;
+		}
+
+		if (kthread_should_stop())
+			break;
+
+		prepare_to_wait_exclusive(&plo->complete_waitq, &_wait,
+					  TASK_INTERRUPTIBLE);
+		if (list_empty(&plo->complete_queue) &&
+		    !kthread_should_stop()) {
+			spin_unlock_irq(&plo->lock);
+			schedule();
+			spin_lock_irq(&plo->lock);
+		}
+		finish_wait(&plo->complete_waitq, &_wait);
+	}
+	spin_unlock_irq(&plo->lock);
+
+	if (current->io_context)
+		exit_io_context(current);
+
+	return 0;
+}
+
+static void ploop_start_complete_threads(struct ploop_device * plo)
+{
+	struct task_struct * t;
+	int i, nr;
+
+	nr = clamp(complete_threads, 0, PLOOP_MAX_COMPLETE_THREADS);
+	for (i = 0; i < nr; i++) {
+		t = kthread_run(ploop_complete_thread, plo, "ploop%d/%d",
+				plo->index, i);
+		if (IS_ERR(t))
+			break;
+		plo->complete_threads[i] = t;
+	}
+	plo->nr_complete_threads = i;
+}
+
+static void ploop_stop_complete_threads(struct ploop_device * plo)
+{
+	int i, nr;
+
+	spin_lock_irq(&plo->lock);
+	nr = plo->nr_complete_threads;
+	plo->nr_complete_threads = 0;
+	spin_unlock_irq(&plo->lock);
+
+	for (i = 0; i < nr; i++) {
+		kthread_stop(plo->complete_threads[i]);
+		plo->complete_threads[i] = NULL;
+	}
+	BUG_ON(!list_empty(&plo->complete_queue));
+}
 
 /* block device operations */
 static int ploop_open(struct block_device *bdev, fmode_t fmode)
@@ -2829,6 +3286,12 @@ init_delta(struct ploop_device * plo, struct ploop_ctl * ctl, int level)
 	if (ops == NULL)
 		return ERR_PTR(-EINVAL);
 
+	err = -EINVAL;
+	if (ctl->pctl_cluster_log < PLOOP_MIN_CLUSTER_LOG ||
+	    ctl->pctl_cluster_log < PAGE_SHIFT - 9 ||
+	    ctl->pctl_cluster_log > PLOOP_MAX_CLUSTER_LOG)
+		goto out_err;
+
 	if (level < 0 && !list_empty(&plo->map.delta_list)) {
 		struct ploop_delta * top_delta = ploop_top_delta(plo);
 		err = -EINVAL;
@@ -3049,6 +3512,7 @@ void ploop_quiesce(struct ploop_device * plo)
 	preq->state = (1 << PLOOP_REQ_SYNC) | (1 << PLOOP_REQ_BARRIER);
 	preq->error = 0;
 	preq->tstamp = jiffies;
+	ploop_lat_start(preq);
 
 	init_completion(&qcomp);
 	init_completion(&plo->relax_comp);
@@ -3101,6 +3565,39 @@ static struct super_block *find_and_freeze_bdev(struct gendisk *disk,
 	return sb;
 }
 
+/*
+ * Holds new writes on drain_queue and waits for the ones in flight, while
+ * reads go on. Then ploop_quiesce() has only reads in flight to wait for,
+ * and the delta switch has little of the top delta left to flush.
+ */
+static void ploop_drain_writes(struct ploop_device * plo)
+{
+	struct completion comp;
+	int wait;
+
+	init_completion(&comp);
+
+	spin_lock_irq(&plo->lock);
+	set_bit(PLOOP_S_SNAP_DRAIN, &plo->state);
+	wait = plo->active_writes;
+	if (wait)
+		plo->drain_comp = &comp;
+	spin_unlock_irq(&plo->lock);
+
+	if (wait)
+		wait_for_completion(&comp);
+}
+
+static void ploop_release_writes(struct ploop_device * plo)
+{
+	spin_lock_irq(&plo->lock);
+	clear_bit(PLOOP_S_SNAP_DRAIN, &plo->state);
+	list_splice_init(&plo->drain_queue, &plo->entry_queue);
+	if (test_bit(PLOOP_S_WAIT_PROCESS, &plo->state))
+		wake_up_interruptible(&plo->waitq);
+	spin_unlock_irq(&plo->lock);
+}
+
 static int ploop_snapshot(struct ploop_device * plo, unsigned long arg,
 			  struct block_device * bdev)
 {
@@ -3166,6 +3663,10 @@ static int ploop_snapshot(struct ploop_device * plo, unsigned long arg,
 		}
 	}
 
+	ploop_drain_writes(plo);
+	/* Errors are reported by sync of complete_snapshot() */
+	top_delta->io.ops->sync(&top_delta->io);
+
 	ploop_quiesce(plo);
 	err = top_delta->ops->complete_snapshot(top_delta, &snapdata);
 	if (!err) {
@@ -3175,6 +3676,7 @@ static int ploop_snapshot(struct ploop_device * plo, unsigned long arg,
 		mutex_unlock(&plo->sysfs_mutex);
 	}
 	ploop_relax(plo);
+	ploop_release_writes(plo);
 
 	if ((ctl.pctl_flags & PLOOP_FLAG_FS_SYNC) && bdev) {
 		/* Drop ctl_mutex in order to avoid reverse order locking
@@ -3311,10 +3813,12 @@ static void ploop_merge_process(struct ploop_device * plo)
 
 	atomic_set(&plo->maintenance_cnt, 1);
 	plo->merge_ptr = 0;
+	plo->merge_done = 0;
+	plo->merge_next = 0;
 
 	init_completion(&plo->maintenance_comp);
 
-	num_reqs = plo->tune.fsync_max;
+	num_reqs = plo->tune.merge_reqs ? : plo->tune.fsync_max;
 	if (num_reqs > plo->tune.max_requests/2)
 		num_reqs = plo->tune.max_requests/2;
 	if (num_reqs < 1)
@@ -3333,6 +3837,7 @@ static void ploop_merge_process(struct ploop_device * plo)
 		preq->state = (1 << PLOOP_REQ_SYNC) | (1 << PLOOP_REQ_MERGE);
 		preq->error = 0;
 		preq->tstamp = jiffies;
+		ploop_lat_start(preq);
 		preq->iblock = 0;
 		preq->prealloc_size = 0;
 
@@ -3390,6 +3895,7 @@ static void ploop_merge_cleanup(struct ploop_device * plo,
 
 	plo->trans_map = NULL;
 	plo->maintenance_type = PLOOP_MNTN_OFF;
+	clear_bit(PLOOP_S_MERGE_PAUSED, &plo->state);
 	mutex_unlock(&plo->sysfs_mutex);
 	ploop_map_destroy(map);
 	ploop_relax(plo);
@@ -3633,6 +4139,10 @@ static int ploop_start(struct ploop_device * plo, struct block_device *bdev)
 	if (list_empty(&plo->map.delta_list))
 		return -ENOENT;
 
+	err = ploop_cache_check_image(ploop_top_delta(plo));
+	if (err)
+		return err;
+
 	for (i = 0; i < plo->tune.max_requests; i++) {
 		struct ploop_request * preq;
 		preq = kzalloc(sizeof(struct ploop_request), GFP_KERNEL);
@@ -3685,10 +4195,13 @@ static int ploop_start(struct ploop_device * plo, struct block_device *bdev)
 	bd_set_size(bdev, (loff_t)plo->bd_size << 9);
 	set_blocksize(bdev, PAGE_SIZE);
 
+	ploop_start_complete_threads(plo);
+
 	plo->thread = kthread_create(ploop_thread, plo, "ploop%d",
 				     plo->index);
 	if (IS_ERR(plo->thread)) {
 		err = PTR_ERR(plo->thread);
+		ploop_stop_complete_threads(plo);
 		goto out_err;
 	}
 
@@ -3750,6 +4263,10 @@ static int ploop_stop(struct ploop_device * plo, struct block_device *bdev)
 		return -EBUSY;
 	}
 
+	/* Release writes held by push backup, or queue will never drain */
+	if (plo->pbd)
+		ploop_pb_stop_ioc(plo);
+
 	for (p = plo->disk->minors - 1; p > 0; p--)
 		invalidate_partition(plo->disk, p);
 	invalidate_partition(plo->disk, 0);
@@ -3758,11 +4275,16 @@ static int ploop_stop(struct ploop_device * plo, struct block_device *bdev)
 
 	del_timer_sync(&plo->mitigation_timer);
 	del_timer_sync(&plo->freeze_timer);
+	del_timer_sync(&plo->merge_timer);
 
 	/* This will wait for queue drain */
 	kthread_stop(plo->thread);
 	plo->thread = NULL;
 
+	/* main thread exits with no active requests, so completion
+	 * queue is empty as well */
+	ploop_stop_complete_threads(plo);
+
 	/* queue drained, no more ENOSPC */
 	spin_lock_irq(&plo->lock);
 	if (waitqueue_active(&plo->event_waitq))
@@ -3943,6 +4465,7 @@ static void ploop_relocate(struct ploop_device * plo)
 	preq->state = (1 << PLOOP_REQ_SYNC) | (1 << PLOOP_REQ_RELOC_A);
 	preq->error = 0;
 	preq->tstamp = jiffies;
+	ploop_lat_start(preq);
 	preq->iblock = 0;
 	preq->prealloc_size = 0;
 
@@ -4224,7 +4747,7 @@ static void ploop_relocblks_process(struct ploop_device *plo)
 	int num_reqs;
 	struct ploop_request *preq;
 
-	num_reqs = plo->tune.fsync_max;
+	num_reqs = plo->tune.reloc_reqs ? : plo->tune.fsync_max;
 	if (num_reqs > plo->tune.max_requests/2)
 		num_reqs = plo->tune.max_requests/2;
 	if (num_reqs < 1)
@@ -4247,6 +4770,7 @@ static void ploop_relocblks_process(struct ploop_device *plo)
 		preq->state = (1 << PLOOP_REQ_SYNC) | (1 << PLOOP_REQ_RELOC_S);
 		preq->error = 0;
 		preq->tstamp = jiffies;
+		ploop_lat_start(preq);
 		preq->iblock = 0;
 		preq->prealloc_size = 0;
 
@@ -4314,6 +4838,104 @@ static int ploop_fbdrop_ioc(struct ploop_device *plo)
 	return 0;
 }
 
+/* Called with device quiesced: cut off the tail freed by relocation */
+static int ploop_relocblks_truncate(struct ploop_device *plo,
+				    struct ploop_relocblks_ctl *ctl,
+				    unsigned long arg)
+{
+	struct ploop_delta *delta = ploop_top_delta(plo);
+	int err;
+
+	if (ploop_fb_get_lost_range_len(plo->fbd) != 0) {
+		BUG_ON (delta->io.alloc_head >
+			ploop_fb_get_alloc_head(plo->fbd));
+		err = delta->ops->truncate(delta, NULL,
+					   ploop_fb_get_first_lost_iblk(plo->fbd));
+		if (!err) {
+			delta->io.prealloced_size = 0;
+			ctl->alloc_head = ploop_fb_get_lost_range_len(plo->fbd);
+			err = copy_to_user((void*)arg, ctl, sizeof(*ctl));
+		}
+	} else {
+		ctl->alloc_head = 0;
+		err = copy_to_user((void*)arg, ctl, sizeof(*ctl));
+	}
+
+	ploop_discard_restart(plo, err);
+
+	ploop_relax(plo);
+	return err;
+}
+
+static int ploop_relocblks_wait(struct ploop_device *plo,
+				struct ploop_relocblks_ctl *ctl,
+				unsigned long arg)
+{
+	struct ploop_freeblks_desc *fbd;
+	int err;
+
+	err = ploop_maintenance_wait(plo);
+	if (err)
+		return err;
+
+	BUG_ON(atomic_read(&plo->maintenance_cnt));
+
+	if (plo->maintenance_type != PLOOP_MNTN_RELOC)
+		return -EALREADY;
+
+	fbd = plo->fbd;
+	BUG_ON (!fbd);
+
+	if (test_bit(PLOOP_S_ABORT, &plo->state)) {
+		clear_bit(PLOOP_S_DISCARD,&plo->state);
+
+		ploop_fb_fini(plo->fbd, -EIO);
+		plo->maintenance_type = PLOOP_MNTN_OFF;
+		return -EIO;
+	}
+
+	if (ploop_fb_get_n_relocated(fbd) != ploop_fb_get_n_relocating(fbd))
+		return release_fbd(plo, NULL, -EIO);
+
+	/* time to truncate */
+	ploop_quiesce(plo);
+	return ploop_relocblks_truncate(plo, ctl, arg);
+}
+
+/* Reloc extents are loaded to plo->fbd, relocate them and truncate */
+static int ploop_relocblks_start(struct ploop_device *plo,
+				 struct ploop_relocblks_ctl *ctl,
+				 unsigned long arg)
+{
+	struct ploop_delta *delta = ploop_top_delta(plo);
+	int n_free;
+
+	ploop_quiesce(plo);
+
+	/* alloc_head must never decrease */
+	BUG_ON (delta->io.alloc_head < ploop_fb_get_alloc_head(plo->fbd));
+	n_free = ploop_fb_get_n_free(plo->fbd);
+
+	/*
+	 * before relocation start, freeblks engine could provide only
+	 * free blocks
+	 */
+	BUG_ON (delta->io.alloc_head > ploop_fb_get_alloc_head(plo->fbd) &&
+		n_free);
+	ploop_fb_relocation_start(plo->fbd, ctl->n_scanned);
+
+	if (!n_free || !ctl->n_extents)
+		return ploop_relocblks_truncate(plo, ctl, arg);
+
+	plo->maintenance_type = PLOOP_MNTN_RELOC;
+
+	ploop_relax(plo);
+
+	ploop_relocblks_process(plo);
+
+	return ploop_relocblks_wait(plo, ctl, arg);
+}
+
 static int ploop_relocblks_ioc(struct ploop_device *plo, unsigned long arg)
 {
 	struct ploop_delta *delta = ploop_top_delta(plo);
@@ -4322,7 +4944,6 @@ static int ploop_relocblks_ioc(struct ploop_device *plo, unsigned long arg)
 	struct ploop_freeblks_desc *fbd = plo->fbd;
 	int i;
 	int err = 0;
-	int n_free;
 
 	if (list_empty(&plo->map.delta_list))
 		return -ENOENT;
@@ -4343,7 +4964,7 @@ static int ploop_relocblks_ioc(struct ploop_device *plo, unsigned long arg)
 	}
 
 	if (plo->maintenance_type == PLOOP_MNTN_RELOC)
-		goto already;
+		return ploop_relocblks_wait(plo, &ctl, arg);
 
 	if (ctl.n_extents) {
 		extents = kzalloc(sizeof(*extents) * ctl.n_extents,
@@ -4368,74 +4989,212 @@ static int ploop_relocblks_ioc(struct ploop_device *plo, unsigned long arg)
 		extents = NULL;
 	}
 
-	ploop_quiesce(plo);
+	return ploop_relocblks_start(plo, &ctl, arg);
+}
 
-	/* alloc_head must never decrease */
-	BUG_ON (delta->io.alloc_head < ploop_fb_get_alloc_head(plo->fbd));
-	n_free = ploop_fb_get_n_free(plo->fbd);
+struct ploop_compact_scan
+{
+	iblock_t	a_h;
+	unsigned long	*used;	/* blocks below a_h referenced by BAT */
+	iblock_t	base;
+	cluster_t	*rmap;	/* iblk - base -> clu, for [base .. a_h) */
+};
 
-	/*
-	 * before relocation start, freeblks engine could provide only
-	 * free blocks
-	 */
-	BUG_ON (delta->io.alloc_head > ploop_fb_get_alloc_head(plo->fbd) &&
-		n_free);
-	ploop_fb_relocation_start(plo->fbd, ctl.n_scanned);
+/* Read BAT of top delta and fill "used" map or, if cs->rmap is set,
+ * reverse map of the tail. Device must be quiesced. */
+static int ploop_compact_scan_bat(struct ploop_device *plo,
+				  struct ploop_compact_scan *cs,
+				  struct page *page)
+{
+	struct ploop_delta *delta = ploop_top_delta(plo);
+	u32 nr_clusters = DIV_ROUND_UP(plo->bd_size, 1 << plo->cluster_log);
+	u32 per_page = PAGE_SIZE / sizeof(u32);
+	u32 pageno;
+
+	for (pageno = 0;
+	     pageno * per_page < nr_clusters + PLOOP_MAP_OFFSET; pageno++) {
+		u32 *idx;
+		u32 i;
+		int err;
 
-	if (!n_free || !ctl.n_extents)
-		goto truncate;
+		err = delta->io.ops->sync_read(&delta->io, page, PAGE_SIZE, 0,
+					(sector_t)pageno << (PAGE_SHIFT - 9));
+		if (err)
+			return err;
 
-	plo->maintenance_type = PLOOP_MNTN_RELOC;
+		idx = page_address(page);
+		for (i = 0; i < per_page; i++) {
+			u32 pos = pageno * per_page + i;
+			iblock_t iblk;
 
-	ploop_relax(plo);
+			if (pos < PLOOP_MAP_OFFSET)
+				continue;
+			if (pos - PLOOP_MAP_OFFSET >= nr_clusters)
+				break;
 
-	ploop_relocblks_process(plo);
-already:
-	err = ploop_maintenance_wait(plo);
-	if (err)
-		return err;
+			iblk = idx[i] >> ploop_map_log(plo);
+			if (!iblk || iblk >= cs->a_h)
+				continue;
 
-	BUG_ON(atomic_read(&plo->maintenance_cnt));
+			if (cs->rmap) {
+				if (iblk >= cs->base)
+					cs->rmap[iblk - cs->base] =
+						pos - PLOOP_MAP_OFFSET;
+			} else
+				__set_bit(iblk, cs->used);
+		}
+	}
 
-	if (plo->maintenance_type != PLOOP_MNTN_RELOC)
-		return -EALREADY;
+	return 0;
+}
 
-	fbd = plo->fbd;
-	BUG_ON (!fbd);
+/*
+ * Find tail blocks of top delta to move into free blocks reported by
+ * discard/balloon and load them to plo->fbd as reloc extents. Returns
+ * number of extents loaded, sets *n_scanned to the length of the tail
+ * considered.
+ */
+static int ploop_compact_load_extents(struct ploop_device *plo,
+				      u32 *n_scanned)
+{
+	struct ploop_compact_scan cs = {};
+	unsigned long *free = NULL;
+	struct page *page = NULL;
+	iblock_t start, i;
+	u32 free_below, need;
+	int nr = 0;
+	int err;
 
-	if (test_bit(PLOOP_S_ABORT, &plo->state)) {
-		clear_bit(PLOOP_S_DISCARD,&plo->state);
+	cs.a_h = start = ploop_fb_get_alloc_head(plo->fbd);
+	if (!cs.a_h)
+		goto out_done;
 
-		ploop_fb_fini(plo->fbd, -EIO);
-		plo->maintenance_type = PLOOP_MNTN_OFF;
-		return -EIO;
+	page = alloc_page(GFP_KERNEL);
+	cs.used = vmalloc(BITS_TO_LONGS(cs.a_h) * sizeof(long));
+	free = vmalloc(BITS_TO_LONGS(cs.a_h) * sizeof(long));
+	err = -ENOMEM;
+	if (!page || !cs.used || !free)
+		goto out;
+
+	bitmap_zero(cs.used, cs.a_h);
+	bitmap_zero(free, cs.a_h);
+
+	err = ploop_compact_scan_bat(plo, &cs, page);
+	if (err)
+		goto out;
+
+	ploop_fb_mark_free(plo->fbd, free, 0, cs.a_h);
+
+	/* Grow the tail until free blocks below it can take all blocks
+	 * in use inside it. Free blocks inside the tail only need their
+	 * index zeroed, they are not destinations. */
+	free_below = bitmap_weight(free, cs.a_h);
+	need = 0;
+	for (start = cs.a_h; start > 0 && need < free_below; start--) {
+		if (test_bit(start - 1, free))
+			free_below--;
+		else if (test_bit(start - 1, cs.used))
+			need++;
 	}
 
-	if (ploop_fb_get_n_relocated(fbd) != ploop_fb_get_n_relocating(fbd))
-		return release_fbd(plo, extents, -EIO);
+	if (start == cs.a_h)
+		goto out_done;
 
-	/* time to truncate */
-	ploop_quiesce(plo);
-truncate:
-	if (ploop_fb_get_lost_range_len(plo->fbd) != 0) {
-		BUG_ON (delta->io.alloc_head >
-			ploop_fb_get_alloc_head(plo->fbd));
-		err = delta->ops->truncate(delta, NULL,
-					   ploop_fb_get_first_lost_iblk(plo->fbd));
-		if (!err) {
-			delta->io.prealloced_size = 0;
-			ctl.alloc_head = ploop_fb_get_lost_range_len(plo->fbd);
-			err = copy_to_user((void*)arg, &ctl, sizeof(ctl));
+	cs.base = start;
+	cs.rmap = vmalloc((cs.a_h - start) * sizeof(cluster_t));
+	err = -ENOMEM;
+	if (!cs.rmap)
+		goto out;
+
+	err = ploop_compact_scan_bat(plo, &cs, page);
+	if (err)
+		goto out;
+
+	for (i = start; i < cs.a_h; ) {
+		iblock_t end = i + 1;
+		int is_free = test_bit(i, free);
+
+		if (!test_bit(i, cs.used)) {
+			i++;
+			continue;
 		}
-	} else {
-		ctl.alloc_head = 0;
-		err = copy_to_user((void*)arg, &ctl, sizeof(ctl));
+
+		while (end < cs.a_h && test_bit(end, cs.used) &&
+		       !test_bit(end, free) == !is_free &&
+		       cs.rmap[end - start] == cs.rmap[i - start] + (end - i))
+			end++;
+
+		err = ploop_fb_add_reloc_extent(plo->fbd, cs.rmap[i - start],
+						i, end - i, is_free);
+		if (err)
+			goto out;
+
+		nr++;
+		i = end;
 	}
 
-	ploop_discard_restart(plo, err);
+out_done:
+	*n_scanned = cs.a_h - start;
+	err = nr;
+out:
+	vfree(cs.rmap);
+	vfree(free);
+	vfree(cs.used);
+	if (page)
+		__free_page(page);
+	return err;
+}
+
+/*
+ * Online compaction: free blocks are collected by discard (or balloon),
+ * the rest is done here - find tail blocks, relocate them into holes and
+ * truncate the image. Result is reported as for PLOOP_IOC_RELOCBLKS.
+ */
+static int ploop_compact_ioc(struct ploop_device *plo, unsigned long arg)
+{
+	struct ploop_delta *delta;
+	struct ploop_relocblks_ctl ctl;
+	int err;
+
+	if (list_empty(&plo->map.delta_list))
+		return -ENOENT;
+
+	if (copy_from_user(&ctl, (void*)arg, sizeof(ctl)))
+		return -EFAULT;
 
+	delta = ploop_top_delta(plo);
+	if (delta->level != ctl.level)
+		return -EINVAL;
+
+	if (plo->maintenance_type == PLOOP_MNTN_RELOC) {
+		if (!plo->fbd)
+			return -EINVAL;
+		return ploop_relocblks_wait(plo, &ctl, arg);
+	}
+
+	if (plo->maintenance_type == PLOOP_MNTN_DISCARD &&
+	    test_bit(PLOOP_S_DISCARD_LOADED, &plo->state)) {
+		ploop_quiesce(plo);
+		clear_bit(PLOOP_S_DISCARD_LOADED, &plo->state);
+		plo->maintenance_type = PLOOP_MNTN_FBLOADED;
+		ploop_fb_lost_range_init(plo->fbd, delta->io.alloc_head);
+		ploop_relax(plo);
+	}
+
+	if (plo->maintenance_type != PLOOP_MNTN_FBLOADED || !plo->fbd ||
+	    ploop_fb_get_freezed_level(plo->fbd) != ctl.level)
+		return -EINVAL;
+
+	ploop_quiesce(plo);
+	err = ploop_compact_load_extents(plo, &ctl.n_scanned);
 	ploop_relax(plo);
-	return err;
+	if (err < 0)
+		return release_fbd(plo, NULL, err);
+
+	ctl.n_extents = err;
+	ctl.alloc_head = ploop_fb_get_alloc_head(plo->fbd);
+
+	return ploop_relocblks_start(plo, &ctl, arg);
 }
 
 static int ploop_getdevice_ioc(unsigned long arg)
@@ -4549,6 +5308,9 @@ static int ploop_ioctl(struct block_device *bdev, fmode_t fmode, unsigned int cm
 	case PLOOP_IOC_RELOCBLKS:
 		err = ploop_relocblks_ioc(plo, arg);
 		break;
+	case PLOOP_IOC_COMPACT:
+		err = ploop_compact_ioc(plo, arg);
+		break;
 	case PLOOP_IOC_GETDEVICE:
 		err = ploop_getdevice_ioc(arg);
 		break;
@@ -4565,6 +5327,25 @@ static int ploop_ioctl(struct block_device *bdev, fmode_t fmode, unsigned int cm
 	case PLOOP_IOC_MAX_DELTA_SIZE:
 		err = ploop_set_max_delta_size(plo, arg);
 		break;
+
+	case PLOOP_IOC_PUSH_BACKUP_INIT:
+		err = ploop_pb_init_ioc(plo);
+		break;
+	case PLOOP_IOC_PUSH_BACKUP_GET:
+		err = ploop_pb_get_ioc(plo, arg);
+		break;
+	case PLOOP_IOC_PUSH_BACKUP_ACK:
+		err = ploop_pb_ack_ioc(plo, arg);
+		break;
+	case PLOOP_IOC_PUSH_BACKUP_STOP:
+		err = ploop_pb_stop_ioc(plo);
+		break;
+	case PLOOP_IOC_CACHE_ATTACH:
+		err = ploop_cache_attach_ioc(plo, arg);
+		break;
+	case PLOOP_IOC_CACHE_DETACH:
+		err = ploop_cache_detach_ioc(plo);
+		break;
 	default:
 		err = -EINVAL;
 	}
@@ -4646,12 +5427,19 @@ static struct ploop_device *__ploop_dev_alloc(int index)
 	init_timer(&plo->freeze_timer);
 	plo->freeze_timer.function = freeze_timeout;
 	plo->freeze_timer.data = (unsigned long)plo;
+	init_timer(&plo->merge_timer);
+	plo->merge_timer.function = merge_timeout;
+	plo->merge_timer.data = (unsigned long)plo;
+	INIT_LIST_HEAD(&plo->merge_wait_list);
 	INIT_LIST_HEAD(&plo->entry_queue);
+	INIT_LIST_HEAD(&plo->drain_queue);
 	plo->entry_tree[0] = plo->entry_tree[1] = RB_ROOT;
 	plo->lockout_tree = RB_ROOT;
 	INIT_LIST_HEAD(&plo->ready_queue);
+	INIT_LIST_HEAD(&plo->complete_queue);
 	INIT_LIST_HEAD(&plo->free_list);
 	init_waitqueue_head(&plo->waitq);
+	init_waitqueue_head(&plo->complete_waitq);
 	init_waitqueue_head(&plo->req_waitq);
 	init_waitqueue_head(&plo->freeze_waitq);
 	init_waitqueue_head(&plo->event_waitq);
@@ -4881,6 +5669,8 @@ module_param(user_threshold, long, 0644);
 MODULE_PARM_DESC(user_threshold, "Disk space reserved for user (in kilobytes)");
 module_param(large_disk_support, int, 0444);
 MODULE_PARM_DESC(ploop_large_disk_support, "Support of large disks (>2TB)");
+module_param(complete_threads, int, 0644);
+MODULE_PARM_DESC(complete_threads, "Number of request completion threads per device (0 - complete in main thread)");
 
 static int __init ploop_mod_init(void)
 {
@@ -98,6 +98,8 @@ struct ploop_freeblks_desc {
 				     * PLOOP_IOC_FREEBLKS stage */
 
 	struct bio_list	fbd_dbl; /* dbl stands for 'discard bio list' */
+	int	 fbd_dbl_reqs;	/* discard preqs of the batch not done yet */
+	int	 fbd_dbl_err;	/* first error of the batch */
 };
 
 int ploop_fb_get_n_relocated(struct ploop_freeblks_desc *fbd)
@@ -259,6 +261,27 @@ int ploop_fb_filter_freeblks(struct ploop_freeblks_desc *fbd, unsigned long minl
 	return fbd->fbd_n_free;
 }
 
+/* Mark blocks of [base .. base + nr - 1] which are still free (not
+ * re-used by WRITEs yet) in bitmap 'map' */
+void ploop_fb_mark_free(struct ploop_freeblks_desc *fbd, unsigned long *map,
+			iblock_t base, u32 nr)
+{
+	struct ploop_freeblks_extent *fextent = fbd->fbd_ffb.ext;
+	u32 off = fbd->fbd_ffb.off;
+
+	if (fextent == NULL)
+		return;
+
+	list_for_each_entry_from(fextent, &fbd->fbd_free_list, list) {
+		iblock_t start = max(fextent->iblk + off, base);
+		iblock_t end = min(fextent->iblk + fextent->len, base + nr);
+
+		if (start < end)
+			bitmap_set(map, start - base, end - start);
+		off = 0;
+	}
+}
+
 struct ploop_request *
 ploop_fb_get_zero_request(struct ploop_freeblks_desc *fbd)
 {
@@ -707,6 +730,8 @@ static void fbd_complete_bio(struct ploop_freeblks_desc *fbd, int err)
 		nr_completed++;
 	}
 	fbd->fbd_dbl.tail = NULL;
+	fbd->fbd_dbl_reqs = 0;
+	fbd->fbd_dbl_err = 0;
 
 	spin_lock_irq(&plo->lock);
 	plo->bio_total -= nr_completed;
@@ -764,6 +789,8 @@ struct ploop_freeblks_desc *ploop_fb_init(struct ploop_device *plo)
 		return NULL;
 
 	fbd->fbd_dbl.tail = fbd->fbd_dbl.head = NULL;
+	fbd->fbd_dbl_reqs = 0;
+	fbd->fbd_dbl_err = 0;
 	INIT_LIST_HEAD(&fbd->fbd_free_list);
 	INIT_LIST_HEAD(&fbd->fbd_reloc_list);
 	fbd->reloc_tree = RB_ROOT;
@@ -1077,16 +1104,46 @@ int ploop_discard_add_bio(struct ploop_freeblks_desc *fbd, struct bio *bio)
 		return -EOPNOTSUPP;
 	if (fbd->plo->maintenance_type != PLOOP_MNTN_DISCARD)
 		return -EBUSY;
-	/* only one request can be processed simultaneously */
-	if (fbd->fbd_dbl.head)
+	/* a batch is closed once all its requests are done */
+	if (fbd->fbd_dbl.head && !fbd->fbd_dbl_reqs)
 		return -EBUSY;
 
-	fbd->fbd_dbl.head = fbd->fbd_dbl.tail = bio;
+	/* bio may be the head of a chain of merged discards */
+	if (fbd->fbd_dbl.head)
+		fbd->fbd_dbl.tail->bi_next = bio;
+	else
+		fbd->fbd_dbl.head = bio;
+	while (bio->bi_next)
+		bio = bio->bi_next;
+	fbd->fbd_dbl.tail = bio;
+	fbd->fbd_dbl_reqs++;
 
 	return 0;
 }
 
+/* Returns 1 when the last request of the batch is done, with the first
+ * error of the batch in *err */
+int ploop_discard_req_done(struct ploop_freeblks_desc *fbd, int *err)
+{
+	if (*err && !fbd->fbd_dbl_err)
+		fbd->fbd_dbl_err = *err;
+
+	BUG_ON(fbd->fbd_dbl_reqs <= 0);
+	if (--fbd->fbd_dbl_reqs)
+		return 0;
+
+	*err = fbd->fbd_dbl_err;
+	return 1;
+}
+
+/* No more discards can join: the batch is full or is being relocated */
 int ploop_discard_is_inprogress(struct ploop_freeblks_desc *fbd)
 {
-	return fbd && fbd->fbd_dbl.head != NULL;
+	return fbd && ((fbd->fbd_dbl.head && !fbd->fbd_dbl_reqs) ||
+		       fbd->fbd_dbl_reqs >= max(fbd->plo->tune.discard_batch, 1));
+}
+
+int ploop_discard_batch_open(struct ploop_freeblks_desc *fbd)
+{
+	return fbd && fbd->fbd_dbl_reqs;
 }
@@ -12,7 +12,9 @@ int ploop_fb_add_reloc_extent(struct ploop_freeblks_desc *fbd, cluster_t clu, ib
 void ploop_fb_lost_range_init(struct ploop_freeblks_desc *fbd, iblock_t first_lost_iblk);
 void ploop_fb_relocation_start(struct ploop_freeblks_desc *fbd, __u32 n_scanned);
 int ploop_discard_add_bio(struct ploop_freeblks_desc *fbd, struct bio *bio);
+int ploop_discard_req_done(struct ploop_freeblks_desc *fbd, int *err);
 int ploop_discard_is_inprogress(struct ploop_freeblks_desc *fbd);
+int ploop_discard_batch_open(struct ploop_freeblks_desc *fbd);
 
 /* avoid direct access to freeblks internals */
 int ploop_fb_get_n_relocated(struct ploop_freeblks_desc *fbd);
@@ -36,6 +38,10 @@ int ploop_fb_copy_freeblks_to_user(struct ploop_freeblks_desc *fbd, void *arg,
 				   struct ploop_freeblks_ctl *ctl);
 int ploop_fb_filter_freeblks(struct ploop_freeblks_desc *fbd, unsigned long minlen);
 
+/* helper for ioctl(PLOOP_IOC_COMPACT) */
+void ploop_fb_mark_free(struct ploop_freeblks_desc *fbd, unsigned long *map,
+			iblock_t base, u32 nr);
+
 /* get/put "zero index" request */
 struct ploop_request *ploop_fb_get_zero_request(struct ploop_freeblks_desc *fbd);
 void ploop_fb_put_zero_request(struct ploop_freeblks_desc *fbd, struct ploop_request *preq);
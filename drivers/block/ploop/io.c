@@ -1,5 +1,7 @@
 #include <linux/fs.h>
 #include <linux/file.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
 
 #include <linux/ploop/ploop.h>
 #include <linux/ploop/ploop_if.h>
@@ -140,3 +142,61 @@ void ploop_io_report_fn(struct file * file, char * msg)
 		free_page((unsigned long)path);
 }
 EXPORT_SYMBOL(ploop_io_report_fn);
+
+/* Group commit of image fsyncs.
+ *
+ * Flushes of all the writers to an image end up on io->fsync_queue and
+ * the fsync thread of the io covers everything queued by the time it
+ * calls the backing fsync. When the last fsync covered more than one
+ * request, i.e. there are concurrent flushers, the thread waits for a
+ * half of the recent fsync latency before the next one, to gather more
+ * of them, unless fsync_max requests are queued earlier. A lone flusher
+ * does not wait at all.
+ *
+ * Called and returns with plo->lock held.
+ */
+#define PLOOP_FSYNC_WINDOW_MAX	(10 * NSEC_PER_MSEC)
+
+void ploop_fsync_group_wait(struct ploop_io * io)
+{
+	struct ploop_device * plo = io->plo;
+	u64 window;
+	ktime_t end;
+
+	if (io->fsync_batch <= 1)
+		return;
+
+	window = min_t(u64, io->fsync_lat_ns / 2, PLOOP_FSYNC_WINDOW_MAX);
+	if (!window)
+		return;
+
+	end = ktime_add_ns(ktime_get(), window);
+	while (io->fsync_qlen < plo->tune.fsync_max &&
+	       !kthread_should_stop()) {
+		DEFINE_WAIT(_wait);
+		int ret;
+
+		prepare_to_wait(&io->fsync_waitq, &_wait, TASK_INTERRUPTIBLE);
+		spin_unlock_irq(&plo->lock);
+		ret = schedule_hrtimeout(&end, HRTIMER_MODE_ABS);
+		spin_lock_irq(&plo->lock);
+		finish_wait(&io->fsync_waitq, &_wait);
+
+		/* expired */
+		if (!ret)
+			break;
+	}
+}
+EXPORT_SYMBOL(ploop_fsync_group_wait);
+
+/* Account a backing fsync started at @start which covered @nr requests */
+void ploop_fsync_account(struct ploop_io * io, ktime_t start, int nr)
+{
+	s64 lat = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (lat < 0)
+		lat = 0;
+	io->fsync_lat_ns = (io->fsync_lat_ns * 7 + lat) / 8;
+	io->fsync_batch = nr;
+}
+EXPORT_SYMBOL(ploop_fsync_account);
@@ -0,0 +1,2126 @@
+/* Write-back cache of the top delta in a file on fast local storage.
+ *
+ * The cache is stacked on the io of the delta: io->ops is replaced by
+ * ploop_io_ops_cache, which sends data I/O to clusters the cache holds to
+ * the cache file and everything else to the ops of the image. The cache
+ * file is split into slots of cluster size, a slot holds one cluster of
+ * the image (by iblock), pages of it are valid or not independently.
+ * Writes to allocated clusters go to the cache only and are written back
+ * to the image by the cache thread later, oldest first. Reads are served
+ * from the cache when it has all their pages, clusters read twice in a
+ * while are copied into the cache.
+ *
+ * The table of slot records after the header of the cache file is the
+ * journal. A record tells which pages of a slot are not written back to
+ * the image yet, it fits in a sector and is rewritten in place. Records
+ * are committed, after the data they describe, before FLUSH or FUA
+ * request writing to the cache is completed. When the cache is attached
+ * again after a crash, the pages the records tell are written back to
+ * the image before anything else. That is only allowed before the device
+ * is started, and only to the image the cache was formatted for (header
+ * keeps inode number and generation of the image file).
+ *
+ * While the cache is attached and until it is detached cleanly, the
+ * image carries PCACHE_XATTR with the id of the cache and the number of
+ * times it was attached. Records are replayed only if the cache and the
+ * image agree, and the device is not started without the cache the image
+ * is marked with, so that neither can go stale behind the back of the
+ * other.
+ *
+ * I/O to the image which bypasses the cache (index pages, sync I/O,
+ * allocation, truncate) writes back and drops the slots it touches first.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/aio.h>
+#include <linux/bio.h>
+#include <linux/hash.h>
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
+#include <linux/completion.h>
+#include <linux/random.h>
+#include <linux/xattr.h>
+#include <asm/uaccess.h>
+
+#include <linux/ploop/ploop.h>
+#include "io_cache.h"
+
+#define PCACHE_MAGIC		0x68636c70	/* "plch" */
+#define PCACHE_VERSION		2
+
+#define PCACHE_XATTR		"trusted.ploop.cache"
+
+/* At most 1MB clusters with 4K pages */
+#define PCACHE_MAX_PAGES	256
+#define PCACHE_MAP_WORDS	(PCACHE_MAX_PAGES / 64)
+
+#define PCACHE_FREE		0xFFFFFFFFU
+
+/* Slots written back in one go, then image is synced and records committed */
+#define PCACHE_WB_BATCH		16
+/* How deep LRU is searched for a slot to reuse */
+#define PCACHE_EVICT_SCAN	32
+/* Table pages written by commit per fsync of the data */
+#define PCACHE_COMMIT_PAGES	16
+/* Clusters recently read through to the image, second read promotes */
+#define PCACHE_GHOST_BITS	10
+
+struct pcache_hdr
+{
+	__le32	magic;
+	__le32	version;
+	__le32	cluster_log;
+	__le32	nr_slots;
+	__le64	table_off;	/* bytes */
+	__le64	data_off;	/* bytes, cluster aligned */
+	__le64	id;		/* random, chosen by format */
+	__le64	gen;		/* attach count */
+	__le64	img_ino;	/* image file the cache is for */
+	__le32	img_igen;
+	__le32	reserved;
+};
+
+/* PCACHE_XATTR of the image */
+struct pcache_mark
+{
+	__le64	id;
+	__le64	gen;
+};
+
+#define PCACHE_REC_DIRTY	1
+
+struct pcache_rec
+{
+	__le32	iblk;		/* PCACHE_FREE if the slot is not used */
+	__le32	flags;		/* PCACHE_REC_DIRTY */
+	__le64	dirty[PCACHE_MAP_WORDS]; /* pages not written back */
+	__le64	reserved[3];
+};
+
+#define PCACHE_RECS_PER_PAGE	(PAGE_SIZE / sizeof(struct pcache_rec))
+
+/* Slot is mapped to slot->iblk */
+#define PCACHE_S_USED		1
+/* Fill or eviction in progress, I/O to the slot waits on slot->waiters */
+#define PCACHE_S_BUSY		2
+/* Record on disk might be dirty, slot cannot be reused */
+#define PCACHE_S_UNSYNCED	4
+
+struct pcache_slot
+{
+	struct hlist_node	hash;
+	struct list_head	lru;		/* lru or free_list */
+	struct list_head	dirty_link;	/* dirty_list */
+	struct list_head	waiters;	/* pcache_req parked on BUSY */
+	iblock_t		iblk;
+	unsigned int		flags;
+	int			pinned;		/* cache file I/O in flight */
+	int			writing;	/* writes among them */
+	unsigned int		wb_pass;
+	unsigned long		gen;		/* writes completed */
+	unsigned long		dirty_since;
+	unsigned long		valid[BITS_TO_LONGS(PCACHE_MAX_PAGES)];
+	unsigned long		dirty[BITS_TO_LONGS(PCACHE_MAX_PAGES)];
+};
+
+/* Request parked in the cache or job for the cache thread */
+enum {
+	PCACHE_J_SUBMIT,	/* data I/O waiting for a slot */
+	PCACHE_J_FILL,		/* read pages of a BUSY slot from image */
+	PCACHE_J_READ_PAGE,	/* evict the cluster, then read_page */
+	PCACHE_J_WRITE_PAGE,	/* evict the cluster, then write_page */
+	PCACHE_J_FLUSH,		/* commit, then issue_flush */
+	PCACHE_J_EVICT,		/* write back and drop a range */
+	PCACHE_J_DROP,		/* drop a range, it is truncated */
+	PCACHE_J_SYNC,		/* write back everything */
+};
+
+struct pcache_req
+{
+	struct list_head	list;
+	int			type;
+	struct ploop_request	*preq;
+	unsigned long		rw;
+	struct bio_list		bl;
+	iblock_t		iblk;
+	iblock_t		end;
+	unsigned int		size;
+	struct page		*page;
+	sector_t		sec;
+	int			fua;
+	struct pcache_slot	*slot;
+	unsigned long		fill[BITS_TO_LONGS(PCACHE_MAX_PAGES)];
+	struct completion	*done;	/* waited for by the submitter */
+	int			err;
+};
+
+struct ploop_cache
+{
+	struct ploop_io		*io;
+	struct ploop_io_ops	*ops;		/* ops of the image io */
+	struct file		*file;
+
+	unsigned int		cluster_log;
+	unsigned int		ppc;		/* pages per cluster */
+	unsigned int		nr_slots;
+	unsigned int		nr_used;
+	unsigned int		nr_dirty;
+	loff_t			table_off;
+	loff_t			data_off;
+	u64			id;
+	u64			gen;
+
+	spinlock_t		lock;
+	struct pcache_slot	*slots;
+	struct hlist_head	*hash;
+	unsigned int		hash_bits;
+	struct list_head	free_list;
+	struct list_head	lru;		/* used slots, victims first */
+	struct list_head	dirty_list;	/* oldest first */
+	unsigned int		wb_pass;
+
+	struct page		**table;
+	unsigned int		nr_table;
+	unsigned long		*table_dirty;
+
+	struct list_head	slot_waiters;	/* data I/O out of slots */
+	struct list_head	ready;		/* parked preqs to submit again */
+	struct list_head	jobs;
+	struct list_head	commit_list;	/* FUA preqs waiting for commit */
+	struct list_head	flush_list;	/* and FLUSH ones */
+	int			resubmit;	/* slot_waiters may go now */
+	int			error;		/* journal cannot be written */
+
+	struct task_struct	*thread;
+	wait_queue_head_t	waitq;
+	wait_queue_head_t	drain_waitq;
+	struct mutex		commit_mutex;
+
+	iblock_t		ghost[1 << PCACHE_GHOST_BITS];
+
+	struct page		*cbuf[PCACHE_COMMIT_PAGES];	/* commit_mutex */
+	struct page		*wb_pages[PCACHE_MAX_PAGES];	/* thread */
+};
+
+/* Data I/O to the cache file */
+struct pcache_io
+{
+	struct ploop_cache	*pc;
+	struct pcache_slot	*slot;
+	struct ploop_request	*preq;
+	struct iov_iter		iter;
+	size_t			len;
+	unsigned int		p0, p1;
+	int			write, fua, flush;
+	struct bio_vec		bvec[0];
+};
+
+static struct ploop_io_ops ploop_io_ops_cache;
+
+static void pcache_do_submit(struct ploop_cache *pc, struct ploop_request *preq,
+			     unsigned long rw, struct bio_list *sbl,
+			     iblock_t iblk, unsigned int size,
+			     struct pcache_req *pr);
+
+static inline loff_t pcache_slot_pos(struct ploop_cache *pc,
+				     struct pcache_slot *slot)
+{
+	return pc->data_off +
+		((loff_t)(slot - pc->slots) << (pc->cluster_log + 9));
+}
+
+static inline sector_t pcache_img_sec(struct ploop_cache *pc, iblock_t iblk,
+				      unsigned int page)
+{
+	return ((sector_t)iblk << pc->cluster_log) +
+		(page << (PAGE_SHIFT - 9));
+}
+
+static inline int pcache_range_full(unsigned long *map, unsigned int p0,
+				    unsigned int p1)
+{
+	return find_next_zero_bit(map, p1 + 1, p0) > p1;
+}
+
+static inline int pcache_range_any(unsigned long *map, unsigned int p0,
+				   unsigned int p1)
+{
+	return find_next_bit(map, p1 + 1, p0) <= p1;
+}
+
+static inline u64 pcache_map_word(unsigned long *map, int i)
+{
+#if BITS_PER_LONG == 64
+	return map[i];
+#else
+	return map[2 * i] | ((u64)map[2 * i + 1] << 32);
+#endif
+}
+
+static inline void pcache_map_set_word(unsigned long *map, int i, u64 w)
+{
+#if BITS_PER_LONG == 64
+	map[i] = w;
+#else
+	map[2 * i] = (u32)w;
+	map[2 * i + 1] = w >> 32;
+#endif
+}
+
+static inline struct pcache_rec *pcache_rec(struct ploop_cache *pc,
+					    unsigned int n)
+{
+	struct pcache_rec *rec = page_address(pc->table[n / PCACHE_RECS_PER_PAGE]);
+
+	return rec + n % PCACHE_RECS_PER_PAGE;
+}
+
+/* Called with pc->lock held */
+static void pcache_rec_update(struct ploop_cache *pc, struct pcache_slot *slot)
+{
+	unsigned int n = slot - pc->slots;
+	struct pcache_rec *rec = pcache_rec(pc, n);
+	int dirty = !bitmap_empty(slot->dirty, pc->ppc);
+	int i;
+
+	rec->iblk = cpu_to_le32(slot->iblk);
+	rec->flags = cpu_to_le32(dirty ? PCACHE_REC_DIRTY : 0);
+	for (i = 0; i < PCACHE_MAP_WORDS; i++)
+		rec->dirty[i] = cpu_to_le64(pcache_map_word(slot->dirty, i));
+
+	__set_bit(n / PCACHE_RECS_PER_PAGE, pc->table_dirty);
+}
+
+static inline int pcache_evictable(struct pcache_slot *slot)
+{
+	return !(slot->flags & (PCACHE_S_BUSY | PCACHE_S_UNSYNCED)) &&
+		!slot->pinned && list_empty(&slot->dirty_link) &&
+		list_empty(&slot->waiters);
+}
+
+static struct pcache_slot *pcache_lookup(struct ploop_cache *pc,
+					 iblock_t iblk)
+{
+	struct pcache_slot *slot;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(slot, n, &pc->hash[hash_32(iblk, pc->hash_bits)],
+			     hash)
+		if (slot->iblk == iblk)
+			return slot;
+	return NULL;
+}
+
+/* Maps a free slot to iblk, or a clean one nobody uses. Called with
+ * pc->lock held. */
+static struct pcache_slot *pcache_get_slot(struct ploop_cache *pc,
+					   iblock_t iblk)
+{
+	struct pcache_slot *slot;
+	int scan = 0;
+
+	if (!list_empty(&pc->free_list)) {
+		slot = list_first_entry(&pc->free_list, struct pcache_slot, lru);
+		goto found;
+	}
+
+	list_for_each_entry(slot, &pc->lru, lru) {
+		if (pcache_evictable(slot)) {
+			hlist_del(&slot->hash);
+			pc->nr_used--;
+			goto found;
+		}
+		if (++scan >= PCACHE_EVICT_SCAN)
+			break;
+	}
+	return NULL;
+
+found:
+	list_move_tail(&slot->lru, &pc->lru);
+	slot->iblk = iblk;
+	slot->flags = PCACHE_S_USED;
+	slot->gen = 0;
+	bitmap_zero(slot->valid, PCACHE_MAX_PAGES);
+	bitmap_zero(slot->dirty, PCACHE_MAX_PAGES);
+	hlist_add_head(&slot->hash, &pc->hash[hash_32(iblk, pc->hash_bits)]);
+	pc->nr_used++;
+	return slot;
+}
+
+/* Returns 1 if iblk was read through recently, remembers it otherwise */
+static int pcache_ghost_hit(struct ploop_cache *pc, iblock_t iblk)
+{
+	iblock_t *g = &pc->ghost[hash_32(iblk, PCACHE_GHOST_BITS)];
+
+	if (*g == iblk) {
+		*g = PCACHE_FREE;
+		return 1;
+	}
+	*g = iblk;
+	return 0;
+}
+
+/* Called with pc->lock held */
+static int pcache_wb_due(struct ploop_cache *pc, struct pcache_slot *slot)
+{
+	struct ploop_tunable *tune = &pc->io->plo->tune;
+
+	return (u64)pc->nr_dirty * 100 >=
+			(u64)tune->cache_dirty_ratio * pc->nr_slots ||
+		!list_empty(&pc->slot_waiters) ||
+		time_after_eq(jiffies, slot->dirty_since + tune->cache_wb_delay);
+}
+
+static int pcache_wb_wanted(struct ploop_cache *pc)
+{
+	int ret = 0;
+
+	spin_lock_irq(&pc->lock);
+	if (!list_empty(&pc->dirty_list))
+		ret = pcache_wb_due(pc, list_first_entry(&pc->dirty_list,
+							 struct pcache_slot,
+							 dirty_link));
+	spin_unlock_irq(&pc->lock);
+	return ret;
+}
+
+static inline void pcache_wake(struct ploop_cache *pc)
+{
+	if (waitqueue_active(&pc->waitq))
+		wake_up(&pc->waitq);
+}
+
+static void pcache_queue_job(struct ploop_cache *pc, struct pcache_req *job)
+{
+	spin_lock_irq(&pc->lock);
+	list_add_tail(&job->list, &pc->jobs);
+	pcache_wake(pc);
+	spin_unlock_irq(&pc->lock);
+}
+
+static struct pcache_req *pcache_alloc_job(int type)
+{
+	struct pcache_req *job = kzalloc(sizeof(*job), GFP_NOIO);
+
+	if (job)
+		job->type = type;
+	return job;
+}
+
+/* Queues a job to the cache thread and waits for it */
+static int pcache_wait_job(struct ploop_cache *pc, int type,
+			   iblock_t iblk, iblock_t end)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct pcache_req job;
+
+	memset(&job, 0, sizeof(job));
+	job.type = type;
+	job.iblk = iblk;
+	job.end = end;
+	job.done = &done;
+	pcache_queue_job(pc, &job);
+
+	wait_for_completion(&done);
+	return job.err;
+}
+
+struct pcache_wait
+{
+	struct completion	done;
+	long			res;
+};
+
+static void pcache_file_io_complete(u64 data, long res)
+{
+	struct pcache_wait *w = (struct pcache_wait *)data;
+
+	w->res = res;
+	complete(&w->done);
+}
+
+/* Synchronous I/O of whole pages to the cache file */
+static int pcache_file_io(struct ploop_cache *pc, int write,
+			  struct page **pages, unsigned int nr, loff_t pos)
+{
+	struct pcache_wait w;
+	struct iov_iter iter;
+	struct bio_vec *bvec;
+	struct kiocb *iocb;
+	size_t len = (size_t)nr << PAGE_SHIFT;
+	int i, err;
+
+	bvec = kmalloc(nr * sizeof(struct bio_vec), GFP_NOIO);
+	if (!bvec)
+		return -ENOMEM;
+
+	iocb = aio_kernel_alloc(GFP_NOIO);
+	if (!iocb) {
+		kfree(bvec);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr; i++) {
+		bvec[i].bv_page = pages[i];
+		bvec[i].bv_len = PAGE_SIZE;
+		bvec[i].bv_offset = 0;
+	}
+
+	init_completion(&w.done);
+	iov_iter_init_bvec(&iter, bvec, nr, len, 0);
+	aio_kernel_init_iter(iocb, pc->file,
+			     write ? IOCB_CMD_WRITE_ITER : IOCB_CMD_READ_ITER,
+			     &iter, pos);
+	aio_kernel_init_callback(iocb, pcache_file_io_complete, (u64)&w);
+
+	err = aio_kernel_submit(iocb);
+	if (!err) {
+		wait_for_completion(&w.done);
+		if (w.res < 0)
+			err = w.res;
+		else if (w.res != len)
+			err = -EIO;
+	}
+
+	kfree(bvec);
+	return err;
+}
+
+static int pcache_fsync(struct ploop_cache *pc)
+{
+	return vfs_fsync(pc->file, pc->file->f_path.dentry, 1);
+}
+
+/* Writes dirty records to the table. Data they describe goes to media
+ * first, or a crash could leave a record pointing to stale data. */
+static int pcache_commit(struct ploop_cache *pc)
+{
+	unsigned int idx[PCACHE_COMMIT_PAGES];
+	unsigned int i, n, from = 0;
+	int err;
+
+	mutex_lock(&pc->commit_mutex);
+	err = pc->error;
+	if (err)
+		goto out;
+
+	for (;;) {
+		spin_lock_irq(&pc->lock);
+		for (n = 0; n < PCACHE_COMMIT_PAGES; n++) {
+			from = find_next_bit(pc->table_dirty, pc->nr_table, from);
+			if (from >= pc->nr_table)
+				break;
+			__clear_bit(from, pc->table_dirty);
+			copy_page(page_address(pc->cbuf[n]),
+				  page_address(pc->table[from]));
+			idx[n] = from++;
+		}
+		spin_unlock_irq(&pc->lock);
+		if (!n)
+			break;
+
+		err = pcache_fsync(pc);
+		for (i = 0; i < n && !err; i++)
+			err = pcache_file_io(pc, 1, &pc->cbuf[i], 1,
+					     pc->table_off +
+					     ((loff_t)idx[i] << PAGE_SHIFT));
+		if (err || n < PCACHE_COMMIT_PAGES)
+			break;
+	}
+
+	if (!err)
+		err = pcache_fsync(pc);
+
+	pc->io->plo->st.cache_commits++;
+	if (err) {
+		printk(KERN_ERR "ploop%d: commit to cache failed: %d\n",
+		       pc->io->plo->index, err);
+		pc->error = err;
+	}
+out:
+	mutex_unlock(&pc->commit_mutex);
+	return err;
+}
+
+/* Called with pc->lock held */
+static void pcache_unpin(struct ploop_cache *pc, struct pcache_slot *slot)
+{
+	if (--slot->pinned)
+		return;
+
+	if ((slot->flags & PCACHE_S_BUSY) && waitqueue_active(&pc->drain_waitq))
+		wake_up(&pc->drain_waitq);
+
+	if (!list_empty(&pc->slot_waiters)) {
+		pc->resubmit = 1;
+		pcache_wake(pc);
+	}
+}
+
+static void pcache_rw_complete(u64 data, long res)
+{
+	struct pcache_io *pio = (struct pcache_io *)data;
+	struct ploop_cache *pc = pio->pc;
+	struct pcache_slot *slot = pio->slot;
+	struct ploop_request *preq = pio->preq;
+	unsigned long flags;
+	int queued = 0;
+	int err = 0;
+
+	if (res < 0)
+		err = res;
+	else if (res != pio->len)
+		err = -EIO;
+
+	spin_lock_irqsave(&pc->lock, flags);
+	if (pio->write) {
+		slot->writing--;
+		if (!err) {
+			unsigned int n = pio->p1 - pio->p0 + 1;
+
+			bitmap_set(slot->valid, pio->p0, n);
+			bitmap_set(slot->dirty, pio->p0, n);
+			slot->gen++;
+			slot->flags |= PCACHE_S_UNSYNCED;
+			if (list_empty(&slot->dirty_link)) {
+				list_add_tail(&slot->dirty_link, &pc->dirty_list);
+				slot->dirty_since = jiffies;
+				pc->nr_dirty++;
+				if (pcache_wb_due(pc, slot))
+					pcache_wake(pc);
+			}
+			pcache_rec_update(pc, slot);
+
+			if (pio->flush || pio->fua) {
+				list_add_tail(&preq->list, pio->flush ?
+					      &pc->flush_list : &pc->commit_list);
+				pcache_wake(pc);
+				queued = 1;
+			}
+		}
+	}
+	pcache_unpin(pc, slot);
+	spin_unlock_irqrestore(&pc->lock, flags);
+
+	if (err)
+		PLOOP_REQ_SET_ERROR(preq, err);
+	if (!queued)
+		ploop_complete_io_state(preq);
+	kfree(pio);
+}
+
+/* Data I/O of preq to a pinned slot, one aio for the whole request */
+static void pcache_rw(struct ploop_cache *pc, struct pcache_slot *slot,
+		      struct ploop_request *preq, unsigned long rw,
+		      struct bio_list *sbl, unsigned int off, unsigned int size)
+{
+	struct ploop_device *plo = pc->io->plo;
+	int write = !!(rw & (1<<BIO_RW));
+	struct pcache_io *pio = NULL;
+	struct kiocb *iocb = NULL;
+	struct bio *b;
+	int nr = 0;
+	int err;
+
+	for (b = sbl->head; b; b = b->bi_next)
+		nr += b->bi_vcnt - b->bi_idx;
+
+	pio = kmalloc(sizeof(*pio) + nr * sizeof(struct bio_vec), GFP_NOIO);
+	if (pio)
+		iocb = aio_kernel_alloc(GFP_NOIO);
+	if (!iocb) {
+		kfree(pio);
+		spin_lock_irq(&pc->lock);
+		if (write)
+			slot->writing--;
+		pcache_unpin(pc, slot);
+		spin_unlock_irq(&pc->lock);
+		PLOOP_REQ_SET_ERROR(preq, -ENOMEM);
+		ploop_complete_io_state(preq);
+		return;
+	}
+
+	nr = 0;
+	for (b = sbl->head; b; b = b->bi_next) {
+		memcpy(pio->bvec + nr, bio_iovec(b),
+		       (b->bi_vcnt - b->bi_idx) * sizeof(struct bio_vec));
+		nr += b->bi_vcnt - b->bi_idx;
+	}
+
+	pio->pc = pc;
+	pio->slot = slot;
+	pio->preq = preq;
+	pio->len = (size_t)size << 9;
+	pio->p0 = off >> (PAGE_SHIFT - 9);
+	pio->p1 = (off + size - 1) >> (PAGE_SHIFT - 9);
+	pio->write = write;
+	pio->flush = pio->fua = 0;
+	if (write) {
+		pio->flush = test_and_clear_bit(PLOOP_REQ_FORCE_FLUSH,
+						&preq->state) ||
+			     (rw & BIO_FLUSH);
+		pio->fua = test_and_clear_bit(PLOOP_REQ_FORCE_FUA,
+					      &preq->state) ||
+			   (rw & BIO_FUA);
+		ploop_prepare_tracker(preq,
+				      ((sector_t)slot->iblk << plo->cluster_log) |
+				      off);
+		plo->st.cache_writes++;
+	} else
+		plo->st.cache_read_hits++;
+
+	iov_iter_init_bvec(&pio->iter, pio->bvec, nr, pio->len, 0);
+	aio_kernel_init_iter(iocb, pc->file,
+			     write ? IOCB_CMD_WRITE_ITER : IOCB_CMD_READ_ITER,
+			     &pio->iter, pcache_slot_pos(pc, slot) +
+			     ((loff_t)off << 9));
+	aio_kernel_init_callback(iocb, pcache_rw_complete, (u64)pio);
+
+	err = aio_kernel_submit(iocb);
+	if (err)
+		pcache_rw_complete((u64)pio, err);
+}
+
+/* Called by the main thread, parked preqs come again through
+ * pcache_submit_queued(). pr is the record preq was parked with, it is
+ * reused or freed. Writes never
+ * go to image directly: with no slot for them they wait for writeback. */
+static void pcache_do_submit(struct ploop_cache *pc, struct ploop_request *preq,
+			     unsigned long rw, struct bio_list *sbl,
+			     iblock_t iblk, unsigned int size,
+			     struct pcache_req *pr)
+{
+	struct ploop_device *plo = pc->io->plo;
+	unsigned int spp = 1 << (PAGE_SHIFT - 9);
+	unsigned int off, p0, p1;
+	int write = !!(rw & (1<<BIO_RW));
+	struct pcache_req *job = NULL, *promote = NULL;
+	struct pcache_slot *slot;
+	DECLARE_BITMAP(fill, PCACHE_MAX_PAGES);
+
+	off = sbl->head->bi_sector & ((1 << plo->cluster_log) - 1);
+	p0 = off / spp;
+	p1 = (off + size - 1) / spp;
+
+again:
+	spin_lock_irq(&pc->lock);
+	slot = pcache_lookup(pc, iblk);
+	if (slot && (slot->flags & PCACHE_S_BUSY))
+		goto park;
+
+	bitmap_zero(fill, PCACHE_MAX_PAGES);
+
+	if (!write) {
+		if (slot && pcache_range_full(slot->valid, p0, p1))
+			goto hit;
+
+		/* Image is stale for dirty pages */
+		if (slot && pcache_range_any(slot->dirty, p0, p1)) {
+			bitmap_set(fill, p0, p1 - p0 + 1);
+			goto fill;
+		}
+
+		if (!slot && plo->tune.cache_promote &&
+		    pcache_ghost_hit(pc, iblk) &&
+		    (promote = kzalloc(sizeof(*promote), GFP_ATOMIC)) != NULL) {
+			slot = pcache_get_slot(pc, iblk);
+			if (slot) {
+				slot->flags |= PCACHE_S_BUSY;
+				promote->type = PCACHE_J_FILL;
+				promote->slot = slot;
+				promote->iblk = iblk;
+				bitmap_fill(promote->fill, pc->ppc);
+				list_add_tail(&promote->list, &pc->jobs);
+				pcache_wake(pc);
+			} else
+				kfree(promote);
+		}
+		spin_unlock_irq(&pc->lock);
+
+		plo->st.cache_read_misses++;
+		pc->ops->submit(pc->io, preq, rw, sbl, iblk, size);
+		kfree(pr);
+		kfree(job);
+		return;
+	}
+
+	if (!slot) {
+		slot = pcache_get_slot(pc, iblk);
+		if (!slot)
+			goto park;
+	}
+
+	/* Partially written pages must be read from image first */
+	if ((off & (spp - 1)) && !test_bit(p0, slot->valid))
+		__set_bit(p0, fill);
+	if (((off + size) & (spp - 1)) && !test_bit(p1, slot->valid))
+		__set_bit(p1, fill);
+	if (!bitmap_empty(fill, PCACHE_MAX_PAGES))
+		goto fill;
+
+hit:
+	slot->pinned++;
+	if (write)
+		slot->writing++;
+	list_move_tail(&slot->lru, &pc->lru);
+	spin_unlock_irq(&pc->lock);
+
+	pcache_rw(pc, slot, preq, rw, sbl, off, size);
+	kfree(pr);
+	kfree(job);
+	return;
+
+fill:
+	if (!job) {
+		spin_unlock_irq(&pc->lock);
+		job = pcache_alloc_job(PCACHE_J_FILL);
+		if (!job)
+			goto enomem;
+		goto again;
+	}
+	slot->flags |= PCACHE_S_BUSY;
+	job->slot = slot;
+	job->iblk = iblk;
+	bitmap_copy(job->fill, fill, PCACHE_MAX_PAGES);
+	list_add_tail(&job->list, &pc->jobs);
+	job = NULL;
+	/* fall through */
+
+park:
+	if (!pr) {
+		spin_unlock_irq(&pc->lock);
+		pr = pcache_alloc_job(PCACHE_J_SUBMIT);
+		if (!pr)
+			goto enomem;
+		goto again;
+	}
+	pr->preq = preq;
+	pr->rw = rw;
+	pr->bl = *sbl;
+	pr->iblk = iblk;
+	pr->size = size;
+	list_add_tail(&pr->list, slot ? &slot->waiters : &pc->slot_waiters);
+	plo->st.cache_parked++;
+	pcache_wake(pc);
+	spin_unlock_irq(&pc->lock);
+	kfree(job);
+	return;
+
+enomem:
+	kfree(pr);
+	PLOOP_REQ_SET_ERROR(preq, -ENOMEM);
+	ploop_complete_io_state(preq);
+}
+
+/* Parked preqs are submitted again by the main thread, see
+ * pcache_submit_queued(), the cache thread does no I/O to image for them. */
+static void pcache_resubmit(struct ploop_cache *pc, struct list_head *list,
+			    int err)
+{
+	struct ploop_device *plo = pc->io->plo;
+	struct pcache_req *pr, *tmp;
+
+	if (list_empty(list))
+		return;
+
+	if (err) {
+		list_for_each_entry_safe(pr, tmp, list, list) {
+			list_del_init(&pr->list);
+			PLOOP_REQ_SET_ERROR(pr->preq, err);
+			ploop_complete_io_state(pr->preq);
+			kfree(pr);
+		}
+		return;
+	}
+
+	spin_lock_irq(&pc->lock);
+	list_splice_tail_init(list, &pc->ready);
+	spin_unlock_irq(&pc->lock);
+
+	spin_lock_irq(&plo->lock);
+	if (test_bit(PLOOP_S_WAIT_PROCESS, &plo->state))
+		wake_up_interruptible(&plo->waitq);
+	spin_unlock_irq(&plo->lock);
+}
+
+static int pcache_unpinned(struct ploop_cache *pc, struct pcache_slot *slot)
+{
+	int ret;
+
+	spin_lock_irq(&pc->lock);
+	ret = !slot->pinned;
+	spin_unlock_irq(&pc->lock);
+	return ret;
+}
+
+/* Waits for cache file I/O to a BUSY slot to complete */
+static void pcache_drain(struct ploop_cache *pc, struct pcache_slot *slot)
+{
+	wait_event(pc->drain_waitq, pcache_unpinned(pc, slot));
+}
+
+/* Copies dirty pages of the slot to image, does not sync it */
+static int pcache_write_back(struct ploop_cache *pc, struct pcache_slot *slot)
+{
+	DECLARE_BITMAP(map, PCACHE_MAX_PAGES);
+	unsigned int a, b = 0;
+	int err = 0;
+
+	spin_lock_irq(&pc->lock);
+	bitmap_copy(map, slot->dirty, PCACHE_MAX_PAGES);
+	spin_unlock_irq(&pc->lock);
+
+	while ((a = find_next_bit(map, pc->ppc, b)) < pc->ppc) {
+		b = find_next_zero_bit(map, pc->ppc, a);
+
+		err = pcache_file_io(pc, 0, pc->wb_pages, b - a,
+				     pcache_slot_pos(pc, slot) +
+				     ((loff_t)a << PAGE_SHIFT));
+		if (!err)
+			err = pc->ops->sync_writevec(pc->io, pc->wb_pages, b - a,
+						     pcache_img_sec(pc, slot->iblk, a));
+		if (err)
+			break;
+	}
+
+	pc->io->plo->st.cache_writebacks++;
+	return err;
+}
+
+/* Writes back a batch of dirty slots and commits them clean. Slots
+ * written to meanwhile stay dirty. Returns the number of slots taken. */
+static int pcache_wb_batch(struct ploop_cache *pc, int all, int *errp)
+{
+	struct pcache_slot *batch[PCACHE_WB_BATCH];
+	unsigned long gen[PCACHE_WB_BATCH];
+	struct pcache_slot *slot;
+	int i, n = 0;
+	int err = 0;
+
+	spin_lock_irq(&pc->lock);
+	list_for_each_entry(slot, &pc->dirty_list, dirty_link) {
+		if (all) {
+			if (slot->wb_pass == pc->wb_pass)
+				continue;
+			slot->wb_pass = pc->wb_pass;
+		} else if (!pcache_wb_due(pc, slot))
+			break;
+
+		batch[n] = slot;
+		gen[n] = slot->gen;
+		if (++n == PCACHE_WB_BATCH)
+			break;
+	}
+	spin_unlock_irq(&pc->lock);
+
+	if (!n)
+		return 0;
+
+	for (i = 0; i < n && !err; i++)
+		err = pcache_write_back(pc, batch[i]);
+	if (!err)
+		err = pc->ops->sync(pc->io);
+	if (err) {
+		if (printk_ratelimit())
+			printk(KERN_ERR "ploop%d: cache writeback failed: %d\n",
+			       pc->io->plo->index, err);
+		*errp = err;
+		return n;
+	}
+
+	spin_lock_irq(&pc->lock);
+	for (i = 0; i < n; i++) {
+		slot = batch[i];
+		if (slot->gen != gen[i]) {
+			list_move_tail(&slot->dirty_link, &pc->dirty_list);
+			slot->dirty_since = jiffies;
+			batch[i] = NULL;
+			continue;
+		}
+		bitmap_zero(slot->dirty, PCACHE_MAX_PAGES);
+		list_del_init(&slot->dirty_link);
+		pc->nr_dirty--;
+		pcache_rec_update(pc, slot);
+	}
+	spin_unlock_irq(&pc->lock);
+
+	err = pcache_commit(pc);
+	if (err) {
+		*errp = err;
+		return n;
+	}
+
+	spin_lock_irq(&pc->lock);
+	for (i = 0; i < n; i++) {
+		slot = batch[i];
+		if (!slot || slot->gen != gen[i])
+			continue;
+		slot->flags &= ~PCACHE_S_UNSYNCED;
+		/* Written back oldest, so reused first */
+		list_move(&slot->lru, &pc->lru);
+	}
+	if (!list_empty(&pc->slot_waiters))
+		pc->resubmit = 1;
+	spin_unlock_irq(&pc->lock);
+
+	return n;
+}
+
+/* With all, writes back everything written before the call and commits */
+static int pcache_writeback(struct ploop_cache *pc, int all)
+{
+	int err = 0;
+
+	if (!all) {
+		pcache_wb_batch(pc, 0, &err);
+		return err;
+	}
+
+	spin_lock_irq(&pc->lock);
+	pc->wb_pass++;
+	spin_unlock_irq(&pc->lock);
+
+	while (pcache_wb_batch(pc, 1, &err) && !err)
+		;
+	if (!err)
+		err = pcache_commit(pc);
+	return err;
+}
+
+/* Takes a slot mapped to iblk out of use, writing it back first if asked.
+ * The slot is left BUSY and off all lists, its waiters are moved to
+ * waiters. Returns 1 if the slot was unmapped. */
+static int pcache_unmap(struct ploop_cache *pc, struct pcache_slot *slot,
+			iblock_t iblk, int writeback, struct list_head *waiters)
+{
+	struct pcache_req *job, *tmp;
+	int err = 0;
+
+	spin_lock_irq(&pc->lock);
+	if (!(slot->flags & PCACHE_S_USED) || slot->iblk != iblk) {
+		spin_unlock_irq(&pc->lock);
+		return 0;
+	}
+	/* Fill does not make sense anymore, its waiters are ours */
+	list_for_each_entry_safe(job, tmp, &pc->jobs, list) {
+		if (job->type == PCACHE_J_FILL && job->slot == slot) {
+			list_del(&job->list);
+			kfree(job);
+		}
+	}
+	slot->flags |= PCACHE_S_BUSY;
+	spin_unlock_irq(&pc->lock);
+
+	pcache_drain(pc, slot);
+
+	if (writeback && !list_empty(&slot->dirty_link)) {
+		err = pcache_write_back(pc, slot);
+		if (!err)
+			err = pc->ops->sync(pc->io);
+	}
+
+	spin_lock_irq(&pc->lock);
+	if (err) {
+		slot->flags &= ~PCACHE_S_BUSY;
+		list_splice_tail_init(&slot->waiters, waiters);
+		spin_unlock_irq(&pc->lock);
+		return err;
+	}
+	hlist_del(&slot->hash);
+	list_del_init(&slot->lru);
+	if (!list_empty(&slot->dirty_link)) {
+		list_del_init(&slot->dirty_link);
+		pc->nr_dirty--;
+	}
+	pc->nr_used--;
+	slot->iblk = PCACHE_FREE;
+	bitmap_zero(slot->dirty, PCACHE_MAX_PAGES);
+	pcache_rec_update(pc, slot);
+	list_splice_tail_init(&slot->waiters, waiters);
+	spin_unlock_irq(&pc->lock);
+	return 1;
+}
+
+/* Drops slots of iblocks [iblk, end], written back unless truncated */
+static int pcache_evict_range(struct ploop_cache *pc, iblock_t iblk,
+			      iblock_t end, int writeback)
+{
+	int scan = end - iblk >= PCACHE_EVICT_SCAN;
+	unsigned int n, nr = scan ? pc->nr_slots : end - iblk + 1;
+	LIST_HEAD(freed);
+	LIST_HEAD(waiters);
+	struct pcache_slot *slot;
+	iblock_t cur;
+	int err = 0, ret;
+
+	/* Short ranges are looked up, long ones are matched against slots */
+	for (n = 0; n < nr; n++) {
+		spin_lock_irq(&pc->lock);
+		if (scan) {
+			slot = pc->slots + n;
+			cur = slot->iblk;
+			if (!(slot->flags & PCACHE_S_USED) ||
+			    cur < iblk || cur > end)
+				slot = NULL;
+		} else {
+			cur = iblk + n;
+			slot = pcache_lookup(pc, cur);
+		}
+		spin_unlock_irq(&pc->lock);
+		if (!slot)
+			continue;
+
+		ret = pcache_unmap(pc, slot, cur, writeback, &waiters);
+		if (ret < 0)
+			err = ret;
+		else if (ret)
+			list_add_tail(&slot->lru, &freed);
+	}
+
+	if (!list_empty(&freed)) {
+		ret = pcache_commit(pc);
+		if (ret)
+			err = ret;
+	}
+
+	spin_lock_irq(&pc->lock);
+	list_for_each_entry(slot, &freed, lru)
+		slot->flags = 0;
+	list_splice_init(&freed, &pc->free_list);
+	if (!list_empty(&pc->slot_waiters))
+		pc->resubmit = 1;
+	spin_unlock_irq(&pc->lock);
+
+	pcache_resubmit(pc, &waiters, 0);
+	return err;
+}
+
+static void pcache_fill(struct ploop_cache *pc, struct pcache_req *job)
+{
+	struct pcache_slot *slot = job->slot;
+	DECLARE_BITMAP(map, PCACHE_MAX_PAGES);
+	LIST_HEAD(waiters);
+	unsigned int a, b = 0;
+	int err = 0;
+
+	pcache_drain(pc, slot);
+
+	spin_lock_irq(&pc->lock);
+	bitmap_andnot(map, job->fill, slot->valid, PCACHE_MAX_PAGES);
+	spin_unlock_irq(&pc->lock);
+
+	while ((a = find_next_bit(map, pc->ppc, b)) < pc->ppc) {
+		b = find_next_zero_bit(map, pc->ppc, a);
+
+		err = pc->ops->sync_readvec(pc->io, pc->wb_pages, b - a,
+					    pcache_img_sec(pc, slot->iblk, a));
+		if (!err)
+			err = pcache_file_io(pc, 1, pc->wb_pages, b - a,
+					     pcache_slot_pos(pc, slot) +
+					     ((loff_t)a << PAGE_SHIFT));
+		if (err)
+			break;
+
+		spin_lock_irq(&pc->lock);
+		bitmap_set(slot->valid, a, b - a);
+		spin_unlock_irq(&pc->lock);
+	}
+	pc->io->plo->st.cache_fills++;
+
+	spin_lock_irq(&pc->lock);
+	slot->flags &= ~PCACHE_S_BUSY;
+	list_splice_init(&slot->waiters, &waiters);
+	if (!list_empty(&pc->slot_waiters))
+		pc->resubmit = 1;
+	spin_unlock_irq(&pc->lock);
+
+	pcache_resubmit(pc, &waiters, err);
+}
+
+static void pcache_do_job(struct ploop_cache *pc, struct pcache_req *job)
+{
+	struct ploop_io *io = pc->io;
+	int err;
+
+	switch (job->type) {
+	case PCACHE_J_FILL:
+		pcache_fill(pc, job);
+		break;
+	case PCACHE_J_READ_PAGE:
+	case PCACHE_J_WRITE_PAGE:
+		err = pcache_evict_range(pc, job->iblk, job->iblk, 1);
+		if (err) {
+			PLOOP_REQ_SET_ERROR(job->preq, err);
+			ploop_complete_io_state(job->preq);
+		} else if (job->type == PCACHE_J_READ_PAGE)
+			pc->ops->read_page(io, job->preq, job->page, job->sec);
+		else
+			pc->ops->write_page(io, job->preq, job->page, job->sec,
+					    job->fua);
+		break;
+	case PCACHE_J_FLUSH:
+		err = pcache_commit(pc);
+		if (!err && pc->ops->issue_flush) {
+			pc->ops->issue_flush(io, job->preq);
+			break;
+		}
+		if (err)
+			PLOOP_REQ_SET_ERROR(job->preq, err);
+		job->preq->eng_state = PLOOP_E_COMPLETE;
+		ploop_complete_io_state(job->preq);
+		break;
+	case PCACHE_J_EVICT:
+	case PCACHE_J_DROP:
+		job->err = pcache_evict_range(pc, job->iblk, job->end,
+					      job->type == PCACHE_J_EVICT);
+		break;
+	case PCACHE_J_SYNC:
+		job->err = pcache_writeback(pc, 1);
+		break;
+	}
+
+	if (job->done)
+		complete(job->done);
+	else
+		kfree(job);
+}
+
+/* Completes FUA and FLUSH writes to the cache once they are committed.
+ * FLUSH ones need image synced as well, for what was written to it
+ * directly before them. */
+static void pcache_commit_queued(struct ploop_cache *pc)
+{
+	struct ploop_request *preq, *tmp;
+	LIST_HEAD(fua);
+	LIST_HEAD(flush);
+	int err = 0;
+
+	spin_lock_irq(&pc->lock);
+	list_splice_init(&pc->commit_list, &fua);
+	list_splice_init(&pc->flush_list, &flush);
+	spin_unlock_irq(&pc->lock);
+
+	if (list_empty(&fua) && list_empty(&flush))
+		return;
+
+	if (!list_empty(&flush))
+		err = pc->ops->sync(pc->io);
+	if (!err)
+		err = pcache_commit(pc);
+
+	list_splice(&flush, &fua);
+	list_for_each_entry_safe(preq, tmp, &fua, list) {
+		list_del_init(&preq->list);
+		if (err)
+			PLOOP_REQ_SET_ERROR(preq, err);
+		ploop_complete_io_state(preq);
+	}
+}
+
+static int pcache_has_work(struct ploop_cache *pc)
+{
+	return !list_empty(&pc->jobs) || !list_empty(&pc->commit_list) ||
+		!list_empty(&pc->flush_list) || pc->resubmit ||
+		pcache_wb_wanted(pc);
+}
+
+static int pcache_thread(void *data)
+{
+	struct ploop_cache *pc = data;
+	struct pcache_req *job;
+	int err;
+
+	set_user_nice(current, -20);
+
+	while (!kthread_should_stop()) {
+		LIST_HEAD(waiters);
+
+		wait_event_interruptible_timeout(pc->waitq,
+						 pcache_has_work(pc) ||
+						 kthread_should_stop(), HZ);
+
+		pcache_commit_queued(pc);
+
+		for (;;) {
+			spin_lock_irq(&pc->lock);
+			job = NULL;
+			if (!list_empty(&pc->jobs)) {
+				job = list_first_entry(&pc->jobs,
+						       struct pcache_req, list);
+				list_del_init(&job->list);
+			}
+			spin_unlock_irq(&pc->lock);
+			if (!job)
+				break;
+			pcache_do_job(pc, job);
+		}
+
+		spin_lock_irq(&pc->lock);
+		if (pc->resubmit) {
+			pc->resubmit = 0;
+			list_splice_init(&pc->slot_waiters, &waiters);
+		}
+		spin_unlock_irq(&pc->lock);
+		pcache_resubmit(pc, &waiters, 0);
+
+		/* Do not spin on a failing image or cache */
+		if (pcache_wb_wanted(pc) && pcache_writeback(pc, 0))
+			schedule_timeout_interruptible(HZ);
+	}
+
+	err = pcache_writeback(pc, 1);
+	if (err)
+		printk(KERN_WARNING "ploop%d: cache is not written back: %d, "
+		       "attach it again to recover\n", pc->io->plo->index, err);
+	return err;
+}
+
+/* Ops of the cache: data I/O goes through the cache, the rest to image */
+
+static void pcache_submit(struct ploop_io *io, struct ploop_request *preq,
+			  unsigned long rw, struct bio_list *sbl,
+			  iblock_t iblk, unsigned int size)
+{
+	struct ploop_cache *pc = io->cache;
+
+	if (iblk == PLOOP_ZERO_INDEX || !size) {
+		pc->ops->submit(io, preq, rw, sbl, iblk, size);
+		return;
+	}
+
+	pcache_do_submit(pc, preq, rw, sbl, iblk, size, NULL);
+}
+
+static int pcache_cached(struct ploop_cache *pc, iblock_t iblk, iblock_t end)
+{
+	int ret = 0;
+
+	spin_lock_irq(&pc->lock);
+	if (end - iblk >= PCACHE_EVICT_SCAN)
+		ret = pc->nr_used != 0;
+	else {
+		for (;; iblk++) {
+			if (pcache_lookup(pc, iblk)) {
+				ret = 1;
+				break;
+			}
+			if (iblk == end)
+				break;
+		}
+	}
+	spin_unlock_irq(&pc->lock);
+	return ret;
+}
+
+static int pcache_evict(struct ploop_cache *pc, loff_t pos, loff_t len)
+{
+	int shift = pc->cluster_log + 9;
+	iblock_t iblk = pos >> shift;
+	iblock_t end = (pos + len - 1) >> shift;
+
+	if (!len || !pcache_cached(pc, iblk, end))
+		return 0;
+
+	return pcache_wait_job(pc, PCACHE_J_EVICT, iblk, end);
+}
+
+static void pcache_submit_alloc(struct ploop_io *io, struct ploop_request *preq,
+				struct bio_list *sbl, unsigned int size)
+{
+	struct ploop_cache *pc = io->cache;
+	int err;
+
+	/* Slot left behind by truncate in a way we did not see */
+	err = pcache_evict(pc, (loff_t)io->alloc_head << (pc->cluster_log + 9),
+			   1 << (pc->cluster_log + 9));
+
+	/* What was written to cache must be stable before it, as image is */
+	if (!err && ((preq->req_rw & BIO_FLUSH) ||
+		     test_bit(PLOOP_REQ_FORCE_FLUSH, &preq->state)))
+		err = pcache_commit(pc);
+
+	if (err) {
+		PLOOP_FAIL_REQUEST(preq, err);
+		return;
+	}
+
+	pc->ops->submit_alloc(io, preq, sbl, size);
+}
+
+static void pcache_page_io(struct ploop_io *io, struct ploop_request *preq,
+			   struct page *page, sector_t sec, int type, int fua)
+{
+	struct ploop_cache *pc = io->cache;
+	iblock_t iblk = sec >> pc->cluster_log;
+	struct pcache_req *job;
+
+	job = pcache_alloc_job(type);
+	if (!job) {
+		PLOOP_FAIL_REQUEST(preq, -ENOMEM);
+		return;
+	}
+	job->preq = preq;
+	job->page = page;
+	job->sec = sec;
+	job->fua = fua;
+	job->iblk = iblk;
+	pcache_queue_job(pc, job);
+}
+
+static void pcache_read_page(struct ploop_io *io, struct ploop_request *preq,
+			     struct page *page, sector_t sec)
+{
+	struct ploop_cache *pc = io->cache;
+	iblock_t iblk = sec >> pc->cluster_log;
+
+	if (pcache_cached(pc, iblk, iblk))
+		pcache_page_io(io, preq, page, sec, PCACHE_J_READ_PAGE, 0);
+	else
+		pc->ops->read_page(io, preq, page, sec);
+}
+
+static void pcache_write_page(struct ploop_io *io, struct ploop_request *preq,
+			      struct page *page, sector_t sec, int fua)
+{
+	struct ploop_cache *pc = io->cache;
+	iblock_t iblk = sec >> pc->cluster_log;
+
+	if (pcache_cached(pc, iblk, iblk))
+		pcache_page_io(io, preq, page, sec, PCACHE_J_WRITE_PAGE, fua);
+	else
+		pc->ops->write_page(io, preq, page, sec, fua);
+}
+
+static int pcache_sync_read(struct ploop_io *io, struct page *page,
+			    unsigned int len, unsigned int off, sector_t sec)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_evict(pc, (loff_t)sec << 9, len);
+
+	return err ? : pc->ops->sync_read(io, page, len, off, sec);
+}
+
+static int pcache_sync_write(struct ploop_io *io, struct page *page,
+			     unsigned int len, unsigned int off, sector_t sec)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_evict(pc, (loff_t)sec << 9, len);
+
+	return err ? : pc->ops->sync_write(io, page, len, off, sec);
+}
+
+static int pcache_sync_readvec(struct ploop_io *io, struct page **pvec,
+			       unsigned int nr, sector_t sec)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_evict(pc, (loff_t)sec << 9, (loff_t)nr << PAGE_SHIFT);
+
+	return err ? : pc->ops->sync_readvec(io, pvec, nr, sec);
+}
+
+static int pcache_sync_writevec(struct ploop_io *io, struct page **pvec,
+				unsigned int nr, sector_t sec)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_evict(pc, (loff_t)sec << 9, (loff_t)nr << PAGE_SHIFT);
+
+	return err ? : pc->ops->sync_writevec(io, pvec, nr, sec);
+}
+
+static int pcache_alloc(struct ploop_io *io, loff_t pos, loff_t len)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_evict(pc, pos, len);
+
+	return err ? : pc->ops->alloc(io, pos, len);
+}
+
+static int pcache_truncate(struct ploop_io *io, struct file *file,
+			   __u32 alloc_head)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = 0;
+
+	if (pcache_cached(pc, alloc_head, PCACHE_FREE - 1))
+		err = pcache_wait_job(pc, PCACHE_J_DROP, alloc_head,
+				      PCACHE_FREE - 1);
+
+	return err ? : pc->ops->truncate(io, file, alloc_head);
+}
+
+static void pcache_issue_flush(struct ploop_io *io, struct ploop_request *preq)
+{
+	struct pcache_req *job = pcache_alloc_job(PCACHE_J_FLUSH);
+
+	if (!job) {
+		PLOOP_FAIL_REQUEST(preq, -ENOMEM);
+		return;
+	}
+	job->preq = preq;
+	pcache_queue_job(io->cache, job);
+}
+
+static int pcache_sync_all(struct ploop_cache *pc)
+{
+	return pcache_wait_job(pc, PCACHE_J_SYNC, 0, 0);
+}
+
+/* Called when the image must be consistent on its own: stop, snapshot,
+ * grow, ... so everything is written back. */
+static int pcache_sync(struct ploop_io *io)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_sync_all(pc);
+
+	return err ? : pc->ops->sync(io);
+}
+
+static int pcache_stop(struct ploop_io *io)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_sync_all(pc);
+
+	return err ? : pc->ops->stop(io);
+}
+
+static int pcache_prepare_snapshot(struct ploop_io *io,
+				   struct ploop_snapdata *sd)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_sync_all(pc);
+
+	return err ? : pc->ops->prepare_snapshot(io, sd);
+}
+
+static int pcache_complete_snapshot(struct ploop_io *io,
+				    struct ploop_snapdata *sd)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_sync_all(pc);
+
+	return err ? : pc->ops->complete_snapshot(io, sd);
+}
+
+static int pcache_prepare_merge(struct ploop_io *io, struct ploop_snapdata *sd)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_sync_all(pc);
+
+	return err ? : pc->ops->prepare_merge(io, sd);
+}
+
+static int pcache_start_merge(struct ploop_io *io, struct ploop_snapdata *sd)
+{
+	struct ploop_cache *pc = io->cache;
+	int err = pcache_sync_all(pc);
+
+	return err ? : pc->ops->start_merge(io, sd);
+}
+
+static int pcache_open(struct ploop_io *io)
+{
+	return io->cache->ops->open(io);
+}
+
+static void pcache_unplug(struct ploop_io *io)
+{
+	struct ploop_cache *pc = io->cache;
+
+	if (pc->ops->unplug)
+		pc->ops->unplug(io);
+}
+
+static void pcache_submit_queued(struct ploop_io *io)
+{
+	struct ploop_cache *pc = io->cache;
+	struct pcache_req *pr, *tmp;
+	LIST_HEAD(list);
+
+	spin_lock_irq(&pc->lock);
+	list_splice_init(&pc->ready, &list);
+	spin_unlock_irq(&pc->lock);
+
+	list_for_each_entry_safe(pr, tmp, &list, list) {
+		list_del_init(&pr->list);
+		pcache_do_submit(pc, pr->preq, pr->rw, &pr->bl, pr->iblk,
+				 pr->size, pr);
+	}
+
+	if (pc->ops->submit_queued)
+		pc->ops->submit_queued(io);
+}
+
+static int pcache_congested(struct ploop_io *io, int bits)
+{
+	struct ploop_cache *pc = io->cache;
+
+	return pc->ops->congested ? pc->ops->congested(io, bits) : 0;
+}
+
+static int pcache_disable_merge(struct ploop_io *io, sector_t isector,
+				unsigned int len)
+{
+	struct ploop_cache *pc = io->cache;
+
+	return pc->ops->disable_merge ?
+		pc->ops->disable_merge(io, isector, len) : 0;
+}
+
+static void pcache_queue_settings(struct ploop_io *io, struct request_queue *q)
+{
+	struct ploop_cache *pc = io->cache;
+
+	if (pc->ops->queue_settings)
+		pc->ops->queue_settings(io, q);
+}
+
+static int pcache_dump(struct ploop_io *io)
+{
+	struct ploop_cache *pc = io->cache;
+
+	return pc->ops->dump ? pc->ops->dump(io) : -1;
+}
+
+static loff_t pcache_i_size_read(struct ploop_io *io)
+{
+	return io->cache->ops->i_size_read(io);
+}
+
+static fmode_t pcache_f_mode(struct ploop_io *io)
+{
+	return io->cache->ops->f_mode(io);
+}
+
+/* Setup and teardown */
+
+static void pcache_free(struct ploop_cache *pc)
+{
+	int i;
+
+	if (pc->table) {
+		for (i = 0; i < pc->nr_table; i++)
+			if (pc->table[i])
+				__free_page(pc->table[i]);
+		vfree(pc->table);
+	}
+	for (i = 0; i < PCACHE_COMMIT_PAGES; i++)
+		if (pc->cbuf[i])
+			__free_page(pc->cbuf[i]);
+	for (i = 0; i < PCACHE_MAX_PAGES; i++)
+		if (pc->wb_pages[i])
+			__free_page(pc->wb_pages[i]);
+	kfree(pc->table_dirty);
+	vfree(pc->hash);
+	vfree(pc->slots);
+	if (pc->file)
+		fput(pc->file);
+	kfree(pc);
+}
+
+static struct ploop_cache *pcache_create(struct ploop_io *io, struct file *file)
+{
+	struct ploop_cache *pc;
+	int i;
+
+	pc = kzalloc(sizeof(*pc), GFP_KERNEL);
+	if (!pc)
+		return NULL;
+
+	pc->io = io;
+	pc->ops = io->ops;
+	pc->file = file;
+	pc->cluster_log = io->plo->cluster_log;
+	pc->ppc = 1 << (pc->cluster_log + 9 - PAGE_SHIFT);
+
+	spin_lock_init(&pc->lock);
+	INIT_LIST_HEAD(&pc->free_list);
+	INIT_LIST_HEAD(&pc->lru);
+	INIT_LIST_HEAD(&pc->dirty_list);
+	INIT_LIST_HEAD(&pc->slot_waiters);
+	INIT_LIST_HEAD(&pc->ready);
+	INIT_LIST_HEAD(&pc->jobs);
+	INIT_LIST_HEAD(&pc->commit_list);
+	INIT_LIST_HEAD(&pc->flush_list);
+	init_waitqueue_head(&pc->waitq);
+	init_waitqueue_head(&pc->drain_waitq);
+	mutex_init(&pc->commit_mutex);
+	for (i = 0; i < (1 << PCACHE_GHOST_BITS); i++)
+		pc->ghost[i] = PCACHE_FREE;
+
+	for (i = 0; i < PCACHE_COMMIT_PAGES; i++)
+		if (!(pc->cbuf[i] = alloc_page(GFP_KERNEL)))
+			goto fail;
+	for (i = 0; i < pc->ppc; i++)
+		if (!(pc->wb_pages[i] = alloc_page(GFP_KERNEL)))
+			goto fail;
+
+	return pc;
+
+fail:
+	pc->file = NULL;
+	pcache_free(pc);
+	return NULL;
+}
+
+/* Allocates slots and in-memory table for the layout */
+static int pcache_setup(struct ploop_cache *pc, unsigned int nr_slots,
+			loff_t table_off, loff_t data_off)
+{
+	unsigned int i;
+
+	pc->nr_slots = nr_slots;
+	pc->table_off = table_off;
+	pc->data_off = data_off;
+	pc->nr_table = DIV_ROUND_UP(nr_slots, PCACHE_RECS_PER_PAGE);
+	pc->hash_bits = max(ilog2(roundup_pow_of_two(nr_slots)), 1);
+
+	pc->slots = vmalloc(nr_slots * sizeof(struct pcache_slot));
+	pc->hash = vmalloc(sizeof(struct hlist_head) << pc->hash_bits);
+	pc->table = vmalloc(pc->nr_table * sizeof(struct page *));
+	pc->table_dirty = kzalloc(BITS_TO_LONGS(pc->nr_table) *
+				  sizeof(unsigned long), GFP_KERNEL);
+	if (!pc->slots || !pc->hash || !pc->table || !pc->table_dirty)
+		return -ENOMEM;
+
+	memset(pc->table, 0, pc->nr_table * sizeof(struct page *));
+	for (i = 0; i < pc->nr_table; i++)
+		if (!(pc->table[i] = alloc_page(GFP_KERNEL)))
+			return -ENOMEM;
+
+	for (i = 0; i < (1U << pc->hash_bits); i++)
+		INIT_HLIST_HEAD(&pc->hash[i]);
+
+	memset(pc->slots, 0, nr_slots * sizeof(struct pcache_slot));
+	for (i = 0; i < nr_slots; i++) {
+		struct pcache_slot *slot = pc->slots + i;
+
+		INIT_LIST_HEAD(&slot->dirty_link);
+		INIT_LIST_HEAD(&slot->waiters);
+		slot->iblk = PCACHE_FREE;
+		list_add_tail(&slot->lru, &pc->free_list);
+	}
+	return 0;
+}
+
+/* All records free, committed */
+static int pcache_reset_table(struct ploop_cache *pc)
+{
+	unsigned int i;
+
+	spin_lock_irq(&pc->lock);
+	for (i = 0; i < pc->nr_table; i++)
+		memset(page_address(pc->table[i]), 0, PAGE_SIZE);
+	for (i = 0; i < pc->nr_slots; i++)
+		pcache_rec_update(pc, pc->slots + i);
+	spin_unlock_irq(&pc->lock);
+
+	return pcache_commit(pc);
+}
+
+static int pcache_write_hdr(struct ploop_cache *pc)
+{
+	struct inode *img = pc->io->files.inode;
+	struct pcache_hdr *hdr = page_address(pc->cbuf[0]);
+	int err;
+
+	memset(hdr, 0, PAGE_SIZE);
+	hdr->magic = cpu_to_le32(PCACHE_MAGIC);
+	hdr->version = cpu_to_le32(PCACHE_VERSION);
+	hdr->cluster_log = cpu_to_le32(pc->cluster_log);
+	hdr->nr_slots = cpu_to_le32(pc->nr_slots);
+	hdr->table_off = cpu_to_le64(pc->table_off);
+	hdr->data_off = cpu_to_le64(pc->data_off);
+	hdr->id = cpu_to_le64(pc->id);
+	hdr->gen = cpu_to_le64(pc->gen);
+	hdr->img_ino = cpu_to_le64(img->i_ino);
+	hdr->img_igen = cpu_to_le32(img->i_generation);
+
+	err = pcache_file_io(pc, 1, pc->cbuf, 1, 0);
+	return err ? : pcache_fsync(pc);
+}
+
+/* Returns -ENODATA if the image is not marked */
+static int pcache_get_mark(struct ploop_io *io, struct pcache_mark *mark)
+{
+	ssize_t ret;
+
+	ret = vfs_getxattr(io->files.file->f_path.dentry, PCACHE_XATTR,
+			   mark, sizeof(*mark));
+	if (ret == -EOPNOTSUPP)
+		return -ENODATA;
+	if (ret < 0)
+		return ret;
+	return ret == sizeof(*mark) ? 0 : -EINVAL;
+}
+
+/* Before any dirty data of this generation goes to the cache */
+static int pcache_set_mark(struct ploop_cache *pc)
+{
+	struct pcache_mark mark;
+	int err;
+
+	mark.id = cpu_to_le64(pc->id);
+	mark.gen = cpu_to_le64(pc->gen);
+	err = vfs_setxattr(pc->io->files.file->f_path.dentry, PCACHE_XATTR,
+			   &mark, sizeof(mark), 0);
+	return err ? : pc->ops->sync(pc->io);
+}
+
+/* Only when everything is written back */
+static void pcache_clear_mark(struct ploop_cache *pc)
+{
+	int err;
+
+	err = vfs_removexattr(pc->io->files.file->f_path.dentry, PCACHE_XATTR);
+	if (err && err != -ENODATA)
+		printk(KERN_WARNING "ploop%d: cannot unmark image: %d\n",
+		       pc->io->plo->index, err);
+}
+
+/* Image marked by a cache must not be started without it */
+int ploop_cache_check_image(struct ploop_delta *delta)
+{
+	struct pcache_mark mark;
+	int err;
+
+	if (delta->io.cache || (delta->flags & PLOOP_FMT_RDONLY))
+		return 0;
+
+	err = pcache_get_mark(&delta->io, &mark);
+	if (err == -ENODATA)
+		return 0;
+	if (!err) {
+		printk(KERN_WARNING "ploop%d: image has dirty data in cache "
+		       "%llx, attach it first\n", delta->plo->index,
+		       (unsigned long long)le64_to_cpu(mark.id));
+		err = -EBUSY;
+	}
+	return err;
+}
+
+static int pcache_format(struct ploop_cache *pc)
+{
+	loff_t size = i_size_read(pc->file->f_mapping->host);
+	loff_t cluster = 1 << (pc->cluster_log + 9);
+	loff_t table_off = PAGE_SIZE, data_off;
+	u64 nr;
+	int err;
+
+	if (size <= table_off)
+		return -ENOSPC;
+
+	nr = div64_u64(size - table_off, cluster + sizeof(struct pcache_rec));
+	nr = min_t(u64, nr, PCACHE_FREE);
+	data_off = ALIGN(table_off + ALIGN(nr * sizeof(struct pcache_rec),
+					   PAGE_SIZE), cluster);
+	if (data_off >= size)
+		return -ENOSPC;
+	nr = min_t(u64, nr, (size - data_off) >> (pc->cluster_log + 9));
+	if (!nr)
+		return -ENOSPC;
+
+	err = pcache_setup(pc, nr, table_off, data_off);
+	if (!err)
+		err = pcache_reset_table(pc);
+	if (err)
+		return err;
+
+	/* Header last: cache is not valid until the table is */
+	get_random_bytes(&pc->id, sizeof(pc->id));
+	pc->gen = 1;
+	return pcache_write_hdr(pc);
+}
+
+/* Writes back what was not written back before the cache went away */
+static int pcache_recover(struct ploop_cache *pc)
+{
+	loff_t size = i_size_read(pc->file->f_mapping->host);
+	iblock_t img_blocks = pc->ops->i_size_read(pc->io) >>
+			      (pc->cluster_log + 9);
+	struct inode *img = pc->io->files.inode;
+	struct pcache_hdr *hdr;
+	struct pcache_mark mark;
+	unsigned int nr, i, n, dirty = 0;
+	loff_t table_off, data_off;
+	int err, marked;
+
+	err = pcache_get_mark(pc->io, &mark);
+	if (err && err != -ENODATA)
+		return err;
+	marked = !err;
+
+	err = pcache_file_io(pc, 0, pc->cbuf, 1, 0);
+	if (err)
+		return err;
+
+	hdr = page_address(pc->cbuf[0]);
+	nr = le32_to_cpu(hdr->nr_slots);
+	table_off = le64_to_cpu(hdr->table_off);
+	data_off = le64_to_cpu(hdr->data_off);
+	pc->id = le64_to_cpu(hdr->id);
+	pc->gen = le64_to_cpu(hdr->gen);
+	if (le32_to_cpu(hdr->magic) != PCACHE_MAGIC ||
+	    le32_to_cpu(hdr->version) != PCACHE_VERSION ||
+	    le64_to_cpu(hdr->img_ino) != img->i_ino ||
+	    le32_to_cpu(hdr->img_igen) != img->i_generation ||
+	    le32_to_cpu(hdr->cluster_log) != pc->cluster_log ||
+	    !nr || nr == PCACHE_FREE || table_off != PAGE_SIZE ||
+	    data_off < table_off + (loff_t)nr * sizeof(struct pcache_rec) ||
+	    data_off & ((1 << (pc->cluster_log + 9)) - 1) ||
+	    data_off + ((loff_t)nr << (pc->cluster_log + 9)) > size)
+		return -EINVAL;
+
+	if (marked && le64_to_cpu(mark.id) != pc->id) {
+		printk(KERN_WARNING "ploop%d: image has dirty data in cache "
+		       "%llx\n", pc->io->plo->index,
+		       (unsigned long long)le64_to_cpu(mark.id));
+		return -EBUSY;
+	}
+
+	err = pcache_setup(pc, nr, table_off, data_off);
+	if (err)
+		return err;
+
+	for (i = 0; i < pc->nr_table; i += n) {
+		n = min_t(unsigned int, pc->nr_table - i, PCACHE_MAX_PAGES);
+		err = pcache_file_io(pc, 0, pc->table + i, n,
+				     table_off + ((loff_t)i << PAGE_SHIFT));
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct pcache_rec *rec = pcache_rec(pc, i);
+		struct pcache_slot *slot = pc->slots + i;
+		int w;
+
+		if (!(le32_to_cpu(rec->flags) & PCACHE_REC_DIRTY))
+			continue;
+
+		/* Image was used without the cache or cache is an old copy */
+		if (!marked || le64_to_cpu(mark.gen) != pc->gen) {
+			printk(KERN_WARNING "ploop%d: cache generation %llu "
+			       "does not match image, not replayed\n",
+			       pc->io->plo->index,
+			       (unsigned long long)pc->gen);
+			return -ESTALE;
+		}
+
+		slot->iblk = le32_to_cpu(rec->iblk);
+		if (slot->iblk >= img_blocks) {
+			printk(KERN_WARNING "ploop%d: cache slot %u points "
+			       "beyond image: %u\n", pc->io->plo->index, i,
+			       slot->iblk);
+			slot->iblk = PCACHE_FREE;
+			continue;
+		}
+		for (w = 0; w < PCACHE_MAP_WORDS; w++)
+			pcache_map_set_word(slot->dirty, w,
+					    le64_to_cpu(rec->dirty[w]));
+		bitmap_clear(slot->dirty, pc->ppc, PCACHE_MAX_PAGES - pc->ppc);
+
+		err = pcache_write_back(pc, slot);
+		slot->iblk = PCACHE_FREE;
+		bitmap_zero(slot->dirty, PCACHE_MAX_PAGES);
+		if (err)
+			return err;
+		dirty++;
+	}
+
+	if (dirty) {
+		printk(KERN_INFO "ploop%d: %u clusters written back from cache\n",
+		       pc->io->plo->index, dirty);
+		err = pc->ops->sync(pc->io);
+		if (err)
+			return err;
+	}
+
+	err = pcache_reset_table(pc);
+	if (err)
+		return err;
+
+	pc->gen++;
+	return pcache_write_hdr(pc);
+}
+
+static void pcache_destroy(struct ploop_io *io)
+{
+	struct ploop_cache *pc = io->cache;
+
+	/* The thread writes everything back before exit */
+	if (!kthread_stop(pc->thread))
+		pcache_clear_mark(pc);
+	io->ops = pc->ops;
+	io->cache = NULL;
+	pcache_free(pc);
+
+	io->ops->destroy(io);
+}
+
+static struct ploop_io_ops ploop_io_ops_cache =
+{
+	.id		=	PLOOP_IO_CACHE,
+	.name		=	"cache",
+	.owner		=	THIS_MODULE,
+
+	.unplug		=	pcache_unplug,
+	.submit_queued	=	pcache_submit_queued,
+	.congested	=	pcache_congested,
+
+	.alloc		=	pcache_alloc,
+	.submit		=	pcache_submit,
+	.submit_alloc	=	pcache_submit_alloc,
+	.disable_merge	=	pcache_disable_merge,
+	.read_page	=	pcache_read_page,
+	.write_page	=	pcache_write_page,
+	.sync_read	=	pcache_sync_read,
+	.sync_write	=	pcache_sync_write,
+	.sync_readvec	=	pcache_sync_readvec,
+	.sync_writevec	=	pcache_sync_writevec,
+
+	.destroy	=	pcache_destroy,
+	.open		=	pcache_open,
+	.sync		=	pcache_sync,
+	.stop		=	pcache_stop,
+	.prepare_snapshot =	pcache_prepare_snapshot,
+	.complete_snapshot =	pcache_complete_snapshot,
+	.prepare_merge	=	pcache_prepare_merge,
+	.start_merge	=	pcache_start_merge,
+	.truncate	=	pcache_truncate,
+	.queue_settings	=	pcache_queue_settings,
+	.issue_flush	=	pcache_issue_flush,
+	.dump		=	pcache_dump,
+	.i_size_read	=	pcache_i_size_read,
+	.f_mode		=	pcache_f_mode,
+};
+
+int ploop_cache_attach_ioc(struct ploop_device *plo, unsigned long arg)
+{
+	struct ploop_cache_ctl ctl;
+	struct ploop_delta *delta;
+	struct ploop_cache *pc;
+	struct file *file;
+	int err;
+
+	if (copy_from_user(&ctl, (void *)arg, sizeof(ctl)))
+		return -EFAULT;
+
+	if (ctl.flags & ~PLOOP_CACHE_FORMAT)
+		return -EINVAL;
+
+	if (list_empty(&plo->map.delta_list))
+		return -ENOENT;
+
+	delta = ploop_top_delta(plo);
+	if (delta->io.cache)
+		return -EBUSY;
+
+	if (delta->flags & PLOOP_FMT_RDONLY)
+		return -EINVAL;
+
+	if (plo->maintenance_type != PLOOP_MNTN_OFF)
+		return -EBUSY;
+
+	/* Replay must not overwrite what the running device wrote */
+	if (!(ctl.flags & PLOOP_CACHE_FORMAT) &&
+	    test_bit(PLOOP_S_RUNNING, &plo->state))
+		return -EBUSY;
+
+	if (plo->cluster_log + 9 < PAGE_SHIFT ||
+	    (1 << (plo->cluster_log + 9 - PAGE_SHIFT)) > PCACHE_MAX_PAGES)
+		return -EINVAL;
+
+	file = fget(ctl.fd);
+	if (!file)
+		return -EBADF;
+
+	err = -EINVAL;
+	if (!S_ISREG(file->f_mapping->host->i_mode) ||
+	    !(file->f_flags & O_DIRECT) ||
+	    (file->f_mode & (FMODE_READ | FMODE_WRITE)) !=
+	    (FMODE_READ | FMODE_WRITE) ||
+	    file->f_mapping == delta->io.files.mapping) {
+		fput(file);
+		return err;
+	}
+
+	pc = pcache_create(&delta->io, file);
+	if (!pc) {
+		fput(file);
+		return -ENOMEM;
+	}
+
+	/* Nothing goes to image meanwhile, recovery overwrites it */
+	ploop_quiesce(plo);
+
+	if (ctl.flags & PLOOP_CACHE_FORMAT) {
+		/* Dirty data of another cache would be lost */
+		err = ploop_cache_check_image(delta);
+		if (!err)
+			err = pcache_format(pc);
+	} else
+		err = pcache_recover(pc);
+	if (!err)
+		err = pcache_set_mark(pc);
+	if (err)
+		goto out;
+
+	pc->thread = kthread_create(pcache_thread, pc, "ploop_cache%d",
+				    plo->index);
+	if (IS_ERR(pc->thread)) {
+		err = PTR_ERR(pc->thread);
+		/* Nothing dirty in the cache yet */
+		pcache_clear_mark(pc);
+		goto out;
+	}
+	wake_up_process(pc->thread);
+
+	delta->io.cache = pc;
+	delta->io.ops = &ploop_io_ops_cache;
+out:
+	ploop_relax(plo);
+
+	if (err)
+		pcache_free(pc);
+	return err;
+}
+
+int ploop_cache_detach_ioc(struct ploop_device *plo)
+{
+	struct ploop_delta *delta;
+	struct ploop_cache *pc = NULL;
+	int err;
+
+	list_for_each_entry(delta, &plo->map.delta_list, list) {
+		if (delta->io.cache) {
+			pc = delta->io.cache;
+			break;
+		}
+	}
+	if (!pc)
+		return -ENOENT;
+
+	/* Most of it while the device runs */
+	err = pcache_sync_all(pc);
+	if (err)
+		return err;
+
+	ploop_quiesce(plo);
+	err = pcache_sync_all(pc);
+	if (!err) {
+		kthread_stop(pc->thread);
+		pcache_clear_mark(pc);
+		delta->io.ops = pc->ops;
+		delta->io.cache = NULL;
+	}
+	ploop_relax(plo);
+
+	if (!err)
+		pcache_free(pc);
+	return err;
+}
@@ -0,0 +1,10 @@
+#ifndef _LINUX_PLOOP_IO_CACHE_H_
+#define _LINUX_PLOOP_IO_CACHE_H_
+
+struct ploop_cache;
+
+extern int ploop_cache_attach_ioc(struct ploop_device *plo, unsigned long arg);
+extern int ploop_cache_detach_ioc(struct ploop_device *plo);
+extern int ploop_cache_check_image(struct ploop_delta *delta);
+
+#endif // _LINUX_PLOOP_IO_CACHE_H_
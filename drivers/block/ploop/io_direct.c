@@ -9,6 +9,7 @@
 #include <linux/buffer_head.h>
 #include <linux/falloc.h>
 #include <linux/magic.h>
+#include <linux/swap.h>
 
 #include <linux/ploop/ploop.h>
 #include <linux/ploop/ploop_if.h>
@@ -26,7 +27,6 @@
 
 #define PLOOP_MAX_PREALLOC(plo) (128 * 1024 * 1024) /* 128MB */
 
-#define PLOOP_MAX_EXTENT_MAP (64 * 1024 * 1024)    /* 64MB */
 int max_extent_map_pages __read_mostly;
 int min_extent_map_entries __read_mostly;
 
@@ -69,6 +69,143 @@ struct bio_list_walk
 static int cached_submit(struct ploop_io *io, iblock_t iblk,
 	      struct ploop_request * preq,
 	      struct bio_list * sbl, unsigned int size);
+static void dio_unplug(struct ploop_io * io);
+
+/*
+ * Plugging window. The main thread submits bios of subsequent preqs with
+ * the backing queue left plugged and unplugs it once before it goes to
+ * sleep, or every tune.dio_plug_batch preqs. Small sequential writes of
+ * different preqs, adjacent in the image after remapping through the BAT,
+ * are then merged into one request by the backing device elevator instead
+ * of being dispatched one by one.
+ */
+static inline int dio_may_plug(struct ploop_io * io)
+{
+	struct ploop_device * plo = io->plo;
+
+	return plo->tune.dio_plug_batch > 1 && current == plo->thread &&
+	       io == &ploop_top_delta(plo)->io;
+}
+
+/* Returns rw for the last bio of a preq */
+static unsigned long dio_plug_rw(struct ploop_io * io, unsigned long rw)
+{
+	if (!(rw & (1 << BIO_RW_UNPLUG)) || (rw & (BIO_FLUSH | BIO_FUA)) ||
+	    !dio_may_plug(io))
+		return rw;
+
+	io->plo->st.dio_plugged++;
+	if (++io->plug_len >= io->plo->tune.dio_plug_batch) {
+		io->plug_len = 0;
+		return rw;
+	}
+
+	return rw & ~(1 << BIO_RW_UNPLUG);
+}
+
+static void dio_submit_queued(struct ploop_io * io)
+{
+	if (current == io->plo->thread && io->plug_len) {
+		io->plug_len = 0;
+		dio_unplug(io);
+	}
+}
+
+/*
+ * Shared cache of read-only images.
+ *
+ * An image opened read-only by several ploop devices, usually the base
+ * delta of containers cloned from one template, has one ploop_mapping and
+ * one page cache. Nobody writes to it while it is shared, writers are
+ * exclusive, see ploop_dio_open(). Reads of such an image are copied from
+ * its page cache, when all the pages are there. Otherwise they go to disk
+ * as usual and, while the image is shared, the range is read ahead into
+ * the page cache for the other devices. The pages are charged to the host,
+ * not to the container which happened to read them first.
+ */
+static inline int dio_shared_cache(struct ploop_io * io)
+{
+	struct ploop_delta * delta = container_of(io, struct ploop_delta, io);
+
+	return io->plo->tune.shared_cache &&
+	       (delta->flags & PLOOP_FMT_RDONLY) &&
+	       ploop_dio_readers(io) > 0;
+}
+
+/* Returns 1 if preq is completed from cache */
+static int dio_shared_read(struct ploop_io * io, struct ploop_request * preq,
+			   struct bio_list * sbl, sector_t sec, unsigned int size)
+{
+	struct address_space * mapping = io->files.mapping;
+	loff_t pos = (loff_t)sec << 9;
+	unsigned int len = size << 9;
+	struct bio * bio;
+	int i;
+
+	if (!mapping->nrpages)
+		goto miss;
+
+	for (bio = sbl->head; bio && len; bio = bio->bi_next) {
+		for (i = 0; i < bio->bi_vcnt && len; i++) {
+			struct bio_vec * bv = bio->bi_io_vec + i;
+			unsigned int off = 0;
+
+			while (off < bv->bv_len && len) {
+				unsigned int poff = pos & ~PAGE_CACHE_MASK;
+				unsigned int copy;
+				struct page * page;
+				void * src, * dst;
+
+				copy = min3(bv->bv_len - off, len,
+					    (unsigned int)PAGE_CACHE_SIZE - poff);
+
+				page = find_get_page(mapping,
+						     pos >> PAGE_CACHE_SHIFT);
+				if (!page)
+					goto miss;
+				if (!PageUptodate(page)) {
+					page_cache_release(page);
+					goto miss;
+				}
+
+				src = kmap_atomic(page, KM_USER0);
+				dst = kmap_atomic(bv->bv_page, KM_USER1);
+				memcpy(dst + bv->bv_offset + off, src + poff, copy);
+				kunmap_atomic(dst, KM_USER1);
+				kunmap_atomic(src, KM_USER0);
+
+				mark_page_accessed(page);
+				page_cache_release(page);
+
+				off += copy;
+				pos += copy;
+				len -= copy;
+			}
+		}
+	}
+
+	preq->plo->st.bio_shared_hits++;
+	ploop_prepare_io_request(preq);
+	ploop_complete_io_request(preq);
+	return 1;
+
+miss:
+	if (ploop_dio_readers(io) > 1) {
+#ifdef CONFIG_BEANCOUNTERS
+		struct user_beancounter * ub = set_exec_ub(get_ub0());
+#endif
+		pgoff_t start = ((loff_t)sec << 9) >> PAGE_CACHE_SHIFT;
+		pgoff_t end = (((loff_t)(sec + size) << 9) - 1) >> PAGE_CACHE_SHIFT;
+
+		page_cache_sync_readahead(mapping, &io->files.file->f_ra,
+					  io->files.file, start,
+					  end - start + 1);
+#ifdef CONFIG_BEANCOUNTERS
+		set_exec_ub(ub);
+#endif
+	}
+	return 0;
+}
 
 static void
 dio_submit(struct ploop_io *io, struct ploop_request * preq,
@@ -118,6 +255,10 @@ dio_submit(struct ploop_io *io, struct ploop_request * preq,
 	sec = sbl->head->bi_sector;
 	sec = ((sector_t)iblk << preq->plo->cluster_log) | (sec & ((1<<preq->plo->cluster_log) - 1));
 
+	if (!write && dio_shared_cache(io) &&
+	    dio_shared_read(io, preq, sbl, sec, size))
+		return;
+
 	em = extent_lookup_create(io, sec, size);
 	if (IS_ERR(em))
 		goto out_em_err;
@@ -236,6 +377,8 @@ flush_bio:
 		}
 		if (unlikely(postfua && !bl.head))
 			rw2 |= (BIO_FUA | ((bio_num) ? BIO_FLUSH : 0));
+		if (!bl.head)
+			rw2 = dio_plug_rw(io, rw2);
 
 		ploop_acc_ff_out(preq->plo, rw2 | b->bi_rw);
 		submit_bio(rw2 & ~(bl.head ? (1 << BIO_RW_UNPLUG) : 0), b);
@@ -454,6 +597,7 @@ try_again:
 		ploop_acc_flush_skip_locked(plo, preq->req_rw);
 		preq->iblock = iblk;
 		list_add_tail(&preq->list, &io->fsync_queue);
+		ploop_lat_account(preq, PLOOP_LAT_FSYNC);
 		plo->st.bio_syncwait++;
 		if ((test_bit(PLOOP_REQ_SYNC, &preq->state) ||
 		     ++io->fsync_qlen >= plo->tune.fsync_max) &&
@@ -606,6 +750,8 @@ flush_bio:
 			rw |= BIO_FLUSH;
 			preflush = 0;
 		}
+		if (!bl.head)
+			rw = dio_plug_rw(io, rw);
 		ploop_acc_ff_out(preq->plo, rw | b->bi_rw);
 		submit_bio(rw & ~(bl.head ? (1 << BIO_RW_UNPLUG) : 0), b);
 	}
@@ -722,7 +868,8 @@ static int dio_fsync_thread(void * data)
 
 	spin_lock_irq(&plo->lock);
 	while (!kthread_should_stop() || !list_empty(&io->fsync_queue)) {
-		int err;
+		int err, nr = 0;
+		ktime_t start;
 		LIST_HEAD(list);
 
 		DEFINE_WAIT(_wait);
@@ -741,11 +888,14 @@ static int dio_fsync_thread(void * data)
 		if (list_empty(&io->fsync_queue) && kthread_should_stop())
 			break;
 
+		ploop_fsync_group_wait(io);
+
 		INIT_LIST_HEAD(&list);
 		list_splice_init(&io->fsync_queue, &list);
 		spin_unlock_irq(&plo->lock);
 
 		/* filemap_fdatawrite() has been made already */
+		start = ktime_get();
 		filemap_fdatawait(io->files.mapping);
 
 		err = 0;
@@ -772,8 +922,10 @@ static int dio_fsync_thread(void * data)
 				PLOOP_REQ_SET_ERROR(preq, err);
 			list_add_tail(&preq->list, &plo->ready_queue);
 			io->fsync_qlen--;
+			nr++;
 		}
 		plo->st.bio_fsync++;
+		ploop_fsync_account(io, start, nr);
 
 		if (test_bit(PLOOP_S_WAIT_PROCESS, &plo->state))
 			wake_up_interruptible(&plo->waitq);
@@ -864,8 +1016,10 @@ static void dio_destroy(struct ploop_io * io)
 		if (io->files.em_tree) {
 			io->files.em_tree = NULL;
 			mutex_lock(&io->files.inode->i_mutex);
-			ploop_dio_close(io, delta->flags & PLOOP_FMT_RDONLY);
-			(void)dio_invalidate_cache(io->files.mapping, io->files.bdev);
+			/* Page cache of a shared image is used by others */
+			if (!ploop_dio_close(io, delta->flags & PLOOP_FMT_RDONLY))
+				(void)dio_invalidate_cache(io->files.mapping,
+							   io->files.bdev);
 			mutex_unlock(&io->files.inode->i_mutex);
 		}
 
@@ -929,6 +1083,10 @@ static int dio_open(struct ploop_io * io)
 
 	io->files.em_tree = em_tree;
 
+	/* Others reading it keep page cache coherent, see dio_shared_read() */
+	if ((delta->flags & PLOOP_FMT_RDONLY) && ploop_dio_readers(io) > 1)
+		goto out;
+
 	err = dio_invalidate_cache(io->files.mapping, io->files.bdev);
 	if (err) {
 		io->files.em_tree = NULL;
@@ -1491,6 +1649,11 @@ dio_fastmap(struct ploop_io * io, struct bio * orig_bio,
 		return 0;
 	}
 
+	/* Reads of shared image go through its page cache in dio_submit() */
+	if (dio_shared_cache(io) &&
+	    (io->files.mapping->nrpages || ploop_dio_readers(io) > 1))
+		return 1;
+
 	em = extent_lookup(io->files.em_tree, isec);
 
 	if (em == NULL) {
@@ -1682,6 +1845,8 @@ static int dio_prepare_merge(struct ploop_io * io, struct ploop_snapdata *sd)
 		fput(file);
 		return err;
 	}
+	/* Drop pages read ahead for the devices sharing it until now */
+	(void)invalidate_inode_pages2(io->files.mapping);
 	mutex_unlock(&io->files.inode->i_mutex);
 
 	if (!io->files.em_tree->_get_extent) {
@@ -1857,6 +2022,7 @@ static struct ploop_io_ops ploop_io_ops_direct =
 	.owner		=	THIS_MODULE,
 
 	.unplug		=	dio_unplug,
+	.submit_queued	=	dio_submit_queued,
 	.congested	=	dio_congested,
 
 	.alloc		=	dio_alloc_sync,
@@ -1894,7 +2060,7 @@ static struct ploop_io_ops ploop_io_ops_direct =
 };
 
 module_param(max_extent_map_pages, int, 0644);
-MODULE_PARM_DESC(max_extent_map_pages, "Maximal amount of pages taken by all extent map caches");
+MODULE_PARM_DESC(max_extent_map_pages, "Maximal amount of pages taken by all extent map caches, 0 - adapt to the size of images and RAM");
 module_param(min_extent_map_entries, int, 0644);
 MODULE_PARM_DESC(min_extent_map_entries, "Minimal amount of entries in a single extent map cache");
 
@@ -1902,9 +2068,6 @@ static int __init pio_direct_mod_init(void)
 {
 	int err;
 
-	if (max_extent_map_pages == 0)
-		max_extent_map_pages = PLOOP_MAX_EXTENT_MAP >> PAGE_SHIFT;
-
 	if (min_extent_map_entries == 0)
 		min_extent_map_entries = 64;
 
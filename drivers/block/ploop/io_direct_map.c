@@ -8,6 +8,9 @@
 #include <linux/buffer_head.h>
 #include <linux/interrupt.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/swap.h>
 
 #include <linux/ploop/ploop_if.h>
 #include "io_direct_events.h"
@@ -61,6 +64,13 @@ ploop_dio_open(struct ploop_io * io, int rdonly)
 	struct address_space * mapping = file->f_mapping;
 
 	pm = kzalloc(sizeof(struct ploop_mapping), GFP_KERNEL);
+	if (pm) {
+		pm->extent_root.last_hit = alloc_percpu(struct extent_map *);
+		if (pm->extent_root.last_hit == NULL) {
+			kfree(pm);
+			pm = NULL;
+		}
+	}
 
 	err = 0;
 	spin_lock(&ploop_mappings_lock);
@@ -80,8 +90,10 @@ ploop_dio_open(struct ploop_io * io, int rdonly)
 
 out_unlock:
 			spin_unlock(&ploop_mappings_lock);
-			if (pm)
+			if (pm) {
+				free_percpu(pm->extent_root.last_hit);
 				kfree(pm);
+			}
 			if (!err)
 				io->size_ptr = &m->size;
 			return err ? ERR_PTR(err) : &m->extent_root;
@@ -162,12 +174,22 @@ ploop_dio_close(struct ploop_io * io, int rdonly)
 	if (pm) {
 		drop_extent_map(&pm->extent_root);
 		BUG_ON(pm->extent_root.map_size);
+		free_percpu(pm->extent_root.last_hit);
 		kfree(pm);
 		return 0;
 	}
 	return -ENOENT;
 }
 
+/* Number of read-only users of the image, -1 if it is opened for write */
+int ploop_dio_readers(struct ploop_io * io)
+{
+	struct ploop_mapping * m = container_of(io->size_ptr,
+						struct ploop_mapping, size);
+
+	return ACCESS_ONCE(m->readers);
+}
+
 void ploop_dio_downgrade(struct address_space * mapping)
 {
 	struct ploop_mapping * m;
@@ -236,6 +258,8 @@ int __init extent_map_init(void)
 
 void extent_map_exit(void)
 {
+	/* extents are freed from rcu callbacks */
+	rcu_barrier();
 	if (extent_map_cache)
 		kmem_cache_destroy(extent_map_cache);
 }
@@ -255,22 +279,93 @@ struct extent_map *alloc_extent_map(gfp_t mask)
 	em = kmem_cache_alloc(extent_map_cache, GFP_NOFS);
 	if (em) {
 		atomic_set(&em->refs, 1);
+		em->referenced = 0;
 		INIT_LIST_HEAD(&em->lru_link);
 		atomic_inc(&ploop_extent_maps_count);
 	}
 	return em;
 }
 
+static void extent_free_rcu(struct rcu_head *head)
+{
+	struct extent_map *em = container_of(head, struct extent_map, rcu);
+
+	kmem_cache_free(extent_map_cache, em);
+}
+
+/*
+ * The last_hit caches are read under rcu_read_lock() only, so an extent
+ * is freed after a grace period, when nobody can see it in a cache.
+ */
 void extent_put(struct extent_map *em)
 {
 	if (!em)
 		return;
 	if (atomic_dec_and_test(&em->refs)) {
 		atomic_dec(&ploop_extent_maps_count);
-		kmem_cache_free(extent_map_cache, em);
+		call_rcu(&em->rcu, extent_free_rcu);
 	}
 }
 
+/*
+ * The last_hit slot of this cpu is only a hint: being preempted and
+ * using the slot of another cpu is harmless.
+ */
+static inline struct extent_map **extent_cache_slot(struct extent_map_tree *tree)
+{
+	return per_cpu_ptr(tree->last_hit, raw_smp_processor_id());
+}
+
+/* Must be called with tree->lock held, so that em is in the tree */
+static inline void extent_cache_set(struct extent_map_tree *tree,
+				    struct extent_map *em)
+{
+	if (tree->last_hit)
+		rcu_assign_pointer(*extent_cache_slot(tree), em);
+}
+
+/*
+ * Lockless lookup of the extent containing "start" in the cache of this
+ * cpu. An extent in the cache is in the tree: it is removed from all
+ * the caches under tree->lock before being taken out of the tree.
+ */
+static struct extent_map *extent_cache_lookup(struct extent_map_tree *tree,
+					      sector_t start)
+{
+	struct extent_map *em;
+
+	if (!tree->last_hit)
+		return NULL;
+
+	rcu_read_lock();
+	em = rcu_dereference(*extent_cache_slot(tree));
+	if (em && (start < em->start || start >= em->end ||
+		   !atomic_inc_not_zero(&em->refs)))
+		em = NULL;
+	rcu_read_unlock();
+
+	if (em && !em->referenced)
+		em->referenced = 1;
+	return em;
+}
+
+/*
+ * Takes em out of the tree, the caller drops the reference of the tree.
+ * Called with tree->lock held for write.
+ */
+static void extent_unlink(struct extent_map_tree *tree, struct extent_map *em)
+{
+	int cpu;
+
+	rb_erase(&em->rb_node, &tree->map);
+	list_del_init(&em->lru_link);
+	tree->map_size--;
+
+	if (tree->last_hit)
+		for_each_possible_cpu(cpu)
+			(void)cmpxchg(per_cpu_ptr(tree->last_hit, cpu), em, NULL);
+}
+
 static struct rb_node *tree_insert(struct rb_root *root, sector_t start,
 				   sector_t end, struct rb_node *node)
 {
@@ -342,14 +437,14 @@ static inline struct rb_node *tree_search(struct rb_root *root, sector_t offset)
 	return ret;
 }
 
-static int tree_delete(struct rb_root *root, sector_t offset)
+static int tree_delete(struct extent_map_tree *tree, sector_t offset)
 {
 	struct rb_node *node;
 
-	node = __tree_search(root, offset, NULL);
+	node = __tree_search(&tree->map, offset, NULL);
 	if (!node)
 		return -ENOENT;
-	rb_erase(node, root);
+	extent_unlink(tree, rb_entry(node, struct extent_map, rb_node));
 	return 0;
 }
 
@@ -361,10 +456,40 @@ static int mergable_maps(struct extent_map *prev, struct extent_map *next)
 	return 0;
 }
 
+/*
+ * With max_extent_map_pages left at 0 the budget is not fixed: it is
+ * PLOOP_EXTENT_MAP_MIN, raised to map all the images fully even if their
+ * files are fragmented down to PLOOP_EXTENT_MAP_GRAIN, but to no more
+ * than 1/PLOOP_EXTENT_MAP_RAM_PART of RAM. The entries are only made for
+ * extents really used, so unfragmented images take no more than before.
+ */
+#define PLOOP_EXTENT_MAP_MIN		(64 * 1024 * 1024)
+#define PLOOP_EXTENT_MAP_GRAIN		(256 * 1024)
+#define PLOOP_EXTENT_MAP_RAM_PART	64
+/* how many hit extents purge may skip looking for a victim */
+#define PLOOP_EXTENT_MAP_CHANCES	8
+
+static inline int extent_map_max_entries(void)
+{
+	unsigned long entries, floor, limit;
+
+	if (max_extent_map_pages)
+		return ((unsigned long)max_extent_map_pages << PAGE_SHIFT) /
+			sizeof(struct extent_map);
+
+	floor = PLOOP_EXTENT_MAP_MIN / sizeof(struct extent_map);
+	limit = (totalram_pages / PLOOP_EXTENT_MAP_RAM_PART) *
+		(PAGE_SIZE / sizeof(struct extent_map));
+	entries = (unsigned long)atomic_long_read(&ploop_io_images_size) /
+		PLOOP_EXTENT_MAP_GRAIN;
+	entries = max(min(entries, limit), floor);
+
+	return min_t(unsigned long, entries, INT_MAX);
+}
+
 static inline int purge_lru_mapping(struct extent_map_tree *tree)
 {
-	int max_entries = (max_extent_map_pages << PAGE_SHIFT) /
-		sizeof(struct extent_map);
+	int max_entries = extent_map_max_entries();
 
 	return atomic_read(&ploop_extent_maps_count) > max_entries &&
 	       tree->map_size > max(1, min_extent_map_entries) &&
@@ -374,8 +499,7 @@ static inline int purge_lru_mapping(struct extent_map_tree *tree)
 
 static inline void purge_lru_warn(struct extent_map_tree *tree)
 {
-	int max_entries = (max_extent_map_pages << PAGE_SHIFT) /
-		sizeof(struct extent_map);
+	int max_entries = extent_map_max_entries();
 
 	loff_t ratio = i_size_read(tree->mapping->host) * 100;
 	do_div(ratio, atomic_long_read(&ploop_io_images_size));
@@ -387,9 +511,10 @@ static inline void purge_lru_warn(struct extent_map_tree *tree)
 	/* Claim FS as 'too fragmented' if average_extent_size < 8MB */
 	if ((u64)max_entries * (8 * 1024 * 1024) <
 	    atomic_long_read(&ploop_io_images_size))
-		printk(KERN_WARNING "max_extent_map_pages=%d is too low for "
+		printk(KERN_WARNING "max_extent_map_pages=%lu is too low for "
 		       "ploop_io_images_size=%ld bytes\n",
-		       max_extent_map_pages,
+		       (unsigned long)max_entries * sizeof(struct extent_map)
+				>> PAGE_SHIFT,
 		       atomic_long_read(&ploop_io_images_size));
 	else {
 		loff_t avg_siz = i_size_read(tree->mapping->host);
@@ -432,9 +557,7 @@ static int add_extent_mapping(struct extent_map_tree *tree,
 			}
 			if (tmp->end > em->end)
 				em->end = tmp->end;
-			rb_erase(rb, &tree->map);
-			list_del_init(&tmp->lru_link);
-			tree->map_size--;
+			extent_unlink(tree, tmp);
 			extent_put(tmp);
 		} else {
 			list_add_tail(&em->lru_link, &tree->lru_list);
@@ -443,19 +566,33 @@ static int add_extent_mapping(struct extent_map_tree *tree,
 			if (purge_lru_mapping(tree)) {
 				struct extent_map *victim_em;
 				static unsigned long purge_lru_time;
+				int chances = PLOOP_EXTENT_MAP_CHANCES;
 
 				/* Warn about this once per hour */
 				if (printk_timed_ratelimit(&purge_lru_time,
 							   60*60*HZ))
 					purge_lru_warn(tree);
 
-				victim_em = list_entry(tree->lru_list.next,
-						       struct extent_map,
-						       lru_link);
-
-				list_del_init(&victim_em->lru_link);
-				tree->map_size--;
-				rb_erase(&victim_em->rb_node, &tree->map);
+				/*
+				 * Hits do not reorder the list, they mark
+				 * the extent instead. Marked ones are given
+				 * a second chance, as in CLOCK.
+				 */
+				for (;;) {
+					victim_em = list_entry(tree->lru_list.next,
+							       struct extent_map,
+							       lru_link);
+					if (victim_em != em &&
+					    (!victim_em->referenced ||
+					     chances <= 0))
+						break;
+					chances--;
+					victim_em->referenced = 0;
+					list_move_tail(&victim_em->lru_link,
+						       &tree->lru_list);
+				}
+
+				extent_unlink(tree, victim_em);
 				extent_put(victim_em);
 			}
 		}
@@ -471,9 +608,7 @@ static int add_extent_mapping(struct extent_map_tree *tree,
 			if (mergable_maps(merge, em)) {
 				em->start = merge->start;
 				em->block_start = merge->block_start;
-				rb_erase(&merge->rb_node, &tree->map);
-				list_del_init(&merge->lru_link);
-				tree->map_size--;
+				extent_unlink(tree, merge);
 				extent_put(merge);
 			}
 		}
@@ -485,13 +620,12 @@ static int add_extent_mapping(struct extent_map_tree *tree,
 		merge = rb_entry(rb, struct extent_map, rb_node);
 		if (mergable_maps(em, merge)) {
 			em->end = merge->end;
-			rb_erase(&merge->rb_node, &tree->map);
-			list_del_init(&merge->lru_link);
-			tree->map_size--;
+			extent_unlink(tree, merge);
 			extent_put(merge);
 		}
 	}
 
+	extent_cache_set(tree, em);
 	trace_add_extent_mapping(em);
 out:
 	write_unlock_irq(&tree->lock);
@@ -501,29 +635,24 @@ out:
 struct extent_map *
 extent_lookup(struct extent_map_tree *tree, sector_t start)
 {
-	struct extent_map *em = NULL;
+	struct extent_map *em;
 	struct rb_node *rb_node;
 
+	em = extent_cache_lookup(tree, start);
+	if (em)
+		return em;
+
 	/* extent_lookup() is called under plo->lock, so irq is disabled */
 	read_lock(&tree->lock);
 	rb_node = __tree_search(&tree->map, start, NULL);
 	if (rb_node) {
 		em = rb_entry(rb_node, struct extent_map, rb_node);
 		atomic_inc(&em->refs);
+		em->referenced = 1;
+		extent_cache_set(tree, em);
 	}
 	read_unlock(&tree->lock);
 
-	if (em) {
-		write_lock(&tree->lock);
-		/* em could not be released, but could be deleted
-		 * from the list before we re-acquired the lock */
-		if (!list_empty(&em->lru_link)) {
-			list_del(&em->lru_link);
-			list_add_tail(&em->lru_link, &tree->lru_list);
-		}
-		write_unlock(&tree->lock);
-	}
-
 	return em;
 }
 
@@ -539,6 +668,11 @@ lookup_extent_mapping(struct extent_map_tree *tree, sector_t start, sector_t len
 	struct extent_map *em;
 	struct rb_node *rb_node;
 
+	/* an extent containing start is the first one to intersect */
+	em = extent_cache_lookup(tree, start);
+	if (em)
+		return em;
+
 	read_lock_irq(&tree->lock);
 	rb_node = tree_search(&tree->map, start);
 	if (!rb_node) {
@@ -551,6 +685,7 @@ lookup_extent_mapping(struct extent_map_tree *tree, sector_t start, sector_t len
 		goto out;
 	}
 	atomic_inc(&em->refs);
+	extent_cache_set(tree, em);
 
 out:
 	read_unlock_irq(&tree->lock);
@@ -566,11 +701,7 @@ static int remove_extent_mapping(struct extent_map_tree *tree, struct extent_map
 	int ret;
 
 	write_lock_irq(&tree->lock);
-	ret = tree_delete(&tree->map, em->start);
-	if (!ret) {
-		list_del_init(&em->lru_link);
-		tree->map_size--;
-	}
+	ret = tree_delete(tree, em->start);
 	write_unlock_irq(&tree->lock);
 	return ret;
 }
@@ -823,9 +954,7 @@ static int drop_extent_map(struct extent_map_tree *tree)
 	write_lock_irq(&tree->lock);
 	while ((node = tree->map.rb_node) != NULL) {
 		em = rb_entry(node, struct extent_map, rb_node);
-		rb_erase(node, &tree->map);
-		list_del_init(&em->lru_link);
-		tree->map_size--;
+		extent_unlink(tree, em);
 		extent_put(em);
 	}
 	write_unlock_irq(&tree->lock);
@@ -2,6 +2,7 @@
 #define __INTERVAL_TREE_H__
 
 #include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 
 #define BLOCK_UNINIT ~((sector_t) 0)
 
@@ -11,6 +12,8 @@ struct extent_map_tree
 	struct list_head lru_list;
 	unsigned int map_size; /* # entries in map */
 	rwlock_t lock;
+	/* per-cpu extent found last, looked up with no lock taken */
+	struct extent_map ** last_hit;
 	struct address_space * mapping;
 	int (*_get_extent)(struct inode *inode, sector_t isec,
 			   unsigned int nr, sector_t *start,
@@ -28,6 +31,9 @@ struct extent_map
 	sector_t	block_start;
 
 	atomic_t refs;
+	/* hit since it was last seen by purge */
+	int		referenced;
+	struct rcu_head	rcu;
 };
 
 extern int max_extent_map_pages;
@@ -52,6 +58,7 @@ void trim_extent_mappings(struct extent_map_tree *tree, sector_t start);
 
 int ploop_dio_close(struct ploop_io * io, int rdonly);
 struct extent_map_tree * ploop_dio_open(struct ploop_io * io, int rdonly);
+int ploop_dio_readers(struct ploop_io * io);
 void ploop_dio_downgrade(struct address_space * mapping);
 int ploop_dio_upgrade(struct ploop_io * io);
 
@@ -14,6 +14,7 @@
 #define KAIO_PREALLOC (128 * 1024 * 1024) /* 128 MB */
 
 #define KAIO_MAX_PAGES_PER_REQ 32	  /* 128 KB */
+#define KAIO_MAX_PAGES_PER_BATCH 128	  /* 512 KB */
 
 /* This will be used as flag "ploop_kaio_open() succeeded" */
 static struct extent_map_tree
@@ -40,6 +41,8 @@ static void __kaio_queue_fsync_req(struct ploop_request * preq, int prio)
 		list_add_tail(&preq->list, &io->fsync_queue);
 
 	io->fsync_qlen++;
+	if (preq->lat_phase == PLOOP_LAT_AUTO)
+		preq->lat_phase = PLOOP_LAT_FSYNC;
 	if (waitqueue_active(&io->fsync_waitq))
 		wake_up_interruptible(&io->fsync_waitq);
 }
@@ -81,6 +84,7 @@ static void kaio_complete_io_state(struct ploop_request * preq)
 
 	if (post_fsync) {
 		spin_lock_irqsave(&plo->lock, flags);
+		ploop_lat_account(preq, PLOOP_LAT_FSYNC);
 		kaio_queue_fsync_req(preq);
 		plo->st.bio_syncwait++;
 		spin_unlock_irqrestore(&plo->lock, flags);
@@ -96,6 +100,18 @@ static void kaio_complete_io_request(struct ploop_request * preq)
 
 struct kaio_req {
 	struct ploop_request *preq;
+	struct list_head      list;	/* in io->plug_list */
+	struct kaio_req	     *next;	/* shares iocb with us */
+	loff_t		      pos;
+	size_t		      count;
+	unsigned long	      rw;
+	int		      nr_segs;
+	struct bio_vec	      bvecs[0];
+};
+
+/* Several kreqs adjacent in the file submitted as one iocb */
+struct kaio_batch {
+	struct kaio_req	     *head;
 	struct bio_vec	      bvecs[0];
 };
 
@@ -142,8 +158,10 @@ static struct kaio_req *kaio_kreq_alloc(struct ploop_request *preq, int *nr_p)
 	return kreq;
 }
 
-static int kaio_kernel_submit(struct file *file, struct kaio_req *kreq,
-		size_t nr_segs, size_t count, loff_t pos, unsigned long rw)
+static int __kaio_kernel_submit(struct file *file, struct bio_vec *bvecs,
+		size_t nr_segs, size_t count, loff_t pos, unsigned long rw,
+		void (*end_io)(u64, long), u64 data,
+		struct ploop_request *preq)
 {
 	struct kiocb *iocb;
 	unsigned short op;
@@ -159,19 +177,160 @@ static int kaio_kernel_submit(struct file *file, struct kaio_req *kreq,
 	else
 		op = IOCB_CMD_READ_ITER;
 
-	iov_iter_init_bvec(&iter, kreq->bvecs, nr_segs, count, 0);
+	iov_iter_init_bvec(&iter, bvecs, nr_segs, count, 0);
 	aio_kernel_init_iter(iocb, file, op, &iter, pos);
-	aio_kernel_init_callback(iocb, kaio_rw_kreq_complete, (u64)kreq);
+	aio_kernel_init_callback(iocb, end_io, data);
 
 	err = aio_kernel_submit(iocb);
 	if (err)
 		printk("kaio_kernel_submit: aio_kernel_submit failed with "
 		       "err=%d (rw=%s; state=%ld/0x%lx; pos=%lld; len=%ld)\n",
 		       err, (rw & (1<<BIO_RW)) ? "WRITE" : "READ",
-		       kreq->preq->eng_state, kreq->preq->state, pos, count);
+		       preq->eng_state, preq->state, pos, count);
 	return err;
 }
 
+static int kaio_kernel_submit(struct file *file, struct kaio_req *kreq,
+		size_t nr_segs, size_t count, loff_t pos, unsigned long rw)
+{
+	return __kaio_kernel_submit(file, kreq->bvecs, nr_segs, count, pos, rw,
+				    kaio_rw_kreq_complete, (u64)kreq,
+				    kreq->preq);
+}
+
+static void kaio_rw_batch_complete(u64 data, long res)
+{
+	struct kaio_batch *batch = (struct kaio_batch *)data;
+	struct kaio_req *kreq = batch->head;
+
+	kfree(batch);
+
+	while (kreq) {
+		struct kaio_req *next = kreq->next;
+
+		kaio_rw_kreq_complete((u64)kreq, res);
+		kreq = next;
+	}
+}
+
+static void kaio_submit_kreq(struct file *file, struct kaio_req *kreq)
+{
+	int err;
+
+	err = kaio_kernel_submit(file, kreq, kreq->nr_segs, kreq->count,
+				 kreq->pos, kreq->rw);
+	if (err)
+		kaio_rw_kreq_complete((u64)kreq, err);
+}
+
+/*
+ * Submit kreqs queued by the main thread. Runs of kreqs going in the same
+ * direction and continuing each other in the file are glued into a single
+ * iocb, so that a sequential stream split over several preqs costs one
+ * aio submission instead of one per preq.
+ */
+static void kaio_submit_queued(struct ploop_io * io)
+{
+	struct file *file = io->files.file;
+
+	while (!list_empty(&io->plug_list)) {
+		struct kaio_req *head, *tail, *kreq;
+		struct kaio_batch *batch;
+		size_t count;
+		int nr_segs, nr = 1;
+		int err;
+
+		head = list_first_entry(&io->plug_list, struct kaio_req, list);
+		list_del(&head->list);
+		head->next = NULL;
+		tail = head;
+		count = head->count;
+		nr_segs = head->nr_segs;
+
+		while (!list_empty(&io->plug_list)) {
+			kreq = list_first_entry(&io->plug_list,
+						struct kaio_req, list);
+			if (((kreq->rw ^ head->rw) & (1<<BIO_RW)) ||
+			    kreq->pos != head->pos + count ||
+			    nr_segs + kreq->nr_segs > KAIO_MAX_PAGES_PER_BATCH)
+				break;
+
+			list_del(&kreq->list);
+			kreq->next = NULL;
+			tail->next = kreq;
+			tail = kreq;
+			count += kreq->count;
+			nr_segs += kreq->nr_segs;
+			nr++;
+		}
+
+		if (nr == 1) {
+			kaio_submit_kreq(file, head);
+			continue;
+		}
+
+		batch = kmalloc(offsetof(struct kaio_batch, bvecs[nr_segs]),
+				GFP_NOIO);
+		if (!batch) {
+			while (head) {
+				kreq = head->next;
+				kaio_submit_kreq(file, head);
+				head = kreq;
+			}
+			continue;
+		}
+
+		batch->head = head;
+		nr_segs = 0;
+		for (kreq = head; kreq; kreq = kreq->next) {
+			memcpy(batch->bvecs + nr_segs, kreq->bvecs,
+			       kreq->nr_segs * sizeof(struct bio_vec));
+			nr_segs += kreq->nr_segs;
+		}
+
+		io->plo->st.kaio_merges += nr - 1;
+
+		err = __kaio_kernel_submit(file, batch->bvecs, nr_segs, count,
+					   head->pos, head->rw,
+					   kaio_rw_batch_complete, (u64)batch,
+					   head->preq);
+		if (err)
+			kaio_rw_batch_complete((u64)batch, err);
+	}
+
+	io->plug_len = 0;
+}
+
+/* plug_list belongs to the main thread, nobody else may touch it */
+static inline void kaio_flush_plug(struct ploop_io * io)
+{
+	if (current == io->plo->thread && !list_empty(&io->plug_list))
+		kaio_submit_queued(io);
+}
+
+static void kaio_queue_kreq(struct ploop_io * io, struct kaio_req *kreq)
+{
+	list_add_tail(&kreq->list, &io->plug_list);
+	io->plo->st.kaio_plugged++;
+
+	if (++io->plug_len >= io->plo->tune.kaio_batch)
+		kaio_submit_queued(io);
+}
+
+/*
+ * kreqs are held back only on behalf of the main thread and only for
+ * the top delta: ploop_wait() submits them before the thread goes to
+ * sleep, and the device cannot be quiesced (hence top delta cannot
+ * change) until then.
+ */
+static inline int kaio_may_plug(struct ploop_io * io)
+{
+	struct ploop_device * plo = io->plo;
+
+	return plo->tune.kaio_batch > 1 && current == plo->thread &&
+	       io == &ploop_top_delta(plo)->io;
+}
+
 /*
  * Pack as many bios from the list pointed by '*bio_pp' to kreq as possible,
  * but no more than 'size' bytes. Returns 'copy' equal to # bytes copied.
@@ -243,11 +402,13 @@ static size_t kaio_kreq_pack(struct kaio_req *kreq, int *nr_segs,
  * The same as WRITE, but here the file plays the role of source and the
  * content of bios in sbl plays the role of destination.
  */
-static void kaio_sbl_submit(struct file *file, struct ploop_request *preq,
+static void kaio_sbl_submit(struct ploop_io *io, struct ploop_request *preq,
 			    unsigned long rw, struct bio_list *sbl,
 			    iblock_t iblk, size_t size)
 {
+	struct file *file = io->files.file;
 	struct bio *bio = sbl->head;
+	int plug = kaio_may_plug(io);
 	int idx = 0;
 
 	loff_t off = bio->bi_sector;
@@ -280,6 +441,15 @@ static void kaio_sbl_submit(struct file *file, struct ploop_request *preq,
 		copy = kaio_kreq_pack(kreq, &nr_segs, &bio, &idx, size);
 
 		atomic_inc(&preq->io_count);
+		if (plug) {
+			kreq->pos = off;
+			kreq->count = copy;
+			kreq->rw = rw;
+			kreq->nr_segs = nr_segs;
+			kaio_queue_kreq(io, kreq);
+			goto next;
+		}
+
 		err = kaio_kernel_submit(file, kreq, nr_segs, copy, off, rw);
 		if (err) {
 			PLOOP_REQ_SET_ERROR(preq, err);
@@ -288,6 +458,7 @@ static void kaio_sbl_submit(struct file *file, struct ploop_request *preq,
 			break;
 		}
 
+next:
 		off += copy;
 		size -= copy;
 	}
@@ -301,6 +472,7 @@ kaio_submit(struct ploop_io *io, struct ploop_request * preq,
 	     struct bio_list *sbl, iblock_t iblk, unsigned int size)
 {
 	if (rw & BIO_FLUSH) {
+		kaio_flush_plug(io);
 		spin_lock_irq(&io->plo->lock);
 		kaio_queue_fsync_req(preq);
 		io->plo->st.bio_syncwait++;
@@ -311,7 +483,7 @@ kaio_submit(struct ploop_io *io, struct ploop_request * preq,
 	if (iblk == PLOOP_ZERO_INDEX)
 		iblk = 0;
 
-	kaio_sbl_submit(io->files.file, preq, rw, sbl, iblk, size);
+	kaio_sbl_submit(io, preq, rw, sbl, iblk, size);
 }
 
 /* returns non-zero if and only if preq was resubmitted */
@@ -358,6 +530,63 @@ static inline int io2level(struct ploop_io * io)
 	return delta->level;
 }	
 
+/* One vfs_fsync() for all the fsync requests queued by now, each of them
+ * is then completed or resubmitted as if it had got its own one. Truncate
+ * requests are left on the queue. Called and returns with plo->lock held.
+ */
+static void kaio_fsync_group(struct ploop_io * io)
+{
+	struct ploop_device * plo = io->plo;
+	struct file * file = io->files.file;
+	struct ploop_request * preq, * n;
+	LIST_HEAD(list);
+	ktime_t start;
+	int err, nr = 0;
+
+	ploop_fsync_group_wait(io);
+
+	list_for_each_entry_safe(preq, n, &io->fsync_queue, list) {
+		if (preq->prealloc_size)
+			continue;
+		list_move_tail(&preq->list, &list);
+		io->fsync_qlen--;
+		nr++;
+	}
+	if (!nr)
+		return;
+	plo->st.bio_fsync++;
+	spin_unlock_irq(&plo->lock);
+
+	start = ktime_get();
+	err = vfs_fsync(file, file->f_path.dentry, 1);
+	ploop_fsync_account(io, start, nr);
+	if (err)
+		printk("kaio_fsync_thread: vfs_fsync failed "
+		       "with err=%d (i_ino=%ld of level=%d "
+		       "on ploop%d)\n",
+		       err, io->files.inode->i_ino,
+		       io2level(io), plo->index);
+
+	while (!list_empty(&list)) {
+		preq = list_entry(list.next, struct ploop_request, list);
+		list_del(&preq->list);
+
+		if (err) {
+			PLOOP_REQ_SET_ERROR(preq, -EIO);
+		} else if (preq->req_rw & BIO_FLUSH) {
+			BUG_ON(!preq->req_size);
+			preq->req_rw &= ~BIO_FLUSH;
+			if (kaio_resubmit(preq))
+				continue;
+		}
+
+		spin_lock_irq(&plo->lock);
+		list_add_tail(&preq->list, &plo->ready_queue);
+		spin_unlock_irq(&plo->lock);
+	}
+	spin_lock_irq(&plo->lock);
+}
+
 static int kaio_fsync_thread(void * data)
 {
 	struct ploop_io * io = data;
@@ -387,40 +616,22 @@ static int kaio_fsync_thread(void * data)
 			break;
 
 		preq = list_entry(io->fsync_queue.next, struct ploop_request, list);
-		list_del(&preq->list);
-		io->fsync_qlen--;
-		if (!preq->prealloc_size)
-			plo->st.bio_fsync++;
-		spin_unlock_irq(&plo->lock);
 
 		/* trick: preq->prealloc_size is actually new pos of eof */
 		if (preq->prealloc_size) {
+			list_del(&preq->list);
+			io->fsync_qlen--;
+			spin_unlock_irq(&plo->lock);
+
 			err = kaio_truncate(io, io->files.file,
 					    preq->prealloc_size >> (plo->cluster_log + 9));
 			if (err)
 				PLOOP_REQ_SET_ERROR(preq, -EIO);
-		} else {
-			struct file *file = io->files.file;
-			err = vfs_fsync(file, file->f_path.dentry, 1);
-			if (err) {
-				printk("kaio_fsync_thread: vfs_fsync failed "
-				       "with err=%d (i_ino=%ld of level=%d "
-				       "on ploop%d)\n",
-				       err, io->files.inode->i_ino,
-				       io2level(io), plo->index);
-				PLOOP_REQ_SET_ERROR(preq, -EIO);
-			} else if (preq->req_rw & BIO_FLUSH) {
-				BUG_ON(!preq->req_size);
-				preq->req_rw &= ~BIO_FLUSH;
-				if (kaio_resubmit(preq)) {
-					spin_lock_irq(&plo->lock);
-					continue;
-				}
-			}
-		}
 
-		spin_lock_irq(&plo->lock);
-		list_add_tail(&preq->list, &plo->ready_queue);
+			spin_lock_irq(&plo->lock);
+			list_add_tail(&preq->list, &plo->ready_queue);
+		} else
+			kaio_fsync_group(io);
 
 		if (test_bit(PLOOP_S_WAIT_PROCESS, &plo->state))
 			wake_up_interruptible(&plo->waitq);
@@ -482,7 +693,7 @@ kaio_submit_alloc(struct ploop_io *io, struct ploop_request * preq,
 	preq->iblock = iblk;
 	preq->eng_state = PLOOP_E_DATA_WBI;
 
-	kaio_sbl_submit(io->files.file, preq, 1<<BIO_RW, sbl, iblk, size);
+	kaio_sbl_submit(io, preq, 1<<BIO_RW, sbl, iblk, size);
 }
 
 static int kaio_release_prealloced(struct ploop_io * io)
@@ -552,6 +763,7 @@ kaio_init(struct ploop_io * io)
 {
 	INIT_LIST_HEAD(&io->fsync_queue);
 	init_waitqueue_head(&io->fsync_waitq);
+	INIT_LIST_HEAD(&io->plug_list);
 
 	return 0;
 }
@@ -567,6 +779,7 @@ kaio_io_page(struct ploop_io * io, int op, struct ploop_request * preq,
 	struct file *file = io->files.file;
 	int err;
 
+	kaio_flush_plug(io);
 	ploop_prepare_io_request(preq);
 
 	iocb = aio_kernel_alloc(GFP_NOIO);
@@ -667,6 +880,7 @@ kaio_sync_io(struct ploop_io * io, int op, struct page * page,
 	struct kaio_comp comp;
 	int err;
 
+	kaio_flush_plug(io);
 	kaio_comp_init(&comp);
 
 	iocb = aio_kernel_alloc(GFP_NOIO);
@@ -926,6 +1140,7 @@ static int kaio_truncate(struct ploop_io * io, struct file * file,
 
 static void kaio_unplug(struct ploop_io * io)
 {
+	kaio_flush_plug(io);
 	blk_run_address_space(io->files.file->f_mapping);
 }
 
@@ -941,6 +1156,7 @@ static void kaio_issue_flush(struct ploop_io * io, struct ploop_request *preq)
 	preq->eng_state = PLOOP_E_COMPLETE;
 	preq->req_rw &= ~BIO_FLUSH;
 
+	kaio_flush_plug(io);
 	spin_lock_irq(&io->plo->lock);
 
 	if (delta->flags & PLOOP_FMT_RDONLY)
@@ -986,6 +1202,7 @@ static struct ploop_io_ops ploop_io_ops_kaio =
 	.owner		=	THIS_MODULE,
 
 	.unplug		=	kaio_unplug,
+	.submit_queued	=	kaio_flush_plug,
 
 	.alloc		=	kaio_alloc_sync,
 	.submit		=	kaio_submit,
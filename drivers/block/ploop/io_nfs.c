@@ -18,6 +18,23 @@
 #include <linux/ploop/ploop.h>
 
 #define MAX_NBIO_PAGES	32
+#define MAX_NBIO_PREQS	16
+
+/*
+ * ploop requests served by one async read or write RPC. Normally this is
+ * the single preq the RPC was built for, but the main thread holds the
+ * last, not yet full RPC of a request back in io->plug_list, and the next
+ * request continuing it in the file appends its pages to the same RPC.
+ */
+struct nfsio_batch
+{
+	struct ploop_io		*io;
+	void			*nreq;
+	struct list_head	list;		/* in io->plug_list */
+	int			rw;
+	int			nr_preqs;
+	struct ploop_request	*preqs[MAX_NBIO_PREQS];
+};
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,25)
 struct workqueue_struct *nfsio_workqueue;
@@ -37,6 +54,9 @@ static void nfsio_rbio_release(void *);
 static void nfsio_wbio_release(void *);
 static void nfsio_cbio_release(void *);
 static int verify_bounce(struct nfs_write_data * nreq);
+static struct nfsio_batch *nfsio_rbatch(struct nfs_read_data *);
+static struct nfsio_batch *nfsio_wbatch(struct nfs_write_data *);
+static void nfsio_submit_queued(struct ploop_io * io);
 
 extern int nfs_initiate_commit(struct rpc_clnt *clnt,
 			       struct nfs_commit_data *data,
@@ -56,9 +76,18 @@ void nfsio_complete_io_state(struct ploop_request * preq)
 	    test_bit(PLOOP_REQ_UNSTABLE, &preq->state)) {
 		struct ploop_io * io = &map_writable_delta(preq)->io;
 		list_add_tail(&preq->list, &io->fsync_queue);
+		ploop_lat_account(preq, PLOOP_LAT_FSYNC);
+		/* One COMMIT covers the whole queue: let it grow while
+		 * more writes are on the wire, unless somebody waits.
+		 */
 		io->fsync_qlen++;
-		if (waitqueue_active(&io->fsync_waitq))
+		if ((test_bit(PLOOP_REQ_SYNC, &preq->state) ||
+		     io->fsync_qlen >= plo->tune.fsync_max ||
+		     !atomic_read(&io->rpc_wr_inflight)) &&
+		    waitqueue_active(&io->fsync_waitq))
 			wake_up_interruptible(&io->fsync_waitq);
+		else if (!timer_pending(&io->fsync_timer))
+			mod_timer(&io->fsync_timer, jiffies + plo->tune.fsync_delay);
 		plo->st.bio_syncwait++;
 	} else {
 		list_add_tail(&preq->list, &plo->ready_queue);
@@ -81,6 +110,139 @@ static inline void nfsio_complete_io_request(struct ploop_request * preq)
 		nfsio_complete_io_state(preq);
 }
 
+/*
+ * RPCs are asynchronous, only the number of them in flight is bounded:
+ * the submitter waits here while tune.nfs_window RPCs are outstanding.
+ * 0 means no limit.
+ */
+static void nfsio_rpc_start(struct ploop_io * io, int write)
+{
+	struct ploop_device * plo = io->plo;
+	int depth;
+
+	if (plo->tune.nfs_window &&
+	    atomic_read(&io->rpc_inflight) >= plo->tune.nfs_window) {
+		plo->st.nfs_window_waits++;
+		wait_event(io->rpc_waitq, !plo->tune.nfs_window ||
+			   atomic_read(&io->rpc_inflight) < plo->tune.nfs_window);
+	}
+
+	depth = atomic_inc_return(&io->rpc_inflight);
+	if (write)
+		atomic_inc(&io->rpc_wr_inflight);
+	if (depth > plo->st.nfs_inflight_max)
+		plo->st.nfs_inflight_max = depth;
+}
+
+static void nfsio_rpc_done(struct ploop_io * io, int write)
+{
+	/* No more writes to join the pending COMMIT, do it now */
+	if (write && atomic_dec_and_test(&io->rpc_wr_inflight) &&
+	    waitqueue_active(&io->fsync_waitq))
+		wake_up_interruptible(&io->fsync_waitq);
+
+	atomic_dec(&io->rpc_inflight);
+	if (waitqueue_active(&io->rpc_waitq))
+		wake_up(&io->rpc_waitq);
+}
+
+static void nfsio_fsync_timeout(unsigned long data)
+{
+	struct ploop_io * io = (void*)data;
+
+	wake_up_interruptible(&io->fsync_waitq);
+}
+
+static void nfsio_batch_init(struct nfsio_batch * b, struct ploop_io * io,
+			     void * nreq, int rw, struct ploop_request * preq)
+{
+	b->io = io;
+	b->nreq = nreq;
+	b->rw = rw;
+	b->nr_preqs = 1;
+	b->preqs[0] = preq;
+	atomic_inc(&preq->io_count);
+}
+
+static inline int nfsio_batch_full(struct nfsio_batch * b)
+{
+	return b->nr_preqs >= MAX_NBIO_PREQS;
+}
+
+static void nfsio_batch_add(struct nfsio_batch * b,
+			    struct ploop_request * preq)
+{
+	b->preqs[b->nr_preqs++] = preq;
+	atomic_inc(&preq->io_count);
+	b->io->plo->st.nfs_merges++;
+}
+
+/*
+ * RPCs are held back only by the main thread and only for the top delta,
+ * see nfsio_submit_queued(). Requests somebody waits for go out at once.
+ */
+static inline int nfsio_may_plug(struct ploop_io * io,
+				 struct ploop_request * preq)
+{
+	struct ploop_device * plo = io->plo;
+
+	return plo->tune.nfs_coalesce && current == plo->thread &&
+	       io == &ploop_top_delta(plo)->io &&
+	       !test_bit(PLOOP_REQ_SYNC, &preq->state);
+}
+
+static void nfsio_plug(struct ploop_io * io, struct nfsio_batch * b)
+{
+	list_add_tail(&b->list, &io->plug_list);
+	io->plug_len++;
+}
+
+/*
+ * If 'preq' continues the RPC held back in io->plug_list, join it and
+ * return it together with the end of data in its last page. Otherwise
+ * the held RPC is sent.
+ */
+static void *nfsio_get_plugged(struct ploop_io * io,
+			       struct ploop_request * preq, int rw,
+			       loff_t pos, unsigned int * prev_end)
+{
+	struct nfsio_batch *b;
+	loff_t offset;
+	unsigned int pgbase, count;
+
+	*prev_end = PAGE_SIZE;
+
+	/* plug_list belongs to the main thread, nobody else may touch it */
+	if (current != io->plo->thread || list_empty(&io->plug_list))
+		return NULL;
+
+	b = list_first_entry(&io->plug_list, struct nfsio_batch, list);
+	if (b->rw == WRITE) {
+		struct nfs_write_data *nreq = b->nreq;
+
+		offset = nreq->args.offset;
+		pgbase = nreq->args.pgbase;
+		count = nreq->args.count;
+	} else {
+		struct nfs_read_data *nreq = b->nreq;
+
+		offset = nreq->args.offset;
+		pgbase = nreq->args.pgbase;
+		count = nreq->args.count;
+	}
+
+	if (b->rw != rw || nfsio_batch_full(b) || offset + count != pos) {
+		nfsio_submit_queued(io);
+		return NULL;
+	}
+
+	list_del(&b->list);
+	io->plug_len--;
+	nfsio_batch_add(b, preq);
+	*prev_end = ((pgbase + count - 1) & ~PAGE_MASK) + 1;
+	return b->nreq;
+}
+
 
 static void nfsio_read_result(struct rpc_task *task, void *calldata)
 {
@@ -100,13 +262,20 @@ static void nfsio_read_result(struct rpc_task *task, void *calldata)
 static void nfsio_read_release(void *calldata)
 {
 	struct nfs_read_data *nreq = calldata;
-	struct ploop_request *preq = (struct ploop_request *) nreq->header->req;
+	struct nfsio_batch *b = nfsio_rbatch(nreq);
 	int status = nreq->task.tk_status;
+	int i;
 
-	if (unlikely(status < 0))
-		PLOOP_REQ_SET_ERROR(preq, status);
+	nfsio_rpc_done(b->io, 0);
 
-	ploop_complete_io_request(preq);
+	for (i = 0; i < b->nr_preqs; i++) {
+		struct ploop_request *preq = b->preqs[i];
+
+		if (unlikely(status < 0))
+			PLOOP_REQ_SET_ERROR(preq, status);
+
+		ploop_complete_io_request(preq);
+	}
 
 	nfsio_rbio_release(calldata);
 }
@@ -208,13 +377,44 @@ rbio_submit(struct ploop_io * io, struct nfs_read_data * nreq,
 }
 #endif
 
+static struct nfs_read_data *
+nfsio_rbio_get(struct ploop_io * io, struct ploop_request * preq, loff_t pos,
+	       struct page * page, unsigned int off, unsigned int len)
+{
+	struct nfs_read_data * nreq;
+
+	nreq = rbio_init(pos, page, off, len, preq, io->files.inode);
+	if (nreq)
+		nfsio_batch_init(nfsio_rbatch(nreq), io, nreq, READ, preq);
+	return nreq;
+}
+
+/* On failure all preqs of the batch are completed with error */
+static int nfsio_rbio_submit(struct ploop_io * io, struct nfs_read_data * nreq)
+{
+	struct nfsio_batch *b = nfsio_rbatch(nreq);
+	int err, i;
+
+	nfsio_rpc_start(io, 0);
+	err = rbio_submit(io, nreq, &nfsio_read_ops);
+	if (err) {
+		nfsio_rpc_done(io, 0);
+		for (i = 0; i < b->nr_preqs; i++) {
+			PLOOP_REQ_SET_ERROR(b->preqs[i], err);
+			ploop_complete_io_request(b->preqs[i]);
+		}
+		nfsio_rbio_release(nreq);
+	}
+	return err;
+}
+
 static void
 nfsio_submit_read(struct ploop_io *io, struct ploop_request * preq,
 		  struct bio_list *sbl, iblock_t iblk, unsigned int size)
 {
 	struct inode *inode = io->files.inode;
 	size_t rsize = NFS_SERVER(inode)->rsize;
-	struct nfs_read_data *nreq = NULL;
+	struct nfs_read_data *nreq;
 	loff_t pos;
 	unsigned int prev_end;
 	struct bio * b;
@@ -225,7 +425,7 @@ nfsio_submit_read(struct ploop_io *io, struct ploop_request * preq,
 	pos = ((loff_t)iblk << preq->plo->cluster_log) | (pos & ((1<<preq->plo->cluster_log) - 1));
 	pos <<= 9;
 
-	prev_end = PAGE_SIZE;
+	nreq = nfsio_get_plugged(io, preq, READ, pos, &prev_end);
 
 	for (b = sbl->head; b != NULL; b = b->bi_next) {
 		int bv_idx;
@@ -252,21 +452,11 @@ nfsio_submit_read(struct ploop_io *io, struct ploop_request * preq,
 				}
 			}
 
-			if (nreq) {
-				int err;
-
-				atomic_inc(&preq->io_count);
-
-				err = rbio_submit(io, nreq, &nfsio_read_ops);
-				if (err) {
-					PLOOP_REQ_SET_ERROR(preq, err);
-					ploop_complete_io_request(preq);
-					goto out;
-				}
-			}
+			if (nreq && nfsio_rbio_submit(io, nreq))
+				goto out;
 
-			nreq = rbio_init(pos, bv->bv_page, bv->bv_offset,
-					 bv->bv_len, preq, inode);
+			nreq = nfsio_rbio_get(io, preq, pos, bv->bv_page,
+					      bv->bv_offset, bv->bv_len);
 
 			if (nreq == NULL) {
 				PLOOP_REQ_SET_ERROR(preq, -ENOMEM);
@@ -279,16 +469,12 @@ nfsio_submit_read(struct ploop_io *io, struct ploop_request * preq,
 	}
 
 	if (nreq) {
-		int err;
-
-		atomic_inc(&preq->io_count);
-
-		err = rbio_submit(io, nreq, &nfsio_read_ops);
-		if (err) {
-			PLOOP_REQ_SET_ERROR(preq, err);
-			ploop_complete_io_request(preq);
-			goto out;
-		}
+		if (nfsio_may_plug(io, preq) &&
+		    nreq->args.count < rsize &&
+		    !nfsio_batch_full(nfsio_rbatch(nreq)))
+			nfsio_plug(io, nfsio_rbatch(nreq));
+		else
+			nfsio_rbio_submit(io, nreq);
 	}
 
 out:
@@ -313,18 +499,25 @@ static void nfsio_write_result(struct rpc_task *task, void *calldata)
 static void nfsio_write_release(void *calldata)
 {
 	struct nfs_write_data *nreq = calldata;
-	struct ploop_request *preq = (struct ploop_request *) nreq->header->req;
+	struct nfsio_batch *b = nfsio_wbatch(nreq);
 	int status = nreq->task.tk_status;
+	int i;
 
-	if (unlikely(status < 0))
-		PLOOP_REQ_SET_ERROR(preq, status);
+	nfsio_rpc_done(b->io, 1);
 
-	if (!preq->error &&
-	    nreq->res.verf->committed != NFS_FILE_SYNC) {
-		if (!test_and_set_bit(PLOOP_REQ_UNSTABLE, &preq->state))
-			memcpy(&preq->verf, &nreq->res.verf->verifier, 8);
+	for (i = 0; i < b->nr_preqs; i++) {
+		struct ploop_request *preq = b->preqs[i];
+
+		if (unlikely(status < 0))
+			PLOOP_REQ_SET_ERROR(preq, status);
+
+		if (!preq->error &&
+		    nreq->res.verf->committed != NFS_FILE_SYNC) {
+			if (!test_and_set_bit(PLOOP_REQ_UNSTABLE, &preq->state))
+				memcpy(&preq->verf, &nreq->res.verf->verifier, 8);
+		}
+		nfsio_complete_io_request(preq);
 	}
-	nfsio_complete_io_request(preq);
 
 	nfsio_wbio_release(calldata);
 }
@@ -432,13 +625,72 @@ static int wbio_submit(struct ploop_io * io, struct nfs_write_data *nreq,
 #endif
 
 
+static struct nfs_write_data *
+nfsio_wbio_get(struct ploop_io * io, struct ploop_request * preq, loff_t pos,
+	       struct page * page, unsigned int off, unsigned int len)
+{
+	struct nfs_write_data * nreq;
+
+	nreq = wbio_init(pos, page, off, len, preq, io->files.inode);
+	if (nreq)
+		nfsio_batch_init(nfsio_wbatch(nreq), io, nreq, WRITE, preq);
+	return nreq;
+}
+
+/* On failure all preqs of the batch are completed with error */
+static int nfsio_wbio_submit(struct ploop_io * io, struct nfs_write_data * nreq)
+{
+	struct nfsio_batch *b = nfsio_wbatch(nreq);
+	int err, i;
+
+	nfsio_rpc_start(io, 1);
+	err = wbio_submit(io, nreq, &nfsio_write_ops);
+	if (err) {
+		nfsio_rpc_done(io, 1);
+		for (i = 0; i < b->nr_preqs; i++) {
+			PLOOP_REQ_SET_ERROR(b->preqs[i], err);
+			nfsio_complete_io_request(b->preqs[i]);
+		}
+		nfsio_wbio_release(nreq);
+	}
+	return err;
+}
+
+/*
+ * Send RPCs held back by the main thread. Called by it before it goes to
+ * sleep, so the device cannot be quiesced (hence top delta cannot change)
+ * while something is held.
+ */
+static void nfsio_submit_queued(struct ploop_io * io)
+{
+	while (!list_empty(&io->plug_list)) {
+		struct nfsio_batch *b;
+
+		b = list_first_entry(&io->plug_list, struct nfsio_batch, list);
+		list_del(&b->list);
+
+		if (b->rw == WRITE)
+			nfsio_wbio_submit(io, b->nreq);
+		else
+			nfsio_rbio_submit(io, b->nreq);
+	}
+
+	io->plug_len = 0;
+}
+
+static inline void nfsio_flush_plug(struct ploop_io * io)
+{
+	if (current == io->plo->thread && !list_empty(&io->plug_list))
+		nfsio_submit_queued(io);
+}
+
 static void
 nfsio_submit_write(struct ploop_io *io, struct ploop_request * preq,
 		   struct bio_list *sbl, iblock_t iblk, unsigned int size)
 {
 	struct inode *inode = io->files.inode;
 	size_t wsize = NFS_SERVER(inode)->wsize;
-	struct nfs_write_data *nreq = NULL;
+	struct nfs_write_data *nreq;
 	loff_t pos;
 	struct bio * b;
 	unsigned int prev_end;
@@ -450,7 +702,7 @@ nfsio_submit_write(struct ploop_io *io, struct ploop_request * preq,
 	ploop_prepare_tracker(preq, pos);
 	pos <<= 9;
 
-	prev_end = PAGE_SIZE;
+	nreq = nfsio_get_plugged(io, preq, WRITE, pos, &prev_end);
 
 	for (b = sbl->head; b != NULL; b = b->bi_next) {
 		int bv_idx;
@@ -477,19 +729,11 @@ nfsio_submit_write(struct ploop_io *io, struct ploop_request * preq,
 				}
 			}
 
-			if (nreq) {
-				int err;
-				atomic_inc(&preq->io_count);
-				err = wbio_submit(io, nreq, &nfsio_write_ops);
-				if (err) {
-					PLOOP_REQ_SET_ERROR(preq, err);
-					nfsio_complete_io_request(preq);
-					goto out;
-				}
-			}
+			if (nreq && nfsio_wbio_submit(io, nreq))
+				goto out;
 
-			nreq = wbio_init(pos, bv->bv_page, bv->bv_offset,
-					 bv->bv_len, preq, inode);
+			nreq = nfsio_wbio_get(io, preq, pos, bv->bv_page,
+					      bv->bv_offset, bv->bv_len);
 
 			if (nreq == NULL) {
 				PLOOP_REQ_SET_ERROR(preq, -ENOMEM);
@@ -502,13 +746,12 @@ nfsio_submit_write(struct ploop_io *io, struct ploop_request * preq,
 	}
 
 	if (nreq) {
-		int err;
-		atomic_inc(&preq->io_count);
-		err = wbio_submit(io, nreq, &nfsio_write_ops);
-		if (err) {
-			PLOOP_REQ_SET_ERROR(preq, err);
-			nfsio_complete_io_request(preq);
-		}
+		if (nfsio_may_plug(io, preq) &&
+		    nreq->args.count < wsize &&
+		    !nfsio_batch_full(nfsio_wbatch(nreq)))
+			nfsio_plug(io, nfsio_wbatch(nreq));
+		else
+			nfsio_wbio_submit(io, nreq);
 	}
 
 out:
@@ -636,18 +879,10 @@ nfsio_submit_write_pad(struct ploop_io *io, struct ploop_request * preq,
 			}
 		}
 
-		if (nreq) {
-			int err;
-			atomic_inc(&preq->io_count);
-			err = wbio_submit(io, nreq, &nfsio_write_ops);
-			if (err) {
-				PLOOP_REQ_SET_ERROR(preq, err);
-				nfsio_complete_io_request(preq);
-				goto out;
-			}
-		}
+		if (nreq && nfsio_wbio_submit(io, nreq))
+			goto out;
 
-		nreq = wbio_init(pos, page, poff, plen, preq, inode);
+		nreq = nfsio_wbio_get(io, preq, pos, page, poff, plen);
 
 		if (nreq == NULL) {
 			PLOOP_REQ_SET_ERROR(preq, -ENOMEM);
@@ -659,15 +894,8 @@ nfsio_submit_write_pad(struct ploop_io *io, struct ploop_request * preq,
 		bw.bv_off += plen;
 	}
 
-	if (nreq) {
-		int err;
-		atomic_inc(&preq->io_count);
-		err = wbio_submit(io, nreq, &nfsio_write_ops);
-		if (err) {
-			PLOOP_REQ_SET_ERROR(preq, err);
-			nfsio_complete_io_request(preq);
-		}
-	}
+	if (nreq)
+		nfsio_wbio_submit(io, nreq);
 
 out:
 	nfsio_complete_io_request(preq);
@@ -692,6 +920,8 @@ nfsio_submit_alloc(struct ploop_io *io, struct ploop_request * preq,
 
 static void nfsio_destroy(struct ploop_io * io)
 {
+	del_timer_sync(&io->fsync_timer);
+
 	if (io->fsync_thread) {
 		kthread_stop(io->fsync_thread);
 		io->fsync_thread = NULL;
@@ -724,6 +954,13 @@ nfsio_init(struct ploop_io * io)
 {
 	INIT_LIST_HEAD(&io->fsync_queue);
 	init_waitqueue_head(&io->fsync_waitq);
+	init_timer(&io->fsync_timer);
+	io->fsync_timer.function = nfsio_fsync_timeout;
+	io->fsync_timer.data = (unsigned long)io;
+	INIT_LIST_HEAD(&io->plug_list);
+	atomic_set(&io->rpc_inflight, 0);
+	atomic_set(&io->rpc_wr_inflight, 0);
+	init_waitqueue_head(&io->rpc_waitq);
 	return 0;
 }
 
@@ -732,25 +969,18 @@ static void
 nfsio_read_page(struct ploop_io * io, struct ploop_request * preq,
 		struct page * page, sector_t sec)
 {
-	struct inode *inode = io->files.inode;
 	struct nfs_read_data *nreq;
-	int err;
 
+	nfsio_flush_plug(io);
 	ploop_prepare_io_request(preq);
 
-	nreq = rbio_init((loff_t)sec << 9, page, 0, PAGE_SIZE, preq, inode);
+	nreq = nfsio_rbio_get(io, preq, (loff_t)sec << 9, page, 0, PAGE_SIZE);
 	if (nreq == NULL) {
 		PLOOP_REQ_SET_ERROR(preq, -ENOMEM);
 		goto out;
 	}
 
-	atomic_inc(&preq->io_count);
-
-	err = rbio_submit(io, nreq, &nfsio_read_ops);
-	if (err) {
-		PLOOP_REQ_SET_ERROR(preq, err);
-		ploop_complete_io_request(preq);
-	}
+	nfsio_rbio_submit(io, nreq);
 
 out:
 	ploop_complete_io_request(preq);
@@ -760,26 +990,20 @@ static void
 nfsio_write_page(struct ploop_io * io, struct ploop_request * preq,
 		 struct page * page, sector_t sec, int fua)
 {
-	struct inode *inode = io->files.inode;
 	struct nfs_write_data *nreq;
-	int err;
 
+	nfsio_flush_plug(io);
 	nfsio_prepare_io_request(preq);
 	ploop_prepare_tracker(preq, sec);
 
-	nreq = wbio_init((loff_t)sec << 9, page, 0, PAGE_SIZE, preq, inode);
+	nreq = nfsio_wbio_get(io, preq, (loff_t)sec << 9, page, 0, PAGE_SIZE);
 
 	if (nreq == NULL) {
 		PLOOP_REQ_SET_ERROR(preq, -ENOMEM);
 		goto out;
 	}
 
-	atomic_inc(&preq->io_count);
-	err = wbio_submit(io, nreq, &nfsio_write_ops);
-	if (err) {
-		PLOOP_REQ_SET_ERROR(preq, err);
-		nfsio_complete_io_request(preq);
-	}
+	nfsio_wbio_submit(io, nreq);
 
 out:
 	nfsio_complete_io_request(preq);
@@ -1036,7 +1260,8 @@ static int nfsio_alloc_sync(struct ploop_io * io, loff_t pos, loff_t len)
 {
 	int head_len = len & (PAGE_SIZE - 1);
 	int nr_total = len >> PAGE_SHIFT;
-	int nr = 1 << (io->plo->cluster_log + 9 - PAGE_SHIFT);
+	int nr = min(1 << (io->plo->cluster_log + 9 - PAGE_SHIFT),
+		     BIO_MAX_PAGES);
 	struct page * pvec[nr];
 	int i;
 	int err = 0;
@@ -1485,6 +1710,7 @@ static struct ploop_io_ops ploop_io_ops_nfs =
 	.alloc		=	nfsio_alloc_sync,
 	.submit		=	nfsio_submit,
 	.submit_alloc	=	nfsio_submit_alloc,
+	.submit_queued	=	nfsio_flush_plug,
 	.read_page	=	nfsio_read_page,
 	.write_page	=	nfsio_write_page,
 	.sync_read	=	nfsio_sync_read,
@@ -1516,11 +1742,13 @@ union nfsio_bio
 	struct {
 		struct nfs_read_header	r;
 		struct page		*padd[MAX_NBIO_PAGES];
+		struct nfsio_batch	batch;
 	} ru;
 	struct {
 		struct nfs_write_header	w;
 		struct page		*padd[MAX_NBIO_PAGES];
 		u32			bounced;
+		struct nfsio_batch	batch;
 	} wu;
 	struct {
 		struct nfs_commit_data c;
@@ -1612,6 +1840,20 @@ void nfsio_rbio_release(void *data)
 	mempool_free(b, nfsio_bio_mempool);
 }
 
+static struct nfsio_batch *nfsio_rbatch(struct nfs_read_data *p)
+{
+	struct nfs_read_header *p_hdr = container_of(p, struct nfs_read_header, rpc_data);
+
+	return &container_of(p_hdr, union nfsio_bio, ru.r)->ru.batch;
+}
+
+static struct nfsio_batch *nfsio_wbatch(struct nfs_write_data *p)
+{
+	struct nfs_write_header *p_hdr = container_of(p, struct nfs_write_header, rpc_data);
+
+	return &container_of(p_hdr, union nfsio_bio, wu.w)->wu.batch;
+}
+
 static void nfsio_put_open_context(struct nfs_open_context *ctx)
 {
 	if (atomic_dec_and_test(&ctx->lock_context.count))
@@ -1628,6 +1870,8 @@ void nfsio_cbio_release(void *data)
 
 int verify_bounce(struct nfs_write_data * nreq)
 {
+	struct nfs_write_header *p_hdr = container_of(nreq, struct nfs_write_header, rpc_data);
+	union nfsio_bio * b = container_of(p_hdr, union nfsio_bio, wu.w);
 	int i;
 
 	for (i = 0; i < nreq->pages.npages; i++) {
@@ -1652,7 +1896,7 @@ int verify_bounce(struct nfs_write_data * nreq)
 			kunmap_atomic(kdst, KM_USER1);
 			kunmap_atomic(ksrc, KM_USER0);
 			nreq->pages.pagevec[i] = page;
-			((union nfsio_bio*)nreq)->wu.bounced |= (1<<i);
+			b->wu.bounced |= (1<<i);
 		}
 	}
 	return 0;
@@ -40,10 +40,14 @@ typedef u32 map_index_t;
 #define INDEX_PER_PAGE	(PAGE_SIZE / sizeof(map_index_t))
 
 static struct kmem_cache * ploop_map_cache;
+static struct workqueue_struct * ploop_map_wq;
 
-static LIST_HEAD(map_lru);
+/* Maps having idle cached nodes */
+static LIST_HEAD(map_list);
 static DEFINE_SPINLOCK(map_lru_lock);
 static atomic_t map_pages_nr = ATOMIC_INIT(0);
+/* Idle nodes on LRU, under map_lru_lock */
+static unsigned long map_lru_nr;
 
 /*
  * Additional information for each page is:
@@ -73,8 +77,17 @@ struct map_node
 
 	struct page		*page;
 	struct list_head	lru;
+	/* Set by lookups in fast path instead of moving node to tail
+	 * of LRU, map_lru_scan() gives such nodes another round. */
+	int			referenced;
 	u8			*levels;
 
+	/* group commit: link in map->wb_group, deadline and number of
+	 * updates collected */
+	struct list_head	wb_link;
+	unsigned long		wb_deadline;
+	unsigned int		wb_nr;
+
 	/* List of preq's blocking on this mapping.
 	 *
 	 * We queue here several kinds of requests:
@@ -109,6 +122,41 @@ enum {
 	PLOOP_MAP_READ		= 17,	/* Mapping read is scheduled */
 	PLOOP_MAP_WRITEBACK	= 18,	/* Mapping is under writeback */
 	PLOOP_MAP_ERROR		= 19,	/* Mapping is baaad */
+	PLOOP_MAP_WB_GROUP	= 20,	/* Index updates are being collected
+					 * for group commit, WRITEBACK is set
+					 * but write is not issued yet */
+};
+
+static void map_readahead_work(struct work_struct *work);
+
+/*
+ * Flattened index of lower deltas.
+ *
+ * A cluster absent in top delta is searched level by level: each
+ * map_index_fault() merges one more lower delta index page into the node,
+ * with a read and a pass through the state machine. With a long chain of
+ * snapshots this is repeated every time the node is evicted and read back.
+ * Lower deltas are read-only, so the result of the merges is kept per
+ * index page, apart from the nodes: levels[] and indices of all the deltas
+ * in [uptodate, top_level). It is applied to node at once, without io, and
+ * thrown away when top delta changes. Merge, delete, replace and truncate
+ * destroy the whole map.
+ *
+ * Index page of a base image written sequentially maps its clusters back
+ * to back, all from one level. Such an entry has no holes left to fill by
+ * the levels below and is reduced to the first index and the level of the
+ * run, without page and levels[].
+ */
+struct map_flat
+{
+	struct list_head	lru;
+	cluster_t		pageno;
+	int			top_level;
+	int			uptodate;
+	map_index_t		run_start;
+	int			run_level;
+	struct page		*page;		/* NULL for a run */
+	u8			levels[0];
 };
 
 void map_init(struct ploop_device * plo, struct ploop_map * map)
@@ -119,9 +167,42 @@ void map_init(struct ploop_device * plo, struct ploop_map * map)
 	map->plo = plo;
 	map->rb_root = RB_ROOT;
 	map->lru_buffer_ptr = 0;
+	INIT_LIST_HEAD(&map->lru_list);
+	INIT_LIST_HEAD(&map->lru_link);
+	INIT_DELAYED_WORK(&map->ra_work, map_readahead_work);
+	INIT_LIST_HEAD(&map->wb_group);
+	map->ra_next = map->ra_nr = map->ra_end = map->ra_last = 0;
+	map->evictions = 0;
+	INIT_RADIX_TREE(&map->flat_tree, GFP_NOFS);
+	INIT_LIST_HEAD(&map->flat_lru);
+	map->flat_pages = 0;
 	init_waitqueue_head(&map->destroy_waitq);
 }
 
+/* Both under map_lru_lock */
+static void map_lru_add(struct map_node * m)
+{
+	struct ploop_map * map = m->parent;
+
+	if (list_empty(&map->lru_list))
+		list_add_tail(&map->lru_link, &map_list);
+	if (list_empty(&m->lru))
+		map_lru_nr++;
+	list_move_tail(&m->lru, &map->lru_list);
+}
+
+static void map_lru_del(struct map_node * m)
+{
+	struct ploop_map * map = m->parent;
+
+	if (list_empty(&m->lru))
+		return;
+	list_del_init(&m->lru);
+	map_lru_nr--;
+	if (list_empty(&map->lru_list))
+		list_del_init(&map->lru_link);
+}
+
 /* Deliver batch of LRU updates from buffer to global LRU.
  * Everything, which has zero refcnt, is added to LRU or moved to tail
  * of LRU. Everything, which has non-zero refcnt, is removed from LRU.
@@ -135,9 +216,9 @@ static void flush_lru_buffer(struct ploop_map * map)
 	for (i = 0; i < map->lru_buffer_ptr; i++) {
 		struct map_node * m = map->lru_buffer[i];
 		if (atomic_dec_and_test(&m->refcnt))
-			list_move_tail(&m->lru, &map_lru);
+			map_lru_add(m);
 		else
-			list_del_init(&m->lru);
+			map_lru_del(m);
 	}
 	spin_unlock_irqrestore(&map_lru_lock, flags);
 
@@ -189,7 +270,11 @@ static struct map_node * map_lookup(struct ploop_map * map, cluster_t block)
 	return NULL;
 }
 
-/* Lookup mapping atomically. */
+/* Lookup mapping atomically.
+ *
+ * Called under plo->lock. Fast path does not touch global LRU: cached
+ * node is only marked referenced and aged lazily by map_lru_scan().
+ */
 
 int ploop_fastmap(struct ploop_map * map, cluster_t block, iblock_t *result)
 {
@@ -209,18 +294,15 @@ int ploop_fastmap(struct ploop_map * map, cluster_t block, iblock_t *result)
 	if (m == NULL)
 		return -1;
 
-	if (atomic_read(&m->refcnt) == 0) {
-		cond_flush_lru_buffer(map);
-		if (atomic_read(&m->refcnt) == 0) {
-			atomic_inc(&m->refcnt);
-			map->lru_buffer[map->lru_buffer_ptr++] = m;
-		}
-	}
+	if (!m->referenced)
+		m->referenced = 1;
 	map->last_activity = jiffies;
 
 	if (!test_bit(PLOOP_MAP_UPTODATE, &m->state))
 		return -1;
 
+	map->plo->st.map_hits++;
+
 	idx = (block + PLOOP_MAP_OFFSET) & (INDEX_PER_PAGE - 1); 
 	blk = ((map_index_t *)page_address(m->page))[idx] >>
 	       ploop_map_log(map->plo);
@@ -238,7 +320,7 @@ int ploop_fastmap(struct ploop_map * map, cluster_t block, iblock_t *result)
 static void map_node_destroy(struct map_node *m)
 {
 	rb_erase(&m->rb_link, &m->parent->rb_root);
-	list_del_init(&m->lru);
+	map_lru_del(m);
 	BUG_ON(atomic_read(&m->refcnt));
 	BUG_ON(!list_empty(&m->io_queue));
 	if (m->page)
@@ -246,24 +328,55 @@ static void map_node_destroy(struct map_node *m)
 	if (m->levels)
 		kfree(m->levels);
 	m->parent->pages--;
+	m->parent->evictions++;
 	atomic_dec(&map_pages_nr);
 	kmem_cache_free(ploop_map_cache, m);
 }
 
-static void map_lru_scan(void)
+/* Under map_lru_lock. Victim is the oldest idle node of @map or, for
+ * global scan, of the map holding most pages scaled down by priority of
+ * its device, so that one huge image cannot evict everybody else.
+ */
+static struct map_node * map_lru_candidate(struct ploop_map * map)
 {
-	int max_loops = atomic_read(&map_pages_nr);
+	struct ploop_map * iter;
+	unsigned int score, best = 0;
+
+	if (map == NULL) {
+		list_for_each_entry(iter, &map_list, lru_link) {
+			score = iter->pages >> min_t(int, PLOOP_MAP_PRIO_MAX,
+					iter->plo->tune.map_priority);
+			if (map == NULL || score > best) {
+				map = iter;
+				best = score;
+			}
+		}
+		if (map == NULL)
+			return NULL;
+	}
+
+	if (list_empty(&map->lru_list))
+		return NULL;
+
+	return list_first_entry(&map->lru_list, struct map_node, lru);
+}
+
+/* Try to free nr_to_scan idle nodes of @map or of all maps, when @map is
+ * NULL. Global scans respect min_map_pages of active devices.
+ */
+static int map_lru_scan(struct ploop_map * scan_map, int nr_to_scan)
+{
+	int max_loops = scan_map ? scan_map->pages : atomic_read(&map_pages_nr);
+	int freed = 0;
 
-	while (atomic_read(&map_pages_nr) > max_map_pages &&
-	       --max_loops >= 0) {
+	while (freed < nr_to_scan && --max_loops >= 0) {
 		struct ploop_map * map;
-		struct map_node * candidate = NULL;
+		struct map_node * candidate;
 
 		spin_lock_irq(&map_lru_lock);
-		if (!list_empty(&map_lru)) {
-			candidate = list_first_entry(&map_lru, struct map_node, lru);
+		candidate = map_lru_candidate(scan_map);
+		if (candidate)
 			atomic_inc(&candidate->refcnt);
-		}
 		spin_unlock_irq(&map_lru_lock);
 
 		if (!candidate)
@@ -279,22 +392,31 @@ static void map_lru_scan(void)
 			wake_up(&map->destroy_waitq);
 			spin_unlock(&map_lru_lock);
 			spin_unlock_irq(&map->plo->lock);
-			return;
+			break;
 		}
 
-		list_del_init(&candidate->lru);
+		map_lru_del(candidate);
 
 		if (atomic_dec_and_test(&candidate->refcnt)) {
-			/* This instance is within its limits, just
-			 * readd node back to tail of lru.
+			/* Recently used by fast path or this instance
+			 * is within its limits, just readd node back
+			 * to tail of lru.
 			 */
-			if (map->pages <= map->plo->tune.min_map_pages &&
-			    time_after(map->last_activity +
-				       map->plo->tune.max_map_inactivity, jiffies) &&
+			if (candidate->referenced &&
 			    !test_bit(PLOOP_MAP_DEAD, &map->flags)) {
-				list_add_tail(&candidate->lru, &map_lru);
+				candidate->referenced = 0;
+				map_lru_add(candidate);
+			} else if (!scan_map &&
+				   map->pages <= map->plo->tune.min_map_pages &&
+				   time_after(map->last_activity +
+					      map->plo->tune.max_map_inactivity,
+					      jiffies) &&
+				   !test_bit(PLOOP_MAP_DEAD, &map->flags)) {
+				map_lru_add(candidate);
 			} else {
 				map_node_destroy(candidate);
+				map->plo->st.map_evictions++;
+				freed++;
 			}
 		}
 		spin_unlock(&map_lru_lock);
@@ -303,42 +425,74 @@ static void map_lru_scan(void)
 		if (!(max_loops & 16))
 			cond_resched();
 	}
+
+	return freed;
+}
+
+/* Only idle nodes can be freed, busy ones are pinned by requests. As
+ * shrink_slab() wants, what is left is reported after a scan too, so
+ * what was freed is the difference. */
+static int map_shrink(struct shrinker * shrink, int nr_to_scan, gfp_t gfp_mask)
+{
+	if (nr_to_scan)
+		map_lru_scan(NULL, nr_to_scan);
+
+	return min(map_lru_nr, (unsigned long)INT_MAX);
+}
+
+static struct shrinker map_shrinker = {
+	.shrink = map_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static inline cluster_t map_pageno(cluster_t block)
+{
+	return (block + PLOOP_MAP_OFFSET) / INDEX_PER_PAGE;
+}
+
+static inline cluster_t map_page_start(cluster_t ondisk_pageno)
+{
+	return ondisk_pageno ? ondisk_pageno * INDEX_PER_PAGE - PLOOP_MAP_OFFSET : 0;
 }
 
 static struct map_node *
-map_create(struct ploop_map * map, cluster_t block)
+map_node_alloc(struct ploop_map * map, cluster_t ondisk_pageno,
+	       struct page * page)
 {
-	struct ploop_device * plo = map->plo;
-	struct rb_node **p, *parent;
 	struct map_node * m;
-	cluster_t ondisk_pageno = (block + PLOOP_MAP_OFFSET) / INDEX_PER_PAGE;
 
 	m = kmem_cache_alloc(ploop_map_cache, GFP_NOFS);
 	if (unlikely(m == NULL))
-		return ERR_PTR(-ENOMEM);
-
-	m->page = alloc_page(GFP_NOFS);
-	if (unlikely(m->page == NULL)) {
-		kmem_cache_free(ploop_map_cache, m);
-		return ERR_PTR(-ENOMEM);
-	}
+		return NULL;
 
-	if (ondisk_pageno == 0) {
-		m->mn_start = 0;
+	m->page = page;
+	m->mn_start = map_page_start(ondisk_pageno);
+	if (ondisk_pageno == 0)
 		m->mn_end = INDEX_PER_PAGE - PLOOP_MAP_OFFSET - 1;
-	} else {
-		m->mn_start = ondisk_pageno * INDEX_PER_PAGE - PLOOP_MAP_OFFSET;
+	else
 		m->mn_end = m->mn_start + INDEX_PER_PAGE - 1;
-	}
 
 	INIT_LIST_HEAD(&m->io_queue);
 	INIT_LIST_HEAD(&m->lru);
+	INIT_LIST_HEAD(&m->wb_link);
+	m->wb_nr = 0;
+	m->referenced = 0;
 	m->levels = NULL;
 	m->state = 0;
 	atomic_set(&m->refcnt, 1);
 	m->parent = map;
 
-	spin_lock_irq(&plo->lock);
+	return m;
+}
+
+/* Under plo->lock. Links node to the map, unless the index page is cached
+ * already: it could be prefetched by readahead. Then the cached node is
+ * returned.
+ */
+static struct map_node * map_insert(struct ploop_map * map, struct map_node * m)
+{
+	struct rb_node **p, *parent;
+	cluster_t block = m->mn_start;
 
 	p = &map->rb_root.rb_node;
 	parent = NULL;
@@ -348,21 +502,12 @@ map_create(struct ploop_map * map, cluster_t block)
 		parent = *p;
 		entry = rb_entry(parent, struct map_node, rb_link);
 
-		/* Nodes can be deleted by any of ploop threads,
-		 * but they are inserted only in ploop thread.
-		 * Before calling map_create() we checked the node
-		 * is absent, therefore:
-		 */
-		BUG_ON(ondisk_pageno ==
-		       (entry->mn_start + PLOOP_MAP_OFFSET) / INDEX_PER_PAGE);
-
 		if (block < entry->mn_start)
 			p = &(*p)->rb_left;
 		else if (block > entry->mn_end)
 			p = &(*p)->rb_right;
 		else
-			printk("map_create: Oops! block=%u; mn_range=[%u..%u]\n",
-			       block, entry->mn_start, entry->mn_end);
+			return entry;
 	}
 
 	rb_link_node(&m->rb_link, parent, p);
@@ -370,15 +515,248 @@ map_create(struct ploop_map * map, cluster_t block)
 
 	map->pages++;
 	atomic_inc(&map_pages_nr);
-	spin_unlock_irq(&plo->lock);
+	return NULL;
+}
+
+static void map_node_free(struct map_node * m)
+{
+	put_page(m->page);
+	kmem_cache_free(ploop_map_cache, m);
+}
+
+static void map_check_limits(struct ploop_map * map)
+{
+	struct ploop_device * plo = map->plo;
+
+	if (plo->tune.max_map_pages &&
+	    map->pages > plo->tune.max_map_pages)
+		map_lru_scan(map, map->pages - plo->tune.max_map_pages);
 
 	if (atomic_read(&map_pages_nr) > max_map_pages)
-		map_lru_scan();
+		map_lru_scan(NULL, atomic_read(&map_pages_nr) - max_map_pages);
+}
+
+static struct map_node *
+map_create(struct ploop_map * map, cluster_t block)
+{
+	struct ploop_device * plo = map->plo;
+	struct map_node * m, * entry;
+	struct page * page;
+
+	page = alloc_page(GFP_NOFS);
+	if (unlikely(page == NULL))
+		return ERR_PTR(-ENOMEM);
+
+	m = map_node_alloc(map, map_pageno(block), page);
+	if (unlikely(m == NULL)) {
+		put_page(page);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	spin_lock_irq(&plo->lock);
+	entry = map_insert(map, m);
+	if (entry) {
+		atomic_inc(&entry->refcnt);
+		if (!list_empty(&entry->lru) &&
+		    atomic_read(&entry->refcnt) == 1) {
+			cond_flush_lru_buffer(map);
+			if (atomic_read(&entry->refcnt) == 1) {
+				atomic_inc(&entry->refcnt);
+				map->lru_buffer[map->lru_buffer_ptr++] = entry;
+			}
+		}
+		spin_unlock_irq(&plo->lock);
+		map_node_free(m);
+		return entry;
+	}
+	spin_unlock_irq(&plo->lock);
+
+	map_check_limits(map);
 
 	return m;
 }
 
-/* helper for trans_map_get_index() and map_get_index() */
+/*
+ * BAT readahead.
+ *
+ * Index pages are prefetched in batches of adjacent pages of top delta
+ * with synchronous io in ploop_map_wq, so requests are not stalled by it.
+ * Prefetched nodes are inserted uptodate and idle. Readahead is started
+ * for whole BAT on start with tune.map_prefetch and when index pages are
+ * faulted in sequentially.
+ */
+
+static int map_cache_full(struct ploop_map * map)
+{
+	struct ploop_device * plo = map->plo;
+
+	return (plo->tune.max_map_pages &&
+		map->pages >= plo->tune.max_map_pages) ||
+	       atomic_read(&map_pages_nr) >= max_map_pages;
+}
+
+/* Returns 0 if page was inserted to the map */
+static int map_insert_prefetched(struct ploop_map * map, cluster_t pageno,
+				 struct page * page, int level,
+				 unsigned long evictions)
+{
+	struct ploop_device * plo = map->plo;
+	struct map_node * m;
+
+	m = map_node_alloc(map, pageno, page);
+	if (m == NULL)
+		return -ENOMEM;
+
+	MAP_SET_LEVEL(m, level);
+	MAP_SET_UPTODATE(m, level);
+	set_bit(PLOOP_MAP_UPTODATE, &m->state);
+	atomic_set(&m->refcnt, 0);
+
+	spin_lock_irq(&plo->lock);
+	/* Node evicted while we were reading could have been written
+	 * back, on-disk copy we have read can be stale. */
+	if (test_bit(PLOOP_MAP_DEAD, &map->flags) ||
+	    map->evictions != evictions || map_insert(map, m)) {
+		spin_unlock_irq(&plo->lock);
+		kmem_cache_free(ploop_map_cache, m);
+		return -EEXIST;
+	}
+	plo->st.map_readahead++;
+	spin_lock(&map_lru_lock);
+	map_lru_add(m);
+	spin_unlock(&map_lru_lock);
+	spin_unlock_irq(&plo->lock);
+
+	return 0;
+}
+
+/* Read one batch of adjacent index pages starting from pageno.
+ * Returns number of pages processed, 0 at the end of BAT.
+ */
+static int map_readahead_batch(struct ploop_map * map, cluster_t pageno,
+			       unsigned int nr)
+{
+	struct ploop_device * plo = map->plo;
+	struct ploop_delta * top_delta = map_top_delta(map);
+	struct page * pvec[PLOOP_MAP_RA_MAX];
+	sector_t sec, first_sec = 0;
+	unsigned long evictions;
+	unsigned int i, n;
+	int err;
+
+	if (map_page_start(pageno) >= map->max_index)
+		return 0;
+
+	for (n = 0; n < nr && n < PLOOP_MAP_RA_MAX; n++) {
+		cluster_t block = map_page_start(pageno + n);
+		struct map_node * m;
+
+		if (block >= map->max_index)
+			break;
+
+		spin_lock_irq(&plo->lock);
+		m = map_lookup(map, block);
+		spin_unlock_irq(&plo->lock);
+
+		if (m || !top_delta->ops->map_index(top_delta, block, &sec))
+			break;
+		if (n == 0)
+			first_sec = sec;
+		else if (sec != first_sec + n * (PAGE_SIZE >> 9))
+			break;
+	}
+
+	/* Cached or absent in top delta, skip it */
+	if (n == 0)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		pvec[i] = alloc_page(GFP_NOFS);
+		if (pvec[i] == NULL)
+			break;
+	}
+	n = i;
+	if (n == 0)
+		return -ENOMEM;
+
+	spin_lock_irq(&plo->lock);
+	evictions = map->evictions;
+	spin_unlock_irq(&plo->lock);
+
+	err = top_delta->io.ops->sync_readvec(&top_delta->io, pvec, n, first_sec);
+
+	for (i = 0; i < n; i++) {
+		if (err || map_insert_prefetched(map, pageno + i, pvec[i],
+						 top_delta->level, evictions))
+			put_page(pvec[i]);
+	}
+
+	return err ? : n;
+}
+
+static void map_readahead_work(struct work_struct *work)
+{
+	struct ploop_map * map = container_of(work, struct ploop_map,
+					      ra_work.work);
+	struct ploop_device * plo = map->plo;
+	struct ploop_delta * top_delta;
+	unsigned int pageno, nr;
+	int n;
+
+	/* Delta list is stable only under ctl_mutex. Do not wait for it,
+	 * ioctls can hold it for a long time. */
+	if (!mutex_trylock(&plo->ctl_mutex)) {
+		queue_delayed_work(ploop_map_wq, &map->ra_work, HZ / 10);
+		return;
+	}
+
+	spin_lock_irq(&plo->lock);
+	pageno = map->ra_next;
+	nr = map->ra_nr;
+	map->ra_nr = 0;
+	spin_unlock_irq(&plo->lock);
+
+	if (!test_bit(PLOOP_S_RUNNING, &plo->state) ||
+	    list_empty(&map->delta_list))
+		goto out;
+
+	top_delta = map_top_delta(map);
+	if ((top_delta->ops->capability & PLOOP_FMT_CAP_IDENTICAL) ||
+	    !top_delta->io.ops->sync_readvec)
+		goto out;
+
+	while (nr && !map_cache_full(map) &&
+	       !test_bit(PLOOP_MAP_DEAD, &map->flags) &&
+	       !test_bit(PLOOP_S_ABORT, &plo->state)) {
+		n = map_readahead_batch(map, pageno, nr);
+		if (n <= 0)
+			break;
+		pageno += n;
+		nr -= min_t(unsigned int, nr, n);
+		cond_resched();
+	}
+out:
+	mutex_unlock(&plo->ctl_mutex);
+}
+
+/* Under plo->lock, m is index page being read on demand */
+static void map_readahead_trigger(struct ploop_map * map, struct map_node * m)
+{
+	struct ploop_device * plo = map->plo;
+	unsigned int pageno = map_pageno(m->mn_start);
+	unsigned int ra = plo->tune.map_readahead;
+
+	if (map == &plo->map && ra && !map->ra_nr &&
+	    !test_bit(PLOOP_MAP_IDENTICAL, &map->flags) &&
+	    (pageno == map->ra_last + 1 || pageno == map->ra_end)) {
+		map->ra_next = pageno + 1;
+		map->ra_nr = ra;
+		map->ra_end = map->ra_next + ra;
+		queue_delayed_work(ploop_map_wq, &map->ra_work, 0);
+	}
+	map->ra_last = pageno;
+}
+
 static iblock_t
 cluster2iblock(struct ploop_request *preq, struct map_node *m, cluster_t block,
 	       u32 *idx)
@@ -453,6 +831,211 @@ int map_get_index(struct ploop_request * preq, cluster_t block, iblock_t *result
 	return -1;
 }
 
+static void map_flat_free(struct ploop_map * map, struct map_flat * f)
+{
+	radix_tree_delete(&map->flat_tree, f->pageno);
+	list_del(&f->lru);
+	map->flat_pages--;
+	if (f->page)
+		put_page(f->page);
+	kfree(f);
+}
+
+static void map_flat_destroy(struct ploop_map * map)
+{
+	while (!list_empty(&map->flat_lru))
+		map_flat_free(map, list_first_entry(&map->flat_lru,
+						    struct map_flat, lru));
+}
+
+/* Returns entry for m if it is valid for current top delta */
+static struct map_flat * map_flat_lookup(struct map_node * m)
+{
+	struct ploop_map * map = m->parent;
+	struct map_flat * f;
+
+	if (map != &map->plo->map || list_empty(&map->delta_list))
+		return NULL;
+
+	f = radix_tree_lookup(&map->flat_tree, map_pageno(m->mn_start));
+	if (f == NULL)
+		return NULL;
+
+	if (f->top_level != map_top_delta(map)->level) {
+		map_flat_free(map, f);
+		return NULL;
+	}
+
+	list_move_tail(&f->lru, &map->flat_lru);
+	return f;
+}
+
+static struct map_flat * map_flat_create(struct map_node * m)
+{
+	struct ploop_map * map = m->parent;
+	struct map_flat * f;
+
+	f = kmalloc(sizeof(struct map_flat) + INDEX_PER_PAGE, GFP_NOFS);
+	if (f == NULL)
+		return NULL;
+
+	f->page = alloc_page(GFP_NOFS | __GFP_ZERO);
+	if (f->page == NULL)
+		goto out_free;
+
+	f->pageno = map_pageno(m->mn_start);
+	f->top_level = map_top_delta(map)->level;
+	f->uptodate = f->top_level;
+
+	if (radix_tree_insert(&map->flat_tree, f->pageno, f))
+		goto out_put;
+
+	list_add_tail(&f->lru, &map->flat_lru);
+	map->flat_pages++;
+	return f;
+
+out_put:
+	put_page(f->page);
+out_free:
+	kfree(f);
+	return NULL;
+}
+
+/* Replaces entry f mapping one run of clusters with its short form */
+static void map_flat_make_run(struct ploop_map * map, struct map_flat * f,
+			      int skip)
+{
+	map_index_t step = 1 << ploop_map_log(map->plo);
+	map_index_t * idx = page_address(f->page);
+	struct map_flat * r;
+	void ** slot;
+	int i;
+
+	for (i = skip; i < INDEX_PER_PAGE; i++)
+		if (idx[i] == 0 || idx[i] != idx[skip] + (i - skip) * step ||
+		    f->levels[i] != f->levels[skip])
+			return;
+
+	r = kmalloc(sizeof(struct map_flat), GFP_NOFS);
+	if (r == NULL)
+		return;
+
+	*r = *f;
+	r->run_start = idx[skip];
+	r->run_level = f->levels[skip];
+	r->page = NULL;
+
+	slot = radix_tree_lookup_slot(&map->flat_tree, f->pageno);
+	radix_tree_replace_slot(slot, r);
+	list_replace(&f->lru, &r->lru);
+
+	put_page(f->page);
+	kfree(f);
+	map->plo->st.map_flat_runs++;
+}
+
+/*
+ * Called by merge of index page of delta at level into m, before
+ * MAP_UPTODATE(m) is lowered to it. The levels in between were skipped
+ * as having no such index page, so the entry takes this level only if it
+ * already has all the levels above it.
+ */
+static void map_flat_update(struct map_node * m, map_index_t * merged,
+			    int level)
+{
+	struct ploop_map * map = m->parent;
+	int skip = m->mn_start == 0 ? PLOOP_MAP_OFFSET : 0;
+	map_index_t * idx;
+	struct map_flat * f;
+	int i;
+
+	if (!map->plo->tune.flat_map_pages ||
+	    MAP_LEVEL(m) != map_top_delta(map)->level)
+		return;
+
+	f = map_flat_lookup(m);
+	if (f == NULL) {
+		/* Everything above level is in node itself */
+		if (MAP_UPTODATE(m) != MAP_LEVEL(m))
+			return;
+		while (map->flat_pages >= map->plo->tune.flat_map_pages)
+			map_flat_free(map, list_first_entry(&map->flat_lru,
+							    struct map_flat, lru));
+		f = map_flat_create(m);
+		if (f == NULL)
+			return;
+	}
+
+	if (f->uptodate <= level || f->uptodate > MAP_UPTODATE(m))
+		return;
+
+	/* A run has no holes for this level to fill */
+	if (f->page == NULL) {
+		f->uptodate = level;
+		return;
+	}
+
+	idx = page_address(f->page);
+	for (i = skip; i < INDEX_PER_PAGE; i++) {
+		if (idx[i] == 0 && merged[i] != 0) {
+			idx[i] = merged[i];
+			f->levels[i] = level;
+		}
+	}
+	f->uptodate = level;
+
+	map_flat_make_run(map, f, skip);
+}
+
+/*
+ * Merges all the known lower levels into m, which must be uptodate with
+ * no index read in flight. Returns 1 if MAP_UPTODATE(m) was lowered.
+ */
+static int map_flat_apply(struct map_node * m)
+{
+	struct ploop_device * plo = m->parent->plo;
+	int skip = m->mn_start == 0 ? PLOOP_MAP_OFFSET : 0;
+	map_index_t step = 1 << ploop_map_log(plo);
+	map_index_t * map, * idx = NULL;
+	struct map_flat * f;
+	int i;
+
+	f = map_flat_lookup(m);
+	if (f == NULL || f->uptodate >= MAP_UPTODATE(m) ||
+	    MAP_LEVEL(m) != f->top_level)
+		return 0;
+
+	map = page_address(m->page);
+	if (f->page)
+		idx = page_address(f->page);
+
+	for (i = skip; i < INDEX_PER_PAGE; i++) {
+		if (map[i] != 0 || (idx && idx[i] == 0))
+			continue;
+		if (!m->levels) {
+			m->levels = kmalloc(INDEX_PER_PAGE, GFP_NOFS);
+			if (unlikely(m->levels == NULL))
+				return 0;
+			memset(m->levels, MAP_LEVEL(m), INDEX_PER_PAGE);
+		}
+		if (idx) {
+			m->levels[i] = f->levels[i];
+			map[i] = idx[i];
+		} else {
+			m->levels[i] = f->run_level;
+			map[i] = f->run_start + (i - skip) * step;
+		}
+	}
+
+	spin_lock_irq(&plo->lock);
+	MAP_SET_UPTODATE(m, f->uptodate);
+	spin_unlock_irq(&plo->lock);
+
+	plo->st.map_flat_hits++;
+	__TRACE("MAP F %u %d\n", m->mn_start, f->uptodate);
+	return 1;
+}
+
 int map_index_fault(struct ploop_request * preq)
 {
 	struct ploop_device * plo = preq->plo;
@@ -470,6 +1053,14 @@ int map_index_fault(struct ploop_request * preq)
 		return -1;
 	}
 
+	/* Lower levels were merged before, look the cluster up again */
+	if (!test_bit(PLOOP_MAP_READ, &m->state) && map_flat_apply(m)) {
+		spin_lock_irq(&plo->lock);
+		list_add_tail(&preq->list, &plo->ready_queue);
+		spin_unlock_irq(&plo->lock);
+		return 0;
+	}
+
 	top_delta = ploop_top_delta(plo);
 	delta = NULL;
 
@@ -502,6 +1093,7 @@ int map_index_fault(struct ploop_request * preq)
 	if (test_and_set_bit(PLOOP_MAP_READ, &m->state)) {
 		__TRACE("r %p %u %p\n", preq, preq->req_cluster, m);
 		list_add_tail(&preq->list, &m->io_queue);
+		preq->lat_phase = PLOOP_LAT_MAP;
 		plo->st.merge_lockouts++;
 		spin_unlock_irq(&plo->lock);
 		/* Someone already scheduled read. */
@@ -537,6 +1129,10 @@ static void map_read_endio(struct ploop_request * preq, struct map_node * m)
 	struct list_head * n, *pn;
 	LIST_HEAD(list);
 
+	/* Node is read from top delta, add the lower levels known */
+	if (!preq->error)
+		map_flat_apply(m);
+
 	spin_lock_irq(&plo->lock);
 
 	if (!preq->error) {
@@ -597,6 +1193,8 @@ static void map_merge_endio(struct ploop_request * preq, struct map_node * m)
 		map[i] = merged[i];
 	}
 
+	map_flat_update(m, merged, preq->sinfo.ri.level);
+
 	put_page(preq->sinfo.ri.tpage);
 	preq->sinfo.ri.tpage = NULL;
 
@@ -703,6 +1301,7 @@ static int ploop_read_map(struct ploop_map * map, struct ploop_request * preq)
 		}
 
 		if (!test_and_set_bit(PLOOP_MAP_READ, &m->state)) {
+			map_readahead_trigger(map, m);
 			spin_unlock_irq(&plo->lock);
 
 			return ploop_map_start_read(map, preq, m);
@@ -710,6 +1309,7 @@ static int ploop_read_map(struct ploop_map * map, struct ploop_request * preq)
 			__TRACE("g %p %u %p\n", preq, preq->req_cluster, m);
 			plo->st.map_lockouts++;
 			list_add_tail(&preq->list, &m->io_queue);
+			preq->lat_phase = PLOOP_LAT_MAP;
 			err = 1;
 		}
 	}
@@ -723,9 +1323,15 @@ void ploop_update_map(struct ploop_map * map, int level,
 		      cluster_t block, iblock_t iblk)
 {
 	struct map_node * m;
+	struct map_flat * f;
 	u32 idx;
 	map_index_t *p;
 
+	/* Device is quiesced, main thread does not use flattened index */
+	f = radix_tree_lookup(&map->flat_tree, map_pageno(block));
+	if (f)
+		map_flat_free(map, f);
+
 	spin_lock_irq(&map->plo->lock);
 
 	m = map_lookup(map, block);
@@ -791,7 +1397,9 @@ int ploop_find_trans_map(struct ploop_map * map, struct ploop_request * preq)
 					map->lru_buffer[map->lru_buffer_ptr++] = m;
 				}
 			}
-		}
+			map->plo->st.map_hits++;
+		} else
+			map->plo->st.map_misses++;
 		spin_unlock_irq(&map->plo->lock);
 
 		if (m == NULL) {
@@ -844,7 +1452,9 @@ int ploop_find_map(struct ploop_map * map, struct ploop_request * preq)
 					map->lru_buffer[map->lru_buffer_ptr++] = m;
 				}
 			}
-		}
+			map->plo->st.map_hits++;
+		} else
+			map->plo->st.map_misses++;
 		spin_unlock_irq(&map->plo->lock);
 
 		if (m == NULL) {
@@ -890,6 +1500,56 @@ static void copy_index_for_wb(struct page * page, struct map_node * m, int level
 
 /* Data write is commited. Now we need to update index. */
 
+static void map_wb_delayed(struct map_node * m);
+
+/* Index update of this request may wait for others to be written
+ * together. Ordered and relocation writes are issued at once. */
+static inline int map_wb_group_allowed(struct ploop_request * preq)
+{
+	return !(preq->req_rw & (BIO_FUA | BIO_FLUSH)) &&
+	       !test_bit(PLOOP_REQ_SYNC, &preq->state) &&
+	       !test_bit(PLOOP_REQ_RELOC_A, &preq->state) &&
+	       !test_bit(PLOOP_REQ_RELOC_S, &preq->state) &&
+	       !test_bit(PLOOP_REQ_ZERO, &preq->state);
+}
+
+/* Close group and write all collected indices with one write */
+static void map_wb_group_commit(struct map_node * m)
+{
+	clear_bit(PLOOP_MAP_WB_GROUP, &m->state);
+	list_del_init(&m->wb_link);
+	m->wb_nr = 0;
+	map_wb_delayed(m);
+}
+
+/* Called by main thread: commit groups with expired deadline, or all of
+ * them when @force (barrier or stop is waiting for active requests). */
+void ploop_map_wb_flush(struct ploop_map * map, int force)
+{
+	struct map_node * m, * tmp;
+
+	list_for_each_entry_safe(m, tmp, &map->wb_group, wb_link) {
+		if (!force && time_before(jiffies, m->wb_deadline))
+			break;
+		map_wb_group_commit(m);
+	}
+}
+
+/* How long main thread may sleep before some group is due */
+long ploop_map_wb_timeout(struct ploop_map * map)
+{
+	struct map_node * m;
+
+	if (list_empty(&map->wb_group))
+		return MAX_SCHEDULE_TIMEOUT;
+
+	m = list_first_entry(&map->wb_group, struct map_node, wb_link);
+	if (time_after_eq(jiffies, m->wb_deadline))
+		return 0;
+
+	return m->wb_deadline - jiffies;
+}
+
 void ploop_index_update(struct ploop_request * preq)
 {
 	struct ploop_device * plo = preq->plo;
@@ -932,6 +1592,24 @@ void ploop_index_update(struct ploop_request * preq)
 		preq->eng_state = PLOOP_E_INDEX_DELAY;
 		list_add_tail(&preq->list, &m->io_queue);
 		__TRACE("d %p %u %p\n", preq, preq->req_cluster, m);
+		if (test_bit(PLOOP_MAP_WB_GROUP, &m->state) &&
+		    (++m->wb_nr >= plo->tune.index_wb_batch ||
+		     !map_wb_group_allowed(preq)))
+			map_wb_group_commit(m);
+		return;
+	}
+
+	if (m->parent == &plo->map && plo->tune.index_wb_delay &&
+	    plo->tune.index_wb_batch > 1 && map_wb_group_allowed(preq)) {
+		/* Open group, index write is issued when it is full or
+		 * deadline expires, see ploop_map_wb_flush() */
+		preq->eng_state = PLOOP_E_INDEX_DELAY;
+		list_add_tail(&preq->list, &m->io_queue);
+		set_bit(PLOOP_MAP_WB_GROUP, &m->state);
+		m->wb_nr = 1;
+		m->wb_deadline = jiffies + plo->tune.index_wb_delay;
+		list_add_tail(&m->wb_link, &m->parent->wb_group);
+		__TRACE("G %p %u %p\n", preq, preq->req_cluster, m);
 		return;
 	}
 
@@ -1073,12 +1751,8 @@ static void map_wb_complete(struct map_node * m, int err)
 	struct ploop_device * plo = m->parent->plo;
 	struct ploop_delta * top_delta = map_top_delta(m->parent);
 	struct list_head * cursor, * tmp;
-	struct ploop_request * main_preq;
-	struct page * page = NULL;
 	int delayed = 0;
 	unsigned int idx;
-	sector_t sec;
-	int fua, force_fua;
 
 	/* First, complete processing of written back indices,
 	 * finally instantiate indices in mapping cache.
@@ -1143,6 +1817,21 @@ static void map_wb_complete(struct map_node * m, int err)
 		return;
 	}
 
+	map_wb_delayed(m);
+}
+
+/* Write page with all indices of requests in PLOOP_E_INDEX_DELAY */
+static void map_wb_delayed(struct map_node * m)
+{
+	struct ploop_device * plo = m->parent->plo;
+	struct ploop_delta * top_delta = map_top_delta(m->parent);
+	struct list_head * cursor, * tmp;
+	struct ploop_request * main_preq;
+	struct page * page;
+	unsigned int idx;
+	sector_t sec;
+	int fua, force_fua;
+
 	page = alloc_page(GFP_NOFS);
 	if (page)
 		copy_index_for_wb(page, m, top_delta->level);
@@ -1226,6 +1915,15 @@ void ploop_map_start(struct ploop_map * map, u64 bd_size)
 
 	map->max_index = (bd_size + (1 << plo->cluster_log) - 1 ) >> plo->cluster_log;
 	map->flags = 0;
+
+	if (map == &plo->map && plo->tune.map_prefetch && map->max_index) {
+		spin_lock_irq(&plo->lock);
+		map->ra_next = 0;
+		map->ra_nr = map_pageno(map->max_index - 1) + 1;
+		map->ra_end = map->ra_nr;
+		spin_unlock_irq(&plo->lock);
+		queue_delayed_work(ploop_map_wq, &map->ra_work, 0);
+	}
 }
 
 
@@ -1248,8 +1946,12 @@ void ploop_map_destroy(struct ploop_map * map)
 	int i;
 	struct rb_node * node;
 
+	cancel_delayed_work_sync(&map->ra_work);
+	map_flat_destroy(map);
+
 	spin_lock_irq(&map->plo->lock);
 	set_bit(PLOOP_MAP_DEAD, &map->flags);
+	map->ra_nr = 0;
 
 	for (i = 0; i < map->lru_buffer_ptr; i++)
 		atomic_dec(&map->lru_buffer[i]->refcnt);
@@ -1293,11 +1995,21 @@ int __init ploop_map_init(void)
 						);
 	if (!ploop_map_cache)
 		return -ENOMEM;
+	ploop_map_wq = create_singlethread_workqueue("ploop_map");
+	if (!ploop_map_wq) {
+		kmem_cache_destroy(ploop_map_cache);
+		ploop_map_cache = NULL;
+		return -ENOMEM;
+	}
+	register_shrinker(&map_shrinker);
 	return 0;
 }
 
 void ploop_map_exit(void)
 {
-	if (ploop_map_cache)
+	if (ploop_map_cache) {
+		unregister_shrinker(&map_shrinker);
+		destroy_workqueue(ploop_map_wq);
 		kmem_cache_destroy(ploop_map_cache);
+	}
 }
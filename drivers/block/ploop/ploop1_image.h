@@ -283,36 +283,38 @@ get_SizeInSectors_from_le(struct ploop_pvd_header *vh, int version)
 }
 
 static inline void
-put_SizeInSectors(u64 SizeInSectors, struct ploop_pvd_header *vh,
-		  int version)
+cpu_to_le_SizeInSectors(struct ploop_pvd_header *vh, int version)
 {
 	switch (version) {
 	case PLOOP_FMT_V1:
-		vh->m_SizeInSectors_v1 = SizeInSectors;
+		vh->m_SizeInSectors_v1 = cpu_to_le32(vh->m_SizeInSectors_v1);
 		break;
 	case PLOOP_FMT_V2:
-		vh->m_SizeInSectors_v2 = SizeInSectors;
+		vh->m_SizeInSectors_v2 = cpu_to_le64(vh->m_SizeInSectors_v2);
 		break;
 	default:
 		BUG();
 	}
 }
+#endif
 
 static inline void
-cpu_to_le_SizeInSectors(struct ploop_pvd_header *vh, int version)
+put_SizeInSectors(__u64 SizeInSectors, struct ploop_pvd_header *vh,
+		  int version)
 {
 	switch (version) {
 	case PLOOP_FMT_V1:
-		vh->m_SizeInSectors_v1 = cpu_to_le32(vh->m_SizeInSectors_v1);
+		vh->m_SizeInSectors_v1 = SizeInSectors;
 		break;
 	case PLOOP_FMT_V2:
-		vh->m_SizeInSectors_v2 = cpu_to_le64(vh->m_SizeInSectors_v2);
+		vh->m_SizeInSectors_v2 = SizeInSectors;
 		break;
+#ifdef __KERNEL__
 	default:
 		BUG();
+#endif
 	}
 }
-#endif
 
 /*
  * Returns: "size to fill" (in bytes)
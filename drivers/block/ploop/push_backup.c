@@ -0,0 +1,194 @@
+/* Push backup: user-space backup client reads clusters of running ploop
+ * device in the order kernel chooses. A write to a cluster not backed up
+ * yet is held until the client reports the cluster as backed up
+ * (copy-before-write), so the client sees the device as it was when
+ * backup started, without snapshot and subsequent merge.
+ */
+
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/vmalloc.h>
+#include <linux/bitmap.h>
+#include <asm/uaccess.h>
+
+#include <linux/ploop/ploop.h>
+#include "push_backup.h"
+
+/* Longest extent returned by PLOOP_IOC_PUSH_BACKUP_GET */
+#define PLOOP_PB_MAX_EXTENT	256
+
+struct ploop_pushbackup_desc {
+	struct ploop_device *plo;
+	unsigned long	*map;		/* clusters not backed up yet */
+	u32		nr_clusters;
+	u32		nr_left;
+	u32		ptr;		/* next cluster to scan from */
+	struct list_head pending;	/* writes held by copy-before-write */
+};
+
+static void ploop_pb_release(struct ploop_pushbackup_desc *pbd, int all)
+{
+	struct ploop_device *plo = pbd->plo;
+	struct ploop_request *preq, *tmp;
+	int kicked = 0;
+
+	list_for_each_entry_safe(preq, tmp, &pbd->pending, list) {
+		if (!all && test_bit(preq->req_cluster, pbd->map))
+			continue;
+
+		list_move_tail(&preq->list, &plo->ready_queue);
+		kicked = 1;
+	}
+
+	if (kicked && test_bit(PLOOP_S_WAIT_PROCESS, &plo->state))
+		wake_up_interruptible(&plo->waitq);
+}
+
+/* Called by main thread for every write preq entering state machine.
+ * Returns 1 if preq was held. */
+int ploop_pb_check_and_park(struct ploop_device *plo,
+			    struct ploop_request *preq)
+{
+	struct ploop_pushbackup_desc *pbd;
+	int ret = 0;
+
+	spin_lock_irq(&plo->lock);
+	pbd = plo->pbd;
+	if (pbd && preq->req_cluster < pbd->nr_clusters &&
+	    test_bit(preq->req_cluster, pbd->map)) {
+		list_add_tail(&preq->list, &pbd->pending);
+		plo->st.bio_pb_held++;
+		ret = 1;
+	}
+	spin_unlock_irq(&plo->lock);
+
+	return ret;
+}
+
+int ploop_pb_init_ioc(struct ploop_device *plo)
+{
+	struct ploop_pushbackup_desc *pbd;
+	u32 nr;
+
+	if (!test_bit(PLOOP_S_RUNNING, &plo->state))
+		return -EINVAL;
+
+	if (plo->maintenance_type != PLOOP_MNTN_OFF)
+		return -EBUSY;
+
+	pbd = kzalloc(sizeof(*pbd), GFP_KERNEL);
+	if (!pbd)
+		return -ENOMEM;
+
+	nr = DIV_ROUND_UP(plo->bd_size, 1 << plo->cluster_log);
+	pbd->map = vmalloc(BITS_TO_LONGS(nr) * sizeof(unsigned long));
+	if (!pbd->map) {
+		kfree(pbd);
+		return -ENOMEM;
+	}
+
+	bitmap_fill(pbd->map, nr);
+	pbd->plo = plo;
+	pbd->nr_clusters = nr;
+	pbd->nr_left = nr;
+	INIT_LIST_HEAD(&pbd->pending);
+
+	/* Backup represents the state of device when nothing is in flight */
+	ploop_quiesce(plo);
+
+	spin_lock_irq(&plo->lock);
+	plo->pbd = pbd;
+	spin_unlock_irq(&plo->lock);
+	plo->maintenance_type = PLOOP_MNTN_PUSH_BACKUP;
+
+	ploop_relax(plo);
+
+	return 0;
+}
+
+int ploop_pb_get_ioc(struct ploop_device *plo, unsigned long arg)
+{
+	struct ploop_pushbackup_desc *pbd = plo->pbd;
+	struct ploop_push_backup_extent e;
+	u32 clu, end;
+
+	if (plo->maintenance_type != PLOOP_MNTN_PUSH_BACKUP || !pbd)
+		return -EINVAL;
+
+	e.clu = e.len = 0;
+
+	spin_lock_irq(&plo->lock);
+	if (!pbd->nr_left)
+		goto out;
+
+	if (!list_empty(&pbd->pending)) {
+		struct ploop_request *preq;
+
+		preq = list_entry(pbd->pending.next, struct ploop_request, list);
+		clu = preq->req_cluster;
+	} else {
+		clu = find_next_bit(pbd->map, pbd->nr_clusters, pbd->ptr);
+		if (clu >= pbd->nr_clusters)
+			clu = find_first_bit(pbd->map, pbd->nr_clusters);
+	}
+
+	end = find_next_zero_bit(pbd->map, pbd->nr_clusters, clu);
+	if (end - clu > PLOOP_PB_MAX_EXTENT)
+		end = clu + PLOOP_PB_MAX_EXTENT;
+
+	pbd->ptr = end;
+	e.clu = clu;
+	e.len = end - clu;
+out:
+	spin_unlock_irq(&plo->lock);
+
+	if (copy_to_user((void *)arg, &e, sizeof(e)))
+		return -EFAULT;
+
+	return 0;
+}
+
+int ploop_pb_ack_ioc(struct ploop_device *plo, unsigned long arg)
+{
+	struct ploop_pushbackup_desc *pbd = plo->pbd;
+	struct ploop_push_backup_extent e;
+	u32 clu;
+
+	if (plo->maintenance_type != PLOOP_MNTN_PUSH_BACKUP || !pbd)
+		return -EINVAL;
+
+	if (copy_from_user(&e, (void *)arg, sizeof(e)))
+		return -EFAULT;
+
+	if (e.clu >= pbd->nr_clusters || e.len > pbd->nr_clusters - e.clu)
+		return -EINVAL;
+
+	spin_lock_irq(&plo->lock);
+	for (clu = e.clu; clu < e.clu + e.len; clu++)
+		if (__test_and_clear_bit(clu, pbd->map))
+			pbd->nr_left--;
+
+	ploop_pb_release(pbd, 0);
+	spin_unlock_irq(&plo->lock);
+
+	return 0;
+}
+
+int ploop_pb_stop_ioc(struct ploop_device *plo)
+{
+	struct ploop_pushbackup_desc *pbd = plo->pbd;
+
+	if (plo->maintenance_type != PLOOP_MNTN_PUSH_BACKUP || !pbd)
+		return -EINVAL;
+
+	spin_lock_irq(&plo->lock);
+	ploop_pb_release(pbd, 1);
+	plo->pbd = NULL;
+	spin_unlock_irq(&plo->lock);
+
+	plo->maintenance_type = PLOOP_MNTN_OFF;
+
+	vfree(pbd->map);
+	kfree(pbd);
+	return 0;
+}
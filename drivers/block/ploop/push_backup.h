@@ -0,0 +1,13 @@
+#ifndef _LINUX_PLOOP_PUSH_BACKUP_H_
+#define _LINUX_PLOOP_PUSH_BACKUP_H_
+
+struct ploop_pushbackup_desc;
+
+extern int ploop_pb_init_ioc(struct ploop_device *plo);
+extern int ploop_pb_get_ioc(struct ploop_device *plo, unsigned long arg);
+extern int ploop_pb_ack_ioc(struct ploop_device *plo, unsigned long arg);
+extern int ploop_pb_stop_ioc(struct ploop_device *plo);
+extern int ploop_pb_check_and_park(struct ploop_device *plo,
+				   struct ploop_request *preq);
+
+#endif // _LINUX_PLOOP_PUSH_BACKUP_H_
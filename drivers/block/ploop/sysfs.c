@@ -341,6 +341,38 @@ static int store_aborted(struct ploop_device * plo, u32 val)
 	return 0;
 }
 
+static u32 show_merge_paused(struct ploop_device * plo)
+{
+	return test_bit(PLOOP_S_MERGE_PAUSED, &plo->state);
+}
+
+static int store_merge_paused(struct ploop_device * plo, u32 val)
+{
+	ploop_merge_pause(plo, !!val);
+	return 0;
+}
+
+static u32 show_merge_done(struct ploop_device * plo)
+{
+	return plo->merge_done;
+}
+
+static u32 show_merge_total(struct ploop_device * plo)
+{
+	u32 ret = 0;
+
+	mutex_lock(&plo->sysfs_mutex);
+	if (plo->maintenance_type == PLOOP_MNTN_MERGE && plo->trans_map)
+		ret = plo->trans_map->max_index;
+	mutex_unlock(&plo->sysfs_mutex);
+	return ret;
+}
+
+static u32 show_merge_pos(struct ploop_device * plo)
+{
+	return plo->maintenance_type == PLOOP_MNTN_MERGE ? plo->merge_ptr : 0;
+}
+
 static u32 show_top(struct ploop_device * plo)
 {
 	int top = -1;
@@ -401,6 +433,40 @@ static ssize_t print_cookie(struct ploop_device * plo, char * page)
 	return sprintf(page, "%s\n", plo->cookie);
 }
 
+static const char *lat_names[PLOOP_LAT_MAX] = {
+	[PLOOP_LAT_QUEUE]	= "queue",
+	[PLOOP_LAT_LOCKOUT]	= "lockout",
+	[PLOOP_LAT_MAP]		= "map",
+	[PLOOP_LAT_DATA]	= "data",
+	[PLOOP_LAT_INDEX]	= "index",
+	[PLOOP_LAT_FSYNC]	= "fsync",
+	[PLOOP_LAT_TOTAL]	= "total",
+};
+
+/* One line per phase: name, total us, then counts of log2 us buckets */
+static ssize_t print_latency(struct ploop_device * plo, char * page)
+{
+	ssize_t len = 0;
+	int i, n;
+
+	for (i = 0; i < PLOOP_LAT_MAX; i++) {
+		len += sprintf(page + len, "%s %llu", lat_names[i],
+			       (unsigned long long)plo->lat.sum[i]);
+		for (n = 0; n < PLOOP_LAT_BUCKETS; n++)
+			len += sprintf(page + len, " %u", plo->lat.hist[i][n]);
+		page[len++] = '\n';
+	}
+	return len;
+}
+
+static int store_latency(struct ploop_device * plo, u32 val)
+{
+	spin_lock_irq(&plo->lock);
+	memset(&plo->lat, 0, sizeof(plo->lat));
+	spin_unlock_irq(&plo->lock);
+	return 0;
+}
+
 #define _TUNE_U32(_name)				\
 static u32 show_##_name(struct ploop_device * plo)	\
 {							\
@@ -443,6 +509,40 @@ _TUNE_BOOL(disable_user_threshold);
 _TUNE_U32(congestion_high_watermark);
 _TUNE_U32(congestion_low_watermark);
 _TUNE_U32(max_active_requests);
+_TUNE_U32(max_map_pages);
+_TUNE_U32(map_readahead);
+_TUNE_BOOL(map_prefetch);
+_TUNE_JIFFIES(index_wb_delay);
+_TUNE_U32(index_wb_batch);
+_TUNE_U32(kaio_batch);
+_TUNE_U32(dio_plug_batch);
+_TUNE_U32(merge_reqs);
+_TUNE_U32(merge_iops);
+_TUNE_U32(merge_kbps);
+_TUNE_U32(reloc_reqs);
+_TUNE_U32(grow_iops);
+_TUNE_U32(grow_kbps);
+_TUNE_U32(flat_map_pages);
+_TUNE_BOOL(shared_cache);
+_TUNE_U32(nfs_window);
+_TUNE_BOOL(nfs_coalesce);
+_TUNE_U32(cache_dirty_ratio);
+_TUNE_JIFFIES(cache_wb_delay);
+_TUNE_BOOL(cache_promote);
+_TUNE_U32(discard_batch);
+
+static u32 show_map_priority(struct ploop_device * plo)
+{
+	return plo->tune.map_priority;
+}
+
+static int store_map_priority(struct ploop_device * plo, u32 val)
+{
+	if (val > PLOOP_MAP_PRIO_MAX)
+		return -EINVAL;
+	plo->tune.map_priority = val;
+	return 0;
+}
 
 
 struct pattr_sysfs_entry {
@@ -461,6 +561,9 @@ struct pattr_sysfs_entry {
 #define _A3(_name)							\
 &((struct pattr_sysfs_entry){ .attr = { .name = __stringify(_name), .mode = S_IRUGO }, .print = print_##_name, }).attr
 
+#define _A4(_name)							\
+&((struct pattr_sysfs_entry){ .attr = { .name = __stringify(_name), .mode = S_IRUGO|S_IWUSR }, .print = print_##_name, .store = store_##_name, }).attr
+
 static struct attribute *state_attributes[] = {
 	_A(block_size),
 	_A(fmt_version),
@@ -481,6 +584,11 @@ static struct attribute *state_attributes[] = {
 	_A(event),
 	_A3(cookie),
 	_A(open_count),
+	_A(merge_pos),
+	_A(merge_total),
+	_A(merge_done),
+	_A2(merge_paused),
+	_A4(latency),
 	NULL
 };
 
@@ -501,6 +609,28 @@ static struct attribute *tune_attributes[] = {
 	_A2(congestion_high_watermark),
 	_A2(congestion_low_watermark),
 	_A2(max_active_requests),
+	_A2(max_map_pages),
+	_A2(map_priority),
+	_A2(map_readahead),
+	_A2(map_prefetch),
+	_A2(index_wb_delay),
+	_A2(index_wb_batch),
+	_A2(kaio_batch),
+	_A2(dio_plug_batch),
+	_A2(merge_reqs),
+	_A2(merge_iops),
+	_A2(merge_kbps),
+	_A2(reloc_reqs),
+	_A2(grow_iops),
+	_A2(grow_kbps),
+	_A2(flat_map_pages),
+	_A2(shared_cache),
+	_A2(nfs_window),
+	_A2(nfs_coalesce),
+	_A2(cache_dirty_ratio),
+	_A2(cache_wb_delay),
+	_A2(cache_promote),
+	_A2(discard_batch),
 	NULL
 };
 
@@ -5,88 +5,92 @@
 #include <linux/sched.h>
 #include <linux/fs.h>
 #include <linux/interrupt.h>
+#include <linux/bitmap.h>
 #include <asm/uaccess.h>
 
 #include <linux/ploop/ploop.h>
 
-struct track_record
+/* Changed clusters are kept in a bitmap, one bit per cluster of the top
+ * delta. Bitmap pages are allocated on first write to the range they
+ * cover and are indexed by plo->track_pages radix tree, so that memory
+ * is proportional to the dirtied part of the image, not to its size.
+ * Adjacent bits are merged into extents when the tracker is read.
+ */
+
+#define TRACK_BITS_PER_PAGE	(PAGE_SIZE * 8)
+
+static inline unsigned long *track_page_bits(struct page * page)
 {
-	struct rb_node	rb_node;
-	u32		start;
-	u32		end;
-};
+	return page_address(page);
+}
 
-static int tree_insert(struct rb_root *root, struct track_record *m)
+static struct page * track_page_get(struct ploop_device * plo,
+				    unsigned long idx)
 {
-	struct rb_node ** p = &root->rb_node;
-	struct rb_node * parent = NULL;
-	struct track_record * entry;
-
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct track_record, rb_node);
-
-		if (m->start < entry->start)
-			p = &(*p)->rb_left;
-		else if (m->start >= entry->end)
-			p = &(*p)->rb_right;
-		else
-			return -EEXIST;
+	struct page * page, * new;
+
+	page = radix_tree_lookup(&plo->track_pages, idx);
+	if (page)
+		return page;
+
+	spin_unlock(&plo->track_lock);
+
+	new = alloc_page(GFP_NOFS | __GFP_ZERO);
+	if (new && radix_tree_preload(GFP_NOFS)) {
+		__free_page(new);
+		new = NULL;
 	}
 
-	rb_link_node(&m->rb_node, parent, p);
-	rb_insert_color(&m->rb_node, root);
-	return 0;
+	spin_lock(&plo->track_lock);
+
+	if (new == NULL)
+		return NULL;
+
+	page = radix_tree_lookup(&plo->track_pages, idx);
+	if (page == NULL) {
+		new->index = idx;
+		if (radix_tree_insert(&plo->track_pages, idx, new) == 0) {
+			page = new;
+			new = NULL;
+		}
+	}
+	radix_tree_preload_end();
+
+	if (new)
+		__free_page(new);
+	return page;
+}
+
+static void track_page_put(struct ploop_device * plo, unsigned long idx,
+			   struct page * page)
+{
+	if (find_first_bit(track_page_bits(page), TRACK_BITS_PER_PAGE) <
+	    TRACK_BITS_PER_PAGE)
+		return;
+
+	radix_tree_delete(&plo->track_pages, idx);
+	__free_page(page);
 }
 
 void ploop_tracker_notify(struct ploop_device * plo, sector_t sec)
 {
-	struct track_record * m;
+	struct page * page;
+	u32 clu;
 
 	if (!test_bit(PLOOP_S_TRACK, &plo->state))
 		return;
 	if (test_bit(PLOOP_S_TRACK_ABORT, &plo->state))
 		return;
 
-	sec >>= plo->cluster_log;
-
-	m = kmalloc(sizeof(struct track_record), GFP_NOFS);
-	if (m == NULL) {
-		set_bit(PLOOP_S_TRACK_ABORT, &plo->state);
-		return;
-	}
-
-	m->start = sec;
-	m->end = sec + 1;
+	clu = sec >> plo->cluster_log;
 
 	spin_lock(&plo->track_lock);
-	if (tree_insert(&plo->track_tree, m)) {
-		kfree(m);
-	} else {
-		struct rb_node * rb;
-		struct track_record * merge;
-
-		if (m->start != 0) {
-			rb = rb_prev(&m->rb_node);
-			if (rb) {
-				merge = rb_entry(rb, struct track_record, rb_node);
-				if (m->start == merge->end) {
-					m->start = merge->start;
-					rb_erase(&merge->rb_node, &plo->track_tree);
-					kfree(merge);
-				}
-			}
-		}
-
-		rb = rb_next(&m->rb_node);
-		if (rb) {
-			merge = rb_entry(rb, struct track_record, rb_node);
-			if (m->end == merge->start) {
-				m->end = merge->end;
-				rb_erase(&merge->rb_node, &plo->track_tree);
-				kfree(merge);
-			}
-		}
+	page = track_page_get(plo, clu / TRACK_BITS_PER_PAGE);
+	if (page == NULL) {
+		set_bit(PLOOP_S_TRACK_ABORT, &plo->state);
+	} else if (!__test_and_set_bit(clu % TRACK_BITS_PER_PAGE,
+				       track_page_bits(page))) {
+		plo->track_dirty++;
 	}
 	spin_unlock(&plo->track_lock);
 }
@@ -153,39 +157,71 @@ int ploop_tracker_setpos(struct ploop_device * plo, unsigned long arg)
 	return 0;
 }
 
-static struct track_record * find_record(struct rb_root * root, u32 start)
+/* Find first dirty extent at or after cluster "start", clear it and
+ * return it as [*ext_start, *ext_end). Returns 0 if nothing is dirty
+ * there. Called under track_lock.
+ */
+static int track_extract_extent(struct ploop_device * plo, u32 start,
+				u32 * ext_start, u32 * ext_end)
 {
-	struct rb_node * n = root->rb_node;
-	struct rb_node * prev = NULL;
+	unsigned long idx = start / TRACK_BITS_PER_PAGE;
+	unsigned long bit = start % TRACK_BITS_PER_PAGE;
+	struct page * page;
+	unsigned long end;
+
+	if (!plo->track_dirty)
+		return 0;
+
+	/* Look for the first set bit */
+	for (;;) {
+		if (radix_tree_gang_lookup(&plo->track_pages, (void **)&page,
+					   idx, 1) != 1)
+			return 0;
 
-	while (n) {
-		struct track_record * m;
+		if (page->index != idx) {
+			idx = page->index;
+			bit = 0;
+		}
 
-		m = rb_entry(n, struct track_record, rb_node);
-		prev = n;
+		bit = find_next_bit(track_page_bits(page),
+				    TRACK_BITS_PER_PAGE, bit);
+		if (bit < TRACK_BITS_PER_PAGE)
+			break;
 
-		if (start < m->start)
-			n = n->rb_left;
-		else if (start >= m->end)
-			n = n->rb_right;
-		else
-			return m;
+		idx++;
+		bit = 0;
 	}
 
-	while (prev && start >= rb_entry(prev, struct track_record, rb_node)->end)
-		prev = rb_next(prev);
+	*ext_start = idx * TRACK_BITS_PER_PAGE + bit;
 
-	if (!prev)
-		return NULL;
+	/* Extend and clear it, possibly crossing page boundaries */
+	for (;;) {
+		end = find_next_zero_bit(track_page_bits(page),
+					 TRACK_BITS_PER_PAGE, bit);
+		bitmap_clear(track_page_bits(page), bit, end - bit);
+		plo->track_dirty -= end - bit;
+		track_page_put(plo, idx, page);
 
-	return rb_entry(prev, struct track_record, rb_node);
-}
+		if (end < TRACK_BITS_PER_PAGE)
+			break;
 
+		page = radix_tree_lookup(&plo->track_pages, idx + 1);
+		if (page == NULL || !test_bit(0, track_page_bits(page)))
+			break;
+
+		idx++;
+		bit = 0;
+	}
+
+	*ext_end = idx * TRACK_BITS_PER_PAGE + end;
+	return 1;
+}
 
 int ploop_tracker_read(struct ploop_device * plo, unsigned long arg)
 {
 	u64 ptr;
-	struct track_record * m;
+	u32 start, end;
+	int found;
 	struct ploop_delta * delta;
 	struct ploop_track_extent e;
 	int err;
@@ -204,26 +240,23 @@ int ploop_tracker_read(struct ploop_device * plo, unsigned long arg)
 	delta = ploop_top_delta(plo);
 
 	spin_lock(&plo->track_lock);
-	m = find_record(&plo->track_tree, plo->track_ptr);
-	if (m == NULL) {
+	found = track_extract_extent(plo, plo->track_ptr, &start, &end);
+	if (!found) {
 		if (plo->track_end >= ((sector_t)delta->io.alloc_head << plo->cluster_log) &&
 		    plo->track_ptr)
-			m = find_record(&plo->track_tree, 0);
+			found = track_extract_extent(plo, 0, &start, &end);
 	}
 
-	if (m) {
-		rb_erase(&m->rb_node, &plo->track_tree);
-		plo->track_ptr = m->end;
-	} else {
+	if (found)
+		plo->track_ptr = end;
+	else
 		plo->track_ptr = 0;
-	}
 	spin_unlock(&plo->track_lock);
 
 	err = -EAGAIN;
-	if (m) {
-		e.start = (u64)m->start << (plo->cluster_log + 9);
-		e.end = (u64)m->end << (plo->cluster_log + 9);
-		kfree(m);
+	if (found) {
+		e.start = (u64)start << (plo->cluster_log + 9);
+		e.end = (u64)end << (plo->cluster_log + 9);
 		err = 0;
 	} else if (plo->track_end < ((sector_t)delta->io.alloc_head << plo->cluster_log)) {
 		e.start = (u64)plo->track_end << 9;
@@ -262,25 +295,28 @@ int ploop_tracker_stop(struct ploop_device * plo, int force)
 
 int ploop_tracker_destroy(struct ploop_device *plo, int force)
 {
-	struct rb_node * n;
+	struct page * pages[16];
+	int nr, i;
 
-	if (RB_EMPTY_ROOT(&plo->track_tree))
-		return 0;
-
-	if (!force)
+	if (plo->track_dirty && !force)
 		return -EBUSY;
 
 	spin_lock(&plo->track_lock);
-	while ((n = rb_first(&plo->track_tree)) != NULL) {
-		rb_erase(n, &plo->track_tree);
-		kfree(n);
+	while ((nr = radix_tree_gang_lookup(&plo->track_pages, (void **)pages,
+					    0, ARRAY_SIZE(pages))) != 0) {
+		for (i = 0; i < nr; i++) {
+			radix_tree_delete(&plo->track_pages, pages[i]->index);
+			__free_page(pages[i]);
+		}
 	}
+	plo->track_dirty = 0;
 	spin_unlock(&plo->track_lock);
 	return 0;
 }
 
 void track_init(struct ploop_device * plo)
 {
-	plo->track_tree = RB_ROOT;
+	INIT_RADIX_TREE(&plo->track_pages, GFP_ATOMIC);
+	plo->track_dirty = 0;
 	spin_lock_init(&plo->track_lock);
 }
@@ -110,8 +110,13 @@ struct tun_file {
 	struct fasync_struct *fasync;
 	/* only used for fasnyc */
 	unsigned int flags;
+	/* index in tun->tfiles, the tx queue of the device it serves */
+	u16 queue_index;
 };
 
+/* Maximum number of queues of an IFF_MULTI_QUEUE device */
+#define MAX_TAP_QUEUES	8
+
 #define TUN_USER_FEATURES	(NETIF_F_HW_CSUM | NETIF_F_TSO_ECN | \
 				 NETIF_F_TSO | NETIF_F_TSO6 | NETIF_F_UFO)
 /* Since the socket were moved to tun_file, to preserve the behavior of persist
@@ -119,7 +124,9 @@ struct tun_file {
  * file were attached to a persist device.
  */
 struct tun_struct {
-	struct tun_file		*tfile;
+	/* attached queues, changed under netif_tx_lock */
+	struct tun_file		*tfiles[MAX_TAP_QUEUES];
+	unsigned int		numqueues;
 	unsigned int 		flags;
 	uid_t			owner;
 	gid_t			group;
@@ -149,7 +156,7 @@ static int tun_attach(struct tun_struct *tun, struct file *file)
 		goto out;
 
 	err = -EBUSY;
-	if (tun->tfile)
+	if (tun->numqueues == (tun->flags & TUN_TAP_MQ ? MAX_TAP_QUEUES : 1))
 		goto out;
 
 	err = 0;
@@ -160,7 +167,8 @@ static int tun_attach(struct tun_struct *tun, struct file *file)
 
 	tfile->tun = tun;
 	tfile->socket.sk->sk_sndbuf = tun->sndbuf;
-	tun->tfile = tfile;
+	tfile->queue_index = tun->numqueues;
+	tun->tfiles[tun->numqueues++] = tfile;
 	dev_hold(tun->dev);
 	sock_hold(&tfile->sk);
 	atomic_inc(&tfile->count);
@@ -170,15 +178,23 @@ out:
 	return err;
 }
 
-static void __tun_detach(struct tun_struct *tun)
+static void __tun_detach(struct tun_file *tfile)
 {
-	struct tun_file *tfile = tun->tfile;
-	/* Detach from net device */
+	struct tun_struct *tun = tfile->tun;
+	unsigned int index = tfile->queue_index;
+
+	/* Detach from net device, the last queue takes our place */
 	netif_tx_lock_bh(tun->dev);
-	tun->tfile = NULL;
+	tun->numqueues--;
+	tun->tfiles[index] = tun->tfiles[tun->numqueues];
+	tun->tfiles[index]->queue_index = index;
+	tun->tfiles[tun->numqueues] = NULL;
 	tfile->tun = NULL;
 	netif_tx_unlock_bh(tun->dev);
 
+	/* the moved queue might have been stopped */
+	netif_tx_wake_all_queues(tun->dev);
+
 	/* Drop read queue */
 	skb_queue_purge(&tfile->socket.sk->sk_receive_queue);
 
@@ -187,10 +203,10 @@ static void __tun_detach(struct tun_struct *tun)
 	dev_put(tun->dev);
 }
 
-static void tun_detach(struct tun_struct *tun)
+static void tun_detach(struct tun_file *tfile)
 {
 	rtnl_lock();
-	__tun_detach(tun);
+	__tun_detach(tfile);
 	rtnl_unlock();
 }
 
@@ -209,12 +225,10 @@ static struct tun_struct *tun_get(struct file *file)
 	return __tun_get(file->private_data);
 }
 
-static void tun_put(struct tun_struct *tun)
+static void tun_put(struct tun_file *tfile)
 {
-	struct tun_file *tfile = tun->tfile;
-
 	if (atomic_dec_and_test(&tfile->count))
-		tun_detach(tfile->tun);
+		tun_detach(tfile);
 }
 
 /* TAP filterting */
@@ -335,14 +349,19 @@ static const struct ethtool_ops tun_ethtool_ops;
 static void tun_net_uninit(struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
-	struct tun_file *tfile = tun->tfile;
+	struct tun_file *tfile;
+	int i;
 
 	/* Inform the methods they need to stop using the dev.
 	 */
-	if (tfile) {
-		wake_up_all(&tfile->socket.wait);
-		if (atomic_dec_and_test(&tfile->count))
-			__tun_detach(tun);
+	if (tun->numqueues) {
+		/* the ones detached here are replaced by already visited */
+		for (i = tun->numqueues - 1; i >= 0; i--) {
+			tfile = tun->tfiles[i];
+			wake_up_all(&tfile->socket.wait);
+			if (atomic_dec_and_test(&tfile->count))
+				__tun_detach(tfile);
+		}
 
 		/* The device is being removed, drop module refcount */
 		if (tun->flags & TUN_PERSIST)
@@ -353,28 +372,44 @@ static void tun_net_uninit(struct net_device *dev)
 /* Net device open. */
 static int tun_net_open(struct net_device *dev)
 {
-	netif_start_queue(dev);
+	netif_tx_start_all_queues(dev);
 	return 0;
 }
 
 /* Net device close. */
 static int tun_net_close(struct net_device *dev)
 {
-	netif_stop_queue(dev);
+	netif_tx_stop_all_queues(dev);
 	return 0;
 }
 
+/* Spread flows over the attached queues */
+static u16 tun_select_queue(struct net_device *dev, struct sk_buff *skb)
+{
+	struct tun_struct *tun = netdev_priv(dev);
+	unsigned int numqueues = ACCESS_ONCE(tun->numqueues);
+
+	if (numqueues <= 1)
+		return 0;
+	return skb_tx_hash(dev, skb) % numqueues;
+}
+
 /* Net device start xmit */
 static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
-	struct tun_file *tfile = tun->tfile;
+	u16 txq = skb_get_queue_mapping(skb);
+	struct tun_file *tfile;
 
 	DBG(KERN_INFO "%s: tun_net_xmit %d\n", tun->dev->name, skb->len);
 
-	/* Drop packet if interface is not attached */
-	if (!tfile)
+	/*
+	 * Drop packet if interface is not attached, or if its queue went
+	 * away after tun_select_queue().
+	 */
+	if (txq >= tun->numqueues)
 		goto drop;
+	tfile = tun->tfiles[txq];
 
 	/* Drop if the filter does not like it.
 	 * This is a noop if the filter is disabled.
@@ -387,7 +422,7 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 		if (!(tun->flags & TUN_ONE_QUEUE)) {
 			/* Normal queueing mode. */
 			/* Packet scheduler handles dropping of further packets. */
-			netif_stop_queue(dev);
+			netif_tx_stop_queue(netdev_get_tx_queue(dev, txq));
 
 			/* We won't see all dropped packets individually, so overrun
 			 * error is more appropriate. */
@@ -467,6 +502,7 @@ static const struct net_device_ops tun_netdev_ops = {
 	.ndo_open		= tun_net_open,
 	.ndo_stop		= tun_net_close,
 	.ndo_start_xmit		= tun_net_xmit,
+	.ndo_select_queue	= tun_select_queue,
 	.ndo_change_mtu		= tun_net_change_mtu,
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller	= tun_poll_controller,
@@ -479,6 +515,7 @@ static const struct net_device_ops tap_netdev_ops = {
 	.ndo_open		= tun_net_open,
 	.ndo_stop		= tun_net_close,
 	.ndo_start_xmit		= tun_net_xmit,
+	.ndo_select_queue	= tun_select_queue,
 	.ndo_change_mtu		= tun_net_change_mtu,
 	.ndo_set_multicast_list	= tun_net_mclist,
 	.ndo_set_mac_address	= eth_mac_addr,
@@ -552,7 +589,7 @@ static unsigned int tun_chr_poll(struct file *file, poll_table * wait)
 	if (tun->dev->reg_state != NETREG_REGISTERED)
 		mask = POLLERR;
 
-	tun_put(tun);
+	tun_put(tfile);
 	return mask;
 }
 
@@ -736,7 +773,7 @@ static ssize_t tun_chr_aio_write(struct kiocb *iocb, const struct iovec *iv,
 	result = tun_get_user(tun, tfile, iv, iov_length(iv, count),
 			      file->f_flags & O_NONBLOCK);
 
-	tun_put(tun);
+	tun_put(tfile);
 	return result;
 }
 
@@ -890,7 +927,7 @@ static ssize_t tun_do_read(struct tun_struct *tun, struct tun_file *tfile,
 			schedule();
 			continue;
 		}
-		netif_wake_queue(tun->dev);
+		netif_wake_subqueue(tun->dev, tfile->queue_index);
 
 		ret = tun_put_user(tun, tfile, skb, iv, len);
 		kfree_skb(skb);
@@ -924,7 +961,7 @@ static ssize_t tun_chr_aio_read(struct kiocb *iocb, const struct iovec *iv,
 			  file->f_flags & O_NONBLOCK);
 	ret = min_t(ssize_t, ret, len);
 out:
-	tun_put(tun);
+	tun_put(tfile);
 	return ret;
 }
 
@@ -951,6 +988,13 @@ static void tun_setup(struct net_device *dev)
 /* Trivial set of netlink ops to allow deleting tun or tap
  * device with netlink.
  */
+static struct net_device *tun_alloc_netdev(const char *name,
+					   unsigned long flags)
+{
+	return alloc_netdev_mq(sizeof(struct tun_struct), name, tun_setup,
+			       flags & TUN_TAP_MQ ? MAX_TAP_QUEUES : 1);
+}
+
 static int tun_validate(struct nlattr *tb[], struct nlattr *data[])
 {
 	return -EINVAL;
@@ -993,7 +1037,7 @@ static int tun_sendmsg(struct kiocb *iocb, struct socket *sock,
 
 	ret = tun_get_user(tun, tfile, m->msg_iov, total_len,
 			   m->msg_flags & MSG_DONTWAIT);
-	tun_put(tun);
+	tun_put(tfile);
 	return ret;
 }
 
@@ -1022,7 +1066,7 @@ static int tun_recvmsg(struct kiocb *iocb, struct socket *sock,
 		ret = flags & MSG_TRUNC ? ret : total_len;
 	}
 out:
-	tun_put(tun);
+	tun_put(tfile);
 	return ret;
 }
 
@@ -1064,6 +1108,9 @@ static int tun_flags(struct tun_struct *tun)
 	if (tun->flags & TUN_VNET_HDR)
 		flags |= IFF_VNET_HDR;
 
+	if (tun->flags & TUN_TAP_MQ)
+		flags |= IFF_MULTI_QUEUE;
+
 	return flags;
 }
 
@@ -1112,6 +1159,10 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		else
 			return -EINVAL;
 
+		if (!!(ifr->ifr_flags & IFF_MULTI_QUEUE) !=
+		    !!(tun->flags & TUN_TAP_MQ))
+			return -EINVAL;
+
 		if (((tun->owner != -1 && cred->euid != tun->owner) ||
 		     (tun->group != -1 && !in_egroup_p(tun->group))) &&
 		    !capable(CAP_NET_ADMIN) && !capable(CAP_VE_NET_ADMIN))
@@ -1146,11 +1197,13 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		} else
 			return -EINVAL;
 
+		if (ifr->ifr_flags & IFF_MULTI_QUEUE)
+			flags |= TUN_TAP_MQ;
+
 		if (*ifr->ifr_name)
 			name = ifr->ifr_name;
 
-		dev = alloc_netdev(sizeof(struct tun_struct), name,
-				   tun_setup);
+		dev = tun_alloc_netdev(name, flags);
 		if (!dev)
 			return -ENOMEM;
 
@@ -1215,7 +1268,7 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 	 * xoff state.
 	 */
 	if (netif_running(tun->dev))
-		netif_wake_queue(tun->dev);
+		netif_tx_wake_all_queues(tun->dev);
 
 	strcpy(ifr->ifr_name, tun->dev->name);
 	return 0;
@@ -1306,7 +1359,7 @@ static long tun_chr_ioctl(struct file *file, unsigned int cmd,
 		 * This is needed because we never checked for invalid flags on
 		 * TUNSETIFF. */
 		return put_user(IFF_TUN | IFF_TAP | IFF_NO_PI | IFF_ONE_QUEUE |
-				IFF_VNET_HDR,
+				IFF_VNET_HDR | IFF_MULTI_QUEUE,
 				(unsigned int __user*)argp);
 	}
 
@@ -1473,7 +1526,7 @@ static long tun_chr_ioctl(struct file *file, unsigned int cmd,
 unlock:
 	rtnl_unlock();
 	if (tun)
-		tun_put(tun);
+		tun_put(tfile);
 	return ret;
 }
 
@@ -1542,15 +1595,14 @@ static int tun_chr_close(struct inode *inode, struct file *file)
 
 		DBG(KERN_INFO "%s: tun_chr_close\n", dev->name);
 
-		__tun_detach(tun);
+		rtnl_lock();
+		__tun_detach(tfile);
 
-		/* If desireable, unregister the netdevice. */
-		if (!(tun->flags & TUN_PERSIST)) {
-			rtnl_lock();
-			if (dev->reg_state == NETREG_REGISTERED)
-				unregister_netdevice(dev);
-			rtnl_unlock();
-		}
+		/* If desireable, unregister the netdevice with its last queue. */
+		if (!(tun->flags & TUN_PERSIST) && !tun->numqueues &&
+		    dev->reg_state == NETREG_REGISTERED)
+			unregister_netdevice(dev);
+		rtnl_unlock();
 	}
 
 	/* drop the reference that file holds */
@@ -1637,7 +1689,7 @@ static void tun_set_msglevel(struct net_device *dev, u32 value)
 static u32 tun_get_link(struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
-	return !!tun->tfile;
+	return !!tun->numqueues;
 }
 
 static u32 tun_get_rx_csum(struct net_device *dev)
@@ -1709,8 +1761,9 @@ static void tun_cpt(struct net_device *dev,
 	v.cpt_flags = tun->flags;
 	v.cpt_bindfile = 0;
 
-	if (tun->tfile)
-		v.cpt_bindfile = ops->lookup_object(CPT_OBJ_FILE, tun->tfile->socket.file, ctx);
+	/* only the first queue of a multiqueue device is bound on restore */
+	if (tun->numqueues)
+		v.cpt_bindfile = ops->lookup_object(CPT_OBJ_FILE, tun->tfiles[0]->socket.file, ctx);
 
 	v.cpt_if_flags = 0;
 	memset(v.cpt_dev_addr, 0, sizeof(v.cpt_dev_addr));
@@ -1821,7 +1874,7 @@ static int tun_rst(loff_t start, struct cpt_netdev_image *di,
 	}
 
 	err = -ENOMEM;
-	dev = alloc_netdev(sizeof(struct tun_struct), di->cpt_name, tun_setup);
+	dev = tun_alloc_netdev(di->cpt_name, ti.cpt_flags);
 	if (!dev)
 		goto out_tf;
 
@@ -1931,7 +1984,7 @@ struct socket *tun_get_socket(struct file *file)
 	tun = tun_get(file);
 	if (!tun)
 		return ERR_PTR(-EBADFD);
-	tun_put(tun);
+	tun_put(tfile);
 	return &tfile->socket;
 }
 EXPORT_SYMBOL_GPL(tun_get_socket);
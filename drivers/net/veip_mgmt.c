@@ -143,13 +143,13 @@ void veip_cleanup(void)
 	struct veip_struct *veip;
 
 	spin_lock(&veip_lock);
-	for (i = 0; i < VEIP_HASH_SZ; i++)
-		while (!hlist_empty(ip_entry_hash_table + i)) {
+	for (i = 0; i <= veip_hash->mask; i++)
+		while (!hlist_empty(veip_hash->buckets + i)) {
 			struct ip_entry_struct *entry;
 
-			entry = hlist_entry(ip_entry_hash_table[i].first,
-					struct ip_entry_struct, ip_hash);
-			hlist_del(&entry->ip_hash);
+			entry = veip_hash_entry(veip_hash->buckets[i].first,
+					veip_hash);
+			hlist_del(&entry->ip_hash[veip_hash->node]);
 			list_del(&entry->ve_list);
 			kfree(entry);
 		}
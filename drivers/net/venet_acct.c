@@ -0,0 +1,328 @@
+/*
+ *  venet_acct.c
+ *
+ *  Copyright (C) 2005  SWsoft
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * Traffic accounting of a VE: bytes and packets sent and received through
+ * venet and veth are counted per address class. Classes are given by a
+ * table of prefixes common to all VEs, the remote address of a packet is
+ * looked up in it, class 0 is the default one. The counters of all VEs
+ * are read at once from /proc/vz/venet_acct.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/in.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ve.h>
+#include <linux/ve_proto.h>
+#include <linux/venet.h>
+#include <linux/vzctl_venet.h>
+#include <asm/uaccess.h>
+
+struct venet_acct_prefix {
+	int			family;
+	__u32			addr[4];
+	__u32			mask[4];
+	unsigned int		prefixlen;
+	unsigned int		class;
+};
+
+struct venet_acct_table {
+	unsigned int		nr;
+	struct rcu_head		rcu;
+	struct venet_acct_prefix prefixes[0];	/* longest prefix first */
+};
+
+static struct venet_acct_table *venet_acct_table;
+static DEFINE_MUTEX(venet_acct_mutex);
+
+static unsigned int venet_acct_class(struct sk_buff *skb, int dir)
+{
+	struct venet_acct_table *t;
+	struct venet_acct_prefix *p;
+	struct ve_addr_struct addr;
+	unsigned int i, class = 0;
+
+	t = rcu_dereference(venet_acct_table);
+	if (t == NULL)
+		return 0;
+
+	/* remote end: source of incoming packets, destination of outgoing */
+	if (venet_skb_addr(skb, &addr, dir == VENET_ACCT_OUT) < 0)
+		return 0;
+
+	for (i = 0; i < t->nr; i++) {
+		p = t->prefixes + i;
+		if (p->family != addr.family)
+			continue;
+		if ((addr.key[0] & p->mask[0]) == p->addr[0] &&
+		    (addr.key[1] & p->mask[1]) == p->addr[1] &&
+		    (addr.key[2] & p->mask[2]) == p->addr[2] &&
+		    (addr.key[3] & p->mask[3]) == p->addr[3]) {
+			class = p->class;
+			break;
+		}
+	}
+	return class;
+}
+
+/*
+ * Is called in xmit of venet or veth with skb->data pointing at the
+ * network header. Traffic of VE0 is not accounted.
+ */
+void venet_acct_skb(struct ve_struct *ve, struct sk_buff *skb, int dir)
+{
+	struct venet_stat *acct, *stat;
+	unsigned int class;
+
+	if (ve_is_super(ve))
+		return;
+
+	rcu_read_lock();
+	acct = rcu_dereference(ve->stat);
+	if (acct == NULL)
+		goto out;
+
+	class = venet_acct_class(skb, dir);
+	stat = per_cpu_ptr(acct, smp_processor_id());
+	u64_stats_update_begin(&stat->syncp);
+	stat->bytes[class][dir] += skb->len;
+	stat->packets[class][dir]++;
+	u64_stats_update_end(&stat->syncp);
+out:
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL(venet_acct_skb);
+
+int venet_acct_init(struct ve_struct *ve)
+{
+	struct venet_stat *acct;
+
+	if (ve_is_super(ve))
+		return 0;
+
+	acct = alloc_percpu(struct venet_stat);
+	if (acct == NULL)
+		return -ENOMEM;
+
+	rcu_assign_pointer(ve->stat, acct);
+	return 0;
+}
+
+/* called on stop of VE network, after its devices are gone */
+void venet_acct_fini(struct ve_struct *ve)
+{
+	struct venet_stat *acct;
+
+	acct = ve->stat;
+	if (acct == NULL)
+		return;
+
+	rcu_assign_pointer(ve->stat, NULL);
+	synchronize_net();
+	free_percpu(acct);
+}
+
+static int venet_acct_cmp(const void *a, const void *b)
+{
+	const struct venet_acct_prefix *pa = a, *pb = b;
+
+	return (int)pb->prefixlen - (int)pa->prefixlen;
+}
+
+static int venet_acct_prefix_init(struct venet_acct_prefix *p,
+		struct vzctl_venet_acct_prefix *up)
+{
+	unsigned int i, len, max;
+
+	switch (up->family) {
+	case AF_INET:
+		max = 32;
+		break;
+	case AF_INET6:
+		max = 128;
+		break;
+	default:
+		return -EAFNOSUPPORT;
+	}
+
+	if (up->prefixlen > max || up->class >= VENET_ACCT_CLASSES)
+		return -EINVAL;
+
+	memset(p, 0, sizeof(*p));
+	p->family = up->family;
+	p->prefixlen = up->prefixlen;
+	p->class = up->class;
+
+	/* same layout as ve_addr_struct, IPv4 lives in the last word */
+	len = up->prefixlen;
+	for (i = 4 - max / 32; i < 4; i++) {
+		if (len >= 32)
+			p->mask[i] = ~0U;
+		else if (len > 0)
+			p->mask[i] = htonl(~0U << (32 - len));
+		len -= min(len, 32U);
+	}
+	if (up->family == AF_INET)
+		p->addr[3] = up->addr[0] & p->mask[3];
+	else
+		for (i = 0; i < 4; i++)
+			p->addr[i] = up->addr[i] & p->mask[i];
+	return 0;
+}
+
+static void venet_acct_table_free(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct venet_acct_table, rcu));
+}
+
+int venet_acct_set_classes(unsigned int nr,
+		struct vzctl_venet_acct_prefix __user *uprefixes)
+{
+	struct venet_acct_table *t = NULL, *old;
+	struct vzctl_venet_acct_prefix up;
+	unsigned int i;
+	int err;
+
+	if (!capable_setveid())
+		return -EPERM;
+
+	if (nr > VENET_ACCT_MAX_PREFIXES)
+		return -E2BIG;
+
+	if (nr != 0) {
+		t = kmalloc(sizeof(*t) + nr * sizeof(t->prefixes[0]),
+				GFP_KERNEL);
+		if (t == NULL)
+			return -ENOMEM;
+
+		for (i = 0; i < nr; i++) {
+			err = -EFAULT;
+			if (copy_from_user(&up, uprefixes + i, sizeof(up)))
+				goto err;
+			err = venet_acct_prefix_init(t->prefixes + i, &up);
+			if (err < 0)
+				goto err;
+		}
+		t->nr = nr;
+		sort(t->prefixes, nr, sizeof(t->prefixes[0]),
+				venet_acct_cmp, NULL);
+	}
+
+	mutex_lock(&venet_acct_mutex);
+	old = venet_acct_table;
+	rcu_assign_pointer(venet_acct_table, t);
+	mutex_unlock(&venet_acct_mutex);
+
+	if (old != NULL)
+		call_rcu(&old->rcu, venet_acct_table_free);
+	return 0;
+
+err:
+	kfree(t);
+	return err;
+}
+
+#ifdef CONFIG_PROC_FS
+static void venet_acct_sum(struct venet_stat *acct, struct venet_stat *sum)
+{
+	struct venet_stat *stat;
+	unsigned int start, class, dir;
+	u64 bytes[VENET_ACCT_CLASSES][2], packets[VENET_ACCT_CLASSES][2];
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stat = per_cpu_ptr(acct, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&stat->syncp);
+			memcpy(bytes, stat->bytes, sizeof(bytes));
+			memcpy(packets, stat->packets, sizeof(packets));
+		} while (u64_stats_fetch_retry_irq(&stat->syncp, start));
+
+		for (class = 0; class < VENET_ACCT_CLASSES; class++)
+			for (dir = 0; dir < 2; dir++) {
+				sum->bytes[class][dir] += bytes[class][dir];
+				sum->packets[class][dir] += packets[class][dir];
+			}
+	}
+}
+
+static int venet_acct_show(struct seq_file *m, void *v)
+{
+	struct ve_struct *ve;
+	struct venet_stat *acct, *sum;
+	unsigned int class;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (sum == NULL)
+		return -ENOMEM;
+
+	seq_printf(m, "%10s %5s %20s %20s %20s %20s\n", "veid", "class",
+			"in_bytes", "in_packets", "out_bytes", "out_packets");
+
+	mutex_lock(&ve_list_lock);
+	for_each_ve(ve) {
+		rcu_read_lock();
+		acct = rcu_dereference(ve->stat);
+		if (acct != NULL)
+			venet_acct_sum(acct, sum);
+		rcu_read_unlock();
+		if (acct == NULL)
+			continue;
+
+		for (class = 0; class < VENET_ACCT_CLASSES; class++) {
+			if (!sum->packets[class][VENET_ACCT_IN] &&
+			    !sum->packets[class][VENET_ACCT_OUT])
+				continue;
+			seq_printf(m, "%10u %5u %20llu %20llu %20llu %20llu\n",
+				ve->veid, class,
+				sum->bytes[class][VENET_ACCT_IN],
+				sum->packets[class][VENET_ACCT_IN],
+				sum->bytes[class][VENET_ACCT_OUT],
+				sum->packets[class][VENET_ACCT_OUT]);
+		}
+	}
+	mutex_unlock(&ve_list_lock);
+
+	kfree(sum);
+	return 0;
+}
+
+static int venet_acct_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, venet_acct_show, NULL);
+}
+
+struct file_operations proc_venet_acct_operations = {
+	.open		= venet_acct_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+void venet_acct_cleanup(void)
+{
+	struct venet_acct_table *t;
+
+	mutex_lock(&venet_acct_mutex);
+	t = venet_acct_table;
+	rcu_assign_pointer(venet_acct_table, NULL);
+	mutex_unlock(&venet_acct_mutex);
+
+	if (t != NULL)
+		call_rcu(&t->rcu, venet_acct_table_free);
+}
@@ -0,0 +1,279 @@
+/*
+ *  venet_filter.c
+ *
+ *  Copyright (C) 2005  SWsoft
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * Early ingress filter of a VE: packets from blocked source addresses
+ * and packets over the rate limit are dropped by venet and veth before
+ * they are passed to the stack of the VE.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/in.h>
+#include <linux/if_ether.h>
+#include <linux/ve.h>
+#include <linux/ve_proto.h>
+#include <linux/venet.h>
+#include <linux/vzctl_venet.h>
+
+#define VENET_FILTER_HASH_SZ	512
+
+/* serializes updates of filters, lookups are under rcu */
+static DEFINE_MUTEX(venet_filter_mutex);
+
+struct venet_filter_entry {
+	struct hlist_node	hash;
+	struct ve_addr_struct	addr;
+	struct rcu_head		rcu;
+};
+
+struct venet_filter {
+	unsigned int		nr_blocked;
+	struct hlist_head	hash[VENET_FILTER_HASH_SZ];
+
+	/* token bucket, a packet costs HZ credits */
+	spinlock_t		lock;
+	unsigned int		rate;		/* packets per second */
+	u64			credit;
+	u64			credit_max;
+	unsigned long		last;
+
+	struct rcu_head		rcu;
+};
+
+static inline struct hlist_head *
+venet_filter_bucket(struct venet_filter *f, struct ve_addr_struct *addr)
+{
+	return f->hash + (jhash2(addr->key, 4, 0) & (VENET_FILTER_HASH_SZ - 1));
+}
+
+static struct venet_filter_entry *
+venet_filter_lookup(struct venet_filter *f, struct ve_addr_struct *addr)
+{
+	struct venet_filter_entry *e;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(e, n, venet_filter_bucket(f, addr), hash)
+		if (memcmp(&e->addr, addr, sizeof(*addr)) == 0)
+			return e;
+	return NULL;
+}
+
+static int venet_filter_credit(struct venet_filter *f)
+{
+	unsigned long now = jiffies;
+	int ret = 0;
+
+	spin_lock(&f->lock);
+	f->credit += (u64)(now - f->last) * f->rate;
+	if (f->credit > f->credit_max)
+		f->credit = f->credit_max;
+	f->last = now;
+
+	if (f->credit >= HZ) {
+		f->credit -= HZ;
+		ret = 1;
+	}
+	spin_unlock(&f->lock);
+
+	return ret;
+}
+
+/*
+ * Returns 1 if the packet should be dropped. Is called in xmit of venet or
+ * veth with skb->data pointing at the network header.
+ */
+int venet_filter_drop(struct ve_struct *ve, struct sk_buff *skb)
+{
+	struct venet_filter *f;
+	struct ve_addr_struct addr;
+	int drop = 0;
+
+	rcu_read_lock();
+	f = rcu_dereference(ve->venet_filter);
+	if (f == NULL)
+		goto out;
+
+	if (f->nr_blocked && venet_skb_addr(skb, &addr, 0) == 0 &&
+			venet_filter_lookup(f, &addr) != NULL)
+		drop = 1;
+	else if (f->rate && !venet_filter_credit(f))
+		drop = 1;
+out:
+	rcu_read_unlock();
+	return drop;
+}
+EXPORT_SYMBOL(venet_filter_drop);
+
+static struct venet_filter *venet_filter_get(struct ve_struct *ve)
+{
+	struct venet_filter *f;
+	int i;
+
+	if (ve->venet_filter != NULL)
+		return ve->venet_filter;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (f == NULL)
+		return NULL;
+
+	for (i = 0; i < VENET_FILTER_HASH_SZ; i++)
+		INIT_HLIST_HEAD(f->hash + i);
+	spin_lock_init(&f->lock);
+	rcu_assign_pointer(ve->venet_filter, f);
+	return f;
+}
+
+static void venet_filter_entry_free(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct venet_filter_entry, rcu));
+}
+
+static void venet_filter_flush(struct venet_filter *f)
+{
+	struct venet_filter_entry *e;
+	struct hlist_node *n, *tmp;
+	int i;
+
+	for (i = 0; i < VENET_FILTER_HASH_SZ; i++)
+		hlist_for_each_entry_safe(e, n, tmp, f->hash + i, hash) {
+			hlist_del_rcu(&e->hash);
+			call_rcu(&e->rcu, venet_filter_entry_free);
+		}
+	f->nr_blocked = 0;
+}
+
+static void venet_filter_free(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct venet_filter, rcu));
+}
+
+/* called on stop of VE network */
+void venet_filter_destroy(struct ve_struct *ve)
+{
+	struct venet_filter *f;
+
+	mutex_lock(&venet_filter_mutex);
+	f = ve->venet_filter;
+	if (f != NULL) {
+		rcu_assign_pointer(ve->venet_filter, NULL);
+		venet_filter_flush(f);
+		call_rcu(&f->rcu, venet_filter_free);
+	}
+	mutex_unlock(&venet_filter_mutex);
+}
+
+static int venet_filter_block(struct venet_filter *f,
+		struct ve_addr_struct *addr)
+{
+	struct venet_filter_entry *e;
+
+	if (venet_filter_lookup(f, addr) != NULL)
+		return -EADDRINUSE;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (e == NULL)
+		return -ENOMEM;
+
+	e->addr = *addr;
+	hlist_add_head_rcu(&e->hash, venet_filter_bucket(f, addr));
+	f->nr_blocked++;
+	return 0;
+}
+
+static int venet_filter_unblock(struct venet_filter *f,
+		struct ve_addr_struct *addr)
+{
+	struct venet_filter_entry *e;
+
+	e = venet_filter_lookup(f, addr);
+	if (e == NULL)
+		return -EADDRNOTAVAIL;
+
+	hlist_del_rcu(&e->hash);
+	f->nr_blocked--;
+	call_rcu(&e->rcu, venet_filter_entry_free);
+	return 0;
+}
+
+static void venet_filter_set_rate(struct venet_filter *f,
+		unsigned int rate, unsigned int burst)
+{
+	spin_lock_bh(&f->lock);
+	f->rate = rate;
+	f->credit_max = (u64)max(burst, 1U) * HZ;
+	f->credit = f->credit_max;
+	f->last = jiffies;
+	spin_unlock_bh(&f->lock);
+}
+
+int venet_filter_ctl(envid_t veid, int op, struct sockaddr __user *uaddr,
+		int addrlen, unsigned int rate, unsigned int burst)
+{
+	struct ve_struct *ve;
+	struct venet_filter *f;
+	struct ve_addr_struct addr;
+	int err;
+
+	if (!capable_setveid())
+		return -EPERM;
+
+	if (op == VE_FILTER_BLOCK_ADD || op == VE_FILTER_BLOCK_DEL) {
+		err = sockaddr_to_veaddr(uaddr, addrlen, &addr);
+		if (err < 0)
+			return err;
+	}
+
+	ve = get_ve_by_id(veid);
+	if (ve == NULL)
+		return -ESRCH;
+
+	/* filter of a stopped VE would never be destroyed */
+	down_read(&ve->op_sem);
+	mutex_lock(&venet_filter_mutex);
+	err = -ESRCH;
+	if (!ve->is_running)
+		goto out;
+
+	err = -ENOMEM;
+	f = venet_filter_get(ve);
+	if (f == NULL)
+		goto out;
+
+	switch (op) {
+	case VE_FILTER_BLOCK_ADD:
+		err = venet_filter_block(f, &addr);
+		break;
+	case VE_FILTER_BLOCK_DEL:
+		err = venet_filter_unblock(f, &addr);
+		break;
+	case VE_FILTER_FLUSH:
+		venet_filter_flush(f);
+		err = 0;
+		break;
+	case VE_FILTER_RATE:
+		venet_filter_set_rate(f, rate, burst);
+		err = 0;
+		break;
+	default:
+		err = -EINVAL;
+	}
+out:
+	mutex_unlock(&venet_filter_mutex);
+	up_read(&ve->op_sem);
+	put_ve(ve);
+	return err;
+}
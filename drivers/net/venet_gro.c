@@ -0,0 +1,161 @@
+/*
+ *  venet_gro.c
+ *
+ *  Copyright (C) 2005  SWsoft
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * GRO of packets entering a VE through venet or veth. The sender queues
+ * them to a per-cpu NAPI context instead of the backlog, its poll merges
+ * segments of a flow the same way a NIC driver does, so that the stack of
+ * the VE gets one large packet instead of many small ones. Packets which
+ * are already aggregated or which come to a device with GRO off go the
+ * old way.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/notifier.h>
+#include <linux/venet.h>
+
+#define VENET_GRO_WEIGHT	64
+
+struct venet_gro {
+	struct napi_struct	napi;
+	struct sk_buff_head	queue;
+};
+
+static DEFINE_PER_CPU(struct venet_gro, venet_gro);
+
+static int venet_gro_enable = 1;
+module_param(venet_gro_enable, int, 0644);
+MODULE_PARM_DESC(venet_gro_enable, "Aggregate packets received by VEs");
+
+static int venet_gro_poll(struct napi_struct *napi, int budget)
+{
+	struct venet_gro *g = container_of(napi, struct venet_gro, napi);
+	struct sk_buff *skb;
+	int work = 0;
+
+	while (work < budget && (skb = skb_dequeue(&g->queue)) != NULL) {
+		napi_gro_receive(napi, skb);
+		work++;
+	}
+
+	/* nothing is held between polls, see venet_gro_flush_dev() */
+	if (work < budget) {
+		napi_complete(napi);
+		/* netpoll may have queued from irq in between */
+		if (!skb_queue_empty(&g->queue))
+			napi_schedule(napi);
+	} else
+		napi_gro_flush(napi);
+	return work;
+}
+
+/*
+ * Is called instead of netif_rx() by xmit of venet and veth, skb->dev is
+ * the receiving device and skb->data points at the network header.
+ * Returns 0 if the caller should pass the packet on itself.
+ */
+int venet_gro_rx(struct sk_buff *skb)
+{
+	struct venet_gro *g;
+
+	if (!venet_gro_enable || !(skb->dev->features & NETIF_F_GRO) ||
+			skb_is_gso(skb))
+		return 0;
+
+	g = &get_cpu_var(venet_gro);
+	if (skb_queue_len(&g->queue) >= netdev_max_backlog) {
+		put_cpu_var(venet_gro);
+		kfree_skb(skb);
+		return 1;
+	}
+
+	skb_queue_tail(&g->queue, skb);
+	napi_schedule(&g->napi);
+	put_cpu_var(venet_gro);
+	return 1;
+}
+EXPORT_SYMBOL(venet_gro_rx);
+
+/*
+ * Queued packets hold no reference on their device. Once the device is
+ * down no xmit queues more of them, drop those queued and wait for the
+ * polls which may be passing its packets on.
+ */
+static void venet_gro_flush_dev(struct net_device *dev)
+{
+	struct sk_buff *skb, *tmp;
+	struct venet_gro *g;
+	unsigned long flags;
+	int cpu;
+
+	synchronize_net();
+	for_each_possible_cpu(cpu) {
+		g = &per_cpu(venet_gro, cpu);
+		spin_lock_irqsave(&g->queue.lock, flags);
+		skb_queue_walk_safe(&g->queue, skb, tmp) {
+			if (skb->dev == dev) {
+				__skb_unlink(skb, &g->queue);
+				kfree_skb(skb);
+			}
+		}
+		spin_unlock_irqrestore(&g->queue.lock, flags);
+	}
+	synchronize_net();
+}
+
+static int venet_gro_device_event(struct notifier_block *nb,
+		unsigned long event, void *ptr)
+{
+	struct net_device *dev = ptr;
+
+	if (event == NETDEV_UNREGISTER &&
+	    (dev->vz_features & NETIF_F_VENET))
+		venet_gro_flush_dev(dev);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block venet_gro_notifier = {
+	.notifier_call = venet_gro_device_event,
+};
+
+int venet_gro_init(void)
+{
+	struct venet_gro *g;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		g = &per_cpu(venet_gro, cpu);
+		skb_queue_head_init(&g->queue);
+		INIT_LIST_HEAD(&g->napi.poll_list);
+		g->napi.poll = venet_gro_poll;
+		g->napi.weight = VENET_GRO_WEIGHT;
+	}
+
+	return register_netdevice_notifier(&venet_gro_notifier);
+}
+
+/* called after all venet and veth devices are gone */
+void venet_gro_fini(void)
+{
+	struct venet_gro *g;
+	int cpu;
+
+	unregister_netdevice_notifier(&venet_gro_notifier);
+
+	for_each_possible_cpu(cpu) {
+		g = &per_cpu(venet_gro, cpu);
+		napi_disable(&g->napi);
+		skb_queue_purge(&g->queue);
+	}
+}
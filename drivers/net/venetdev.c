@@ -44,23 +44,96 @@
 #include <linux/if_ether.h>	/* For the statistics structure. */
 #include <linux/if_arp.h>	/* For ARPHRD_ETHER */
 #include <linux/ethtool.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
 #include <linux/venet.h>
 #include <linux/ve_proto.h>
 #include <linux/vzctl.h>
 #include <linux/vzctl_venet.h>
 
-struct hlist_head ip_entry_hash_table[VEIP_HASH_SZ];
+struct veip_hash_table *veip_hash;
+static unsigned int veip_hash_nr;	/* entries in the table */
+static u32 veip_hash_rnd;
+static DEFINE_MUTEX(veip_hash_mutex);	/* serializes resizes */
 DEFINE_SPINLOCK(veip_lock);
 LIST_HEAD(veip_lh);
 
-#define ip_entry_hash_function(ip)  (ntohl(ip) & (VEIP_HASH_SZ - 1))
+static inline struct hlist_head *veip_hash_bucket(struct veip_hash_table *t,
+		struct ve_addr_struct *addr)
+{
+	return t->buckets + (jhash2(addr->key, 4, veip_hash_rnd) & t->mask);
+}
+
+static struct veip_hash_table *veip_hash_alloc(unsigned int size, int node)
+{
+	struct veip_hash_table *t;
+	size_t sz;
+	unsigned int i;
+
+	sz = sizeof(*t) + size * sizeof(struct hlist_head);
+	if (sz <= PAGE_SIZE)
+		t = kmalloc(sz, GFP_KERNEL);
+	else
+		t = vmalloc(sz);
+	if (t == NULL)
+		return NULL;
+
+	t->mask = size - 1;
+	t->node = node;
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(t->buckets + i);
+	return t;
+}
+
+static void veip_hash_free(struct veip_hash_table *t)
+{
+	if (is_vmalloc_addr(t))
+		vfree(t);
+	else
+		kfree(t);
+}
+
+/* doubles the table if there are more entries than buckets */
+static void veip_hash_grow(void)
+{
+	struct veip_hash_table *old, *new;
+	struct ip_entry_struct *entry;
+	struct hlist_node *n;
+	unsigned int i, size;
+
+	mutex_lock(&veip_hash_mutex);
+	old = veip_hash;
+	size = (old->mask + 1) * 2;
+	if (veip_hash_nr <= old->mask + 1 || size > VEIP_HASH_MAX)
+		goto out;
+
+	new = veip_hash_alloc(size, !old->node);
+	if (new == NULL)
+		goto out;
+
+	spin_lock(&veip_lock);
+	for (i = 0; i <= old->mask; i++)
+		for (n = old->buckets[i].first; n != NULL; n = n->next) {
+			entry = veip_hash_entry(n, old);
+			hlist_add_head_rcu(&entry->ip_hash[new->node],
+					veip_hash_bucket(new, &entry->addr));
+		}
+	rcu_assign_pointer(veip_hash, new);
+	spin_unlock(&veip_lock);
+
+	synchronize_rcu();
+	veip_hash_free(old);
+out:
+	mutex_unlock(&veip_hash_mutex);
+}
 
 void ip_entry_hash(struct ip_entry_struct *entry, struct veip_struct *veip)
 {
-	hlist_add_head_rcu(&entry->ip_hash,
-			ip_entry_hash_table +
-			ip_entry_hash_function(entry->addr.key[3]));
+	hlist_add_head_rcu(&entry->ip_hash[veip_hash->node],
+			veip_hash_bucket(veip_hash, &entry->addr));
 	list_add(&entry->ve_list, &veip->ip_lh);
+	veip_hash_nr++;
 }
 
 static void ip_entry_free(struct rcu_head *rcu)
@@ -74,7 +147,8 @@ static void ip_entry_free(struct rcu_head *rcu)
 void ip_entry_unhash(struct ip_entry_struct *entry)
 {
 	list_del(&entry->ve_list);
-	hlist_del_rcu(&entry->ip_hash);
+	hlist_del_rcu(&entry->ip_hash[veip_hash->node]);
+	veip_hash_nr--;
 	call_rcu(&entry->rcu, ip_entry_free);
 }
 
@@ -102,13 +176,17 @@ int veip_put(struct veip_struct *veip)
 
 struct ip_entry_struct *venet_entry_lookup(struct ve_addr_struct *addr)
 {
+	struct veip_hash_table *t;
 	struct ip_entry_struct *entry;
 	struct hlist_node *n;
 
-	hlist_for_each_entry_rcu(entry, n, ip_entry_hash_table +
-			ip_entry_hash_function(addr->key[3]), ip_hash)
+	t = rcu_dereference(veip_hash);
+	for (n = rcu_dereference(veip_hash_bucket(t, addr)->first);
+			n != NULL; n = rcu_dereference(n->next)) {
+		entry = veip_hash_entry(n, t);
 		if (memcmp(&entry->addr, addr, sizeof(*addr)) == 0)
 			return entry;
+	}
 	return NULL;
 }
 
@@ -322,6 +400,8 @@ out_unlock:
 out:
 	if (entry != NULL)
 		kfree(entry);
+	else
+		veip_hash_grow();
 
 	return err;
 }
@@ -351,6 +431,107 @@ out:
 	return err;
 }
 
+/*
+ * Adds all of the addresses or none of them. The entries are allocated
+ * before and the hash is grown after the batch, so veip_lock is only
+ * taken once for it.
+ */
+static int veip_entries_add(struct ve_struct *ve, struct ve_addr_struct *addrs,
+		unsigned int nr)
+{
+	struct ip_entry_struct *entry, *tmp, *found;
+	LIST_HEAD(pool);
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		entry = kzalloc(sizeof(struct ip_entry_struct), GFP_KERNEL);
+		err = -ENOMEM;
+		if (entry == NULL)
+			goto out;
+		list_add(&entry->ve_list, &pool);
+	}
+
+	if (ve->veip == NULL) {
+		err = veip_start(ve);
+		if (err < 0)
+			goto out;
+	}
+
+	spin_lock(&veip_lock);
+	for (i = 0; i < nr; i++) {
+		found = venet_entry_lookup(&addrs[i]);
+		if (found != NULL) {
+			err = veip_entry_conflict(found, ve);
+			if (err < 0)
+				goto out_undo;
+			continue;
+		}
+
+		entry = list_first_entry(&pool, struct ip_entry_struct,
+				ve_list);
+		list_del(&entry->ve_list);
+		entry->active_env = ve;
+		entry->addr = addrs[i];
+		ip_entry_hash(entry, ve->veip);
+	}
+	spin_unlock(&veip_lock);
+
+	veip_hash_grow();
+	err = 0;
+	goto out;
+
+out_undo:
+	/* all the earlier ones were free and are ours now */
+	while (i-- > 0) {
+		found = venet_entry_lookup(&addrs[i]);
+		if (found == NULL || found->active_env != ve)
+			continue;
+
+		found->active_env = NULL;
+		if (found->tgt_veip == NULL)
+			ip_entry_unhash(found);
+	}
+	spin_unlock(&veip_lock);
+out:
+	list_for_each_entry_safe(entry, tmp, &pool, ve_list)
+		kfree(entry);
+	return err;
+}
+
+/* Deletes all of the addresses if all of them belong to the VE */
+static int veip_entries_del(envid_t veid, struct ve_addr_struct *addrs,
+		unsigned int nr)
+{
+	struct ip_entry_struct *found;
+	unsigned int i;
+	int err;
+
+	err = -EADDRNOTAVAIL;
+	spin_lock(&veip_lock);
+	for (i = 0; i < nr; i++) {
+		found = venet_entry_lookup(&addrs[i]);
+		if (found == NULL || found->active_env == NULL ||
+				found->active_env->veid != veid)
+			goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		found = venet_entry_lookup(&addrs[i]);
+		/* listed twice */
+		if (found == NULL || found->active_env == NULL)
+			continue;
+
+		found->active_env = NULL;
+		if (found->tgt_veip == NULL)
+			ip_entry_unhash(found);
+	}
+	err = 0;
+out:
+	spin_unlock(&veip_lock);
+	return err;
+}
+
 static int convert_sockaddr(struct sockaddr *addr, int addrlen,
 		struct ve_addr_struct *veaddr)
 {
@@ -420,6 +601,38 @@ void veaddr_print(char *str, int len, struct ve_addr_struct *a)
 			);
 }
 
+/*
+ * Fills @addr with the source (@dst == 0) or destination address of
+ * a packet with skb->data pointing at the network header.
+ */
+int venet_skb_addr(struct sk_buff *skb, struct ve_addr_struct *addr, int dst)
+{
+	struct iphdr *iph;
+	struct ipv6hdr *ip6h;
+
+	memset(addr, 0, sizeof(*addr));
+
+	switch (skb->protocol) {
+	case __constant_htons(ETH_P_IP):
+		if (!pskb_may_pull(skb, sizeof(struct iphdr)))
+			return -EINVAL;
+		iph = (struct iphdr *)skb->data;
+		addr->family = AF_INET;
+		addr->key[3] = dst ? iph->daddr : iph->saddr;
+		return 0;
+	case __constant_htons(ETH_P_IPV6):
+		if (!pskb_may_pull(skb, sizeof(struct ipv6hdr)))
+			return -EINVAL;
+		ip6h = (struct ipv6hdr *)skb->data;
+		addr->family = AF_INET6;
+		memcpy(addr->key, dst ? ip6h->daddr.s6_addr32 :
+				ip6h->saddr.s6_addr32, sizeof(addr->key));
+		return 0;
+	}
+
+	return -EAFNOSUPPORT;
+}
+
 /*
  * Device functions
  */
@@ -448,6 +661,27 @@ static void venet_destructor(struct net_device *dev)
 	dev->ml_priv = NULL;
 }
 
+/*
+ * Deliver packets straight into the receiving stack instead of queueing
+ * them to the backlog of the cpu to be processed again in softirq.
+ */
+static int venet_direct_rx = 1;
+module_param(venet_direct_rx, int, 0644);
+MODULE_PARM_DESC(venet_direct_rx, "Receive packets in the context of sender");
+
+/*
+ * Direct receive is only safe when the sender is in process context and
+ * the only bh disable is that of dev_queue_xmit(): then no lock shared with
+ * the receive path can be held, and a packet sent in reply while receiving
+ * disables bh once more and goes through the backlog, so there is
+ * no recursion.
+ */
+static inline int venet_can_rx_direct(void)
+{
+	return venet_direct_rx && !in_irq() && !irqs_disabled() &&
+		softirq_count() == SOFTIRQ_DISABLE_OFFSET;
+}
+
 /*
  * The higher levels take care of making this non-reentrant (it's
  * called with bh's disabled).
@@ -456,11 +690,11 @@ static int venet_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct net_device_stats *stats;
 	struct net_device *rcv = NULL;
-	struct ve_struct *ve;
+	struct ve_struct *ve, *src_ve;
 	int length;
 
 	stats = venet_stats(dev, smp_processor_id());
-	ve = get_exec_env();
+	ve = src_ve = get_exec_env();
 	if (unlikely(ve->disable_net))
 		goto outf;
 
@@ -487,6 +721,9 @@ static int venet_xmit(struct sk_buff *skb, struct net_device *dev)
 	if (unlikely(ve->disable_net))
 		goto outf;
 
+	if (unlikely(ve->venet_filter != NULL) && venet_filter_drop(ve, skb))
+		goto outf;
+
 	rcv = ve->_venet_dev;
 	if (!rcv)
 		/* VE going down */
@@ -502,6 +739,8 @@ static int venet_xmit(struct sk_buff *skb, struct net_device *dev)
 
 	skb->pkt_type = PACKET_HOST;
 	skb->dev = rcv;
+	skb_record_rx_queue(skb, skb_get_queue_mapping(skb) %
+			netdev_extended(rcv)->real_num_rx_queues);
 
 	/*
 	 * If there is not enough space for header we allocate one.
@@ -532,10 +771,21 @@ static int venet_xmit(struct sk_buff *skb, struct net_device *dev)
 	skb_reset_mac_header(skb);
 	memset(skb->data - dev->hard_header_len, 0, dev->hard_header_len);
 
+	venet_acct_skb(src_ve, skb, VENET_ACCT_OUT);
+	venet_acct_skb(ve, skb, VENET_ACCT_IN);
+
 	nf_reset(skb);
 	length = skb->len;
 
-	netif_rx(skb);
+	/* GRO compares L2 headers, let it see the zeroed one */
+	skb_set_mac_header(skb, -dev->hard_header_len);
+	if (!venet_gro_rx(skb)) {
+		skb_reset_mac_header(skb);
+		if (venet_can_rx_direct())
+			netif_receive_skb(skb);
+		else
+			netif_rx(skb);
+	}
 
 	stats->tx_bytes += length;
 	stats->tx_packets++;
@@ -742,55 +992,55 @@ unlock:
 	spin_unlock(&veip_lock);
 }
 
+struct veip_seq_iter {
+	struct veip_hash_table	*table;
+	unsigned int		bucket;	/* next bucket to scan */
+};
+
+static struct hlist_node *veip_seq_next_bucket(struct veip_seq_iter *iter)
+{
+	struct hlist_node *p;
+
+	while (iter->bucket <= iter->table->mask) {
+		p = rcu_dereference(iter->table->buckets[iter->bucket++].first);
+		if (p != NULL)
+			return p;
+	}
+	return NULL;
+}
+
 static void *veip_seq_start(struct seq_file *m, loff_t *pos)
 {
-	loff_t l;
+	struct veip_seq_iter *iter = m->private;
 	struct hlist_node *p;
-	struct ip_entry_struct *s;
-	int i;
+	loff_t l;
 
 	l = *pos;
 	rcu_read_lock();
-	if (l == 0) {
-		m->private = (void *)0;
+	iter->table = rcu_dereference(veip_hash);
+	iter->bucket = 0;
+	if (l == 0)
 		return SEQ_START_TOKEN;
-	}
 
-	for (i = 0; i < VEIP_HASH_SZ; i++) {
-		hlist_for_each_entry_rcu(s, p, ip_entry_hash_table + i, ip_hash) {
-			if (--l == 0) {
-				m->private = (void *)(long)(i + 1);
-				return p;
-			}
-		}
-	}
+	for (p = veip_seq_next_bucket(iter); p != NULL;
+			p = rcu_dereference(p->next) ? : veip_seq_next_bucket(iter))
+		if (--l == 0)
+			return p;
 	return NULL;
 }
 
 static void *veip_seq_next(struct seq_file *m, void *v, loff_t *pos)
 {
-	struct hlist_node *p;
-	int i;
-
-	if (v == SEQ_START_TOKEN)
-		goto find;
+	struct veip_seq_iter *iter = m->private;
+	struct hlist_node *p = NULL;
 
-	p = rcu_dereference(((struct hlist_node *)v)->next);
+	if (v != SEQ_START_TOKEN)
+		p = rcu_dereference(((struct hlist_node *)v)->next);
+	if (p == NULL)
+		p = veip_seq_next_bucket(iter);
 	if (p != NULL)
-		goto found;
-
-find:
-	for (i = (int)(long)m->private; i < VEIP_HASH_SZ; i++) {
-		p = rcu_dereference(ip_entry_hash_table[i].first);
-		if (p != NULL) {
-			m->private = (void *)(long)(i + 1);
-found:
-			(*pos)++;
-			return p;
-		}
-	}
-
-	return NULL;
+		(*pos)++;
+	return p;
 }
 
 static void veip_seq_stop(struct seq_file *m, void *v)
@@ -800,7 +1050,7 @@ static void veip_seq_stop(struct seq_file *m, void *v)
 
 static int veip_seq_show(struct seq_file *m, void *v)
 {
-	struct hlist_node *p;
+	struct veip_seq_iter *iter = m->private;
 	struct ip_entry_struct *entry;
 	struct veip_struct *veip;
 	char s[40];
@@ -810,8 +1060,7 @@ static int veip_seq_show(struct seq_file *m, void *v)
 		return 0;
 	}
 
-	p = (struct hlist_node *)v;
-	entry = hlist_entry(p, struct ip_entry_struct, ip_hash);
+	entry = veip_hash_entry(v, iter->table);
 	veaddr_print(s, sizeof(s), &entry->addr);
 	veip = ACCESS_ONCE(entry->tgt_veip);
 	seq_printf(m, "%39s %10u\n", s, veip == NULL ? 0 : veip->veid);
@@ -827,14 +1076,56 @@ static struct seq_operations veip_seq_op = {
 
 static int veip_open(struct inode *inode, struct file *file)
 {
-        return seq_open(file, &veip_seq_op);
+	return seq_open_private(file, &veip_seq_op,
+			sizeof(struct veip_seq_iter));
 }
 
 static struct file_operations proc_veip_operations = {
 	.open		= veip_open,
 	.read		= seq_read,
 	.llseek		= seq_lseek,
-	.release	= seq_release,
+	.release	= seq_release_private,
+};
+
+/* chain length statistics of the address hash */
+static int veip_hash_show(struct seq_file *m, void *v)
+{
+	struct veip_hash_table *t;
+	struct hlist_node *n;
+	unsigned int i, len, max_len = 0, nr_empty = 0, nr = 0;
+
+	rcu_read_lock();
+	t = rcu_dereference(veip_hash);
+	for (i = 0; i <= t->mask; i++) {
+		len = 0;
+		for (n = rcu_dereference(t->buckets[i].first); n != NULL;
+				n = rcu_dereference(n->next))
+			len++;
+		if (len == 0)
+			nr_empty++;
+		if (len > max_len)
+			max_len = len;
+		nr += len;
+	}
+	rcu_read_unlock();
+
+	seq_printf(m, "buckets %u\n", t->mask + 1);
+	seq_printf(m, "entries %u\n", nr);
+	seq_printf(m, "empty %u\n", nr_empty);
+	seq_printf(m, "max_chain %u\n", max_len);
+	return 0;
+}
+
+static int veip_hash_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, veip_hash_show, NULL);
+}
+
+static struct file_operations proc_veip_hash_operations = {
+	.open		= veip_hash_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
 };
 #endif
 
@@ -901,6 +1192,74 @@ out:
 	return err;
 }
 
+static int veaddr_check(struct ve_addr_struct *addr)
+{
+	switch (addr->family) {
+	case AF_INET:
+		if (addr->key[0] || addr->key[1] || addr->key[2])
+			return -EINVAL;
+		return 0;
+	case AF_INET6:
+		return 0;
+	}
+	return -EAFNOSUPPORT;
+}
+
+static int real_ve_ip_map_bulk(envid_t veid, int op, unsigned int nr,
+		struct vzctl_ve_ip_addr __user *uaddrs)
+{
+	struct ve_addr_struct *addrs;
+	struct ve_struct *ve;
+	unsigned int i;
+	int err;
+
+	BUILD_BUG_ON(sizeof(struct vzctl_ve_ip_addr) !=
+			sizeof(struct ve_addr_struct));
+
+	if (!capable_setveid())
+		return -EPERM;
+
+	if (op != VE_IP_ADD && op != VE_IP_DEL)
+		return -EINVAL;
+	if (nr == 0)
+		return 0;
+	if (nr > VENET_IP_MAP_BULK_MAX)
+		return -E2BIG;
+
+	addrs = vmalloc(nr * sizeof(struct ve_addr_struct));
+	if (addrs == NULL)
+		return -ENOMEM;
+
+	err = -EFAULT;
+	if (copy_from_user(addrs, uaddrs, nr * sizeof(struct ve_addr_struct)))
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		err = veaddr_check(&addrs[i]);
+		if (err < 0)
+			goto out;
+	}
+
+	if (op == VE_IP_DEL) {
+		err = veip_entries_del(veid, addrs, nr);
+		goto out;
+	}
+
+	ve = get_ve_by_id(veid);
+	err = -ESRCH;
+	if (!ve)
+		goto out;
+
+	down_read(&ve->op_sem);
+	if (ve->is_running)
+		err = veip_entries_add(ve, addrs, nr);
+	up_read(&ve->op_sem);
+	put_ve(ve);
+out:
+	vfree(addrs);
+	return err;
+}
+
 int venet_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	int err;
@@ -915,6 +1274,31 @@ int venet_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		err = real_ve_ip_map(s.veid, s.op, s.addr, s.addrlen);
 		break;
 	}
+	case VENETCTL_VE_FILTER: {
+		struct vzctl_ve_filter s;
+		err = -EFAULT;
+		if (copy_from_user(&s, (void __user *)arg, sizeof(s)))
+			break;
+		err = venet_filter_ctl(s.veid, s.op, s.addr, s.addrlen,
+				s.rate, s.burst);
+		break;
+	}
+	case VENETCTL_ACCT_CLASSES: {
+		struct vzctl_venet_acct_classes s;
+		err = -EFAULT;
+		if (copy_from_user(&s, (void __user *)arg, sizeof(s)))
+			break;
+		err = venet_acct_set_classes(s.nr, s.prefixes);
+		break;
+	}
+	case VENETCTL_VE_IP_MAP_BULK: {
+		struct vzctl_ve_ip_map_bulk s;
+		err = -EFAULT;
+		if (copy_from_user(&s, (void __user *)arg, sizeof(s)))
+			break;
+		err = real_ve_ip_map_bulk(s.veid, s.op, s.nr, s.addrs);
+		break;
+	}
 	}
 	return err;
 }
@@ -936,6 +1320,38 @@ int compat_venet_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				cs.addrlen);
 		break;
 	}
+	case VENETCTL_COMPAT_VE_FILTER: {
+		struct compat_vzctl_ve_filter cs;
+
+		err = -EFAULT;
+		if (copy_from_user(&cs, (void *)arg, sizeof(cs)))
+			break;
+
+		err = venet_filter_ctl(cs.veid, cs.op, compat_ptr(cs.addr),
+				cs.addrlen, cs.rate, cs.burst);
+		break;
+	}
+	case VENETCTL_COMPAT_ACCT_CLASSES: {
+		struct compat_vzctl_venet_acct_classes cs;
+
+		err = -EFAULT;
+		if (copy_from_user(&cs, (void *)arg, sizeof(cs)))
+			break;
+
+		err = venet_acct_set_classes(cs.nr, compat_ptr(cs.prefixes));
+		break;
+	}
+	case VENETCTL_COMPAT_VE_IP_MAP_BULK: {
+		struct compat_vzctl_ve_ip_map_bulk cs;
+
+		err = -EFAULT;
+		if (copy_from_user(&cs, (void *)arg, sizeof(cs)))
+			break;
+
+		err = real_ve_ip_map_bulk(cs.veid, cs.op, cs.nr,
+				compat_ptr(cs.addrs));
+		break;
+	}
 	default:
 		err = venet_ioctl(file, cmd, arg);
 		break;
@@ -953,12 +1369,26 @@ static struct vzioctlinfo venetcalls = {
 	.owner		= THIS_MODULE,
 };
 
+/*
+ * The host device carries the traffic of all the containers, so it gets
+ * a queue per cpu. Transmit queues are picked by the core (XPS or flow
+ * hash), and the receive queue on the other side follows the transmit
+ * one, so RPS can be set up per queue of the receiving device.
+ */
+static int venet_ct_queues = 1;
+module_param(venet_ct_queues, int, 0644);
+MODULE_PARM_DESC(venet_ct_queues, "Number of queues of container devices");
+
 int venet_dev_start(struct ve_struct *ve)
 {
 	struct net_device *dev_venet;
+	unsigned int nr_queues;
 	int err;
 
-	dev_venet = alloc_netdev(0, "venet%d", venet_setup);
+	nr_queues = ve_is_super(ve) ? num_online_cpus() : venet_ct_queues;
+	nr_queues = clamp_t(unsigned int, nr_queues, 1, nr_cpu_ids);
+
+	dev_venet = alloc_netdev_mq(0, "venet%d", venet_setup, nr_queues);
 	if (!dev_venet)
 		return -ENOMEM;
 	dev_net_set(dev_venet, ve->ve_netns);
@@ -999,11 +1429,17 @@ static __net_init int venet_init_net(struct net *net)
 	if (err != 0)
 		goto err;
 
-	err = venet_dev_start(env);
+	err = venet_acct_init(env);
 	if (err)
 		goto err_free;
+
+	err = venet_dev_start(env);
+	if (err)
+		goto err_acct;
 	return 0;
 
+err_acct:
+	venet_acct_fini(env);
 err_free:
 	veip_stop(env);
 err:
@@ -1026,6 +1462,7 @@ static __net_exit void venet_exit_net(struct list_head *net_exit_list)
 			goto next;
 
 		venet_ext_clean(env);
+		venet_filter_destroy(env);
 		veip_stop(env);
 
 		dev = env->_venet_dev;
@@ -1049,6 +1486,8 @@ next:
 		if (env->ve_netns != net)
 			continue;
 
+		venet_acct_fini(env);
+
 		dev = env->_venet_dev;
 		if (dev == NULL)
 			continue;
@@ -1071,23 +1510,42 @@ __init int venet_init(void)
 #ifdef CONFIG_PROC_FS
 	struct proc_dir_entry *de;
 #endif
-	int i, err;
+	int err;
 
 	if (get_ve0()->_venet_dev != NULL)
 		return -EEXIST;
 
-	for (i = 0; i < VEIP_HASH_SZ; i++)
-		INIT_HLIST_HEAD(ip_entry_hash_table + i);
+	veip_hash = veip_hash_alloc(VEIP_HASH_SZ, 0);
+	if (veip_hash == NULL)
+		return -ENOMEM;
+	get_random_bytes(&veip_hash_rnd, sizeof(veip_hash_rnd));
+
+	err = venet_gro_init();
+	if (err) {
+		veip_hash_free(veip_hash);
+		return err;
+	}
 
 	err = register_pernet_device(&venet_net_ops);
-	if (err)
+	if (err) {
+		venet_gro_fini();
+		veip_hash_free(veip_hash);
 		return err;
+	}
 
 #ifdef CONFIG_PROC_FS
 	de = proc_create("veip", S_IFREG | S_IRUSR, proc_vz_dir,
 			&proc_veip_operations);
 	if (de == NULL)
 		printk(KERN_WARNING "venet: can't make veip proc entry\n");
+	de = proc_create("veip_hash", S_IFREG | S_IRUSR, proc_vz_dir,
+			&proc_veip_hash_operations);
+	if (de == NULL)
+		printk(KERN_WARNING "venet: can't make veip_hash proc entry\n");
+	de = proc_create("venet_acct", S_IFREG | S_IRUSR, proc_vz_dir,
+			&proc_venet_acct_operations);
+	if (de == NULL)
+		printk(KERN_WARNING "venet: can't make venet_acct proc entry\n");
 #endif
 
 	vzioctl_register(&venetcalls);
@@ -1100,16 +1558,21 @@ __exit void venet_exit(void)
 	vzmon_unregister_veaddr_print_cb(veaddr_seq_print);
 	vzioctl_unregister(&venetcalls);
 	unregister_pernet_device(&venet_net_ops);
+	venet_gro_fini();
 
 #ifdef CONFIG_PROC_FS
+	remove_proc_entry("venet_acct", proc_vz_dir);
+	remove_proc_entry("veip_hash", proc_vz_dir);
 	remove_proc_entry("veip", proc_vz_dir);
 #endif
 	veip_cleanup();
+	venet_acct_cleanup();
 
 	/* Ensure there are no outstanding rcu callbacks */
 	rcu_barrier();
 
 	BUG_ON(!list_empty(&veip_lh));
+	veip_hash_free(veip_hash);
 }
 
 module_init(venet_init);
@@ -1125,10 +1588,11 @@ EXPORT_SYMBOL(ip_entry_hash);
 EXPORT_SYMBOL(ip_entry_unhash);
 EXPORT_SYMBOL(sockaddr_to_veaddr);
 EXPORT_SYMBOL(veaddr_print);
+EXPORT_SYMBOL(venet_skb_addr);
 EXPORT_SYMBOL(venet_entry_lookup);
 EXPORT_SYMBOL(veip_find);
 EXPORT_SYMBOL(veip_findcreate);
 EXPORT_SYMBOL(veip_put);
 EXPORT_SYMBOL(venet_ext_lookup);
 EXPORT_SYMBOL(veip_lh);
-EXPORT_SYMBOL(ip_entry_hash_table);
+EXPORT_SYMBOL(veip_hash);
@@ -46,6 +46,7 @@
 #include <linux/ethtool.h>
 #include <linux/ve_proto.h>
 #include <linux/veth.h>
+#include <linux/venet.h>
 #include <linux/vzctl.h>
 #include <linux/vzctl_veth.h>
 
@@ -235,22 +236,31 @@ static void veth_destructor(struct net_device *dev)
 	free_netdev(dev);
 }
 
-static struct net_device_stats *get_stats(struct net_device *dev)
+static struct rtnl_link_stats64 *get_stats64(struct net_device *dev,
+		struct rtnl_link_stats64 *stats)
 {
 	int i;
-	struct net_device_stats *stats;
 
-	stats = &veth_from_netdev(dev)->stats;
-	memset(stats, 0, sizeof(struct net_device_stats));
 	for_each_possible_cpu(i) {
-		struct net_device_stats *dev_stats;
+		struct veth_pcpu_stats *dev_stats;
+		u64 rx_bytes, tx_bytes, rx_packets, tx_packets, tx_dropped;
+		unsigned int start;
 
 		dev_stats = veth_stats(dev, i);
-		stats->rx_bytes   += dev_stats->rx_bytes;
-		stats->tx_bytes   += dev_stats->tx_bytes;
-		stats->rx_packets += dev_stats->rx_packets;
-		stats->tx_packets += dev_stats->tx_packets;
-		stats->tx_dropped += dev_stats->tx_dropped;
+		do {
+			start = u64_stats_fetch_begin_irq(&dev_stats->syncp);
+			rx_bytes   = dev_stats->rx_bytes;
+			tx_bytes   = dev_stats->tx_bytes;
+			rx_packets = dev_stats->rx_packets;
+			tx_packets = dev_stats->tx_packets;
+			tx_dropped = dev_stats->tx_dropped;
+		} while (u64_stats_fetch_retry_irq(&dev_stats->syncp, start));
+
+		stats->rx_bytes   += rx_bytes;
+		stats->tx_bytes   += tx_bytes;
+		stats->rx_packets += rx_packets;
+		stats->tx_packets += tx_packets;
+		stats->tx_dropped += tx_dropped;
 	}
 
 	return stats;
@@ -262,7 +272,7 @@ static struct net_device_stats *get_stats(struct net_device *dev)
  */
 static int veth_xmit(struct sk_buff *skb, struct net_device *dev)
 {
-	struct net_device_stats *stats;
+	struct veth_pcpu_stats *stats;
 	struct net_device *rcv = NULL;
 	struct veth_struct *entry;
 	int length;
@@ -310,28 +320,46 @@ out:
 	skb->pkt_type = PACKET_HOST;
 	skb->protocol = eth_type_trans(skb, rcv);
 
+#if defined(CONFIG_VE_NETDEV) || defined(CONFIG_VE_NETDEV_MODULE)
+	if (unlikely(rcv->owner_env->venet_filter != NULL) &&
+			venet_filter_drop(rcv->owner_env, skb))
+		goto outf;
+
+	venet_acct_skb(dev->owner_env, skb, VENET_ACCT_OUT);
+	venet_acct_skb(rcv->owner_env, skb, VENET_ACCT_IN);
+#endif
+
 	if (skb->protocol != __constant_htons(ETH_P_IP))
 		skb_orphan(skb);
 
 	nf_reset(skb);
 	length = skb->len;
 
-	netif_rx(skb);
+#if defined(CONFIG_VE_NETDEV) || defined(CONFIG_VE_NETDEV_MODULE)
+	if (!venet_gro_rx(skb))
+#endif
+		netif_rx(skb);
 
+	u64_stats_update_begin(&stats->syncp);
 	stats->tx_bytes += length;
 	stats->tx_packets++;
+	u64_stats_update_end(&stats->syncp);
 	if (rcv) {
-		struct net_device_stats *rcv_stats;
+		struct veth_pcpu_stats *rcv_stats;
 		rcv_stats = veth_stats(rcv, smp_processor_id());
+		u64_stats_update_begin(&rcv_stats->syncp);
 		rcv_stats->rx_bytes += length;
 		rcv_stats->rx_packets++;
+		u64_stats_update_end(&rcv_stats->syncp);
 	}
 
 	return 0;
 
 outf:
 	kfree_skb(skb);
+	u64_stats_update_begin(&stats->syncp);
 	stats->tx_dropped++;
+	u64_stats_update_end(&stats->syncp);
 	return 0;
 }
 
@@ -355,7 +383,7 @@ static int veth_set_mac(struct net_device *dev, void *p)
 static int veth_init_dev(struct net_device *dev)
 {
 	veth_from_netdev(dev)->real_stats =
-		alloc_percpu(struct net_device_stats);
+		alloc_percpu(struct veth_pcpu_stats);
 	if (veth_from_netdev(dev)->real_stats == NULL)
 		return -ENOMEM;
 
@@ -387,13 +415,22 @@ static int veth_op_set_sg(struct net_device *dev, u32 data)
 
 static int veth_op_set_tx_csum(struct net_device *dev, u32 data)
 {
-	return veth_set_op(dev, data, ethtool_op_set_tx_csum);
+	return veth_set_op(dev, data, ethtool_op_set_tx_hw_csum);
+}
+
+static int veth_set_all_tso(struct net_device *dev, u32 data)
+{
+	if (data)
+		dev->features |= NETIF_F_ALL_TSO;
+	else
+		dev->features &= ~NETIF_F_ALL_TSO;
+	return 0;
 }
 
 static int
 veth_op_set_tso(struct net_device *dev, u32 data)
 {
-	return veth_set_op(dev, data, ethtool_op_set_tso);
+	return veth_set_op(dev, data, veth_set_all_tso);
 }
 
 #define veth_op_set_rx_csum veth_op_set_tx_csum
@@ -461,26 +498,36 @@ static struct netdev_rst veth_netdev_rst = {
 static const struct net_device_ops veth_ops = {
 	.ndo_init = veth_init_dev,
 	.ndo_start_xmit = veth_xmit,
-	.ndo_get_stats = get_stats,
 	.ndo_open = veth_open,
 	.ndo_stop = veth_close,
 	.ndo_set_mac_address = veth_set_mac,
 	.ndo_cpt = veth_cpt,
 };
 
+static const struct net_device_ops_ext veth_ops_ext = {
+	.size = sizeof(struct net_device_ops_ext),
+	.ndo_get_stats64 = get_stats64,
+};
+
+/*
+ * Packets are passed to the pair as they are: a CHECKSUM_PARTIAL or GSO
+ * skb is either consumed by the local stack of the peer, which accepts
+ * it as is, or has its checksum completed and is segmented by the core
+ * when forwarded to a device without the offloads.
+ */
+#define VETH_FEATURES	(NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_ALL_TSO)
+
 static void veth_setup(struct net_device *dev)
 {
 	ether_setup(dev);
 
 	dev->netdev_ops = &veth_ops;
+	set_netdev_ops_ext(dev, &veth_ops_ext);
 	dev->destructor = veth_destructor;
 	dev->tx_queue_len = 0;
 
-	/*
-	 * No other features, as they are:
-	 *  - checksumming is required, and nobody else will done our job
-	 */
-	dev->features |= NETIF_F_LLTX |	NETIF_F_HIGHDMA;
+	dev->features |= NETIF_F_LLTX |	NETIF_F_HIGHDMA | VETH_FEATURES;
+	dev->vlan_features = dev->features;
 	dev->vz_features |= NETIF_F_VENET | NETIF_F_VIRTUAL;
 
 	SET_ETHTOOL_OPS(dev, &veth_ethtool_ops);
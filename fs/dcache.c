@@ -105,11 +105,20 @@ static void dentry_iput(struct dentry * dentry)
 	__releases(dcache_lock)
 {
 	struct inode *inode = dentry->d_inode;
+	struct user_beancounter *ub = NULL;
+
 	if (inode) {
 		dentry->d_inode = NULL;
 		list_del_init(&dentry->d_alias);
+		/* the last alias hands the inode over to its beancounter */
+		if (list_empty(&inode->i_dentry) && dentry->d_ub != get_ub0())
+			ub = get_beancounter_rcu(dentry->d_ub);
 		spin_unlock(&dentry->d_lock);
 		spin_unlock(&dcache_lock);
+		if (ub != NULL) {
+			ub_icache_set_owner(inode, ub);
+			put_beancounter(ub);
+		}
 		if (!inode->i_nlink)
 			fsnotify_inoderemove(inode);
 		if (dentry->d_op && dentry->d_op->d_iput)
@@ -271,14 +280,44 @@ static struct dentry *d_kill(struct dentry *dentry)
  * no dcache lock, please.
  */
 
+/*
+ * Lookup-only walks drop the last reference of hashed dentries which are
+ * still on the LRU since they were unused last time. Nothing is to be
+ * done with the LRU then, so the reference is dropped under d_lock only
+ * and dcache_lock is not taken. Whoever takes a dentry off the LRU while
+ * it may be in use checks d_count under d_lock afterwards.
+ */
+static inline int dput_lru_fast(struct dentry *dentry)
+{
+	int ret = 0;
+
+	if (dentry->d_op && dentry->d_op->d_delete)
+		return 0;
+	if (ub_dcache_lru_popup)
+		return 0;
+
+	spin_lock(&dentry->d_lock);
+	if (!d_unhashed(dentry) && !list_empty(&dentry->d_lru) &&
+	    !(dentry->d_flags & DCACHE_DISCONNECTED)) {
+		atomic_dec(&dentry->d_count);
+		ret = 1;
+	}
+	spin_unlock(&dentry->d_lock);
+
+	return ret;
+}
+
 void dput_nocache(struct dentry *dentry, int nocache)
 {
 	if (!dentry)
 		return;
 
 repeat:
-	if (atomic_read(&dentry->d_count) == 1)
+	if (atomic_read(&dentry->d_count) == 1) {
 		might_sleep();
+		if (!nocache && dput_lru_fast(dentry))
+			return;
+	}
 	if (!atomic_dec_and_lock(&dentry->d_count, &dcache_lock))
 		return;
 
@@ -514,13 +553,37 @@ static void prune_one_dentry(struct dentry * dentry)
 	}
 }
 
+#define UB_DCACHE_EVICT_BATCH	16
+
+/*
+ * Inodes pinned only by the dentries pruned for a beancounter are freed
+ * right away, otherwise they would stay in the global inode LRU and be
+ * reclaimed by scanning through the inodes of other beancounters.
+ */
+static void ub_dcache_evict_inodes(struct inode **inodes, int *nr)
+	__releases(dcache_lock)
+	__acquires(dcache_lock)
+{
+	int i;
+
+	if (!*nr)
+		return;
+
+	spin_unlock(&dcache_lock);
+	for (i = 0; i < *nr; i++)
+		iput_evict(inodes[i]);
+	spin_lock(&dcache_lock);
+	*nr = 0;
+}
+
 int __shrink_dcache_ub(struct user_beancounter *ub, int count, int popup)
 {
 	LIST_HEAD(referenced);
 	LIST_HEAD(tmp);
 	struct dentry *dentry;
+	struct inode *inode, *evict[UB_DCACHE_EVICT_BATCH];
 	struct super_block *sb = NULL;
-	int pruned = 0;
+	int pruned = 0, nr_evict = 0;
 	unsigned int d_time = 0;
 
 	while (!list_empty(&ub->ub_dentry_lru)) {
@@ -550,6 +613,11 @@ int __shrink_dcache_ub(struct user_beancounter *ub, int count, int popup)
 
 	while (!list_empty(&tmp)) {
 		dentry = list_entry(tmp.prev, struct dentry, d_bclru);
+		/* inodes are put under s_umount of their superblock */
+		if (nr_evict && dentry->d_sb != sb) {
+			ub_dcache_evict_inodes(evict, &nr_evict);
+			continue;
+		}
 		dentry_lru_del_init(dentry);
 		spin_lock(&dentry->d_lock);
 		/*
@@ -580,10 +648,21 @@ int __shrink_dcache_ub(struct user_beancounter *ub, int count, int popup)
 			sb = dentry->d_sb;
 		}
 
+		/* the last alias keeps the only reference to the inode */
+		inode = dentry->d_inode;
+		if (inode && atomic_read(&inode->i_count) == 1 &&
+		    list_is_singular(&inode->i_dentry)) {
+			atomic_inc(&inode->i_count);
+			evict[nr_evict++] = inode;
+		}
+
 		prune_one_dentry(dentry);
 		/* dentry->d_lock was dropped in prune_one_dentry() */
+		if (nr_evict == UB_DCACHE_EVICT_BATCH)
+			ub_dcache_evict_inodes(evict, &nr_evict);
 		cond_resched_lock(&dcache_lock);
 	}
+	ub_dcache_evict_inodes(evict, &nr_evict);
 
 	list_splice(&referenced, &ub->ub_dentry_lru);
 
@@ -1056,15 +1135,18 @@ resume:
 		struct dentry *dentry = list_entry(tmp, struct dentry, d_u.d_child);
 		next = tmp->next;
 
-		dentry_lru_del_init(dentry);
-		/* 
+		/*
 		 * move only zero ref count dentries to the end 
-		 * of the unused list for prune_dcache
+		 * of the unused list for prune_dcache, d_lock keeps
+		 * off dput_lru_fast()
 		 */
+		spin_lock(&dentry->d_lock);
+		dentry_lru_del_init(dentry);
 		if (!atomic_read(&dentry->d_count)) {
 			dentry_lru_add_tail(dentry);
 			found++;
 		}
+		spin_unlock(&dentry->d_lock);
 
 		/*
 		 * We can return to the caller if we have found some (this
@@ -2237,7 +2319,7 @@ char *__d_path(const struct path *path, struct path *root,
 	struct vfsmount *oldmnt = vfsmnt;
 	struct ve_struct *ve = get_exec_env();
 
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	if (buffer) {
 		prepend(&end, &buflen, "\0", 1);
 		if (buflen < 1)
@@ -2281,7 +2363,7 @@ out:
 			prepend(&retval, &buflen, " (deleted)", 10) != 0)
 		goto Elong;
 
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 	return buffer ? retval : NULL;
 
 global_root:
@@ -2315,7 +2397,7 @@ ct_root:
 Elong:
 	retval = ERR_PTR(-ENAMETOOLONG);
 out_err:
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 	return retval;
 
 }
@@ -1231,6 +1231,8 @@ struct ext4_sb_info {
 
 	/* locality groups */
 	struct ext4_locality_group *s_locality_groups;
+	/* allocation slots of containers */
+	struct ext4_ub_slot *s_ub_slots;
 
 	/* for write statistics */
 	unsigned long s_sectors_written_start;
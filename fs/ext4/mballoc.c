@@ -23,6 +23,8 @@
 
 #include "mballoc.h"
 #include <linux/debugfs.h>
+#include <linux/hash.h>
+#include <bc/beancounter.h>
 #include <trace/events/ext4.h>
 
 /*
@@ -1530,7 +1532,13 @@ static void ext4_mb_use_best_found(struct ext4_allocation_context *ac,
 	ac->ac_buddy_page = e4b->bd_buddy_page;
 	get_page(ac->ac_buddy_page);
 	/* store last allocated for subsequent stream allocation */
-	if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
+	if (ac->ac_slot && (ac->ac_flags &
+			(EXT4_MB_STREAM_ALLOC | EXT4_MB_HINT_GROUP_ALLOC))) {
+		spin_lock(&ac->ac_slot->us_lock);
+		ac->ac_slot->us_last_group = ac->ac_f_ex.fe_group;
+		ac->ac_slot->us_last_start = ac->ac_f_ex.fe_start;
+		spin_unlock(&ac->ac_slot->us_lock);
+	} else if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
 		spin_lock(&sbi->s_md_lock);
 		sbi->s_mb_last_group = ac->ac_f_ex.fe_group;
 		sbi->s_mb_last_start = ac->ac_f_ex.fe_start;
@@ -1985,7 +1993,12 @@ ext4_mb_regular_allocator(struct ext4_allocation_context *ac)
 	bsbits = ac->ac_sb->s_blocksize_bits;
 
 	/* if stream allocation is enabled, use global goal */
-	if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
+	if ((ac->ac_flags & EXT4_MB_STREAM_ALLOC) && ac->ac_slot) {
+		spin_lock(&ac->ac_slot->us_lock);
+		ac->ac_g_ex.fe_group = ac->ac_slot->us_last_group;
+		ac->ac_g_ex.fe_start = ac->ac_slot->us_last_start;
+		spin_unlock(&ac->ac_slot->us_lock);
+	} else if (ac->ac_flags & EXT4_MB_STREAM_ALLOC) {
 		/* TBD: may be hot point */
 		spin_lock(&sbi->s_md_lock);
 		ac->ac_g_ex.fe_group = sbi->s_mb_last_group;
@@ -2347,10 +2360,20 @@ err_freesgi:
 	return -ENOMEM;
 }
 
+static void ext4_mb_init_lg(struct ext4_locality_group *lg)
+{
+	int i;
+
+	mutex_init(&lg->lg_mutex);
+	for (i = 0; i < PREALLOC_TB_SIZE; i++)
+		INIT_LIST_HEAD(&lg->lg_prealloc_list[i]);
+	spin_lock_init(&lg->lg_prealloc_lock);
+}
+
 int ext4_mb_init(struct super_block *sb, int needs_recovery)
 {
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
-	unsigned i, j;
+	unsigned i;
 	unsigned offset;
 	unsigned max;
 	int ret;
@@ -2411,10 +2434,24 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 	for_each_possible_cpu(i) {
 		struct ext4_locality_group *lg;
 		lg = per_cpu_ptr(sbi->s_locality_groups, i);
-		mutex_init(&lg->lg_mutex);
-		for (j = 0; j < PREALLOC_TB_SIZE; j++)
-			INIT_LIST_HEAD(&lg->lg_prealloc_list[j]);
-		spin_lock_init(&lg->lg_prealloc_lock);
+		ext4_mb_init_lg(lg);
+	}
+
+	sbi->s_ub_slots = kcalloc(EXT4_UB_SLOTS, sizeof(struct ext4_ub_slot),
+				  GFP_KERNEL);
+	if (sbi->s_ub_slots == NULL) {
+		free_percpu(sbi->s_locality_groups);
+		kfree(sbi->s_mb_offsets);
+		kfree(sbi->s_mb_maxs);
+		return -ENOMEM;
+	}
+	for (i = 0; i < EXT4_UB_SLOTS; i++) {
+		struct ext4_ub_slot *slot = sbi->s_ub_slots + i;
+
+		ext4_mb_init_lg(&slot->us_lg);
+		spin_lock_init(&slot->us_lock);
+		slot->us_last_group = (u64)ext4_get_groups_count(sb) * i /
+					EXT4_UB_SLOTS;
 	}
 
 	if (sbi->s_proc)
@@ -2502,6 +2539,7 @@ int ext4_mb_release(struct super_block *sb)
 	}
 
 	free_percpu(sbi->s_locality_groups);
+	kfree(sbi->s_ub_slots);
 
 	return 0;
 }
@@ -3902,6 +3940,20 @@ static inline void ext4_mb_show_ac(struct ext4_allocation_context *ac)
 }
 #endif
 
+/*
+ * Allocation slot of the container the caller works for, NULL for the host.
+ * Writeback runs with the beancounter which dirtied the inode.
+ */
+static struct ext4_ub_slot *ext4_mb_ub_slot(struct ext4_sb_info *sbi)
+{
+	struct user_beancounter *ub = get_exec_ub_top();
+
+	if (ub == get_ub0() || sbi->s_ub_slots == NULL)
+		return NULL;
+
+	return sbi->s_ub_slots + hash_32(ub->ub_uid, EXT4_UB_SLOTS_BITS);
+}
+
 /*
  * We use locality group preallocation for small size file. The size of the
  * file is determined by the current size or the resulting size after
@@ -3943,9 +3995,14 @@ static void ext4_mb_group_or_file(struct ext4_allocation_context *ac)
 	/*
 	 * locality group prealloc space are per cpu. The reason for having
 	 * per cpu locality group is to reduce the contention between block
-	 * request from multiple CPUs.
+	 * request from multiple CPUs. Containers use the locality group of
+	 * their slot instead.
 	 */
-	ac->ac_lg = per_cpu_ptr(sbi->s_locality_groups, raw_smp_processor_id());
+	if (ac->ac_slot)
+		ac->ac_lg = &ac->ac_slot->us_lg;
+	else
+		ac->ac_lg = per_cpu_ptr(sbi->s_locality_groups,
+					raw_smp_processor_id());
 
 	/* we're going to use group allocation */
 	ac->ac_flags |= EXT4_MB_HINT_GROUP_ALLOC;
@@ -3995,11 +4052,21 @@ ext4_mb_initialize_context(struct ext4_allocation_context *ac,
 	ac->ac_g_ex.fe_start = block;
 	ac->ac_g_ex.fe_len = len;
 	ac->ac_flags = ar->flags;
+	ac->ac_slot = ext4_mb_ub_slot(sbi);
 
 	/* we have to define context: we'll we work with a file or
 	 * locality group. this is a policy, actually */
 	ext4_mb_group_or_file(ac);
 
+	/* first blocks of a small file go where its container allocates */
+	if (ac->ac_slot && (ac->ac_flags & EXT4_MB_HINT_GROUP_ALLOC) &&
+	    !ar->pleft && !ar->pright) {
+		spin_lock(&ac->ac_slot->us_lock);
+		ac->ac_g_ex.fe_group = ac->ac_slot->us_last_group;
+		ac->ac_g_ex.fe_start = ac->ac_slot->us_last_start;
+		spin_unlock(&ac->ac_slot->us_lock);
+	}
+
 	mb_debug(1, "init ac: %u blocks @ %u, goal %u, flags %x, 2^%d, "
 			"left: %u/%u, right %u/%u to %swritable\n",
 			(unsigned) ar->len, (unsigned) ar->logical,
@@ -163,6 +163,24 @@ struct ext4_locality_group {
 	spinlock_t		lg_prealloc_lock;
 };
 
+/*
+ * Allocations of containers are spread over EXT4_UB_SLOTS slots keyed by
+ * beancounter, each slot starting in its own range of block groups.  Small
+ * files of a slot share its locality group, stream allocations and the
+ * first blocks of files continue from where the slot allocated last, so
+ * that blocks of different containers do not interleave.
+ */
+#define EXT4_UB_SLOTS_BITS	5
+#define EXT4_UB_SLOTS		(1 << EXT4_UB_SLOTS_BITS)
+
+struct ext4_ub_slot {
+	struct ext4_locality_group us_lg;
+	/* where last allocation of the slot was done, under us_lock */
+	spinlock_t		us_lock;
+	ext4_group_t		us_last_group;
+	ext4_grpblk_t		us_last_start;
+};
+
 struct ext4_allocation_context {
 	struct inode *ac_inode;
 	struct super_block *ac_sb;
@@ -196,6 +214,7 @@ struct ext4_allocation_context {
 	struct page *ac_buddy_page;
 	struct ext4_prealloc_space *ac_pa;
 	struct ext4_locality_group *ac_lg;
+	struct ext4_ub_slot *ac_slot;
 };
 
 #define AC_STATUS_CONTINUE	1
@@ -5007,6 +5007,9 @@ static void ext4_kill_sb(struct super_block *sb)
 {
 	struct ext4_sb_info *sbi;
 
+	/* deferred pramcache inodes pin dentries */
+	pramcache_cancel_load(sb);
+
 	sbi = EXT4_SB(sb);
 	if (sbi && sbi->s_balloon_ino)
 		iput(sbi->s_balloon_ino);
@@ -86,9 +86,33 @@ EXPORT_SYMBOL_GPL(get_max_files);
  * Handle nr_files sysctl
  */
 #if defined(CONFIG_SYSCTL) && defined(CONFIG_PROC_FS)
+#ifdef CONFIG_BEANCOUNTERS
+/*
+ * Files of a VE are not counted in nr_files, they are accounted in the
+ * percpu precharged UB_NUMFILE of its beancounter, report that one.
+ */
+static int proc_nr_files_ve(ctl_table *table, int write,
+                     void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct user_beancounter *ub = get_exec_ub_top();
+	struct files_stat_struct stat = { };
+	ctl_table t = *table;
+
+	stat.nr_files = get_beancounter_usage_percpu(ub, UB_NUMFILE);
+	stat.max_files = min(ub->ub_parms[UB_NUMFILE].limit,
+			files_stat.max_files);
+	t.data = &stat;
+	return proc_doulongvec_minmax(&t, write, buffer, lenp, ppos);
+}
+#endif
+
 int proc_nr_files(ctl_table *table, int write,
                      void __user *buffer, size_t *lenp, loff_t *ppos)
 {
+#ifdef CONFIG_BEANCOUNTERS
+	if (!ve_is_super(get_exec_env()))
+		return proc_nr_files_ve(table, write, buffer, lenp, ppos);
+#endif
 	files_stat.nr_files = get_nr_files();
 	return proc_doulongvec_minmax(table, write, buffer, lenp, ppos);
 }
@@ -27,7 +27,9 @@
 #include <linux/buffer_head.h>
 #include <trace/events/kmem.h>
 #include <linux/tracepoint.h>
+#include <linux/hash.h>
 #include "internal.h"
+#include <bc/beancounter.h>
 #include <bc/io_acct.h>
 
 /*
@@ -279,6 +281,97 @@ static void move_expired_inodes(struct list_head *delaying_queue,
 	}
 }
 
+#ifdef CONFIG_BC_IO_ACCOUNTING
+#define WB_UB_QUEUES_BITS	4
+#define WB_UB_QUEUES		(1 << WB_UB_QUEUES_BITS)
+
+struct wb_ub_queue {
+	struct list_head	inodes;
+	struct user_beancounter	*ub;
+	int			quantum;
+};
+
+static void ub_fair_merge(struct wb_ub_queue *queues, struct list_head *out)
+{
+	struct inode *inode;
+	bool more;
+	int i, n;
+
+	do {
+		more = false;
+		for (i = 0; i < WB_UB_QUEUES; i++) {
+			struct wb_ub_queue *q = &queues[i];
+
+			for (n = q->quantum; n && !list_empty(&q->inodes); n--) {
+				inode = list_entry(q->inodes.next,
+						   struct inode, i_list);
+				list_move(&inode->i_list, out);
+			}
+			more |= !list_empty(&q->inodes);
+		}
+	} while (more);
+}
+
+/*
+ * Interleave inodes of the io queue by beancounters they are written back
+ * for, so that one container with lots of dirty inodes doesn't hold back
+ * writeback of the others. Containers take turns in a few inodes, more of
+ * them at higher io priority. Inodes of one superblock are kept together,
+ * containers beyond the number of queues share them.
+ *
+ * The queue is served from the tail, that's where eldest inodes are.
+ */
+static void ub_fair_queue_io(struct list_head *queue)
+{
+	struct wb_ub_queue queues[WB_UB_QUEUES];
+	struct super_block *sb = NULL;
+	struct user_beancounter *ub, *first;
+	struct inode *inode;
+	LIST_HEAD(out);
+	int i;
+
+	if (list_empty(queue))
+		return;
+
+	first = list_entry(queue->next, struct inode, i_list)->i_mapping->dirtied_ub;
+	list_for_each_entry(inode, queue, i_list)
+		if (inode->i_mapping->dirtied_ub != first)
+			goto mixed;
+	return;
+
+mixed:
+	for (i = 0; i < WB_UB_QUEUES; i++) {
+		INIT_LIST_HEAD(&queues[i].inodes);
+		queues[i].ub = NULL;
+		queues[i].quantum = UB_WB_QUANTUM;
+	}
+
+	/* dirtied_ub is dropped under tree_lock, the beancounter is rcu freed */
+	rcu_read_lock();
+	while (!list_empty(queue)) {
+		inode = list_entry(queue->prev, struct inode, i_list);
+		if (sb && inode->i_sb != sb)
+			ub_fair_merge(queues, &out);
+		sb = inode->i_sb;
+
+		ub = rcu_dereference(inode->i_mapping->dirtied_ub);
+		i = hash_ptr(ub, WB_UB_QUEUES_BITS);
+		if (list_empty(&queues[i].inodes) && queues[i].ub != ub) {
+			queues[i].ub = ub;
+			queues[i].quantum = ub ? ub_ioprio_quantum(ub) :
+						 UB_WB_QUANTUM;
+		}
+		list_move_tail(&inode->i_list, &queues[i].inodes);
+	}
+	rcu_read_unlock();
+	ub_fair_merge(queues, &out);
+
+	list_splice(&out, queue);
+}
+#else
+static inline void ub_fair_queue_io(struct list_head *queue) { }
+#endif
+
 /*
  * Queue all expired dirty inodes for io, eldest first.
  * Before
@@ -296,6 +389,7 @@ static void queue_io(struct bdi_writeback *wb, struct writeback_control *wbc)
 	move_expired_inodes(&wb->b_dirty, &wb->b_io, 0, wbc);
 	move_expired_inodes(&wb->b_dirty_time, &wb->b_io,
 			    EXPIRE_DIRTY_ATIME, wbc);
+	ub_fair_queue_io(&wb->b_io);
 }
 
 static int write_inode(struct inode *inode, struct writeback_control *wbc)
@@ -560,6 +654,17 @@ static int writeback_sb_inodes(struct super_block *sb, struct bdi_writeback *wb,
 			continue;
 		}
 
+		/*
+		 * Don't get stuck in io limit of one container while the
+		 * others are waiting, its inodes are back in the next round.
+		 */
+		if (wbc->sync_mode == WB_SYNC_NONE && !wbc->for_sync &&
+		    !wb->bdi->dirty_exceeded &&
+		    ub_should_delay_writeback(wbc->wb_ub, inode)) {
+			redirty_tail(inode);
+			continue;
+		}
+
 		if (inode->i_state & (I_NEW | I_WILL_FREE)) {
 			requeue_io(inode);
 			continue;
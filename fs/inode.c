@@ -28,6 +28,9 @@
 #include <linux/posix_acl.h>
 #include <linux/nsproxy.h>
 #include <linux/mnt_namespace.h>
+#include <linux/page_replica.h>
+#include <bc/beancounter.h>
+#include <bc/dcache.h>
 #include <trace/events/writeback.h>
 #include "internal.h"
 
@@ -82,6 +85,46 @@ LIST_HEAD(inode_in_use);
 LIST_HEAD(inode_unused);
 static struct hlist_head *inode_hashtable __read_mostly;
 
+/*
+ * Hash chains are changed under inode_lock and the lock of the bucket.
+ * Lookups of inodes which are in use go with the bucket lock only, see
+ * find_inode_inuse(), this keeps iget of cached inodes off inode_lock.
+ */
+#define I_HASH_LOCKS	1024
+
+static spinlock_t inode_hash_locks[I_HASH_LOCKS] = {
+	[0 ... I_HASH_LOCKS - 1] = __SPIN_LOCK_UNLOCKED(inode_hash_locks)
+};
+
+static inline spinlock_t *inode_hash_lock(unsigned int bucket)
+{
+	return inode_hash_locks + (bucket & (I_HASH_LOCKS - 1));
+}
+
+static inline void inode_hash_add(struct inode *inode, struct hlist_head *head)
+{
+	spinlock_t *lock;
+
+	inode->i_hash_bucket = head - inode_hashtable;
+	lock = inode_hash_lock(inode->i_hash_bucket);
+	spin_lock(lock);
+	hlist_add_head(&inode->i_hash, head);
+	spin_unlock(lock);
+}
+
+static inline void inode_hash_del(struct inode *inode)
+{
+	spinlock_t *lock;
+
+	if (hlist_unhashed(&inode->i_hash))
+		return;
+
+	lock = inode_hash_lock(inode->i_hash_bucket);
+	spin_lock(lock);
+	hlist_del_init(&inode->i_hash);
+	spin_unlock(lock);
+}
+
 /*
  * A simple spinlock to protect the list manipulations.
  *
@@ -232,10 +275,32 @@ static struct inode *alloc_inode(struct super_block *sb)
 	return inode;
 }
 
+/*
+ * inode_lock must be held
+ */
+static void __ub_icache_del(struct inode *inode)
+{
+	struct user_beancounter *ub = inode->i_ub;
+
+	if (ub == NULL)
+		return;
+
+	list_del_init(&inode->i_bclru);
+	ub->ub_inode_unused--;
+	inode->i_ub = NULL;
+}
+
 void __destroy_inode(struct inode *inode)
 {
 	BUG_ON(inode_has_buffers(inode));
 	BUG_ON(inode->i_data.dirtied_ub);
+	/* nobody can set the owner of a dying inode, no aliases are left */
+	if (inode->i_ub) {
+		spin_lock(&inode_lock);
+		__ub_icache_del(inode);
+		spin_unlock(&inode_lock);
+	}
+	page_replica_free(&inode->i_data);
 	security_inode_free(inode);
 	fsnotify_inode_delete(inode);
 #ifdef CONFIG_FS_POSIX_ACL
@@ -267,6 +332,7 @@ void inode_init_once(struct inode *inode)
 	INIT_HLIST_NODE(&inode->i_hash);
 	INIT_LIST_HEAD(&inode->i_dentry);
 	INIT_LIST_HEAD(&inode->i_devices);
+	INIT_LIST_HEAD(&inode->i_bclru);
 	INIT_RADIX_TREE(&inode->i_data.page_tree, GFP_ATOMIC);
 	spin_lock_init(&inode->i_data.tree_lock);
 	spin_lock_init(&inode->i_data.i_mmap_lock);
@@ -306,6 +372,7 @@ void __iget(struct inode *inode)
 	if (!(inode->i_state & (I_DIRTY|I_SYNC)))
 		list_move(&inode->i_list, &inode_in_use);
 	inodes_stat.nr_unused--;
+	__ub_icache_del(inode);
 }
 EXPORT_SYMBOL(__iget);
 
@@ -375,7 +442,7 @@ static void dispose_list(struct list_head *head)
 		clear_inode(inode);
 
 		spin_lock(&inode_lock);
-		hlist_del_init(&inode->i_hash);
+		inode_hash_del(inode);
 		list_del_init(&inode->i_sb_list);
 		spin_unlock(&inode_lock);
 
@@ -436,7 +503,7 @@ static void show_inode(struct inode *inode)
 		printk("\n");
 	}
 
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	list_for_each_entry(mnt, &get_task_mnt_ns(current)->list, mnt_list) {
 		if (mnt->mnt_sb != inode->i_sb)
 			continue;
@@ -448,7 +515,7 @@ static void show_inode(struct inode *inode)
 			printk("%2.2x ", *((u_char *)mnt + i));
 		printk("\n");
 	}
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 }
 
 /*
@@ -614,6 +681,79 @@ static void prune_icache(int nr_to_scan)
 	up_read(&iprune_sem);
 }
 
+/*
+ * An inode that lost its last alias is owned by the beancounter of that
+ * dentry until it is used again or freed, so that the unused inodes left
+ * behind by the dcache of a container are reclaimed from that container.
+ * The caller holds a reference to @ub, which keeps ub_icache_unuse() away.
+ */
+void ub_icache_set_owner(struct inode *inode, struct user_beancounter *ub)
+{
+	spin_lock(&inode_lock);
+	if (inode->i_ub != ub) {
+		__ub_icache_del(inode);
+		inode->i_ub = ub;
+		ub->ub_inode_unused++;
+	}
+	list_move(&inode->i_bclru, &ub->ub_inode_lru);
+	spin_unlock(&inode_lock);
+
+	ub_icache_kick(ub);
+}
+
+/*
+ * Free up to `count' unused inodes owned by the beancounter. Inodes which
+ * are in use again are just disowned, dirty inodes and inodes with page
+ * cache or buffers are left for prune_icache().
+ */
+int __shrink_icache_ub(struct user_beancounter *ub, int count)
+{
+	LIST_HEAD(freeable);
+	struct inode *inode;
+	int nr_pruned = 0;
+
+	down_read(&iprune_sem);
+	spin_lock(&inode_lock);
+	while (count-- > 0 && !list_empty(&ub->ub_inode_lru)) {
+		inode = list_entry(ub->ub_inode_lru.prev,
+				struct inode, i_bclru);
+
+		if (atomic_read(&inode->i_count)) {
+			__ub_icache_del(inode);
+			continue;
+		}
+		if (!can_unuse(inode)) {
+			list_move(&inode->i_bclru, &ub->ub_inode_lru);
+			continue;
+		}
+		__ub_icache_del(inode);
+		list_move(&inode->i_list, &freeable);
+		WARN_ON(inode->i_state & I_NEW);
+		inode->i_state |= I_FREEING;
+		nr_pruned++;
+	}
+	inodes_stat.nr_unused -= nr_pruned;
+	ub->ub_inode_pruned += nr_pruned;
+	spin_unlock(&inode_lock);
+
+	dispose_list(&freeable);
+	up_read(&iprune_sem);
+
+	return nr_pruned;
+}
+
+/* the beancounter is going away, its unused inodes stay on inode_unused */
+void ub_icache_unuse(struct user_beancounter *ub)
+{
+	spin_lock(&inode_lock);
+	while (!list_empty(&ub->ub_inode_lru)) {
+		__ub_icache_del(list_first_entry(&ub->ub_inode_lru,
+					struct inode, i_bclru));
+		cond_resched_lock(&inode_lock);
+	}
+	spin_unlock(&inode_lock);
+}
+
 /*
  * shrink_icache_memory() will attempt to reclaim some unused inodes.  Here,
  * "unused" means that no dentries are referring to the inodes: the files are
@@ -700,6 +840,34 @@ repeat:
 	return node ? inode : NULL;
 }
 
+/*
+ * find_inode_inuse finds an inode with references under the bucket lock
+ * only. Such an inode can't be freed, so its reference is just bumped.
+ * Inodes which are unused or being freed are left to find_inode_fast.
+ */
+static struct inode *find_inode_inuse(struct super_block *sb,
+				struct hlist_head *head, unsigned long ino)
+{
+	spinlock_t *lock = inode_hash_lock(head - inode_hashtable);
+	struct hlist_node *node;
+	struct inode *inode;
+
+	spin_lock(lock);
+	hlist_for_each_entry(inode, node, head, i_hash) {
+		if (inode->i_ino != ino)
+			continue;
+		if (inode->i_sb != sb)
+			continue;
+		if ((inode->i_state & (I_FREEING|I_CLEAR|I_WILL_FREE)) ||
+		    !atomic_inc_not_zero(&inode->i_count))
+			inode = NULL;
+		spin_unlock(lock);
+		return inode;
+	}
+	spin_unlock(lock);
+	return NULL;
+}
+
 static unsigned long hash(struct super_block *sb, unsigned long hashval)
 {
 	unsigned long tmp;
@@ -718,7 +886,7 @@ __inode_add_to_lists(struct super_block *sb, struct hlist_head *head,
 	list_add(&inode->i_list, &inode_in_use);
 	list_add(&inode->i_sb_list, &sb->s_inodes);
 	if (head)
-		hlist_add_head(&inode->i_hash, head);
+		inode_hash_add(inode, head);
 }
 
 /**
@@ -1050,6 +1218,12 @@ static struct inode *ifind_fast(struct super_block *sb,
 {
 	struct inode *inode;
 
+	inode = find_inode_inuse(sb, head, ino);
+	if (inode) {
+		wait_on_inode(inode);
+		return inode;
+	}
+
 	spin_lock(&inode_lock);
 	inode = find_inode_fast(sb, head, ino);
 	if (inode) {
@@ -1283,7 +1457,7 @@ int insert_inode_locked(struct inode *inode)
 			break;
 		}
 		if (likely(!node)) {
-			hlist_add_head(&inode->i_hash, head);
+			inode_hash_add(inode, head);
 			spin_unlock(&inode_lock);
 			return 0;
 		}
@@ -1322,7 +1496,7 @@ int insert_inode_locked4(struct inode *inode, unsigned long hashval,
 			break;
 		}
 		if (likely(!node)) {
-			hlist_add_head(&inode->i_hash, head);
+			inode_hash_add(inode, head);
 			spin_unlock(&inode_lock);
 			return 0;
 		}
@@ -1350,7 +1524,7 @@ void __insert_inode_hash(struct inode *inode, unsigned long hashval)
 {
 	struct hlist_head *head = inode_hashtable + hash(inode->i_sb, hashval);
 	spin_lock(&inode_lock);
-	hlist_add_head(&inode->i_hash, head);
+	inode_hash_add(inode, head);
 	spin_unlock(&inode_lock);
 }
 EXPORT_SYMBOL(__insert_inode_hash);
@@ -1364,7 +1538,7 @@ EXPORT_SYMBOL(__insert_inode_hash);
 void remove_inode_hash(struct inode *inode)
 {
 	spin_lock(&inode_lock);
-	hlist_del_init(&inode->i_hash);
+	inode_hash_del(inode);
 	spin_unlock(&inode_lock);
 }
 EXPORT_SYMBOL(remove_inode_hash);
@@ -1408,7 +1582,7 @@ void generic_delete_inode(struct inode *inode)
 		clear_inode(inode);
 	}
 	spin_lock(&inode_lock);
-	hlist_del_init(&inode->i_hash);
+	inode_hash_del(inode);
 	spin_unlock(&inode_lock);
 	wake_up_inode(inode);
 	BUG_ON(inode->i_state != I_CLEAR);
@@ -1445,7 +1619,7 @@ int generic_detach_inode(struct inode *inode)
 		WARN_ON(inode->i_state & I_NEW);
 		inode->i_state &= ~I_WILL_FREE;
 		inodes_stat.nr_unused--;
-		hlist_del_init(&inode->i_hash);
+		inode_hash_del(inode);
 	}
 	list_del_init(&inode->i_list);
 	list_del_init(&inode->i_sb_list);
@@ -1532,6 +1706,46 @@ retry:
 }
 EXPORT_SYMBOL(iput);
 
+/**
+ *	iput_evict	- put an inode without keeping it unused
+ *	@inode: inode to put
+ *
+ *	Like iput(), but the last reference to a clean inode without page
+ *	cache and buffers destroys it at once instead of leaving it on the
+ *	global unused list for prune_icache(). Used by beancounter dcache
+ *	reclaim to free inodes of the dentries it prunes.
+ */
+void iput_evict(struct inode *inode)
+{
+	const struct super_operations *op = inode->i_sb->s_op;
+
+	if (!atomic_dec_and_lock(&inode->i_count, &inode_lock))
+		return;
+
+	if ((op && op->drop_inode) || !inode->i_nlink ||
+	    (inode->i_state & (I_DIRTY_ALL | I_SYNC)) ||
+	    !(inode->i_sb->s_flags & MS_ACTIVE) ||
+	    hlist_unhashed(&inode->i_hash) ||
+	    inode->i_data.nrpages || inode_has_buffers(inode)) {
+		atomic_inc(&inode->i_count);
+		spin_unlock(&inode_lock);
+		iput(inode);
+		return;
+	}
+
+	inode_hash_del(inode);
+	list_del_init(&inode->i_list);
+	list_del_init(&inode->i_sb_list);
+	WARN_ON(inode->i_state & I_NEW);
+	inode->i_state |= I_FREEING;
+	inodes_stat.nr_inodes--;
+	spin_unlock(&inode_lock);
+
+	clear_inode(inode);
+	wake_up_inode(inode);
+	destroy_inode(inode);
+}
+
 /**
  *	bmap	- find a block number in a file
  *	@inode: inode of file
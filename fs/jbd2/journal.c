@@ -42,6 +42,7 @@
 #include <linux/log2.h>
 #include <linux/vmalloc.h>
 #include <linux/bitops.h>
+#include <bc/beancounter.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/jbd2.h>
@@ -650,6 +651,51 @@ int jbd2_log_wait_commit(journal_t *journal, tid_t tid)
 	return err;
 }
 
+/*
+ * A beancounter requesting this many fsync-driven commits in a row, each
+ * within JBD2_FSYNC_WINDOW of the previous one, has its next commits
+ * delayed by JBD2_FSYNC_DELAY so that its fsyncs are batched.
+ */
+#define JBD2_FSYNC_STREAK	4
+#define JBD2_FSYNC_WINDOW	(HZ / 10)
+#define JBD2_FSYNC_DELAY	msecs_to_jiffies(4)
+
+/*
+ * Called before an fsync requests the commit of the running transaction
+ * @tid.  The commit is not delayed if the transaction has handles of other
+ * beancounters or if a commit is requested meanwhile, e.g. by an fsync of
+ * another beancounter.
+ */
+static void jbd2_fsync_batch(journal_t *journal, tid_t tid)
+{
+	struct user_beancounter *ub = get_exec_ub_top();
+	transaction_t *transaction;
+	int batch = 0;
+
+	spin_lock(&journal->j_state_lock);
+	if (journal->j_fsync_ub != ub ||
+	    time_after(jiffies, journal->j_fsync_stamp + JBD2_FSYNC_WINDOW)) {
+		journal->j_fsync_ub = ub;
+		journal->j_fsync_streak = 0;
+	} else if (journal->j_fsync_streak < JBD2_FSYNC_STREAK)
+		journal->j_fsync_streak++;
+	journal->j_fsync_stamp = jiffies;
+
+	transaction = journal->j_running_transaction;
+	if (journal->j_fsync_streak >= JBD2_FSYNC_STREAK &&
+	    transaction && transaction->t_tid == tid &&
+	    transaction->t_ub == ub && !transaction->t_ub_shared) {
+		journal->j_fsync_batched++;
+		batch = 1;
+	}
+	spin_unlock(&journal->j_state_lock);
+
+	if (batch)
+		wait_event_timeout(journal->j_wait_commit,
+				tid_geq(journal->j_commit_request, tid),
+				JBD2_FSYNC_DELAY);
+}
+
 /*
  * When this function returns the transaction corresponding to tid
  * will be completed.  If the transaction has currently running, start
@@ -667,6 +713,7 @@ int jbd2_complete_transaction(journal_t *journal, tid_t tid)
 		if (journal->j_commit_request != tid) {
 			/* transaction not yet started, so request it */
 			spin_unlock(&journal->j_state_lock);
+			jbd2_fsync_batch(journal, tid);
 			jbd2_log_start_commit(journal, tid);
 			goto wait_commit;
 		}
@@ -809,6 +856,8 @@ static int jbd2_seq_info_show(struct seq_file *seq, void *v)
 	    s->stats->run.rs_blocks / s->stats->ts_tid);
 	seq_printf(seq, "  %lu logged blocks per transaction\n",
 	    s->stats->run.rs_blocks_logged / s->stats->ts_tid);
+	seq_printf(seq, "%lu fsync commits delayed for batching\n",
+	    s->journal->j_fsync_batched);
 	return 0;
 }
 
@@ -27,6 +27,7 @@
 #include <linux/highmem.h>
 #include <linux/hrtimer.h>
 #include <linux/virtinfo.h>
+#include <bc/beancounter.h>
 
 static void __jbd2_journal_temp_unlink_buffer(struct journal_head *jh);
 static void __jbd2_journal_unfile_buffer(struct journal_head *jh);
@@ -234,6 +235,10 @@ repeat_locked:
 	}
 
 	handle->h_transaction = transaction;
+	if (transaction->t_ub == NULL)
+		transaction->t_ub = get_exec_ub_top();
+	else if (transaction->t_ub != get_exec_ub_top())
+		transaction->t_ub_shared = 1;
 	transaction->t_outstanding_credits += nblocks;
 	transaction->t_updates++;
 	transaction->t_handle_count++;
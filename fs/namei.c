@@ -395,6 +395,10 @@ int get_write_access(struct inode * inode)
 	atomic_inc(&inode->i_writecount);
 	spin_unlock(&inode->i_lock);
 
+	/* the file may change, pramcache must not load saved pages any more */
+	if (unlikely(test_bit(AS_PRAMCACHE, &inode->i_mapping->flags)))
+		clear_bit(AS_PRAMCACHE, &inode->i_mapping->flags);
+
 	return 0;
 }
 
@@ -732,15 +736,15 @@ int follow_up(struct path *path)
 {
 	struct vfsmount *parent;
 	struct dentry *mountpoint;
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	parent = path->mnt->mnt_parent;
 	if (parent == path->mnt) {
-		spin_unlock(&vfsmount_lock);
+		br_read_unlock(vfsmount_lock);
 		return 0;
 	}
 	mntget(parent);
 	mountpoint = dget(path->mnt->mnt_mountpoint);
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 	dput(path->dentry);
 	path->dentry = mountpoint;
 	mntput(path->mnt);
@@ -1000,25 +1004,23 @@ static __always_inline int follow_dotdot(struct nameidata *nd)
 			break;
 		}
 #endif
-		spin_lock(&dcache_lock);
 		if (nd->path.dentry != nd->path.mnt->mnt_root) {
-			nd->path.dentry = dget(nd->path.dentry->d_parent);
-			spin_unlock(&dcache_lock);
+			/* d_move() changes d_parent under d_lock as well */
+			nd->path.dentry = dget_parent(nd->path.dentry);
 			dput(old);
 			if (unlikely(!path_connected(&nd->path)))
 				return -ENOENT;
 			break;
 		}
-		spin_unlock(&dcache_lock);
-		spin_lock(&vfsmount_lock);
+		br_read_lock(vfsmount_lock);
 		parent = nd->path.mnt->mnt_parent;
 		if (parent == nd->path.mnt) {
-			spin_unlock(&vfsmount_lock);
+			br_read_unlock(vfsmount_lock);
 			break;
 		}
 		mntget(parent);
 		nd->path.dentry = dget(nd->path.mnt->mnt_mountpoint);
-		spin_unlock(&vfsmount_lock);
+		br_read_unlock(vfsmount_lock);
 		dput(old);
 		mntput(nd->path.mnt);
 		nd->path.mnt = parent;
@@ -67,14 +67,14 @@ inline int is_nfs_automount(struct vfsmount *mnt)
 {
 	struct vfsmount *submnt;
 
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	list_for_each_entry(submnt, &nfs_automount_list, mnt_expire) {
 		if (mnt == submnt) {
-			spin_unlock(&vfsmount_lock);
+			br_read_unlock(vfsmount_lock);
 			return 1;
 		}
 	}
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 
 	return 0;
 }
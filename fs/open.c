@@ -31,6 +31,7 @@
 #include <linux/falloc.h>
 #include <linux/fs_struct.h>
 #include <linux/ima.h>
+#include <linux/page_replica.h>
 
 #include "internal.h"
 
@@ -670,6 +671,7 @@ static inline int __get_file_write_access(struct inode *inode,
 	error = get_write_access(inode);
 	if (error)
 		return error;
+	page_replica_collapse(inode->i_mapping);
 	/*
 	 * Do not take mount writer counts on
 	 * special files since no writes to
@@ -188,21 +188,27 @@ static void iov_fault_in_pages_read(struct iovec *iov, unsigned long len)
 	}
 }
 
-static void anon_pipe_buf_release(struct pipe_inode_info *pipe,
-				  struct pipe_buffer *buf)
+/*
+ * If nobody else uses this page, and the cache of the pipe is not full,
+ * keep it for the next write into the pipe. A writer streaming through the
+ * pipe then reuses the pages the reader has just released instead of
+ * going to the page allocator for every one of them. Cached pages stay
+ * charged to the beancounter that allocated them.
+ */
+void pipe_recycle_page(struct pipe_inode_info *pipe, struct page *page)
 {
-	struct page *page = buf->page;
-
-	/*
-	 * If nobody else uses this page, and we don't already have a
-	 * temporary page, let's keep track of it as a one-deep
-	 * allocation cache. (Otherwise just release our reference to it)
-	 */
-	if (page_count(page) == 1 && !pipe->tmp_page)
-		pipe->tmp_page = page;
+	if (page_count(page) == 1 && pipe->nr_tmp_pages < PIPE_TMP_PAGES)
+		pipe->tmp_page[pipe->nr_tmp_pages++] = page;
 	else
 		page_cache_release(page);
 }
+EXPORT_SYMBOL_GPL(pipe_recycle_page);
+
+static void anon_pipe_buf_release(struct pipe_inode_info *pipe,
+				  struct pipe_buffer *buf)
+{
+	pipe_recycle_page(pipe, buf->page);
+}
 
 /**
  * generic_pipe_buf_map - virtually map a pipe buffer
@@ -535,19 +541,21 @@ redo1:
 		if (bufs < PIPE_BUFFERS) {
 			int newbuf = (pipe->curbuf + bufs) & (PIPE_BUFFERS-1);
 			struct pipe_buffer *buf = pipe->bufs + newbuf;
-			struct page *page = pipe->tmp_page;
+			struct page *page = NULL;
 			char *src;
 			int error, atomic = 1;
 			int offset = 0;
 			size_t remaining;
 
-			if (!page) {
+			if (pipe->nr_tmp_pages)
+				page = pipe->tmp_page[pipe->nr_tmp_pages - 1];
+			else {
 				page = alloc_page(GFP_HIGHUSER | __GFP_UBC);
 				if (unlikely(!page)) {
 					ret = ret ? : -ENOMEM;
 					break;
 				}
-				pipe->tmp_page = page;
+				pipe->tmp_page[pipe->nr_tmp_pages++] = page;
 			}
 			/* Always wake up, even if the copy fails. Otherwise
 			 * we lock up (O_NONBLOCK-)readers that sleep due to
@@ -591,7 +599,7 @@ redo2:
 			buf->offset = 0;
 			buf->len = chars;
 			pipe->nrbufs = ++bufs;
-			pipe->tmp_page = NULL;
+			pipe->nr_tmp_pages--;
 
 			total_len -= chars;
 			if (!total_len)
@@ -915,8 +923,8 @@ void __free_pipe_info(struct pipe_inode_info *pipe)
 		if (buf->ops)
 			buf->ops->release(pipe, buf);
 	}
-	if (pipe->tmp_page)
-		__free_page(pipe->tmp_page);
+	for (i = 0; i < pipe->nr_tmp_pages; i++)
+		__free_page(pipe->tmp_page[i]);
 	kfree(pipe);
 }
 
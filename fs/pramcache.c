@@ -6,6 +6,7 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/kobject.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/mm.h>
@@ -30,14 +31,81 @@ static int pramcache_feature_nosync;
 #define PRAMCACHE_BDEV_CACHE	"bdev_cache"
 
 #define PRAMCACHE_MAGIC		0x70667363
-#define PRAMCACHE_VERSION	3
+#define PRAMCACHE_VERSION	4
 
 #define PRAMCACHE_FHANDLE_MAX	256
 
+/* version 3 has no nr_streams and is always saved to a single stream */
 struct pramcache_header {
 	__u32 magic;
 	__u32 version;
 	__u32 mnt_count;
+	__u32 nr_streams;
+};
+#define PRAMCACHE_HEADER_V3_SIZE	offsetof(struct pramcache_header, nr_streams)
+
+/*
+ * Page cache is saved by up to PRAMCACHE_MAX_THREADS threads, each to its
+ * own pair of streams: "page_cache" for the first one, "page_cache.N" for
+ * others. Inodes are handed out to the threads in batches, and the streams
+ * are loaded in parallel as well.
+ */
+#define PRAMCACHE_MAX_THREADS	16
+#define PRAMCACHE_BATCH		64
+#define PRAMCACHE_NAME_MAX	32
+
+static int pramcache_threads;	/* 0 - one per online cpu */
+
+/*
+ * Inodes are saved, and so loaded, in passes by rank, see inode_rank()
+ */
+#define PRAMCACHE_ORDER_EXEC	0x1	/* executables and libraries first */
+#define PRAMCACHE_ORDER_LARGE	0x2	/* then large files, e.g. databases */
+static int pramcache_load_order;
+
+#define PRAMCACHE_LARGE_SIZE	(64ULL << 20)
+
+#define PRAMCACHE_RANK_EXEC	0
+#define PRAMCACHE_RANK_LARGE	1
+#define PRAMCACHE_RANK_REST	2
+
+struct pramcache_batch {
+	struct list_head list;
+	int nr;
+	struct inode *inodes[PRAMCACHE_BATCH];
+};
+
+struct pramcache_save_ctl;
+
+struct pramcache_saver {
+	struct pramcache_save_ctl *ctl;
+	struct pram_stream meta_stream, data_stream;
+	int first;
+	void *buf;
+};
+
+struct pramcache_save_ctl {
+	int nosync;
+	spinlock_t lock;
+	struct list_head queue;		/* of batches */
+	int nr_queued;
+	int done;
+	wait_queue_head_t work_wait;
+	wait_queue_head_t space_wait;
+	atomic_t nr_running;
+	struct completion finished;
+	int nr_streams;
+	int nr_threads;			/* 0 - saving in the caller */
+	struct pramcache_saver saver[PRAMCACHE_MAX_THREADS];
+};
+
+struct pramcache_loader {
+	struct super_block *sb;
+	int index;
+	int started;
+	long ret;
+	struct list_head *deferred;
+	struct completion done;
 };
 
 struct page_state {
@@ -88,6 +156,23 @@ static char *pramcache_pram_basename(struct super_block *sb,
 	return buf;
 }
 
+static char *pramcache_stream_name(char *buf, int index)
+{
+	if (!index)
+		strlcpy(buf, PRAMCACHE_PAGE_CACHE, PRAMCACHE_NAME_MAX);
+	else
+		snprintf(buf, PRAMCACHE_NAME_MAX, "%s.%d",
+			 PRAMCACHE_PAGE_CACHE, index);
+	return buf;
+}
+
+static int pramcache_nr_threads(void)
+{
+	int nr = pramcache_threads ? : num_online_cpus();
+
+	return clamp(nr, 1, PRAMCACHE_MAX_THREADS);
+}
+
 /*
  * Meta and data streams must be opened and closed atomically, otherwise we can
  * get a data storage without corresponding meta storage, which will lead to
@@ -399,10 +484,80 @@ static void save_invalidate_mapping_pages(struct address_space *mapping,
 	}
 }
 
+/*
+ * Lazy load (fs.pramcache.lazy): at mount, only dirty pages, which are newer
+ * than the disk, are inserted into page cache. Clean ones are popped from
+ * pram to per-inode lists and inserted by a low priority thread afterwards,
+ * so that the filesystem is usable at once. A page read from disk meanwhile
+ * wins and the saved copy is dropped. Once the file is given write access
+ * (write, direct IO and truncate all need it), the saved copies may be
+ * stale: get_write_access() clears AS_PRAMCACHE, and the thread, which
+ * inserts under i_mutex, drops the rest of the inode's pages. Umount stops
+ * the thread, see pramcache_cancel_load().
+ */
+static int pramcache_lazy;
+
+struct lazy_page {
+	struct page *page;
+	struct page_state state;
+};
+
+#define LAZY_CHUNK_SIZE \
+	((PAGE_SIZE - sizeof(long) - sizeof(struct list_head)) / \
+	 sizeof(struct lazy_page))
+
+struct lazy_chunk {
+	struct list_head list;
+	long nr;
+	struct lazy_page pages[LAZY_CHUNK_SIZE];
+};
+
+struct lazy_inode {
+	struct list_head list;
+	struct dentry *dentry;
+	loff_t filesize;
+	long nr_pages;
+	struct list_head chunks;
+};
+
+struct pramcache_lazy {
+	struct list_head list;		/* in lazy_loads */
+	struct super_block *sb;
+	struct list_head inodes;
+	int abort;
+	struct completion done;		/* for pramcache_cancel_load() */
+};
+
+static LIST_HEAD(lazy_loads);
+static DEFINE_MUTEX(lazy_mutex);
+
+static int lazy_add_page(struct lazy_inode *li, struct page *page,
+			 struct page_state *state)
+{
+	struct lazy_chunk *chunk = NULL;
+
+	if (!list_empty(&li->chunks))
+		chunk = list_entry(li->chunks.prev, struct lazy_chunk, list);
+	if (!chunk || chunk->nr == LAZY_CHUNK_SIZE) {
+		chunk = kmalloc(sizeof(*chunk), GFP_KERNEL);
+		if (!chunk)
+			return -ENOMEM;
+		chunk->nr = 0;
+		list_add_tail(&chunk->list, &li->chunks);
+	}
+	chunk->pages[chunk->nr].page = page;
+	chunk->pages[chunk->nr].state = *state;
+	chunk->nr++;
+	li->nr_pages++;
+	return 0;
+}
+
+/* clean pages are deferred to @li if it is given */
 static long load_mapping_pages(struct address_space *mapping,
 			       loff_t filesize,
 			       struct pram_stream *meta_stream,
-			       struct pram_stream *data_stream)
+			       struct pram_stream *data_stream,
+			       struct lazy_inode *li)
 {
 	struct page_state state;
 	struct page *page;
@@ -416,6 +571,15 @@ next:
 	if (IS_ERR(page))
 		return PTR_ERR(page);
 
+	if (li && !(state.flags & PAGE_STATE_DIRTY)) {
+		err = lazy_add_page(li, page, &state);
+		if (err) {
+			put_page(page);
+			return err;
+		}
+		goto next;
+	}
+
 	err = insert_page(mapping, filesize, page, &state);
 	if (err)
 		return err;
@@ -475,11 +639,30 @@ invalidate:
 	invalidate_mapping_pages(&inode->i_data, 0, ~0UL);
 }
 
+static void lazy_free_inode(struct lazy_inode *li)
+{
+	struct lazy_chunk *chunk, *tmp;
+	long i;
+
+	list_for_each_entry_safe(chunk, tmp, &li->chunks, list) {
+		for (i = 0; i < chunk->nr; i++)
+			if (chunk->pages[i].page)
+				put_page(chunk->pages[i].page);
+		kfree(chunk);
+	}
+	if (li->dentry)
+		dput_nocache(li->dentry, 1);
+	kfree(li);
+}
+
+/* with @deferred, clean pages are put to a lazy_inode added to the list */
 static long load_inode(struct super_block *sb,
 		       void *buf, size_t bufsize,
 		       struct pram_stream *meta_stream,
-		       struct pram_stream *data_stream)
+		       struct pram_stream *data_stream,
+		       struct list_head *deferred)
 {
+	struct lazy_inode *li = NULL;
 	struct file_handle *handle;
 	struct dentry *dentry;
 	__u64 filesize;
@@ -513,8 +696,26 @@ static long load_inode(struct super_block *sb,
 		      sizeof(filesize)) != sizeof(filesize))
 		goto out_dput;
 
+	if (deferred) {
+		err = -ENOMEM;
+		li = kzalloc(sizeof(*li), GFP_KERNEL);
+		if (!li)
+			goto out_dput;
+		INIT_LIST_HEAD(&li->chunks);
+		li->filesize = filesize;
+	}
+
 	err = load_mapping_pages(&dentry->d_inode->i_data, filesize,
-				 meta_stream, data_stream);
+				 meta_stream, data_stream, li);
+	if (li) {
+		if (err >= 0 && li->nr_pages) {
+			set_bit(AS_PRAMCACHE, &dentry->d_inode->i_mapping->flags);
+			li->dentry = dentry;
+			list_add_tail(&li->list, deferred);
+			return err;
+		}
+		lazy_free_inode(li);
+	}
 out_dput:
 	dput_nocache(dentry, 1);
 out:
@@ -522,7 +723,7 @@ out:
 }
 
 static int save_header(struct super_block *sb,
-		       struct pram_stream *stream)
+		       struct pram_stream *stream, int nr_streams)
 {
 	struct pramcache_header hdr;
 	int err;
@@ -530,6 +731,7 @@ static int save_header(struct super_block *sb,
 	hdr.magic = PRAMCACHE_MAGIC;
 	hdr.version = PRAMCACHE_VERSION;
 	hdr.mnt_count = sb->s_mnt_count;
+	hdr.nr_streams = nr_streams;
 
 	err = pram_prealloc(GFP_KERNEL | __GFP_HIGHMEM, sizeof(hdr));
 	if (!err) {
@@ -540,11 +742,12 @@ static int save_header(struct super_block *sb,
 }
 
 static int check_header(struct super_block *sb,
-			struct pram_stream *stream)
+			struct pram_stream *stream, int *nr_streams)
 {
 	struct pramcache_header hdr;
 
-	if (pram_read(stream, &hdr, sizeof(hdr)) != sizeof(hdr))
+	if (pram_read(stream, &hdr, PRAMCACHE_HEADER_V3_SIZE) !=
+	    PRAMCACHE_HEADER_V3_SIZE)
 		return -EIO;
 
 	if (hdr.magic != PRAMCACHE_MAGIC) {
@@ -552,11 +755,23 @@ static int check_header(struct super_block *sb,
 		return -EINVAL;
 	}
 
-	if (hdr.version != PRAMCACHE_VERSION) {
+	if (hdr.version == 3)
+		hdr.nr_streams = 1;
+	else if (hdr.version != PRAMCACHE_VERSION) {
 		pramcache_msg(sb, KERN_ERR, "bad version (%d)",
 			      (int)hdr.version);
 		return -EINVAL;
+	} else if (pram_read(stream, &hdr.nr_streams,
+			     sizeof(hdr.nr_streams)) != sizeof(hdr.nr_streams))
+		return -EIO;
+
+	if (hdr.nr_streams < 1 || hdr.nr_streams > PRAMCACHE_MAX_THREADS) {
+		pramcache_msg(sb, KERN_ERR, "bad number of streams (%u)",
+			      hdr.nr_streams);
+		return -EINVAL;
 	}
+	if (nr_streams)
+		*nr_streams = hdr.nr_streams;
 
 	if (!(sb->s_flags & MS_RDONLY))
 		hdr.mnt_count++;
@@ -603,27 +818,89 @@ out:
 	}
 }
 
-static void save_invalidate_page_cache(struct super_block *sb, int nosync)
+static int inode_rank(struct inode *inode, int order)
 {
-	struct pram_stream meta_stream, data_stream;
-	struct inode *inode, *old_inode = NULL;
-	int first = 1;
-	void *buf;
-	int err;
+	if ((order & PRAMCACHE_ORDER_EXEC) &&
+	    S_ISREG(inode->i_mode) && (inode->i_mode & S_IXUGO))
+		return PRAMCACHE_RANK_EXEC;
+	if ((order & PRAMCACHE_ORDER_LARGE) &&
+	    i_size_read(inode) >= PRAMCACHE_LARGE_SIZE)
+		return PRAMCACHE_RANK_LARGE;
+	return PRAMCACHE_RANK_REST;
+}
 
-	err = open_streams(sb, PRAMCACHE_PAGE_CACHE, PRAM_WRITE,
-			   &meta_stream, &data_stream);
-	if (err)
-		goto out;
+static void save_batch(struct pramcache_saver *s, struct pramcache_batch *b)
+{
+	int i;
 
-	err = save_header(sb, &meta_stream);
-	if (err)
-		goto out_close_streams;
+	for (i = 0; i < b->nr; i++) {
+		save_invalidate_inode(b->inodes[i], &s->first, s->ctl->nosync,
+				      s->buf, PRAMCACHE_FHANDLE_MAX,
+				      &s->meta_stream, &s->data_stream);
+		iput(b->inodes[i]);
+	}
+	kfree(b);
+}
 
-	err = -ENOMEM;
-	buf = kmalloc(PRAMCACHE_FHANDLE_MAX, GFP_KERNEL);
-	if (!buf)
-		goto out_close_streams;
+static int pramcache_save_thread(void *data)
+{
+	struct pramcache_saver *s = data;
+	struct pramcache_save_ctl *ctl = s->ctl;
+	struct pramcache_batch *b;
+
+	for (;;) {
+		wait_event(ctl->work_wait, ctl->nr_queued || ctl->done);
+
+		spin_lock(&ctl->lock);
+		if (list_empty(&ctl->queue)) {
+			spin_unlock(&ctl->lock);
+			if (ctl->done)
+				break;
+			continue;
+		}
+		b = list_entry(ctl->queue.next, struct pramcache_batch, list);
+		list_del(&b->list);
+		ctl->nr_queued--;
+		spin_unlock(&ctl->lock);
+		wake_up(&ctl->space_wait);
+
+		save_batch(s, b);
+	}
+
+	if (atomic_dec_and_test(&ctl->nr_running))
+		complete(&ctl->finished);
+	return 0;
+}
+
+static void queue_batch(struct pramcache_save_ctl *ctl,
+			struct pramcache_batch *b)
+{
+	if (!ctl->nr_threads) {
+		save_batch(&ctl->saver[0], b);
+		return;
+	}
+
+	/* do not pin more inodes than the threads can take soon */
+	wait_event(ctl->space_wait, ctl->nr_queued < 2 * ctl->nr_threads);
+
+	spin_lock(&ctl->lock);
+	list_add_tail(&b->list, &ctl->queue);
+	ctl->nr_queued++;
+	spin_unlock(&ctl->lock);
+	wake_up(&ctl->work_wait);
+}
+
+static int save_inodes(struct super_block *sb, struct pramcache_save_ctl *ctl,
+		       int rank, int order)
+{
+	struct inode *inode, *old_inode = NULL;
+	struct pramcache_batch *b;
+	int err = 0;
+
+	b = kmalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	b->nr = 0;
 
 	spin_lock(&inode_lock);
 	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
@@ -633,6 +910,15 @@ static void save_invalidate_page_cache(struct super_block *sb, int nosync)
 			continue;
 		if (!inode->i_data.nrpages)
 			continue;
+		if (inode_rank(inode, order) != rank)
+			continue;
+		__iget(inode);
+		b->inodes[b->nr++] = inode;
+		if (b->nr < PRAMCACHE_BATCH)
+			continue;
+
+		/* The batch reference is dropped by whoever saves the inode,
+		 * so take one more to continue the walk from. */
 		__iget(inode);
 		spin_unlock(&inode_lock);
 
@@ -644,19 +930,106 @@ static void save_invalidate_page_cache(struct super_block *sb, int nosync)
 		iput(old_inode);
 		old_inode = inode;
 
-		save_invalidate_inode(inode, &first, nosync,
-				      buf, PRAMCACHE_FHANDLE_MAX,
-				      &meta_stream, &data_stream);
+		queue_batch(ctl, b);
+
+		b = kmalloc(sizeof(*b), GFP_KERNEL);
+		if (!b) {
+			err = -ENOMEM;
+			goto out;
+		}
+		b->nr = 0;
 
 		spin_lock(&inode_lock);
 	}
 	spin_unlock(&inode_lock);
+
+	if (b->nr)
+		queue_batch(ctl, b);
+	else
+		kfree(b);
+out:
 	iput(old_inode);
-	err = 0;
+	return err;
+}
+
+static void save_invalidate_page_cache(struct super_block *sb, int nosync)
+{
+	struct pramcache_save_ctl *ctl;
+	struct pramcache_saver *s;
+	struct task_struct *tsk;
+	char name[PRAMCACHE_NAME_MAX];
+	int i, nr, rank, order;
+	int err = -ENOMEM;
+
+	ctl = kzalloc(sizeof(*ctl), GFP_KERNEL);
+	if (!ctl)
+		goto out;
+
+	ctl->nosync = nosync;
+	spin_lock_init(&ctl->lock);
+	INIT_LIST_HEAD(&ctl->queue);
+	init_waitqueue_head(&ctl->work_wait);
+	init_waitqueue_head(&ctl->space_wait);
+	atomic_set(&ctl->nr_running, 1);
+	init_completion(&ctl->finished);
+
+	nr = pramcache_nr_threads();
+	for (i = 0; i < nr; i++) {
+		s = &ctl->saver[i];
+		s->ctl = ctl;
+		s->first = 1;
+		err = -ENOMEM;
+		s->buf = kmalloc(PRAMCACHE_FHANDLE_MAX, GFP_KERNEL);
+		if (!s->buf)
+			break;
+		err = open_streams(sb, pramcache_stream_name(name, i),
+				   PRAM_WRITE, &s->meta_stream, &s->data_stream);
+		if (err) {
+			kfree(s->buf);
+			break;
+		}
+	}
+	/* failing to open extra streams only makes saving slower */
+	ctl->nr_streams = i;
+	if (!ctl->nr_streams)
+		goto out_free;
+
+	for (i = 0; i < ctl->nr_streams; i++) {
+		err = save_header(sb, &ctl->saver[i].meta_stream,
+				  ctl->nr_streams);
+		if (err)
+			goto out_close_streams;
+	}
+
+	for (i = 0; ctl->nr_streams > 1 && i < ctl->nr_streams; i++) {
+		tsk = kthread_run(pramcache_save_thread, &ctl->saver[i],
+				  "pramcache/%d", i);
+		if (IS_ERR(tsk))
+			break;
+		atomic_inc(&ctl->nr_running);
+		ctl->nr_threads++;
+	}
+
+	order = pramcache_load_order;
+	rank = order ? PRAMCACHE_RANK_EXEC : PRAMCACHE_RANK_REST;
+	for (; !err && rank <= PRAMCACHE_RANK_REST; rank++)
+		err = save_inodes(sb, ctl, rank, order);
+
+	spin_lock(&ctl->lock);
+	ctl->done = 1;
+	spin_unlock(&ctl->lock);
+	wake_up_all(&ctl->work_wait);
+	if (!atomic_dec_and_test(&ctl->nr_running))
+		wait_for_completion(&ctl->finished);
 
-	kfree(buf);
 out_close_streams:
-	close_streams(&meta_stream, &data_stream, err);
+	for (i = 0; i < ctl->nr_streams; i++) {
+		s = &ctl->saver[i];
+		close_streams(&s->meta_stream, &s->data_stream, err);
+		kfree(s->buf);
+	}
+out_free:
+	kfree(ctl);
 out:
 	if (err)
 		pramcache_msg(sb, KERN_ERR,
@@ -669,11 +1042,213 @@ out:
 	}
 }
 
-void pramcache_load_page_cache(struct super_block *sb)
+static long load_page_cache_stream(struct super_block *sb,
+				   struct pram_stream *meta_stream,
+				   struct pram_stream *data_stream,
+				   struct list_head *deferred)
 {
-	struct pram_stream meta_stream, data_stream;
 	long ret, loaded = 0;
 	void *buf;
+
+	buf = kmalloc(PRAMCACHE_FHANDLE_MAX, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	for (;;) {
+		ret = load_inode(sb, buf, PRAMCACHE_FHANDLE_MAX,
+				 meta_stream, data_stream, deferred);
+		if (ret < 0)
+			break;
+		loaded += ret;
+	}
+
+	kfree(buf);
+	return ret == -ENODATA ? loaded : ret;
+}
+
+/* loads and destroys one of extra streams, @index > 0 */
+static long load_extra_stream(struct super_block *sb, int index,
+			      struct list_head *deferred)
+{
+	struct pram_stream meta_stream, data_stream;
+	char name[PRAMCACHE_NAME_MAX];
+	long ret;
+
+	ret = open_streams(sb, pramcache_stream_name(name, index), PRAM_READ,
+			   &meta_stream, &data_stream);
+	if (ret)
+		return ret;
+
+	ret = check_header(sb, &meta_stream, NULL);
+	if (!ret)
+		ret = load_page_cache_stream(sb, &meta_stream, &data_stream,
+					     deferred);
+
+	close_streams(&meta_stream, &data_stream, 0);
+	return ret;
+}
+
+static int pramcache_load_thread(void *data)
+{
+	struct pramcache_loader *l = data;
+
+	l->ret = load_extra_stream(l->sb, l->index, l->deferred);
+	complete(&l->done);
+	return 0;
+}
+
+/* extra streams left from a save nobody has loaded would leak pram */
+static void drop_extra_streams(struct super_block *sb, int from)
+{
+	struct pram_stream meta_stream, data_stream;
+	char name[PRAMCACHE_NAME_MAX];
+	int i;
+
+	for (i = max(from, 1); i < PRAMCACHE_MAX_THREADS; i++)
+		if (!open_streams(sb, pramcache_stream_name(name, i),
+				  PRAM_READ, &meta_stream, &data_stream))
+			close_streams(&meta_stream, &data_stream, 0);
+}
+
+static long lazy_insert_inode(struct pramcache_lazy *lazy,
+			      struct lazy_inode *li)
+{
+	struct inode *inode = li->dentry->d_inode;
+	struct address_space *mapping = inode->i_mapping;
+	struct lazy_chunk *chunk;
+	struct lazy_page *lp;
+	long i, loaded = 0;
+
+	list_for_each_entry(chunk, &li->chunks, list) {
+		for (i = 0; i < chunk->nr; i++) {
+			if (ACCESS_ONCE(lazy->abort))
+				goto out;
+			lp = &chunk->pages[i];
+			mutex_lock(&inode->i_mutex);
+			if (!test_bit(AS_PRAMCACHE, &mapping->flags)) {
+				/* modified since mount, the rest is freed */
+				mutex_unlock(&inode->i_mutex);
+				goto out;
+			}
+			if ((loff_t)lp->state.index << PAGE_CACHE_SHIFT >=
+							i_size_read(inode))
+				put_page(lp->page);
+			else if (!insert_page(mapping, li->filesize,
+					      lp->page, &lp->state))
+				loaded++;
+			mutex_unlock(&inode->i_mutex);
+			/* insert_page() consumed the reference */
+			lp->page = NULL;
+			cond_resched();
+		}
+	}
+out:
+	clear_bit(AS_PRAMCACHE, &mapping->flags);
+	return loaded;
+}
+
+static int pramcache_lazy_thread(void *data)
+{
+	struct pramcache_lazy *lazy = data;
+	struct lazy_inode *li, *tmp;
+	long loaded = 0;
+	int cancelled;
+
+	set_user_nice(current, 19);
+
+	list_for_each_entry_safe(li, tmp, &lazy->inodes, list) {
+		loaded += lazy_insert_inode(lazy, li);
+		list_del(&li->list);
+		lazy_free_inode(li);
+	}
+
+	if (!lazy->abort)
+		pramcache_msg(lazy->sb, KERN_INFO,
+			      "loaded deferred page cache (%ld pages)", loaded);
+
+	mutex_lock(&lazy_mutex);
+	cancelled = list_empty(&lazy->list);
+	list_del_init(&lazy->list);
+	mutex_unlock(&lazy_mutex);
+
+	if (cancelled)
+		complete(&lazy->done);
+	else
+		kfree(lazy);
+	return 0;
+}
+
+static void start_lazy_load(struct super_block *sb, struct list_head *deferred)
+{
+	struct pramcache_lazy *lazy;
+	struct lazy_inode *li, *tmp;
+	struct task_struct *tsk;
+
+	lazy = kzalloc(sizeof(*lazy), GFP_KERNEL);
+	if (!lazy) {
+		list_for_each_entry_safe(li, tmp, deferred, list)
+			lazy_free_inode(li);
+		return;
+	}
+	lazy->sb = sb;
+	INIT_LIST_HEAD(&lazy->inodes);
+	list_splice(deferred, &lazy->inodes);
+	init_completion(&lazy->done);
+
+	mutex_lock(&lazy_mutex);
+	list_add(&lazy->list, &lazy_loads);
+	mutex_unlock(&lazy_mutex);
+
+	tsk = kthread_run(pramcache_lazy_thread, lazy, "pramcache_lazy");
+	if (IS_ERR(tsk))
+		pramcache_lazy_thread(lazy);
+}
+
+/*
+ * Must be called before the super block is shut down, since deferred
+ * inodes are pinned by dentry references.
+ */
+void pramcache_cancel_load(struct super_block *sb)
+{
+	struct pramcache_lazy *lazy;
+
+	for (;;) {
+		mutex_lock(&lazy_mutex);
+		list_for_each_entry(lazy, &lazy_loads, list)
+			if (lazy->sb == sb)
+				goto found;
+		mutex_unlock(&lazy_mutex);
+		return;
+found:
+		lazy->abort = 1;
+		list_del_init(&lazy->list);
+		mutex_unlock(&lazy_mutex);
+
+		wait_for_completion(&lazy->done);
+		kfree(lazy);
+	}
+}
+EXPORT_SYMBOL(pramcache_cancel_load);
+
+static long count_deferred(struct list_head *deferred)
+{
+	struct lazy_inode *li;
+	long nr = 0;
+
+	list_for_each_entry(li, deferred, list)
+		nr += li->nr_pages;
+	return nr;
+}
+
+void pramcache_load_page_cache(struct super_block *sb)
+{
+	struct pram_stream meta_stream, data_stream;
+	struct pramcache_loader *loaders = NULL;
+	struct task_struct *tsk;
+	LIST_HEAD(deferred);
+	struct list_head *lazy_list = NULL;
+	long ret, loaded = 0, nr_deferred = 0;
+	int i, nr = 1;
 	int err;
 
 	BUG_ON(!sb->s_bdev);
@@ -688,35 +1263,69 @@ void pramcache_load_page_cache(struct super_block *sb)
 	if (err)
 		goto out;
 
-	err = check_header(sb, &meta_stream);
+	err = check_header(sb, &meta_stream, &nr);
 	if (err)
 		goto out_close_streams;
 
-	err = -ENOMEM;
-	buf = kmalloc(PRAMCACHE_FHANDLE_MAX, GFP_KERNEL);
-	if (!buf)
-		goto out_close_streams;
+	if (pramcache_lazy)
+		lazy_list = &deferred;
+
+	if (nr > 1)
+		loaders = kcalloc(nr, sizeof(*loaders), GFP_KERNEL);
+	for (i = 1; loaders && i < nr; i++) {
+		loaders[i].sb = sb;
+		loaders[i].index = i;
+		init_completion(&loaders[i].done);
+		if (lazy_list) {
+			loaders[i].deferred = kmalloc(sizeof(struct list_head),
+						      GFP_KERNEL);
+			if (!loaders[i].deferred)
+				continue;
+			INIT_LIST_HEAD(loaders[i].deferred);
+		}
+		tsk = kthread_run(pramcache_load_thread, &loaders[i],
+				  "pramcache/%d", i);
+		loaders[i].started = !IS_ERR(tsk);
+	}
 
-next:
-	ret = load_inode(sb, buf, PRAMCACHE_FHANDLE_MAX,
-			 &meta_stream, &data_stream);
-	if (ret < 0) {
+	ret = load_page_cache_stream(sb, &meta_stream, &data_stream,
+				     lazy_list);
+	if (ret < 0)
 		err = ret;
-		if (err == -ENODATA)
-			err = 0;
-		goto out_free_buf;
+	else
+		loaded += ret;
+
+	for (i = 1; i < nr; i++) {
+		if (loaders && loaders[i].started) {
+			wait_for_completion(&loaders[i].done);
+			ret = loaders[i].ret;
+			if (loaders[i].deferred) {
+				list_splice(loaders[i].deferred, &deferred);
+				kfree(loaders[i].deferred);
+			}
+		} else
+			ret = load_extra_stream(sb, i, lazy_list);
+		if (ret < 0) {
+			if (!err)
+				err = ret;
+		} else
+			loaded += ret;
+	}
+	kfree(loaders);
+
+	if (!list_empty(&deferred)) {
+		nr_deferred = count_deferred(&deferred);
+		start_lazy_load(sb, &deferred);
 	}
-	loaded += ret;
-	goto next;
 
-out_free_buf:
-	kfree(buf);
 out_close_streams:
 	close_streams(&meta_stream, &data_stream, 0);
+	drop_extra_streams(sb, nr);
 out:
 	if (!err)
 		pramcache_msg(sb, KERN_INFO,
-			      "loaded page cache (%ld pages)", loaded);
+			      "loaded page cache (%ld pages, %ld deferred)",
+			      loaded, nr_deferred);
 	else if (err != -ENOENT)
 		pramcache_msg(sb, KERN_ERR,
 			      "Failed to load page cache: %d", err);
@@ -733,7 +1342,7 @@ static void save_invalidate_bdev_cache(struct super_block *sb)
 	if (err)
 		goto out;
 
-	err = save_header(sb, &meta_stream);
+	err = save_header(sb, &meta_stream, 1);
 	if (err)
 		goto out_close_streams;
 
@@ -766,12 +1375,12 @@ void pramcache_load_bdev_cache(struct super_block *sb)
 	if (err)
 		goto out;
 
-	err = check_header(sb, &meta_stream);
+	err = check_header(sb, &meta_stream, NULL);
 	if (err)
 		goto out_close_streams;
 
 	loaded = load_mapping_pages(sb->s_bdev->bd_inode->i_mapping, 0,
-				    &meta_stream, &data_stream);
+				    &meta_stream, &data_stream, NULL);
 	if (loaded < 0)
 		err = loaded;
 
@@ -862,6 +1471,27 @@ ctl_table pramcache_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec,
 	},
+	{
+		.procname	= "threads",
+		.data		= &pramcache_threads,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec,
+	},
+	{
+		.procname	= "load_order",
+		.data		= &pramcache_load_order,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec,
+	},
+	{
+		.procname	= "lazy",
+		.data		= &pramcache_lazy,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec,
+	},
 	{ .ctl_name = 0 }
 };
 #endif /* CONFIG_SYSCTL */
@@ -866,12 +866,12 @@ static unsigned mounts_poll(struct file *file, poll_table *wait)
 	get_mnt_poll(ns, &ppoll, &pevent);
 	poll_wait(file, ppoll, wait);
 
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	if (p->event != *pevent) {
 		p->event = *pevent;
 		res |= POLLERR | POLLPRI;
 	}
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 
 	return res;
 }
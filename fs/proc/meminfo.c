@@ -237,6 +237,9 @@ int meminfo_proc_show_ub(struct seq_file *m, void *v,
 #endif
 #ifdef CONFIG_MEMORY_VSWAP
 		"VirtualSwap:    %8lu kB\n"
+#endif
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+		"VirtualSwapPool:%8lu kB\n"
 #endif
 		"Active:         %8lu kB\n"
 		"Inactive:       %8lu kB\n"
@@ -295,6 +298,9 @@ int meminfo_proc_show_ub(struct seq_file *m, void *v,
 #endif
 #ifdef CONFIG_MEMORY_VSWAP
 		K(global_page_state(NR_VSWAP)),
+#endif
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+		K(global_page_state(NR_VSWAP_POOL)),
 #endif
 		K(pages[LRU_ACTIVE_ANON]   + pages[LRU_ACTIVE_FILE]),
 		K(pages[LRU_INACTIVE_ANON] + pages[LRU_INACTIVE_FILE]),
@@ -22,6 +22,8 @@
 #include <net/netlink.h>
 #include <net/genetlink.h>
 
+#include "../internal.h"
+
 /* Check validity of generic quotactl commands */
 static int generic_quotactl_valid(struct super_block *sb, int type, int cmd,
 				  qid_t id)
@@ -204,12 +206,13 @@ void sync_quota_sb(struct super_block *sb, int type)
 
 static void sync_dquots(int type)
 {
-	struct super_block *sb;
+	struct super_block *sb, *p = NULL;
 	int cnt;
 
 	spin_lock(&sb_lock);
-restart:
 	list_for_each_entry(sb, &super_blocks, s_list) {
+		if (list_empty(&sb->s_instances))
+			continue;
 		/* This test just improves performance so it needn't be
 		 * reliable... */
 		for (cnt = 0; cnt < MAXQUOTAS; cnt++) {
@@ -231,9 +234,12 @@ restart:
 			sync_quota_sb(sb, type);
 		up_read(&sb->s_umount);
 		spin_lock(&sb_lock);
-		if (__put_super_and_need_restart(sb))
-			goto restart;
+		if (p)
+			__put_super(p);
+		p = sb;
 	}
+	if (p)
+		__put_super(p);
 	spin_unlock(&sb_lock);
 }
 
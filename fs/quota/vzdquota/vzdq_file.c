@@ -653,7 +653,7 @@ static int vzdq_aquot_buildmntlist(struct ve_struct *ve,
 	get_fs_root(current->fs, &root)
 #endif
 	mnt = root.mnt;
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	while (1) {
 		list_for_each_entry(p, head, list) {
 			if (p->mnt->mnt_sb == mnt->mnt_sb)
@@ -685,7 +685,7 @@ skip:
 					struct vfsmount, mnt_child);
 	}
 out:
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 	path_put(&root);
 	return err;
 }
@@ -296,6 +296,42 @@ static int vzquota_read_file(struct inode *ino, struct vz_quota_kstat *qstat)
 	return 0;
 }
 
+/*
+ * Generations continue from the record left by previous quota on. The
+ * record is kept for VZ_DQ_GETCKPT, a file without one predates the
+ * checkpoints and was written through, so it counts as clean.
+ */
+static void vzquota_read_ckpt(struct vz_quota_master *qmblk, struct inode *ino)
+{
+	struct vz_quota_ckpt_stat *found = &qmblk->dq_ckpt_found;
+	struct vz_quota_ckpt_img img;
+	struct super_block *sb = ino->i_sb;
+	ssize_t size;
+
+	memset(found, 0, sizeof(*found));
+	found->state = VZQUOTA_CKPT_CLEAN;
+
+	size = sb->s_op->quota_read_ino(sb, ino,
+			(char *)&img, sizeof(img), VZQUOTA_CKPT_OFF);
+	if (size != sizeof(img) ||
+			le32_to_cpu(img.magic) != VZQUOTA_CKPT_MAGIC)
+		return;
+
+	found->state = le32_to_cpu(img.state);
+	found->generation = le64_to_cpu(img.generation);
+	found->ckpt_time = le64_to_cpu(img.ckpt_time);
+	qmblk->dq_ckpt_gen = found->generation;
+	if (found->state != VZQUOTA_CKPT_CLEAN)
+		printk(KERN_WARNING "vzdq: quota file %u of dev %s wasn't "
+				"closed, usage is as of %llu\n", qmblk->dq_id,
+				sb->s_id, (unsigned long long)found->ckpt_time);
+}
+
+static int vzquota_write_file(struct vz_quota_master *qmblk,
+		struct inode *ino, struct vz_quota_ugid **ugid);
+static int vzquota_checkpoint(struct vz_quota_master *qmblk,
+		struct inode *ino, unsigned int state);
+
 static int vzquota_on_file(unsigned int quota_id, const char __user *quota_root,
 					char __user *buf)
 {
@@ -348,12 +384,16 @@ static int vzquota_on_file(unsigned int quota_id, const char __user *quota_root,
 	ret = vzquota_read_ugid(qmblk, ino);
 	if (ret)
 		goto out_kill_qmblk;
+	vzquota_read_ckpt(qmblk, ino);
 
 	ret = __vzquota_on(qmblk, &path, &dqsb, buf);
 	if (ret)
 		goto out_kill_qmblk;
 
 	qmblk->qfile = ino;
+	if (vzquota_checkpoint(qmblk, ino, VZQUOTA_CKPT_DIRTY))
+		printk(KERN_ERR "vzdq: error writing quota checkpoint, "
+				"dev %s\n", ino->i_sb->s_id);
 	mutex_unlock(&vz_quota_mutex);
 	return 0;
 
@@ -433,6 +473,8 @@ void vzquota_off_cookies(struct super_block *sb)
 {
 	int i;
 	struct vz_quota_master *qmblk;
+	struct inode *qfile;
+	struct vz_quota_ugid *no_ugids[2] = { NULL, NULL };
 
 	vzquota_cur_qmblk_orphan_set(NULL);
 again:
@@ -446,9 +488,15 @@ again:
 
 			list_del_init(&qmblk->dq_hash);
 			vzquota_put_super(qmblk->dq_sb);
+			qfile = qmblk->qfile;
+			qmblk->qfile = NULL;
 			mutex_unlock(&vz_quota_mutex);
 
-			iput(qmblk->qfile);
+			/* keep the checkpoint state, it is for quota on */
+			cancel_delayed_work_sync(&qmblk->dq_ckpt_work);
+			if (test_and_clear_bit(0, &qmblk->dq_ckpt_dirty))
+				vzquota_write_file(qmblk, qfile, no_ugids);
+			iput(qfile);
 			qmblk_put(qmblk);
 
 			goto again;
@@ -506,6 +554,7 @@ static int vzquota_write_file(struct vz_quota_master *qmblk,
 	mutex_lock(&qmblk->dq_write_lock);
 	qmblk_data_read_lock(qmblk);
 
+	vzquota_qmblk_fold(qmblk);
 	vzquota_stat_dump(qmblk, &dqstat);
 	vzquota_uginfo_dump(qmblk, &uginfo);
 	if (ugid[0] != NULL)
@@ -542,6 +591,63 @@ err:
 	return -1;
 }
 
+static int vzquota_ckpt_write(struct vz_quota_master *qmblk,
+		struct inode *ino, unsigned int state)
+{
+	struct vz_quota_ckpt_img img;
+	struct super_block *sb = ino->i_sb;
+	ssize_t size;
+
+	img.magic = cpu_to_le32(VZQUOTA_CKPT_MAGIC);
+	img.state = cpu_to_le32(state);
+	img.generation = cpu_to_le64(++qmblk->dq_ckpt_gen);
+	img.ckpt_time = cpu_to_le64(get_seconds());
+
+	size = sb->s_op->quota_write_ino(sb, ino,
+			(char *)&img, sizeof(img), VZQUOTA_CKPT_OFF);
+
+	return (size == sizeof(img)) ? 0 : -EIO;
+}
+
+/*
+ * Write usage back to quota file and stamp it with checkpoint record.
+ * Changes made while we write set dq_ckpt_dirty again and get into the
+ * next checkpoint.
+ */
+static int vzquota_checkpoint(struct vz_quota_master *qmblk,
+		struct inode *ino, unsigned int state)
+{
+	struct vz_quota_ugid *no_ugids[2] = { NULL, NULL };
+	int err;
+
+	clear_bit(0, &qmblk->dq_ckpt_dirty);
+	smp_mb__after_clear_bit();
+	err = vzquota_write_file(qmblk, ino, no_ugids);
+	if (err)
+		return err;
+
+	mutex_lock(&qmblk->dq_write_lock);
+	err = vzquota_ckpt_write(qmblk, ino, state);
+	mutex_unlock(&qmblk->dq_write_lock);
+	return err;
+}
+
+void vzquota_ckpt_work(struct work_struct *work)
+{
+	struct vz_quota_master *qmblk;
+	struct inode *ino;
+
+	qmblk = container_of(work, struct vz_quota_master, dq_ckpt_work.work);
+	/* cleared before the work is cancelled and the file is put */
+	ino = ACCESS_ONCE(qmblk->qfile);
+	if (ino == NULL)
+		return;
+
+	if (vzquota_checkpoint(qmblk, ino, VZQUOTA_CKPT_DIRTY))
+		printk(KERN_ERR "vzdq: error writing quota checkpoint. "
+				"In case of crash quota will be inconsistent.\n");
+}
+
 static int vzquota_write_ugids(struct vz_quota_master *qmblk,
 		struct inode *ino, struct vz_quota_ugid **ugid)
 {
@@ -602,9 +708,9 @@ static void vzquota_sync_file(struct vz_quota_master *qmblk, struct inode *ino)
 {
 
 	struct super_block *sb = ino->i_sb;
-	struct vz_quota_ugid *no_ugids[2] = { NULL, NULL };
 
-	vzquota_write_file(qmblk, ino, no_ugids);
+	cancel_delayed_work_sync(&qmblk->dq_ckpt_work);
+	vzquota_checkpoint(qmblk, ino, VZQUOTA_CKPT_CLEAN);
 
 	/*
 	 * FIXME - this is taken from quota.c, they know this is slow
@@ -917,11 +1023,16 @@ static int vzquota_setlimit(unsigned int quota_id,
 	}
 	user_dqstat2dqstat(&uqstat.dq_stat, &qstat.dq_stat);
 	user_dqinfo2dqinfo(&uqstat.dq_info, &qstat.dq_info);
+	/* reported by getstat only, not a part of the limits */
+	qstat.dq_info.flags &= ~VZ_QUOTA_DIRTY;
 
 	qmblk_data_write_lock(qmblk);
+	/* grace time is started against the exact usage */
+	vzquota_qmblk_fold(qmblk);
 	err = vzquota_update_limit(&qmblk->dq_stat, &qstat.dq_stat);
 	if (err == 0)
 		qmblk->dq_info = qstat.dq_info;
+	vzquota_statfs_invalidate(qmblk);
 	qmblk_data_write_unlock(qmblk);
 
 out:
@@ -949,10 +1060,14 @@ static int vzquota_getstat(unsigned int quota_id,
 		goto out;
 
 	qmblk_data_read_lock(qmblk);
+	vzquota_qmblk_fold(qmblk);
 	/* copy whole buffer under lock */
 	memcpy(&qstat.dq_stat, &qmblk->dq_stat, sizeof(qstat.dq_stat));
 	memcpy(&qstat.dq_info, &qmblk->dq_info, sizeof(qstat.dq_info));
 	qmblk_data_read_unlock(qmblk);
+	if (qmblk->qfile != NULL &&
+	    qmblk->dq_ckpt_found.state != VZQUOTA_CKPT_CLEAN)
+		qstat.dq_info.flags |= VZ_QUOTA_DIRTY;
 	dqstat2user_dqstat(&qstat.dq_stat, &uqstat.dq_stat);
 	dqinfo2user_dqinfo(&qstat.dq_info, &uqstat.dq_info);
 	if (!compat) {
@@ -973,6 +1088,38 @@ out:
 	return err;
 }
 
+/*
+ * get checkpoint record the quota file had when quota was turned on,
+ * to know whether and since when the usage has to be recounted
+ */
+static int vzquota_getckpt(unsigned int quota_id,
+		struct vz_quota_ckpt_stat __user *u_ckpt)
+{
+	int err;
+	struct vz_quota_ckpt_stat ckpt;
+	struct vz_quota_master *qmblk;
+
+	mutex_lock(&vz_quota_mutex);
+
+	err = -ENOENT;
+	qmblk = vzquota_find_master(quota_id);
+	if (qmblk == NULL)
+		goto out;
+
+	err = -EINVAL;
+	if (qmblk->qfile == NULL)
+		goto out;
+
+	ckpt = qmblk->dq_ckpt_found;
+	err = 0;
+	if (copy_to_user(u_ckpt, &ckpt, sizeof(ckpt)))
+		err = -EFAULT;
+
+out:
+	mutex_unlock(&vz_quota_mutex);
+	return err;
+}
+
 static int vzquota_get_status(unsigned int quota_id)
 {
 	int ret;
@@ -1049,6 +1196,11 @@ long do_vzquotactl(int cmd, unsigned int quota_id,
 		case VZ_DQ_STATUS:
 			ret = vzquota_get_status(quota_id);
 			break;
+		case VZ_DQ_GETCKPT:
+			/* qstat points to struct vz_quota_ckpt_stat here */
+			ret = vzquota_getckpt(quota_id,
+					(struct vz_quota_ckpt_stat __user *)qstat);
+			break;
 
 		default:
 			ret = -EINVAL;
@@ -1215,6 +1367,9 @@ static int vzquota_read_proc(char *page, char **start, off_t off, int count,
 			/* we print quotaid and path only in VE0 */
 			if (capable(CAP_SYS_ADMIN))
 				len += print_proc_master_id(p+len,path_buf, qp);
+			qmblk_data_read_lock(qp);
+			vzquota_qmblk_fold(qp);
+			qmblk_data_read_unlock(qp);
 			len += print_proc_stat(p+len, &qp->dq_stat,
 					&qp->dq_info);
 			printed += len;
@@ -93,6 +93,114 @@ static inline void vzquota_claim_rsv_space(struct dq_kstat *dqstat,
 	dqstat->bcurrent += number;
 }
 
+/*
+ * Space usage of a master may be changed per-cpu, with no data lock, as
+ * long as the limits can't be reached by all cpus having a full batch.
+ * Otherwise the usage is folded and checked exactly under the lock.
+ */
+static inline int vzquota_qmblk_space_far(struct vz_quota_master *qmblk,
+		__u64 number)
+{
+	struct dq_kstat *dqstat = &qmblk->dq_stat;
+	__u64 limit;
+
+	if (qmblk->dq_pcpu == NULL)
+		return 0;
+
+	limit = min(ACCESS_ONCE(dqstat->bsoftlimit),
+			ACCESS_ONCE(dqstat->bhardlimit));
+	return ACCESS_ONCE(dqstat->bcurrent) + ACCESS_ONCE(dqstat->breserved) +
+		number + VZDQ_PCPU_SLACK <= limit;
+}
+
+/* freeing may need to reset the grace time, which is done exactly */
+static inline int vzquota_qmblk_free_far(struct vz_quota_master *qmblk)
+{
+	return qmblk->dq_pcpu != NULL && ACCESS_ONCE(qmblk->dq_stat.btime) == 0;
+}
+
+static void vzquota_qmblk_add(struct vz_quota_master *qmblk, s64 number,
+		int reserved, int locked)
+{
+	struct vz_quota_pcpu *pcpu;
+	s64 delta;
+	int cpu;
+
+	cpu = get_cpu();
+	pcpu = per_cpu_ptr(qmblk->dq_pcpu, cpu);
+	delta = atomic64_add_return(number,
+			reserved ? &pcpu->breserved : &pcpu->bcurrent);
+	if (delta > (s64)VZDQ_PCPU_BATCH || delta < -(s64)VZDQ_PCPU_BATCH) {
+		if (!locked)
+			qmblk_data_write_lock(qmblk);
+		__vzquota_qmblk_fold(qmblk, cpu);
+		if (!locked)
+			qmblk_data_write_unlock(qmblk);
+	}
+	put_cpu();
+}
+
+/* ugid records are changed under data lock only */
+static inline int vzquota_inode_has_ugid(struct inode *inode)
+{
+#ifdef CONFIG_VZ_QUOTA_UGID
+	int cnt;
+
+	for (cnt = 0; cnt < MAXQUOTAS; cnt++)
+		if (INODE_QLNK(inode)->qugid[cnt] != NULL)
+			return 1;
+#endif
+	return 0;
+}
+
+#define VZDQ_FAST_ALLOC		0
+#define VZDQ_FAST_CLAIM		1
+#define VZDQ_FAST_FREE		2
+
+/*
+ * Lockless space usage change of an inode without ugid records: qmblk is
+ * looked up under rcu and only its per-cpu counters are touched, neither
+ * the inode qmblk lock nor the data lock are taken unless a batch is folded.
+ * Returns 0 if the caller should change the usage the locked way.
+ */
+static int vzquota_space_fast(struct inode *inode, qsize_t number,
+		int rsv, int op)
+{
+	struct vz_quota_ugid *qugid[MAXQUOTAS] = { NULL, };
+	struct vz_quota_master *qmblk;
+	int ok = 0;
+
+	qmblk = vzquota_inode_qmblk_get(inode);
+	if (qmblk == NULL)
+		return 0;
+	if (vzquota_inode_has_ugid(inode))
+		goto out;
+
+	switch (op) {
+	case VZDQ_FAST_ALLOC:
+		if (!vzquota_qmblk_space_far(qmblk, number))
+			goto out;
+		vzquota_qmblk_add(qmblk, number, rsv, 0);
+		break;
+	case VZDQ_FAST_CLAIM:
+		vzquota_qmblk_add(qmblk, -(s64)number, 1, 0);
+		vzquota_qmblk_add(qmblk, number, 0, 0);
+		break;
+	case VZDQ_FAST_FREE:
+		if (!vzquota_qmblk_free_far(qmblk))
+			goto out;
+		vzquota_qmblk_add(qmblk, -(s64)number, rsv, 0);
+		break;
+	}
+	/* reservation doesn't change on-disk quota data */
+	if (!rsv)
+		vzquota_mark_dirty(qmblk, qugid);
+	ok = 1;
+out:
+	qmblk_put(qmblk);
+	return ok;
+}
+
 /*
  * better printk() message or use /proc/vzquotamsg interface
  * similar to /proc/kmsg
@@ -360,8 +468,15 @@ static int __vzquota_alloc_space(struct inode *inode,
 	struct vz_quota_datast data;
 	struct vzsnap_struct *vzs = NULL;
 	int ret = QUOTA_OK;
+	int far, locked = 0;
 
-	qmblk = vzquota_inode_data(inode, &data);
+	if (vzquota_space_fast(inode, number, rsv, VZDQ_FAST_ALLOC)) {
+		inode_incr_space(inode, number, rsv);
+		might_sleep();
+		return QUOTA_OK;
+	}
+
+	qmblk = __vzquota_inode_data(inode, &data, 0);
 	if (qmblk == VZ_QUOTA_BAD)
 		return NO_QUOTA;
 	if (qmblk != NULL) {
@@ -370,11 +485,20 @@ static int __vzquota_alloc_space(struct inode *inode,
 		struct vz_quota_ugid * qugid[MAXQUOTAS];
 #endif
 
+		far = vzquota_qmblk_space_far(qmblk, number);
+		locked = !far || vzquota_inode_has_ugid(inode);
+		if (locked)
+			qmblk_data_write_lock(qmblk);
+
 		/* checking first */
-		ret = vzquota_check_space(&qmblk->dq_info, &qmblk->dq_stat,
-				number, qmblk->dq_id, prealloc);
-		if (ret == NO_QUOTA)
-			goto no_quota;
+		if (!far) {
+			vzquota_qmblk_fold(qmblk);
+			ret = vzquota_check_space(&qmblk->dq_info,
+					&qmblk->dq_stat, number,
+					qmblk->dq_id, prealloc);
+			if (ret == NO_QUOTA)
+				goto no_quota;
+		}
 #ifdef CONFIG_VZ_QUOTA_UGID
 		for (cnt = 0; cnt < MAXQUOTAS; cnt++) {
 			qugid[cnt] = INODE_QLNK(inode)->qugid[cnt];
@@ -393,10 +517,13 @@ static int __vzquota_alloc_space(struct inode *inode,
 				__vzquota_get_ugid(qugid[cnt]);
 		}
 #endif
-		vzquota_incr_space(&qmblk->dq_stat, number, rsv);
+		if (far)
+			vzquota_qmblk_add(qmblk, number, rsv, locked);
+		else
+			vzquota_incr_space(&qmblk->dq_stat, number, rsv);
 		if (qmblk->dq_snap && !rsv)
 			vzs = vzsnap_get(qmblk->dq_snap);
-		vzquota_data_unlock(inode, &data);
+		__vzquota_data_unlock(inode, &data, locked);
 		/* Reservation doesn't change state of on-disk quota's data,
 		   skip quota dirtying */
 		if (rsv)
@@ -418,7 +545,7 @@ out:
 	return QUOTA_OK;
 
 no_quota:
-	vzquota_data_unlock(inode, &data);
+	__vzquota_data_unlock(inode, &data, locked);
 	return NO_QUOTA;
 }
 
@@ -438,8 +565,15 @@ static int vzquota_claim_reserved_space(struct inode *inode, qsize_t number)
 	struct vz_quota_master *qmblk;
 	struct vz_quota_datast data;
 	struct vzsnap_struct *vzs = NULL;
+	int locked;
 
-	qmblk = vzquota_inode_data(inode, &data);
+	if (vzquota_space_fast(inode, number, 0, VZDQ_FAST_CLAIM)) {
+		inode_claim_rsv_space(inode, number);
+		might_sleep();
+		return QUOTA_OK;
+	}
+
+	qmblk = __vzquota_inode_data(inode, &data, 0);
 	if (qmblk == VZ_QUOTA_BAD)
 		return NO_QUOTA; /* isn't checked by the caller */
 	if (qmblk != NULL) {
@@ -448,7 +582,17 @@ static int vzquota_claim_reserved_space(struct inode *inode, qsize_t number)
 		struct vz_quota_ugid * qugid[MAXQUOTAS];
 #endif
 
-		vzquota_claim_rsv_space(&qmblk->dq_stat, number);
+		/* claiming never fails and doesn't start the grace time */
+		locked = qmblk->dq_pcpu == NULL ||
+			vzquota_inode_has_ugid(inode);
+		if (locked)
+			qmblk_data_write_lock(qmblk);
+
+		if (qmblk->dq_pcpu != NULL) {
+			vzquota_qmblk_add(qmblk, -(s64)number, 1, locked);
+			vzquota_qmblk_add(qmblk, number, 0, locked);
+		} else
+			vzquota_claim_rsv_space(&qmblk->dq_stat, number);
 		if(qmblk->dq_snap)
 			vzs = vzsnap_get(qmblk->dq_snap);
 
@@ -462,7 +606,7 @@ static int vzquota_claim_reserved_space(struct inode *inode, qsize_t number)
 			__vzquota_get_ugid(qugid[cnt]);
 		}
 #endif
-		vzquota_data_unlock(inode, &data);
+		__vzquota_data_unlock(inode, &data, locked);
 		vzquota_mark_dirty(qmblk, qugid);
 #ifdef CONFIG_VZ_QUOTA_UGID
 		for (cnt = 0; cnt < MAXQUOTAS; cnt++) {
@@ -551,8 +695,15 @@ static int __vzquota_free_space(struct inode *inode, qsize_t number, int rsv)
 {
 	struct vz_quota_master *qmblk;
 	struct vz_quota_datast data;
+	int far, locked;
 
-	qmblk = vzquota_inode_data(inode, &data);
+	if (vzquota_space_fast(inode, number, rsv, VZDQ_FAST_FREE)) {
+		inode_decr_space(inode, number, rsv);
+		might_sleep();
+		return QUOTA_OK;
+	}
+
+	qmblk = __vzquota_inode_data(inode, &data, 0);
 	if (qmblk == VZ_QUOTA_BAD)
 		return NO_QUOTA; /* isn't checked by the caller */
 	if (qmblk != NULL) {
@@ -561,7 +712,17 @@ static int __vzquota_free_space(struct inode *inode, qsize_t number, int rsv)
 		struct vz_quota_ugid * qugid[MAXQUOTAS];
 #endif
 
-		vzquota_decr_space(&qmblk->dq_stat, number, rsv);
+		far = vzquota_qmblk_free_far(qmblk);
+		locked = !far || vzquota_inode_has_ugid(inode);
+		if (locked)
+			qmblk_data_write_lock(qmblk);
+
+		if (far)
+			vzquota_qmblk_add(qmblk, -(s64)number, rsv, locked);
+		else {
+			vzquota_qmblk_fold(qmblk);
+			vzquota_decr_space(&qmblk->dq_stat, number, rsv);
+		}
 #ifdef CONFIG_VZ_QUOTA_UGID
 		for (cnt = 0; cnt < MAXQUOTAS; cnt++) {
 			qugid[cnt] = INODE_QLNK(inode)->qugid[cnt];
@@ -573,7 +734,7 @@ static int __vzquota_free_space(struct inode *inode, qsize_t number, int rsv)
 				__vzquota_get_ugid(qugid[cnt]);
 		}
 #endif
-		vzquota_data_unlock(inode, &data);
+		__vzquota_data_unlock(inode, &data, locked);
 		/* Reservation doesn't change state of on-disk quota's data,
 		   skip quota dirtying */
 		if (rsv)
@@ -689,6 +850,7 @@ void vzquota_inode_off(struct inode * inode)
 
 		inode->i_flags |= S_NOQUOTA;
 
+		vzquota_qmblk_fold(qmblk);
 		vzquota_decr_space(&qmblk->dq_stat, bytes, 0);
 		vzquota_decr_inodes(&qmblk->dq_stat, 1);
 #ifdef CONFIG_VZ_QUOTA_UGID
@@ -10,8 +10,104 @@
 
 #include <linux/errno.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
 #include <linux/vzdq_tree.h>
 
+static struct quotatree_hent *quotatree_hash_alloc(unsigned int bits)
+{
+	size_t size = sizeof(struct quotatree_hent) << bits;
+
+	if (size <= PAGE_SIZE)
+		return kzalloc(size, GFP_NOFS);
+	return __vmalloc(size, GFP_NOFS | __GFP_HIGHMEM | __GFP_ZERO,
+			PAGE_KERNEL);
+}
+
+static void quotatree_hash_free(struct quotatree_hent *hash)
+{
+	if (is_vmalloc_addr(hash))
+		vfree(hash);
+	else
+		kfree(hash);
+}
+
+static struct quotatree_hent *
+quotatree_hash_slot(struct quotatree_hent *hash, unsigned int bits,
+		quotaid_t id)
+{
+	unsigned int mask = (1U << bits) - 1, i;
+
+	for (i = hash_32(id, bits); hash[i].data != NULL; i = (i + 1) & mask)
+		if (hash[i].id == id)
+			break;
+	return hash + i;
+}
+
+static void quotatree_hash_grow(struct quotatree_tree *tree)
+{
+	struct quotatree_hent *hash, *e;
+	unsigned int bits, i;
+
+	bits = tree->hash_bits + 1;
+	hash = quotatree_hash_alloc(bits);
+	if (tree->hash != NULL) {
+		for (i = 0; hash != NULL && i < (1U << tree->hash_bits); i++) {
+			if (tree->hash[i].data == NULL)
+				continue;
+			e = quotatree_hash_slot(hash, bits, tree->hash[i].id);
+			*e = tree->hash[i];
+		}
+		quotatree_hash_free(tree->hash);
+	}
+	/* without index lookups just walk the tree */
+	tree->hash = hash;
+	tree->hash_bits = bits;
+}
+
+static void quotatree_hash_insert(struct quotatree_tree *tree,
+		quotaid_t id, void *data)
+{
+	struct quotatree_hent *e;
+
+	if (tree->hash == NULL)
+		return;
+	/* keep load under 3/4 */
+	if (tree->leaf_num * 4 >= 3U << tree->hash_bits) {
+		quotatree_hash_grow(tree);
+		if (tree->hash == NULL)
+			return;
+	}
+	e = quotatree_hash_slot(tree->hash, tree->hash_bits, id);
+	e->id = id;
+	e->data = data;
+}
+
+/* linear probing, so the chain is closed up instead of leaving tombstones */
+static void quotatree_hash_remove(struct quotatree_tree *tree, quotaid_t id)
+{
+	struct quotatree_hent *hash = tree->hash;
+	unsigned int mask, i, j, home;
+
+	if (hash == NULL)
+		return;
+	mask = (1U << tree->hash_bits) - 1;
+	i = quotatree_hash_slot(hash, tree->hash_bits, id) - hash;
+	if (hash[i].data == NULL)
+		return;
+
+	for (j = (i + 1) & mask; hash[j].data != NULL; j = (j + 1) & mask) {
+		home = hash_32(hash[j].id, tree->hash_bits);
+		/* entry can fill the hole if its home is not after the hole */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			hash[i] = hash[j];
+			i = j;
+		}
+	}
+	hash[i].data = NULL;
+}
+
 struct quotatree_tree *quotatree_alloc(void)
 {
 	int l;
@@ -28,6 +124,12 @@ struct quotatree_tree *quotatree_alloc(void)
 	}
 	tree->root = NULL;
 	tree->leaf_num = 0;
+	tree->hash_bits = QUOTATREE_HASH_MINBITS;
+	tree->hash = quotatree_hash_alloc(tree->hash_bits);
+	if (tree->hash == NULL) {
+		kfree(tree);
+		tree = NULL;
+	}
 out:
 	return tree;
 }
@@ -57,9 +159,20 @@ quotatree_follow(struct quotatree_tree *tree, quotaid_t id, int level,
 	return parent;
 }
 
+/*
+ * @st is filled for quotatree_insert() only if @id is not found.
+ */
 void *quotatree_find(struct quotatree_tree *tree, quotaid_t id,
 		struct quotatree_find_state *st)
 {
+	struct quotatree_hent *e;
+
+	if (tree->hash != NULL) {
+		e = quotatree_hash_slot(tree->hash, tree->hash_bits, id);
+		if (e->data != NULL)
+			return e->data;
+	}
+
 	quotatree_follow(tree, id, QUOTATREE_DEPTH, st);
 	if (st->level == QUOTATREE_DEPTH)
 		return *st->block;
@@ -145,6 +258,7 @@ int quotatree_insert(struct quotatree_tree *tree, quotaid_t id,
 		st->block = p->blocks + index;
 		st->level++;
 	}
+	quotatree_hash_insert(tree, id, data);
 	tree->leaf_num++;
 	*st->block = data;
 
@@ -170,6 +284,7 @@ void quotatree_remove(struct quotatree_tree *tree, quotaid_t id)
 	struct quotatree_node *p;
 	int level, i;
 
+	quotatree_hash_remove(tree, id);
 	p = quotatree_remove_ptr(tree, id, QUOTATREE_DEPTH);
 	for (level = QUOTATREE_DEPTH - 1; level >= QUOTATREE_CDEPTH; level--) {
 		for (i = 0; i < QUOTATREE_BSIZE; i++)
@@ -282,5 +397,7 @@ void quotatree_free(struct quotatree_tree *tree, void (*dtor)(void *))
 {
 	quotatree_free_leafs(tree, dtor);
 	quotatree_free_nodes(tree);
+	if (tree->hash != NULL)
+		quotatree_hash_free(tree->hash);
 	kfree(tree);
 }
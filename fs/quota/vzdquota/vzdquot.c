@@ -149,10 +149,13 @@ struct vz_quota_master *vzquota_alloc_master(unsigned int quota_id,
 	qmblk = kmem_cache_alloc(vzquota_cachep, GFP_KERNEL);
 	if (qmblk == NULL)
 		goto out;
+	qmblk->dq_pcpu = alloc_percpu(struct vz_quota_pcpu);
+	if (qmblk->dq_pcpu == NULL)
+		goto out_free;
 #ifdef CONFIG_VZ_QUOTA_UGID
 	qmblk->dq_uid_tree = quotatree_alloc();
 	if (!qmblk->dq_uid_tree)
-		goto out_free;
+		goto out_free_pcpu;
 
 	qmblk->dq_gid_tree = quotatree_alloc();
 	if (!qmblk->dq_gid_tree)
@@ -174,7 +177,12 @@ struct vz_quota_master *vzquota_alloc_master(unsigned int quota_id,
 	qmblk->dq_ugid_max = 0;
 	qmblk->dq_flags = 0;
 	qmblk->qfile = NULL;
+	INIT_DELAYED_WORK(&qmblk->dq_ckpt_work, vzquota_ckpt_work);
+	qmblk->dq_ckpt_dirty = 0;
+	qmblk->dq_ckpt_gen = 0;
 	qmblk->dq_snap = NULL;
+	seqcount_init(&qmblk->dq_statfs_seq);
+	qmblk->dq_statfs_valid = 0;
 	memset(qmblk->dq_ugid_info, 0, sizeof(qmblk->dq_ugid_info));
 	INIT_LIST_HEAD(&qmblk->dq_ilink_list);
 
@@ -190,9 +198,11 @@ struct vz_quota_master *vzquota_alloc_master(unsigned int quota_id,
 #ifdef CONFIG_VZ_QUOTA_UGID
 out_free_tree:
 	quotatree_free(qmblk->dq_uid_tree, NULL);
+out_free_pcpu:
+	free_percpu(qmblk->dq_pcpu);
+#endif
 out_free:
 	kmem_cache_free(vzquota_cachep, qmblk);
-#endif
 out:
 	return ERR_PTR(err);
 }
@@ -232,6 +242,12 @@ struct vz_quota_master *vzquota_find_master(unsigned int quota_id)
 	return NULL;
 }
 
+static void vzquota_free_master_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(vzquota_cachep,
+			container_of(rcu, struct vz_quota_master, dq_rcu));
+}
+
 /**
  * vzquota_free_master - release resources taken by qmblk, freeing memory
  *
@@ -244,7 +260,49 @@ void vzquota_free_master(struct vz_quota_master *qmblk)
 	vzquota_kill_ugid(qmblk);
 #endif
 	BUG_ON(!list_empty(&qmblk->dq_ilink_list));
-	kmem_cache_free(vzquota_cachep, qmblk);
+	free_percpu(qmblk->dq_pcpu);
+	/* the structure itself may still be looked at by vzquota_dstat() */
+	call_rcu(&qmblk->dq_rcu, vzquota_free_master_rcu);
+}
+
+static inline void vzquota_fold_delta(qsize_t *val, s64 delta)
+{
+	if (delta >= 0 || *val > -delta)
+		*val += delta;
+	else
+		*val = 0;
+}
+
+/**
+ * __vzquota_qmblk_fold - fold space usage changed on cpu into dq_stat
+ *
+ * Called under qmblk data lock.
+ */
+void __vzquota_qmblk_fold(struct vz_quota_master *qmblk, int cpu)
+{
+	struct vz_quota_pcpu *pcpu;
+
+	pcpu = per_cpu_ptr(qmblk->dq_pcpu, cpu);
+	vzquota_fold_delta(&qmblk->dq_stat.bcurrent,
+			atomic64_xchg(&pcpu->bcurrent, 0));
+	vzquota_fold_delta(&qmblk->dq_stat.breserved,
+			atomic64_xchg(&pcpu->breserved, 0));
+}
+
+/**
+ * vzquota_qmblk_fold - make space usage in dq_stat exact
+ *
+ * Called under qmblk data lock.
+ */
+void vzquota_qmblk_fold(struct vz_quota_master *qmblk)
+{
+	int cpu;
+
+	if (qmblk->dq_pcpu == NULL)
+		return;
+
+	for_each_possible_cpu(cpu)
+		__vzquota_qmblk_fold(qmblk, cpu);
 }
 
 
@@ -554,6 +612,34 @@ static inline int vzquota_qlnk_is_empty(struct vz_quota_ilink *qlnk)
 	return qlnk->qmblk == __VZ_QUOTA_EMPTY;
 }
 
+/**
+ * vzquota_inode_qmblk_get - lockless lookup of qmblk for per-cpu updates
+ * @inode: the inode
+ *
+ * Returns referenced actual qmblk with per-cpu counters and no snapshot
+ * attached, or NULL if the caller should go the locked way through
+ * __vzquota_inode_data(). The qmblk may be being switched from the inode
+ * by a concurrent recalc, the reference keeps its per-cpu counters alive.
+ */
+struct vz_quota_master *vzquota_inode_qmblk_get(struct inode *inode)
+{
+	struct vz_quota_master *qmblk;
+
+	if (unlikely(inode->i_flags & S_NOQUOTA))
+		return NULL;
+
+	rcu_read_lock();
+	qmblk = ACCESS_ONCE(INODE_QLNK(inode)->qmblk);
+	if (qmblk == NULL || qmblk == VZ_QUOTA_BAD ||
+	    qmblk == __VZ_QUOTA_EMPTY ||
+	    (qmblk->dq_flags & (VZDQ_NOQUOT | VZDQ_NOACT)) ||
+	    qmblk->dq_pcpu == NULL || qmblk->dq_snap != NULL ||
+	    !atomic_inc_not_zero(&qmblk->dq_count))
+		qmblk = NULL;
+	rcu_read_unlock();
+	return qmblk;
+}
+
 static inline void set_qlnk_origin(struct vz_quota_ilink *qlnk,
 		unsigned char origin)
 {
@@ -637,11 +723,11 @@ static void vzquota_qlnk_swap(struct vz_quota_ilink *qlt,
 /**
  * vzquota_qlnk_reinit_locked - destroy qlnk content, called under locks
  *
- * Called under dcache_lock and inode_qmblk locks.
+ * Called under inode_qmblk lock and, if @dlocked, dcache_lock.
  * Returns 1 if locks were dropped inside, 0 if atomic.
  */
 static int vzquota_qlnk_reinit_locked(struct vz_quota_ilink *qlnk,
-		struct inode *inode)
+		struct inode *inode, int dlocked)
 {
 	if (vzquota_qlnk_is_empty(qlnk))
 		return 0;
@@ -650,12 +736,14 @@ static int vzquota_qlnk_reinit_locked(struct vz_quota_ilink *qlnk,
 		set_qlnk_origin(qlnk, VZ_QUOTAO_RE_LOCK);
 		return 0;
 	}
-	spin_unlock(&dcache_lock);
+	if (dlocked)
+		spin_unlock(&dcache_lock);
 	inode_qmblk_unlock(inode->i_sb);
 	vzquota_qlnk_destroy(qlnk);
 	vzquota_qlnk_init(qlnk);
 	inode_qmblk_lock(inode->i_sb);
-	spin_lock(&dcache_lock);
+	if (dlocked)
+		spin_lock(&dcache_lock);
 	return 1;
 }
 
@@ -687,14 +775,15 @@ static int vzquota_qlnk_reinit_attr(struct vz_quota_ilink *qlnk,
  * @qlnk: vz_quota_ilink to fill
  * @inode: inode for which @qlnk is filled (i_sb, i_uid, i_gid)
  * @qmblk: qmblk to which this @qlnk will belong
+ * @dlocked: dcache_lock is held by the caller
  *
- * Called under dcache_lock and inode_qmblk locks.
+ * Called under inode_qmblk lock and, if @dlocked, dcache_lock.
  * Returns 1 if locks were dropped inside, 0 if atomic.
  * @qlnk is expected to be empty.
  */
 static int vzquota_qlnk_fill(struct vz_quota_ilink *qlnk,
 		struct inode *inode,
-		struct vz_quota_master *qmblk)
+		struct vz_quota_master *qmblk, int dlocked)
 {
 	if (qmblk != VZ_QUOTA_BAD)
 		qmblk_get(qmblk);
@@ -706,7 +795,8 @@ static int vzquota_qlnk_fill(struct vz_quota_ilink *qlnk,
 	    (qmblk->dq_flags & VZDQUG_ON)) {
 		struct vz_quota_ugid *quid, *qgid;
 
-		spin_unlock(&dcache_lock);
+		if (dlocked)
+			spin_unlock(&dcache_lock);
 		inode_qmblk_unlock(inode->i_sb);
 
 		mutex_lock(&qmblk->dq_mutex);
@@ -715,7 +805,8 @@ static int vzquota_qlnk_fill(struct vz_quota_ilink *qlnk,
 		mutex_unlock(&qmblk->dq_mutex);
 
 		inode_qmblk_lock(inode->i_sb);
-		spin_lock(&dcache_lock);
+		if (dlocked)
+			spin_lock(&dcache_lock);
 		qlnk->qugid[USRQUOTA] = quid;
 		qlnk->qugid[GRPQUOTA] = qgid;
 		return 1;
@@ -824,9 +915,9 @@ static void vzquota_inode_drop(struct inode *inode)
  * Additionally, the restarts prevent inconsistencies if the dentry tree
  * changes (inode is moved).  This is not a big deal, but anyway...
  */
-static int vzquota_inode_qmblk_set(struct inode *inode,
+static int __vzquota_inode_qmblk_set(struct inode *inode,
 		struct vz_quota_master *qmblk,
-		struct vz_quota_ilink *qlnk)
+		struct vz_quota_ilink *qlnk, int dlocked)
 {
 	if (qmblk == NULL) {
 		printk(KERN_ERR "VZDQ: NULL in set, orig {%u, %u}, "
@@ -843,11 +934,11 @@ static int vzquota_inode_qmblk_set(struct inode *inode,
 	}
 	while (1) {
 		if (vzquota_qlnk_is_empty(qlnk) &&
-		    vzquota_qlnk_fill(qlnk, inode, qmblk))
+		    vzquota_qlnk_fill(qlnk, inode, qmblk, dlocked))
 			return 1;
 		if (qlnk->qmblk == qmblk)
 			break;
-		if (vzquota_qlnk_reinit_locked(qlnk, inode))
+		if (vzquota_qlnk_reinit_locked(qlnk, inode, dlocked))
 			return 1;
 	}
 	vzquota_qlnk_swap(qlnk, INODE_QLNK(inode));
@@ -855,6 +946,13 @@ static int vzquota_inode_qmblk_set(struct inode *inode,
 	return 0;
 }
 
+static inline int vzquota_inode_qmblk_set(struct inode *inode,
+		struct vz_quota_master *qmblk,
+		struct vz_quota_ilink *qlnk)
+{
+	return __vzquota_inode_qmblk_set(inode, qmblk, qlnk, 1);
+}
+
 
 /* ----------------------------------------------------------------------
  *
@@ -1201,9 +1299,43 @@ fail:
 	goto set;
 }
 
+/*
+ * Fast path for an inode being created in a directory with actual qmblk:
+ * the directory is pinned by the creation context and the new inode is
+ * not in the dentry tree yet, so neither needs dcache_lock to be resolved.
+ * Called under inode_qmblk lock. Returns 0 if the slow path is needed.
+ */
+static int vzquota_new_qmblk_recalc(struct inode *inode,
+		struct vz_quota_ilink *qlnk)
+{
+	struct inode *parent;
+
+	if (!vzquota_cur_qmblk_check() ||
+	    inode->i_op != VZ_QUOTA_EMPTY_IOPS ||
+	    (inode->i_state & I_FREEING) ||
+	    !list_empty(&inode->i_dentry))
+		return 0;
+
+	parent = vzquota_cur_qmblk_fetch();
+	while (vzquota_qlnk_is_empty(INODE_QLNK(inode))) {
+		if (vzquota_check_parent(parent, inode) != NULL ||
+		    !VZ_QUOTA_IS_ACTUAL(parent))
+			return 0;
+		if (!__vzquota_inode_qmblk_set(inode,
+					INODE_QLNK(parent)->qmblk, qlnk, 0)) {
+			set_qlnk_origin(INODE_QLNK(inode), VZ_QUOTAO_DET);
+			break;
+		}
+	}
+	return 1;
+}
+
 static void vzquota_inode_qmblk_recalc(struct inode *inode,
 		struct vz_quota_ilink *qlnk)
 {
+	if (vzquota_new_qmblk_recalc(inode, qlnk))
+		return;
+
 	spin_lock(&dcache_lock);
 	if (!list_empty(&inode->i_dentry))
 		vzquota_dtree_qmblk_recalc(inode, qlnk);
@@ -1357,9 +1489,10 @@ void vzquota_inode_drop_call(struct inode *inode)
 }
 
 /**
- * vzquota_inode_data - initialize (if nec.) and lock inode quota ptrs
+ * __vzquota_inode_data - initialize (if nec.) and lock inode quota ptrs
  * @inode: the inode
  * @data: storage space
+ * @lock_data: take qmblk data lock too
  *
  * Returns: qmblk is NULL or VZ_QUOTA_BAD or actualized qmblk.
  * On return if qmblk is neither NULL nor VZ_QUOTA_BAD:
@@ -1368,8 +1501,8 @@ void vzquota_inode_drop_call(struct inode *inode)
  *   some locks are taken (and should be released by vzquota_data_unlock).
  * If qmblk is NULL or VZ_QUOTA_BAD, locks are NOT taken.
  */
-struct vz_quota_master *vzquota_inode_data(struct inode *inode,
-		struct vz_quota_datast *data)
+struct vz_quota_master *__vzquota_inode_data(struct inode *inode,
+		struct vz_quota_datast *data, int lock_data)
 {
 	struct vz_quota_master *qmblk;
 
@@ -1400,7 +1533,8 @@ struct vz_quota_master *vzquota_inode_data(struct inode *inode,
 			 * However, quota usage information should stop being
 			 * updated immediately after vzquota_off.
 			 */
-			qmblk_data_write_lock(qmblk);
+			if (lock_data)
+				qmblk_data_write_lock(qmblk);
 		} else {
 			inode_qmblk_unlock(inode->i_sb);
 			vzquota_qlnk_destroy(&data->qlnk);
@@ -1412,10 +1546,11 @@ struct vz_quota_master *vzquota_inode_data(struct inode *inode,
 	return qmblk;
 }
 
-void vzquota_data_unlock(struct inode *inode,
-		struct vz_quota_datast *data)
+void __vzquota_data_unlock(struct inode *inode,
+		struct vz_quota_datast *data, int locked_data)
 {
-	qmblk_data_write_unlock(INODE_QLNK(inode)->qmblk);
+	if (locked_data)
+		qmblk_data_write_unlock(INODE_QLNK(inode)->qmblk);
 	inode_qmblk_unlock(inode->i_sb);
 	vzquota_qlnk_destroy(&data->qlnk);
 }
@@ -1896,6 +2031,39 @@ static struct vzioctlinfo vzdqcalls = {
 	.owner		= THIS_MODULE,
 };
 
+/* how long statfs may report usage without looking at qmblk counters */
+#define VZDQ_STATFS_TTL		(HZ / 4)
+
+/*
+ * Lockless part of vzquota_dstat(): inode with actual qmblk and a recent
+ * enough snapshot of it. qmblk may be being switched from the inode, it is
+ * kept by rcu and the snapshot is cut of that qmblk anyway.
+ */
+static int vzquota_dstat_cached(struct inode *inode, struct dq_kstat *qstat)
+{
+	struct vz_quota_master *qmblk;
+	unsigned int seq;
+	int ok = 0;
+
+	rcu_read_lock();
+	qmblk = ACCESS_ONCE(INODE_QLNK(inode)->qmblk);
+	if (qmblk == NULL || qmblk == VZ_QUOTA_BAD ||
+	    (qmblk->dq_flags & (VZDQ_NOQUOT | VZDQ_NOACT)))
+		goto out;
+
+	do {
+		seq = read_seqcount_begin(&qmblk->dq_statfs_seq);
+		ok = qmblk->dq_statfs_valid &&
+			time_before(jiffies,
+				qmblk->dq_statfs_stamp + VZDQ_STATFS_TTL);
+		if (ok)
+			memcpy(qstat, &qmblk->dq_statfs, sizeof(*qstat));
+	} while (read_seqcount_retry(&qmblk->dq_statfs_seq, seq));
+out:
+	rcu_read_unlock();
+	return ok;
+}
+
 /**
  * vzquota_dstat - get quota usage info for virtual superblock
  */
@@ -1903,6 +2071,9 @@ static int vzquota_dstat(struct inode *inode, struct dq_kstat *qstat)
 {
 	struct vz_quota_master *qmblk;
 
+	if (IS_VZ_QUOTA(inode->i_sb) && vzquota_dstat_cached(inode, qstat))
+		return 0;
+
 	qmblk = vzquota_inode_qmblk(inode);
 	if (qmblk == NULL)
 		return -ENOENT;
@@ -1912,7 +2083,13 @@ static int vzquota_dstat(struct inode *inode, struct dq_kstat *qstat)
 	}
 
 	qmblk_data_read_lock(qmblk);
+	vzquota_qmblk_fold(qmblk);
 	memcpy(qstat, &qmblk->dq_stat, sizeof(*qstat));
+	write_seqcount_begin(&qmblk->dq_statfs_seq);
+	memcpy(&qmblk->dq_statfs, qstat, sizeof(*qstat));
+	qmblk->dq_statfs_stamp = jiffies;
+	qmblk->dq_statfs_valid = 1;
+	write_seqcount_end(&qmblk->dq_statfs_seq);
 	qmblk_data_read_unlock(qmblk);
 	qmblk_put(qmblk);
 	return 0;
@@ -2007,6 +2184,7 @@ static void vzquota_cache_release(void)
 			BUG();
 
 	/* release caches */
+	rcu_barrier();
 	kmem_cache_destroy(vzquota_cachep);
 	vzquota_cachep = NULL;
 }
@@ -5,6 +5,7 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/magic.h>
 #include <linux/mm.h>
 #include <linux/memcontrol.h>
 #include <linux/mm_inline.h>
@@ -18,6 +19,7 @@
 #include <linux/parser.h>
 #include <linux/pram.h>
 #include <linux/ramfs.h>
+#include <linux/shmem_fs.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/types.h>
@@ -39,6 +41,16 @@ static void pram_fs_msg(struct super_block *sb, const char *prefix,
 	va_end(ap);
 }
 
+/* tmpfs trees are saved too, see pram_name option of tmpfs */
+static inline bool is_tmpfs_inode(struct inode *inode)
+{
+#ifdef CONFIG_SHMEM
+	return inode->i_sb->s_magic == TMPFS_MAGIC;
+#else
+	return false;
+#endif
+}
+
 static int save_str(const char *str, int len, struct pram_stream *stream)
 {
 	__u32 __len = len;
@@ -142,6 +154,15 @@ static int load_mapping_pages(struct address_space *mapping,
 		}
 
 		offset = __offset;
+		if (is_tmpfs_inode(mapping->host)) {
+			/* charged and accounted by shmem */
+			err = shmem_insert_page(mapping->host, offset, page);
+			put_page(page);
+			if (err)
+				break;
+			continue;
+		}
+
 		if (!pram_page_dirty(page)) {
 			err = add_to_page_cache_lru(page, mapping, offset,
 						    GFP_KERNEL);
@@ -251,9 +272,14 @@ static int save_file(struct dentry *dentry,
 
 	if (S_ISLNK(mode))
 		err = save_symlink_value(dentry, meta_stream);
-	else if (S_ISREG(mode))
-		err = save_mapping_pages(inode->i_mapping,
-					 meta_stream, data_stream);
+	else if (S_ISREG(mode)) {
+		/* only pages in the mapping are saved */
+		if (is_tmpfs_inode(inode))
+			err = shmem_read_swapped_pages(inode);
+		if (!err)
+			err = save_mapping_pages(inode->i_mapping,
+						 meta_stream, data_stream);
+	}
 
 	return err;
 }
@@ -580,9 +606,9 @@ static inline const char *pram_fs_node_basename(struct super_block *sb,
  */
 static DEFINE_MUTEX(streams_mutex);
 
-static int open_streams(struct super_block *sb, int mode,
-			struct pram_stream *meta_stream,
-			struct pram_stream *data_stream)
+static int __open_streams(const char *basename, int mode,
+			  struct pram_stream *meta_stream,
+			  struct pram_stream *data_stream)
 {
 	char *buf;
 	size_t basename_len;
@@ -592,7 +618,7 @@ static int open_streams(struct super_block *sb, int mode,
 	if (!buf)
 		goto out;
 
-	pram_fs_node_basename(sb, buf, PAGE_SIZE);
+	strlcpy(buf, basename, PAGE_SIZE);
 	basename_len = strlen(buf);
 
 	mutex_lock(&streams_mutex);
@@ -621,6 +647,24 @@ out:
 	return err;
 }
 
+static int open_streams(struct super_block *sb, int mode,
+			struct pram_stream *meta_stream,
+			struct pram_stream *data_stream)
+{
+	char *buf;
+	int err;
+
+	buf = (char *)__get_free_page(GFP_TEMPORARY);
+	if (!buf)
+		return -ENOMEM;
+
+	pram_fs_node_basename(sb, buf, PAGE_SIZE);
+	err = __open_streams(buf, mode, meta_stream, data_stream);
+
+	free_page((unsigned long)buf);
+	return err;
+}
+
 static inline void close_streams(struct pram_stream *meta_stream,
 				 struct pram_stream *data_stream, int err)
 {
@@ -630,6 +674,53 @@ static inline void close_streams(struct pram_stream *meta_stream,
 	mutex_unlock(&streams_mutex);
 }
 
+/**
+ * pram_fs_save_tree - save a filesystem tree to pram
+ * @root: root of the tree
+ * @basename: prefix of the names of the pram streams
+ *
+ * Pages of regular files are moved to pram. Streams saved under the same
+ * name before are replaced. Used by tmpfs.
+ */
+int pram_fs_save_tree(struct dentry *root, const char *basename)
+{
+	struct pram_stream meta_stream, data_stream;
+	int err;
+
+	err = __open_streams(basename, PRAM_READ, &meta_stream, &data_stream);
+	if (!err)
+		close_streams(&meta_stream, &data_stream, 0);
+
+	err = __open_streams(basename, PRAM_WRITE, &meta_stream, &data_stream);
+	if (err)
+		return err;
+
+	err = save_tree(root, &meta_stream, &data_stream);
+	close_streams(&meta_stream, &data_stream, err);
+	return err;
+}
+
+/**
+ * pram_fs_load_tree - load a tree saved by pram_fs_save_tree()
+ * @mnt: mount to load the tree to
+ * @basename: prefix of the names of the pram streams
+ *
+ * The streams are destroyed. Returns -ENOENT if there are none.
+ */
+int pram_fs_load_tree(struct vfsmount *mnt, const char *basename)
+{
+	struct pram_stream meta_stream, data_stream;
+	int err;
+
+	err = __open_streams(basename, PRAM_READ, &meta_stream, &data_stream);
+	if (err)
+		return err;
+
+	err = load_tree(mnt, &meta_stream, &data_stream);
+	close_streams(&meta_stream, &data_stream, 0);
+	return err;
+}
+
 static void save_pram_fs(struct super_block *sb)
 {
 	struct pram_stream meta_stream, data_stream;
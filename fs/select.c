@@ -85,8 +85,8 @@ long select_estimate_accuracy(struct timespec *tv)
 	now = timespec_sub(*tv, now);
 	ret = __estimate_accuracy(&now);
 	if (ret < current->timer_slack_ns)
-		return current->timer_slack_ns;
-	return ret;
+		ret = current->timer_slack_ns;
+	return ve_timer_slack(timespec_to_ktime(*tv), ret);
 }
 
 
@@ -18,6 +18,7 @@
 #include <linux/mnt_namespace.h>
 #include <linux/mount.h>
 #include <linux/backing-dev.h>
+#include <linux/async.h>
 #include "internal.h"
 
 #include <bc/beancounter.h>
@@ -143,11 +144,102 @@ static int sync_collect_filesystems(struct ve_struct *ve, struct list_head *sync
 	return ret;
 }
 
+static void sync_one_filesystem(struct super_block *sb,
+		struct user_beancounter *ub, int wait)
+{
+	down_read(&sb->s_umount);
+	/*
+	 * If the file system is frozen we can't proceed because we
+	 * could potentially block on frozen file system. This would
+	 * lead to a deadlock, because we're holding s_umount which
+	 * has to be taken in order to  thaw the file system as well.
+	 * Frozen file system should be clean anyway so just skip it.
+	 */
+	if ((!sb_has_new_freeze(sb) && sb->s_frozen != SB_UNFROZEN) ||
+	    (sb->s_writers.frozen != SB_UNFROZEN))
+		goto skip;
+
+	if (!(sb->s_flags & MS_RDONLY) && sb->s_root && sb->s_bdi)
+		__sync_filesystem(sb, ub, wait);
+skip:
+	up_read(&sb->s_umount);
+}
+
+/*
+ * Filesystems of one backing device are synced one after another,
+ * filesystems of different devices (e.g. ploops of containers) in parallel.
+ */
+struct sync_bdi {
+	struct list_head list;
+	struct list_head sbs;
+	struct backing_dev_info *bdi;
+	struct user_beancounter *ub;
+	int wait;
+};
+
+static void sync_bdi_filesystems(void *data, async_cookie_t cookie)
+{
+	struct sync_bdi *sd = data;
+	struct sync_sb *ss;
+
+	list_for_each_entry(ss, &sd->sbs, list)
+		sync_one_filesystem(ss->sb, sd->ub, sd->wait);
+}
+
+static struct sync_bdi *sync_find_bdi(struct list_head *bdi_list,
+		struct backing_dev_info *bdi)
+{
+	struct sync_bdi *sd;
+
+	list_for_each_entry(sd, bdi_list, list)
+		if (sd->bdi == bdi)
+			return sd;
+	return NULL;
+}
+
+/*
+ * Sync the collected filesystems, the list is left with the filesystems
+ * which were synced in place for lack of memory.
+ */
+static void sync_collected_filesystems(struct list_head *sync_list,
+		struct user_beancounter *ub, int wait)
+{
+	ASYNC_DOMAIN_EXCLUSIVE(domain);
+	LIST_HEAD(bdi_list);
+	struct sync_bdi *sd, *tmp;
+	struct sync_sb *ss, *next;
+
+	list_for_each_entry_safe(ss, next, sync_list, list) {
+		sd = sync_find_bdi(&bdi_list, ss->sb->s_bdi);
+		if (sd == NULL) {
+			sd = kmalloc(sizeof(*sd), GFP_KERNEL);
+			if (sd == NULL) {
+				sync_one_filesystem(ss->sb, ub, wait);
+				continue;
+			}
+			INIT_LIST_HEAD(&sd->sbs);
+			sd->bdi = ss->sb->s_bdi;
+			sd->ub = ub;
+			sd->wait = wait;
+			list_add_tail(&sd->list, &bdi_list);
+		}
+		list_move_tail(&ss->list, &sd->sbs);
+	}
+
+	/* async falls back to a call in place when it is short of threads */
+	list_for_each_entry(sd, &bdi_list, list)
+		async_schedule_domain(sync_bdi_filesystems, sd, &domain);
+	async_synchronize_full_domain(&domain);
+
+	list_for_each_entry_safe(sd, tmp, &bdi_list, list) {
+		list_splice_tail(&sd->sbs, sync_list);
+		kfree(sd);
+	}
+}
+
 static void sync_filesystems_ve(struct ve_struct *ve, struct user_beancounter *ub, int wait)
 {
-	struct super_block *sb;
 	LIST_HEAD(sync_list);
-	struct sync_sb *ss;
 
 	mutex_lock(&ve->sync_mutex);		/* Could be down_interruptible */
 
@@ -157,15 +249,7 @@ static void sync_filesystems_ve(struct ve_struct *ve, struct user_beancounter *u
 	 * Let's sync what we collected already instead.
 	 */
 	sync_collect_filesystems(ve, &sync_list);
-
-	list_for_each_entry(ss, &sync_list, list) {
-		sb = ss->sb;
-		down_read(&sb->s_umount);
-		if (!(sb->s_flags & MS_RDONLY) && sb->s_root && sb->s_bdi)
-			__sync_filesystem(sb, ub, wait);
-		up_read(&sb->s_umount);
-	}
-
+	sync_collected_filesystems(&sync_list, ub, wait);
 	sync_release_filesystems(&sync_list);
 
 	mutex_unlock(&ve->sync_mutex);
@@ -187,7 +271,9 @@ static void sync_filesystems_ve(struct ve_struct *ve, struct user_beancounter *u
  */
 static void sync_filesystems_ve0(struct user_beancounter *ub, int wait)
 {
-	struct super_block *sb;
+	struct super_block *sb, *p = NULL;
+	LIST_HEAD(sync_list);
+	struct sync_sb *ss;
 	static DEFINE_MUTEX(mutex);
 
 	mutex_lock(&mutex);		/* Could be down_interruptible */
@@ -195,38 +281,32 @@ static void sync_filesystems_ve0(struct user_beancounter *ub, int wait)
 	list_for_each_entry(sb, &super_blocks, s_list)
 		sb->s_need_sync = 1;
 
-restart:
 	list_for_each_entry(sb, &super_blocks, s_list) {
-		if (!sb->s_need_sync)
+		if (!sb->s_need_sync || list_empty(&sb->s_instances))
 			continue;
 		sb->s_need_sync = 0;
 		sb->s_count++;
 		spin_unlock(&sb_lock);
 
-		down_read(&sb->s_umount);
-		/*
-		 * If the file system is frozen we can't proceed because we
-		 * could potentially block on frozen file system. This would
-		 * lead to a deadlock, because we're holding s_umount which
-		 * has to be taken in order to  thaw the file system as well.
-		 * Frozen file system should be clean anyway so just skip it.
-		 */
-		if ((!sb_has_new_freeze(sb) && sb->s_frozen != SB_UNFROZEN) ||
-		    (sb->s_writers.frozen != SB_UNFROZEN))
-			goto skip;
-
-		if (!(sb->s_flags & MS_RDONLY) && sb->s_root && sb->s_bdi)
-			__sync_filesystem(sb, ub, wait);
-
-skip:
-		up_read(&sb->s_umount);
+		/* collected filesystems keep their reference till synced */
+		ss = kmalloc(sizeof(*ss), GFP_KERNEL);
+		if (ss != NULL) {
+			ss->sb = sb;
+			list_add_tail(&ss->list, &sync_list);
+		} else
+			sync_one_filesystem(sb, ub, wait);
 
-		/* restart only when sb is no longer on the list */
 		spin_lock(&sb_lock);
-		if (__put_super_and_need_restart(sb))
-			goto restart;
+		if (p)
+			__put_super(p);
+		p = ss ? NULL : sb;
 	}
+	if (p)
+		__put_super(p);
 	spin_unlock(&sb_lock);
+
+	sync_collected_filesystems(&sync_list, ub, wait);
+	sync_release_filesystems(&sync_list);
 	mutex_unlock(&mutex);
 }
 
@@ -88,6 +88,21 @@ struct ubparm {
 	int		max_precharge;
 };
 
+/*
+ * Record of /proc/bc/iolat: I/O completion latency histogram of one
+ * beancounter. Bucket 0 counts requests completed in less than 1us,
+ * bucket i counts requests completed in [2^(i-1), 2^i) us, the last
+ * bucket also takes everything slower.
+ */
+#define UB_IOLAT_BUCKETS	24
+
+struct ub_iolat_stat {
+	unsigned int		id;
+	unsigned int		nr_buckets;
+	unsigned long long	read[UB_IOLAT_BUCKETS];
+	unsigned long long	write[UB_IOLAT_BUCKETS];
+};
+
 /*
  * Kernel internal part.
  */
@@ -118,10 +133,12 @@ struct ubparm {
  *   task pointers are set only for current task and only once
  *   refcount is managed atomically
  *   value and limit comparison and change are protected by per-ub spinlock
+ *   charges within percpu precharge reserve are done without per-ub spinlock
  */
 
 struct task_beancounter;
 struct sock_beancounter;
+struct futex_hash;
 
 struct page_private {
 	unsigned long		ubp_tmpfs_respages;
@@ -132,13 +149,24 @@ struct sock_private {
 	unsigned long		ubp_wmem_pressure;
 	unsigned long		ubp_maxadvmss;
 	unsigned long		ubp_rmem_pressure;
-	int			ubp_tw_count;
 #define UB_RMEM_EXPAND          0
 #define UB_RMEM_KEEP            1
 #define UB_RMEM_SHRINK          2
 	struct list_head	ubp_other_socks;
 	struct list_head	ubp_tcp_socks;
 	struct percpu_counter	ubp_orphan_count;
+	struct percpu_counter	ubp_tw_count;
+};
+
+/* time spent by tasks in memory reclaim and reclaim throttling */
+struct ub_stall {
+	spinlock_t	lock;
+	int		nr;		/* tasks stalled right now */
+	u64		some_start;
+	u64		full_start;
+	u64		some;		/* ns with at least one task stalled */
+	u64		full;		/* ns with all tasks stalled */
+	u64		total;		/* ns stalled, summed over tasks */
 };
 
 struct ub_percpu_struct {
@@ -156,12 +184,24 @@ struct ub_percpu_struct {
 	unsigned long vswapin;
 	unsigned long vswapout;
 
+	/* direct compaction on behalf of the tasks of the beancounter */
+	unsigned long compact_stall;
+	unsigned long compact_fail;
+	unsigned long compact_success;
+	unsigned long compact_throttled;
+	u64 compact_time;	/* ns */
+
 #ifdef CONFIG_BC_IO_ACCOUNTING
 	unsigned long async_write_complete;
 	unsigned long async_write_canceled;
+	/* completed pages not yet reported to VITYPE_IO notifiers */
+	unsigned int async_write_unaccounted;
 	unsigned long long sync_write_bytes;
 	unsigned long long sync_read_bytes;
 #endif
+#ifdef CONFIG_BC_IO_PRIORITY
+	unsigned long iolat[2][UB_IOLAT_BUCKETS];
+#endif
 #ifdef CONFIG_BC_DEBUG_KMEM
 	long	pages_charged;
 	long	vmalloc_charged;
@@ -180,10 +220,17 @@ struct ub_percpu_struct {
 
 	/* percpu resource precharge */
 	int	precharge[UB_RESOURCES];
+	/* adaptive percpu precharge bound and time of last refill */
+	int		precharge_size[UB_RESOURCES];
+	unsigned long	precharge_stamp[UB_RESOURCES];
 
 	int pincount;
 };
 
+#define UB_SLAB_CACHES		BITS_PER_LONG
+
+struct ub_meminfo_cache;
+
 struct user_beancounter
 {
 	unsigned long		ub_magic;
@@ -198,8 +245,8 @@ struct user_beancounter
 	union {
 		struct list_head ub_leaked_list;
 		struct rcu_head rcu;
-		struct work_struct work;
-		struct delayed_work dwork;
+		/* on the release, then on the cleanup batch of ubcleand */
+		struct list_head ub_release_node;
 	};
 
 	spinlock_t		ub_lock;
@@ -227,7 +274,17 @@ struct user_beancounter
 	atomic_long_t		wb_requests;
 	atomic_long_t		wb_sectors;
 
+	/* async writeback bandwidth estimate, see ub_update_write_bandwidth */
+	unsigned long		wb_bw;		/* pages per second */
+	unsigned long		wb_bw_stamp;	/* jiffies */
+	unsigned long		wb_bw_written;	/* pages completed at stamp */
+
 	unsigned long		ub_swapentries; /* under swap_lock */
+	/* preferred swap area and own swap cluster, see mm/swapfile.c */
+	int			ub_swap_prefer;	/* type + 1, 0 if none */
+	int			ub_swap_cluster_type; /* type + 1, under swap_lock */
+	unsigned int		ub_swap_cluster_next;
+	unsigned int		ub_swap_cluster_nr;
 
 #ifdef CONFIG_BC_RSS_ACCOUNTING
 	struct gang_set		gang_set;
@@ -238,6 +295,40 @@ struct user_beancounter
 	unsigned		rl_step;	/* ns per page */
 	ktime_t			rl_wall;	/* wall time */
 
+	struct ub_stall		ub_stall;
+
+	/* background reclaim of physpages */
+	struct work_struct	ub_reclaim_work;
+	unsigned long		ub_bg_reclaimed;
+
+	/* page cache soft limit, see ub_cache_over_limit() */
+	unsigned long		ub_cache_limit;	/* pages, 0 if none */
+
+	/* direct compaction budget, see ub_compact_allowed() */
+	unsigned int		ub_compact_budget; /* ms per second, 0 if none */
+	unsigned long		ub_compact_stamp;  /* jiffies, start of period */
+	u64			ub_compact_spent;  /* ns in period */
+
+	/* ksm, the scan budget is racy between node ksmds */
+	atomic_long_t		ub_ksm_merged;	/* pages mapped from ksm pages */
+	unsigned long		ub_ksm_scanned;	/* in scan round ub_ksm_seqnr */
+	unsigned long		ub_ksm_seqnr;
+
+	/* last meminfo and vmstat of the VE, see kernel/bc/vm_pages.c */
+	struct ub_meminfo_cache	*ub_meminfo;
+
+	/* private futex hash of the VE, set once, see kernel/futex.c */
+	struct futex_hash	*ub_futex_hash;
+
+	/* THP modes of the VE and khugepaged budget, see mm/huge_memory.c */
+	unsigned int		ub_thp_mode;
+	unsigned int		ub_thp_collapsed; /* in scan ub_thp_seqnr */
+	unsigned int		ub_thp_seqnr;
+
+	/* SLAB_UB_PAGES caches, under ub_slab_mutex in mm/slab.c */
+	struct kmem_cache	*ub_slab_caches[UB_SLAB_CACHES];
+	unsigned long		ub_slab_pending;	/* creation is queued */
+
 	struct cgroup		*ub_cgroup;
 	struct cgroup __rcu	*mem_cgroup;
 
@@ -249,18 +340,36 @@ struct user_beancounter
 	int			ub_dentry_batch;
 	unsigned long		ub_dentry_pruned;
 
+	/* unaliased inodes, under inode_lock */
+	struct list_head	ub_inode_lru;
+	int			ub_inode_unused;
+	unsigned long		ub_inode_pruned;
+	struct work_struct	ub_icache_work;
+
 	/* resources statistic and settings */
 	struct ubparm		ub_parms[UB_RESOURCES];
 	/* resources statistic for last interval */
 	struct ubparm		*ub_store;
 
 	struct ub_percpu_struct	*ub_percpu;
+	/* privvmpages charged into the reserves of mms, see ub_privvm_charge() */
+	atomic_long_t		ub_privvm_reserve;
 	struct oom_control	oom_ctrl;
 
 	struct rb_node		dc_node;
 	unsigned int		dc_time;
 	unsigned int		dc_shrink_ts;
 	unsigned int		ub_dcache_threshold;
+	unsigned int		ub_icache_threshold;
+
+	/* eventfd subscriptions, under ub_lock */
+	unsigned long		ub_event_mask;
+	struct list_head	ub_events;
+
+	/* user space OOM handler, under oom_ctrl.lock */
+	struct eventfd_ctx	*ub_oom_eventfd;
+	unsigned int		ub_oom_deadline;	/* msecs */
+	unsigned long		ub_oom_expires;		/* 0 - no OOM pending */
 };
 
 enum ub_flags {
@@ -268,6 +377,7 @@ enum ub_flags {
 	UB_OOM_NOPROC,
 	UB_PAGECACHE_ISOLATION,
 	UB_UNDERFLOW,
+	UB_BG_RECLAIM,
 };
 
 extern int ub_count;
@@ -572,6 +682,15 @@ static inline void __ub_stat_flush_pcpu(atomic_long_t *stat, int *pcpu)
 #define ub_stat_flush_pcpu(ub, name)	__ub_stat_flush_pcpu(&(ub)->name, &(ub)->ub_percpu->name)
 
 int ubstat_alloc_store(struct user_beancounter *ub);
+void ub_free_events(struct user_beancounter *ub);
+void __ub_post_event(struct user_beancounter *ub, int resource);
+
+/* called under ub_lock after failcnt or held change */
+static inline void ub_post_event(struct user_beancounter *ub, int resource)
+{
+	if (unlikely(ub->ub_event_mask & (1UL << resource)))
+		__ub_post_event(ub, resource);
+}
 
 /*
  *	Resource charging
@@ -597,7 +716,32 @@ void uncharge_beancounter_fast(struct user_beancounter *ub,
 		int resource, unsigned long val);
 
 extern int ub_resource_precharge[UB_RESOURCES];
+extern int ub_precharge_adaptive;
 void init_beancounter_precharge(struct user_beancounter *ub, int resource);
+void ub_precharge_size_snapshot(struct user_beancounter *ub, int *size);
+
+/* upper bound for max_precharge, grows in adaptive mode */
+static inline int ub_precharge_bound(int resource)
+{
+	return min_t(long, INT_MAX / NR_CPUS,
+			(long)ub_resource_precharge[resource] <<
+			ub_precharge_adaptive);
+}
+
+/*
+ * Current percpu precharge bound. It starts from the default precharge and
+ * in adaptive mode moves between it and max_precharge depending on refill
+ * rate, max_precharge itself shrinks when the beancounter approaches limit.
+ */
+static inline int ub_percpu_max_precharge(struct user_beancounter *ub,
+		struct ub_percpu_struct *ub_pcpu, int resource)
+{
+	int size = ub_pcpu->precharge_size[resource];
+
+	if (!size)
+		size = ub_resource_precharge[resource];
+	return min(size, ub->ub_parms[resource].max_precharge);
+}
 
 static inline int __try_charge_beancounter_percpu(struct user_beancounter *ub,
 		struct ub_percpu_struct *ub_pcpu, int resource, unsigned long val)
@@ -617,7 +761,7 @@ static inline int __try_uncharge_beancounter_percpu(struct user_beancounter *ub,
 	BUG_ON(ub->ub_parms[resource].max_precharge < 0);
 
 	if (likely(ub_pcpu->precharge[resource] + val <=
-				ub->ub_parms[resource].max_precharge)) {
+			ub_percpu_max_precharge(ub, ub_pcpu, resource))) {
 		ub_pcpu->precharge[resource] += val;
 		return 0;
 	}
@@ -669,10 +813,19 @@ void ub_reclaim_rate_limit(struct user_beancounter *ub, int wait, unsigned count
 
 #define UB_IOPRIO_MIN 0
 #define UB_IOPRIO_MAX 8
+#define UB_WB_QUANTUM 4
 #ifdef CONFIG_BC_IO_PRIORITY
 extern int ub_set_ioprio(int id, int ioprio);
+extern void ub_io_lat_account(struct user_beancounter *ub, int rw, u64 ns);
+extern int ub_ioprio_quantum(struct user_beancounter *ub);
 #else
 static inline int ub_set_ioprio(int veid, int ioprio) { return -EINVAL; }
+static inline void ub_io_lat_account(struct user_beancounter *ub,
+		int rw, u64 ns) { }
+static inline int ub_ioprio_quantum(struct user_beancounter *ub)
+{
+	return UB_WB_QUANTUM;
+}
 #endif
 
 extern void ub_init_ioprio(struct user_beancounter *ub);
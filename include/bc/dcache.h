@@ -17,6 +17,8 @@ UB_DECLARE_VOID_FUNC(ub_dcache_unuse(struct user_beancounter *ub))
 UB_DECLARE_FUNC(int, ub_dcache_reclaim(struct user_beancounter *ub, unsigned long, unsigned long))
 UB_DECLARE_FUNC(int, ub_dcache_shrink(struct user_beancounter *ub, unsigned long size, gfp_t gfp_mask))
 UB_DECLARE_FUNC(unsigned long, ub_dcache_get_size(struct dentry *dentry))
+UB_DECLARE_VOID_FUNC(ub_icache_kick(struct user_beancounter *ub))
+UB_DECLARE_VOID_FUNC(ub_init_icache(struct user_beancounter *ub))
 
 extern unsigned int dcache_update_time(void);
 
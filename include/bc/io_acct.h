@@ -19,6 +19,8 @@
 
 extern int ub_dirty_radio;
 extern int ub_dirty_background_ratio;
+extern int ub_io_account_batch;
+extern int ub_dirty_ioless;
 
 /*
  * IO ub is required in task context only, so if exec_ub is set
@@ -50,11 +52,31 @@ static inline void ub_io_account_write(size_t bytes)
 	virtinfo_notifier_call(VITYPE_IO, VIRTINFO_IO_ACCOUNT, &bytes);
 }
 
-extern void ub_io_account_dirty(struct address_space *mapping);
-extern void ub_io_account_clean(struct address_space *mapping);
-extern void ub_io_account_cancel(struct address_space *mapping);
-extern void ub_io_writeback_inc(struct address_space *mapping);
-extern void ub_io_writeback_dec(struct address_space *mapping);
+struct bio;
+
+/* bio is about to be submitted, used for per-device limits */
+static inline void ub_io_account_bio(struct bio *bio)
+{
+	virtinfo_notifier_call(VITYPE_IO, VIRTINFO_IO_BIO, bio);
+}
+
+extern void ub_io_account_dirty(struct address_space *mapping,
+				struct page *page);
+extern void ub_io_account_clean(struct address_space *mapping,
+				struct page *page);
+extern void ub_io_account_cancel(struct address_space *mapping,
+				 struct page *page);
+extern void ub_io_writeback_inc(struct address_space *mapping,
+				struct page *page);
+extern void ub_io_writeback_dec(struct address_space *mapping,
+				struct page *page);
+
+extern struct address_space *ub_io_lock_page_owner(struct page *page,
+						   unsigned long *flags);
+extern void ub_io_unlock_page_owner(struct page *page,
+		struct address_space *mapping,
+		struct user_beancounter *from, unsigned long flags);
+extern void ub_io_junk_pages(struct user_beancounter *ub);
 
 #define ub_dirty_pages(ub)	ub_stat_get(ub, dirty_pages)
 
@@ -63,6 +85,13 @@ extern int ub_dirty_limits(unsigned long *pbackground,
 
 extern bool ub_should_skip_writeback(struct user_beancounter *ub,
 				     struct inode *inode);
+extern bool ub_should_delay_writeback(struct user_beancounter *ub,
+				      struct inode *inode);
+
+extern void ub_update_write_bandwidth(struct user_beancounter *ub);
+extern unsigned long ub_dirty_pause(struct user_beancounter *ub,
+		unsigned long dirty, unsigned long background,
+		unsigned long thresh, unsigned long pages_dirtied);
 
 static inline void ub_writeback_io(unsigned long requests, unsigned long sectors)
 {
@@ -81,23 +110,50 @@ static inline void ub_io_account_write(size_t bytes)
 {
 }
 
-static inline void ub_io_account_dirty(struct address_space *mapping)
+static inline void ub_io_account_bio(struct bio *bio)
+{
+}
+
+static inline void ub_io_account_dirty(struct address_space *mapping,
+				       struct page *page)
 {
 }
 
-static inline void ub_io_account_clean(struct address_space *mapping)
+static inline void ub_io_account_clean(struct address_space *mapping,
+				       struct page *page)
 {
 }
 
-static inline void ub_io_account_cancel(struct address_space *mapping)
+static inline void ub_io_account_cancel(struct address_space *mapping,
+					struct page *page)
 {
 }
 
-static inline void ub_io_writeback_inc(struct address_space *mapping)
+static inline void ub_io_writeback_inc(struct address_space *mapping,
+				       struct page *page)
 {
 }
 
-static inline void ub_io_writeback_dec(struct address_space *mapping)
+static inline void ub_io_writeback_dec(struct address_space *mapping,
+				       struct page *page)
+{
+}
+
+static inline struct address_space *ub_io_lock_page_owner(struct page *page,
+							  unsigned long *flags)
+{
+	local_irq_save(*flags);
+	return NULL;
+}
+
+static inline void ub_io_unlock_page_owner(struct page *page,
+		struct address_space *mapping,
+		struct user_beancounter *from, unsigned long flags)
+{
+	local_irq_restore(flags);
+}
+
+static inline void ub_io_junk_pages(struct user_beancounter *ub)
 {
 }
 
@@ -118,6 +174,25 @@ static inline bool ub_should_skip_writeback(struct user_beancounter *ub,
 	return false;
 }
 
+#define ub_dirty_ioless		0
+
+static inline bool ub_should_delay_writeback(struct user_beancounter *ub,
+					     struct inode *inode)
+{
+	return false;
+}
+
+static inline void ub_update_write_bandwidth(struct user_beancounter *ub)
+{
+}
+
+static inline unsigned long ub_dirty_pause(struct user_beancounter *ub,
+		unsigned long dirty, unsigned long background,
+		unsigned long thresh, unsigned long pages_dirtied)
+{
+	return 0;
+}
+
 #endif /* UBC_IO_ACCT */
 
 #endif
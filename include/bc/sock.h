@@ -33,6 +33,13 @@ struct sock_beancounter {
 	 */
 	unsigned long           poll_reserv;
 	unsigned long		forw_space;
+	/*
+	 * Space charged in advance for UB_OTHERSOCKBUF skbs when the
+	 * beancounter is far from the barrier, so that per-skb charge and
+	 * uncharge take only the socket batch_lock.
+	 */
+	unsigned long		batch_reserv;
+	spinlock_t		batch_lock;
 	/* fields below are protected by bc spinlock */
 	unsigned long           ub_waitspc;     /* space waiting for */
 	unsigned long           ub_wcharged;
@@ -34,21 +34,35 @@ static inline void ub_dec_orphan_count(struct sock *sk)
 	percpu_counter_dec(__ub_get_orphan_count_ptr(sk));
 }
 
+/* exact value, sums all the cpus */
 static inline int ub_get_orphan_count(struct sock *sk)
 {
 	return percpu_counter_sum_positive(__ub_get_orphan_count_ptr(sk));
 }
 
-extern int __ub_too_many_orphans(struct sock *sk, int count);
-static inline int ub_too_many_orphans(struct sock *sk, int count)
+extern int __ub_orphan_limit(struct sock *sk);
+static inline int ub_orphan_limit(struct sock *sk)
 {
+	int limit = sysctl_tcp_max_orphans;
+
 #ifdef CONFIG_BEANCOUNTERS
-	if (__ub_too_many_orphans(sk, count))
-		return 1;
+	if (sock_has_ubc(sk))
+		limit = min(limit, __ub_orphan_limit(sk));
 #endif
-	return (ub_get_orphan_count(sk) > sysctl_tcp_max_orphans ||
-		(sk->sk_wmem_queued > SOCK_MIN_SNDBUF &&
-		 atomic_read(&tcp_memory_allocated) > sysctl_tcp_mem[2]));
+	return limit;
+}
+
+/*
+ * The number of orphans is penalized by @shift. The counter is summed
+ * over the cpus only when its approximate value is close to the limit.
+ */
+static inline int ub_too_many_orphans(struct sock *sk, int shift)
+{
+	if (percpu_counter_compare(__ub_get_orphan_count_ptr(sk),
+				ub_orphan_limit(sk) >> shift) > 0)
+		return 1;
+	return (sk->sk_wmem_queued > SOCK_MIN_SNDBUF &&
+		atomic_read(&tcp_memory_allocated) > sysctl_tcp_mem[2]);
 }
 
 #include <bc/kmem.h>
@@ -62,27 +76,37 @@ static inline void ub_timewait_mod(struct inet_timewait_sock *tw, int incdec)
 
 	ub = slab_ub(tw);
 	if (ub != NULL)
-		ub->ub_tw_count += incdec;
+		percpu_counter_add(&ub->ub_tw_count, incdec);
 #endif
 }
 
-static inline int __ub_timewait_check(struct sock *sk)
+/*
+ * A VE may hold no more buckets than tcp_max_tw_buckets_ub, than
+ * tcp_max_tw_ub_share percent of the whole death row and than fit into
+ * the tcp_max_tw_kmem_fraction part of its kmemsize.
+ */
+static inline int __ub_timewait_check(struct sock *sk,
+		struct inet_timewait_death_row *twdr)
 {
 #ifdef CONFIG_BEANCOUNTERS
 	struct user_beancounter *ub;
-	unsigned long mem_max, mem;
-	int tw_count;
+	unsigned long mem_max, objuse;
+	s64 limit;
 
 	ub = sock_bc(sk)->ub;
 	if (ub == NULL)
 		return 1;
 
-	tw_count = ub->ub_tw_count;
+	limit = min_t(s64, sysctl_tcp_max_tw_buckets_ub,
+		(s64)twdr->sysctl_max_tw_buckets * sysctl_tcp_max_tw_ub_share / 100);
+
 	mem_max = sysctl_tcp_max_tw_kmem_fraction *
 		((ub->ub_parms[UB_KMEMSIZE].limit >> 10) + 1);
-	mem = kmem_cache_objuse(sk->sk_prot_creator->twsk_prot->twsk_slab);
-	mem *= tw_count;
-	return tw_count < sysctl_tcp_max_tw_buckets_ub && mem < mem_max;
+	objuse = kmem_cache_objuse(sk->sk_prot_creator->twsk_prot->twsk_slab);
+	if (objuse)
+		limit = min_t(s64, limit, DIV_ROUND_UP(mem_max, objuse));
+
+	return percpu_counter_compare(&ub->ub_tw_count, limit) < 0;
 #else
 	return 1;
 #endif
@@ -99,6 +123,6 @@ static inline int __ub_timewait_check(struct sock *sk)
 	} while (0)
 
 #define ub_timewait_check(sk, twdr) ((!(twdr)->ub_managed) || \
-					__ub_timewait_check(sk))
+					__ub_timewait_check(sk, twdr))
 
 #endif
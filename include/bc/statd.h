@@ -18,6 +18,9 @@
 #define UBSTAT_UBLIST			0x040000
 #define UBSTAT_UBPARMNUM		0x050000
 #define UBSTAT_GETTIME			0x060000
+#define UBSTAT_READ_BULK		0x070000
+#define UBSTAT_EVENTFD			0x080000
+#define UBSTAT_OOMFD			0x090000
 
 #define UBSTAT_CMD(func)		((func) & 0xF0000)
 #define UBSTAT_PARMID(func)		((func) & 0x0FFFF)
@@ -60,7 +63,78 @@ typedef struct {
 	ubstatparmf_t	param[0];
 } ubstatfull_t;
 
+/*
+ * UBSTAT_READ_BULK: current values of all top-level beancounters in one
+ * call. Buffer starts with ubstatbulk_t header followed by nr_entries
+ * records of entry_size bytes each, every record is ubstatbulkent_t with
+ * nr_resources parameters. Fields are fixed-width for compat tasks.
+ */
+#define UBSTAT_BULK_VERSION		1
+
+typedef struct {
+	__u32		version;
+	__u32		nr_resources;
+	__u32		entry_size;
+	__u32		nr_entries;
+	__u64		cur_time;
+} ubstatbulk_t;
+
+typedef struct {
+	__u64		held;
+	__u64		maxheld;
+	__u64		barrier;
+	__u64		limit;
+	__u64		failcnt;
+} ubstatbulkparm_t;
+
+typedef struct {
+	__u32		uid;
+	__u32		__unused;
+	ubstatbulkparm_t param[0];
+} ubstatbulkent_t;
+
+/*
+ * UBSTAT_EVENTFD: eventfd is signalled each time failcnt of the resource
+ * grows and each time held crosses non-zero threshold in either direction.
+ */
+#define UBSTAT_EVENT_UNREGISTER		0x1
+
+typedef struct {
+	__s32		eventfd;
+	__u32		flags;
+	__u64		threshold;
+} ubeventrq_t;
+
+/*
+ * UBSTAT_OOMFD: OOM in the beancounter is first left to user space. The
+ * eventfd is signalled and the kernel waits up to deadline_ms for memory
+ * to be freed, candidates are listed in /proc/bc/<id>/oom_tasks. Request
+ * with UBSTAT_OOM_HANDLED ends the wait, another OOM within deadline_ms
+ * after the wait is handled by the kernel. UBSTAT_EVENT_UNREGISTER drops
+ * the handler.
+ */
+#define UBSTAT_OOM_HANDLED		0x2
+#define UBSTAT_OOM_MAX_DEADLINE		5000
+
+typedef struct {
+	__s32		eventfd;
+	__u32		flags;
+	__u32		deadline_ms;
+	__u32		__unused;
+} uboomrq_t;
+
 #ifdef __KERNEL__
+struct ub_event {
+	struct list_head	list;
+	struct eventfd_ctx	*eventfd;
+	int			resource;
+	int			above;
+	unsigned long		threshold;
+	unsigned long		failcnt;
+};
+
+#define UB_MAX_EVENTS		64
+
 struct ub_stat_notify {
 	struct list_head	list;
 	struct task_struct	*task;
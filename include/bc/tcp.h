@@ -32,9 +32,34 @@ static inline void ub_tcp_update_maxadvmss(struct sock *sk)
 #endif
 }
 
+/*
+ * TCP memory pressure as seen by a socket. A beancounter with limited TCP
+ * buffers has a state of its own: it is under pressure once any of them
+ * is over the barrier, the global state set at tcp_mem[1] does not touch
+ * it and only the hard tcp_mem[2] is kept as a backstop. Sockets of other
+ * beancounters follow the global state.
+ */
+static inline int ub_tcp_sk_pressure(struct sock *sk)
+{
+#ifdef CONFIG_BEANCOUNTERS
+	if (sock_has_ubc(sk)) {
+		struct ubparm *snd, *rcv;
+
+		snd = &sock_bc(sk)->ub->ub_parms[UB_TCPSNDBUF];
+		rcv = &sock_bc(sk)->ub->ub_parms[UB_TCPRCVBUF];
+		if (snd->barrier != UB_MAXVALUE && rcv->barrier != UB_MAXVALUE)
+			return snd->held > snd->barrier ||
+			       rcv->held > rcv->barrier ||
+			       atomic_read(&tcp_memory_allocated) >
+					sysctl_tcp_mem[2];
+	}
+#endif
+	return tcp_memory_pressure;
+}
+
 static inline int ub_tcp_rmem_allows_expand(struct sock *sk)
 {
-	if (tcp_memory_pressure)
+	if (ub_tcp_sk_pressure(sk))
 		return 0;
 #ifdef CONFIG_BEANCOUNTERS
 	if (sock_has_ubc(sk)) {
@@ -53,7 +78,7 @@ static inline int ub_tcp_rmem_allows_expand(struct sock *sk)
 
 static inline int ub_tcp_memory_pressure(struct sock *sk)
 {
-	if (tcp_memory_pressure)
+	if (ub_tcp_sk_pressure(sk))
 		return 1;
 #ifdef CONFIG_BEANCOUNTERS
 	if (sock_has_ubc(sk))
@@ -64,7 +89,7 @@ static inline int ub_tcp_memory_pressure(struct sock *sk)
 
 static inline int ub_tcp_shrink_rcvbuf(struct sock *sk)
 {
-	if (tcp_memory_pressure)
+	if (ub_tcp_sk_pressure(sk))
 		return 1;
 #ifdef CONFIG_BEANCOUNTERS
 	if (sock_has_ubc(sk))
@@ -18,6 +18,7 @@
 #include <bc/decl.h>
 
 extern int glob_ve_meminfo;
+extern int ub_meminfo_cache_time;
 
 /*
  * Check whether vma has private or copy-on-write mapping.
@@ -38,6 +39,12 @@ UB_DECLARE_VOID_FUNC(ub_memory_uncharge(struct mm_struct *mm,
 			unsigned vm_flags,
 			struct file *vm_file))
 
+UB_DECLARE_FUNC(int, ub_privvm_charge(struct mm_struct *mm,
+			unsigned long pages, int strict))
+UB_DECLARE_VOID_FUNC(ub_privvm_uncharge(struct mm_struct *mm,
+			unsigned long pages))
+UB_DECLARE_VOID_FUNC(ub_privvm_release(struct mm_struct *mm))
+
 struct shmem_inode_info;
 UB_DECLARE_VOID_FUNC(ub_tmpfs_respages_inc(struct shmem_inode_info *shi))
 UB_DECLARE_VOID_FUNC(ub_tmpfs_respages_sub(struct shmem_inode_info *shi,
@@ -93,6 +100,16 @@ static inline void ub_swapentry_recharge(struct swap_info_struct *si, pgoff_t of
 
 #endif /* CONFIG_BC_SWAP_ACCOUNTING */
 
+#if defined(CONFIG_BC_SWAP_ACCOUNTING) && defined(CONFIG_SWAP)
+extern int ub_swap_set_prefer(struct user_beancounter *ub, const char *path);
+#else
+static inline int ub_swap_set_prefer(struct user_beancounter *ub,
+				     const char *path)
+{
+	return -ENOSYS;
+}
+#endif
+
 
 #ifdef CONFIG_BC_RSS_ACCOUNTING
 
@@ -101,6 +118,18 @@ void ub_hugetlb_uncharge(struct page *page);
 
 int ub_try_to_free_pages(struct user_beancounter *ub, gfp_t gfp_mask);
 
+extern int ub_bg_reclaim_low;
+extern int ub_bg_reclaim_high;
+void ub_init_bg_reclaim(struct user_beancounter *ub);
+int __init ub_init_bg_reclaim_wq(void);
+
+int ub_cache_over_limit(struct user_beancounter *ub);
+
+static inline int ub_cache_limited(struct user_beancounter *ub)
+{
+	return top_beancounter(ub)->ub_cache_limit != 0;
+}
+
 extern int ub_phys_charge(struct user_beancounter *ub,
 		unsigned long pages, gfp_t gfp_mask);
 
@@ -132,6 +161,19 @@ static inline int ub_try_to_free_pages(struct user_beancounter *ub, gfp_t gfp_ma
 	return -ENOSYS;
 }
 
+static inline void ub_init_bg_reclaim(struct user_beancounter *ub) { }
+static inline int ub_init_bg_reclaim_wq(void) { return 0; }
+
+static inline int ub_cache_over_limit(struct user_beancounter *ub)
+{
+	return 0;
+}
+
+static inline int ub_cache_limited(struct user_beancounter *ub)
+{
+	return 0;
+}
+
 static inline int ub_phys_charge(struct user_beancounter *ub,
 		unsigned long pages, gfp_t gfp_mask)
 {
@@ -155,6 +197,27 @@ static inline int ub_precharge_hpage(struct mm_struct *mm)
 }
 #endif /* CONFIG_BC_RSS_ACCOUNTING */
 
+#if defined(CONFIG_BEANCOUNTERS) && defined(CONFIG_COMPACTION)
+bool ub_compact_allowed(struct user_beancounter *ub);
+u64 ub_compact_start(struct user_beancounter *ub);
+void ub_compact_end(struct user_beancounter *ub, u64 start);
+#else
+static inline bool ub_compact_allowed(struct user_beancounter *ub)
+{
+	return true;
+}
+static inline u64 ub_compact_start(struct user_beancounter *ub)
+{
+	return 0;
+}
+static inline void ub_compact_end(struct user_beancounter *ub, u64 start) { }
+#endif
+
+u64 ub_stall_start(struct user_beancounter *ub);
+void ub_stall_end(struct user_beancounter *ub, u64 start);
+void ub_stall_read(struct user_beancounter *ub,
+		u64 *some, u64 *full, u64 *total);
+
 void __show_ub_mem(struct user_beancounter *ub);
 void show_ub_mem(struct user_beancounter *ub);
 
@@ -635,6 +635,8 @@ struct cgroup *cgroup_kernel_open(struct cgroup *parent,
 		enum cgroup_open_flags flags, char *name);
 int cgroup_kernel_remove(struct cgroup *parent, char *name);
 int cgroup_kernel_attach(struct cgroup *cgrp, struct task_struct *tsk);
+int cgroup_kernel_attach_many(struct cgroup **cgrps, int nr,
+			      struct task_struct *tsk);
 void cgroup_kernel_close(struct cgroup *cgrp);
 int cpt_collect_cgroups(struct vfsmount *mnt,
 			int (*cb)(struct cgroup *cgrp, void *arg), void *arg);
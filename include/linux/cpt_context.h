@@ -1,4 +1,6 @@
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/cpt_ioctl.h>
 #include <asm/uaccess.h>
 #include <bc/beancounter.h>
 
@@ -29,6 +31,7 @@ struct cpt_delayed_context {
 void destroy_delayed_context(struct cpt_delayed_context *);
 
 struct pram_stream;
+struct rst_pager;
 
 typedef struct cpt_context
 {
@@ -56,8 +59,14 @@ typedef struct cpt_context
 	struct rb_root	iter_rb_root;
 	struct user_beancounter *iter_ub;
 	int		iter_shm_start;
+	int		iter_soft_dirty;
 	struct file	*pagein_file_in;
 	struct file	*pagein_file_out;
+	int		postcopy;
+	struct radix_tree_root postcopy_pages;	/* cpt: pages served by pfn */
+	struct rst_pager *pager;		/* rst: post-copy page-in thread */
+	int		incremental;		/* CPT_INCR_* */
+	struct cpt_iter_stats *iter_stats;
 #endif
 	loff_t		current_section;
 	loff_t		current_object;
@@ -68,6 +77,12 @@ typedef struct cpt_context
 	__u32		write_error;
 
 	struct list_head object_array[CPT_OBJ_MAX];
+#define CPT_OBJHASH_ORDER 2
+#define CPT_OBJHASH_HBITS (PAGE_SHIFT + CPT_OBJHASH_ORDER - \
+			   (sizeof(void*) == 4 ? 2 : 3))
+#define CPT_OBJHASH_HSIZE (1<<CPT_OBJHASH_HBITS)
+	struct hlist_head *objhash;		/* objects by o_obj, type */
+	struct hlist_head *objhash_pos;		/* objects by o_pos, type */
 
 	void		(*write)(const void *addr, size_t count, struct cpt_context *ctx);
 	void		(*pwrite)(void *addr, size_t count, struct cpt_context *ctx, loff_t pos);
@@ -122,6 +137,23 @@ typedef struct cpt_context
 	struct pram_stream *pram_stream;
 #endif
 
+	/* Worker threads writing page contents while dumping VM */
+	struct cpt_page_dumper *page_dumper;
+
+	/* Zero elision, dedup and compression of pages, see CPT_SET_PACK */
+	__u32		pack_flags;
+	struct cpt_packer *packer;
+
+	/* Concurrent restore of process subtrees, see rst_undump.c */
+	struct mutex	rst_lock;
+	wait_queue_head_t rst_wait;
+	unsigned int	rst_mm_gen;
+	int		rst_failed;
+
+	/* Per phase time and image bytes, see CPT_GET_STATS */
+	struct cpt_stats stats;
+	atomic64_t	stat_read;	/* rst: bytes read with ctx->pread */
+
 	loff_t dumpsize;
 	loff_t maxdumpsize;
 } cpt_context_t;
@@ -191,6 +223,7 @@ int cpt_close_object(struct cpt_context *ctx);
 int cpt_open_object(cpt_object_t *obj, struct cpt_context *ctx);
 int cpt_push_object(loff_t *saved, struct cpt_context *ctx);
 int cpt_pop_object(loff_t *saved, struct cpt_context *ctx);
+int cpt_reserve_space(size_t count, loff_t *pos, struct cpt_context *ctx);
 
 int rst_get_section(int type, struct cpt_context * ctx, loff_t *, loff_t *);
 __u8 *__rst_get_name(loff_t *pos_p, struct cpt_context *ctx);
@@ -224,11 +257,12 @@ extern int swap_percent;
 #define eprintk(a...) cpt_printk(1, "CPT ERR: " a)
 #define eprintk_ctx(f, arg...)						\
 do {									\
+	loff_t __err_off = ctx->err_offset;				\
 	eprintk("%p,%u :" f, ctx, ctx->ve_id, ##arg);			\
-	if (ctx->error_msg && ctx->err_offset < PAGE_SIZE)		\
-		ctx->err_offset += snprintf((char*)(ctx->error_msg +	\
-				ctx->err_offset),			\
-			       	PAGE_SIZE - ctx->err_offset,		\
+	if (ctx->error_msg && __err_off < PAGE_SIZE)			\
+		ctx->err_offset = __err_off +				\
+			snprintf((char*)(ctx->error_msg + __err_off),	\
+			       	PAGE_SIZE - __err_off,			\
 				"Error: " f, ##arg);			\
 } while(0)
 
@@ -259,6 +293,54 @@ static inline void cpt_release_buf(cpt_context_t *ctx)
 	*(u32*)(buf + PAGE_SIZE - 4) = CPT_TMPBUF_FREE;
 }
 
+/*
+ * Restoring tasks hold rst_lock, except while they wait for children or
+ * read page contents into their own mm.
+ */
+static inline void rst_tree_lock(cpt_context_t *ctx)
+{
+	mutex_lock(&ctx->rst_lock);
+}
+
+static inline void rst_tree_unlock(cpt_context_t *ctx)
+{
+	mutex_unlock(&ctx->rst_lock);
+}
+
+struct cpt_stat_mark {
+	ktime_t		start;
+	loff_t		pos;
+};
+
+static inline loff_t cpt_stat_pos(cpt_context_t *ctx)
+{
+	return (ctx->file ? ctx->file->f_pos : 0) +
+		atomic64_read(&ctx->stat_read);
+}
+
+static inline void cpt_stat_start(struct cpt_stat_mark *m, cpt_context_t *ctx)
+{
+	m->start = ktime_get();
+	m->pos = cpt_stat_pos(ctx);
+}
+
+static inline void cpt_stat_end(int phase, struct cpt_stat_mark *m,
+				cpt_context_t *ctx)
+{
+	struct cpt_stat_phase *ps = &ctx->stats.phase[phase];
+
+	ps->usecs += ktime_us_delta(ktime_get(), m->start);
+	ps->bytes += cpt_stat_pos(ctx) - m->pos;
+	ps->count++;
+}
+
+static inline void cpt_stat_reset(cpt_context_t *ctx)
+{
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->stats.nr_phases = CPT_STAT_MAX;
+	atomic64_set(&ctx->stat_read, 0);
+}
+
 static inline void cpt_flush_error(cpt_context_t *ctx)
 {
 	mm_segment_t oldfs;
@@ -125,6 +125,7 @@ enum _cpt_object_type
 	CPT_OBJ_POSIX_TIMER		= 4123,
 	CPT_OBJ_SOCK_PACKET		= 4124,
 	CPT_OBJ_SOCK_PACKET_MC		= 4125,
+	CPT_OBJ_HUGEPAGES		= 4126,
 
 	/* 2.6.27-specific */
 	CPT_OBJ_NET_TAP_FILTER = 0x01000000,
@@ -326,6 +327,7 @@ enum _cpt_content_type {
 	CPT_CONTENT_NLMARRAY,
 	CPT_CONTENT_X86_XSAVE,
 	CPT_CONTENT_PRAM,
+	CPT_CONTENT_PACKED,
 	CPT_CONTENT_MAX
 };
 
@@ -402,9 +404,10 @@ struct cpt_veinfo_image
 	__u32	last_pid;
 	__u32	rnd_va_space;
 	__u32	vpid_max;
-	__u32	__cpt_pad1;
+	__u32	shm_interleave;
 	__u64	real_start_timespec_delta;
-	__u64	reserved[6];
+	__u64	timer_slack_ns;
+	__u64	reserved[5];
 	__u64	aio_max_nr;
 	__u64	cpt_ve_bcap;
 } __attribute__ ((aligned (8)));
@@ -747,6 +750,7 @@ struct cpt_sock_image
 	__u8	cpt_sockflags;
 #define CPT_SOCK_DELETED	0x1
 #define CPT_SOCK_DELAYED	0x2
+#define CPT_SOCK_REUSEPORT	0x4
 
 	__u16	__cpt_pad4;
 	__u32	__cpt_pad5;
@@ -1129,6 +1133,9 @@ struct cpt_sysvshm_image
 	__u64	cpt_dtime;
 	__u64	cpt_creator;
 	__u64	cpt_last;
+	__u32	cpt_flags;
+#define CPT_SHM_INTERLEAVE	0x1
+	__u32	__cpt_pad1;
 } __attribute__ ((aligned (8)));
 
 
@@ -1242,6 +1249,23 @@ struct cpt_page_block
 	__u64	cpt_end;
 } __attribute__ ((aligned (8)));
 
+/* CPT_OBJ_HUGEPAGES is a cpt_page_block too: the range was mapped by
+ * transparent huge pages. */
+
+/* CPT_CONTENT_PACKED page block: a record per page follows the header */
+struct cpt_packed_page
+{
+	__u16	cpt_type;
+	__u16	__cpt_pad1;
+	__u32	cpt_len;	/* bytes of data after the record */
+	__u64	cpt_ref;	/* CPT_PACKED_DUP: pos of record with data */
+} __attribute__ ((aligned (8)));
+
+#define CPT_PACKED_ZERO		0	/* zero page, no data */
+#define CPT_PACKED_RAW		1	/* PAGE_SIZE bytes */
+#define CPT_PACKED_LZO		2	/* lzo1x compressed page */
+#define CPT_PACKED_DUP		3	/* same as the page at cpt_ref */
+
 struct cpt_remappage_block
 {
 	__u64	cpt_next;
@@ -51,6 +51,12 @@
 
 #define CPT_TEST_VECAPS2	_IOW(CPTCTLTYPE, 30, unsigned int)
 
+#define CPT_SET_POSTCOPY	_IOW(CPTCTLTYPE, 31, int)
+#define CPT_GET_ITER_STATS	_IOR(CPTCTLTYPE, 32, struct cpt_iter_stats)
+#define CPT_SET_PACK		_IOW(CPTCTLTYPE, 33, int)
+#define CPT_SET_INCREMENTAL	_IOW(CPTCTLTYPE, 34, int)
+#define CPT_GET_STATS		_IOR(CPTCTLTYPE, 35, struct cpt_stats)
+
 /* CPT_TEST_VECAPS return codes */
 #define VECAPS_OK			0
 #define VECAPS_NO_CPU_FEATURE		1
@@ -64,4 +70,81 @@ struct vecaps {
 	__u32	features;
 };
 
+/* CPT_SET_PACK flags: how page contents are written to the image */
+#define CPT_PACK_ZERO		0x1	/* elide zero pages */
+#define CPT_PACK_DEDUP		0x2	/* refer to identical pages already dumped */
+#define CPT_PACK_LZO		0x4	/* compress pages */
+#define CPT_PACK_MASK		0x7
+
+/* CPT_SET_INCREMENTAL modes: what CPT_ITER puts to the page stream */
+#define CPT_INCR_OFF		0	/* usual iterative migration */
+#define CPT_INCR_BASE		1	/* all pages, starts a chain of snapshots */
+#define CPT_INCR_DELTA		2	/* pages changed since previous snapshot */
+
+/* CPT_GET_ITER_STATS: what the last CPT_ITER did */
+#define CPT_ITER_MAX_PASSES	16
+
+struct cpt_iter_pass {
+	__u32	sent;		/* pages transferred */
+	__u32	dirtied;	/* pages changed since previous pass */
+	__u32	young;		/* pages accessed since previous pass */
+	__u32	shm;		/* shmem pages transferred */
+	__u32	msecs;		/* since previous pass start */
+	__u32	rate;		/* dirtied pages per second */
+};
+
+/* stop_reason */
+#define CPT_ITER_STOP_SMALL	1	/* dirty set is small enough */
+#define CPT_ITER_STOP_GROWTH	2	/* dirty set grows */
+#define CPT_ITER_STOP_PASSES	3	/* too many passes */
+#define CPT_ITER_STOP_RATE	4	/* dirty rate stopped dropping */
+
+struct cpt_iter_stats {
+	__u32	nr_passes;
+	__u32	stop_reason;
+	struct cpt_iter_pass pass[CPT_ITER_MAX_PASSES];
+};
+
+/*
+ * CPT_GET_STATS: where the time of the last suspend/dump/resume or
+ * undump/resume went. Whole operations include their phases. Phases
+ * done by every task during undump are summed over tasks, they overlap
+ * when process subtrees are restored concurrently.
+ */
+#define CPT_STAT_SUSPEND	0	/* cpt_vps_suspend() */
+#define CPT_STAT_STOP_TASKS	1	/* freeze tasks */
+#define CPT_STAT_SUSPEND_NET	2	/* stop network */
+#define CPT_STAT_COLLECT	3	/* collect tasks and resources */
+#define CPT_STAT_DUMP		4	/* cpt_dump() */
+#define CPT_STAT_DUMP_FILES	5	/* files, sockets, fs and files structs */
+#define CPT_STAT_DUMP_NET	6	/* network devices and addresses */
+#define CPT_STAT_DUMP_VM	7	/* memory */
+#define CPT_STAT_DUMP_SYSV	8	/* sysv semaphores and messages */
+#define CPT_STAT_DUMP_TASKS	9	/* process state */
+#define CPT_STAT_DUMP_SOCKETS	10	/* orphaned sockets */
+#define CPT_STAT_DUMP_CONNTRACK	11	/* connection tracking */
+#define CPT_STAT_UNDUMP		12	/* vps_rst_undump() */
+#define CPT_STAT_RST_UBC	13	/* beancounters */
+#define CPT_STAT_RST_NET	14	/* network, incl. connection tracking */
+#define CPT_STAT_RST_CONNTRACK	15	/* connection tracking */
+#define CPT_STAT_RST_SOCKETS	16	/* sockets */
+#define CPT_STAT_RST_SYSV	17	/* sysv ipc */
+#define CPT_STAT_RST_MM		18	/* memory, per task */
+#define CPT_STAT_RST_FILES	19	/* file descriptors, per task */
+#define CPT_STAT_RESUME		20	/* resume after dump or undump */
+#define CPT_STAT_MAX		24
+
+struct cpt_stat_phase {
+	__u64	usecs;
+	__u64	bytes;		/* image bytes written or read */
+	__u32	count;		/* times the phase was done */
+	__u32	pad;
+};
+
+struct cpt_stats {
+	__u32	nr_phases;	/* CPT_STAT_MAX */
+	__u32	pad;
+	struct cpt_stat_phase phase[CPT_STAT_MAX];
+};
+
 #endif
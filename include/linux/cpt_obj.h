@@ -9,7 +9,9 @@
 typedef struct _cpt_object
 {
 	struct list_head	o_list;
-	struct list_head	o_hash;
+	struct hlist_node	o_hash;		/* by o_obj */
+	struct hlist_node	o_pos_hash;	/* by o_pos */
+	int			o_type;
 	int			o_count;
 	int			o_index;
 	int			o_lock;
@@ -26,6 +28,7 @@ typedef struct _cpt_object
 #define CPT_FILE_SYSVIPC	0x4
 #define CPT_TTY_NOPAIR		0x1
 #define CPT_NAMESPACE_MAIN	0x1
+#define CPT_TASK_SHARING	0x1
 } cpt_object_t;
 
 struct cpt_context;
@@ -41,16 +44,28 @@ cpt_object_t *lookup_cpt_object(enum _cpt_object_type type, void *p, struct cpt_
 cpt_object_t *lookup_cpt_obj_bypos(enum _cpt_object_type type, loff_t pos, struct cpt_context *ctx);
 cpt_object_t *lookup_cpt_obj_byindex(enum _cpt_object_type type, __u32 index, struct cpt_context *ctx);
 
+extern void cpt_obj_hash(cpt_object_t *cpt, struct cpt_context *ctx);
+extern void cpt_obj_hash_pos(cpt_object_t *cpt, struct cpt_context *ctx);
+
+/* For objects leaving ctx, see rst_freeze_delayfs() */
+static inline void cpt_obj_unhash(cpt_object_t *cpt)
+{
+	hlist_del_init(&cpt->o_hash);
+	hlist_del_init(&cpt->o_pos_hash);
+}
+
 static inline void cpt_obj_setpos(cpt_object_t *cpt, loff_t pos, struct cpt_context *ctx)
 {
 	cpt->o_pos = pos;
 	/* Add to pos hash table */
+	cpt_obj_hash_pos(cpt, ctx);
 }
 
 static inline void cpt_obj_setobj(cpt_object_t *cpt, void *ptr, struct cpt_context *ctx)
 {
 	cpt->o_obj = ptr;
 	/* Add to hash table */
+	cpt_obj_hash(cpt, ctx);
 }
 
 static inline void cpt_obj_setindex(cpt_object_t *cpt, __u32 index, struct cpt_context *ctx)
@@ -68,5 +83,6 @@ extern cpt_object_t *cpt_object_get(enum _cpt_object_type type, void *p, struct
 
 extern int cpt_object_init(struct cpt_context *ctx);
 extern int cpt_object_destroy(struct cpt_context *ctx);
+extern void cpt_object_release_hash(struct cpt_context *ctx);
 
 #endif /* __CPT_OBJ_H_ */
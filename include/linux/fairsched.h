@@ -50,6 +50,7 @@ asmlinkage long sys_fairsched_nodemask(unsigned int id, unsigned int len,
 
 int fairsched_new_node(int id, unsigned int vcpus);
 int fairsched_move_task(int id, struct task_struct *tsk);
+struct cgroup *fairsched_open_node(int id);
 void fairsched_drop_node(int id, int leave);
 
 struct kernel_cpustat;
@@ -59,6 +60,17 @@ int fairsched_get_cpu_stat(int id, struct kernel_cpustat *kstat);
 int cpu_cgroup_get_avenrun(struct cgroup *cgrp, unsigned long *avenrun);
 int fairsched_get_cpu_avenrun(int id, unsigned long *avenrun);
 
+void cpu_cgroup_get_throttled(struct cgroup *cgrp, u64 *nr_throttled,
+			      u64 *throttled_time);
+struct vz_fairsched_stat;
+int fairsched_get_stats(struct vz_fairsched_stat __user *buf,
+			unsigned int *nr);
+
+int cpu_cgroup_get_lat_hist(struct cgroup *cgrp, unsigned long *wait,
+			    unsigned long *throttle);
+int fairsched_get_lat_hist(int id, unsigned long *wait,
+			   unsigned long *throttle);
+
 struct cftype;
 int cpu_cgroup_proc_stat(struct cgroup *cgrp, struct cftype *cft,
 				struct seq_file *p);
@@ -68,10 +80,14 @@ int fairsched_show_stat(struct seq_file *p, int id);
 
 static inline int fairsched_new_node(int id, unsigned int vcpus) { return 0; }
 static inline int fairsched_move_task(int id, struct task_struct *tsk) { return 0; }
+static inline struct cgroup *fairsched_open_node(int id) { return NULL; }
 static inline void fairsched_drop_node(int id, int leave) { }
 static inline int fairsched_show_stat(struct seq_file *p, int id) { return -ENOSYS; }
 static inline int fairsched_get_cpu_avenrun(int id, unsigned long *avenrun) { return -ENOSYS; }
 static inline int fairsched_get_cpu_stat(int id, struct kernel_cpustat *kstat) { return -ENOSYS; }
+static inline int fairsched_get_lat_hist(int id, unsigned long *wait, unsigned long *throttle) { return -ENOSYS; }
+struct vz_fairsched_stat;
+static inline int fairsched_get_stats(struct vz_fairsched_stat __user *buf, unsigned int *nr) { return -ENOSYS; }
 
 #endif /* CONFIG_VZ_FAIRSCHED */
 #endif /* __KERNEL__ */
@@ -402,13 +402,17 @@ struct blk_user_cbt_info {
 enum CI_FLAGS
 {
 	CI_FLAG_ONCE = 1, /* BLKCBTGET will clear bits */
-	CI_FLAG_NEW_UUID = 2 /* BLKCBTSET update uuid */
+	CI_FLAG_NEW_UUID = 2, /* BLKCBTSET update uuid */
+	CI_FLAG_SNAPSHOT = 4 /* BLKCBTGET reads frozen generation */
 };
 #define BLKCBTSTART _IOR(0x12,200, struct blk_user_cbt_info)
 #define BLKCBTSTOP _IO(0x12,201)
 #define BLKCBTGET _IOWR(0x12,202,struct blk_user_cbt_info)
 #define BLKCBTSET _IOR(0x12,203,struct blk_user_cbt_info)
 #define BLKCBTCLR _IOR(0x12,204,struct blk_user_cbt_info)
+#define BLKCBTSNAPCREATE _IO(0x12,205)
+#define BLKCBTSNAPDROP _IO(0x12,206)
+#define BLKCBTSNAPMERGE _IO(0x12,207)
 
 #define BMAP_IOCTL 1		/* obsolete - kept for compatibility */
 #define FIBMAP	   _IO(0x00,1)	/* bmap access */
@@ -886,6 +890,9 @@ struct address_space {
 	struct address_space	*assoc_mapping;	/* ditto */
 	struct user_beancounter *dirtied_ub;
 	struct list_head	i_peer_list;
+#ifdef CONFIG_PAGECACHE_REPLICATION
+	struct page_replica	*replica;	/* per-node copies of text */
+#endif
 } __attribute__((aligned(sizeof(long))));
 	/*
 	 * On most architectures that alignment is already the case; but
@@ -981,6 +988,7 @@ struct inode {
 	uid_t			i_uid;
 	gid_t			i_gid;
 	dev_t			i_rdev;
+	unsigned int		i_hash_bucket;	/* of i_hash, see fs/inode.c */
 	u64			i_version;
 	loff_t			i_size;
 #ifdef __NEED_I_SIZE_ORDERED
@@ -1041,6 +1049,11 @@ struct inode {
 	struct posix_acl	*i_default_acl;
 #endif
 	struct file		*i_peer_file;
+
+	/* beancounter of the last alias, see ub_icache_set_owner() */
+	struct user_beancounter	*i_ub;
+	struct list_head	i_bclru;	/* in i_ub->ub_inode_lru */
+
 	void			*i_private; /* fs or device private pointer */
 };
 
@@ -2689,6 +2702,10 @@ extern void inode_init_once(struct inode *);
 extern void inode_add_to_lists(struct super_block *, struct inode *);
 extern void ihold(struct inode * inode);
 extern void iput(struct inode *);
+extern void iput_evict(struct inode *);
+extern void ub_icache_set_owner(struct inode *, struct user_beancounter *);
+extern int __shrink_icache_ub(struct user_beancounter *ub, int count);
+extern void ub_icache_unuse(struct user_beancounter *ub);
 extern struct inode * igrab(struct inode *);
 extern ino_t iunique(struct super_block *, ino_t);
 extern int inode_needs_sync(struct inode *inode);
@@ -2916,6 +2933,7 @@ extern struct super_block *get_super_thawed(struct block_device *);
 extern struct super_block *get_active_super(struct block_device *bdev);
 extern struct super_block *user_get_super(dev_t);
 extern void drop_super(struct super_block *sb);
+extern void iterate_supers(void (*)(struct super_block *, void *), void *);
 
 extern int dcache_dir_open(struct inode *, struct file *);
 extern int dcache_dir_close(struct inode *, struct file *);
@@ -3,6 +3,7 @@
 
 #include <linux/compiler.h>
 #include <linux/types.h>
+#include <linux/errno.h>
 
 /* Second argument to futex syscall */
 
@@ -186,6 +187,23 @@ static inline void exit_pi_state_list(struct task_struct *curr)
 {
 }
 #endif
+
+struct user_beancounter;
+
+#if defined(CONFIG_FUTEX) && defined(CONFIG_BEANCOUNTERS)
+extern int ub_futex_hash_init(struct user_beancounter *ub,
+			      unsigned long size);
+extern void ub_futex_hash_free(struct user_beancounter *ub);
+#else
+static inline int ub_futex_hash_init(struct user_beancounter *ub,
+				     unsigned long size)
+{
+	return -ENOSYS;
+}
+static inline void ub_futex_hash_free(struct user_beancounter *ub)
+{
+}
+#endif
 #endif /* __KERNEL__ */
 
 #define FUTEX_OP_SET		0	/* *(int *)UADDR2 = OPARG; */
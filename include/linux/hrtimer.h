@@ -437,6 +437,14 @@ extern long hrtimer_nanosleep(struct timespec *rqtp,
 			      const enum hrtimer_mode mode,
 			      const clockid_t clockid);
 extern long hrtimer_nanosleep_restart(struct restart_block *restart_block);
+#ifdef CONFIG_VE
+extern unsigned long ve_timer_slack(ktime_t expires, unsigned long slack);
+#else
+static inline unsigned long ve_timer_slack(ktime_t expires, unsigned long slack)
+{
+	return slack;
+}
+#endif
 #ifdef CONFIG_COMPAT
 extern long compat_nanosleep_restart(struct restart_block *restart);
 #endif
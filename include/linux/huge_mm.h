@@ -55,16 +55,16 @@ extern pmd_t *page_check_address_pmd(struct page *page,
 #define HPAGE_PMD_SIZE HPAGE_SIZE
 
 #define transparent_hugepage_enabled(__vma)				\
-	((transparent_hugepage_flags &					\
+	((mm_thp_flags((__vma)->vm_mm) &				\
 	 (1<<TRANSPARENT_HUGEPAGE_FLAG) ||				\
-	 (transparent_hugepage_flags &					\
+	 (mm_thp_flags((__vma)->vm_mm) &				\
 	  (1<<TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG) &&			\
 	  ((__vma)->vm_flags & VM_HUGEPAGE))) &&			\
 	!((__vma)->vm_flags & VM_NOHUGEPAGE))
 #define transparent_hugepage_defrag(__vma)				\
-	((transparent_hugepage_flags &					\
+	((mm_thp_flags((__vma)->vm_mm) &				\
 	  (1<<TRANSPARENT_HUGEPAGE_DEFRAG_FLAG)) ||			\
-	 (transparent_hugepage_flags &					\
+	 (mm_thp_flags((__vma)->vm_mm) &				\
 	  (1<<TRANSPARENT_HUGEPAGE_DEFRAG_REQ_MADV_FLAG) &&		\
 	  (__vma)->vm_flags & VM_HUGEPAGE))
 #ifdef CONFIG_DEBUG_VM
@@ -76,6 +76,12 @@ extern pmd_t *page_check_address_pmd(struct page *page,
 #endif /* CONFIG_DEBUG_VM */
 
 extern unsigned long transparent_hugepage_flags;
+#ifdef CONFIG_BEANCOUNTERS
+/* the flags with the modes of the container of the mm, VE_CONFIGURE_THP */
+extern unsigned long mm_thp_flags(struct mm_struct *mm);
+#else
+#define mm_thp_flags(mm)	transparent_hugepage_flags
+#endif
 extern int copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 			  pmd_t *dst_pmd, pmd_t *src_pmd,
 			  struct vm_area_struct *dst_vma,
@@ -47,6 +47,8 @@ struct ipc_namespace {
 	 * of shmctl()
 	 */
 	int		shm_rmid_forced;
+	/* new segments get MPOL_INTERLEAVE over all the memory nodes */
+	int		shm_interleave;
 
 	struct notifier_block ipcns_nb;
 
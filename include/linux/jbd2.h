@@ -650,6 +650,14 @@ struct transaction_s
 	 */
 	unsigned int t_synchronous_commit:1;
 
+	/*
+	 * Beancounter of the first handle of this transaction and whether
+	 * handles of other beancounters joined it [t_handle_lock].  Only
+	 * compared, never dereferenced.
+	 */
+	struct user_beancounter	*t_ub;
+	int			t_ub_shared;
+
 	/* Disk flush needs to be sent to fs partition [no locking] */
 	int			t_need_data_flush;
 
@@ -973,6 +981,17 @@ struct journal_s
 	u32			j_min_batch_time;
 	u32			j_max_batch_time;
 
+	/*
+	 * Beancounter which requested the last fsync-driven commits, how
+	 * many of them in a row and when [j_state_lock].  Only compared,
+	 * never dereferenced.  Commits requested by a beancounter which
+	 * keeps fsyncing alone are delayed to batch them.
+	 */
+	struct user_beancounter	*j_fsync_ub;
+	unsigned int		j_fsync_streak;
+	unsigned long		j_fsync_stamp;
+	unsigned long		j_fsync_batched;
+
 	/* This function is called when a transaction is closed */
 	void			(*j_commit_callback)(journal_t *,
 						     transaction_t *);
@@ -12,15 +12,18 @@ extern int khugepaged_enter_vma_merge(struct vm_area_struct *vma);
 	(transparent_hugepage_flags &				       \
 	 ((1<<TRANSPARENT_HUGEPAGE_FLAG) |		       \
 	  (1<<TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG)))
-#define khugepaged_always()				\
-	(transparent_hugepage_flags &			\
+#define khugepaged_always(mm)				\
+	(mm_thp_flags(mm) &				\
 	 (1<<TRANSPARENT_HUGEPAGE_FLAG))
-#define khugepaged_req_madv()					\
-	(transparent_hugepage_flags &				\
+#define khugepaged_req_madv(mm)					\
+	(mm_thp_flags(mm) &					\
 	 (1<<TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG))
 #define khugepaged_defrag()					\
 	(transparent_hugepage_flags &				\
 	 (1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG))
+#define khugepaged_defrag_mm(mm)				\
+	(mm_thp_flags(mm) &					\
+	 (1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG))
 
 static inline int khugepaged_fork(struct mm_struct *mm, struct mm_struct *oldmm)
 {
@@ -38,8 +41,8 @@ static inline void khugepaged_exit(struct mm_struct *mm)
 static inline int khugepaged_enter(struct vm_area_struct *vma)
 {
 	if (!test_bit(MMF_VM_HUGEPAGE, &vma->vm_mm->flags))
-		if ((khugepaged_always() ||
-		     (khugepaged_req_madv() &&
+		if ((khugepaged_always(vma->vm_mm) ||
+		     (khugepaged_req_madv(vma->vm_mm) &&
 		      vma->vm_flags & VM_HUGEPAGE)) &&
 		    !(vma->vm_flags & VM_NOHUGEPAGE))
 			if (__khugepaged_enter(vma->vm_mm))
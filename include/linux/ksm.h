@@ -20,12 +20,14 @@ struct mem_cgroup;
 int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 		unsigned long end, int advice, unsigned long *vm_flags);
 int __ksm_enter(struct mm_struct *mm);
+int __ksm_fork(struct mm_struct *mm, struct mm_struct *oldmm);
 void __ksm_exit(struct mm_struct *mm);
+void ksm_vma_auto(struct mm_struct *mm, unsigned long *vm_flags);
 
 static inline int ksm_fork(struct mm_struct *mm, struct mm_struct *oldmm)
 {
 	if (test_bit(MMF_VM_MERGEABLE, &oldmm->flags))
-		return __ksm_enter(mm);
+		return __ksm_fork(mm, oldmm);
 	return 0;
 }
 
@@ -91,6 +93,10 @@ static inline void ksm_exit(struct mm_struct *mm)
 {
 }
 
+static inline void ksm_vma_auto(struct mm_struct *mm, unsigned long *vm_flags)
+{
+}
+
 static inline int PageKsm(struct page *page)
 {
 	return 0;
@@ -390,9 +390,47 @@ do {								\
 #define lock_contended(lockdep_map, ip) do {} while (0)
 #define lock_acquired(lockdep_map, ip) do {} while (0)
 
+#ifdef CONFIG_LOCK_CONTENTION
+
+extern int lock_contention_period;
+extern unsigned long long __lock_contention_begin(void);
+extern void lock_contention_end(void *lock, unsigned long ip,
+				unsigned long long start);
+
+static inline unsigned long long lock_contention_begin(void)
+{
+	if (likely(!lock_contention_period))
+		return 0;
+	return __lock_contention_begin();
+}
+
+#define LOCK_CONTENDED(_lock, try, lock)			\
+do {								\
+	if (!try(_lock)) {					\
+		unsigned long long __lc_start;			\
+								\
+		__lc_start = lock_contention_begin();		\
+		lock(_lock);					\
+		if (unlikely(__lc_start))			\
+			lock_contention_end(_lock, _RET_IP_,	\
+					    __lc_start);	\
+	}							\
+} while (0)
+
+#else /* CONFIG_LOCK_CONTENTION */
+
+static inline unsigned long long lock_contention_begin(void)
+{
+	return 0;
+}
+
+#define lock_contention_end(lock, ip, start) do { } while (0)
+
 #define LOCK_CONTENDED(_lock, try, lock) \
 	lock(_lock)
 
+#endif /* CONFIG_LOCK_CONTENTION */
+
 #endif /* CONFIG_LOCK_STAT */
 
 #ifdef CONFIG_LOCKDEP
@@ -405,6 +443,21 @@ do {								\
 #define LOCK_CONTENDED_FLAGS(_lock, try, lock, lockfl, flags) \
 	LOCK_CONTENDED((_lock), (try), (lock))
 
+#elif defined(CONFIG_LOCK_CONTENTION)
+
+#define LOCK_CONTENDED_FLAGS(_lock, try, lock, lockfl, flags)	\
+do {								\
+	if (!try(_lock)) {					\
+		unsigned long long __lc_start;			\
+								\
+		__lc_start = lock_contention_begin();		\
+		lockfl((_lock), (flags));			\
+		if (unlikely(__lc_start))			\
+			lock_contention_end(_lock, _RET_IP_,	\
+					    __lc_start);	\
+	}							\
+} while (0)
+
 #else /* CONFIG_LOCKDEP */
 
 #define LOCK_CONTENDED_FLAGS(_lock, try, lock, lockfl, flags) \
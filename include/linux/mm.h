@@ -1003,6 +1003,30 @@ static inline int handle_mm_fault(struct mm_struct *mm,
 }
 #endif
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+extern int handle_speculative_fault(struct mm_struct *mm,
+			unsigned long address, unsigned int flags);
+
+/*
+ * Everything changing vmas, or ptes of anonymous vmas, under the write
+ * mmap_sem is put between these, see handle_speculative_fault(). They nest.
+ */
+static inline void mm_vma_write_begin(struct mm_struct *mm)
+{
+	if (!mm->vma_seq_nest++)
+		write_seqcount_begin(&mm->vma_seq);
+}
+
+static inline void mm_vma_write_end(struct mm_struct *mm)
+{
+	if (!--mm->vma_seq_nest)
+		write_seqcount_end(&mm->vma_seq);
+}
+#else
+static inline void mm_vma_write_begin(struct mm_struct *mm) { }
+static inline void mm_vma_write_end(struct mm_struct *mm) { }
+#endif
+
 extern int install_anon_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			     unsigned long addr, struct page *page);
 
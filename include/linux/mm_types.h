@@ -9,6 +9,7 @@
 #include <linux/prio_tree.h>
 #include <linux/rbtree.h>
 #include <linux/rwsem.h>
+#include <linux/seqlock.h>
 #include <linux/completion.h>
 #include <linux/cpumask.h>
 #include <linux/page-debug-flags.h>
@@ -242,6 +243,10 @@ struct mm_struct {
 	atomic_t mm_count;			/* How many references to "struct mm_struct" (users count as 1) */
 	int map_count;				/* number of VMAs */
 	struct rw_semaphore mmap_sem;
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	seqcount_t vma_seq;			/* see handle_speculative_fault() */
+	int vma_seq_nest;			/* under the write mmap_sem */
+#endif
 	spinlock_t page_table_lock;		/* Protects page tables and some counters */
 
 	struct list_head mmlist;		/* List of maybe swapped mm's.	These are globally strung
@@ -295,6 +300,8 @@ struct mm_struct {
 
 #ifdef CONFIG_BEANCOUNTERS
 	struct user_beancounter *mm_ub;
+	struct futex_hash *mm_futex_hash;	/* of mm_ub, see hash_futex() */
+	unsigned long privvm_reserve;	/* under page_table_lock */
 #endif
 	struct core_state *core_state; /* coredumping support */
 #ifdef CONFIG_AIO
@@ -6,6 +6,7 @@
 #include <linux/sched.h>
 #include <bc/beancounter.h>
 #include <bc/vmpages.h>
+#include <bc/io_acct.h>
 
 void setup_zone_gang(struct gang_set *gs, struct zone *zone, struct gang *gang);
 
@@ -164,12 +165,15 @@ static inline int gang_add_user_page(struct page *page,
 	set_page_gang(page, mem_page_gang(gs, page));
 	return 0;
 }
+/* Page cache pages must be locked or mapped, see ub_io_lock_page_owner() */
 static inline int gang_mod_user_page(struct page *page,
 		struct gang_set *gs, gfp_t gfp_mask)
 {
 	int numpages = hpage_nr_pages(page);
 	struct gang *gang = page_gang(page);
 	struct user_beancounter *ub = get_gang_ub(gang);
+	struct address_space *mapping;
+	unsigned long flags;
 
 	if (ub_phys_charge(get_gangs_ub(gs), numpages,
 				gfp_mask|__GFP_NORETRY))
@@ -183,9 +187,11 @@ static inline int gang_mod_user_page(struct page *page,
 	}
 
 	VM_BUG_ON(PageLRU(page));
-	spin_lock_irq(&gang->lruvec.lru_lock);
+	mapping = ub_io_lock_page_owner(page, &flags);
+	spin_lock(&gang->lruvec.lru_lock);
 	set_page_gang(page, mem_page_gang(gs, page));
-	spin_unlock_irq(&gang->lruvec.lru_lock);
+	spin_unlock(&gang->lruvec.lru_lock);
+	ub_io_unlock_page_owner(page, mapping, ub, flags);
 	return 0;
 }
 static inline int gang_mod_shadow_page(struct page *page)
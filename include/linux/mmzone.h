@@ -109,6 +109,9 @@ enum zone_stat_item {
 #ifdef CONFIG_MEMORY_VSWAP
 	NR_VSWAP,
 #endif
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+	NR_VSWAP_POOL,		/* pages of compressed vswap pool */
+#endif
 #ifdef CONFIG_NUMA
 	NUMA_HIT,		/* allocated in intended node */
 	NUMA_MISS,		/* allocated in non intended node */
@@ -380,11 +383,18 @@ struct lru_milestone {
 	struct list_head	lru[NR_EVICTABLE_LRU_LISTS];
 };
 
+/*
+ * idle_age[i] counts pages idle for [2^i, 2^(i+1)) kstaled scan periods,
+ * it is int-sized because struct gang must fit into four pages per node.
+ */
+#define KSTALED_AGE_BUCKETS	8
+
 struct idle_page_stats {
 #ifdef CONFIG_KSTALED
 	unsigned long idle_clean;
 	unsigned long idle_dirty_file;
 	unsigned long idle_dirty_swap;
+	unsigned int idle_age[KSTALED_AGE_BUCKETS];
 #endif
 };
 
@@ -795,6 +805,10 @@ typedef struct pglist_data {
 	wait_queue_head_t kswapd_wait;
 	struct task_struct *kswapd;
 	int kswapd_max_order;
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	/* struct pages from here on are initialised after smp_init() */
+	unsigned long first_deferred_pfn;
+#endif
 } pg_data_t;
 
 #define node_present_pages(nid)	(NODE_DATA(nid)->node_present_pages)
@@ -13,6 +13,7 @@
 #include <linux/list.h>
 #include <linux/nodemask.h>
 #include <linux/spinlock.h>
+#include <linux/lglock.h>
 #include <asm/atomic.h>
 
 struct super_block;
@@ -142,7 +143,7 @@ extern void mnt_set_expiry(struct vfsmount *mnt, struct list_head *expiry_list);
 extern void mark_mounts_for_expiry(struct list_head *mounts);
 extern void replace_mount(struct vfsmount *src_mnt, struct vfsmount *dst_mnt);
 
-extern spinlock_t vfsmount_lock;
+DECLARE_BRLOCK(vfsmount_lock);
 extern dev_t name_to_dev_t(char *name);
 
 #endif /* _LINUX_MOUNT_H */
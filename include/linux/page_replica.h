@@ -0,0 +1,83 @@
+#ifndef _LINUX_PAGE_REPLICA_H
+#define _LINUX_PAGE_REPLICA_H
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+
+struct ctl_table;
+
+#ifdef CONFIG_PAGECACHE_REPLICATION
+
+/* per-node copies of the pages of one address_space, see mm/page_replica.c */
+struct page_replica {
+	unsigned long		nr_pages;	/* under page_replica_lock */
+	struct radix_tree_root	tree[0];	/* indexed by node */
+};
+
+extern int sysctl_pagecache_replication;
+
+extern struct page *__page_replica_fault(struct vm_area_struct *vma,
+					 struct page *page);
+extern void __page_replica_collapse(struct address_space *mapping);
+extern void __page_replica_invalidate(struct address_space *mapping,
+				      pgoff_t index);
+extern void page_replica_free(struct address_space *mapping);
+extern int pagecache_replication_sysctl_handler(struct ctl_table *table,
+		int write, void __user *buffer, size_t *lenp, loff_t *ppos);
+
+/*
+ * Called from the fault path with the page cache page locked. Returns
+ * the locked page to map, which is a copy on the local node if the page
+ * is elsewhere and a read-only text one.
+ */
+static inline struct page *page_replica_fault(struct vm_area_struct *vma,
+		struct page *page, unsigned int flags)
+{
+	if (!sysctl_pagecache_replication || (flags & FAULT_FLAG_WRITE) ||
+	    (vma->vm_flags & (VM_EXEC | VM_WRITE | VM_SHARED | VM_LOCKED)) !=
+								VM_EXEC)
+		return page;
+
+	return __page_replica_fault(vma, page);
+}
+
+/* Drops all the copies before the file contents may change */
+static inline void page_replica_collapse(struct address_space *mapping)
+{
+	/*
+	 * Orders i_writecount raised by the caller before the check, pairs
+	 * with publishing ->replica in page_replica_get(). Replicas made
+	 * after that are seen under page_replica_lock.
+	 */
+	smp_mb();
+	if (unlikely(mapping->replica))
+		__page_replica_collapse(mapping);
+}
+
+/*
+ * Drops the copies of a page just taken out of the page cache, with the
+ * page still locked: a fault might have copied it after the collapse.
+ */
+static inline void page_replica_invalidate(struct address_space *mapping,
+		pgoff_t index)
+{
+	if (unlikely(mapping->replica))
+		__page_replica_invalidate(mapping, index);
+}
+
+#else
+
+static inline struct page *page_replica_fault(struct vm_area_struct *vma,
+		struct page *page, unsigned int flags)
+{
+	return page;
+}
+
+static inline void page_replica_collapse(struct address_space *mapping) { }
+static inline void page_replica_invalidate(struct address_space *mapping,
+		pgoff_t index) { }
+static inline void page_replica_free(struct address_space *mapping) { }
+
+#endif
+
+#endif /* _LINUX_PAGE_REPLICA_H */
@@ -27,6 +27,7 @@ enum mapping_flags {
 	AS_MM_ALL_LOCKS	= __GFP_BITS_SHIFT + 2,	/* under mm_take_all_locks() */
 	AS_UNEVICTABLE	= __GFP_BITS_SHIFT + 3,	/* e.g., ramdisk, SHM_LOCK */
 	AS_CHECKPOINT	= __GFP_BITS_SHIFT + 4,	/* mapping is checkpointed */
+	AS_PRAMCACHE	= __GFP_BITS_SHIFT + 5,	/* pramcache pages deferred */
 };
 
 static inline void mapping_set_error(struct address_space *mapping, int error)
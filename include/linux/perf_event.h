@@ -346,6 +346,13 @@ struct perf_event_attr {
 #define PERF_EVENT_IOC_SET_OUTPUT	_IO ('$', 5)
 #define PERF_EVENT_IOC_SET_FILTER	_IOW('$', 6, char *)
 #define PERF_EVENT_IOC_ID		_IOR('$', 7, __u64 *)
+/*
+ * OpenVZ: only take samples while current runs in the VE with the given
+ * id, PERF_EVENT_VE_ANY drops the restriction. Counting is not affected.
+ */
+#define PERF_EVENT_IOC_SET_VE		_IOW('$', 64, __u32)
+
+#define PERF_EVENT_VE_ANY		((__u32)-1)
 
 enum perf_event_ioc_flags {
 	PERF_IOC_FLAG_GROUP		= 1U << 0,
@@ -1134,6 +1141,9 @@ struct perf_event {
 	struct perf_cgroup		*cgrp; /* cgroup event is attach to */
 	int				cgrp_defer_enabled;
 #endif
+#ifdef CONFIG_VE
+	unsigned int			ve_id; /* VE samples are taken in */
+#endif
 
 #endif /* CONFIG_PERF_EVENTS */
 };
@@ -4,6 +4,7 @@
 #define PIPEFS_MAGIC 0x50495045
 
 #define PIPE_BUFFERS (16)
+#define PIPE_TMP_PAGES (4)
 
 #define PIPE_BUF_FLAG_LRU	0x01	/* page is on the LRU */
 #define PIPE_BUF_FLAG_ATOMIC	0x02	/* was atomically mapped */
@@ -31,7 +32,8 @@ struct pipe_buffer {
  *	@wait: reader/writer wait point in case of empty/full pipe
  *	@nrbufs: the number of non-empty pipe buffers in this pipe
  *	@curbuf: the current pipe buffer entry
- *	@tmp_page: cached released page
+ *	@tmp_page: cache of released pages, see pipe_recycle_page()
+ *	@nr_tmp_pages: number of pages in @tmp_page
  *	@readers: number of current readers of this pipe
  *	@writers: number of current writers of this pipe
  *	@waiting_writers: number of writers blocked waiting for room
@@ -45,7 +47,8 @@ struct pipe_buffer {
 struct pipe_inode_info {
 	wait_queue_head_t wait;
 	unsigned int nrbufs, curbuf;
-	struct page *tmp_page;
+	struct page *tmp_page[PIPE_TMP_PAGES];
+	unsigned int nr_tmp_pages;
 	unsigned int readers;
 	unsigned int writers;
 	unsigned int waiting_writers;
@@ -147,6 +150,7 @@ void free_pipe_info(struct inode * inode);
 void __free_pipe_info(struct pipe_inode_info *);
 int pipe_release(struct inode *inode, int decr, int decw);
 void swap_pipe_info(struct inode *, struct inode *);
+void pipe_recycle_page(struct pipe_inode_info *, struct page *);
 
 /* Generic pipe buffer ops functions */
 void *generic_pipe_buf_map(struct pipe_inode_info *, struct pipe_buffer *, int);
@@ -2,11 +2,13 @@
 #define _LINUX_PLOOP_H_
 
 #include <linux/rbtree.h>
+#include <linux/radix-tree.h>
 #include <linux/timer.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/interrupt.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include "ploop_if.h"
 #include "compat.h"
@@ -53,6 +55,9 @@ enum {
 	PLOOP_S_LOCKED,	        /* ploop is locked by userspace
 				   (for minor mgmt only) */
 	PLOOP_S_ONCE,	        /* An event (e.g. printk once) happened */
+	PLOOP_S_MERGE_PAUSED,	/* Merge requests are held on merge_wait_list */
+	PLOOP_S_SNAP_DRAIN,	/* Snapshot waits for writes in flight, new
+				   ones are held on drain_queue */
 };
 
 struct ploop_snapdata
@@ -105,6 +110,22 @@ struct ploop_io
 	int			fsync_qlen;
 	wait_queue_head_t	fsync_waitq;
 	struct timer_list	fsync_timer;
+	/* group commit of fsyncs, see ploop_fsync_group_wait() */
+	u64			fsync_lat_ns;	/* decaying average */
+	int			fsync_batch;	/* requests the last one did */
+
+	/* Requests (kaio) or backing queue unplugs (dio) held back by
+	 * the main thread for batched submission */
+	struct list_head	plug_list;
+	int			plug_len;
+
+	/* io_nfs: RPCs in flight and the writes among them */
+	atomic_t		rpc_inflight;
+	atomic_t		rpc_wr_inflight;
+	wait_queue_head_t	rpc_waitq;
+
+	/* NULL or write-back cache stacked on this io, see io_cache.c */
+	struct ploop_cache	*cache;
 
 	struct ploop_io_ops	*ops;
 };
@@ -117,6 +138,7 @@ struct ploop_io_ops
 	struct module		*owner;
 
 	void		(*unplug)(struct ploop_io *);
+	void		(*submit_queued)(struct ploop_io *);
 	int		(*congested)(struct ploop_io *, int bits);
 
 	/* Allocate new block, return its index in image.
@@ -206,6 +228,8 @@ enum {
 };
 
 #define PLOOP_LRU_BUFFER	8
+#define PLOOP_MAP_PRIO_MAX	16
+#define PLOOP_MAP_RA_MAX	32	/* index pages per readahead I/O */
 
 struct ploop_map
 {
@@ -222,6 +246,30 @@ struct ploop_map
 	struct map_node		*lru_buffer[PLOOP_LRU_BUFFER];
 	unsigned int		lru_buffer_ptr;
 
+	/* Idle cached nodes, the map is linked to global list of maps
+	 * while it is not empty. Both are under map_lru_lock. */
+	struct list_head	lru_list;
+	struct list_head	lru_link;
+
+	/* BAT readahead: window of ondisk index pages to prefetch,
+	 * under plo->lock */
+	struct delayed_work	ra_work;
+	unsigned int		ra_next;
+	unsigned int		ra_nr;
+	unsigned int		ra_end;
+	unsigned int		ra_last;
+	unsigned long		evictions;
+
+	/* Nodes collecting index updates for group commit, ordered by
+	 * deadline. Used only by main thread. */
+	struct list_head	wb_group;
+
+	/* Flattened index of the deltas below top, per index page, see
+	 * map_flat_apply(). Used only by main thread. */
+	struct radix_tree_root	flat_tree;
+	struct list_head	flat_lru;
+	unsigned int		flat_pages;
+
 	wait_queue_head_t	destroy_waitq;
 };
 
@@ -302,14 +350,37 @@ struct ploop_tunable
 	int	congestion_high_watermark;
 	int	congestion_low_watermark;
 	int	max_active_requests;
+	int	max_map_pages;
+	int	map_priority;
+	int	map_readahead;
+	int	index_wb_delay;
+	int	index_wb_batch;
+	int	kaio_batch;
+	int	dio_plug_batch;
+	int	merge_reqs;
+	int	merge_iops;
+	int	merge_kbps;
+	int	reloc_reqs;
+	int	grow_iops;
+	int	grow_kbps;
+	int	flat_map_pages;
+	int	nfs_window;
+	int	cache_dirty_ratio;
+	int	cache_wb_delay;
+	int	discard_batch;
 	unsigned int pass_flushes : 1, pass_fuas : 1,
 		     congestion_detection : 1,
 		     check_zeros : 1,
 		     disable_root_threshold : 1,
-		     disable_user_threshold : 1;
+		     disable_user_threshold : 1,
+		     map_prefetch : 1,
+		     shared_cache : 1,
+		     nfs_coalesce : 1,
+		     cache_promote : 1;
 };
 
 #define DEFAULT_PLOOP_MAXRQ 256
+#define PLOOP_MAX_COMPLETE_THREADS 16
 #define DEFAULT_PLOOP_BATCH_ENTRY_QLEN 32
 
 #define DEFAULT_PLOOP_TUNE \
@@ -326,6 +397,19 @@ struct ploop_tunable
 .pass_flushes = 1, \
 .pass_fuas = 1, \
 .check_zeros = 1, \
+.map_readahead = 16, \
+.index_wb_delay = (HZ >= 200 ? HZ/200 : 1), \
+.index_wb_batch = DEFAULT_PLOOP_BATCH_ENTRY_QLEN, \
+.kaio_batch = 16, \
+.dio_plug_batch = 16, \
+.flat_map_pages = 256, \
+.shared_cache = 1, \
+.nfs_window = 64, \
+.nfs_coalesce = 1, \
+.cache_dirty_ratio = 50, \
+.cache_wb_delay = 5*HZ, \
+.cache_promote = 1, \
+.discard_batch = 64, \
 .max_active_requests = DEFAULT_PLOOP_BATCH_ENTRY_QLEN / 2, }
 
 struct ploop_stats
@@ -335,7 +419,31 @@ struct ploop_stats
 #undef __DO
 };
 
+/* Phases of a request in latency histograms, see ploop_lat_account() */
+enum
+{
+	PLOOP_LAT_QUEUE,	/* In entry queue */
+	PLOOP_LAT_LOCKOUT,	/* Delayed by another request to the cluster */
+	PLOOP_LAT_MAP,		/* Waits for an index page (BAT fault) */
+	PLOOP_LAT_DATA,		/* Data I/O */
+	PLOOP_LAT_INDEX,	/* Index update and writeback */
+	PLOOP_LAT_FSYNC,	/* Waits for fsync of image */
+	PLOOP_LAT_TOTAL,	/* Whole life of a request */
+	PLOOP_LAT_MAX,
+	PLOOP_LAT_AUTO = PLOOP_LAT_MAX,	/* Phase is told by eng_state */
+};
+
+/* Bucket n counts latencies of [2^(n-1), 2^n) us, the last one all above */
+#define PLOOP_LAT_BUCKETS	24
+
+struct ploop_lat_stats
+{
+	u32			hist[PLOOP_LAT_MAX][PLOOP_LAT_BUCKETS];
+	u64			sum[PLOOP_LAT_MAX];	/* us */
+};
+
 struct ploop_freeblks_desc;
+struct ploop_pushbackup_desc;
 
 struct ploop_device
 {
@@ -367,6 +475,10 @@ struct ploop_device
 	int			active_reqs;
 	int			fastpath_reqs;
 	int			barrier_reqs;
+	int			active_writes;	/* bio writes in active_reqs */
+
+	struct list_head	drain_queue;
+	struct completion	*drain_comp;
 
 	struct bio		*cached_bio;
 
@@ -393,6 +505,13 @@ struct ploop_device
 	struct task_struct	*thread;
 	struct rb_node		link;
 
+	/* Plain requests finished by io are completed by these threads
+	 * in parallel with the main one. */
+	struct task_struct	*complete_threads[PLOOP_MAX_COMPLETE_THREADS];
+	int			nr_complete_threads;
+	struct list_head	complete_queue;
+	wait_queue_head_t	complete_waitq;
+
 	/* someone who wants to quiesce state-machine waits
 	 * here for signal from state-machine saying that
 	 * processing came to PLOOP_REQ_BARRIER request */
@@ -410,12 +529,17 @@ struct ploop_device
 	struct completion	relaxed_comp;
 
 	spinlock_t		track_lock;
-	struct rb_root		track_tree;
+	struct radix_tree_root	track_pages;	/* bitmap of changed clusters */
+	unsigned long		track_dirty;	/* bits set in track_pages */
 	sector_t		track_end;
 	u32			track_cluster;
 	u32			track_ptr;
 
 	u32			merge_ptr;
+	u32			merge_done;	/* clusters copied */
+	struct list_head	merge_wait_list; /* throttled merge preqs */
+	struct timer_list	merge_timer;
+	u64			merge_next;	/* ns, next copy allowed */
 
 	atomic_t		maintenance_cnt;
 	struct completion	maintenance_comp;
@@ -434,9 +558,11 @@ struct ploop_device
 	struct kobject		*ptune_dir;
 
 	struct ploop_stats	st;
+	struct ploop_lat_stats	lat;	/* protected by lock */
 	char                    cookie[PLOOP_COOKIE_SIZE];
 
 	struct ploop_freeblks_desc *fbd;
+	struct ploop_pushbackup_desc *pbd;
 
 	unsigned long		locking_state; /* plo locked by userspace */
 };
@@ -459,6 +585,7 @@ enum
 	PLOOP_REQ_FORCE_FUA,	/*force fua of req write I/O by engine */
 	PLOOP_REQ_FORCE_FLUSH,	/*force flush by engine */
 	PLOOP_REQ_KAIO_FSYNC,	/*force image fsync by KAIO module */
+	PLOOP_REQ_ACTIVE_WRITE,	/* Counted in active_writes */
 };
 
 enum
@@ -561,6 +688,11 @@ struct ploop_request
 
 	/* # bytes in tail of image file to prealloc on behalf of this preq */
 	loff_t			prealloc_size;
+
+	/* Latency accounting: start of request and of current phase, ns */
+	u64			lat_start;
+	u64			lat_stamp;
+	int			lat_phase;
 };
 
 static inline struct ploop_delta * ploop_top_delta(struct ploop_device * plo)
@@ -576,6 +708,13 @@ static inline struct ploop_delta * map_top_delta(struct ploop_map * map)
 }
 
 void ploop_complete_io_state(struct ploop_request * preq);
+void ploop_lat_account(struct ploop_request * preq, int next);
+
+static inline void ploop_lat_start(struct ploop_request * preq)
+{
+	preq->lat_start = preq->lat_stamp = ktime_to_ns(ktime_get());
+	preq->lat_phase = PLOOP_LAT_QUEUE;
+}
 void ploop_fail_request(struct ploop_request * preq, int err);
 void ploop_preq_drop(struct ploop_device * plo, struct list_head *drop_list,
 		      int keep_locked);
@@ -747,6 +886,8 @@ void ploop_map_destroy(struct ploop_map * map);
 void ploop_map_remove_delta(struct ploop_map * map, int level);
 void ploop_index_update(struct ploop_request * preq);
 void ploop_index_wb_complete(struct ploop_request * preq);
+void ploop_map_wb_flush(struct ploop_map * map, int force);
+long ploop_map_wb_timeout(struct ploop_map * map);
 int __init ploop_map_init(void);
 void ploop_map_exit(void);
 
@@ -769,6 +910,8 @@ int ploop_io_init(struct ploop_delta * delta, int nchunks, struct ploop_ctl_chun
 int ploop_io_open(struct ploop_io *);
 void ploop_io_destroy(struct ploop_io * io);
 void ploop_io_report_fn(struct file * file, char * msg);
+void ploop_fsync_group_wait(struct ploop_io * io);
+void ploop_fsync_account(struct ploop_io * io, ktime_t start, int nr);
 
 int ploop_register_format(struct ploop_delta_ops * ops);
 int ploop_register_io(struct ploop_io_ops * ops);
@@ -783,6 +926,7 @@ void ploop_sysfs_uninit(struct ploop_device * plo);
 void ploop_queue_zero_request(struct ploop_device *plo, struct ploop_request *orig_preq, cluster_t clu);
 
 int ploop_maintenance_wait(struct ploop_device * plo);
+void ploop_merge_pause(struct ploop_device * plo, int pause);
 
 extern int max_map_pages;
 
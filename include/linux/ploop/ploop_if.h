@@ -42,6 +42,7 @@ enum {
 #define PLOOP_IO_NFS		2
 #define PLOOP_IO_RESERVED	3	/* reserved, do not use */
 #define PLOOP_IO_KAIO		4
+#define PLOOP_IO_CACHE		5	/* stacked by PLOOP_IOC_CACHE_ATTACH */
 
 /*
  * # slots to skip in the very first page of L2 table
@@ -52,6 +53,15 @@ enum {
  */
 #define PLOOP_MAP_OFFSET	16
 
+/*
+ * Range of pctl_cluster_log, the cluster being 512 << pctl_cluster_log
+ * bytes, but not less than a page: 4K .. 4M. All deltas of a device have
+ * the same one. Clusters above the usual 1M cut image index and the
+ * memory to cache it in proportion, for sequential workloads.
+ */
+#define PLOOP_MIN_CLUSTER_LOG	3
+#define PLOOP_MAX_CLUSTER_LOG	13
+
 /*
  * in-kernel ploop implementation assumes that L2[index] can never be
  * equal to this value (this is guaranteed by limitation of bdsize).
@@ -195,6 +205,7 @@ enum {
 
 	PLOOP_MNTN_TRACK,    /* tracking is in progress */
 	PLOOP_MNTN_DISCARD,  /* ready to handle discard requests */
+	PLOOP_MNTN_PUSH_BACKUP, /* push backup is in progress */
 
 	PLOOP_MNTN_NOFAST = 256,
 	/* all types below requires fast-path disabled ! */
@@ -302,6 +313,54 @@ struct ploop_track_extent
 /* Set maximum size for the top delta . */
 #define PLOOP_IOC_MAX_DELTA_SIZE _IOW(PLOOPCTLTYPE, 28, __u64)
 
+/* Push backup: a range of clusters of the virtual device */
+struct ploop_push_backup_extent
+{
+	__u32	clu;
+	__u32	len;	/* 0 means that everything is backed up */
+};
+
+/* Start push backup. From now on writes to the clusters not backed up
+ * yet are held until user-space reports them as backed up. */
+#define PLOOP_IOC_PUSH_BACKUP_INIT _IO(PLOOPCTLTYPE, 29)
+
+/* ploop -> user: next clusters to back up. Clusters which writers are
+ * waiting for go first. Clusters returned but not acked yet are
+ * returned again after a full pass. */
+#define PLOOP_IOC_PUSH_BACKUP_GET _IOR(PLOOPCTLTYPE, 30, struct ploop_push_backup_extent)
+
+/* user -> ploop: clusters are backed up, release writers waiting for them */
+#define PLOOP_IOC_PUSH_BACKUP_ACK _IOW(PLOOPCTLTYPE, 31, struct ploop_push_backup_extent)
+
+/* Stop push backup, release all held writes */
+#define PLOOP_IOC_PUSH_BACKUP_STOP _IO(PLOOPCTLTYPE, 32)
+
+/* Relocate tail of top delta into free blocks loaded by discard or
+ * balloon and truncate it. Only level is used on input, the result is
+ * reported as for PLOOP_IOC_RELOCBLKS: alloc_head is the number of
+ * blocks truncated. */
+#define PLOOP_IOC_COMPACT	_IOW(PLOOPCTLTYPE, 33, struct ploop_relocblks_ctl)
+
+/* Write-back cache of the top delta in a file on fast storage */
+struct ploop_cache_ctl
+{
+	__u32	fd;		/* cache file, opened O_RDWR|O_DIRECT */
+	__u32	flags;
+};
+
+/* Cache file is initialized, whatever it contained is lost. Without the
+ * flag, the file must be the cache this image was used with last, data
+ * not written back to the image yet is written back on attach, which is
+ * only allowed before PLOOP_IOC_START. An image is marked while a cache
+ * may hold its dirty data: it cannot be started without that cache, nor
+ * get another one. */
+#define PLOOP_CACHE_FORMAT	1
+
+#define PLOOP_IOC_CACHE_ATTACH	_IOW(PLOOPCTLTYPE, 34, struct ploop_cache_ctl)
+
+/* Write back everything and detach the cache */
+#define PLOOP_IOC_CACHE_DETACH	_IO(PLOOPCTLTYPE, 35)
+
 /* Events exposed via /sys/block/ploopN/pstate/event */
 #define PLOOP_EVENT_ABORTED	1
 #define PLOOP_EVENT_STOPPED	2
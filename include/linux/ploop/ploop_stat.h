@@ -36,6 +36,10 @@ __DO(map_merges)
 __DO(map_single_writes)
 __DO(map_multi_writes)
 __DO(map_multi_updates)
+__DO(map_hits)
+__DO(map_misses)
+__DO(map_evictions)
+__DO(map_readahead)
 __DO(bio_trans_whole)
 __DO(bio_trans_copy)
 __DO(bio_trans_alloc)
@@ -46,3 +50,22 @@ __DO(bio_flush_out)
 __DO(bio_fua_out)
 __DO(bio_flush_skip)
 
+__DO(kaio_plugged)
+__DO(kaio_merges)
+__DO(dio_plugged)
+__DO(bio_pb_held)
+__DO(map_flat_hits)
+__DO(bio_shared_hits)
+__DO(nfs_inflight_max)
+__DO(nfs_window_waits)
+__DO(nfs_merges)
+__DO(cache_read_hits)
+__DO(cache_read_misses)
+__DO(cache_writes)
+__DO(cache_parked)
+__DO(cache_fills)
+__DO(cache_writebacks)
+__DO(cache_commits)
+__DO(bio_discard_merges)
+__DO(map_flat_runs)
+__DO(snap_held_writes)
@@ -39,6 +39,8 @@ struct pram_stream {
 	struct page *data_page;
 	unsigned long data_offset;
 	gfp_t gfp_mask;
+	int csum_lazy;		/* verify data pages on pop */
+	u64 start_ns;		/* for statistics */
 };
 
 #define PRAM_WRITE	1
@@ -20,6 +20,13 @@ extern int ramfs_get_sb(struct file_system_type *fs_type,
 	 int flags, const char *dev_name, void *data, struct vfsmount *mnt);
 extern int ramfs_fill_super(struct super_block * sb, void * data, int silent);
 
+#ifdef CONFIG_PRAMFS
+struct dentry;
+struct vfsmount;
+extern int pram_fs_save_tree(struct dentry *root, const char *basename);
+extern int pram_fs_load_tree(struct vfsmount *mnt, const char *basename);
+#endif
+
 #ifndef CONFIG_MMU
 extern int ramfs_nommu_expand_for_mapping(struct inode *inode, size_t newsize);
 extern unsigned long ramfs_nommu_get_unmapped_area(struct file *file,
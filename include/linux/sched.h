@@ -508,9 +508,11 @@ extern int get_dumpable(struct mm_struct *mm);
 #define MMF_VM_MERGEABLE	16	/* KSM may merge identical pages */
 #define MMF_VM_HUGEPAGE		17	/* set when VM_HUGEPAGE is set on vma */
 #define MMF_COMPAT		18	/* this task runs in compat mode. */
+#define MMF_POSTCOPY		19	/* swap ptes of post-copy restore */
 
 #define MMF_INIT_MASK		\
-	((1 << MMF_COMPAT) | MMF_DUMPABLE_MASK | MMF_DUMP_FILTER_MASK)
+	((1 << MMF_COMPAT) | (1 << MMF_POSTCOPY) | \
+	 MMF_DUMPABLE_MASK | MMF_DUMP_FILTER_MASK)
 
 struct sighand_struct {
 	atomic_t		count;
@@ -3003,6 +3005,7 @@ static inline void set_task_cpu(struct task_struct *p, unsigned int cpu)
 extern unsigned int task_nr_cpus(struct task_struct *p);
 extern unsigned int task_vcpu_id(struct task_struct *p);
 extern unsigned int sysctl_sched_vcpu_hotslice;
+extern unsigned int sysctl_sched_cpulimit_pack;
 extern unsigned int sysctl_sched_cpulimit_scale_cpufreq;
 extern unsigned int sched_cpulimit_scale_cpufreq(unsigned int freq);
 #else
@@ -157,6 +157,8 @@ static inline void exit_shm(struct task_struct *task)
 
 int sysvipc_walk_shm(int (*func)(struct shmid_kernel*, void *), void *arg);
 struct file * sysvipc_setup_shm(key_t key, int shmid, size_t size, int shmflg);
+void sysvipc_shm_set_interleave(struct file *file, int on);
+int sysvipc_shm_interleaved(struct file *file);
 extern const struct file_operations shmem_file_operations;
 extern const struct file_operations shm_file_operations;
 
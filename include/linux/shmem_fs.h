@@ -32,6 +32,11 @@ struct shmem_sb_info {
 	gid_t gid;		    /* Mount gid for root directory */
 	mode_t mode;		    /* Mount mode for root directory */
 	struct mempolicy *mpol;     /* default memory policy for mappings */
+#ifdef CONFIG_PRAMFS
+	char *pram_name;	    /* contents are kept in pram under it */
+	unsigned int pram_veid;	    /* container the contents belong to */
+	int pram_save;		    /* save contents on umount */
+#endif
 };
 
 static inline struct shmem_inode_info *SHMEM_I(struct inode *inode)
@@ -78,8 +83,10 @@ static inline int shmem_acl_init(struct inode *inode, struct inode *dir)
 
 int shmem_insertpage(struct inode * inode, unsigned long index,
 		     swp_entry_t swap);
+int shmem_insert_page(struct inode *inode, pgoff_t index, struct page *page);
 int install_shmem_page(struct vm_area_struct *vma,
 		       unsigned long addr, struct page *page);
+int shmem_read_swapped_pages(struct inode *inode);
 int is_shmem_vma(struct vm_area_struct *vma);
 
 #endif
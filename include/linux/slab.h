@@ -96,6 +96,10 @@
  *  cache (SLAB_UBC | SLAB_NO_CHARGE)		charge		---
  *					     (ub_kmalloc)    (kmalloc)
  *
+ *  cache (SLAB_UBC | SLAB_UB_PAGES)		charge		charge
+ *			(socks, ...: per-beancounter child caches charged
+ *				     by whole slab pages, see mm/slab.c)
+ *
  *  cache (no UB flags)				BUG()		---
  *							(nonub caches, mempools)
  *
@@ -106,6 +110,7 @@
  */
 #define SLAB_UBC		0x10000000UL	/* alloc space for ubs ... */
 #define SLAB_NO_CHARGE		0x20000000UL	/* ... but don't charge */
+#define SLAB_UB_PAGES		0x40000000UL	/* slab pages per beancounter */
 
 /*
  * struct kmem_cache related prototypes
@@ -140,9 +145,13 @@ extern void slab_walk_ub(struct user_beancounter *ub,
 void kmem_mark_nocharge(struct kmem_cache *cachep);
 struct user_beancounter **ub_slab_ptr(struct kmem_cache *cachep, void *obj);
 struct user_beancounter *slab_ub(void *obj);
+void slab_shrink_ub(struct user_beancounter *ub);
+void slab_destroy_ub(struct user_beancounter *ub);
 #else
 static inline void kmem_mark_nocharge(struct kmem_cache *cachep) { }
 static inline struct user_beancounter *slab_ub(void *obj) { return NULL; }
+static inline void slab_shrink_ub(struct user_beancounter *ub) { }
+static inline void slab_destroy_ub(struct user_beancounter *ub) { }
 #endif
 /*
  * Please use this macro to create slab caches. Simply specify the
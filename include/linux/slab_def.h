@@ -115,6 +115,12 @@ struct kmem_cache {
 #endif /* CONFIG_DEBUG_SLAB */
 #ifdef CONFIG_BEANCOUNTERS
 	int objuse;
+	/* SLAB_UB_PAGES parent: children list, index in ub_slab_caches */
+	int ub_slab_idx;
+	unsigned int ub_align;
+	/* child: the owner, link in the children list */
+	struct user_beancounter *ub;
+	struct list_head ub_list;
 #endif
 
 /* 6) per-cpu/per-node data, touched during every alloc/free */
@@ -49,9 +49,16 @@ static inline int current_is_kswapd(void)
  */
 
 #ifdef CONFIG_MEMORY_VSWAP
-#define SWP_VSWAP_NUM 2
 #define SWP_VSWAP_READ	(MAX_SWAPFILES + SWP_HWPOISON_NUM + SWP_MIGRATION_NUM)
 #define SWP_VSWAP_WRITE	(SWP_VSWAP_READ + 1)
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+/* vswapped pages kept compressed in the host pool */
+#define SWP_VSWAP_NUM 4
+#define SWP_ZVSWAP_READ	(SWP_VSWAP_READ + 2)
+#define SWP_ZVSWAP_WRITE (SWP_VSWAP_READ + 3)
+#else
+#define SWP_VSWAP_NUM 2
+#endif
 #else
 #define SWP_VSWAP_NUM 0
 #endif
@@ -348,6 +355,10 @@ extern int kswapd_run(int nid);
 
 extern void swap_unplug_io_fn(struct backing_dev_info *, struct page *);
 
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+extern int sysctl_vswap_compress;
+#endif
+
 #ifdef CONFIG_PSWAP
 extern int sysctl_prune_pswap;
 extern int prune_pswap_sysctl_handler(ctl_table *table, int write,
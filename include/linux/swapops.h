@@ -191,6 +191,57 @@ static inline int page_vswapcount(struct page *page) { return 0; }
 
 #endif /* CONFIG_MEMORY_VSWAP */
 
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+
+static inline int is_zvswap_entry(swp_entry_t entry)
+{
+	return swp_type(entry) == SWP_ZVSWAP_READ ||
+	       swp_type(entry) == SWP_ZVSWAP_WRITE;
+}
+
+static inline int is_write_zvswap_entry(swp_entry_t entry)
+{
+	return swp_type(entry) == SWP_ZVSWAP_WRITE;
+}
+
+static inline swp_entry_t wprotect_zvswap_entry(swp_entry_t entry)
+{
+	return swp_entry(SWP_ZVSWAP_READ, swp_offset(entry));
+}
+
+extern int vswap_compress_page(struct page *page);
+extern int zvswap_load_page(swp_entry_t entry, struct page *page);
+extern void get_zvswap_entry(swp_entry_t entry);
+extern void put_zvswap_entry(swp_entry_t entry);
+
+#else /* CONFIG_MEMORY_VSWAP_COMPRESS */
+
+static inline int is_zvswap_entry(swp_entry_t entry)
+{
+	return 0;
+}
+static inline int is_write_zvswap_entry(swp_entry_t entry)
+{
+	return 0;
+}
+static inline swp_entry_t wprotect_zvswap_entry(swp_entry_t entry)
+{
+	return swp_entry(0, 0);
+}
+static inline int vswap_compress_page(struct page *page)
+{
+	return 0;
+}
+static inline int zvswap_load_page(swp_entry_t entry, struct page *page)
+{
+	BUG();
+	return -EINVAL;
+}
+static inline void get_zvswap_entry(swp_entry_t entry) { }
+static inline void put_zvswap_entry(swp_entry_t entry) { }
+
+#endif /* CONFIG_MEMORY_VSWAP_COMPRESS */
+
 #ifdef CONFIG_MIGRATION
 static inline swp_entry_t make_migration_entry(struct page *page, int write)
 {
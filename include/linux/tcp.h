@@ -422,6 +422,7 @@ struct tcp_sock {
 	u32	prr_out;	/* Total number of pkts sent during Recovery. */
 	struct list_head tsq_node; /* anchor in tsq_tasklet.head list */
 	unsigned long	tsq_flags;
+	struct hrtimer	pacing_timer;	/* next packet of a paced flow */
 #endif
 };
 
@@ -42,6 +42,7 @@ struct linux_mib;
 struct fib_info;
 struct fib_rule;
 struct veip_struct;
+struct venet_filter;
 struct ve_monitor;
 struct nsproxy;
 
@@ -52,6 +53,18 @@ struct svc_rqst;
 struct cgroup;
 struct css_set;
 
+/* hardware counters kept per VE with CONFIG_VE_HWSTAT */
+enum {
+	VE_HW_CYCLES,
+	VE_HW_INSTRUCTIONS,
+	VE_HW_LLC_MISSES,
+	VE_HW_NR,
+};
+
+struct ve_hw_stat {
+	u64			cnt[VE_HW_NR];
+};
+
 struct ve_struct {
 	struct list_head	ve_list;
 	wait_queue_head_t	ve_list_wait;
@@ -71,6 +84,9 @@ struct ve_struct {
 	int			is_running;
 	int			is_locked;
 	atomic_t		suspend;
+	/* tasks entered refrigerator while suspend is in progress */
+	atomic_t		suspend_frozen;
+	wait_queue_head_t	suspend_wq;
 	unsigned long		flags;
 	/* see vzcalluser.h for VE_FEATURE_XXX definitions */
 	__u64			features;
@@ -133,6 +149,12 @@ struct ve_struct {
 #if defined(CONFIG_VE_NETDEV) || defined (CONFIG_VE_NETDEV_MODULE)
 	struct veip_struct	*veip;
 	struct net_device	*_venet_dev;
+	struct venet_filter	*venet_filter;
+#endif
+#ifdef CONFIG_RPS
+	/* fairsched node CPUs, packets of its devices are steered there */
+	int			rps_pinned;
+	cpumask_t		rps_cpus;
 #endif
 
 /* per VE CPU stats*/
@@ -141,6 +163,12 @@ struct ve_struct {
 	u64			start_jiffies;	/* Deprecated */
 
 	struct kstat_lat_pcpu_struct	sched_lat_ve;
+	struct kstat_lat_pcpu_struct	alloc_lat_ve;
+	struct kstat_lat_pcpu_struct	page_in_ve;
+	struct kstat_lat_pcpu_struct	swap_in_ve;
+#ifdef CONFIG_VE_HWSTAT
+	struct ve_hw_stat	*hw_stat;	/* percpu */
+#endif
 
 #ifdef CONFIG_INET
 	struct venet_stat       *stat;
@@ -157,6 +185,12 @@ struct ve_struct {
 	unsigned		*_logged_chars;
 	char			*log_buf;
 #define VE_DEFAULT_LOG_BUF_LEN	4096
+	/* log_buf and the fields above of a non-super VE, not logbuf_lock */
+	spinlock_t		log_lock;
+	int			log_new_line;
+	unsigned long		log_rl_begin;
+	int			log_rl_printed;
+	int			log_rl_missed;
 
 	unsigned long		down_at;
 	struct list_head	cleanup_list;
@@ -176,6 +210,8 @@ struct ve_struct {
 
 	int 			odirect_enable;
 	int			fsync_enable;
+	/* wakeups of the tasks are coalesced on a grid of this step */
+	unsigned long		timer_slack_ns;
 
 #if defined(CONFIG_LOCKD) || defined(CONFIG_LOCKD_MODULE)
 	struct ve_nlm_data	*nlm_data;
@@ -203,6 +239,7 @@ struct ve_struct {
 	struct cred		*init_cred;
 	struct net		*ve_netns;
 	struct cgroup		*ve_cgroup;
+	struct cgroup		*ve_sched_cgroup;	/* fairsched node */
 	struct list_head	vetask_auxlist;
 #if defined(CONFIG_HOTPLUG)
 	u64 _uevent_seqnum;
@@ -298,6 +335,30 @@ static inline int vtty_open_master(int veid, int idx) { return -ENODEV; }
 
 #define restoring_ve(ve)	test_bit(VE_RESTORE, &(ve)->flags)
 
+#ifdef CONFIG_VE_HWSTAT
+extern int ve_hwstat_active;
+extern void __ve_hwstat_switch(struct ve_struct *prev);
+extern void ve_hwstat_get(struct ve_struct *ve, u64 *cnt);
+extern int ve_hwstat_sysctl_handler(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos);
+
+/*
+ * Called on context switch with the rq lock held. The counts since the
+ * last switch between VEs on this cpu are charged to the VE left.
+ */
+static inline void ve_hwstat_switch(struct ve_struct *prev,
+		struct ve_struct *next)
+{
+	if (unlikely(ve_hwstat_active) && prev != next)
+		__ve_hwstat_switch(prev);
+}
+#else
+static inline void ve_hwstat_switch(struct ve_struct *prev,
+		struct ve_struct *next)
+{
+}
+#endif
+
 #else	/* CONFIG_VE */
 #define ve_utsname	system_utsname
 #define get_ve(ve)	(NULL)
@@ -16,11 +16,28 @@
 #include <linux/vzcalluser.h>
 #include <linux/veip.h>
 #include <linux/netdevice.h>
+#include <linux/u64_stats_sync.h>
 
-#define VEIP_HASH_SZ 512
+#define VEIP_HASH_SZ 512		/* initial number of buckets */
+#define VEIP_HASH_MAX (1 << 18)
+#define VENET_IP_MAP_BULK_MAX 65536	/* addresses per bulk ioctl */
+
+#define VENET_ACCT_CLASSES	16
+#define VENET_ACCT_MAX_PREFIXES	256
+
+#define VENET_ACCT_IN		0
+#define VENET_ACCT_OUT		1
 
 struct ve_struct;
-struct venet_stat;
+struct vzctl_venet_acct_prefix;
+
+/* per-cpu traffic counters of a VE, see venet_acct.c */
+struct venet_stat {
+	u64			bytes[VENET_ACCT_CLASSES][2];
+	u64			packets[VENET_ACCT_CLASSES][2];
+	struct u64_stats_sync	syncp;
+};
+
 struct venet_stats {
 	struct net_device_stats	stats;
 	struct net_device_stats	*real_stats;
@@ -31,7 +48,7 @@ struct ip_entry_struct
 	struct ve_addr_struct	addr;
 	struct ve_struct	*active_env;
 	struct veip_struct	*tgt_veip;
-	struct hlist_node 	ip_hash;
+	struct hlist_node 	ip_hash[2];	/* see veip_hash_table */
 	union {
 		struct list_head 	ve_list;
 		struct rcu_head		rcu;
@@ -57,6 +74,23 @@ struct veip_struct
 	struct rcu_head		rcu;
 };
 
+/*
+ * The table grows when there are more entries than buckets. The new table
+ * links entries through the other ip_hash node, so lookups in progress
+ * still walk the old one until it is freed after a grace period.
+ */
+struct veip_hash_table {
+	unsigned int		mask;
+	int			node;		/* index in ip_hash[] */
+	struct hlist_head	buckets[0];
+};
+
+static inline struct ip_entry_struct *
+veip_hash_entry(struct hlist_node *n, struct veip_hash_table *table)
+{
+	return container_of(n - table->node, struct ip_entry_struct, ip_hash[0]);
+}
+
 struct veip_pool_ops {
 	int (*veip_create)(struct ve_struct *);
 	void (*veip_release)(struct ve_struct *);
@@ -89,7 +123,25 @@ extern struct list_head veip_lh;
 struct ext_entry_struct *venet_ext_lookup(struct ve_struct *ve,
 		struct ve_addr_struct *addr);
 
-extern struct hlist_head ip_entry_hash_table[];
+extern struct veip_hash_table *veip_hash;
+
+int venet_skb_addr(struct sk_buff *skb, struct ve_addr_struct *addr, int dst);
+int venet_filter_drop(struct ve_struct *ve, struct sk_buff *skb);
+void venet_filter_destroy(struct ve_struct *ve);
+int venet_filter_ctl(envid_t veid, int op, struct sockaddr __user *uaddr,
+		int addrlen, unsigned int rate, unsigned int burst);
+
+void venet_acct_skb(struct ve_struct *ve, struct sk_buff *skb, int dir);
+int venet_acct_init(struct ve_struct *ve);
+void venet_acct_fini(struct ve_struct *ve);
+int venet_acct_set_classes(unsigned int nr,
+		struct vzctl_venet_acct_prefix __user *uprefixes);
+void venet_acct_cleanup(void);
+int venet_gro_rx(struct sk_buff *skb);
+int venet_gro_init(void);
+void venet_gro_fini(void);
+extern struct file_operations proc_venet_acct_operations;
+
 extern spinlock_t veip_lock;
 
 #endif
@@ -22,6 +22,8 @@
 				log_buf_len : VE_DEFAULT_LOG_BUF_LEN)
 #define VE_LOG_BUF_MASK		(ve_log_buf_len - 1)
 #define VE_LOG_BUF(idx)		(ve_log_buf[(idx) & VE_LOG_BUF_MASK])
+#define ve_logbuf_lock		(ve_is_super(get_exec_env()) ? &logbuf_lock : \
+				&get_exec_env()->log_lock)
 
 #else
 
@@ -33,6 +35,7 @@
 #define ve_log_buf_len		log_buf_len
 #define VE_LOG_BUF_MASK		LOG_BUF_MASK
 #define VE_LOG_BUF(idx)		LOG_BUF(idx)
+#define ve_logbuf_lock		(&logbuf_lock)
 
 #endif /* CONFIG_VE */
 #endif /* __VE_PRINTK_H__ */
@@ -19,13 +19,25 @@ enum {
 };
 
 #ifdef __KERNEL__
+#include <linux/u64_stats_sync.h>
+
+/* updated by the sender of a packet with bh disabled */
+struct veth_pcpu_stats
+{
+	u64			rx_bytes;
+	u64			tx_bytes;
+	u64			rx_packets;
+	u64			tx_packets;
+	u64			tx_dropped;
+	struct u64_stats_sync	syncp;
+};
+
 struct veth_struct
 {
-	struct net_device_stats stats;
 	struct net_device	*me;
 	struct net_device	*pair;
 	struct list_head	hwaddr_list;
-	struct net_device_stats	*real_stats;
+	struct veth_pcpu_stats	*real_stats;
 	int			allow_mac_change;
 };
 
@@ -37,7 +49,7 @@ static inline struct net_device * veth_to_netdev(struct veth_struct *veth)
 }
 #endif
 
-static inline struct net_device_stats *
+static inline struct veth_pcpu_stats *
 veth_stats(struct net_device *dev, int cpuid)
 {
 	return per_cpu_ptr(veth_from_netdev(dev)->real_stats, cpuid);
@@ -65,6 +65,7 @@ int meminfo_proc_show_ub(struct seq_file *m, void *v,
 #define VIRTINFO_SYSINFO	2
 #define VIRTINFO_VMSTAT		3
 #define VIRTINFO_OOMKILL	4
+#define VIRTINFO_PAGEIN		5
 
 #define VIRTINFO_IO_ACCOUNT	0
 #define VIRTINFO_IO_PREPARE	1
@@ -74,6 +75,7 @@ int meminfo_proc_show_ub(struct seq_file *m, void *v,
 #define VIRTINFO_IO_OP_ACCOUNT	5
 #define VIRTINFO_IO_BALANCE_DIRTY	6
 #define VIRTINFO_IO_FUSE_REQ	7
+#define VIRTINFO_IO_BIO		8
 
 enum virt_info_types {
 	VITYPE_GENERAL,
@@ -70,6 +70,14 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		THP_COLLAPSE_ALLOC,
 		THP_COLLAPSE_ALLOC_FAILED,
 		THP_SPLIT,
+#endif
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+		SPF_FAULT,
+		SPF_FAULT_FALLBACK,
+#endif
+#ifdef CONFIG_PAGECACHE_REPLICATION
+		PGREPLICATE,
+		PGREPLICATE_DROP,
 #endif
 		NR_VM_EVENT_ITEMS
 };
@@ -69,11 +69,28 @@ struct vzctl_ve_configure {
 #define VE_CONFIGURE_CREATE_PROC_LINK	4
 #define VE_CONFIGURE_OPEN_TTY		5
 #define VE_CONFIGURE_MOUNT_OPTIONS	7
+#define VE_CONFIGURE_THP		8
+#define VE_CONFIGURE_SWAP		9	/* data: path of swap area */
+#define VE_CONFIGURE_PAGECACHE		10	/* val: cache limit, pages */
+#define VE_CONFIGURE_COMPACT		11	/* val: ms per second */
+#define VE_CONFIGURE_FUTEX		12	/* val: private futex buckets */
 	unsigned int val;
 	unsigned int size;
 	char data[0];
 };
 
+/*
+ * val of VE_CONFIGURE_THP, the THP enabled mode and the defrag mode
+ * shifted by VE_THP_DEFRAG_SHIFT. Either overrides the global one from
+ * /sys/kernel/mm/transparent_hugepage for the VE unless it is default.
+ */
+#define VE_THP_DEFAULT		0
+#define VE_THP_ALWAYS		1
+#define VE_THP_MADVISE		2
+#define VE_THP_NEVER		3
+#define VE_THP_MASK		3
+#define VE_THP_DEFRAG_SHIFT	2
+
 struct vzctl_ve_meminfo {
 	envid_t veid;
 	unsigned long val;
@@ -120,6 +137,7 @@ struct env_create_param3 {
 #define VE_FEATURE_IPGRE	(1ULL << 6)
 #define VE_FEATURE_BRIDGE	(1ULL << 7)
 #define VE_FEATURE_NFSD		(1ULL << 8)
+#define VE_FEATURE_KSM		(1ULL << 9)	/* merge all private memory */
 
 #define VE_FEATURES_OLD		(VE_FEATURE_SYSFS)
 #define VE_FEATURES_DEF		(VE_FEATURE_SYSFS | \
@@ -157,6 +175,41 @@ struct vzctl_cpustatctl {
 	struct vz_cpu_stat __user *cpustat;
 };
 
+#define VZ_FAIRSCHED_STAT_VERSION	1
+
+struct vz_fairsched_stat {
+	__u32 id;
+	__u32 weight;
+	__u32 rate;
+	__u32 nr_cpus;
+	__u32 nr_running;
+	__u32 nr_throttled;
+	__u64 user_jif;
+	__u64 nice_jif;
+	__u64 system_jif;
+	__u64 throttled_time;		/* ns */
+	struct vz_load_avg avenrun[3];	/* loadavg data */
+};
+
+/*
+ * Stats of all fairsched nodes visible to the caller. The number of nodes
+ * present is returned in nr, the ioctl returns the number of filled ones.
+ */
+struct vzctl_fairsched_stats {
+	__u32 version;			/* VZ_FAIRSCHED_STAT_VERSION */
+	__u32 nr;			/* in: size of stats array */
+	struct vz_fairsched_stat __user *stats;
+};
+
+/* Totals of the hardware counters of a VE, 0 is the host */
+struct vzctl_hwstatctl {
+	envid_t veid;
+	__u32 pad;
+	__u64 cycles;
+	__u64 instructions;
+	__u64 llc_misses;
+};
+
 #define VZCTLTYPE '.'
 #define VZCTL_OLD_ENV_CREATE	_IOW(VZCTLTYPE, 0,			\
 					struct vzctl_old_env_create)
@@ -178,6 +231,10 @@ struct vzctl_cpustatctl {
 					struct vzctl_ve_meminfo)
 #define VZCTL_VE_CONFIGURE	_IOW(VZCTLTYPE, 15,			\
 					struct vzctl_ve_configure)
+#define VZCTL_GET_FAIRSCHED_STATS _IOWR(VZCTLTYPE, 16,			\
+					struct vzctl_fairsched_stats)
+#define VZCTL_GET_HW_STAT	_IOWR(VZCTLTYPE, 17,			\
+					struct vzctl_hwstatctl)
 
 #ifdef __KERNEL__
 #ifdef CONFIG_COMPAT
@@ -202,12 +259,20 @@ struct compat_vzctl_env_create_data {
 	int datalen;
 };
 
+struct compat_vzctl_fairsched_stats {
+	__u32 version;
+	__u32 nr;
+	compat_uptr_t stats;
+};
+
 #define VZCTL_COMPAT_ENV_CREATE_DATA _IOW(VZCTLTYPE, 10,		\
 					struct compat_vzctl_env_create_data)
 #define VZCTL_COMPAT_VE_NETDEV	_IOW(VZCTLTYPE, 11,			\
 					struct compat_vzctl_ve_netdev)
 #define VZCTL_COMPAT_VE_MEMINFO	_IOW(VZCTLTYPE, 13,                     \
 					struct compat_vzctl_ve_meminfo)
+#define VZCTL_COMPAT_GET_FAIRSCHED_STATS _IOWR(VZCTLTYPE, 16,		\
+					struct compat_vzctl_fairsched_stats)
 #endif
 #endif
 
@@ -36,6 +36,53 @@ struct vzctl_ve_ip_map {
 #define VENETCTL_VE_IP_MAP	_IOW(VENETCTLTYPE, 3,			\
 					struct vzctl_ve_ip_map)
 
+struct vzctl_ve_filter {
+	envid_t veid;
+	int op;
+#define VE_FILTER_BLOCK_ADD	1
+#define VE_FILTER_BLOCK_DEL	2
+#define VE_FILTER_FLUSH		3
+#define VE_FILTER_RATE		4
+	struct sockaddr *addr;		/* source to block */
+	int addrlen;
+	unsigned int rate;		/* packets per second, 0 for no limit */
+	unsigned int burst;
+};
+
+#define VENETCTL_VE_FILTER	_IOW(VENETCTLTYPE, 4,			\
+					struct vzctl_ve_filter)
+
+struct vzctl_venet_acct_prefix {
+	int family;
+	__u32 addr[4];			/* IPv4 address in addr[0] */
+	__u32 prefixlen;
+	__u32 class;			/* 0 .. VENET_ACCT_CLASSES - 1 */
+};
+
+struct vzctl_venet_acct_classes {
+	unsigned int nr;		/* 0 to put all traffic to class 0 */
+	struct vzctl_venet_acct_prefix *prefixes;
+};
+
+#define VENETCTL_ACCT_CLASSES	_IOW(VENETCTLTYPE, 5,			\
+					struct vzctl_venet_acct_classes)
+
+/* same layout as struct ve_addr_struct */
+struct vzctl_ve_ip_addr {
+	int family;
+	__u32 key[4];			/* IPv4 address in key[3] */
+};
+
+struct vzctl_ve_ip_map_bulk {
+	envid_t veid;
+	int op;				/* VE_IP_ADD or VE_IP_DEL */
+	unsigned int nr;
+	struct vzctl_ve_ip_addr *addrs;
+};
+
+#define VENETCTL_VE_IP_MAP_BULK	_IOW(VENETCTLTYPE, 6,			\
+					struct vzctl_ve_ip_map_bulk)
+
 #ifdef __KERNEL__
 #ifdef CONFIG_COMPAT
 struct compat_vzctl_ve_ip_map {
@@ -47,6 +94,36 @@ struct compat_vzctl_ve_ip_map {
 
 #define VENETCTL_COMPAT_VE_IP_MAP _IOW(VENETCTLTYPE, 3,			\
 					struct compat_vzctl_ve_ip_map)
+
+struct compat_vzctl_ve_filter {
+	envid_t veid;
+	int op;
+	compat_uptr_t addr;
+	int addrlen;
+	unsigned int rate;
+	unsigned int burst;
+};
+
+#define VENETCTL_COMPAT_VE_FILTER _IOW(VENETCTLTYPE, 4,			\
+					struct compat_vzctl_ve_filter)
+
+struct compat_vzctl_venet_acct_classes {
+	unsigned int nr;
+	compat_uptr_t prefixes;
+};
+
+#define VENETCTL_COMPAT_ACCT_CLASSES _IOW(VENETCTLTYPE, 5,		\
+					struct compat_vzctl_venet_acct_classes)
+
+struct compat_vzctl_ve_ip_map_bulk {
+	envid_t veid;
+	int op;
+	unsigned int nr;
+	compat_uptr_t addrs;
+};
+
+#define VENETCTL_COMPAT_VE_IP_MAP_BULK _IOW(VENETCTLTYPE, 6,		\
+					struct compat_vzctl_ve_ip_map_bulk)
 #endif
 #endif
 
@@ -70,10 +70,24 @@ struct quotatree_level {
 	quotaid_t freenum;
 };
 
+/*
+ * Open addressing index of leafs by id, so that a lookup of an existing
+ * leaf does not walk all QUOTATREE_DEPTH levels. The tree itself is kept,
+ * its layout is what quota file and leaf iteration are built from.
+ */
+struct quotatree_hent {
+	quotaid_t id;
+	void *data;		/* NULL marks a free slot */
+};
+
+#define QUOTATREE_HASH_MINBITS	4
+
 struct quotatree_tree {
 	struct quotatree_level levels[QUOTATREE_DEPTH];
 	struct quotatree_node *root;
 	unsigned int leaf_num;
+	struct quotatree_hent *hash;	/* NULL if could not be grown */
+	unsigned int hash_bits;
 };
 
 struct quotatree_find_state {
@@ -1,6 +1,8 @@
 #ifndef __LINUX_VZ_EVENT_H__
 #define __LINUX_VZ_EVENT_H__
 
+#include <linux/types.h>
+
 #if defined(CONFIG_VZ_EVENT) || defined(CONFIG_VZ_EVENT_MODULE)
 extern int vzevent_send(int msg, const char *attrs_fmt, ...);
 #else
@@ -18,4 +20,19 @@ enum {
 	VE_EVENT_REBOOT,
 };
 
+/*
+ * Binary events. Listeners of the VZ_EVGRP_BIN group get an array of
+ * these per message, the text ones stay in VZ_EVGRP_ALL. A gap in seq
+ * means messages were dropped, the events missed can be read back from
+ * /proc/vz/vzevents as long as they are still in the ring.
+ */
+#define VZ_EVGRP_BIN	0x02
+
+struct vzevent_rec {
+	__u32	seq;
+	__u16	event;
+	__u16	reserved;
+	__u32	veid;
+};
+
 #endif /* __LINUX_VZ_EVENT_H__ */
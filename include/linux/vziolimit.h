@@ -21,9 +21,43 @@ struct iolimit_state {
 	unsigned int latency;
 };
 
+/* Burst credit, accumulated from unused speed while container is idle */
+struct iolimit_credit {
+	unsigned int id;
+	unsigned int speed_credit;	/* bytes */
+	unsigned int iops_credit;	/* operations */
+	unsigned int accrual;		/* percent of unused speed saved */
+};
+
+struct iolimit_stat {
+	unsigned int id;
+	unsigned int pad;
+	__u64 throttled;		/* number of throttling waits */
+	__u64 throttled_time;		/* total wait time, ms */
+	__s64 tokens;			/* bytes available without waiting */
+	__s64 credit;			/* bytes of burst credit */
+	__s64 iops_tokens;
+	__s64 iops_credit;
+};
+
+/* Limit of reads (rw = 0) or writes (rw = 1) to one disk */
+struct iolimit_dev_state {
+	unsigned int id;
+	unsigned int dev;		/* whole disk, new_encode_dev() format */
+	unsigned int rw;
+	unsigned int speed;		/* bytes per second, 0 - no limit */
+	unsigned int burst;
+	unsigned int latency;		/* ms */
+};
+
 #define VZCTL_SET_IOLIMIT	_IOW(VZIOLIMITTYPE, 0, struct iolimit_state)
 #define VZCTL_GET_IOLIMIT	_IOR(VZIOLIMITTYPE, 1, struct iolimit_state)
 #define VZCTL_SET_IOPSLIMIT	_IOW(VZIOLIMITTYPE, 2, struct iolimit_state)
 #define VZCTL_GET_IOPSLIMIT	_IOR(VZIOLIMITTYPE, 3, struct iolimit_state)
+#define VZCTL_SET_IOLIMIT_CREDIT _IOW(VZIOLIMITTYPE, 4, struct iolimit_credit)
+#define VZCTL_GET_IOLIMIT_CREDIT _IOR(VZIOLIMITTYPE, 5, struct iolimit_credit)
+#define VZCTL_GET_IOLIMIT_STAT	_IOR(VZIOLIMITTYPE, 6, struct iolimit_stat)
+#define VZCTL_SET_IOLIMIT_DEV	_IOW(VZIOLIMITTYPE, 7, struct iolimit_dev_state)
+#define VZCTL_GET_IOLIMIT_DEV	_IOR(VZIOLIMITTYPE, 8, struct iolimit_dev_state)
 
 #endif /* _LINUX_VZIOLIMIT_H */
@@ -26,6 +26,7 @@
 #define VZ_DQ_ON_FILE		12 /* on with data in file */
 #define VZ_DQ_OFF_FILE		13 /* off and sync data to file */
 #define VZ_DQ_STATUS		14 /* report general info (see VZDQ_XXX below) */
+#define VZ_DQ_GETCKPT		15 /* get checkpoint record found by on_file */
 
 /* set of syscalls to maintain UGID quotas */
 #define VZ_DQ_UGID_GETSTAT	1 /* get usage/limits for ugid(s) */
@@ -57,6 +58,7 @@ struct dq_stat {
 /* Values for dq_info->flags */
 #define VZ_QUOTA_INODES 0x01       /* inodes limit warning printed */
 #define VZ_QUOTA_SPACE  0x02       /* space limit warning printed */
+#define VZ_QUOTA_DIRTY  0x04       /* file wasn't closed, recount usage */
 
 struct dq_info {
 	time_t		bexpire;   /* expire timeout for excessive disk use */
@@ -69,6 +71,14 @@ struct vz_quota_stat  {
 	struct dq_info dq_info;
 };
 
+/* checkpoint record of quota file as found by VZ_DQ_ON_FILE */
+struct vz_quota_ckpt_stat {
+	__u32	state;		/* VZQUOTA_CKPT_XXX */
+	__u32	pad;
+	__u64	generation;
+	__u64	ckpt_time;	/* seconds, usage is exact as of that time */
+};
+
 struct vz_quota_hdr {
 	__le32	magic;
 	__le32	version;
@@ -107,6 +117,26 @@ struct vz_quota_uginfo_img {
 	__le64	gid_iexpire;
 };
 
+/*
+ * Checkpoint record. Usage in the file is written back every
+ * VZQUOTA_CKPT_INTERVAL while quota is on, the record tells whether the
+ * file was closed cleanly and when the image was last known to be
+ * consistent, so that after a crash only what changed since then needs
+ * recounting.
+ */
+#define VZQUOTA_CKPT_OFF	2048
+#define VZQUOTA_CKPT_MAGIC	0x636b7074
+
+#define VZQUOTA_CKPT_CLEAN	0	/* quota off, usage is exact */
+#define VZQUOTA_CKPT_DIRTY	1	/* quota on, usage as of ckpt_time */
+
+struct vz_quota_ckpt_img {
+	__le32	magic;
+	__le32	state;
+	__le64	generation;
+	__le64	ckpt_time;
+};
+
 #define VZQUOTA_UGID_OFF	4096
 
 struct vz_quota_ugid_stat_img {
@@ -261,10 +291,14 @@ struct vz_quota_ugid_setinfo {
 #include <linux/vzquota_qlnk.h>
 #include <linux/vzdq_tree.h>
 #include <linux/semaphore.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
 
 /* Values for dq_info flags */
 #define VZ_QUOTA_INODES	0x01	   /* inodes limit warning printed */
 #define VZ_QUOTA_SPACE	0x02	   /* space limit warning printed */
+#define VZ_QUOTA_DIRTY	0x04	   /* file wasn't closed, recount usage */
 
 /* Kernel space data structures */
 struct dq_kstat {
@@ -337,6 +371,18 @@ static inline void dqinfo2user_dqinfo(struct dq_kinfo *dqi,
 	odqi->flags = dqi->flags;
 }
 
+/*
+ * Space usage of a master is changed per-cpu when far from the limits and
+ * folded into dq_stat in batches, see vzquota_qmblk_fold().
+ */
+struct vz_quota_pcpu {
+	atomic64_t		bcurrent;
+	atomic64_t		breserved;
+};
+
+#define VZDQ_PCPU_BATCH		(1ULL << 20)
+#define VZDQ_PCPU_SLACK		(VZDQ_PCPU_BATCH * nr_cpu_ids)
+
 /* master quota record - one per veid */
 struct vz_quota_master {
 	struct list_head	dq_hash;	/* next quota in hash list */
@@ -347,6 +393,7 @@ struct vz_quota_master {
 	struct dq_kstat	 dq_stat;	/* limits, grace, usage stats */
 	struct dq_kinfo	 dq_info;	/* grace times and flags */
 	spinlock_t		dq_data_lock;	/* for dq_stat */
+	struct vz_quota_pcpu	*dq_pcpu;	/* unfolded space usage */
 
 	struct mutex		dq_mutex;	/* mutex to protect
 						   ugid tree */
@@ -360,12 +407,32 @@ struct vz_quota_master {
 
 	struct inode		*qfile;
 	struct mutex		dq_write_lock;
+	struct delayed_work	dq_ckpt_work;	/* deferred write of qfile */
+	unsigned long		dq_ckpt_dirty;	/* qfile is behind dq_stat */
+	u64			dq_ckpt_gen;	/* under dq_write_lock */
+	struct vz_quota_ckpt_stat dq_ckpt_found; /* record met by on_file */
 
 	struct path		dq_root_path;	/* path of fs tree */
 	struct super_block	*dq_sb;	      /* superblock of our quota root */
 	void			*dq_snap;       /* pointer to vzsnap struct */
+
+	/* dq_stat as seen by statfs, written under dq_data_lock */
+	seqcount_t		dq_statfs_seq;
+	int			dq_statfs_valid;
+	unsigned long		dq_statfs_stamp;
+	struct dq_kstat		dq_statfs;
+
+	struct rcu_head		dq_rcu;		/* statfs reads qmblk under rcu */
 };
 
+/* called under dq_data_lock when limits change */
+static inline void vzquota_statfs_invalidate(struct vz_quota_master *qmblk)
+{
+	write_seqcount_begin(&qmblk->dq_statfs_seq);
+	qmblk->dq_statfs_valid = 0;
+	write_seqcount_end(&qmblk->dq_statfs_seq);
+}
+
 /* UID/GID quota record - one per pair (quota_master, uid or gid) */
 struct vz_quota_ugid {
 	unsigned int		qugid_id;     /* UID/GID this applies to */
@@ -401,6 +468,7 @@ struct virt_info_orphan {
 void __vzquota_mark_dirty(struct vz_quota_master *qmblk,
 		struct vz_quota_ugid **ugid);
 void vzquota_cur_qmblk_orphan_set(struct vz_quota_master *qmblk);
+void vzquota_ckpt_work(struct work_struct *work);
 int vzquota_on_cookie(struct super_block *sb, unsigned int cookie);
 void vzquota_off_cookies(struct super_block *sb);
 int vzquota_read_ugid(struct vz_quota_master *qmblk, struct inode *ino);
@@ -413,12 +481,20 @@ int vzquota_uginfo_write(struct inode *ino, struct vz_quota_uginfo_img *img);
 void vzquota_uginfo_dump(struct vz_quota_master *qmblk,
 		struct vz_quota_uginfo_img *img);
 
+#define VZQUOTA_CKPT_INTERVAL	(5 * HZ)
+
 static inline void vzquota_mark_dirty(struct vz_quota_master *qmblk,
 		struct vz_quota_ugid **ugid)
 {
 	/* FIXME - race with vzquota_off */
-	if (qmblk->qfile != NULL)
+	if (qmblk->qfile == NULL)
+		return;
+	/* ugid records are not tracked by the checkpoint, write them now */
+	if (ugid[0] != NULL || ugid[1] != NULL)
 		__vzquota_mark_dirty(qmblk, ugid);
+	else if (!test_and_set_bit(0, &qmblk->dq_ckpt_dirty))
+		schedule_delayed_work(&qmblk->dq_ckpt_work,
+				VZQUOTA_CKPT_INTERVAL);
 }
 
 void __vzquota_mark_dirty_ugids(struct vz_quota_master *qmblk,
@@ -466,9 +542,15 @@ void vzquota_inode_init_call(struct inode *inode);
 void vzquota_inode_swap_call(struct inode *, struct inode *);
 void vzquota_inode_drop_call(struct inode *inode);
 int vzquota_inode_transfer_call(struct inode *, struct iattr *);
-struct vz_quota_master *vzquota_inode_data(struct inode *inode,
-		struct vz_quota_datast *);
-void vzquota_data_unlock(struct inode *inode, struct vz_quota_datast *);
+struct vz_quota_master *__vzquota_inode_data(struct inode *inode,
+		struct vz_quota_datast *, int lock_data);
+void __vzquota_data_unlock(struct inode *inode, struct vz_quota_datast *,
+		int locked_data);
+struct vz_quota_master *vzquota_inode_qmblk_get(struct inode *inode);
+#define vzquota_inode_data(inode, data)	__vzquota_inode_data(inode, data, 1)
+#define vzquota_data_unlock(inode, data) __vzquota_data_unlock(inode, data, 1)
+void __vzquota_qmblk_fold(struct vz_quota_master *qmblk, int cpu);
+void vzquota_qmblk_fold(struct vz_quota_master *qmblk);
 int vzquota_rename_check(struct inode *inode,
 		struct inode *old_dir, struct inode *new_dir);
 struct vz_quota_master *vzquota_inode_qmblk(struct inode *inode);
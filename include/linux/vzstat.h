@@ -12,6 +12,7 @@
 #define __VZSTAT_H__
 
 #include <linux/mmzone.h>
+#include <linux/bitops.h>
 
 struct swap_cache_info_struct {
 	unsigned long add_total;
@@ -20,13 +21,26 @@ struct swap_cache_info_struct {
 	unsigned long find_total;
 };
 
+/*
+ * Histogram of latencies in ns: bucket 0 counts those below 1024,
+ * bucket i those in [2^(i+9), 2^(i+10)), the last one everything above.
+ */
+#define KSTAT_LAT_HIST_NR	24
+
+static inline int kstat_lat_hist_idx(u64 dur)
+{
+	return min_t(int, fls64(dur >> 10), KSTAT_LAT_HIST_NR - 1);
+}
+
 struct kstat_lat_snap_struct {
 	u64 maxlat, totlat;
 	unsigned long count;
+	unsigned long hist[KSTAT_LAT_HIST_NR];
 };
 struct kstat_lat_pcpu_snap_struct {
 	u64 maxlat, totlat;
 	unsigned long count;
+	unsigned long hist[KSTAT_LAT_HIST_NR];
 	seqcount_t lock;
 } ____cacheline_aligned_in_smp;
 
@@ -81,7 +95,7 @@ struct kernel_stat_glob {
 	struct kstat_lat_pcpu_struct alloc_lat[KSTAT_ALLOCSTAT_NR];
 	struct kstat_lat_pcpu_struct sched_lat;
 	struct kstat_lat_pcpu_struct page_in;
-	struct kstat_lat_struct swap_in;
+	struct kstat_lat_pcpu_struct swap_in;
 
 	struct kstat_perf_pcpu_struct ttfp, cache_reap,
 			refill_inact, shrink_icache, shrink_dcache;
@@ -139,6 +153,7 @@ static inline void KSTAT_LAT_ADD(struct kstat_lat_struct *p,
 	if (p->cur.maxlat < dur)
 		p->cur.maxlat = dur;
 	p->cur.totlat += dur;
+	p->cur.hist[kstat_lat_hist_idx(dur)]++;
 }
 
 /*
@@ -171,6 +186,7 @@ static inline void KSTAT_LAT_PCPU_ADD(struct kstat_lat_pcpu_struct *p, int cpu,
 	if (cur->maxlat < dur)
 		cur->maxlat = dur;
 	cur->totlat += dur;
+	cur->hist[kstat_lat_hist_idx(dur)]++;
 	write_seqcount_end(&cur->lock);
 }
 
@@ -191,7 +207,7 @@ static inline void KSTAT_LAT_UPDATE(struct kstat_lat_struct *p)
 
 static inline void KSTAT_LAT_PCPU_UPDATE(struct kstat_lat_pcpu_struct *p)
 {
-	unsigned i, cpu;
+	unsigned i, j, cpu;
 	struct kstat_lat_pcpu_snap_struct snap, *cur;
 	u64 m;
 
@@ -213,6 +229,8 @@ static inline void KSTAT_LAT_PCPU_UPDATE(struct kstat_lat_pcpu_struct *p)
 		p->last.totlat += snap.totlat;
 		if (p->last.maxlat < snap.maxlat)
 			p->last.maxlat = snap.maxlat;
+		for (j = 0; j < KSTAT_LAT_HIST_NR; j++)
+			p->last.hist[j] += snap.hist[j];
 	}
 
 	m = (p->last.maxlat > p->max_snap ? p->last.maxlat : p->max_snap);
@@ -223,4 +241,141 @@ static inline void KSTAT_LAT_PCPU_UPDATE(struct kstat_lat_pcpu_struct *p)
 	p->max_snap = 0;
 }
 
+/*
+ * Sums the histograms of all cpus, counts are since the start.
+ * Unlike KSTAT_LAT_PCPU_UPDATE this does not touch the statistics.
+ */
+static inline void KSTAT_LAT_PCPU_HIST(struct kstat_lat_pcpu_struct *p,
+		unsigned long *hist)
+{
+	unsigned i, j, cpu;
+	struct kstat_lat_pcpu_snap_struct *cur;
+	unsigned long snap[KSTAT_LAT_HIST_NR];
+
+	memset(hist, 0, sizeof(snap));
+	for_each_possible_cpu(cpu) {
+		cur = per_cpu_ptr(p->cur, cpu);
+		do {
+			i = read_seqcount_begin(&cur->lock);
+			memcpy(snap, cur->hist, sizeof(snap));
+		} while (read_seqcount_retry(&cur->lock, i));
+
+		for (j = 0; j < KSTAT_LAT_HIST_NR; j++)
+			hist[j] += snap[j];
+	}
+}
+
+/*
+ * Sums the counts, totals and histograms of all cpus, the same way as
+ * KSTAT_LAT_PCPU_HIST does.
+ */
+static inline void KSTAT_LAT_PCPU_SUM(struct kstat_lat_pcpu_struct *p,
+		struct kstat_lat_snap_struct *sum)
+{
+	unsigned i, j, cpu;
+	struct kstat_lat_pcpu_snap_struct snap, *cur;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		cur = per_cpu_ptr(p->cur, cpu);
+		do {
+			i = read_seqcount_begin(&cur->lock);
+			memcpy(&snap, cur, sizeof(snap));
+		} while (read_seqcount_retry(&cur->lock, i));
+
+		sum->count += snap.count;
+		sum->totlat += snap.totlat;
+		for (j = 0; j < KSTAT_LAT_HIST_NR; j++)
+			sum->hist[j] += snap.hist[j];
+	}
+}
+
+/*
+ * Binary /proc/vz/lat_hist: a header, then records of every VE with
+ * counts since its start. VE 0 holds the totals of the host, which
+ * also have a record for each kind of allocation. Scheduling and
+ * allocation latencies are in ns, page_in and swap_in in cycles.
+ */
+#define VZSTAT_LAT_VERSION	1
+
+enum {
+	VZSTAT_LAT_SCHED,
+	VZSTAT_LAT_ALLOC,		/* all kinds of allocations */
+	VZSTAT_LAT_PAGE_IN,
+	VZSTAT_LAT_SWAP_IN,
+	VZSTAT_LAT_ALLOC_KIND,		/* + KSTAT_ALLOCSTAT_*, VE 0 only */
+};
+
+struct vzstat_lat_hdr {
+	__u32	version;
+	__u32	rec_size;
+	__u32	hist_nr;
+	__u32	pad;
+};
+
+struct vzstat_lat_rec {
+	__u32	veid;
+	__u32	type;
+	__u64	count;
+	__u64	totlat;
+	__u64	hist[KSTAT_LAT_HIST_NR];
+};
+
+/*
+ * Binary /proc/vz/wdog: a header, then the last snapshots vzwdog took,
+ * one per interval, oldest first. Latencies are in ns, memory is in
+ * pages, the interrupt and disk counters are totals since boot. The
+ * flags tell what made vzwdog print the snapshot on the console.
+ */
+#define VZWDOG_SNAP_VERSION	1
+
+#define VZWDOG_SNAP_SCHED_LAT	0x1	/* sched latency over threshold */
+#define VZWDOG_SNAP_ALLOC_LAT	0x2	/* alloc latency over threshold */
+#define VZWDOG_SNAP_UNINT	0x4	/* too many tasks in D state */
+
+struct vzwdog_hdr {
+	__u32	version;
+	__u32	rec_size;
+	__u32	nr;
+	__u32	interval;		/* seconds */
+};
+
+struct vzwdog_snap {
+	__u64	seq;
+	__u64	time_ns;		/* wall clock */
+	__u64	jiffies;
+	__u32	flags;
+	__u32	nr_ve;
+
+	__u64	nr_running;
+	__u64	nr_sleeping;
+	__u64	nr_unint;
+	__u64	nr_zombie;
+	__u64	nr_dead;
+	__u64	nr_stopped;
+	__u64	nr_threads;
+
+	__u64	sched_lat_max;		/* over the interval */
+	__u64	sched_lat_avg[3];
+	__u64	alloc_lat_max[KSTAT_ALLOCSTAT_NR];
+	__u64	alloc_lat_avg[KSTAT_ALLOCSTAT_NR][3];
+
+	__u64	irqs;
+
+	__u64	mem_total;
+	__u64	mem_free;
+	__u64	mem_cached;
+	__u64	mem_anon;
+	__u64	mem_slab;
+	__u64	swap_total;
+	__u64	swap_free;
+
+	__u32	disk_nr;		/* but loop and ram */
+	__u32	disk_in_flight;
+	__u64	disk_ios[2];		/* read, write */
+	__u64	disk_sectors[2];
+	__u64	disk_ticks_ms[2];
+	__u64	disk_io_ms;
+};
+
 #endif /* __VZSTAT_H__ */
@@ -216,6 +216,7 @@ __nf_conntrack_find(struct net *net, const struct nf_conntrack_tuple *tuple);
 extern int
 __nf_conntrack_hash_check_insert(struct nf_conn *ct, struct nf_conn **cd);
 extern int nf_conntrack_hash_check_insert(struct nf_conn *ct);
+extern int nf_conntrack_hash_insert_batch(struct nf_conn **cts, int nr);
 extern void nf_ct_delete_from_lists(struct nf_conn *ct);
 extern void nf_ct_insert_dying_list(struct nf_conn *ct);
 
@@ -281,6 +282,10 @@ extern struct nf_conn nf_conntrack_untracked;
 extern void
 nf_ct_iterate_cleanup(struct net *net, int (*iter)(struct nf_conn *i, void *data), void *data);
 extern void nf_conntrack_free(struct nf_conn *ct);
+extern unsigned int nf_conntrack_count(struct net *net);
+extern int nf_conntrack_count_sysctl(struct ctl_table *table, int write,
+				     void __user *buffer, size_t *lenp,
+				     loff_t *ppos);
 extern struct nf_conn *
 nf_conntrack_alloc(struct net *net,
 		   const struct nf_conntrack_tuple *orig,
@@ -84,5 +84,6 @@ print_tuple(struct seq_file *s, const struct nf_conntrack_tuple *tuple,
             const struct nf_conntrack_l4proto *proto);
 
 extern spinlock_t nf_conntrack_lock ;
+extern struct mutex nf_conntrack_resize_mutex;
 
 #endif /* _NF_CONNTRACK_CORE_H */
@@ -3,19 +3,26 @@
 
 #include <linux/list.h>
 #include <linux/list_nulls.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
 #include <asm/atomic.h>
 
 struct ctl_table_header;
 struct nf_conntrack_ecache;
+struct user_beancounter;
 
 struct netns_ct {
-	atomic_t		count;
+	atomic_t		count;		/* lags behind, see nf_conntrack_count() */
 	unsigned int		max;
 	unsigned int		expect_count;
 	unsigned int		expect_max;
 	unsigned int		htable_size;
+	unsigned int		hash_rnd;
+	seqcount_t		generation;	/* bumped by hash resize */
 	struct kmem_cache	*nf_conntrack_cachep;
 	struct hlist_nulls_head	*hash;
+	struct work_struct	resize_work;
+	struct user_beancounter	*ub;		/* the hash is charged to */
 	struct hlist_head	*expect_hash;
 	struct hlist_nulls_head	unconfirmed;
 	struct hlist_nulls_head	dying;
@@ -35,5 +42,6 @@ struct netns_ct {
 	int			hash_vmalloc;
 	int			expect_vmalloc;
 	char			*slabname;
+	int			*pcpu_count;	/* deltas not folded into count yet */
 };
 #endif
@@ -10,6 +10,7 @@
 struct ctl_table_header;
 struct ipv4_devconf;
 struct fib_rules_ops;
+struct rt_cache_stat;
 struct hlist_head;
 struct sock;
 
@@ -79,5 +80,9 @@ struct netns_ipv4 {
 	int			mroute_reg_vif_num;
 #endif
 #endif
+#ifndef __GENKSYMS__
+	/* percpu route cache lookup stats, NULL for init_net */
+	struct rt_cache_stat	*rt_cache_stat;
+#endif
 };
 #endif
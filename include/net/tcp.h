@@ -264,10 +264,12 @@ extern int sysctl_tcp_max_ssthresh;
 extern int sysctl_tcp_thin_linear_timeouts;
 extern int sysctl_tcp_thin_dupack;
 extern int sysctl_tcp_limit_output_bytes;
+extern int sysctl_tcp_pacing;
 extern int sysctl_tcp_challenge_ack_limit;
 extern int sysctl_tcp_min_tso_segs;
 extern int sysctl_tcp_use_sg;
 extern int sysctl_tcp_max_tw_kmem_fraction;
+extern int sysctl_tcp_max_tw_ub_share;
 extern int sysctl_tcp_max_tw_buckets_ub;
 
 
@@ -556,8 +558,10 @@ extern void tcp_cwnd_application_limited(struct sock *sk);
 
 /* tcp_timer.c */
 extern void tcp_init_xmit_timers(struct sock *);
+extern enum hrtimer_restart tcp_pace_kick(struct hrtimer *timer);
 static inline void tcp_clear_xmit_timers(struct sock *sk)
 {
+	hrtimer_cancel(&tcp_sk(sk)->pacing_timer);
 	inet_csk_clear_xmit_timers(sk);
 }
 
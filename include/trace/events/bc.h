@@ -0,0 +1,155 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bc
+
+#if !defined(_TRACE_BC_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_BC_H
+
+#include <linux/tracepoint.h>
+#include <bc/beancounter.h>
+
+#define show_ub_severity(strict)					\
+	__print_symbolic((strict) & ~UB_SEV_FLAGS,			\
+		{ UB_HARD,	"hard" },				\
+		{ UB_SOFT,	"soft" },				\
+		{ UB_FORCE,	"force" })
+
+/* a charge of val to the resource of ub failed with ret */
+DECLARE_EVENT_CLASS(ub_charge,
+
+	TP_PROTO(struct user_beancounter *ub, int resource,
+		 unsigned long val, int strict, int ret),
+
+	TP_ARGS(ub, resource, val, strict, ret),
+
+	TP_STRUCT__entry(
+		__field(uid_t,		uid)
+		__field(int,		resource)
+		__field(unsigned long,	val)
+		__field(int,		strict)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->uid = ub->ub_uid;
+		__entry->resource = resource;
+		__entry->val = val;
+		__entry->strict = strict;
+		__entry->ret = ret;
+	),
+
+	TP_printk("ub=%u res=%s val=%lu strict=%s%s ret=%d",
+		__entry->uid, ub_rnames[__entry->resource], __entry->val,
+		show_ub_severity(__entry->strict),
+		__entry->strict & UB_TEST ? "|test" : "", __entry->ret)
+);
+
+DEFINE_EVENT(ub_charge, ub_charge_locked,
+
+	TP_PROTO(struct user_beancounter *ub, int resource,
+		 unsigned long val, int strict, int ret),
+
+	TP_ARGS(ub, resource, val, strict, ret)
+);
+
+DEFINE_EVENT(ub_charge, ub_charge_fast,
+
+	TP_PROTO(struct user_beancounter *ub, int resource,
+		 unsigned long val, int strict, int ret),
+
+	TP_ARGS(ub, resource, val, strict, ret)
+);
+
+/* a kmem charge of size failed, resource is the one which was short */
+TRACE_EVENT(ub_kmem_charge,
+
+	TP_PROTO(struct user_beancounter *ub, unsigned long size,
+		 gfp_t gfp_mask, int resource, int ret),
+
+	TP_ARGS(ub, size, gfp_mask, resource, ret),
+
+	TP_STRUCT__entry(
+		__field(uid_t,		uid)
+		__field(unsigned long,	size)
+		__field(gfp_t,		gfp_mask)
+		__field(int,		resource)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->uid = ub->ub_uid;
+		__entry->size = size;
+		__entry->gfp_mask = gfp_mask;
+		__entry->resource = resource;
+		__entry->ret = ret;
+	),
+
+	TP_printk("ub=%u size=%lu gfp=0x%x res=%s ret=%d",
+		__entry->uid, __entry->size, __entry->gfp_mask,
+		ub_rnames[__entry->resource], __entry->ret)
+);
+
+TRACE_EVENT(ub_reclaim_begin,
+
+	TP_PROTO(struct user_beancounter *ub, gfp_t gfp_mask),
+
+	TP_ARGS(ub, gfp_mask),
+
+	TP_STRUCT__entry(
+		__field(uid_t,		uid)
+		__field(gfp_t,		gfp_mask)
+	),
+
+	TP_fast_assign(
+		__entry->uid = ub->ub_uid;
+		__entry->gfp_mask = gfp_mask;
+	),
+
+	TP_printk("ub=%u gfp=0x%x", __entry->uid, __entry->gfp_mask)
+);
+
+TRACE_EVENT(ub_reclaim_end,
+
+	TP_PROTO(struct user_beancounter *ub, unsigned long progress),
+
+	TP_ARGS(ub, progress),
+
+	TP_STRUCT__entry(
+		__field(uid_t,		uid)
+		__field(unsigned long,	progress)
+	),
+
+	TP_fast_assign(
+		__entry->uid = ub->ub_uid;
+		__entry->progress = progress;
+	),
+
+	TP_printk("ub=%u progress=%lu", __entry->uid, __entry->progress)
+);
+
+/* OOM in ub is over, ret is 0 if there was a victim to kill */
+TRACE_EVENT(ub_oom,
+
+	TP_PROTO(struct user_beancounter *ub, gfp_t gfp_mask, int ret),
+
+	TP_ARGS(ub, gfp_mask, ret),
+
+	TP_STRUCT__entry(
+		__field(uid_t,		uid)
+		__field(gfp_t,		gfp_mask)
+		__field(int,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->uid = ub->ub_uid;
+		__entry->gfp_mask = gfp_mask;
+		__entry->ret = ret;
+	),
+
+	TP_printk("ub=%u gfp=0x%x ret=%d",
+		__entry->uid, __entry->gfp_mask, __entry->ret)
+);
+
+#endif /* _TRACE_BC_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -257,6 +257,15 @@ static struct ctl_table ipc_kern_table[] = {
 		.extra1         = &zero,
 		.extra2         = &one,
 	},
+	{
+		.procname	= "shm_interleave",
+		.data		= &init_ipc_ns.shm_interleave,
+		.maxlen		= sizeof(init_ipc_ns.shm_interleave),
+		.mode		= 0644,
+		.proc_handler	= proc_ipc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
 	{
 		.ctl_name	= KERN_MSGMAX,
 		.procname	= "msgmax",
@@ -408,6 +408,35 @@ static const struct vm_operations_struct shm_vm_ops = {
  * Called with shm_ids.rw_mutex held as a writer.
  */
 
+/* Same as mpol=interleave of a tmpfs mount, for the whole segment */
+void sysvipc_shm_set_interleave(struct file *file, int on)
+{
+	struct shmem_inode_info *info = SHMEM_I(file->f_dentry->d_inode);
+	struct mempolicy *mpol = NULL;
+	char str[] = "interleave";
+
+	if (on && (mpol_parse_str(str, &mpol, 1) || !mpol))
+		return;
+	mpol_free_shared_policy(&info->policy);
+	mpol_shared_policy_init(&info->policy, mpol);
+}
+EXPORT_SYMBOL_GPL(sysvipc_shm_set_interleave);
+
+int sysvipc_shm_interleaved(struct file *file)
+{
+	int ret = 0;
+#ifdef CONFIG_NUMA
+	struct shmem_inode_info *info = SHMEM_I(file->f_dentry->d_inode);
+	struct mempolicy *mpol;
+
+	mpol = mpol_shared_policy_lookup(&info->policy, 0);
+	ret = mpol && mpol->mode == MPOL_INTERLEAVE;
+	mpol_cond_put(mpol);
+#endif
+	return ret;
+}
+EXPORT_SYMBOL_GPL(sysvipc_shm_interleaved);
+
 static int newseg(struct ipc_namespace *ns, struct ipc_params *params)
 {
 	key_t key = params->key;
@@ -459,6 +488,8 @@ static int newseg(struct ipc_namespace *ns, struct ipc_params *params)
 				sysctl_overcommit_memory != OVERCOMMIT_NEVER)
 			acctflag = VM_NORESERVE;
 		file = shmem_file_setup(name, size, acctflag);
+		if (!IS_ERR(file) && ns->shm_interleave)
+			sysvipc_shm_set_interleave(file, 1);
 	}
 	error = PTR_ERR(file);
 	if (IS_ERR(file))
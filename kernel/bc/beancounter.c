@@ -33,6 +33,7 @@
 #include <linux/mmgang.h>
 #include <linux/swap.h>
 #include <linux/sched.h>
+#include <linux/futex.h>
 #include <linux/random.h>
 #include <linux/cgroup.h>
 #include <linux/pid_namespace.h>
@@ -43,6 +44,9 @@
 #include <bc/dcache.h>
 #include <bc/proc.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/bc.h>
+
 static struct kmem_cache *ub_cachep;
 
 struct user_beancounter ub0 = {
@@ -95,12 +99,15 @@ static int ubc_pagecache_isolation = 0;
 /* default maximum perpcu resources precharge */
 int ub_resource_precharge[UB_RESOURCES] = {
 	[UB_KMEMSIZE]	= 32 * PAGE_SIZE,
+	[UB_LOCKEDPAGES]= 32,
        [UB_PRIVVMPAGES]= 256,
+	[UB_SHMPAGES]	= 256,
 	[UB_NUMPROC]	= 4,
 	[UB_PHYSPAGES]	= 512,	/* up to 2Mb, 1 huge page */
+	[UB_NUMFLOCK]	= 4,
 	[UB_NUMSIGINFO]	= 4,
 	[UB_DCACHESIZE] = 4 * PAGE_SIZE,
-	[UB_NUMFILE]	= 8,
+	[UB_NUMFILE]	= 32,
 	[UB_SWAPPAGES]	= 256,
 	[UB_SHADOWPAGES] = 256,
 };
@@ -109,6 +116,18 @@ int ub_resource_precharge[UB_RESOURCES] = {
 static int resource_precharge_min = 0;
 static int resource_precharge_max = INT_MAX / NR_CPUS;
 
+/*
+ * Adaptive precharge: percpu bound may grow up to default precharge shifted
+ * by this value when the reserve is refilled often, and shrinks back when
+ * refills become rare. Zero disables adaptation.
+ */
+int ub_precharge_adaptive;
+static int precharge_adaptive_max = 8;
+
+/* refills closer than this grow the percpu bound, further ones shrink it */
+#define UB_PRECHARGE_GROW_PERIOD	(HZ / 50 + 1)
+#define UB_PRECHARGE_SHRINK_PERIOD	HZ
+
 void init_beancounter_precharge(struct user_beancounter *ub, int resource)
 {
 	if (!atomic_read(&ub->ub_refcount))
@@ -116,11 +135,34 @@ void init_beancounter_precharge(struct user_beancounter *ub, int resource)
 
 	/* limit maximum precharge with one half of current resource excess */
 	ub->ub_parms[resource].max_precharge = min_t(long,
-			ub_resource_precharge[resource],
+			ub_precharge_bound(resource),
 			ub_resource_excess(ub, resource, UB_SOFT) /
 			(2 * num_possible_cpus()));
 }
 
+/* called under ub_lock with disabled interrupts, on percpu reserve refill */
+static void ub_adapt_precharge(struct user_beancounter *ub,
+		struct ub_percpu_struct *ub_pcpu, int resource)
+{
+	unsigned long delta = jiffies - ub_pcpu->precharge_stamp[resource];
+	int base = ub_resource_precharge[resource];
+	int size = ub_pcpu->precharge_size[resource] ?: base;
+
+	ub_pcpu->precharge_stamp[resource] = jiffies;
+
+	if (!ub_precharge_adaptive) {
+		ub_pcpu->precharge_size[resource] = 0;
+		return;
+	}
+
+	if (delta < UB_PRECHARGE_GROW_PERIOD)
+		size = min(size << 1, ub->ub_parms[resource].max_precharge);
+	else if (delta > UB_PRECHARGE_SHRINK_PERIOD)
+		size >>= 1;
+
+	ub_pcpu->precharge_size[resource] = max(size, base);
+}
+
 static void init_beancounter_precharges(struct user_beancounter *ub)
 {
 	int resource;
@@ -156,6 +198,20 @@ void ub_precharge_snapshot(struct user_beancounter *ub, int *precharge)
 	}
 	precharge[UB_PHYSPAGES] += precharge[UB_KMEMSIZE] >> PAGE_SHIFT;
 	precharge[UB_OOMGUARPAGES] = precharge[UB_SWAPPAGES];
+	precharge[UB_PRIVVMPAGES] += atomic_long_read(&ub->ub_privvm_reserve);
+}
+
+void ub_precharge_size_snapshot(struct user_beancounter *ub, int *size)
+{
+	int cpu, resource;
+
+	memset(size, 0, sizeof(int) * UB_RESOURCES);
+	for_each_possible_cpu(cpu) {
+		struct ub_percpu_struct *pcpu = ub_percpu(ub, cpu);
+		for ( resource = 0 ; resource < UB_RESOURCES ; resource++ )
+			size[resource] += max(0, ub_percpu_max_precharge(ub,
+						pcpu, resource));
+	}
 }
 
 static void forbid_beancounter_precharge(struct user_beancounter *ub, int val)
@@ -169,14 +225,46 @@ static void forbid_beancounter_precharge(struct user_beancounter *ub, int val)
 static void init_beancounter_struct(struct user_beancounter *ub);
 static void init_beancounter_nolimits(struct user_beancounter *ub);
 
+/*
+ * Hash lookups are done under RCU, each bucket lock serializes inserts,
+ * removals and resurrection of dying beancounters hashed into it.
+ * Sub-beancounters are never hashed, they are serialized by the bucket
+ * of their zero uid. Bucket lock nests outside of ub_hash_lock, which
+ * protects the beancounter lists.
+ */
+struct ub_hash_slot {
+	struct hlist_head	head;
+	spinlock_t		lock;
+} ____cacheline_aligned_in_smp;
+
 #define UB_HASH_SIZE 256
 #define ub_hash_fun(x) ((((x) >> 8) ^ (x)) & (UB_HASH_SIZE - 1))
-static struct hlist_head ub_hash[UB_HASH_SIZE];
+static struct ub_hash_slot ub_hash[UB_HASH_SIZE];
 static DEFINE_SPINLOCK(ub_hash_lock);
 LIST_HEAD(ub_top_list); /* protected by ub_hash_lock */
 EXPORT_SYMBOL(ub_top_list);
 LIST_HEAD(ub_leaked_list);
 
+/*
+ * Beancounters whose refcount dropped to zero wait here for ubcleand to
+ * release them. The whole batch is made to wait for one sched grace
+ * period and then goes to ub_cleanup_list, where it waits for its pages
+ * to leave. So a mass stop of containers costs a few works and grace
+ * periods, not a few per beancounter.
+ */
+static LIST_HEAD(ub_release_list); /* protected by ub_release_lock */
+static DEFINE_SPINLOCK(ub_release_lock);
+
+/* A released beancounter got a reference again */
+static void ub_release_cancel(struct user_beancounter *ub)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ub_release_lock, flags);
+	list_del_init(&ub->ub_release_node);
+	spin_unlock_irqrestore(&ub_release_lock, flags);
+}
+
 static struct cgroup *ub_cgroup_root;
 
 int ub_attach(struct user_beancounter *ub)
@@ -267,6 +355,9 @@ static struct user_beancounter *alloc_ub(uid_t uid)
 	if (percpu_counter_init(&new_ub->ub_orphan_count, 0))
 		goto fail_pcpu;
 
+	if (percpu_counter_init(&new_ub->ub_tw_count, 0))
+		goto fail_tw;
+
 	new_ub->ub_percpu = alloc_percpu(struct ub_percpu_struct);
 	if (new_ub->ub_percpu == NULL)
 		goto fail_free;
@@ -275,6 +366,8 @@ static struct user_beancounter *alloc_ub(uid_t uid)
 	return new_ub;
 
 fail_free:
+	percpu_counter_destroy(&new_ub->ub_tw_count);
+fail_tw:
 	percpu_counter_destroy(&new_ub->ub_orphan_count);
 fail_pcpu:
 	free_mem_gangs(get_ub_gs(new_ub));
@@ -285,8 +378,10 @@ fail_gangs:
 
 static inline void __free_ub(struct user_beancounter *ub)
 {
+	ub_futex_hash_free(ub);
 	free_percpu(ub->ub_percpu);
 	kfree(ub->ub_store);
+	kfree(ub->ub_meminfo);
 	free_mem_gangs(get_ub_gs(ub));
 	kfree(ub->private_data2);
 	kmem_cache_free(ub_cachep, ub);
@@ -295,6 +390,7 @@ static inline void __free_ub(struct user_beancounter *ub)
 static inline void free_ub(struct user_beancounter *ub)
 {
 	percpu_counter_destroy(&ub->ub_orphan_count);
+	percpu_counter_destroy(&ub->ub_tw_count);
 	__free_ub(ub);
 }
 
@@ -304,13 +400,13 @@ struct user_beancounter *get_beancounter_byuid(uid_t uid, int create)
 {
 	struct user_beancounter *new_ub, *ub;
 	unsigned long flags;
-	struct hlist_head *hash;
+	struct ub_hash_slot *slot;
 	struct hlist_node *ptr;
 
-	hash = &ub_hash[ub_hash_fun(uid)];
+	slot = &ub_hash[ub_hash_fun(uid)];
 
 	rcu_read_lock();
-	hlist_for_each_entry_rcu(ub, ptr, hash, ub_hash) {
+	hlist_for_each_entry_rcu(ub, ptr, &slot->head, ub_hash) {
 		if (ub->ub_uid != uid)
 			continue;
 
@@ -319,15 +415,15 @@ struct user_beancounter *get_beancounter_byuid(uid_t uid, int create)
 			return ub;
 		}
 
-		spin_lock_irqsave(&ub_hash_lock, flags);
+		spin_lock_irqsave(&slot->lock, flags);
 		if (!hlist_unhashed(&ub->ub_hash)) {
 			get_beancounter(ub);
-			spin_unlock_irqrestore(&ub_hash_lock, flags);
+			spin_unlock_irqrestore(&slot->lock, flags);
 			rcu_read_unlock();
-			cancel_work_sync(&ub->work);
+			ub_release_cancel(ub);
 			return ub;
 		}
-		spin_unlock_irqrestore(&ub_hash_lock, flags);
+		spin_unlock_irqrestore(&slot->lock, flags);
 	}
 	rcu_read_unlock();
 
@@ -343,25 +439,27 @@ struct user_beancounter *get_beancounter_byuid(uid_t uid, int create)
 		return NULL;
 	}
 
-	spin_lock_irqsave(&ub_hash_lock, flags);
+	spin_lock_irqsave(&slot->lock, flags);
 
-	hlist_for_each_entry(ub, ptr, hash, ub_hash) {
+	hlist_for_each_entry(ub, ptr, &slot->head, ub_hash) {
 		if (ub->ub_uid != uid)
 			continue;
 
 		get_beancounter(ub);
-		spin_unlock_irqrestore(&ub_hash_lock, flags);
+		spin_unlock_irqrestore(&slot->lock, flags);
 		ub_cgroup_destroy(new_ub);
 		free_ub(new_ub);
-		cancel_work_sync(&ub->work);
+		ub_release_cancel(ub);
 		return ub;
 	}
 
+	spin_lock(&ub_hash_lock);
 	ub_count++;
 	list_add_rcu(&new_ub->ub_list, &ub_top_list);
-	hlist_add_head_rcu(&new_ub->ub_hash, hash);
 	add_mem_gangs(get_ub_gs(new_ub));
-	spin_unlock_irqrestore(&ub_hash_lock, flags);
+	spin_unlock(&ub_hash_lock);
+	hlist_add_head_rcu(&new_ub->ub_hash, &slot->head);
+	spin_unlock_irqrestore(&slot->lock, flags);
 
 	ub_update_threshold();
 	set_gang_limits(get_ub_gs(new_ub),
@@ -497,6 +595,7 @@ static inline int bc_verify_held(struct user_beancounter *ub)
 	clean &= verify_res(ub, "pincount", __ub_percpu_sum(ub, pincount));
 
 	clean &= verify_res(ub, "dcache", !list_empty(&ub->ub_dentry_lru));
+	clean &= verify_res(ub, "icache", !list_empty(&ub->ub_inode_lru));
 
 	clean &= verify_res(ub, "underflow",
 			test_bit(UB_UNDERFLOW, &ub->ub_flags));
@@ -527,19 +626,17 @@ static void leak_beancounter(struct user_beancounter *ub)
 	add_taint(TAINT_CRAP);
 }
 
-static void ub_synchronize_sched(struct rcu_head *rcu);
-static void delayed_cleanup_beancounter(struct work_struct *w);
-
-static void delayed_release_beancounter(struct work_struct *w)
+/* Returns 1 if @ub is gone from the hash and lists and is to be cleaned up */
+static int ub_release_one(struct user_beancounter *ub)
 {
-	struct user_beancounter *ub;
+	struct ub_hash_slot *slot;
 	unsigned long zero_limit = 0;
 	unsigned long flags;
 	int refcount;
 
-	ub = container_of(w, struct user_beancounter, work);
+	slot = &ub_hash[ub_hash_fun(ub->ub_uid)];
 
-	spin_lock_irqsave(&ub_hash_lock, flags);
+	spin_lock_irqsave(&slot->lock, flags);
 
 	refcount = atomic_read(&ub->ub_refcount);
 	if (refcount > 0)
@@ -562,10 +659,13 @@ static void delayed_release_beancounter(struct work_struct *w)
 			goto out;
 		}
 		hlist_del_init_rcu(&ub->ub_hash);
-		ub_count--;
 	}
+	spin_lock(&ub_hash_lock);
+	if (!ub->parent)
+		ub_count--;
 	list_del_rcu(&ub->ub_list);
-	spin_unlock_irqrestore(&ub_hash_lock, flags);
+	spin_unlock(&ub_hash_lock);
+	spin_unlock_irqrestore(&slot->lock, flags);
 
 	if (WARN_ON(refcount < 0))
 		printk(KERN_ERR "UB: Bad refcount (%d) on put of %u (%p)\n",
@@ -580,37 +680,28 @@ static void delayed_release_beancounter(struct work_struct *w)
 	set_gang_limits(get_ub_gs(ub), &zero_limit, NULL);
 
 	ub_dcache_unuse(ub);
+	ub_icache_unuse(ub);
 
 	if (!verify_res(ub, ub_rnames[UB_KMEMSIZE],
 		       __get_beancounter_usage_percpu(ub, UB_KMEMSIZE)) ||
-	    refcount)
-		return leak_beancounter(ub);
+	    refcount) {
+		leak_beancounter(ub);
+		return 0;
+	}
 
 	forbid_beancounter_precharge(ub, 0);
-	/* synchronize with __try_charge_beancounter_percpu() */
-	call_rcu_sched(&ub->rcu, ub_synchronize_sched);
-	return;
+	return 1;
 
 out:
-	spin_unlock_irqrestore(&ub_hash_lock, flags);
-}
-
-static void ub_synchronize_sched(struct rcu_head *rcu)
-{
-	struct user_beancounter *ub = container_of(rcu,
-			struct user_beancounter, rcu);
-
-	INIT_DELAYED_WORK(&ub->dwork, delayed_cleanup_beancounter);
-	queue_delayed_work(ub_clean_wq, &ub->dwork, 0);
+	spin_unlock_irqrestore(&slot->lock, flags);
+	return 0;
 }
 
-static void delayed_cleanup_beancounter(struct work_struct *w)
+/* Returns 0 if @ub still has pages to wait for */
+static int ub_cleanup_one(struct user_beancounter *ub)
 {
-	struct user_beancounter *ub;
 	long pages;
 
-	ub = container_of(w, struct user_beancounter, dwork.work);
-
 	junk_mem_gangs(get_ub_gs(ub));
 
 	pages = __get_beancounter_usage_percpu(ub, UB_SHADOWPAGES);
@@ -620,37 +711,105 @@ static void delayed_cleanup_beancounter(struct work_struct *w)
 	 * Here we wait for all isolated pages. No new charges at this point
 	 * so per-cpu summing abowe is safe. Memory reclaimer cannot peel
 	 * pages from semi-dead beancounters, thus we shouldn't block here
-	 * because ubcleand is single-threaded. This function queues cleanup
+	 * because ubcleand is single-threaded. The cleanup work comes back
 	 * again and again until all pages are moved to the junkyard.
 	 */
-	if (pages) {
-		queue_delayed_work(ub_clean_wq, &ub->dwork, 1);
-		return;
-	}
+	if (pages)
+		return 0;
+
+	list_del(&ub->ub_release_node);
 
 	ub_unuse_swap(ub);
+	ub_io_junk_pages(ub);
+	ub_free_events(ub);
+	slab_destroy_ub(ub);
 
-	if (!bc_verify_held(ub))
-		return leak_beancounter(ub);
+	if (!bc_verify_held(ub)) {
+		leak_beancounter(ub);
+		return 1;
+	}
 
 	/* DEBUG: to trigger BUG_ON in precharge/charge/uncharge */
 	forbid_beancounter_precharge(ub, -1);
 	del_mem_gangs(get_ub_gs(ub));
 	ub_free_counters(ub);
 	percpu_counter_destroy(&ub->ub_orphan_count);
+	percpu_counter_destroy(&ub->ub_tw_count);
 	ub_cgroup_destroy(ub);
 
 	call_rcu(&ub->rcu, bc_free_rcu);
+	return 1;
 }
 
+/* Only touched from ubcleand */
+static LIST_HEAD(ub_cleanup_list);
+
+static void ub_cleanup_work_fn(struct work_struct *w);
+static DECLARE_DELAYED_WORK(ub_cleanup_work, ub_cleanup_work_fn);
+
+static void ub_cleanup_work_fn(struct work_struct *w)
+{
+	struct user_beancounter *ub, *tmp;
+
+	list_for_each_entry_safe(ub, tmp, &ub_cleanup_list, ub_release_node)
+		ub_cleanup_one(ub);
+
+	if (!list_empty(&ub_cleanup_list))
+		queue_delayed_work(ub_clean_wq, &ub_cleanup_work, 1);
+}
+
+static void ub_release_work_fn(struct work_struct *w)
+{
+	struct user_beancounter *ub;
+	LIST_HEAD(batch);
+	LIST_HEAD(dying);
+
+	spin_lock_irq(&ub_release_lock);
+	list_splice_init(&ub_release_list, &batch);
+	while (!list_empty(&batch)) {
+		ub = list_first_entry(&batch, struct user_beancounter,
+				ub_release_node);
+		list_del_init(&ub->ub_release_node);
+		spin_unlock_irq(&ub_release_lock);
+
+		/*
+		 * Children are queued before their parents, and are gone
+		 * from parent's children by the time parent is looked at.
+		 */
+		if (ub_release_one(ub))
+			list_add_tail(&ub->ub_release_node, &dying);
+
+		spin_lock_irq(&ub_release_lock);
+	}
+	spin_unlock_irq(&ub_release_lock);
+
+	if (list_empty(&dying))
+		return;
+
+	/* synchronize with __try_charge_beancounter_percpu() */
+	synchronize_sched();
+
+	list_splice_tail(&dying, &ub_cleanup_list);
+	cancel_delayed_work(&ub_cleanup_work);
+	ub_cleanup_work_fn(&ub_cleanup_work.work);
+}
+
+static DECLARE_WORK(ub_release_work, ub_release_work_fn);
+
 static void __release_beancounter(struct user_beancounter *ub)
 {
+	struct ub_hash_slot *slot = &ub_hash[ub_hash_fun(ub->ub_uid)];
 	unsigned long flags;
 
-	spin_lock_irqsave(&ub_hash_lock, flags);
-	if (!atomic_read(&ub->ub_refcount))
-		queue_work(ub_clean_wq, &ub->work);
-	spin_unlock_irqrestore(&ub_hash_lock, flags);
+	spin_lock_irqsave(&slot->lock, flags);
+	if (!atomic_read(&ub->ub_refcount)) {
+		spin_lock(&ub_release_lock);
+		if (list_empty(&ub->ub_release_node))
+			list_add_tail(&ub->ub_release_node, &ub_release_list);
+		spin_unlock(&ub_release_lock);
+		queue_work(ub_clean_wq, &ub_release_work);
+	}
+	spin_unlock_irqrestore(&slot->lock, flags);
 }
 
 void release_beancounter(struct user_beancounter *ub)
@@ -697,6 +856,7 @@ int __charge_beancounter_locked(struct user_beancounter *ub,
 				break;
 		case UB_FORCE:
 			ub_adjust_maxheld(ub, resource);
+			ub_post_event(ub, resource);
 			return 0;
 		default:
 			BUG();
@@ -709,9 +869,53 @@ int __charge_beancounter_locked(struct user_beancounter *ub,
 		ub->ub_parms[resource].failcnt++;
 	}
 	ub->ub_parms[resource].held -= val;
+	ub_post_event(ub, resource);
+	trace_ub_charge_locked(ub, resource, val, strict, -ENOMEM);
 	return -ENOMEM;
 }
 
+/*
+ * Resources with non-zero precharge bound are charged through percpu reserve
+ * without touching ub_lock. Percpu reserve is refilled against the limit, so
+ * UB_HARD charges go to the locked path unless barrier equals to limit.
+ */
+static inline int ub_charge_precharged(struct user_beancounter *ub,
+		int resource, enum ub_severity strict)
+{
+	struct ubparm *p = ub->ub_parms + resource;
+
+	if (p->max_precharge <= 0)
+		return 0;
+	return (strict & ~UB_SEV_FLAGS) != UB_HARD || p->barrier >= p->limit;
+}
+
+static inline int __charge_beancounter(struct user_beancounter *ub,
+		int resource, unsigned long val, enum ub_severity strict)
+{
+	int retval;
+
+	if (ub_charge_precharged(ub, resource, strict))
+		return __charge_beancounter_fast(ub, resource, val, strict);
+
+	spin_lock(&ub->ub_lock);
+	retval = __charge_beancounter_locked(ub, resource, val, strict);
+	spin_unlock(&ub->ub_lock);
+	return retval;
+}
+
+static inline void __uncharge_beancounter(struct user_beancounter *ub,
+		int resource, unsigned long val)
+{
+	if (ub->ub_parms[resource].max_precharge > 0) {
+		__uncharge_beancounter_fast(ub, resource, val);
+		return;
+	}
+
+	spin_lock(&ub->ub_lock);
+	__uncharge_beancounter_locked(ub, resource, val);
+	spin_unlock(&ub->ub_lock);
+}
+
 int charge_beancounter(struct user_beancounter *ub,
 		int resource, unsigned long val, enum ub_severity strict)
 {
@@ -724,9 +928,7 @@ int charge_beancounter(struct user_beancounter *ub,
 
 	local_irq_save(flags);
 	for (p = ub; p != NULL; p = p->parent) {
-		spin_lock(&p->ub_lock);
-		retval = __charge_beancounter_locked(p, resource, val, strict);
-		spin_unlock(&p->ub_lock);
+		retval = __charge_beancounter(p, resource, val, strict);
 		if (unlikely(retval))
 			goto unroll;
 	}
@@ -734,11 +936,8 @@ out:
 	local_irq_restore(flags);
 	return retval;
 unroll:
-	for (q = ub; q != p; q = q->parent) {
-		spin_lock(&q->ub_lock);
-		__uncharge_beancounter_locked(q, resource, val);
-		spin_unlock(&q->ub_lock);
-	}
+	for (q = ub; q != p; q = q->parent)
+		__uncharge_beancounter(q, resource, val);
 	goto out;
 }
 EXPORT_SYMBOL(charge_beancounter);
@@ -764,6 +963,7 @@ void __uncharge_beancounter_locked(struct user_beancounter *ub,
 		val = ub->ub_parms[resource].held;
 	}
 	ub->ub_parms[resource].held -= val;
+	ub_post_event(ub, resource);
 }
 
 void uncharge_beancounter(struct user_beancounter *ub,
@@ -773,11 +973,8 @@ void uncharge_beancounter(struct user_beancounter *ub,
 	unsigned long flags;
 
 	local_irq_save(flags);
-	for (p = ub; p != NULL; p = p->parent) {
-		spin_lock(&p->ub_lock);
-		__uncharge_beancounter_locked(p, resource, val);
-		spin_unlock(&p->ub_lock);
-	}
+	for (p = ub; p != NULL; p = p->parent)
+		__uncharge_beancounter(p, resource, val);
 	local_irq_restore(flags);
 }
 EXPORT_SYMBOL(uncharge_beancounter);
@@ -795,7 +992,9 @@ static int __precharge_beancounter_percpu(struct user_beancounter *ub,
 		return 0;
 
 	spin_lock(&ub->ub_lock);
-	charge = max((int)val, ub->ub_parms[resource].max_precharge >> 1) -
+	ub_adapt_precharge(ub, ub_pcpu, resource);
+	charge = max((int)val,
+			ub_percpu_max_precharge(ub, ub_pcpu, resource) >> 1) -
 		ub_pcpu->precharge[resource];
 	retval = __charge_beancounter_locked(ub, resource,
 			charge, UB_SOFT | UB_TEST);
@@ -814,7 +1013,9 @@ int __charge_beancounter_percpu(struct user_beancounter *ub,
 	int retval, precharge;
 
 	spin_lock(&ub->ub_lock);
-	precharge = max(0, (ub->ub_parms[resource].max_precharge >> 1) -
+	ub_adapt_precharge(ub, ub_pcpu, resource);
+	precharge = max(0, (ub_percpu_max_precharge(ub, ub_pcpu,
+					resource) >> 1) -
 			ub_pcpu->precharge[resource]);
 	retval = __charge_beancounter_locked(ub, resource,
 			val + precharge, UB_SOFT | UB_TEST);
@@ -840,10 +1041,10 @@ void __uncharge_beancounter_percpu(struct user_beancounter *ub,
 
 	spin_lock(&ub->ub_lock);
 	if (ub->ub_parms[resource].max_precharge !=
-			ub_resource_precharge[resource])
+			ub_precharge_bound(resource))
 		init_beancounter_precharge(ub, resource);
 	uncharge = max(0, ub_pcpu->precharge[resource] -
-			(ub->ub_parms[resource].max_precharge >> 1));
+			(ub_percpu_max_precharge(ub, ub_pcpu, resource) >> 1));
 	ub_pcpu->precharge[resource] -= uncharge;
 	smp_wmb();
 	__uncharge_beancounter_locked(ub, resource, val + uncharge);
@@ -869,6 +1070,9 @@ unsigned long __get_beancounter_usage_percpu(struct user_beancounter *ub,
 		/* oomguarpages contains swappages and its precharge too */
 		precharge = __ub_percpu_sum(ub, precharge[UB_SWAPPAGES]);
 		break;
+	case UB_PRIVVMPAGES:
+		precharge += atomic_long_read(&ub->ub_privvm_reserve);
+		break;
 	}
 
 	return held - precharge;
@@ -918,6 +1122,7 @@ out:
 	local_irq_restore(flags);
 	return retval;
 unroll:
+	trace_ub_charge_fast(p, resource, val, strict, retval);
 	for (q = ub; q != p; q = q->parent)
 		__uncharge_beancounter_fast(q, resource, val);
 	goto out;
@@ -956,8 +1161,11 @@ void ub_reclaim_rate_limit(struct user_beancounter *ub, int wait, unsigned count
 	spin_unlock(&ub->rl_lock);
 
 	if (wait && get_exec_ub_top() == ub && !test_thread_flag(TIF_MEMDIE)) {
+		u64 start = ub_stall_start(ub);
+
 		set_current_state(TASK_KILLABLE | TASK_IOTHROTTLED);
 		schedule_hrtimeout(&wall, HRTIMER_MODE_ABS);
+		ub_stall_end(ub, start);
 	}
 }
 
@@ -989,13 +1197,16 @@ static void init_beancounter_struct(struct user_beancounter *ub)
 	INIT_LIST_HEAD(&ub->ub_cclist);
 #endif
 	INIT_LIST_HEAD(&ub->ub_dentry_lru);
-#ifndef CONFIG_BC_KEEP_UNUSED
-	INIT_WORK(&ub->work, delayed_release_beancounter);
-#endif
+	INIT_LIST_HEAD(&ub->ub_release_node);
 	INIT_LIST_HEAD(&ub->ub_dentry_top);
+	ub_init_icache(ub);
+	INIT_LIST_HEAD(&ub->ub_events);
+	atomic_long_set(&ub->ub_privvm_reserve, 0);
 	init_oom_control(&ub->oom_ctrl);
 	spin_lock_init(&ub->rl_lock);
 	ub->rl_wall.tv64 = LLONG_MIN;
+	spin_lock_init(&ub->ub_stall.lock);
+	ub_init_bg_reclaim(ub);
 	ub->dc_time = 0;
 	ub->dc_shrink_ts = 0;
 	rb_init_node(&ub->dc_node);
@@ -1037,6 +1248,12 @@ static DEFINE_PER_CPU(struct ub_percpu_struct, ub0_percpu);
 void __init ub_init_early(void)
 {
 	struct user_beancounter *ub;
+	int i;
+
+	for (i = 0; i < UB_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&ub_hash[i].head);
+		spin_lock_init(&ub_hash[i].lock);
+	}
 
 	init_cache_counters();
 	ub = get_ub0();
@@ -1052,7 +1269,7 @@ void __init ub_init_early(void)
 	__charge_beancounter_locked(ub, UB_NUMPROC, 1, UB_FORCE);
 	init_mm.mm_ub = get_beancounter_longterm(ub);
 
-	hlist_add_head(&ub->ub_hash, &ub_hash[ub->ub_uid]);
+	hlist_add_head(&ub->ub_hash, &ub_hash[ub_hash_fun(ub->ub_uid)].head);
 	list_add(&ub->ub_list, &ub_top_list);
 	ub_count++;
 }
@@ -1087,7 +1304,10 @@ static unsigned int zero = 0;
 static unsigned int one = 1;
 static unsigned int hundreed = 100;
 static int ubc_pagecache_isolation_id;
+static int ubc_bg_reclaim_id;
 static DEFINE_MUTEX(pagecache_isolation_lock);
+static int ub_flag_pagecache_isolation = UB_PAGECACHE_ISOLATION;
+static int ub_flag_bg_reclaim = UB_BG_RECLAIM;
 
 static int proc_pagecache_isolation(ctl_table *table, int write,
 		void __user *buffer, size_t *lenp, loff_t *ppos)
@@ -1112,22 +1332,27 @@ out:
 	return err;
 }
 
-static int proc_pagecache_isolation_change(ctl_table *table, int write,
+/*
+ * Set (extra1 != NULL) or clear ub_flags bit *extra2 of beancounter
+ * with id written into *data.
+ */
+static int proc_ub_flag_change(ctl_table *table, int write,
 		void __user *buffer, size_t *lenp, loff_t *ppos)
 {
 	struct user_beancounter *ub;
+	int flag = *(int *)table->extra2;
 	int err;
 
 	mutex_lock(&pagecache_isolation_lock);
 	err = proc_dointvec(table, write, buffer, lenp, ppos);
 	if (err || !write)
 		goto out;
-	ub = get_beancounter_byuid(ubc_pagecache_isolation_id, 0);
+	ub = get_beancounter_byuid(*(int *)table->data, 0);
 	if (ub) {
 		if (table->extra1)
-			set_bit(UB_PAGECACHE_ISOLATION, &ub->ub_flags);
+			set_bit(flag, &ub->ub_flags);
 		else
-			clear_bit(UB_PAGECACHE_ISOLATION, &ub->ub_flags);
+			clear_bit(flag, &ub->ub_flags);
 		put_beancounter(ub);
 	} else
 		err = -ENOENT;
@@ -1147,6 +1372,16 @@ static ctl_table ub_sysctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= &proc_resource_precharge,
 	},
+	{
+		.procname	= "precharge_adaptive",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ub_precharge_adaptive,
+		.extra1		= &resource_precharge_min,
+		.extra2		= &precharge_adaptive_max,
+		.maxlen		= sizeof(ub_precharge_adaptive),
+		.mode		= 0644,
+		.proc_handler	= &proc_resource_precharge,
+	},
 	{
 		.procname	= "dcache_threshold_ratio",
 		.ctl_name	= CTL_UNNUMBERED,
@@ -1181,6 +1416,14 @@ static ctl_table ub_sysctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= &proc_dointvec,
 	},
+	{
+		.procname	= "meminfo_cache_ms",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ub_meminfo_cache_time,
+		.maxlen		= sizeof(ub_meminfo_cache_time),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_ms_jiffies,
+	},
 	{
 		.procname	= "ioprio",
 		.ctl_name	= CTL_UNNUMBERED,
@@ -1206,6 +1449,25 @@ static ctl_table ub_sysctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= &proc_dointvec,
 	},
+	{
+		.procname	= "dirty_ioless",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ub_dirty_ioless,
+		.maxlen		= sizeof ub_dirty_ioless,
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+	{
+		.procname	= "io_account_batch",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ub_io_account_batch,
+		.maxlen		= sizeof ub_io_account_batch,
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+	},
 	{
 		.procname	= "pagecache_isolation",
 		.ctl_name	= CTL_UNNUMBERED,
@@ -1222,8 +1484,9 @@ static ctl_table ub_sysctl_table[] = {
 		.data		= &ubc_pagecache_isolation_id,
 		.maxlen		= sizeof ubc_pagecache_isolation_id,
 		.mode		= 0200,
-		.proc_handler	= proc_pagecache_isolation_change,
+		.proc_handler	= proc_ub_flag_change,
 		.extra1		= &one,
+		.extra2		= &ub_flag_pagecache_isolation,
 	},
 	{
 		.procname	= "pagecache_isolation_off",
@@ -1231,9 +1494,51 @@ static ctl_table ub_sysctl_table[] = {
 		.data		= &ubc_pagecache_isolation_id,
 		.maxlen		= sizeof ubc_pagecache_isolation_id,
 		.mode		= 0200,
-		.proc_handler	= proc_pagecache_isolation_change,
+		.proc_handler	= proc_ub_flag_change,
+		.extra2		= &ub_flag_pagecache_isolation,
 	},
 #endif /* CONFIG_BC_IO_ACCOUNTING */
+#ifdef CONFIG_BC_RSS_ACCOUNTING
+	{
+		.procname	= "bg_reclaim_low",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ub_bg_reclaim_low,
+		.maxlen		= sizeof ub_bg_reclaim_low,
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &hundreed,
+	},
+	{
+		.procname	= "bg_reclaim_high",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ub_bg_reclaim_high,
+		.maxlen		= sizeof ub_bg_reclaim_high,
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &hundreed,
+	},
+	{
+		.procname	= "bg_reclaim_on",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ubc_bg_reclaim_id,
+		.maxlen		= sizeof ubc_bg_reclaim_id,
+		.mode		= 0200,
+		.proc_handler	= proc_ub_flag_change,
+		.extra1		= &one,
+		.extra2		= &ub_flag_bg_reclaim,
+	},
+	{
+		.procname	= "bg_reclaim_off",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &ubc_bg_reclaim_id,
+		.maxlen		= sizeof ubc_bg_reclaim_id,
+		.mode		= 0200,
+		.proc_handler	= proc_ub_flag_change,
+		.extra2		= &ub_flag_bg_reclaim,
+	},
+#endif /* CONFIG_BC_RSS_ACCOUNTING */
 	{ .ctl_name = 0 }
 };
 
@@ -1266,6 +1571,8 @@ static __init int ub_init_wq(void)
 	ub_clean_wq = create_singlethread_workqueue("ubcleand");
 	if (ub_clean_wq == NULL)
 		panic("Can't create ubclean wq");
+	if (ub_init_bg_reclaim_wq())
+		panic("Can't create ubreclaim wq");
 	return 0;
 }
 
@@ -174,6 +174,7 @@ int ub_dcache_charge(struct user_beancounter *ub, int name_len)
 
 	spin_lock_irq(&ub->ub_lock);
 	ub->ub_parms[UB_DCACHESIZE].failcnt++;
+	ub_post_event(ub, UB_DCACHESIZE);
 	spin_unlock_irq(&ub->ub_lock);
 
 	return -ENOMEM;
@@ -301,7 +302,53 @@ void ub_dcache_change_owner(struct dentry *dentry, struct user_beancounter *ub)
 
 #define UB_DCACHE_BATCH 32
 
-int ub_dcache_reclaim(struct user_beancounter *ub,
+static void ub_icache_work(struct work_struct *w)
+{
+	struct user_beancounter *ub;
+	int excess;
+
+	ub = container_of(w, struct user_beancounter, ub_icache_work);
+	excess = ub->ub_inode_unused - ub->ub_icache_threshold;
+	if (excess > 0)
+		__shrink_icache_ub(ub, excess);
+	put_beancounter(ub);
+}
+
+/*
+ * Unused inodes are not charged, so nothing but global reclaim would free
+ * them. Trim the beancounter to its threshold in background instead, once
+ * it is a batch over.
+ */
+void ub_icache_kick(struct user_beancounter *ub)
+{
+	if (ub->ub_inode_unused < ub->ub_icache_threshold + UB_DCACHE_BATCH)
+		return;
+
+	get_beancounter(ub);
+	if (!schedule_work(&ub->ub_icache_work))
+		put_beancounter(ub);
+}
+
+void ub_init_icache(struct user_beancounter *ub)
+{
+	INIT_LIST_HEAD(&ub->ub_inode_lru);
+	INIT_WORK(&ub->ub_icache_work, ub_icache_work);
+}
+
+static int ub_icache_reclaim(struct user_beancounter *ub,
+		unsigned long numerator, unsigned long denominator)
+{
+	unsigned long batch;
+
+	if (ub->ub_inode_unused <= ub->ub_icache_threshold)
+		return 0;
+
+	batch = ub->ub_inode_unused * numerator / denominator;
+	return __shrink_icache_ub(ub, max_t(unsigned long, batch,
+						UB_DCACHE_BATCH)) > 0;
+}
+
+static int __ub_dcache_reclaim(struct user_beancounter *ub,
 		unsigned long numerator, unsigned long denominator)
 {
 	unsigned long flags, batch;
@@ -333,6 +380,17 @@ int ub_dcache_reclaim(struct user_beancounter *ub,
 	return ret;
 }
 
+int ub_dcache_reclaim(struct user_beancounter *ub,
+		unsigned long numerator, unsigned long denominator)
+{
+	int ret;
+
+	/* pruned dentries leave their inodes to the beancounter */
+	ret = __ub_dcache_reclaim(ub, numerator, denominator);
+	ret |= ub_icache_reclaim(ub, numerator, denominator);
+	return ret;
+}
+
 /* under dcache_lock and dentry->d_lock */
 void ub_dcache_clear_owner(struct dentry *dentry)
 {
@@ -409,6 +467,8 @@ static void __ub_update_threshold(struct user_beancounter *ub,
 
 	ub->ub_dcache_threshold = (unsigned long)(res << PAGE_SHIFT) /
 							dcache_charge_size(0);
+	ub->ub_icache_threshold = (unsigned long)(res << PAGE_SHIFT) /
+							inode_cachep->objuse;
 }
 
 void ub_update_threshold(void)
@@ -18,6 +18,7 @@
 #include <linux/module.h>
 #include <linux/writeback.h>
 #include <linux/backing-dev.h>
+#include <linux/mmgang.h>
 
 #include <bc/beancounter.h>
 #include <bc/io_acct.h>
@@ -30,98 +31,262 @@
 int ub_dirty_radio = 50;
 int ub_dirty_background_ratio = 30;
 
-/* under write lock mapping->tree_lock */
+/*
+ * completed async writes are reported to VIRTINFO_IO_ACCOUNT notifiers
+ * in batches of this many pages per-cpu
+ */
+int ub_io_account_batch = 16;
+
+/*
+ * if set, dirtiers are paced proportionally to writeback bandwidth of
+ * their beancounter instead of doing writeback over ub dirty limit
+ */
+int ub_dirty_ioless = 0;
+
+#define UB_BW_PERIOD		(HZ / 5)
+#define UB_BW_INIT		((100 << 20) >> PAGE_SHIFT)	/* 100Mb/s */
+#define UB_DIRTY_MAX_PAUSE	(HZ / 5)
+#define UB_WB_OWNER_SAMPLE	8
+
+/*
+ * Dirty and writeback pages are accounted to the beancounter which owns
+ * the page, i.e. to the one of its gang. Shared files are dirtied by many
+ * containers and mapping->dirtied_ub, the first dirtier, is kept only as
+ * the context to write the mapping back in. The owner of a page cache
+ * page is changed under mapping->tree_lock, see ub_io_lock_page_owner().
+ *
+ * Without physpages accounting pages have no owner besides ub0, so the
+ * whole mapping is accounted to its first dirtier as before.
+ */
+static inline struct user_beancounter *
+ub_page_owner(struct address_space *mapping, struct page *page)
+{
+#ifdef CONFIG_BC_RSS_ACCOUNTING
+	struct lruvec *lruvec = rcu_dereference(page->lruvec);
+
+	if (likely(lruvec))
+		return get_gang_ub(lruvec_gang(lruvec));
+	return get_ub0();
+#else
+	return mapping->dirtied_ub;
+#endif
+}
+
+/*
+ * dirtied_ub is held while the mapping has dirty or writeback pages
+ * accounted, no matter who owns them.
+ */
+static inline void ub_io_hold_mapping(struct address_space *mapping)
+{
+	if (!mapping->dirtied_ub)
+		mapping->dirtied_ub = get_beancounter(get_io_ub());
+}
 
-void ub_io_account_dirty(struct address_space *mapping)
+static inline void ub_io_release_mapping(struct address_space *mapping)
 {
 	struct user_beancounter *ub = mapping->dirtied_ub;
 
+	mapping->dirtied_ub = NULL;
+	__put_beancounter(ub);
+}
+
+/* under write lock mapping->tree_lock */
+
+void ub_io_account_dirty(struct address_space *mapping, struct page *page)
+{
 	WARN_ON_ONCE(!radix_tree_tagged(&mapping->page_tree,
 				PAGECACHE_TAG_DIRTY));
 
-	if (!ub)
-		ub = mapping->dirtied_ub = get_beancounter(get_io_ub());
+	ub_io_hold_mapping(mapping);
 
-	ub_stat_inc(ub, dirty_pages);
+	rcu_read_lock();
+	ub_stat_inc(ub_page_owner(mapping, page), dirty_pages);
+	rcu_read_unlock();
 }
 
-void ub_io_account_clean(struct address_space *mapping)
+/*
+ * Reports pages accumulated on this cpu to the notifiers. Pages left on
+ * other cpus are reported when those reach the batch, so the throttler
+ * lags behind by at most ub_io_account_batch pages per-cpu.
+ *
+ * under mapping->tree_lock, irqs disabled
+ */
+static void ub_io_account_flush(struct user_beancounter *ub)
 {
-	struct user_beancounter *ub = mapping->dirtied_ub;
-	size_t bytes = PAGE_SIZE;
+	struct ub_percpu_struct *ub_pcpu;
+	size_t bytes;
 
-	if (unlikely(!ub)) {
-		WARN_ON_ONCE(1);
+	ub_pcpu = ub_percpu(ub, smp_processor_id());
+	if (!ub_pcpu->async_write_unaccounted)
 		return;
-	}
-
-	ub_stat_dec(ub, dirty_pages);
 
-	ub_percpu_inc(ub, async_write_complete);
+	bytes = (size_t)ub_pcpu->async_write_unaccounted << PAGE_SHIFT;
+	ub_pcpu->async_write_unaccounted = 0;
 
 	ub = set_exec_ub(ub);
 	virtinfo_notifier_call(VITYPE_IO, VIRTINFO_IO_ACCOUNT, &bytes);
 	ub = set_exec_ub(ub);
+}
 
-	if (!radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_DIRTY) &&
-	    (!radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_WRITEBACK) ||
-	     !mapping_cap_account_writeback(mapping))) {
-		mapping->dirtied_ub = NULL;
-		__put_beancounter(ub);
+void ub_io_account_clean(struct address_space *mapping, struct page *page)
+{
+	struct user_beancounter *ub;
+	struct ub_percpu_struct *ub_pcpu;
+	bool release;
+
+	if (unlikely(!mapping->dirtied_ub)) {
+		WARN_ON_ONCE(1);
+		return;
 	}
+
+	rcu_read_lock();
+	ub = ub_page_owner(mapping, page);
+	ub_stat_dec(ub, dirty_pages);
+
+	ub_pcpu = ub_percpu(ub, smp_processor_id());
+	ub_pcpu->async_write_complete++;
+	ub_pcpu->async_write_unaccounted++;
+
+	release = !radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_DIRTY) &&
+		(!radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_WRITEBACK) ||
+		 !mapping_cap_account_writeback(mapping));
+
+	if (release || ub_pcpu->async_write_unaccounted >=
+			ACCESS_ONCE(ub_io_account_batch))
+		ub_io_account_flush(ub);
+	rcu_read_unlock();
+
+	if (release)
+		ub_io_release_mapping(mapping);
 }
 
-void ub_io_account_cancel(struct address_space *mapping)
+void ub_io_account_cancel(struct address_space *mapping, struct page *page)
 {
-	struct user_beancounter *ub = mapping->dirtied_ub;
+	struct user_beancounter *ub;
 
-	if (unlikely(!ub)) {
+	if (unlikely(!mapping->dirtied_ub)) {
 		WARN_ON_ONCE(1);
 		return;
 	}
 
+	rcu_read_lock();
+	ub = ub_page_owner(mapping, page);
 	ub_stat_dec(ub, dirty_pages);
-
 	ub_percpu_inc(ub, async_write_canceled);
+	rcu_read_unlock();
 
 	if (!radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_DIRTY) &&
 	    (!radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_WRITEBACK) ||
-	     !mapping_cap_account_writeback(mapping))) {
-		mapping->dirtied_ub = NULL;
-		__put_beancounter(ub);
-	}
+	     !mapping_cap_account_writeback(mapping)))
+		ub_io_release_mapping(mapping);
 }
 
-void ub_io_writeback_inc(struct address_space *mapping)
+void ub_io_writeback_inc(struct address_space *mapping, struct page *page)
 {
-	struct user_beancounter *ub = mapping->dirtied_ub;
-
 	WARN_ON_ONCE(!radix_tree_tagged(&mapping->page_tree,
 				PAGECACHE_TAG_WRITEBACK));
 
-	if (!ub)
-		ub = mapping->dirtied_ub = get_beancounter(get_io_ub());
+	ub_io_hold_mapping(mapping);
 
-	ub_stat_inc(ub, writeback_pages);
+	rcu_read_lock();
+	ub_stat_inc(ub_page_owner(mapping, page), writeback_pages);
+	rcu_read_unlock();
 }
 
-void ub_io_writeback_dec(struct address_space *mapping)
+void ub_io_writeback_dec(struct address_space *mapping, struct page *page)
 {
-	struct user_beancounter *ub = mapping->dirtied_ub;
-
-	if (unlikely(!ub)) {
+	if (unlikely(!mapping->dirtied_ub)) {
 		WARN_ON_ONCE(1);
 		return;
 	}
 
-	ub_stat_dec(ub, writeback_pages);
+	rcu_read_lock();
+	ub_stat_dec(ub_page_owner(mapping, page), writeback_pages);
+	rcu_read_unlock();
 
 	if (!radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_WRITEBACK) &&
 	    (!radix_tree_tagged(&mapping->page_tree, PAGECACHE_TAG_DIRTY) ||
-	     !mapping_cap_account_dirty(mapping))) {
-		mapping->dirtied_ub = NULL;
-		__put_beancounter(ub);
+	     !mapping_cap_account_dirty(mapping)))
+		ub_io_release_mapping(mapping);
+}
+
+/*
+ * Takes the lock a page cache page changes its owner under. The mapping
+ * must be pinned by the caller, i.e. the page locked or mapped. Returns
+ * the mapping locked or NULL if the page isn't io accounted, irqs are
+ * disabled in both cases.
+ */
+struct address_space *ub_io_lock_page_owner(struct page *page,
+					    unsigned long *flags)
+{
+	struct address_space *mapping = page_mapping(page);
+
+	if (!mapping || (!mapping_cap_account_dirty(mapping) &&
+			 !mapping_cap_account_writeback(mapping))) {
+		local_irq_save(*flags);
+		return NULL;
+	}
+
+	spin_lock_irqsave(&mapping->tree_lock, *flags);
+	if (unlikely(page_mapping(page) != mapping)) {
+		/* truncated meanwhile, nothing is accounted anymore */
+		spin_unlock(&mapping->tree_lock);
+		return NULL;
+	}
+	return mapping;
+}
+
+/* Carries io accounting of the page from its old owner @from to the new */
+void ub_io_unlock_page_owner(struct page *page, struct address_space *mapping,
+			     struct user_beancounter *from, unsigned long flags)
+{
+	struct user_beancounter *to;
+
+	if (!mapping) {
+		local_irq_restore(flags);
+		return;
 	}
+
+	rcu_read_lock();
+	to = ub_page_owner(mapping, page);
+	if (to != from) {
+		if (mapping_cap_account_dirty(mapping) &&
+		    radix_tree_tag_get(&mapping->page_tree, page->index,
+				       PAGECACHE_TAG_DIRTY)) {
+			ub_stat_dec(from, dirty_pages);
+			ub_stat_inc(to, dirty_pages);
+		}
+		if (mapping_cap_account_writeback(mapping) &&
+		    radix_tree_tag_get(&mapping->page_tree, page->index,
+				       PAGECACHE_TAG_WRITEBACK)) {
+			ub_stat_dec(from, writeback_pages);
+			ub_stat_inc(to, writeback_pages);
+		}
+	}
+	rcu_read_unlock();
+	spin_unlock_irqrestore(&mapping->tree_lock, flags);
+}
+
+/*
+ * Pages of a dead beancounter have been pushed into the junk gangs one by
+ * one without taking tree locks. Whatever it still has accounted is going
+ * to be cleaned on behalf of the junk owner, hand it over as a whole once
+ * nobody can see the old owner of those pages anymore.
+ */
+void ub_io_junk_pages(struct user_beancounter *ub)
+{
+	struct user_beancounter *junk = get_ub0();
+	long pages;
+
+	synchronize_rcu();
+
+	pages = __ub_stat_get_exact(ub, dirty_pages);
+	ub_stat_mod(ub, dirty_pages, -pages);
+	ub_stat_mod(junk, dirty_pages, pages);
+
+	pages = __ub_stat_get_exact(ub, writeback_pages);
+	ub_stat_mod(ub, writeback_pages, -pages);
+	ub_stat_mod(junk, writeback_pages, pages);
 }
 
 int ub_dirty_limits(unsigned long *pbackground,
@@ -148,15 +313,111 @@ int ub_dirty_limits(unsigned long *pbackground,
 	return 1;
 }
 
+/*
+ * Estimates rate of completed async writes, smoothed over a few periods.
+ * Periods without writeback at all don't lower estimate: idle container
+ * has the same bandwidth as busy one when it starts writing again.
+ */
+void ub_update_write_bandwidth(struct user_beancounter *ub)
+{
+	unsigned long now = jiffies, elapsed, written, bw, flags;
+
+	if (now - ub->wb_bw_stamp < UB_BW_PERIOD)
+		return;
+
+	spin_lock_irqsave(&ub->ub_lock, flags);
+	elapsed = now - ub->wb_bw_stamp;
+	if (elapsed < UB_BW_PERIOD)
+		goto out;
+
+	written = __ub_percpu_sum(ub, async_write_complete);
+	if (written != ub->wb_bw_written && elapsed < 8 * UB_BW_PERIOD) {
+		bw = div_u64((u64)(written - ub->wb_bw_written) * HZ, elapsed);
+		ub->wb_bw = ub->wb_bw ? (ub->wb_bw * 3 + bw) / 4 : bw;
+	}
+	ub->wb_bw_written = written;
+	ub->wb_bw_stamp = now;
+out:
+	spin_unlock_irqrestore(&ub->ub_lock, flags);
+}
+
+/*
+ * Returns pause for a task which dirtied @pages_dirtied pages. Below
+ * setpoint in the middle between @background and @thresh dirtiers are
+ * free, above they're limited to writeback bandwidth scaled down
+ * linearly towards @thresh, so dirty memory converges to setpoint.
+ */
+unsigned long ub_dirty_pause(struct user_beancounter *ub,
+		unsigned long dirty, unsigned long background,
+		unsigned long thresh, unsigned long pages_dirtied)
+{
+	unsigned long setpoint = (background + thresh) / 2;
+	unsigned long bw, rate, pause;
+
+	if (dirty <= setpoint || thresh <= setpoint)
+		return 0;
+
+	bw = ub->wb_bw ? : UB_BW_INIT;
+	if (dirty < thresh)
+		rate = div_u64((u64)bw * (thresh - dirty), thresh - setpoint);
+	else
+		rate = 0;
+	rate = max(rate, max(bw / 8, 1UL));
+
+	pause = div_u64((u64)pages_dirtied * HZ, rate) + 1;
+	return min(pause, (unsigned long)UB_DIRTY_MAX_PAUSE);
+}
+
+/*
+ * The inode is written back for @ub if the first few of its dirty pages
+ * include ones owned either by @ub or by somebody over the dirty limit.
+ */
 bool ub_should_skip_writeback(struct user_beancounter *ub, struct inode *inode)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct user_beancounter *owner;
+	struct page *pages[UB_WB_OWNER_SAMPLE];
+	pgoff_t index = 0;
+	unsigned i, nr;
+	bool ret = true;
+
+	if (!rcu_dereference(mapping->dirtied_ub))
+		return true;
+
+	nr = find_get_pages_tag(mapping, &index, PAGECACHE_TAG_DIRTY,
+				UB_WB_OWNER_SAMPLE, pages);
+
+	rcu_read_lock();
+	for (i = 0; i < nr && ret; i++) {
+		owner = ub_page_owner(mapping, pages[i]);
+		ret = owner && owner != ub &&
+			!test_bit(UB_DIRTY_EXCEEDED, &owner->ub_flags);
+	}
+	rcu_read_unlock();
+
+	for (i = 0; i < nr; i++)
+		page_cache_release(pages[i]);
+
+	return ret;
+}
+
+/*
+ * The inode is written back for beancounter which is over its io limit
+ * right now, while writeback isn't for this very beancounter @ub.
+ */
+bool ub_should_delay_writeback(struct user_beancounter *ub, struct inode *inode)
 {
 	struct user_beancounter *dirtied_ub;
-	bool ret;
+	bool ret = false;
 
 	rcu_read_lock();
 	dirtied_ub = rcu_dereference(inode->i_mapping->dirtied_ub);
-	ret = !dirtied_ub || (dirtied_ub != ub &&
-			!test_bit(UB_DIRTY_EXCEEDED, &dirtied_ub->ub_flags));
+	if (dirtied_ub && dirtied_ub != ub) {
+		dirtied_ub = set_exec_ub(dirtied_ub);
+		ret = virtinfo_notifier_call(VITYPE_IO, VIRTINFO_IO_CONGESTION,
+					     NULL) & NOTIFY_FAIL;
+		set_exec_ub(dirtied_ub);
+	}
 	rcu_read_unlock();
 
 	return ret;
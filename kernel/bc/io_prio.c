@@ -10,6 +10,8 @@
 
 #include <linux/module.h>
 #include <linux/cgroup.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <bc/beancounter.h>
 #include <bc/proc.h>
 #include "blk-cgroup.h"
@@ -50,6 +52,54 @@ out:
 	return ret;
 }
 
+/*
+ * Turn of the beancounter in writeback order, in inodes. The lowest io
+ * priority gets 4, the highest twice as much.
+ */
+int ub_ioprio_quantum(struct user_beancounter *ub)
+{
+	struct blkio_cgroup *blkcg;
+
+	if (!ub->ub_cgroup)
+		return UB_WB_QUANTUM;
+
+	blkcg = cgroup_to_blkio_cgroup(ub->ub_cgroup);
+	return max_t(int, 1, div64_u64((u64)blkcg->weight * UB_WB_QUANTUM,
+				       ioprio_weight[UB_IOPRIO_MIN]));
+}
+
+/* Called on request completion with the time since request was queued */
+void ub_io_lat_account(struct user_beancounter *ub, int rw, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	int bucket;
+
+	bucket = us ? fls64(us) : 0;
+	if (bucket >= UB_IOLAT_BUCKETS)
+		bucket = UB_IOLAT_BUCKETS - 1;
+
+	ub_percpu_inc(ub, iolat[!!rw][bucket]);
+}
+
+static void ub_iolat_snapshot(struct user_beancounter *ub,
+		struct ub_iolat_stat *st)
+{
+	struct ub_percpu_struct *pcpu;
+	int cpu, i;
+
+	memset(st, 0, sizeof(*st));
+	st->id = ub->ub_uid;
+	st->nr_buckets = UB_IOLAT_BUCKETS;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = ub_percpu(ub, cpu);
+		for (i = 0; i < UB_IOLAT_BUCKETS; i++) {
+			st->read[i] += pcpu->iolat[READ][i];
+			st->write[i] += pcpu->iolat[WRITE][i];
+		}
+	}
+}
+
 #ifdef CONFIG_PROC_FS
 
 static int bc_iostat(struct seq_file *f, struct user_beancounter *bc)
@@ -115,9 +165,28 @@ static int bc_iostat(struct seq_file *f, struct user_beancounter *bc)
 	return 0;
 }
 
+static void bc_iolat_show(struct seq_file *f, const char *name,
+		unsigned long long *hist)
+{
+	int i;
+
+	seq_printf(f, "%s", name);
+	for (i = 0; i < UB_IOLAT_BUCKETS; i++)
+		seq_printf(f, " %llu", hist[i]);
+	seq_putc(f, '\n');
+}
+
 static int bc_iostat_single(struct seq_file *f, void *v)
 {
-	return bc_iostat(f, seq_beancounter(f));
+	struct user_beancounter *bc = seq_beancounter(f);
+	struct ub_iolat_stat st;
+
+	bc_iostat(f, bc);
+
+	ub_iolat_snapshot(bc, &st);
+	bc_iolat_show(f, "read_lat", st.read);
+	bc_iolat_show(f, "write_lat", st.write);
+	return 0;
 }
 
 static struct bc_proc_entry bc_iostat_entry = {
@@ -189,6 +258,77 @@ static struct bc_proc_entry bc_root_iostat_entry = {
 	.u.fops = &bc_iostat_ops,
 };
 
+/*
+ * Binary array of struct ub_iolat_stat, one per top beancounter. The
+ * snapshot is taken on open, so a monitor polling every second does one
+ * read of a few kilobytes instead of parsing text for every container.
+ */
+struct bc_iolat_buf {
+	size_t			size;
+	struct ub_iolat_stat	stat[0];
+};
+
+static int bc_iolat_open(struct inode *inode, struct file *filp)
+{
+	struct user_beancounter *ub;
+	struct bc_iolat_buf *buf;
+	int nr, max;
+
+	if (!(capable(CAP_DAC_OVERRIDE) && capable(CAP_DAC_READ_SEARCH)))
+		return -EACCES;
+
+	max = 0;
+	rcu_read_lock();
+	for_each_top_beancounter(ub)
+		max++;
+	rcu_read_unlock();
+
+	/* beancounters created in between are seen by the next poll */
+	buf = vmalloc(sizeof(*buf) + max * sizeof(struct ub_iolat_stat));
+	if (!buf)
+		return -ENOMEM;
+
+	nr = 0;
+	rcu_read_lock();
+	for_each_top_beancounter(ub) {
+		if (nr == max)
+			break;
+		ub_iolat_snapshot(ub, &buf->stat[nr++]);
+	}
+	rcu_read_unlock();
+
+	buf->size = nr * sizeof(struct ub_iolat_stat);
+	filp->private_data = buf;
+	return 0;
+}
+
+static ssize_t bc_iolat_read(struct file *filp, char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	struct bc_iolat_buf *buf = filp->private_data;
+
+	return simple_read_from_buffer(ubuf, count, ppos,
+			buf->stat, buf->size);
+}
+
+static int bc_iolat_release(struct inode *inode, struct file *filp)
+{
+	vfree(filp->private_data);
+	return 0;
+}
+
+static struct file_operations bc_iolat_ops = {
+	.open		= bc_iolat_open,
+	.read		= bc_iolat_read,
+	.llseek		= default_llseek,
+	.release	= bc_iolat_release,
+};
+
+static struct bc_proc_entry bc_root_iolat_entry = {
+	.name = "iolat",
+	.u.fops = &bc_iolat_ops,
+};
+
 static int bc_ioprio_show(struct seq_file *f, void *v)
 {
 	struct user_beancounter *bc;
@@ -220,6 +360,7 @@ static int __init bc_iostat_init(void)
 	bc_register_proc_entry(&bc_ioprio_entry);
 	bc_register_proc_entry(&bc_iostat_entry);
 	bc_register_proc_root_entry(&bc_root_iostat_entry);
+	bc_register_proc_root_entry(&bc_root_iolat_entry);
 	return 0;
 }
 late_initcall(bc_iostat_init);
@@ -26,6 +26,8 @@
 #include <bc/kmem.h>
 #include <bc/proc.h>
 
+#include <trace/events/bc.h>
+
 int __ub_kmem_charge(struct user_beancounter *ub,
 		unsigned long size, gfp_t gfp_mask)
 {
@@ -91,12 +93,14 @@ no_precharge:
 
 	spin_lock_irqsave(&ub->ub_lock, flags);
 	ub->ub_parms[failres].failcnt++;
+	ub_post_event(ub, failres);
 	spin_unlock_irqrestore(&ub->ub_lock, flags);
 
 	if (__ratelimit(&ub->ub_ratelimit))
 		printk(KERN_INFO "Fatal resource shortage: %s, UB %d.\n",
 				ub_rnames[failres], ub->ub_uid);
 
+	trace_ub_kmem_charge(ub, size, gfp_mask, failres, -ENOMEM);
 	return -ENOMEM;
 }
 EXPORT_SYMBOL(__ub_kmem_charge);
@@ -110,14 +114,15 @@ void __ub_kmem_uncharge(struct user_beancounter *ub,
 	spin_lock(&ub->ub_lock);
 
 	if (ub->ub_parms[UB_KMEMSIZE].max_precharge !=
-			ub_resource_precharge[UB_KMEMSIZE])
+			ub_precharge_bound(UB_KMEMSIZE))
 		init_beancounter_precharge(ub, UB_KMEMSIZE);
 
 	if (!__try_uncharge_beancounter_percpu(ub, ub_pcpu, UB_KMEMSIZE, size))
 		goto out;
 
 	uncharge = (size + ub_pcpu->precharge[UB_KMEMSIZE]
-			- (ub->ub_parms[UB_KMEMSIZE].max_precharge >> 1)
+			- (ub_percpu_max_precharge(ub, ub_pcpu,
+						   UB_KMEMSIZE) >> 1)
 		   ) & PAGE_MASK;
 	ub_pcpu->precharge[UB_KMEMSIZE] += size - uncharge;
 	__uncharge_beancounter_locked(ub, UB_KMEMSIZE, uncharge);
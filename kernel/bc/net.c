@@ -71,6 +71,9 @@
 /* by some reason it is not used currently */
 #define UB_SOCK_MAINTAIN_WMEMPRESSURE	0
 
+/* UB_OTHERSOCKBUF is charged for sockets by this amount, see batch_reserv */
+#define UB_SOCK_BATCH			(64 * 1024)
+
 
 /* Skb truesize definition. Bad place. Den */
 
@@ -101,78 +104,48 @@ EXPORT_SYMBOL(skb_charge_fullsize);
 static int ub_sock_makewreserv_locked(struct sock *sk,
 		int bufid, unsigned long size);
 
-int __ub_too_many_orphans(struct sock *sk, int count)
+/* a VE may have a quarter of its TCP sockets orphaned */
+int __ub_orphan_limit(struct sock *sk)
 {
+	unsigned long barrier;
 
-	struct ubparm *ub_sock;
-
-	ub_sock = &sock_bc(sk)->ub->ub_parms[UB_NUMTCPSOCK];
-	if (sock_has_ubc(sk) && (count >= ub_sock->barrier >> 2))
-			return 1;
-	return 0;
+	barrier = sock_bc(sk)->ub->ub_parms[UB_NUMTCPSOCK].barrier >> 2;
+	return barrier > INT_MAX ? INT_MAX : (int)barrier - 1;
 }
 
 /*
  * Queueing
  */
 
-static void ub_sock_snd_wakeup(struct user_beancounter *ub)
+/*
+ * Can the first waiter get its space?  Checked before trying to charge, so
+ * that a freed skb which is not enough for the waiter costs O(1) and does not
+ * count as a failure of the resource.
+ */
+static inline int ub_sock_waiter_fits(struct user_beancounter *ub, int bufid,
+		struct sock_beancounter *skbc)
 {
-	struct list_head *p;
-	struct sock *sk;
-	struct sock_beancounter *skbc;
-	struct socket *sock;
-
-	while (!list_empty(&ub->ub_other_sk_list)) {
-		p = ub->ub_other_sk_list.next;
-		skbc = list_entry(p, struct sock_beancounter, ub_sock_list);
-		sk = skbc_sock(skbc);
-
-		sock = sk->sk_socket;
-		if (sock == NULL) {
-			/* sk being destroyed */
-			list_del_init(&skbc->ub_sock_list);
-			continue;
-		}
-
-		ub_debug(UBD_NET_SLEEP,
-				"Checking queue, waiting %lu, reserv %lu\n",
-				skbc->ub_waitspc, skbc->poll_reserv);
-		if (ub_sock_makewreserv_locked(sk, UB_OTHERSOCKBUF,
-					skbc->ub_waitspc))
-			break;
-
-		list_del_init(&skbc->ub_sock_list);
-
-		/*
-		 * See comments in ub_tcp_snd_wakeup.
-		 * Locking note: both unix_write_space and
-		 * sock_def_write_space take callback_lock themselves.
-		 * We take it here just to be on the safe side and to
-		 * act the same way as ub_tcp_snd_wakeup does.
-		 */
-		sock_hold(sk);
-		spin_unlock(&ub->ub_lock);
-
-		read_lock(&sk->sk_callback_lock);
-		sk->sk_write_space(sk);
-		read_unlock(&sk->sk_callback_lock);
-
-		sock_put(sk);
-
-		spin_lock(&ub->ub_lock);
-	}
+	if (skbc->poll_reserv >= skbc->ub_waitspc)
+		return 1;
+	return ub->ub_parms[bufid].held + skbc->ub_waitspc - skbc->poll_reserv <=
+		ub->ub_parms[bufid].limit;
 }
 
-static void ub_tcp_snd_wakeup(struct user_beancounter *ub)
+/*
+ * Waiters are woken in FIFO order, each one only after its space has been
+ * reserved, and the walk stops at the first one which does not fit, so
+ * there is no thundering herd.
+ */
+static void ub_sock_wakeup_queue(struct user_beancounter *ub,
+		struct list_head *queue, int bufid)
 {
 	struct list_head *p;
 	struct sock *sk;
 	struct sock_beancounter *skbc;
 	struct socket *sock;
 
-	while (!list_empty(&ub->ub_tcp_sk_list)) {
-		p = ub->ub_tcp_sk_list.next;
+	while (!list_empty(queue)) {
+		p = queue->next;
 		skbc = list_entry(p, struct sock_beancounter, ub_sock_list);
 		sk = skbc_sock(skbc);
 
@@ -186,8 +159,9 @@ static void ub_tcp_snd_wakeup(struct user_beancounter *ub)
 		ub_debug(UBD_NET_SLEEP,
 				"Checking queue, waiting %lu, reserv %lu\n",
 				skbc->ub_waitspc, skbc->poll_reserv);
-		if (ub_sock_makewreserv_locked(sk, UB_TCPSNDBUF,
-					skbc->ub_waitspc))
+		if (!ub_sock_waiter_fits(ub, bufid, skbc))
+			break;
+		if (ub_sock_makewreserv_locked(sk, bufid, skbc->ub_waitspc))
 			break;
 
 		list_del_init(&skbc->ub_sock_list);
@@ -197,7 +171,8 @@ static void ub_tcp_snd_wakeup(struct user_beancounter *ub)
 		 * Locking note: we get callback_lock here because
 		 * tcp_write_space is over-optimistic about calling context
 		 * (socket lock is presumed).  So we get the lock here although
-		 * it belongs to the callback.
+		 * it belongs to the callback.  Both unix_write_space and
+		 * sock_def_write_space take callback_lock themselves.
 		 */
 		sock_hold(sk);
 		spin_unlock(&ub->ub_lock);
@@ -212,6 +187,16 @@ static void ub_tcp_snd_wakeup(struct user_beancounter *ub)
 	}
 }
 
+static void ub_sock_snd_wakeup(struct user_beancounter *ub)
+{
+	ub_sock_wakeup_queue(ub, &ub->ub_other_sk_list, UB_OTHERSOCKBUF);
+}
+
+static void ub_tcp_snd_wakeup(struct user_beancounter *ub)
+{
+	ub_sock_wakeup_queue(ub, &ub->ub_tcp_sk_list, UB_TCPSNDBUF);
+}
+
 int ub_sock_snd_queue_add(struct sock *sk, int res, unsigned long size)
 {
 	unsigned long flags;
@@ -399,6 +384,7 @@ static int __sock_charge(struct sock *sk, int res)
 	sk_alloc_beancounter(sk);
 	skbc = sock_bc(sk);
 	INIT_LIST_HEAD(&skbc->ub_sock_list);
+	spin_lock_init(&skbc->batch_lock);
 
 	spin_lock_irqsave(&ub->ub_lock, flags);
 	if (unlikely(__charge_beancounter_locked(ub, res, 1, UB_HARD) < 0))
@@ -489,7 +475,8 @@ void ub_sock_uncharge(struct sock *sk)
 
 	ub = skbc->ub;
 
-	spin_lock_irqsave(&ub->ub_lock, flags);
+	spin_lock_irqsave(&skbc->batch_lock, flags);
+	spin_lock(&ub->ub_lock);
 	if (!list_empty(&skbc->ub_sock_list)) {
 		ub_debug(UBD_NET_SOCKET,
 			 "ub_sock_uncharge: removing from ub(%p) queue.\n",
@@ -508,6 +495,9 @@ void ub_sock_uncharge(struct sock *sk)
 				forw);
 	__uncharge_beancounter_locked(ub,
 			(is_tcp_sock ? UB_NUMTCPSOCK : UB_NUMOTHERSOCK), 1);
+	if (skbc->batch_reserv)
+		__uncharge_beancounter_locked(ub, UB_OTHERSOCKBUF,
+				skbc->batch_reserv);
 
 	ub_sock_wcharge_dec(sk, reserv);
 	if (unlikely(skbc->ub_wcharged))
@@ -516,7 +506,9 @@ void ub_sock_uncharge(struct sock *sk)
 		       skbc->ub_wcharged, ub, ub->ub_uid);
 	skbc->poll_reserv = 0;
 	skbc->forw_space = 0;
-	spin_unlock_irqrestore(&ub->ub_lock, flags);
+	skbc->batch_reserv = 0;
+	spin_unlock(&ub->ub_lock);
+	spin_unlock_irqrestore(&skbc->batch_lock, flags);
 
 	put_beancounter(ub);
 	sk_free_beancounter(sk);
@@ -906,12 +898,60 @@ static void ub_tcprcvbuf_uncharge(struct sk_buff *skb)
  * UB_OTHERSOCKBUF and UB_TCPSNDBUF
  */
 
+/*
+ * Returns the charge of skb to batch_reserv of its socket. The excess over
+ * UB_SOCK_BATCH, or everything when the beancounter is near the barrier,
+ * goes back to the beancounter. Returns 0 if the skb has to be uncharged
+ * the usual way.
+ */
+static int ub_sock_batch_uncharge(struct sk_buff *skb)
+{
+	struct sock *sk = skb->sk;
+	struct sock_beancounter *skbc;
+	struct user_beancounter *ub;
+	unsigned long flags, extra;
+
+	ub = skb_bc(skb)->ub;
+	if (sk == NULL || sock_bc(sk)->ub != ub ||
+	    IS_TCP_SOCK(sk->sk_family, sk->sk_type) ||
+	    unlikely(sock_bc(sk)->ub_wcharged))
+		return 0;
+
+	skbc = sock_bc(sk);
+	extra = 0;
+	spin_lock_irqsave(&skbc->batch_lock, flags);
+	skbc->batch_reserv += skb_bc(skb)->charged;
+	if (skbc->batch_reserv > 2 * UB_SOCK_BATCH ||
+	    !ub_barrier_farsz(ub, UB_OTHERSOCKBUF)) {
+		extra = skbc->batch_reserv;
+		if (ub_barrier_farsz(ub, UB_OTHERSOCKBUF))
+			extra -= UB_SOCK_BATCH;
+		skbc->batch_reserv -= extra;
+	}
+	spin_unlock(&skbc->batch_lock);
+
+	/* wakeup may drop the last reference to another socket */
+	if (extra) {
+		spin_lock(&ub->ub_lock);
+		__uncharge_beancounter_locked(ub, UB_OTHERSOCKBUF, extra);
+		ub_sock_snd_wakeup(ub);
+		spin_unlock(&ub->ub_lock);
+	}
+	local_irq_restore(flags);
+
+	ub_skb_set_uncharge(skb);
+	return 1;
+}
+
 static void ub_socksndbuf_uncharge(struct sk_buff *skb)
 {
 	unsigned long flags;
 	struct user_beancounter *ub;
 	unsigned long chargesize;
 
+	if (ub_sock_batch_uncharge(skb))
+		return;
+
 	ub = skb_bc(skb)->ub;
 	chargesize = skb_bc(skb)->charged;
 
@@ -973,17 +1013,32 @@ int ub_sock_getwres_other(struct sock *sk, unsigned long size)
 	if (unlikely(!sock_has_ubc(sk)))
 		return 0;
 
+	skbc = sock_bc(sk);
+	ub = skbc->ub;
+	spin_lock_irqsave(&skbc->batch_lock, flags);
+	if (skbc->batch_reserv >= size) {
+		skbc->batch_reserv -= size;
+		spin_unlock_irqrestore(&skbc->batch_lock, flags);
+		return 0;
+	}
+
 	/*
 	 * Nothing except beancounter lock protects skbc->poll_reserv.
 	 * So, take the lock and do the job.
 	 */
-	skbc = sock_bc(sk);
-	ub = skbc->ub;
-	spin_lock_irqsave(&ub->ub_lock, flags);
+	spin_lock(&ub->ub_lock);
 	err = ub_sock_makewreserv_locked(sk, UB_OTHERSOCKBUF, size);
-	if (!err)
+	if (!err) {
 		skbc->poll_reserv -= size;
-	spin_unlock_irqrestore(&ub->ub_lock, flags);
+
+		/* charge the next skbs in advance */
+		if (ub_barrier_farsz(ub, UB_OTHERSOCKBUF) &&
+		    !__charge_beancounter_locked(ub, UB_OTHERSOCKBUF,
+				    UB_SOCK_BATCH, UB_HARD | UB_TEST))
+			skbc->batch_reserv += UB_SOCK_BATCH;
+	}
+	spin_unlock(&ub->ub_lock);
+	spin_unlock_irqrestore(&skbc->batch_lock, flags);
 
 	return err;
 }
@@ -5,10 +5,16 @@
 #include <linux/cpuset.h>
 #include <linux/module.h>
 #include <linux/oom.h>
+#include <linux/eventfd.h>
+#include <linux/seq_file.h>
+#include <linux/init.h>
 
 #include <bc/beancounter.h>
 #include <bc/oom_kill.h>
 #include <bc/vmpages.h>
+#include <bc/proc.h>
+
+#include <trace/events/bc.h>
 
 #define UB_OOM_TIMEOUT	(5 * HZ)
 
@@ -293,6 +299,44 @@ unsigned long ub_oom_total_pages(struct user_beancounter *ub)
 			       ub->ub_parms[UB_SWAPPAGES].limit);
 }
 
+/*
+ * OOM in a beancounter with a user space handler is left to it first:
+ * its eventfd is signalled and the task waits for the deadline or for
+ * the handler to report it is done, then the charge is retried. An OOM
+ * again within the deadline after the wait is handled by the kernel.
+ * Is called with oom_ctrl->lock held, returns 1 with it released.
+ */
+static int ub_oom_delegate(struct user_beancounter *ub)
+{
+	struct oom_control *oom_ctrl = &ub->oom_ctrl;
+	unsigned long now, expires, deadline;
+
+	if (ub->ub_oom_eventfd == NULL)
+		return 0;
+
+	now = jiffies;
+	deadline = msecs_to_jiffies(ub->ub_oom_deadline);
+	expires = ub->ub_oom_expires;
+	if (expires && !time_before(now, expires)) {
+		ub->ub_oom_expires = 0;
+		if (time_before(now, expires + deadline))
+			return 0;
+		expires = 0;
+	}
+
+	if (!expires) {
+		expires = (now + deadline) ? : 1;
+		ub->ub_oom_expires = expires;
+		eventfd_signal(ub->ub_oom_eventfd, 1);
+	}
+	spin_unlock(&oom_ctrl->lock);
+
+	wait_event_interruptible_timeout(oom_ctrl->wq,
+			ub->ub_oom_expires != expires,
+			(long)(expires - now));
+	return 1;
+}
+
 int out_of_memory_in_ub(struct user_beancounter *ub, gfp_t gfp_mask)
 {
 	struct task_struct *p;
@@ -304,6 +348,9 @@ int out_of_memory_in_ub(struct user_beancounter *ub, gfp_t gfp_mask)
 	if (ub_oom_lock(&ub->oom_ctrl, gfp_mask))
 		goto out;
 
+	if (ub_oom_delegate(ub))
+		return 0;
+
 	snprintf(message, sizeof(message),
 		 "Out of memory in %sUB %u",
 		 ub->parent ? "mem cgroup inside " : "",
@@ -326,6 +373,7 @@ int out_of_memory_in_ub(struct user_beancounter *ub, gfp_t gfp_mask)
 
 	if (!p)
 		res = -ENOMEM;
+	trace_ub_oom(ub, gfp_mask, res);
 out:
 	/*
 	 * Give "p" a good chance of killing itself before we
@@ -337,6 +385,56 @@ out:
 	return res;
 }
 
+#ifdef CONFIG_PROC_FS
+/* OOM candidates for the user space handler, see UBSTAT_OOMFD */
+static int bc_oom_tasks_show(struct seq_file *f, void *v)
+{
+	struct user_beancounter *ub = seq_beancounter(f);
+	unsigned long totalpages = ub_oom_total_pages(ub);
+	struct task_struct *p, *task;
+	unsigned long rss, swap;
+	int points;
+
+	seq_printf(f, "%7s %10s %10s %6s %6s %s\n",
+			"pid", "rss", "swap", "adj", "points", "comm");
+
+	read_lock(&tasklist_lock);
+	for_each_process_all(p) {
+		if (is_global_init(p) || (p->flags & PF_KTHREAD))
+			continue;
+		if (ub_oom_task_skip(ub, p))
+			continue;
+
+		task = find_lock_task_mm(p);
+		if (task == NULL)
+			continue;
+		rss = get_mm_rss(task->mm);
+		swap = get_mm_counter(task->mm, swap_usage);
+		task_unlock(task);
+
+		points = oom_badness(p, totalpages, NULL);
+		seq_printf(f, "%7d %10lu %10lu %6d %6d %s\n",
+				task_pid_vnr(p), rss, swap,
+				get_task_oom_score_adj(p), points, p->comm);
+	}
+	read_unlock(&tasklist_lock);
+	return 0;
+}
+
+static struct bc_proc_entry bc_oom_tasks_entry = {
+	.name = "oom_tasks",
+	.u.show = bc_oom_tasks_show,
+};
+
+static int __init bc_oom_tasks_init(void)
+{
+	bc_register_proc_entry(&bc_oom_tasks_entry);
+	return 0;
+}
+
+late_initcall(bc_oom_tasks_init);
+#endif
+
 struct oom_control global_oom_ctrl;
 
 void init_oom_control(struct oom_control *oom_ctrl)
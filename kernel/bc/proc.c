@@ -140,8 +140,15 @@ static int bc_debug_show(struct seq_file *f, void *v)
 	seq_printf(f, "dcache_shrink_age: %d\n", now - ub->dc_shrink_ts);
 	seq_printf(f, "dcache_thresh: %d\n", ub->ub_dcache_threshold);
 
+	seq_printf(f, "icache_unused: %u\n", ub->ub_inode_unused);
+	seq_printf(f, "icache_pruned: %lu\n", ub->ub_inode_pruned);
+	seq_printf(f, "icache_thresh: %d\n", ub->ub_icache_threshold);
+
 	seq_printf(f, "pagecache_isolation: %s\n",
 		test_bit(UB_PAGECACHE_ISOLATION, &ub->ub_flags) ? "on" : "off");
+	seq_printf(f, "bg_reclaim: %s\n",
+		test_bit(UB_BG_RECLAIM, &ub->ub_flags) ? "on" : "off");
+	seq_printf(f, "pagecache_limit: %lu\n", ub->ub_cache_limit);
 
 	return 0;
 }
@@ -156,20 +163,23 @@ static int bc_precharge_show(struct seq_file *f, void *v)
 {
 	struct user_beancounter *ub;
 	int i, cpus = num_possible_cpus();
-	int precharge[UB_RESOURCES];
+	int precharge[UB_RESOURCES], size[UB_RESOURCES];
 
-	seq_printf(f, "%-12s %16s %10s %10s\n",
-			"resource", "real_held", "precharge", "max_precharge");
+	seq_printf(f, "%-12s %16s %10s %10s %10s\n",
+			"resource", "real_held", "precharge", "max_precharge",
+			"cur_precharge");
 
 	ub = seq_beancounter(f);
 	ub_precharge_snapshot(ub, precharge);
+	ub_precharge_size_snapshot(ub, size);
 	for ( i = 0 ; i < UB_RESOURCES ; i++ ) {
 		if (!strcmp(ub_rnames[i], "dummy"))
 			continue;
-		seq_printf(f, "%-12s %16lu %10d %10d\n", ub_rnames[i],
+		seq_printf(f, "%-12s %16lu %10d %10d %10d\n", ub_rnames[i],
 				ub->ub_parms[i].held,
 				precharge[i],
-				ub->ub_parms[i].max_precharge * cpus);
+				ub->ub_parms[i].max_precharge * cpus,
+				size[i]);
 	}
 
 	return 0;
@@ -303,7 +313,7 @@ static int bc_dcache_show(struct seq_file *f, void *v)
 
 		root.mnt = NULL;
 		root.dentry = NULL;
-		spin_lock(&vfsmount_lock);
+		br_read_lock(vfsmount_lock);
 		list_for_each_entry(mnt, &current->nsproxy->mnt_ns->list, mnt_list) {
 			if (mnt->mnt_sb == dentry->d_sb) {
 				root.mnt = mnt;
@@ -312,7 +322,7 @@ static int bc_dcache_show(struct seq_file *f, void *v)
 				break;
 			}
 		}
-		spin_unlock(&vfsmount_lock);
+		br_read_unlock(vfsmount_lock);
 
 		seq_printf(f, "%12lu %s\t%s\t",
 				ub_dcache_get_size(dentry),
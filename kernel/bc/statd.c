@@ -16,6 +16,7 @@
 #include <linux/errno.h>
 #include <linux/suspend.h>
 #include <linux/freezer.h>
+#include <linux/eventfd.h>
 
 #include <asm/uaccess.h>
 #include <asm/param.h>
@@ -189,6 +190,86 @@ static int ubstat_do_read_full(struct user_beancounter *ub, void *kbuf,
 	return wrote;
 }
 
+static void ubstat_fill_bulk(struct user_beancounter *ub,
+		ubstatbulkent_t *ent)
+{
+	int precharge[UB_RESOURCES];
+	int resource;
+
+	ub_precharge_snapshot(ub, precharge);
+
+	spin_lock_irq(&ub->ub_lock);
+	ub_update_resources_locked(ub);
+	ent->uid = ub->ub_uid;
+	ent->__unused = 0;
+	for (resource = 0; resource < UB_RESOURCES; resource++) {
+		ubstatbulkparm_t *p = &ent->param[resource];
+		struct ubparm *s = &ub->ub_parms[resource];
+
+		p->held		= max_t(long, 0, s->held - precharge[resource]);
+		p->maxheld	= s->maxheld;
+		p->barrier	= s->barrier;
+		p->limit	= s->limit;
+		p->failcnt	= s->failcnt;
+	}
+	spin_unlock_irq(&ub->ub_lock);
+}
+
+static int ubstat_get_bulk(void __user *buf, long size)
+{
+	struct user_beancounter *ub, *ubp;
+	ubstatbulkent_t *ent;
+	ubstatbulk_t hdr;
+	int entry_size, retval;
+
+	entry_size = sizeof(*ent) + UB_RESOURCES * sizeof(ent->param[0]);
+	if (size < sizeof(hdr))
+		return -EINVAL;
+
+	ent = kmalloc(entry_size, GFP_KERNEL);
+	if (ent == NULL)
+		return -ENOMEM;
+
+	hdr.version = UBSTAT_BULK_VERSION;
+	hdr.nr_resources = UB_RESOURCES;
+	hdr.entry_size = entry_size;
+	hdr.nr_entries = 0;
+	hdr.cur_time = get_jiffies_64();
+
+	retval = sizeof(hdr);
+	ubp = NULL;
+
+	rcu_read_lock();
+	for_each_top_beancounter(ub) {
+		if (retval + entry_size > size)
+			break;
+		if (!get_beancounter_rcu(ub))
+			continue;
+		rcu_read_unlock();
+
+		put_beancounter(ubp);
+		ubp = ub;
+
+		ubstat_fill_bulk(ub, ent);
+		if (copy_to_user(buf + retval, ent, entry_size)) {
+			retval = -EFAULT;
+			goto out_put;
+		}
+		retval += entry_size;
+		hdr.nr_entries++;
+
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+
+	if (copy_to_user(buf, &hdr, sizeof(hdr)))
+		retval = -EFAULT;
+out_put:
+	put_beancounter(ubp);
+	kfree(ent);
+	return retval;
+}
+
 int ubstat_alloc_store(struct user_beancounter *ub)
 {
 	if (ub->ub_store == NULL) {
@@ -257,6 +338,178 @@ out:
 	return retval;
 }
 
+/* called under ub_lock */
+void __ub_post_event(struct user_beancounter *ub, int resource)
+{
+	struct ubparm *parm = ub->ub_parms + resource;
+	struct ub_event *ev;
+	int above;
+
+	list_for_each_entry(ev, &ub->ub_events, list) {
+		if (ev->resource != resource)
+			continue;
+
+		above = ev->threshold && parm->held >= ev->threshold;
+		if (ev->failcnt == parm->failcnt && ev->above == above)
+			continue;
+
+		ev->failcnt = parm->failcnt;
+		ev->above = above;
+		eventfd_signal(ev->eventfd, 1);
+	}
+}
+
+static void ub_update_event_mask(struct user_beancounter *ub)
+{
+	struct ub_event *ev;
+	unsigned long mask = 0;
+
+	list_for_each_entry(ev, &ub->ub_events, list)
+		mask |= 1UL << ev->resource;
+	ub->ub_event_mask = mask;
+}
+
+static int ubstat_register_event(struct user_beancounter *ub, int resource,
+		ubeventrq_t *req)
+{
+	struct eventfd_ctx *eventfd;
+	struct ub_event *ev, *tmp, *found;
+	int retval, count;
+
+	eventfd = eventfd_ctx_fdget(req->eventfd);
+	if (IS_ERR(eventfd))
+		return PTR_ERR(eventfd);
+
+	ev = NULL;
+	if (!(req->flags & UBSTAT_EVENT_UNREGISTER)) {
+		retval = -ENOMEM;
+		ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+		if (ev == NULL)
+			goto out;
+
+		INIT_LIST_HEAD(&ev->list);
+		ev->eventfd = eventfd;
+		ev->resource = resource;
+		ev->threshold = min_t(u64, req->threshold, UB_MAXVALUE);
+	}
+
+	count = 0;
+	found = NULL;
+	spin_lock_irq(&ub->ub_lock);
+	list_for_each_entry(tmp, &ub->ub_events, list) {
+		if (tmp->eventfd == eventfd && tmp->resource == resource)
+			found = tmp;
+		else
+			count++;
+	}
+	retval = found ? 0 : -ENOENT;
+	if (ev != NULL) {
+		retval = -ENOSPC;
+		if (count < UB_MAX_EVENTS) {
+			ev->failcnt = ub->ub_parms[resource].failcnt;
+			ev->above = ev->threshold &&
+				ub->ub_parms[resource].held >= ev->threshold;
+			list_add_tail(&ev->list, &ub->ub_events);
+			retval = 0;
+		}
+	}
+	/* registration replaces previous subscription of the same eventfd */
+	if (found && !retval)
+		list_del(&found->list);
+	else
+		found = NULL;
+	ub_update_event_mask(ub);
+	spin_unlock_irq(&ub->ub_lock);
+
+	if (found) {
+		eventfd_ctx_put(found->eventfd);
+		kfree(found);
+	}
+	if (ev != NULL && !retval)
+		return 0;
+	kfree(ev);
+out:
+	eventfd_ctx_put(eventfd);
+	return retval;
+}
+
+void ub_free_events(struct user_beancounter *ub)
+{
+	struct ub_event *ev, *tmp;
+	LIST_HEAD(events);
+
+	spin_lock_irq(&ub->ub_lock);
+	list_splice_init(&ub->ub_events, &events);
+	ub->ub_event_mask = 0;
+	spin_unlock_irq(&ub->ub_lock);
+
+	list_for_each_entry_safe(ev, tmp, &events, list) {
+		eventfd_ctx_put(ev->eventfd);
+		kfree(ev);
+	}
+
+	if (ub->ub_oom_eventfd != NULL)
+		eventfd_ctx_put(ub->ub_oom_eventfd);
+}
+
+static int ubstat_handle_oomrq(struct user_beancounter *ub,
+		void __user *buf, long size)
+{
+	struct oom_control *oom_ctrl = &ub->oom_ctrl;
+	struct eventfd_ctx *eventfd, *old;
+	uboomrq_t req;
+
+	if (size < sizeof(req))
+		return -EINVAL;
+	if (copy_from_user(&req, buf, sizeof(req)))
+		return -EFAULT;
+
+	eventfd = NULL;
+	if (!(req.flags & (UBSTAT_EVENT_UNREGISTER | UBSTAT_OOM_HANDLED))) {
+		if (!req.deadline_ms ||
+		    req.deadline_ms > UBSTAT_OOM_MAX_DEADLINE)
+			return -EINVAL;
+		eventfd = eventfd_ctx_fdget(req.eventfd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	spin_lock(&oom_ctrl->lock);
+	old = NULL;
+	if (req.flags & UBSTAT_OOM_HANDLED) {
+		/* the OOM after that is for the kernel, see ub_oom_delegate */
+		if (ub->ub_oom_expires &&
+		    time_before(jiffies, ub->ub_oom_expires))
+			ub->ub_oom_expires = jiffies ? : 1;
+	} else {
+		old = ub->ub_oom_eventfd;
+		ub->ub_oom_eventfd = eventfd;
+		ub->ub_oom_deadline = eventfd ? req.deadline_ms : 0;
+		ub->ub_oom_expires = 0;
+	}
+	spin_unlock(&oom_ctrl->lock);
+	wake_up_all(&oom_ctrl->wq);
+
+	if (old != NULL)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+static int ubstat_handle_eventrq(struct user_beancounter *ub, long cmd,
+		void __user *buf, long size)
+{
+	ubeventrq_t req;
+
+	if (UBSTAT_PARMID(cmd) >= UB_RESOURCES)
+		return -EINVAL;
+	if (size < sizeof(req))
+		return -EINVAL;
+	if (copy_from_user(&req, buf, sizeof(req)))
+		return -EFAULT;
+
+	return ubstat_register_event(ub, UBSTAT_PARMID(cmd), &req);
+}
+
 static int ubstat_handle_notifrq(ubnotifrq_t *req)
 {
 	int retval;
@@ -338,6 +591,11 @@ long do_ubstat(int func, unsigned long arg1, unsigned long arg2,
 		retval = ubstat_gettime(buf, size);
 		goto notify;
 	}
+	if (func == UBSTAT_READ_BULK) {
+		if (!ve_is_super(get_exec_env()))
+			return -EPERM;
+		return ubstat_get_bulk(buf, size);
+	}
 
 	ub = get_exec_ub_top();
 	if (ub != NULL && ub->ub_uid == arg1)
@@ -348,6 +606,17 @@ long do_ubstat(int func, unsigned long arg1, unsigned long arg2,
 	if (ub == NULL)
 		return -ESRCH;
 
+	if (UBSTAT_CMD(func) == UBSTAT_EVENTFD) {
+		retval = ubstat_handle_eventrq(ub, func, buf, size);
+		put_beancounter_longterm(ub);
+		return retval;
+	}
+	if (func == UBSTAT_OOMFD) {
+		retval = ubstat_handle_oomrq(ub, buf, size);
+		put_beancounter_longterm(ub);
+		return retval;
+	}
+
 	retval = ubstat_get_stat(ub, func, buf, size);
 	put_beancounter_longterm(ub);
 notify:
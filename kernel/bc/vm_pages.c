@@ -25,6 +25,8 @@
 #include <bc/proc.h>
 #include <bc/oom_kill.h>
 
+#include <trace/events/bc.h>
+
 #ifdef CONFIG_BC_RSS_ACCOUNTING
 
 /**
@@ -97,6 +99,120 @@ void ub_update_resources(struct user_beancounter *ub)
 }
 EXPORT_SYMBOL(ub_update_resources);
 
+/*
+ * Privvmpages reserve of a mm.
+ *
+ * Allocators mapping and unmapping memory all the time would charge the
+ * beancounter on every call. The mm keeps some of privvmpages charged in
+ * advance instead: small charges are taken from the reserve, uncharges put
+ * pages back into it and only the excess over UB_MM_RESERVE is returned.
+ * The reserve is refilled only while the barrier leaves room for it, and
+ * the reserves of all mms are not counted as the usage, so they never make
+ * a charge fail which would fit without them.
+ */
+#define UB_MM_RESERVE	2048
+
+static void ub_privvm_reserve_add(struct mm_struct *mm,
+		struct user_beancounter *ub, unsigned long pages)
+{
+	unsigned long excess = 0;
+
+	spin_lock(&mm->page_table_lock);
+	mm->privvm_reserve += pages;
+	if (mm->privvm_reserve > UB_MM_RESERVE) {
+		excess = mm->privvm_reserve - UB_MM_RESERVE / 2;
+		mm->privvm_reserve -= excess;
+	}
+	spin_unlock(&mm->page_table_lock);
+
+	atomic_long_add(pages - excess, &ub->ub_privvm_reserve);
+	if (excess)
+		uncharge_beancounter_fast(ub, UB_PRIVVMPAGES, excess);
+}
+
+/* returns how many of the pages were taken from the reserve */
+static unsigned long ub_privvm_reserve_get(struct mm_struct *mm,
+		struct user_beancounter *ub, unsigned long pages)
+{
+	spin_lock(&mm->page_table_lock);
+	pages = min(pages, mm->privvm_reserve);
+	mm->privvm_reserve -= pages;
+	spin_unlock(&mm->page_table_lock);
+
+	atomic_long_sub(pages, &ub->ub_privvm_reserve);
+	return pages;
+}
+
+/* whether the charge fits if the reserves were not charged */
+static int ub_privvm_fits(struct user_beancounter *ub, unsigned long pages,
+		int strict)
+{
+	unsigned long held, bound;
+
+	held = get_beancounter_usage_percpu(ub, UB_PRIVVMPAGES);
+	bound = ub_resource_bound(ub, UB_PRIVVMPAGES, strict);
+	return held < bound && pages <= bound - held;
+}
+
+int ub_privvm_charge(struct mm_struct *mm, unsigned long pages, int strict)
+{
+	struct user_beancounter *ub;
+	unsigned long got;
+
+	ub = mm_ub_top(mm);
+	if (ub == NULL)
+		return 0;
+
+	got = ub_privvm_reserve_get(mm, ub, pages);
+	if (got == pages)
+		return 0;
+	pages -= got;
+
+	if (pages < UB_MM_RESERVE &&
+	    !charge_beancounter_fast(ub, UB_PRIVVMPAGES,
+		    pages + UB_MM_RESERVE / 2, UB_HARD | UB_TEST)) {
+		ub_privvm_reserve_add(mm, ub, UB_MM_RESERVE / 2);
+		return 0;
+	}
+
+	if (!charge_beancounter_fast(ub, UB_PRIVVMPAGES, pages, strict))
+		return 0;
+
+	if (ub_privvm_fits(ub, pages, strict) &&
+	    !charge_beancounter_fast(ub, UB_PRIVVMPAGES, pages, UB_FORCE))
+		return 0;
+
+	if (got)
+		ub_privvm_reserve_add(mm, ub, got);
+	return -ENOMEM;
+}
+
+void ub_privvm_uncharge(struct mm_struct *mm, unsigned long pages)
+{
+	struct user_beancounter *ub;
+
+	ub = mm_ub_top(mm);
+	if (ub == NULL)
+		return;
+
+	ub_privvm_reserve_add(mm, ub, pages);
+}
+
+/* called when the mm is put, nobody charges it anymore */
+void ub_privvm_release(struct mm_struct *mm)
+{
+	struct user_beancounter *ub;
+	unsigned long pages;
+
+	ub = mm_ub_top(mm);
+	if (ub == NULL)
+		return;
+
+	pages = ub_privvm_reserve_get(mm, ub, ULONG_MAX);
+	if (pages)
+		uncharge_beancounter_fast(ub, UB_PRIVVMPAGES, pages);
+}
+
 int ub_memory_charge(struct mm_struct *mm, unsigned long size,
 		unsigned vm_flags, struct file *vm_file, int sv)
 {
@@ -117,7 +233,7 @@ int ub_memory_charge(struct mm_struct *mm, unsigned long size,
 			goto out_err;
 	}
 	if (VM_UB_PRIVATE(vm_flags, vm_file)) {
-               if (charge_beancounter_fast(ub, UB_PRIVVMPAGES, size, sv))
+		if (ub_privvm_charge(mm, size, sv))
 			goto out_private;
 	}
 	return 0;
@@ -142,8 +258,8 @@ void ub_memory_uncharge(struct mm_struct *mm, unsigned long size,
 
 	if (vm_flags & VM_LOCKED)
 		uncharge_beancounter(ub, UB_LOCKEDPAGES, size);
-       if (VM_UB_PRIVATE(vm_flags, vm_file))
-               uncharge_beancounter_fast(ub, UB_PRIVVMPAGES, size);
+	if (VM_UB_PRIVATE(vm_flags, vm_file))
+		ub_privvm_uncharge(mm, size);
 }
 
 int ub_locked_charge(struct mm_struct *mm, unsigned long size)
@@ -231,16 +347,121 @@ void ub_tmpfs_respages_sub(struct shmem_inode_info *shi,
 		do_ub_tmpfs_respages_sub(shi->shmi_ub, size);
 }
 
+/*
+ * Stall accounting: "some" is time when at least one task of beancounter
+ * waits in reclaim, "full" is time when all its tasks do.
+ */
+static int ub_stall_nr_tasks(struct user_beancounter *ub)
+{
+	return max_t(long, 1, get_beancounter_usage_percpu(top_beancounter(ub),
+							   UB_NUMPROC));
+}
+
+u64 ub_stall_start(struct user_beancounter *ub)
+{
+	struct ub_stall *st = &ub->ub_stall;
+	u64 now = ktime_to_ns(ktime_get());
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	if (!st->nr++)
+		st->some_start = now;
+	if (!st->full_start && st->nr >= ub_stall_nr_tasks(ub))
+		st->full_start = now;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	return now;
+}
+
+void ub_stall_end(struct user_beancounter *ub, u64 start)
+{
+	struct ub_stall *st = &ub->ub_stall;
+	u64 now = ktime_to_ns(ktime_get());
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	if (st->full_start) {
+		st->full += now - st->full_start;
+		st->full_start = 0;
+	}
+	if (!--st->nr)
+		st->some += now - st->some_start;
+	st->total += now - start;
+	spin_unlock_irqrestore(&st->lock, flags);
+}
+
+#ifdef CONFIG_COMPACTION
+/*
+ * Direct compaction run by the tasks of a beancounter is attributed to
+ * it. With ub_compact_budget set they may spend that many ms per second
+ * compacting, after that their high-order allocations skip direct
+ * compaction as if it was deferred. The budget is racy between cpus.
+ */
+bool ub_compact_allowed(struct user_beancounter *ub)
+{
+	if (likely(!ub->ub_compact_budget))
+		return true;
+
+	if (time_after_eq(jiffies, ub->ub_compact_stamp + HZ)) {
+		ub->ub_compact_stamp = jiffies;
+		ub->ub_compact_spent = 0;
+	}
+	if (ub->ub_compact_spent <
+			(u64)ub->ub_compact_budget * NSEC_PER_MSEC)
+		return true;
+
+	ub_percpu_inc(ub, compact_throttled);
+	return false;
+}
+
+u64 ub_compact_start(struct user_beancounter *ub)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+void ub_compact_end(struct user_beancounter *ub, u64 start)
+{
+	u64 delta = ktime_to_ns(ktime_get()) - start;
+
+	ub_percpu_add(ub, compact_time, delta);
+	if (ub->ub_compact_budget)
+		ub->ub_compact_spent += delta;
+}
+#endif
+
+void ub_stall_read(struct user_beancounter *ub,
+		u64 *some, u64 *full, u64 *total)
+{
+	struct ub_stall *st = &ub->ub_stall;
+	u64 now = ktime_to_ns(ktime_get());
+	unsigned long flags;
+
+	spin_lock_irqsave(&st->lock, flags);
+	*some = st->some;
+	*full = st->full;
+	*total = st->total;
+	if (st->nr)
+		*some += now - st->some_start;
+	if (st->full_start)
+		*full += now - st->full_start;
+	spin_unlock_irqrestore(&st->lock, flags);
+}
+
 #ifdef CONFIG_BC_RSS_ACCOUNTING
 int ub_try_to_free_pages(struct user_beancounter *ub, gfp_t gfp_mask)
 {
 	unsigned long progress, flags;
+	u64 start;
 
 	if (!(gfp_mask & __GFP_WAIT))
 		goto nowait;
 
+	trace_ub_reclaim_begin(ub, gfp_mask);
+	start = ub_stall_start(ub);
 	progress = try_to_free_gang_pages(get_ub_gs(ub),
 			gfp_mask | __GFP_HIGHMEM);
+	ub_stall_end(ub, start);
+	trace_ub_reclaim_end(ub, progress);
 	if (progress)
 		return 0;
 
@@ -250,8 +471,11 @@ nowait:
 
 	spin_lock_irqsave(&ub->ub_lock, flags);
 	ub->ub_parms[UB_PHYSPAGES].failcnt++;
-	if (!ub_resource_excess(ub, UB_SWAPPAGES, UB_SOFT))
+	ub_post_event(ub, UB_PHYSPAGES);
+	if (!ub_resource_excess(ub, UB_SWAPPAGES, UB_SOFT)) {
 		ub->ub_parms[UB_SWAPPAGES].failcnt++;
+		ub_post_event(ub, UB_SWAPPAGES);
+	}
 	spin_unlock_irqrestore(&ub->ub_lock, flags);
 
 nowarn:
@@ -262,6 +486,103 @@ nowarn:
 	return 0;
 }
 
+/*
+ * Background reclaim: when physpages headroom of beancounter with
+ * UB_BG_RECLAIM flag falls below ub_bg_reclaim_low percents of limit,
+ * reclaim worker frees pages until headroom reaches ub_bg_reclaim_high.
+ */
+int ub_bg_reclaim_low = 5;
+int ub_bg_reclaim_high = 10;
+
+/* limit for one reclaim work pass, in try_to_free_gang_pages() rounds */
+#define UB_BG_RECLAIM_BATCH	64
+
+static struct workqueue_struct *ub_reclaim_wq;
+
+static unsigned long ub_phys_headroom(struct user_beancounter *ub)
+{
+	unsigned long limit = ub->ub_parms[UB_PHYSPAGES].limit;
+	unsigned long held = get_beancounter_usage_percpu(ub, UB_PHYSPAGES);
+
+	return limit > held ? limit - held : 0;
+}
+
+static unsigned long ub_phys_watermark(struct user_beancounter *ub, int ratio)
+{
+	return ub->ub_parms[UB_PHYSPAGES].limit / 100 * ratio;
+}
+
+/*
+ * Page cache soft limit: while the file pages of a beancounter are over
+ * ub_cache_limit its reclaim takes them only and leaves anon alone, and
+ * the reclaim worker trims them back even with physpages headroom left.
+ */
+int ub_cache_over_limit(struct user_beancounter *ub)
+{
+	unsigned long stat[NR_LRU_LISTS];
+
+	if (likely(!ub->ub_cache_limit))
+		return 0;
+
+	gang_page_stat(get_ub_gs(ub), false, NULL, stat, NULL);
+	return stat[LRU_ACTIVE_FILE] + stat[LRU_INACTIVE_FILE] >
+		ub->ub_cache_limit;
+}
+
+static void ub_bg_reclaim_work(struct work_struct *w)
+{
+	struct user_beancounter *ub;
+	unsigned long progress, high;
+	int round;
+
+	ub = container_of(w, struct user_beancounter, ub_reclaim_work);
+	high = ub_phys_watermark(ub, ub_bg_reclaim_high);
+
+	for (round = 0; round < UB_BG_RECLAIM_BATCH; round++) {
+		if ((!test_bit(UB_BG_RECLAIM, &ub->ub_flags) ||
+		     ub_phys_headroom(ub) >= high) &&
+		    !ub_cache_over_limit(ub))
+			break;
+		progress = try_to_free_gang_pages(get_ub_gs(ub),
+				GFP_KERNEL | __GFP_HIGHMEM);
+		if (!progress)
+			break;
+		ub->ub_bg_reclaimed += progress;
+		cond_resched();
+	}
+
+	put_beancounter(ub);
+}
+
+static void ub_kick_bg_reclaim(struct user_beancounter *ub)
+{
+	if (work_pending(&ub->ub_reclaim_work))
+		return;
+
+	if ((likely(!test_bit(UB_BG_RECLAIM, &ub->ub_flags)) ||
+	     ub->ub_parms[UB_PHYSPAGES].limit == UB_MAXVALUE ||
+	     ub_phys_headroom(ub) >= ub_phys_watermark(ub, ub_bg_reclaim_low)) &&
+	    !ub_cache_over_limit(ub))
+		return;
+
+	get_beancounter(ub);
+	if (!queue_work(ub_reclaim_wq, &ub->ub_reclaim_work))
+		put_beancounter(ub);
+}
+
+void ub_init_bg_reclaim(struct user_beancounter *ub)
+{
+	INIT_WORK(&ub->ub_reclaim_work, ub_bg_reclaim_work);
+}
+
+int __init ub_init_bg_reclaim_wq(void)
+{
+	ub_reclaim_wq = create_workqueue("ubreclaimd");
+	if (ub_reclaim_wq == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
 static int __ub_phys_charge(struct user_beancounter *ub,
 		unsigned long pages, gfp_t gfp_mask)
 {
@@ -285,6 +606,8 @@ static int __ub_phys_charge(struct user_beancounter *ub,
 	}
 	local_irq_restore(flags);
 
+	ub_kick_bg_reclaim(ub);
+
 	return 0;
 }
 
@@ -538,7 +861,84 @@ static int bc_fill_sysinfo(struct user_beancounter *ub,
 	return NOTIFY_OK;
 }
 
-static int bc_fill_meminfo(struct user_beancounter *ub,
+/*
+ * Monitoring, free(1) and JVMs of every VE read /proc/meminfo all the
+ * time, and each read walks the gangs of all zones and folds the percpu
+ * counters of all possible cpus. What one read has found is given to the
+ * reads of the VE for the next ub_meminfo_cache_time jiffies.
+ */
+int ub_meminfo_cache_time = HZ / 10;
+
+struct ub_meminfo_cache {
+	spinlock_t		lock;
+	unsigned long		stamp;		/* jiffies of mi, 0 if none */
+	struct sysinfo		si;
+	struct meminfo		mi;
+	unsigned long		vm_stamp;	/* jiffies of the below */
+	unsigned long		pswpin, pswpout;
+};
+
+static struct ub_meminfo_cache *ub_meminfo_cache(struct user_beancounter *ub)
+{
+	struct ub_meminfo_cache *mc = ub->ub_meminfo;
+
+	if (mc || !ub_meminfo_cache_time)
+		return mc;
+
+	mc = kzalloc(sizeof(struct ub_meminfo_cache), GFP_KERNEL);
+	if (mc == NULL)
+		return NULL;
+
+	spin_lock_init(&mc->lock);
+	if (cmpxchg(&ub->ub_meminfo, NULL, mc) != NULL) {
+		kfree(mc);
+		mc = ub->ub_meminfo;
+	}
+	return mc;
+}
+
+static inline int ub_meminfo_fresh(unsigned long stamp)
+{
+	return stamp && time_before(jiffies, stamp + ub_meminfo_cache_time);
+}
+
+static int bc_cached_meminfo(struct user_beancounter *ub,
+		unsigned long meminfo_val, struct meminfo *mi)
+{
+	struct ub_meminfo_cache *mc = ub->ub_meminfo;
+	struct sysinfo *si = mi->si;
+	int hit = 0;
+
+	if (mc == NULL || !ub_meminfo_cache_time)
+		return 0;
+
+	spin_lock(&mc->lock);
+	if (ub_meminfo_fresh(mc->stamp) && mc->mi.meminfo_val == meminfo_val) {
+		*si = mc->si;
+		*mi = mc->mi;
+		mi->si = si;
+		hit = 1;
+	}
+	spin_unlock(&mc->lock);
+
+	return hit;
+}
+
+static void bc_cache_meminfo(struct user_beancounter *ub, struct meminfo *mi)
+{
+	struct ub_meminfo_cache *mc = ub_meminfo_cache(ub);
+
+	if (mc == NULL)
+		return;
+
+	spin_lock(&mc->lock);
+	mc->si = *mi->si;
+	mc->mi = *mi;
+	mc->stamp = jiffies ? : 1;
+	spin_unlock(&mc->lock);
+}
+
+static int __bc_fill_meminfo(struct user_beancounter *ub,
 		unsigned long meminfo_val, struct meminfo *mi)
 {
 	int cpu, ret;
@@ -551,8 +951,8 @@ static int bc_fill_meminfo(struct user_beancounter *ub,
 	gang_page_stat(get_ub_gs(ub), true, NULL, mi->pages, mi->shadow);
 	gang_idle_page_stat(get_ub_gs(ub), true, NULL, &mi->idle_page_stats);
 
-	mi->locked = ub->ub_parms[UB_LOCKEDPAGES].held;
-	mi->shmem = ub->ub_parms[UB_SHMPAGES].held;
+	mi->locked = get_beancounter_usage_percpu(ub, UB_LOCKEDPAGES);
+	mi->shmem = get_beancounter_usage_percpu(ub, UB_SHMPAGES);
 	dcache = ub->ub_parms[UB_DCACHESIZE].held;
 	kmem = ub->ub_parms[UB_KMEMSIZE].held;
 
@@ -577,25 +977,60 @@ static int bc_fill_meminfo(struct user_beancounter *ub,
 	mi->cached = min(mi->si->totalram - mi->si->freeram -
 			mi->slab_reclaimable - mi->slab_unreclaimable,
 			mi->pages[LRU_INACTIVE_FILE] +
-			mi->pages[LRU_ACTIVE_FILE] +
-			ub->ub_parms[UB_SHMPAGES].held);
+			mi->pages[LRU_ACTIVE_FILE] + mi->shmem);
 out:
 	return ret;
 }
 
+static int bc_fill_meminfo(struct user_beancounter *ub,
+		unsigned long meminfo_val, struct meminfo *mi)
+{
+	int ret;
+
+	if (bc_cached_meminfo(ub, meminfo_val, mi))
+		return NOTIFY_OK;
+
+	ret = __bc_fill_meminfo(ub, meminfo_val, mi);
+	if (!(ret & NOTIFY_STOP_MASK))
+		bc_cache_meminfo(ub, mi);
+
+	return ret;
+}
+
 static int bc_fill_vmstat(struct user_beancounter *ub, unsigned long *stat)
 {
+	struct ub_meminfo_cache *mc = ub_meminfo_cache(ub);
+	unsigned long pswpin = 0, pswpout = 0;
 	int cpu;
 
+	if (mc) {
+		spin_lock(&mc->lock);
+		if (ub_meminfo_fresh(mc->vm_stamp)) {
+			pswpin = mc->pswpin;
+			pswpout = mc->pswpout;
+			spin_unlock(&mc->lock);
+			goto out;
+		}
+		spin_unlock(&mc->lock);
+	}
+
 	for_each_possible_cpu(cpu) {
 		struct ub_percpu_struct *pcpu = ub_percpu(ub, cpu);
 
-		stat[NR_VM_ZONE_STAT_ITEMS + PSWPIN]	+= pcpu->swapin;
-		stat[NR_VM_ZONE_STAT_ITEMS + PSWPOUT]	+= pcpu->swapout;
+		pswpin	+= pcpu->swapin + pcpu->vswapin;
+		pswpout	+= pcpu->swapout + pcpu->vswapout;
+	}
 
-		stat[NR_VM_ZONE_STAT_ITEMS + PSWPIN]	+= pcpu->vswapin;
-		stat[NR_VM_ZONE_STAT_ITEMS + PSWPOUT]	+= pcpu->vswapout;
+	if (mc) {
+		spin_lock(&mc->lock);
+		mc->pswpin = pswpin;
+		mc->pswpout = pswpout;
+		mc->vm_stamp = jiffies ? : 1;
+		spin_unlock(&mc->lock);
 	}
+out:
+	stat[NR_VM_ZONE_STAT_ITEMS + PSWPIN]	+= pswpin;
+	stat[NR_VM_ZONE_STAT_ITEMS + PSWPOUT]	+= pswpout;
 
 	return NOTIFY_OK;
 }
@@ -675,6 +1110,11 @@ static int bc_vmaux_show(struct seq_file *f, void *v)
 	unsigned long swapin, swapout, vswapin, vswapout, phys_pages;
 	unsigned long swapentries, tmpfs_respages, hugetlb_pages;
 	unsigned long shadow_pages;
+	u64 stall_some, stall_full, stall_total;
+#ifdef CONFIG_KSTALED
+	struct idle_page_stats idle;
+	char name[32];
+#endif
 	int i;
 
 	ub = seq_beancounter(f);
@@ -715,6 +1155,42 @@ static int bc_vmaux_show(struct seq_file *f, void *v)
 	seq_printf(f, bc_proc_lu_fmt, "swap_entries", swapentries);
 
 	seq_printf(f, bc_proc_lu_fmt, "hugetlb", hugetlb_pages);
+	seq_printf(f, bc_proc_lu_fmt, "bg_reclaimed", ub->ub_bg_reclaimed);
+#ifdef CONFIG_KSM
+	seq_printf(f, bc_proc_lu_fmt, "ksm_merged",
+			atomic_long_read(&ub->ub_ksm_merged));
+#endif
+
+#ifdef CONFIG_KSTALED
+	gang_idle_page_stat(get_ub_gs(ub), true, NULL, &idle);
+	for (i = 0; i < KSTALED_AGE_BUCKETS; i++) {
+		snprintf(name, sizeof(name), "idle_age_%d", 1 << i);
+		seq_printf(f, bc_proc_lu_fmt, name,
+				(unsigned long)idle.idle_age[i]);
+	}
+#endif
+
+	ub_stall_read(ub, &stall_some, &stall_full, &stall_total);
+	seq_printf(f, bc_proc_llu_fmt, "stall_some_us",
+			div_u64(stall_some, NSEC_PER_USEC));
+	seq_printf(f, bc_proc_llu_fmt, "stall_full_us",
+			div_u64(stall_full, NSEC_PER_USEC));
+	seq_printf(f, bc_proc_llu_fmt, "stall_total_us",
+			div_u64(stall_total, NSEC_PER_USEC));
+
+#ifdef CONFIG_COMPACTION
+	seq_printf(f, bc_proc_lu_fmt, "compact_stall",
+			ub_percpu_sum(ub, compact_stall));
+	seq_printf(f, bc_proc_lu_fmt, "compact_fail",
+			ub_percpu_sum(ub, compact_fail));
+	seq_printf(f, bc_proc_lu_fmt, "compact_success",
+			ub_percpu_sum(ub, compact_success));
+	seq_printf(f, bc_proc_lu_fmt, "compact_throttled",
+			ub_percpu_sum(ub, compact_throttled));
+	seq_printf(f, bc_proc_llu_fmt, "compact_time_us",
+			div_u64(__ub_percpu_sum(ub, compact_time),
+				NSEC_PER_USEC));
+#endif
 
 	return 0;
 }
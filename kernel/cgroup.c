@@ -310,8 +310,11 @@ static int css_set_count;
  * hash table for cgroup groups. This improves the performance to find
  * an existing css_set. This hash doesn't (currently) take into
  * account cgroups in empty hierarchies.
+ *
+ * Every container has its own cgroup in a few hierarchies, so there are
+ * thousands of css_sets on a loaded node.
  */
-#define CSS_SET_HASH_BITS	7
+#define CSS_SET_HASH_BITS	12
 #define CSS_SET_TABLE_SIZE	(1 << CSS_SET_HASH_BITS)
 static struct hlist_head css_set_table[CSS_SET_TABLE_SIZE];
 
@@ -321,9 +324,12 @@ static struct hlist_head *css_set_hash(struct cgroup_subsys_state *css[])
 	int index;
 	unsigned long tmp = 0UL;
 
+	/*
+	 * css are slab objects of a few sizes, a plain sum of them collides
+	 * for sets which differ in two hierarchies, mix each one first.
+	 */
 	for (i = 0; i < CGROUP_SUBSYS_COUNT; i++)
-		tmp += (unsigned long)css[i];
-	tmp = (tmp >> 16) ^ tmp;
+		tmp ^= hash_ptr(css[i], BITS_PER_LONG) + i;
 
 	index = hash_long(tmp, CSS_SET_HASH_BITS);
 
@@ -1997,7 +2003,7 @@ int cgroup_attach_proc(struct cgroup *cgrp, struct task_struct *leader)
 	struct cgroup_subsys *ss, *failed_ss = NULL;
 	bool cancel_failed_ss = false;
 	/* guaranteed to be initialized later, but the compiler needs this */
-	struct css_set *oldcg;
+	struct css_set *oldcg, *last_oldcg = NULL, *last_cg = NULL;
 	struct cgroupfs_root *root = cgrp->root;
 	/* threadgroup list cursor and array */
 	struct task_struct *tsk;
@@ -2112,13 +2118,30 @@ int cgroup_attach_proc(struct cgroup *cgrp, struct task_struct *leader)
 		oldcg = tc->task->cgroups;
 		get_css_set(oldcg);
 		task_unlock(tc->task);
-		tc->cg = find_css_set(tc->task->cgroups, cgrp);
-		put_css_set(oldcg);
+		/*
+		 * threads mostly share the css_set, and so do their new ones:
+		 * the last old one is held to be sure a match is the same set.
+		 */
+		if (oldcg == last_oldcg) {
+			tc->cg = last_cg;
+			get_css_set(tc->cg);
+			put_css_set(oldcg);
+		} else {
+			tc->cg = find_css_set(oldcg, cgrp);
+			if (last_oldcg)
+				put_css_set(last_oldcg);
+			last_oldcg = oldcg;
+			last_cg = tc->cg;
+		}
 		if (!tc->cg) {
 			retval = -ENOMEM;
 			goto out_put_css_set_refs;
 		}
 	}
+	if (last_oldcg) {
+		put_css_set(last_oldcg);
+		last_oldcg = NULL;
+	}
 
 	/*
 	 * step 3: now that we're guaranteed success wrt the css_sets, proceed
@@ -2165,6 +2188,8 @@ int cgroup_attach_proc(struct cgroup *cgrp, struct task_struct *leader)
 	cgroup_wakeup_rmdir_waiter(cgrp);
 	retval = 0;
 out_put_css_set_refs:
+	if (last_oldcg)
+		put_css_set(last_oldcg);
 	if (retval) {
 		for (i = 0; i < group_size; i++) {
 			tc = flex_array_get(group, i);
@@ -5257,6 +5282,25 @@ int cgroup_kernel_attach(struct cgroup *cgrp, struct task_struct *tsk)
 }
 EXPORT_SYMBOL(cgroup_kernel_attach);
 
+/*
+ * Attaches the task to cgroups of several hierarchies under one
+ * cgroup_mutex, NULLs are skipped. Stops at the first failure, the
+ * cgroups before it stay attached.
+ */
+int cgroup_kernel_attach_many(struct cgroup **cgrps, int nr,
+			      struct task_struct *tsk)
+{
+	int i, ret = 0;
+
+	cgroup_lock();
+	for (i = 0; i < nr && !ret; i++)
+		if (cgrps[i])
+			ret = cgroup_attach_task(cgrps[i], tsk);
+	cgroup_unlock();
+	return ret;
+}
+EXPORT_SYMBOL(cgroup_kernel_attach_many);
+
 void cgroup_kernel_close(struct cgroup *cgrp)
 {
 	if (!cgroup_is_disposable(cgrp)) {
@@ -30,6 +30,7 @@
 #include <linux/icmp.h>
 #include <linux/ip.h>
 #include <linux/rculist_nulls.h>
+#include <linux/vmalloc.h>
 
 #if defined(CONFIG_VE_IPTABLES) && \
     (defined(CONFIG_NF_CONNTRACK) || defined(CONFIG_NF_CONNTRACK_MODULE))
@@ -57,8 +58,14 @@
  * safely. And on exit we restore timers to their original values.
  *
  * Note, this approach is not going to work in VE0.
+ *
+ * Images of conntracks and their expectations are composed in a buffer
+ * and written in batches of CT_BATCH_SIZE bytes, cpt_next of each one
+ * is known before it is written.
  */
 
+#define CT_BATCH_SIZE	(16*PAGE_SIZE)
+
 struct ct_holder
 {
 	struct ct_holder *next;
@@ -118,11 +125,10 @@ static int dump_one_expect(struct cpt_ip_connexpect_image *v,
  */
 
 static int dump_expect_list(struct nf_conn *ct, struct ct_holder *list,
-			    cpt_context_t *ctx)
+			    void *buf, cpt_context_t *ctx)
 {
 	int err = 0;
-	unsigned long pg;
-	struct cpt_ip_connexpect_image *v;
+	struct cpt_ip_connexpect_image *v = buf;
 	struct nf_conntrack_expect *exp;
 	struct nf_conn_help *help = nfct_help(ct);
 	struct hlist_node *next;
@@ -139,11 +145,6 @@ static int dump_expect_list(struct nf_conn *ct, struct ct_holder *list,
 	if (expecting*sizeof(struct cpt_ip_connexpect_image) > PAGE_SIZE)
 		return -ENOBUFS;
 
-	pg = __get_free_page(GFP_KERNEL);
-	if (!pg)
-		return -ENOMEM;
-	v = (struct cpt_ip_connexpect_image *)pg;
-
 	spin_lock_bh(&nf_conntrack_lock);
 	hlist_for_each_entry(exp, next, &help->expectations, lnode) {
 		int sibling;
@@ -197,25 +198,22 @@ static int dump_expect_list(struct nf_conn *ct, struct ct_holder *list,
 	}
 	spin_unlock_bh(&nf_conntrack_lock);
 
-	if (err == 0 && (unsigned long)v != pg)
-		ctx->write((void*)pg, (unsigned long)v - pg, ctx);
-
-	free_page(pg);
-	return err;
+	return err ? : (void *)v - buf;
 }
 
+/* Composes the image in buf, returns its size */
 static int dump_one_ct(struct ct_holder *c, struct ct_holder *list,
-		       cpt_context_t *ctx)
+		       void *buf, cpt_context_t *ctx)
 {
 	struct nf_conntrack_tuple_hash *h = c->cth;
 	struct nf_conn *ct = nf_ct_tuplehash_to_ctrack(h);
 	struct nf_conn_nat *nat = nfct_nat(ct);
-	struct cpt_ip_conntrack_image v;
+	struct cpt_ip_conntrack_image *v = buf;
 	const struct nf_conn_help *help;
 	int err = 0;
 
-	BUILD_BUG_ON(sizeof(v.cpt_proto_data) < sizeof(ct->proto));
-	BUILD_BUG_ON(sizeof(v.cpt_help_data) < sizeof(union nf_conntrack_help));
+	BUILD_BUG_ON(sizeof(v->cpt_proto_data) < sizeof(ct->proto));
+	BUILD_BUG_ON(sizeof(v->cpt_help_data) < sizeof(union nf_conntrack_help));
 
 	rcu_read_lock_bh();
 	help = nfct_help(ct);
@@ -233,79 +231,80 @@ static int dump_one_ct(struct ct_holder *c, struct ct_holder *list,
 	if (err)
 		return err;
 
-	cpt_open_object(NULL, ctx);
-
-	v.cpt_next = CPT_NULL;
-	v.cpt_object = CPT_OBJ_NET_CONNTRACK;
-	v.cpt_hdrlen = sizeof(v);
-	v.cpt_content = CPT_CONTENT_ARRAY;
+	memset(v, 0, sizeof(*v));
+	v->cpt_object = CPT_OBJ_NET_CONNTRACK;
+	v->cpt_hdrlen = sizeof(*v);
+	v->cpt_content = CPT_CONTENT_ARRAY;
 
 	rcu_read_lock_bh();
-	v.cpt_status = ct->status;
-	v.cpt_timeout = ct->timeout.expires - jiffies;
-	v.cpt_ct_helper = (nfct_help(ct) != NULL);
-	v.cpt_index = c->index;
-	v.cpt_mark = 0;
+	v->cpt_status = ct->status;
+	v->cpt_timeout = ct->timeout.expires - jiffies;
+	v->cpt_ct_helper = (nfct_help(ct) != NULL);
+	v->cpt_index = c->index;
+	v->cpt_mark = 0;
 #if defined(CONFIG_NF_CONNTRACK_MARK)
-	v.cpt_mark = ct->mark;
+	v->cpt_mark = ct->mark;
 #endif
-	encode_tuple(&v.cpt_tuple[0], &ct->tuplehash[0].tuple);
-	encode_tuple(&v.cpt_tuple[1], &ct->tuplehash[1].tuple);
-	memcpy(&v.cpt_proto_data, &ct->proto, sizeof(v.cpt_proto_data));
+	encode_tuple(&v->cpt_tuple[0], &ct->tuplehash[0].tuple);
+	encode_tuple(&v->cpt_tuple[1], &ct->tuplehash[1].tuple);
+	memcpy(&v->cpt_proto_data, &ct->proto, sizeof(v->cpt_proto_data));
 	if (nfct_help(ct))
-		memcpy(&v.cpt_help_data, &nfct_help(ct)->help, sizeof(v.cpt_help_data));
+		memcpy(&v->cpt_help_data, &nfct_help(ct)->help, sizeof(v->cpt_help_data));
 
-	v.cpt_masq_index = 0;
-	v.cpt_nat_helper = 0;
+	v->cpt_masq_index = 0;
+	v->cpt_nat_helper = 0;
 	if (nat) {
 #ifdef CONFIG_NF_NAT_NEEDED
 #if defined(CONFIG_IP_NF_TARGET_MASQUERADE) || \
 	defined(CONFIG_IP_NF_TARGET_MASQUERADE_MODULE)
-		v.cpt_masq_index = nat->masq_index;
+		v->cpt_masq_index = nat->masq_index;
 #endif
 	/* "help" data is used by pptp, difficult to support */
-		v.cpt_nat_seq[0].cpt_correction_pos = nat->seq[0].correction_pos;
-		v.cpt_nat_seq[0].cpt_offset_before = nat->seq[0].offset_before;
-		v.cpt_nat_seq[0].cpt_offset_after = nat->seq[0].offset_after;
-		v.cpt_nat_seq[1].cpt_correction_pos = nat->seq[1].correction_pos;
-		v.cpt_nat_seq[1].cpt_offset_before = nat->seq[1].offset_before;
-		v.cpt_nat_seq[1].cpt_offset_after = nat->seq[1].offset_after;
+		v->cpt_nat_seq[0].cpt_correction_pos = nat->seq[0].correction_pos;
+		v->cpt_nat_seq[0].cpt_offset_before = nat->seq[0].offset_before;
+		v->cpt_nat_seq[0].cpt_offset_after = nat->seq[0].offset_after;
+		v->cpt_nat_seq[1].cpt_correction_pos = nat->seq[1].correction_pos;
+		v->cpt_nat_seq[1].cpt_offset_before = nat->seq[1].offset_before;
+		v->cpt_nat_seq[1].cpt_offset_after = nat->seq[1].offset_after;
 #endif
 	}
 	rcu_read_unlock_bh();
 
-	ctx->write(&v, sizeof(v), ctx);
-
-	err = dump_expect_list(ct, list, ctx);
+	err = dump_expect_list(ct, list, v + 1, ctx);
+	if (err < 0)
+		return err;
 
-	cpt_close_object(ctx);
-	return err;
+	v->cpt_next = sizeof(*v) + err;
+	return v->cpt_next;
 }
 
 int cpt_dump_ip_conntrack(cpt_context_t * ctx)
 {
-	struct ct_holder *ct_list = NULL;
+	struct ct_holder *holders, *ct_list = NULL;
 	struct ct_holder *c, **cp;
 	struct nf_conn *ct;
+	char *batch = NULL;
+	int fill = 0;
 	int err = 0;
 	int index = 0;
-	int idx;
+	int idx, nr;
 	struct net *net = get_exec_env()->ve_netns;
 	struct hlist_nulls_node *n;
 
-	for (idx = atomic_read(&(net->ct.count)); idx >= 0; idx--) {
-		c = kmalloc(sizeof(struct ct_holder), GFP_KERNEL);
-		if (c == NULL) {
-			err = -ENOMEM;
-			goto done;
-		}
-		memset(c, 0, sizeof(struct ct_holder));
-		c->next = ct_list;
-		ct_list = c;
+	nr = nf_conntrack_count(net) + 1;
+	holders = vmalloc(nr * sizeof(struct ct_holder));
+	if (holders == NULL)
+		return -ENOMEM;
+	memset(holders, 0, nr * sizeof(struct ct_holder));
+	for (idx = nr - 1; idx >= 0; idx--) {
+		holders[idx].next = ct_list;
+		ct_list = &holders[idx];
 	}
 
 	c = ct_list;
 
+	/* A table being grown can show a conntrack twice or miss it */
+	mutex_lock(&nf_conntrack_resize_mutex);
 	rcu_read_lock_bh();
 	for (idx = 0; idx < net->ct.htable_size; idx++) {
 		struct nf_conntrack_tuple_hash *h;
@@ -319,6 +318,7 @@ int cpt_dump_ip_conntrack(cpt_context_t * ctx)
 			 * It is impossible. */
 			if (unlikely(c == NULL)) {
 				rcu_read_unlock_bh();
+				mutex_unlock(&nf_conntrack_resize_mutex);
 				eprintk_ctx("unexpected conntrack appeared\n");
 				err = -ENOMEM;
 				goto done;
@@ -344,6 +344,7 @@ int cpt_dump_ip_conntrack(cpt_context_t * ctx)
 		}
 	}
 	rcu_read_unlock_bh();
+	mutex_unlock(&nf_conntrack_resize_mutex);
 
 	/* No conntracks? Good. */
 	if (index == 0)
@@ -357,7 +358,6 @@ int cpt_dump_ip_conntrack(cpt_context_t * ctx)
 		 */
 		if (c->cth == NULL) {
 			*cp = c->next;
-			kfree(c);
 			continue;
 		}
 
@@ -373,27 +373,42 @@ int cpt_dump_ip_conntrack(cpt_context_t * ctx)
 		cp = &c->next;
 	}
 
+	batch = vmalloc(CT_BATCH_SIZE);
+	if (batch == NULL) {
+		err = -ENOMEM;
+		goto done;
+	}
+
 	cpt_open_section(ctx, CPT_SECT_NET_CONNTRACK);
 
 	for (c = ct_list; c; c = c->next) {
-		err = dump_one_ct(c, ct_list, ctx);
-		if (err)
+		if (CT_BATCH_SIZE - fill <
+		    sizeof(struct cpt_ip_conntrack_image) + PAGE_SIZE) {
+			ctx->write(batch, fill, ctx);
+			fill = 0;
+		}
+		err = dump_one_ct(c, ct_list, batch + fill, ctx);
+		if (err < 0)
 			goto done;
+		fill += err;
+		err = 0;
 	}
+	if (fill)
+		ctx->write(batch, fill, ctx);
 
 	cpt_close_section(ctx);
 
 done:
-	while ((c = ct_list) != NULL) {
-		ct_list = c->next;
+	for (c = ct_list; c; c = c->next) {
 		if (c->cth) {
 			ct = nf_ct_tuplehash_to_ctrack(c->cth);
 			nf_conntrack_put(&ct->ct_general);
 			/* Restore timer. refcnt is preserved. */
 			add_timer(&nf_ct_tuplehash_to_ctrack(c->cth)->timeout);
 		}
-		kfree(c);
 	}
+	vfree(batch);
+	vfree(holders);
 	return err;
 }
 
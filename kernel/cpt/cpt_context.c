@@ -105,6 +105,24 @@ static void file_pwrite(void *addr, size_t count, struct cpt_context *ctx, loff_
 		ctx->write_error = err < 0 ? err : -EIO;
 }
 
+/*
+ * Skip @count bytes of the dump file at the current position, they are
+ * filled later with direct writes at *@pos.
+ */
+int cpt_reserve_space(size_t count, loff_t *pos, struct cpt_context *ctx)
+{
+	struct file *file = ctx->file;
+
+	if (!file)
+		return -EBADF;
+	if (!check_dumpsize(ctx, count, file->f_pos))
+		return ctx->write_error;
+
+	*pos = file->f_pos;
+	file->f_pos += count;
+	return 0;
+}
+
 static void file_align(struct cpt_context *ctx)
 {
 	struct file *file = ctx->file;
@@ -157,6 +175,9 @@ void cpt_context_init(struct cpt_context *ctx)
 	ctx->align = file_align;
 	for (i=0; i < CPT_SECT_MAX; i++)
 		ctx->sections[i] = CPT_NULL;
+#ifdef CONFIG_VZ_CHECKPOINT_ITER
+	INIT_RADIX_TREE(&ctx->postcopy_pages, GFP_KERNEL);
+#endif
 	cpt_object_init(ctx);
 }
 
@@ -316,6 +316,27 @@ out:
 	return todo;
 }
 
+/* Report a few tasks, which do not freeze, and where they sleep */
+static void report_unfrozen(struct cpt_context *ctx, int max)
+{
+	struct task_struct *p, *g;
+	int i = 0;
+
+	read_lock(&tasklist_lock);
+	do_each_thread_ve(g, p) {
+		if (!freezable(p) || frozen(p))
+			continue;
+		if (i++ >= max)
+			goto out;
+		eprintk_ctx("task " CPT_FID " is not frozen, state %ld, "
+			    "wchan %pS\n", CPT_TID(p), p->state,
+			    (void *)get_wchan(p));
+		sched_show_task(p);
+	} while_each_thread_ve(g, p);
+out:
+	read_unlock(&tasklist_lock);
+}
+
 static int check_stop_status(struct cpt_context *ctx, int todo,
 			     unsigned long start_time,
 			     unsigned long stop_time)
@@ -329,25 +350,14 @@ static int check_stop_status(struct cpt_context *ctx, int todo,
 		 * we will wake VE and restart suspend.
 		 */
 		if (time_after(jiffies, start_time + suspend_timeout*HZ)) {
-			struct task_struct *p, *g;
-			int i = 0;
-
 			eprintk_ctx("timed out (%d seconds).\n", suspend_timeout);
-			eprintk_ctx("Unfrozen tasks (no more than 10): see dmesg output.\n");
-			read_lock(&tasklist_lock);
-			do_each_thread_ve(g, p) {
-				task_lock(p);
-				if (freezable(p) && !frozen(p) && (i++ < 10))
-					sched_show_task(p);
-				task_unlock(p);
-
-			} while_each_thread_ve(g, p);
-			read_unlock(&tasklist_lock);
-
+			eprintk_ctx("Unfrozen tasks (no more than 10), stacks are in dmesg:\n");
+			report_unfrozen(ctx, 10);
 			todo = OBSTACLE_TIMEOUT;
-		} else if (signal_pending(current))
+		} else if (signal_pending(current)) {
+			report_unfrozen(ctx, 10);
 			todo = OBSTACLE_SIGNAL;
-		else if (time_after(jiffies, stop_time))
+		} else if (time_after(jiffies, stop_time))
 			todo = OBSTACLE_TRYAGAIN;
 	}
 
@@ -396,6 +406,7 @@ static int check_stop_status(struct cpt_context *ctx, int todo,
 
 static int vps_stop_tasks(struct cpt_context *ctx)
 {
+	struct ve_struct *env = get_exec_env();
 	unsigned long start_time = jiffies;
 	unsigned long timeout = HZ/5;
 	int status;
@@ -405,7 +416,7 @@ static int vps_stop_tasks(struct cpt_context *ctx)
 	do_posix_clock_monotonic_gettime(&ctx->cpt_monotonic_time);
 	ctx->virt_jiffies64 = get_jiffies_64() + get_exec_env()->jiffies_fixup;
 
-	atomic_inc(&get_exec_env()->suspend);
+	atomic_inc(&env->suspend);
 
 	status = vps_handle_external(ctx);
 	if (status)
@@ -413,6 +424,7 @@ static int vps_stop_tasks(struct cpt_context *ctx)
 
 	do {
 		unsigned long stop_time = jiffies + timeout;
+		int frozen = atomic_read(&env->suspend_frozen);
 		int result;
 
 		result = vps_stop_iteration(ctx);
@@ -431,20 +443,20 @@ static int vps_stop_tasks(struct cpt_context *ctx)
 				 * with longer timeout */
 				timeout = min(timeout<<1, DEFAULT_SUSPEND_TIMEOUT_MIN*HZ);
 			} else {
-				if (round++ > 0) {
-					/* VE is partially frozen, give processes
-					 * a chance to enter to refrigerator(). */
-					current->state = TASK_INTERRUPTIBLE;
-					schedule_timeout(HZ/20);
-				} else {
-					yield();
-				}
+				/* VE is partially frozen, wait until the tasks
+				 * asked to freeze enter refrigerator(). Tasks
+				 * can exit or fork meanwhile, so the wait is
+				 * bounded and VE is rescanned after it. */
+				wait_event_interruptible_timeout(env->suspend_wq,
+					atomic_read(&env->suspend_frozen) -
+						frozen >= result,
+					round++ > 0 ? HZ/20 : HZ/100 + 1);
 			}
 		}
 	} while (status > 0);
 
 out:
-	atomic_dec(&get_exec_env()->suspend);
+	atomic_dec(&env->suspend);
 
 	return status;
 }
@@ -821,6 +833,7 @@ static int cpt_dump_veinfo(cpt_context_t *ctx)
 	if (ns->shm_ctlmax > 0xFFFFFFFFU)
 		i->shm_ctl_max = 0xFFFFFFFFU;
 	i->shm_ctl_mni = ns->shm_ctlmni;
+	i->shm_interleave = ns->shm_interleave;
 
 	i->msg_ctl_max = ns->msg_ctlmax;
 	i->msg_ctl_mni = ns->msg_ctlmni;
@@ -850,6 +863,7 @@ static int cpt_dump_veinfo(cpt_context_t *ctx)
 	i->rnd_va_space	= ve->_randomize_va_space + 1;
 	i->vpid_max = ve->ve_ns->pid_ns->pid_max;
 	i->aio_max_nr = ve->aio_max_nr;
+	i->timer_slack_ns = ve->timer_slack_ns;
 	memcpy(&i->cpt_ve_bcap, &ve->ve_cap_bset, sizeof(i->cpt_ve_bcap));
 
 	ctx->write(i, sizeof(*i), ctx);
@@ -943,6 +957,7 @@ int cpt_dump(struct cpt_context *ctx)
 	struct ve_struct *oldenv, *env;
 	cpt_object_t *obj;
 	struct nsproxy *old_ns;
+	struct cpt_stat_mark dm, m;
 	int err, err2 = 0;
 
 	if (!ctx->ve_id)
@@ -991,6 +1006,7 @@ int cpt_dump(struct cpt_context *ctx)
 	err = cpt_open_dumpfile(ctx);
 	if (err)
 		goto out;
+	cpt_stat_start(&dm, ctx);
 	
 	cpt_major_hdr_out(ctx);
 
@@ -1010,34 +1026,48 @@ int cpt_dump(struct cpt_context *ctx)
 		err = cpt_dump_namespace(ctx);
 	if (!err)
 		err = cpt_dump_cgroups(ctx);
+	cpt_stat_start(&m, ctx);
 	if (!err)
 		err = cpt_dump_files(ctx);
 	if (!err)
 		err = cpt_dump_files_struct(ctx);
 	if (!err)
 		err = cpt_dump_fs_struct(ctx);
+	cpt_stat_end(CPT_STAT_DUMP_FILES, &m, ctx);
 	/* netdevices should be dumped after dumping open files
 	   as we need to restore netdevice binding to /dev/net/tun file */
+	cpt_stat_start(&m, ctx);
 	if (!err)
 		err = cpt_dump_ifinfo(ctx);
+	cpt_stat_end(CPT_STAT_DUMP_NET, &m, ctx);
 	if (!err)
 		err = cpt_dump_sighand(ctx);
 	if (!err)
 		err = cpt_dump_posix_timers(ctx);
+	cpt_stat_start(&m, ctx);
 	if (!err)
 		err = cpt_dump_vm(ctx);
+	cpt_stat_end(CPT_STAT_DUMP_VM, &m, ctx);
+	cpt_stat_start(&m, ctx);
 	if (!err)
 		err = cpt_dump_sysvsem(ctx);
 	if (!err)
 		err = cpt_dump_sysvmsg(ctx);
+	cpt_stat_end(CPT_STAT_DUMP_SYSV, &m, ctx);
+	cpt_stat_start(&m, ctx);
 	if (!err)
 		err = cpt_dump_tasks(ctx);
+	cpt_stat_end(CPT_STAT_DUMP_TASKS, &m, ctx);
+	cpt_stat_start(&m, ctx);
 	if (!err)
 		err = cpt_dump_orphaned_sockets(ctx);
+	cpt_stat_end(CPT_STAT_DUMP_SOCKETS, &m, ctx);
 #if defined(CONFIG_VE_IPTABLES) && \
     (defined(CONFIG_NF_CONNTRACK) || defined(CONFIG_NF_CONNTRACK_MODULE))
+	cpt_stat_start(&m, ctx);
 	if (!err)
 		err = cpt_dump_ip_conntrack(ctx);
+	cpt_stat_end(CPT_STAT_DUMP_CONNTRACK, &m, ctx);
 #endif
 	if (!err)
 		err = cpt_dump_utsname(ctx);
@@ -1050,6 +1080,7 @@ int cpt_dump(struct cpt_context *ctx)
 	if (!err)
 		err = cpt_dump_tail(ctx);
 
+	cpt_stat_end(CPT_STAT_DUMP, &dm, ctx);
 	err2 = cpt_close_dumpfile(ctx);
 
 	cpt_close_pram(ctx, err ? : err2);
@@ -1072,8 +1103,12 @@ int cpt_vps_suspend(struct cpt_context *ctx)
 {
 	struct ve_struct *oldenv, *env;
 	struct nsproxy *old_ns;
+	struct cpt_stat_mark sm, m;
 	int err = 0;
 
+	cpt_stat_reset(ctx);
+	cpt_stat_start(&sm, ctx);
+
 	ctx->kernel_config_flags = test_kernel_config();
 	cpt_object_init(ctx);
 
@@ -1114,7 +1149,10 @@ int cpt_vps_suspend(struct cpt_context *ctx)
 	ve_nfs_sync(env, 0);
 
 	/* Find and stop all the tasks */
-	if ((err = vps_stop_tasks(ctx)) != 0)
+	cpt_stat_start(&m, ctx);
+	err = vps_stop_tasks(ctx);
+	cpt_stat_end(CPT_STAT_STOP_TASKS, &m, ctx);
+	if (err)
 		goto out_wake;
 
 	/* Wait for syncing NFS mounts */
@@ -1123,7 +1161,10 @@ int cpt_vps_suspend(struct cpt_context *ctx)
 		goto out_wake;
 	}
 
-	if ((err = cpt_suspend_network(ctx)) != 0)
+	cpt_stat_start(&m, ctx);
+	err = cpt_suspend_network(ctx);
+	cpt_stat_end(CPT_STAT_SUSPEND_NET, &m, ctx);
+	if (err)
 		goto out_wake;
 
 	/* At the moment all the state is frozen. We do not need to lock
@@ -1131,17 +1172,20 @@ int cpt_vps_suspend(struct cpt_context *ctx)
 	 */
 
 	/* Collect task tree */
+	cpt_stat_start(&m, ctx);
 	if ((err = vps_collect_tasks(ctx)) != 0)
 		goto out_wake;
 
 	/* Collect all the resources */
 	err = cpt_collect(ctx);
+	cpt_stat_end(CPT_STAT_COLLECT, &m, ctx);
 
 out:
 	current->nsproxy = old_ns;
 	set_exec_env(oldenv);
 	up_read(&env->op_sem);
 	put_ve(env);
+	cpt_stat_end(CPT_STAT_SUSPEND, &sm, ctx);
         return err;
 
 out_noenv:
@@ -11,3 +11,5 @@ EXPORT_SYMBOL(cpt_object_add);
 EXPORT_SYMBOL(cpt_object_get);
 EXPORT_SYMBOL(lookup_cpt_object);
 EXPORT_SYMBOL(lookup_cpt_obj_bypos);
+EXPORT_SYMBOL(cpt_obj_hash);
+EXPORT_SYMBOL(cpt_obj_hash_pos);
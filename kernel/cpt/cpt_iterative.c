@@ -25,6 +25,7 @@
 
 #include <linux/cpt_obj.h>
 #include <linux/cpt_context.h>
+#include <linux/cpt_ioctl.h>
 #include "cpt_mm.h"
 #include "cpt_files.h"
 #include "cpt_pagein.h"
@@ -38,9 +39,23 @@ struct iter_data
 	int		iter_young;
 	int		iter_shm;
 	int		iter;
+	unsigned long	pass_start;
 	cpt_context_t	*ctx;
 };
 
+/*
+ * Stop iterating when dirty rate dropped by less than this percentage
+ * since previous pass: more passes would just resend the same pages.
+ * 0 disables the check.
+ */
+int cpt_iter_converge = 10;
+
+/*
+ * Track writes with pte dirty bit instead of write-protecting ptes of
+ * anonymous memory, see ptep_test_and_fold_dirty().
+ */
+int cpt_iter_soft_dirty;
+
 /* Algo is the following:
  * 
  * 1. At the first iteration all appropriate pte's are maked COW,
@@ -53,10 +68,28 @@ struct iter_data
  *    we send new copy.
  * 4. Iterations stop when amount of new pages is < thresh_1 or it is
  *    more than pages found at the first iteration / 2^N. So, we never
- *    transfer more than 2*memsize.
+ *    transfer more than 2*memsize. They also stop when the rate pages
+ *    are dirtied with does not drop noticeably from pass to pass
+ *    (cpt_iter_converge), the dirty set is not going to shrink then.
  * 5. Then we freeze VE.
  * 6. cpt_mm, if sees a page, marked PG_checkpoint, sends its pfn.
  *    (well, and panics, if pte is writable).
+ *
+ * In soft-dirty mode (ctx->iter_soft_dirty) ptes of anonymous pages stay
+ * writable. Instead, hardware dirty bit is folded into _PAGE_SOFTDIRTY
+ * when page is sent, so a page is changed when it is PG_checkpointed and
+ * the cpu set the dirty bit again. Writing tasks do not fault then.
+ * Shared memory is write-protected in both modes.
+ *
+ * Incremental snapshots (ctx->incremental) make one pass only and do not
+ * wait for the destination: the page stream is a file then. Step 1 does
+ * not reset PG_checkpointed unless the chain starts (CPT_INCR_BASE), so
+ * the stream gets only pages changed since the previous snapshot and
+ * the image refers to all others by pfn, which some older stream of the
+ * chain has. Restore feeds all streams to rst_iteration() oldest first,
+ * a newer copy of a pfn replaces an older one. Shared memory is dumped
+ * to the image entirely. Usual iterative migration resets the state, so
+ * the chain must start anew after it.
  */
 
 static int add_to_xfer_list(struct page *pg, struct iter_data *iter,
@@ -69,6 +102,41 @@ static int add_to_xfer_list(struct page *pg, struct iter_data *iter,
 	return ((iter->xfer_nr = slot + 1) == CPT_XFER_BATCH);
 }
 
+/*
+ * Page server connected by a socket: the page is not copied, the socket
+ * takes a reference to it, so contents may change until the page is
+ * really transmitted. Such a write is caught like any other: it clears
+ * PG_checkpointed of a write-protected page, or sets the dirty bit of a
+ * soft-dirty one, and the page is sent once more later, so the
+ * destination gets the latest data.
+ */
+static int submit_page_ref(struct file *file, struct page *pg,
+			   struct pgin_reply *rep)
+{
+	mm_segment_t oldfs;
+	size_t done = 0;
+	ssize_t err;
+
+	oldfs = get_fs(); set_fs(KERNEL_DS);
+	err = vfs_write(file, (char *)rep, sizeof(*rep), &file->f_pos);
+	set_fs(oldfs);
+	if (err < 0)
+		return err;
+	if (err != sizeof(*rep))
+		return -EIO;
+
+	while (done < PAGE_SIZE) {
+		err = file->f_op->sendpage(file, pg, done, PAGE_SIZE - done,
+					   &file->f_pos, 0);
+		if (err < 0)
+			return err;
+		if (err == 0)
+			return -EIO;
+		done += err;
+	}
+	return 0;
+}
+
 static int submit_page(struct page *pg, cpt_context_t *ctx)
 {
 	int err;
@@ -84,6 +152,9 @@ static int submit_page(struct page *pg, cpt_context_t *ctx)
 	rep.error = 0;
 	rep.handle = page_to_pfn(pg);
 
+	if (file->f_op && file->f_op->sendpage)
+		return submit_page_ref(file, pg, &rep);
+
 	iov[0].iov_base = &rep;
 	iov[0].iov_len = sizeof(rep);
 	iov[1].iov_base = kmap(pg);
@@ -171,7 +242,13 @@ retry:
 			continue;
 		}
 
-		if (PageCheckpointed(pg)) {
+		if (ctx->iter_soft_dirty) {
+#ifdef __HAVE_ARCH_PTEP_TEST_AND_FOLD_DIRTY
+			if (!ptep_test_and_fold_dirty(vma, addr, pte) &&
+			    PageCheckpointed(pg))
+				continue;
+#endif
+		} else if (PageCheckpointed(pg)) {
 			if (pte_write(ptent)) {
 				pte_unmap_unlock(pte, ptl);
 				eprintk("COW lost %lu %lu!\n", addr, page_to_pfn(pg));
@@ -183,7 +260,8 @@ retry:
 		iter->iter_new++;
 		get_page(pg);
 		SetPageCheckpointed(pg);
-		ptep_set_wrprotect(vma->vm_mm, addr, pte);
+		if (!ctx->iter_soft_dirty)
+			ptep_set_wrprotect(vma->vm_mm, addr, pte);
 		if (add_to_xfer_list(pg, iter, ctx)) {
 			pte_unmap_unlock(pte, ptl);
 			flush_tlb_range(vma, vma->vm_start, vma->vm_end);
@@ -616,12 +694,83 @@ static int nread(struct file *file, void *buf, int len)
 	return 0;
 }
 
+/* Record statistics of the pass just done, returns its dirty rate */
+static u32 iter_account_pass(struct iter_data *iter, cpt_context_t *ctx)
+{
+	struct cpt_iter_stats *st = ctx->iter_stats;
+	struct cpt_iter_pass *ps;
+	unsigned long now = jiffies;
+	u32 msecs;
+
+	msecs = jiffies_to_msecs(now - iter->pass_start) ? : 1;
+	iter->pass_start = now;
+
+	if (st->nr_passes >= CPT_ITER_MAX_PASSES)
+		return 0;
+
+	ps = &st->pass[st->nr_passes];
+	ps->sent = iter->iter_new;
+	/* Everything sent after the first pass was changed meanwhile */
+	ps->dirtied = st->nr_passes ? iter->iter_new : 0;
+	ps->young = iter->iter_young;
+	ps->shm = iter->iter_shm;
+	ps->msecs = msecs;
+	ps->rate = (u64)ps->dirtied * 1000 / msecs;
+	st->nr_passes++;
+
+	return ps->rate;
+}
+
+static int iter_rate_stalled(u32 rate, u32 prev_rate)
+{
+	if (!cpt_iter_converge || !prev_rate)
+		return 0;
+	return (u64)rate * 100 >= (u64)prev_rate * (100 - cpt_iter_converge);
+}
+
+static int cpt_iteration_incremental(struct iter_data *iter,
+				     cpt_context_t *ctx)
+{
+	struct pgin_reply rep;
+	struct file *file = ctx->pagein_file_out;
+	mm_segment_t oldfs;
+	int err;
+
+	ctx->iter_shm_start = 0;
+	if (ctx->incremental == CPT_INCR_BASE)
+		cpt_walk_mm(iter_one_mm, iter, ctx);
+
+	iter->iter_new = iter->iter_young = iter->iter_shm = 0;
+	iter->iter = 1;
+	iter->pass_start = jiffies;
+	err = cpt_walk_mm(iter_one_mm, iter, ctx);
+	iter_account_pass(iter, ctx);
+	dprintk_ctx("incremental: %d pages, %d young\n",
+		    iter->iter_new, iter->iter_young);
+	if (err)
+		return err;
+
+	rep.rmid = PGIN_RMID;
+	rep.error = ITER_STOP;
+	rep.handle = 0;
+
+	oldfs = get_fs(); set_fs(KERNEL_DS);
+	err = vfs_write(file, (void*)&rep, sizeof(rep), &file->f_pos);
+	set_fs(oldfs);
+	if (err != sizeof(rep))
+		return err < 0 ? err : -EIO;
+
+	ctx->iter_done = 1;
+	return 0;
+}
+
 int cpt_iteration(cpt_context_t *ctx)
 {
 	int err;
 	int prev_iter, first_iter, prev_young;
 	struct iter_data *iter;
 	int tmo;
+	u32 rate, prev_rate = 0;
 
 #ifdef ITER_DEBUG
 	ctx->pagein_file_out = filp_open("/var/tmp/dmp_", O_WRONLY|O_TRUNC|O_CREAT, 0666);
@@ -638,6 +787,24 @@ int cpt_iteration(cpt_context_t *ctx)
 	memset(iter, 0, sizeof(struct iter_data));
 
 	iter->ctx = ctx;
+#ifdef __HAVE_ARCH_PTEP_TEST_AND_FOLD_DIRTY
+	ctx->iter_soft_dirty = cpt_iter_soft_dirty;
+#endif
+
+	if (ctx->iter_stats == NULL) {
+		ctx->iter_stats = kmalloc(sizeof(struct cpt_iter_stats),
+					  GFP_KERNEL);
+		if (ctx->iter_stats == NULL) {
+			kfree(iter);
+			return -ENOMEM;
+		}
+	}
+	memset(ctx->iter_stats, 0, sizeof(struct cpt_iter_stats));
+
+	if (ctx->incremental) {
+		err = cpt_iteration_incremental(iter, ctx);
+		goto out;
+	}
 
 	/* Clear the state */ 
 	cpt_walk_shm(iter_one_shm_zero, iter, ctx);
@@ -645,9 +812,11 @@ int cpt_iteration(cpt_context_t *ctx)
 
 	iter->iter_new = iter->iter_young = iter->iter_shm = 0;
 	iter->iter = 1;
+	iter->pass_start = jiffies;
 	err = cpt_walk_mm(iter_one_mm, iter, ctx);
 	if (!err && ctx->iter_shm_start)
 		err = cpt_walk_shm(iter_one_shm, iter, ctx);
+	iter_account_pass(iter, ctx);
 	prev_iter = first_iter = iter->iter_new;
 	prev_young = iter->iter_young;
 	dprintk_ctx("%d: Found %d pages, %d young, %d shm\n",
@@ -670,18 +839,25 @@ int cpt_iteration(cpt_context_t *ctx)
 			if (err)
 				break;
 		}
-		dprintk_ctx("%d: Found %d pages, %d young, %d shm, %d tmo\n",
-			    iter->iter, iter->iter_new, iter->iter_young,
-			    iter->iter_shm, tmo);
+		rate = iter_account_pass(iter, ctx);
+		dprintk_ctx("%d: Found %d pages, %d young, %d shm, %d tmo, "
+			    "%u pages/s\n", iter->iter, iter->iter_new,
+			    iter->iter_young, iter->iter_shm, tmo, rate);
 		if (iter->iter_new > prev_iter/2 ||
 		    iter->iter_young > prev_young/2) {
 			tmo /= 2;
 			if (tmo < 2)
 				tmo = 2;
 		}
-		if (iter->iter_new > first_iter/2 ||
-		    iter->iter_new < 10 ||
-		    iter->iter > 10) {
+		if (iter->iter_new > first_iter/2)
+			ctx->iter_stats->stop_reason = CPT_ITER_STOP_GROWTH;
+		else if (iter->iter_new < 10)
+			ctx->iter_stats->stop_reason = CPT_ITER_STOP_SMALL;
+		else if (iter->iter > 10)
+			ctx->iter_stats->stop_reason = CPT_ITER_STOP_PASSES;
+		else if (iter_rate_stalled(rate, prev_rate))
+			ctx->iter_stats->stop_reason = CPT_ITER_STOP_RATE;
+		if (ctx->iter_stats->stop_reason) {
 			current->state = TASK_UNINTERRUPTIBLE;
 			schedule_timeout(tmo/2);
 			iter->iter = -1;
@@ -690,6 +866,7 @@ int cpt_iteration(cpt_context_t *ctx)
 			cpt_walk_mm(iter_one_mm, iter, ctx);
 			if (ctx->iter_shm_start)
 				cpt_walk_shm(iter_one_shm, iter, ctx);
+			iter_account_pass(iter, ctx);
 			dprintk_ctx("%d: Found %d pages, shm %d, tmo %d\n",
 				    iter->iter, iter->iter_new,
 				    iter->iter_shm, tmo);
@@ -722,6 +899,7 @@ int cpt_iteration(cpt_context_t *ctx)
 		}
 		prev_iter = iter->iter_new;
 		prev_young = iter->iter_young;
+		prev_rate = rate;
 		first_iter /= 2;
 		iter->iter_new = iter->iter_young = iter->iter_shm = 0;
 	}
@@ -740,3 +918,111 @@ out:
 	kfree(iter);
 	return err;
 }
+
+/* Post-copy page server.
+ *
+ * With ctx->postcopy set, cpt_mm does not dump anonymous pages of private
+ * mappings, but sends their pfns as CPT_OBJ_ITERPAGES and pins the pages
+ * here. After the image is restored, destination fetches page contents
+ * with pgin_request's (index is pfn), we answer them in order with
+ * pgin_reply + page, or with pgin_reply with error set and no data, until
+ * PGIN_STOP comes.
+ */
+
+int cpt_postcopy_pin(struct page *pg, cpt_context_t *ctx)
+{
+	int err;
+
+	err = radix_tree_preload(GFP_KERNEL);
+	if (err)
+		return err;
+	err = radix_tree_insert(&ctx->postcopy_pages, page_to_pfn(pg), pg);
+	radix_tree_preload_end();
+	if (err == -EEXIST)
+		return 0;
+	if (!err)
+		get_page(pg);
+	return err;
+}
+
+void cpt_postcopy_release(cpt_context_t *ctx)
+{
+	struct page *pages[16];
+	unsigned long pfn = 0;
+	int i, nr;
+
+	while ((nr = radix_tree_gang_lookup(&ctx->postcopy_pages,
+					    (void **)pages, pfn, 16)) > 0) {
+		for (i = 0; i < nr; i++) {
+			pfn = page_to_pfn(pages[i]);
+			radix_tree_delete(&ctx->postcopy_pages, pfn);
+			put_page(pages[i]);
+		}
+		pfn++;
+		cond_resched();
+	}
+}
+
+static int submit_error(u64 pfn, int error, cpt_context_t *ctx)
+{
+	int err;
+	struct file *file = ctx->pagein_file_out;
+	mm_segment_t oldfs;
+	struct pgin_reply rep;
+
+	rep.rmid = PGIN_RMID;
+	rep.error = error;
+	rep.handle = pfn;
+
+	oldfs = get_fs(); set_fs(KERNEL_DS);
+	err = vfs_write(file, (void*)&rep, sizeof(rep), &file->f_pos);
+	set_fs(oldfs);
+	if (err < 0)
+		return err;
+	if (err != sizeof(rep))
+		return -EIO;
+	return 0;
+}
+
+int cpt_postcopy_serve(cpt_context_t *ctx)
+{
+	int err;
+	unsigned long served = 0, missed = 0;
+
+	if (ctx->pagein_file_in == NULL || ctx->pagein_file_out == NULL)
+		return -EBADF;
+
+	for (;;) {
+		struct pgin_request req;
+		struct page *pg;
+
+		err = nread(ctx->pagein_file_in, &req, sizeof(req));
+		if (err)
+			break;
+
+		if (req.rmid != PGIN_RMID) {
+			eprintk_ctx("pagein stream corrupt\n");
+			err = -EINVAL;
+			break;
+		}
+		if (req.size == PGIN_STOP)
+			break;
+
+		pg = radix_tree_lookup(&ctx->postcopy_pages, req.index);
+		if (pg) {
+			err = submit_page(pg, ctx);
+			served++;
+		} else {
+			eprintk_ctx("pagein request for unknown pfn %Lx\n",
+				    (unsigned long long)req.index);
+			err = submit_error(req.index, ENOENT, ctx);
+			missed++;
+		}
+		if (err)
+			break;
+	}
+
+	dprintk_ctx("post-copy: served %lu pages, %lu missed\n", served, missed);
+	cpt_postcopy_release(ctx);
+	return err;
+}
@@ -30,10 +30,16 @@
 #include <linux/shm.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/lzo.h>
+#include <linux/cpt_ioctl.h>
 
 #include <linux/cpt_obj.h>
 #include <linux/cpt_context.h>
 #include "cpt_mm.h"
+#include "cpt_files.h"
 #include "cpt_kernel.h"
 #include "cpt_fsmagic.h"
 #include "cpt_ubc.h"
@@ -117,6 +123,7 @@ static int collect_one_mm(struct mm_struct *mm, cpt_context_t * ctx)
 int cpt_collect_mm(cpt_context_t * ctx)
 {
 	cpt_object_t *obj;
+	struct task_struct *g, *p;
 	int err;
 	int index;
 
@@ -126,23 +133,32 @@ int cpt_collect_mm(cpt_context_t * ctx)
 			return -ENOMEM;
 	}
 
+	/*
+	 * One walk over the host for all the mms rather than one per mm,
+	 * both lookups are hashed.
+	 */
+	err = 0;
+	rcu_read_lock();
+	do_each_thread_all(g, p) {
+		if (!p->mm)
+			continue;
+		obj = lookup_cpt_object(CPT_OBJ_MM, p->mm, ctx);
+		if (obj && !lookup_cpt_object(CPT_OBJ_TASK, p, ctx)) {
+			eprintk_ctx("mm_struct is referenced outside %d by " CPT_FID "\n",
+					obj->o_count, CPT_TID(p));
+			err = -EAGAIN;
+			goto out_walk;
+		}
+	} while_each_thread_all(g, p);
+out_walk:
+	rcu_read_unlock();
+	if (err)
+		return err;
+
 	index = 1;
 	for_each_object(obj, CPT_OBJ_MM) {
 		struct mm_struct *mm = obj->o_obj;
-		struct task_struct *g, *p;
-		int mm_users = 0;
-
-		rcu_read_lock();
-		do_each_thread_all(g, p) {
-			if (p->mm == mm)
-				mm_users++;
-		} while_each_thread_all(g, p);
-		rcu_read_unlock();
-
-		if (obj->o_count != mm_users) {
-			eprintk_ctx("mm_struct is referenced outside %d %d\n", obj->o_count, mm_users);
-			return -EAGAIN;
-		}
+
 		cpt_obj_setindex(obj, index++, ctx);
 
 		if ((err = collect_one_mm(mm, ctx)) != 0)
@@ -285,6 +301,7 @@ enum {
 	PD_FUNKEY,
 	PD_ITER,
 	PD_ITERYOUNG,
+	PD_HUGE,
 };
 
 /* 0: page can be obtained from backstore, or still not mapped anonymous  page,
@@ -293,8 +310,50 @@ enum {
    2: page requres copy but its content is zero. Quite useless.
    3: wp page is shared after fork(). It is to be COWed when modified.
    4: page is something unsupported... We copy it right now.
+   7: page belongs to a transparent huge page, the whole pmd requires copy.
  */
 
+/*
+ * Transparent huge pages of a private mapping are dumped as they are,
+ * without splitting, so that restore can map them with huge pages again.
+ * A huge page shared with another mm after fork() is split: its 4k
+ * pages are found by where_is_anon_page() as usual. Iterative migration
+ * tracks writes per pte, so it still works on split pages.
+ *
+ * cpt_dump_thp: 0 - split huge pages, as kernels not knowing
+ * CPT_OBJ_HUGEPAGES expect.
+ */
+int cpt_dump_thp = 1;
+
+static int thp_get_desc(struct vm_area_struct *vma, pmd_t *pmd,
+			struct page_desc *pdesc, cpt_context_t *ctx)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	int ret = -EAGAIN;
+
+	/* Restore writes read-only non-accounted vmas page by page */
+	if (!cpt_dump_thp || is_packet_sock_vma(vma) ||
+	    !(vma->vm_flags & (VM_ACCOUNT | VM_WRITE)))
+		return ret;
+#ifdef CONFIG_PRAM
+	if (ctx->pram_stream)
+		return ret;
+#endif
+#ifdef CONFIG_VZ_CHECKPOINT_ITER
+	if (ctx->iter_done || ctx->postcopy)
+		return ret;
+#endif
+
+	spin_lock(&mm->page_table_lock);
+	if (pmd_trans_huge(*pmd) && !pmd_trans_splitting(*pmd) &&
+	    page_mapcount(pmd_page(*pmd)) == 1) {
+		pdesc->type = PD_HUGE;
+		ret = 0;
+	}
+	spin_unlock(&mm->page_table_lock);
+	return ret;
+}
+
 
 
 static void page_get_desc(cpt_object_t *mmobj,
@@ -329,8 +388,11 @@ static void page_get_desc(cpt_object_t *mmobj,
 	if (pmd_none(*pmd))
 		goto out_absent;
 #ifdef CONFIG_X86
-	if (pmd_trans_huge(*pmd))
+	if (pmd_trans_huge(*pmd)) {
+		if (thp_get_desc(vma, pmd, pdesc, ctx) == 0)
+			return;
 		split_huge_page_pmd(mm, pmd);
+	}
 #endif
 
 	if (unlikely(pmd_bad(*pmd)))
@@ -458,14 +520,32 @@ retry:
 		}
 	}
 #ifdef CONFIG_VZ_CHECKPOINT_ITER
+#ifdef __HAVE_ARCH_PTEP_TEST_AND_FOLD_DIRTY
+	/* Written after the last iteration */
+	if (ctx->iter_soft_dirty && pte_hwdirty(pte))
+		ClearPageCheckpointed(pg);
+#endif
 	if (ctx->iter_done && PageCheckpointed(pg)) {
-		if (pte_write(pte)) {
+		if (pte_write(pte) && !ctx->iter_soft_dirty) {
 			wprintk_ctx("writable PG_checkpointed page\n");
 		}
 		pdesc->index = page_to_pfn(pg);
 		pdesc->type = pte_young(pte) ? PD_ITERYOUNG : PD_ITER;
 		goto out_put;
 	}
+	/*
+	 * Post-copy: leave the page here and let destination fetch it
+	 * through the page server after resume. The page is pinned until
+	 * the server is stopped.
+	 */
+	if (ctx->postcopy && pg->mapping &&
+	    (vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE &&
+	    !is_vm_hugetlb_page(vma) &&
+	    cpt_postcopy_pin(pg, ctx) == 0) {
+		pdesc->index = page_to_pfn(pg);
+		pdesc->type = PD_ITER;
+		goto out_put;
+	}
 #endif
 	pdesc->type = PD_COPY;
 
@@ -540,6 +620,459 @@ void dump_pages(struct vm_area_struct *vma, struct page_area *pa,
 	return;
 }
 
+/*
+ * Parallel page dumper. Page contents of big PD_COPY areas are not written
+ * by the dumping thread: it reserves their place in the file and queues
+ * chunks of the area to worker threads, which write them at their offsets.
+ * The image is the same as with sequential dump. The dumping thread holds
+ * mmap_sem of the mm for writing until all chunks of the mm are written.
+ *
+ * cpt_dump_threads: 0 - one worker per online cpu, 1 - no workers.
+ */
+int cpt_dump_threads;
+
+#define CPT_DUMP_MIN_PAGES	16	/* smaller areas are written inline */
+#define CPT_DUMP_CHUNK_PAGES	256	/* pages per work item */
+
+struct cpt_dump_work {
+	struct list_head	list;
+	struct mm_struct	*mm;
+	unsigned long		start;
+	int			npages;
+	loff_t			pos;
+};
+
+struct cpt_page_dumper {
+	struct cpt_context	*ctx;
+	spinlock_t		lock;
+	struct list_head	queue;
+	int			pending;	/* queued and in progress */
+	int			error;
+	wait_queue_head_t	work_wait;
+	wait_queue_head_t	done_wait;
+	int			nr_threads;
+	struct task_struct	*threads[CPT_MAX_DUMP_THREADS];
+};
+
+static int cpt_dump_work_pages(struct cpt_dump_work *w, struct page **pages,
+			       struct cpt_context *ctx)
+{
+	struct file *file = ctx->file;
+	unsigned long start = w->start;
+	loff_t pos = w->pos;
+	int count = 0;
+	int err = 0;
+
+	while (count < w->npages && !err) {
+		mm_segment_t oldfs;
+		int copy = w->npages - count;
+		int i, n;
+
+		if (copy > MAX_PAGE_BATCH)
+			copy = MAX_PAGE_BATCH;
+		n = get_user_pages(current, w->mm, start, copy,
+				   0, 1, pages, NULL);
+		if (n != copy) {
+			eprintk_ctx("get_user_pages fault\n");
+			err = -EFAULT;
+		}
+
+		oldfs = get_fs(); set_fs(KERNEL_DS);
+		for (i = 0; i < n && !err; i++) {
+			char *maddr = kmap(pages[i]);
+			ssize_t ret;
+
+			ret = file->f_op->write(file, maddr, PAGE_SIZE, &pos);
+			if (ret != PAGE_SIZE)
+				err = ret < 0 ? ret : -EIO;
+			kunmap(pages[i]);
+		}
+		set_fs(oldfs);
+
+		for ( ; n > 0; n--)
+			page_cache_release(pages[n-1]);
+		start += copy*PAGE_SIZE;
+		count += copy;
+	}
+	return err;
+}
+
+static int cpt_dump_worker(void *data)
+{
+	struct cpt_page_dumper *d = data;
+	struct page *pages[MAX_PAGE_BATCH];
+
+	for (;;) {
+		struct cpt_dump_work *w = NULL;
+		int err;
+
+		wait_event_interruptible(d->work_wait,
+				!list_empty(&d->queue) || kthread_should_stop());
+
+		spin_lock(&d->lock);
+		if (!list_empty(&d->queue)) {
+			w = list_first_entry(&d->queue,
+					     struct cpt_dump_work, list);
+			list_del(&w->list);
+		}
+		spin_unlock(&d->lock);
+
+		if (!w) {
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+
+		err = cpt_dump_work_pages(w, pages, d->ctx);
+		kfree(w);
+
+		spin_lock(&d->lock);
+		if (err && !d->error)
+			d->error = err;
+		if (!--d->pending)
+			wake_up(&d->done_wait);
+		spin_unlock(&d->lock);
+	}
+	return 0;
+}
+
+/* Returns 1 if page contents of @pa are handed to the workers */
+static int cpt_queue_pages(struct vm_area_struct *vma, struct page_area *pa,
+			   struct cpt_context *ctx)
+{
+	struct cpt_page_dumper *d = ctx->page_dumper;
+	int npages = (pa->end - pa->start) / PAGE_SIZE;
+	unsigned long start = pa->start;
+	loff_t pos;
+
+	if (!d || npages < CPT_DUMP_MIN_PAGES)
+		return 0;
+
+	/* write_error is set, nothing more will be written */
+	if (cpt_reserve_space(npages*PAGE_SIZE, &pos, ctx))
+		return 1;
+
+	while (npages) {
+		struct cpt_dump_work *w, tmp;
+		int err;
+
+		w = kmalloc(sizeof(*w), GFP_KERNEL);
+		if (!w)
+			w = &tmp;
+
+		w->mm = vma->vm_mm;
+		w->start = start;
+		w->npages = min(npages, CPT_DUMP_CHUNK_PAGES);
+		w->pos = pos;
+
+		start += w->npages*PAGE_SIZE;
+		pos += w->npages*PAGE_SIZE;
+		npages -= w->npages;
+
+		if (w == &tmp) {
+			err = cpt_dump_work_pages(w, pa->pages, ctx);
+			if (err && !ctx->write_error)
+				ctx->write_error = err;
+			continue;
+		}
+
+		spin_lock(&d->lock);
+		list_add_tail(&w->list, &d->queue);
+		d->pending++;
+		spin_unlock(&d->lock);
+		wake_up(&d->work_wait);
+	}
+	return 1;
+}
+
+/* Wait until the workers write everything queued so far */
+static int cpt_wait_pages(struct cpt_context *ctx)
+{
+	struct cpt_page_dumper *d = ctx->page_dumper;
+	int err;
+
+	if (!d)
+		return 0;
+
+	wait_event(d->done_wait, !d->pending);
+
+	spin_lock(&d->lock);
+	err = d->error;
+	d->error = 0;
+	spin_unlock(&d->lock);
+
+	if (err && !ctx->write_error)
+		ctx->write_error = err;
+	return err;
+}
+
+static void cpt_start_dumper(struct cpt_context *ctx)
+{
+	struct cpt_page_dumper *d;
+	int i, nr;
+
+	nr = cpt_dump_threads ? : num_online_cpus();
+	if (nr > CPT_MAX_DUMP_THREADS)
+		nr = CPT_MAX_DUMP_THREADS;
+	if (nr <= 1 || !ctx->file)
+		return;
+
+	d = kzalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return;
+
+	d->ctx = ctx;
+	spin_lock_init(&d->lock);
+	INIT_LIST_HEAD(&d->queue);
+	init_waitqueue_head(&d->work_wait);
+	init_waitqueue_head(&d->done_wait);
+
+	for (i = 0; i < nr; i++) {
+		struct task_struct *tsk;
+
+		tsk = kthread_run(cpt_dump_worker, d, "cpt_dump/%d", i);
+		if (IS_ERR(tsk))
+			break;
+		d->threads[d->nr_threads++] = tsk;
+	}
+
+	if (!d->nr_threads) {
+		kfree(d);
+		return;
+	}
+
+	ctx->page_dumper = d;
+}
+
+static void cpt_stop_dumper(struct cpt_context *ctx)
+{
+	struct cpt_page_dumper *d = ctx->page_dumper;
+	int i;
+
+	if (!d)
+		return;
+
+	cpt_wait_pages(ctx);
+	for (i = 0; i < d->nr_threads; i++)
+		kthread_stop(d->threads[i]);
+
+	ctx->page_dumper = NULL;
+	kfree(d);
+}
+
+/*
+ * Packed page contents (CPT_CONTENT_PACKED), enabled by CPT_SET_PACK.
+ * Every page is written as struct cpt_packed_page followed by its data:
+ * nothing for a zero page, a reference to an earlier record for a page
+ * identical to one already dumped, lzo1x-compressed or raw data otherwise.
+ * Dedup relies on VE being frozen: pages remembered in the hash table
+ * are pinned and do not change until the dump is over, so a hash hit is
+ * confirmed by comparing contents.
+ */
+#define CPT_PACK_HASH_BITS	16
+
+struct cpt_pack_slot {
+	u32		hash;
+	struct page	*page;
+	loff_t		pos;
+};
+
+struct cpt_packer {
+	struct cpt_pack_slot	*hash;
+	void			*wrkmem;
+	unsigned char		*buf;
+	unsigned long		nr_zero, nr_dup, nr_lzo, nr_raw;
+	u64			bytes;
+};
+
+static void cpt_start_packer(struct cpt_context *ctx)
+{
+	struct cpt_packer *p;
+
+	if (!ctx->pack_flags || !ctx->file)
+		return;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		goto fail;
+	if (ctx->pack_flags & CPT_PACK_DEDUP) {
+		p->hash = vmalloc(sizeof(struct cpt_pack_slot) <<
+				  CPT_PACK_HASH_BITS);
+		if (!p->hash)
+			goto fail;
+		memset(p->hash, 0, sizeof(struct cpt_pack_slot) <<
+		       CPT_PACK_HASH_BITS);
+	}
+	if (ctx->pack_flags & CPT_PACK_LZO) {
+		p->wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		p->buf = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+		if (!p->wrkmem || !p->buf)
+			goto fail;
+	}
+	ctx->packer = p;
+	return;
+
+fail:
+	if (p) {
+		vfree(p->hash);
+		vfree(p->wrkmem);
+		kfree(p->buf);
+		kfree(p);
+	}
+	eprintk_ctx("no memory to pack pages, dumping them raw\n");
+}
+
+static void cpt_stop_packer(struct cpt_context *ctx)
+{
+	struct cpt_packer *p = ctx->packer;
+	int i;
+
+	if (!p)
+		return;
+
+	dprintk_ctx("packed pages: %lu zero, %lu dup, %lu lzo, %lu raw, "
+		    "%Lu bytes\n", p->nr_zero, p->nr_dup, p->nr_lzo,
+		    p->nr_raw, (unsigned long long)p->bytes);
+
+	if (p->hash) {
+		for (i = 0; i < (1 << CPT_PACK_HASH_BITS); i++)
+			if (p->hash[i].page)
+				put_page(p->hash[i].page);
+		vfree(p->hash);
+	}
+	vfree(p->wrkmem);
+	kfree(p->buf);
+	kfree(p);
+	ctx->packer = NULL;
+}
+
+static struct cpt_pack_slot *cpt_pack_lookup(struct cpt_packer *p,
+					     struct page *page, void *maddr,
+					     u32 *hash)
+{
+	struct cpt_pack_slot *slot;
+	int found = 0;
+
+	*hash = jhash2(maddr, PAGE_SIZE / sizeof(u32), 0);
+	slot = &p->hash[*hash & ((1 << CPT_PACK_HASH_BITS) - 1)];
+
+	if (slot->page && slot->hash == *hash) {
+		void *old = kmap(slot->page);
+
+		found = slot->page == page || !memcmp(old, maddr, PAGE_SIZE);
+		kunmap(slot->page);
+	}
+	return found ? slot : NULL;
+}
+
+static void dump_packed_page(struct page *page, struct cpt_context *ctx)
+{
+	struct cpt_packer *p = ctx->packer;
+	struct cpt_packed_page pp;
+	struct cpt_pack_slot *slot;
+	void *maddr, *data;
+	u32 hash = 0;
+	loff_t pos = ctx->file->f_pos;
+
+	pp.__cpt_pad1 = 0;
+	pp.cpt_ref = 0;
+	pp.cpt_len = 0;
+
+	if ((ctx->pack_flags & CPT_PACK_ZERO) && cpt_page_is_zero(page)) {
+		pp.cpt_type = CPT_PACKED_ZERO;
+		ctx->write(&pp, sizeof(pp), ctx);
+		p->bytes += sizeof(pp);
+		p->nr_zero++;
+		return;
+	}
+
+	maddr = kmap(page);
+
+	if (p->hash && (slot = cpt_pack_lookup(p, page, maddr, &hash))) {
+		pp.cpt_type = CPT_PACKED_DUP;
+		pp.cpt_ref = slot->pos;
+		ctx->write(&pp, sizeof(pp), ctx);
+		kunmap(page);
+		p->bytes += sizeof(pp);
+		p->nr_dup++;
+		return;
+	}
+
+	pp.cpt_type = CPT_PACKED_RAW;
+	pp.cpt_len = PAGE_SIZE;
+	data = maddr;
+	if (p->wrkmem) {
+		size_t len;
+
+		if (lzo1x_1_compress(maddr, PAGE_SIZE, p->buf, &len,
+				     p->wrkmem) == LZO_E_OK &&
+		    len < PAGE_SIZE) {
+			pp.cpt_type = CPT_PACKED_LZO;
+			pp.cpt_len = len;
+			data = p->buf;
+		}
+	}
+	ctx->write(&pp, sizeof(pp), ctx);
+	ctx->write(data, pp.cpt_len, ctx);
+	kunmap(page);
+
+	p->bytes += sizeof(pp) + pp.cpt_len;
+	if (pp.cpt_type == CPT_PACKED_LZO)
+		p->nr_lzo++;
+	else
+		p->nr_raw++;
+
+	if (p->hash) {
+		slot = &p->hash[hash & ((1 << CPT_PACK_HASH_BITS) - 1)];
+		if (slot->page)
+			put_page(slot->page);
+		get_page(page);
+		slot->page = page;
+		slot->hash = hash;
+		slot->pos = pos;
+	}
+}
+
+static void dump_packed_pages(struct vm_area_struct *vma, struct page_area *pa,
+			      struct cpt_context *ctx)
+{
+	unsigned long start = pa->start;
+	int npages = (pa->end - pa->start) / PAGE_SIZE;
+	int count = 0;
+
+	while (count < npages) {
+		int copy = npages - count;
+		int i, n;
+
+		if (copy > MAX_PAGE_BATCH)
+			copy = MAX_PAGE_BATCH;
+		n = get_user_pages(current, vma->vm_mm, start, copy,
+				   0, 1, pa->pages, NULL);
+		if (n != copy) {
+			eprintk_ctx("get_user_pages fault\n");
+			for ( ; n > 0; n--)
+				page_cache_release(pa->pages[n-1]);
+			/* the image would miss the rest of the area */
+			if (!ctx->write_error)
+				ctx->write_error = -EFAULT;
+			return;
+		}
+		for (i = 0; i < n; i++)
+			dump_packed_page(pa->pages[i], ctx);
+		start += n*PAGE_SIZE;
+		count += n;
+		for ( ; n > 0; n--)
+			page_cache_release(pa->pages[n-1]);
+	}
+}
+
+/* Restore writes such vmas page by page through get_user_pages(), raw */
+static int can_pack_pages(struct vm_area_struct *vma, struct cpt_context *ctx)
+{
+	return ctx->packer && !is_packet_sock_vma(vma) &&
+		(vma->vm_flags & (VM_ACCOUNT | VM_WRITE));
+}
+
 int dump_page_block(struct vm_area_struct *vma, struct page_area *pa,
 		    struct cpt_context *ctx)
 {
@@ -548,23 +1081,28 @@ int dump_page_block(struct vm_area_struct *vma, struct page_area *pa,
 
 	cpt_push_object(&saved_object, ctx);
 
-	pgb.cpt_object = CPT_OBJ_PAGES;
+	pgb.cpt_object = (pa->type == PD_HUGE) ?
+			CPT_OBJ_HUGEPAGES : CPT_OBJ_PAGES;
 	pgb.cpt_hdrlen = sizeof(pgb);
-	pgb.cpt_content = (pa->type == PD_COPY) ?
+	pgb.cpt_content = (pa->type == PD_COPY || pa->type == PD_HUGE) ?
 			CPT_CONTENT_DATA : CPT_CONTENT_VOID;
 #ifdef CONFIG_PRAM
 	if (pa->type == PD_COPY && ctx->pram_stream &&
 	    !is_packet_sock_vma(vma))
 		pgb.cpt_content = CPT_CONTENT_PRAM;
 #endif
+	if (pgb.cpt_content == CPT_CONTENT_DATA && can_pack_pages(vma, ctx))
+		pgb.cpt_content = CPT_CONTENT_PACKED;
 	pgb.cpt_start = pa->start;
 	pgb.cpt_end = pa->end;
 
 	ctx->write(&pgb, sizeof(pgb), ctx);
-	if (pa->type == PD_COPY) {
+	if (pa->type == PD_COPY || pa->type == PD_HUGE) {
 		if (pgb.cpt_content == CPT_CONTENT_PRAM)
 			cpt_dump_pram(vma, pa->start, pa->end, ctx);
-		else
+		else if (pgb.cpt_content == CPT_CONTENT_PACKED)
+			dump_packed_pages(vma, pa, ctx);
+		else if (!cpt_queue_pages(vma, pa, ctx))
 			dump_pages(vma, pa, ctx);
 	}
 	cpt_close_object(ctx);
@@ -777,6 +1315,7 @@ static int dump_one_vma(cpt_object_t *mmobj,
 
 		if (!can_expand(pa, &pd)) {
 			if (pa->type == PD_COPY ||
+			    pa->type == PD_HUGE ||
 			    pa->type == PD_ZERO) {
 				dump_page_block(vma, pa, ctx);
 			} else if (pa->type == PD_CLONE) {
@@ -801,6 +1340,7 @@ static int dump_one_vma(cpt_object_t *mmobj,
 
 	if (pa->end > pa->start) {
 		if (pa->type == PD_COPY ||
+		    pa->type == PD_HUGE ||
 		    pa->type == PD_ZERO) {
 			dump_page_block(vma, pa, ctx);
 		} else if (pa->type == PD_CLONE) {
@@ -983,6 +1523,10 @@ static int dump_one_mm(cpt_object_t *obj, struct cpt_context *ctx)
 			goto out;
 	}
 
+	/* Pages must be written before mmap_sem is released */
+	if ((err = cpt_wait_pages(ctx)) != 0)
+		goto out;
+
 	hlist_for_each_entry(aio_ctx, n, &mm->ioctx_list, list) {
 		if ((err = dump_one_aio_ctx(mm, aio_ctx, ctx)) != 0)
 			goto out;
@@ -997,6 +1541,7 @@ static int dump_one_mm(cpt_object_t *obj, struct cpt_context *ctx)
 	return 0;
 
 out:
+	cpt_wait_pages(ctx);
 	up_write(&mm->mmap_sem);
 
 	return err;
@@ -1009,14 +1554,21 @@ int cpt_dump_vm(struct cpt_context *ctx)
 	scnt = scnt0 = zcnt = 0;
 
 	cpt_open_section(ctx, CPT_SECT_MM);
+	cpt_start_packer(ctx);
+	cpt_start_dumper(ctx);
 
 	for_each_object(obj, CPT_OBJ_MM) {
 		int err;
 
-		if ((err = dump_one_mm(obj, ctx)) != 0)
+		if ((err = dump_one_mm(obj, ctx)) != 0) {
+			cpt_stop_dumper(ctx);
+			cpt_stop_packer(ctx);
 			return err;
+		}
 	}
 
+	cpt_stop_dumper(ctx);
+	cpt_stop_packer(ctx);
 	cpt_close_section(ctx);
 
 	if (scnt)
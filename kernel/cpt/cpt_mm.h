@@ -2,14 +2,27 @@ int cpt_collect_mm(cpt_context_t *);
 
 int cpt_dump_vm(struct cpt_context *ctx);
 
+#define CPT_MAX_DUMP_THREADS	16
+extern int cpt_dump_threads;
+extern int cpt_dump_thp;
+
 __u32 rst_mm_flag(struct cpt_task_image *ti, struct cpt_context *ctx);
 int rst_mm_basic(cpt_object_t *obj, struct cpt_task_image *ti, struct cpt_context *ctx);
 int rst_mm_complete(struct cpt_task_image *ti, struct cpt_context *ctx);
+int rst_mm_pending(loff_t pos, struct cpt_context *ctx);
 int set_mlock_creds(int cap);
 
 int cpt_iteration(cpt_context_t *ctx);
+extern int cpt_iter_converge;
+extern int cpt_iter_soft_dirty;
+int cpt_postcopy_pin(struct page *pg, cpt_context_t *ctx);
+int cpt_postcopy_serve(cpt_context_t *ctx);
+void cpt_postcopy_release(cpt_context_t *ctx);
 int rst_iteration(cpt_context_t *ctx);
 void rst_drop_iter_rbtree(cpt_context_t *ctx);
+void rst_pager_seal(cpt_context_t *ctx, int abort);
+int rst_pagein_init(void);
+void rst_pagein_exit(void);
 int rst_iter(struct vm_area_struct *vma, u64 pfn,
 	     unsigned long addr, cpt_context_t * ctx);
 int rst_iter_chunk(struct file *file, loff_t pos, struct cpt_page_block * pgb,
@@ -18,6 +18,7 @@
 #include <linux/file.h>
 #include <linux/mm.h>
 #include <linux/errno.h>
+#include <linux/hash.h>
 
 #include <linux/cpt_obj.h>
 #include <linux/cpt_context.h>
@@ -29,7 +30,9 @@ cpt_object_t *alloc_cpt_object(int gfp, struct cpt_context *ctx)
 	obj = kmalloc(sizeof(cpt_object_t), gfp);
 	if (obj) {
 		INIT_LIST_HEAD(&obj->o_list);
-		INIT_LIST_HEAD(&obj->o_hash);
+		INIT_HLIST_NODE(&obj->o_hash);
+		INIT_HLIST_NODE(&obj->o_pos_hash);
+		obj->o_type = CPT_OBJ_MAX;
 		obj->o_count = 1;
 		obj->o_pos = CPT_NULL;
 		obj->o_lock = 0;
@@ -45,19 +48,70 @@ cpt_object_t *alloc_cpt_object(int gfp, struct cpt_context *ctx)
 
 void free_cpt_object(cpt_object_t *obj, cpt_context_t *ctx)
 {
+	cpt_obj_unhash(obj);
 	kfree(obj);
 	ctx->objcount--;
 }
 
+/*
+ * Lookups by o_obj and by o_pos are done for every reference to an
+ * object, so with linear search collecting and restoring of a CT with
+ * many files and sockets is quadratic. Objects are hashed by (type, key)
+ * as soon as both are known, i.e. when interned and on setobj/setpos.
+ * Without hash tables (allocation failed) lookups fall back to the lists.
+ */
+static inline struct hlist_head *cpt_obj_bucket(struct hlist_head *table,
+		int type, unsigned long key)
+{
+	return &table[hash_long(key ^ type, CPT_OBJHASH_HBITS)];
+}
+
+/* To the tail, so that the oldest one is found as with the lists */
+static void cpt_obj_bucket_add(struct hlist_node *n, struct hlist_head *head)
+{
+	struct hlist_node *last;
+
+	if (hlist_empty(head)) {
+		hlist_add_head(n, head);
+		return;
+	}
+	for (last = head->first; last->next; last = last->next)
+		;
+	hlist_add_after(last, n);
+}
+
+void cpt_obj_hash(cpt_object_t *obj, cpt_context_t *ctx)
+{
+	hlist_del_init(&obj->o_hash);
+	if (ctx->objhash && obj->o_type != CPT_OBJ_MAX && obj->o_obj)
+		cpt_obj_bucket_add(&obj->o_hash, cpt_obj_bucket(ctx->objhash,
+				obj->o_type, (unsigned long)obj->o_obj));
+}
+
+void cpt_obj_hash_pos(cpt_object_t *obj, cpt_context_t *ctx)
+{
+	hlist_del_init(&obj->o_pos_hash);
+	if (ctx->objhash_pos && obj->o_type != CPT_OBJ_MAX &&
+	    obj->o_pos != CPT_NULL)
+		cpt_obj_bucket_add(&obj->o_pos_hash, cpt_obj_bucket(ctx->objhash_pos,
+				obj->o_type, (unsigned long)obj->o_pos));
+}
+
 void intern_cpt_object(enum _cpt_object_type type, cpt_object_t *obj, cpt_context_t *ctx)
 {
 	list_add_tail(&obj->o_list, &ctx->object_array[type]);
+	obj->o_type = type;
+	cpt_obj_hash(obj, ctx);
+	cpt_obj_hash_pos(obj, ctx);
 }
 
 void insert_cpt_object(enum _cpt_object_type type, cpt_object_t *obj,
 			cpt_object_t *head, cpt_context_t *ctx)
 {
 	list_add(&obj->o_list, &head->o_list);
+	obj->o_type = type;
+	cpt_obj_hash(obj, ctx);
+	cpt_obj_hash_pos(obj, ctx);
 }
 
 cpt_object_t * __cpt_object_add(enum _cpt_object_type type, void *p,
@@ -98,6 +152,26 @@ cpt_object_t * cpt_object_get(enum _cpt_object_type type, void *p, cpt_context_t
 	return obj;
 }
 
+static struct hlist_head *cpt_alloc_objhash(void)
+{
+	struct hlist_head *table;
+	int h;
+
+	table = (void *)__get_free_pages(GFP_KERNEL, CPT_OBJHASH_ORDER);
+	if (table)
+		for (h = 0; h < CPT_OBJHASH_HSIZE; h++)
+			INIT_HLIST_HEAD(&table[h]);
+	return table;
+}
+
+void cpt_object_release_hash(cpt_context_t *ctx)
+{
+	free_pages((unsigned long)ctx->objhash, CPT_OBJHASH_ORDER);
+	free_pages((unsigned long)ctx->objhash_pos, CPT_OBJHASH_ORDER);
+	ctx->objhash = NULL;
+	ctx->objhash_pos = NULL;
+}
+
 int cpt_object_init(cpt_context_t *ctx)
 {
 	int i;
@@ -105,6 +179,13 @@ int cpt_object_init(cpt_context_t *ctx)
 	for (i=0; i<CPT_OBJ_MAX; i++) {
 		INIT_LIST_HEAD(&ctx->object_array[i]);
 	}
+
+	/* Objects of a previous run, if any, are forgotten with the lists */
+	cpt_object_release_hash(ctx);
+	ctx->objhash = cpt_alloc_objhash();
+	ctx->objhash_pos = cpt_alloc_objhash();
+	if (!ctx->objhash || !ctx->objhash_pos)
+		cpt_object_release_hash(ctx);
 	return 0;
 }
 
@@ -122,6 +203,7 @@ int cpt_object_destroy(cpt_context_t *ctx)
 			free_cpt_object(obj, ctx);
 		}
 	}
+	cpt_object_release_hash(ctx);
 	if (ctx->objcount != 0)
 		eprintk_ctx("BUG: ctx->objcount=%d\n", ctx->objcount);
 	return 0;
@@ -130,6 +212,16 @@ int cpt_object_destroy(cpt_context_t *ctx)
 cpt_object_t *lookup_cpt_object(enum _cpt_object_type type, void *p, struct cpt_context *ctx)
 {
 	cpt_object_t *obj;
+	struct hlist_node *n;
+
+	if (ctx->objhash && p) {
+		hlist_for_each_entry(obj, n, cpt_obj_bucket(ctx->objhash,
+				type, (unsigned long)p), o_hash) {
+			if (obj->o_obj == p && obj->o_type == type)
+				return obj;
+		}
+		return NULL;
+	}
 
 	for_each_object(obj, type) {
 		if (obj->o_obj == p)
@@ -141,6 +233,16 @@ cpt_object_t *lookup_cpt_object(enum _cpt_object_type type, void *p, struct cpt_
 cpt_object_t *lookup_cpt_obj_bypos(enum _cpt_object_type type, loff_t pos, struct cpt_context *ctx)
 {
 	cpt_object_t *obj;
+	struct hlist_node *n;
+
+	if (ctx->objhash_pos && pos != CPT_NULL) {
+		hlist_for_each_entry(obj, n, cpt_obj_bucket(ctx->objhash_pos,
+				type, (unsigned long)pos), o_pos_hash) {
+			if (obj->o_pos == pos && obj->o_type == type)
+				return obj;
+		}
+		return NULL;
+	}
 
 	for_each_object(obj, type) {
 		if (obj->o_pos == pos)
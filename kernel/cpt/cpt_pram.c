@@ -0,0 +1,437 @@
+/*
+ *
+ *  kernel/cpt/cpt_pram.c
+ *
+ *  Copyright (C) 2000-2005  SWsoft
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * Memory of a suspended container saved to pram instead of the image file,
+ * so that it survives a kexec and is restored with no disk I/O.
+ *
+ * Contents of CPT_CONTENT_PRAM page blocks go to two pram streams named
+ * after the container: "cpt.<veid>.meta" holds a struct cpt_pram_block per
+ * page block, "cpt.<veid>.pages" holds copies of the pages, one pram page
+ * per page of the block. Restore pops all the pages at once and installs
+ * them into page tables of the new mm as the page blocks are met in the
+ * image, looking them up by image position.
+ */
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/pram.h>
+#include <asm/uaccess.h>
+#include <linux/cpt_image.h>
+
+#include <linux/cpt_obj.h>
+#include <linux/cpt_context.h>
+
+MODULE_LICENSE("GPL");
+
+#define CPT_PRAM_NAME_MAX	32
+#define CPT_PRAM_BATCH		16
+
+struct cpt_pram_block {
+	__u64	pos;		/* of page block contents in the image */
+	__u64	start;
+	__u64	end;
+	__u64	index;		/* of the first page in the pages stream */
+};
+
+struct cpt_pram {
+	/* ctx->pram_stream points here */
+	struct pram_stream	pages_stream;
+	struct pram_stream	meta_stream;
+
+	/* dump: number of pages written */
+	unsigned long		nr_pages;
+
+	/* restore: blocks sorted by pos, pages indexed by block->index */
+	struct cpt_pram_block	*blocks;
+	unsigned long		nr_blocks;
+	struct page		**pages;
+};
+
+static inline struct cpt_pram *cpt_pram(cpt_context_t *ctx)
+{
+	return container_of(ctx->pram_stream, struct cpt_pram, pages_stream);
+}
+
+static void cpt_pram_names(cpt_context_t *ctx, char *meta, char *pages)
+{
+	snprintf(meta, CPT_PRAM_NAME_MAX, "cpt.%u.meta", ctx->ve_id);
+	snprintf(pages, CPT_PRAM_NAME_MAX, "cpt.%u.pages", ctx->ve_id);
+}
+
+static int cpt_pram_open(cpt_context_t *ctx)
+{
+	char meta[CPT_PRAM_NAME_MAX], pages[CPT_PRAM_NAME_MAX];
+	struct cpt_pram *p;
+	int err;
+
+	if (ctx->pram_stream)
+		return -EBUSY;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	/* an image left from a previous dump is obsolete */
+	cpt_pram_names(ctx, meta, pages);
+	pram_destroy(meta);
+	pram_destroy(pages);
+
+	err = pram_open(meta, PRAM_WRITE, &p->meta_stream);
+	if (err)
+		goto out_free;
+	err = pram_open(pages, PRAM_WRITE, &p->pages_stream);
+	if (err)
+		goto out_close_meta;
+
+	__module_get(THIS_MODULE);
+	ctx->pram_stream = &p->pages_stream;
+	return 0;
+
+out_close_meta:
+	pram_close(&p->meta_stream, -1);
+out_free:
+	kfree(p);
+	return err;
+}
+
+/*
+ * The page is copied rather than pushed: a page still mapped and on lru
+ * cannot be handed over to pram, and the copy is the same page restore
+ * installs into the new mm.
+ */
+static int cpt_pram_push_copy(struct cpt_pram *p, struct page *page)
+{
+	struct page *new;
+	unsigned long pfn;
+	int err;
+
+	new = alloc_page(GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+	copy_highpage(new, page);
+
+	err = pram_push_page(&p->pages_stream, new, &pfn);
+	if (!err && pfn == page_to_pfn(new))
+		/* not on lru and not accounted, i.e. clean for
+		 * install_anon_page() (see __pram_del_page) */
+		SetPageReserved(new);
+	put_page(new);
+	if (!err)
+		p->nr_pages++;
+	return err;
+}
+
+static int cpt_pram_dump(struct vm_area_struct *vma,
+			 unsigned long start, unsigned long end,
+			 struct cpt_context *ctx)
+{
+	struct cpt_pram *p = cpt_pram(ctx);
+	struct page *pages[CPT_PRAM_BATCH];
+	struct cpt_pram_block b;
+	unsigned long addr;
+	int i, n, err = 0;
+
+	b.pos = ctx->current_object + sizeof(struct cpt_page_block);
+	b.start = start;
+	b.end = end;
+	b.index = p->nr_pages;
+	if (pram_write(&p->meta_stream, &b, sizeof(b)) != sizeof(b)) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (addr = start; addr < end && !err; addr += n * PAGE_SIZE) {
+		n = min_t(unsigned long, (end - addr) / PAGE_SIZE,
+			  CPT_PRAM_BATCH);
+		n = get_user_pages(current, vma->vm_mm, addr, n,
+				   0, 1, pages, NULL);
+		if (n <= 0) {
+			err = n ? : -EFAULT;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (!err)
+				err = cpt_pram_push_copy(p, pages[i]);
+			page_cache_release(pages[i]);
+		}
+		cond_resched();
+	}
+out:
+	/* the image is useless without these pages */
+	if (err && !ctx->write_error)
+		ctx->write_error = err;
+	return err;
+}
+
+static void cpt_pram_close(cpt_context_t *ctx, int err)
+{
+	struct cpt_pram *p;
+
+	if (!ctx->pram_stream)
+		return;
+
+	p = cpt_pram(ctx);
+	ctx->pram_stream = NULL;
+
+	pram_close(&p->meta_stream, err);
+	pram_close(&p->pages_stream, err);
+	if (!err)
+		dprintk_ctx("saved %lu pages to pram\n", p->nr_pages);
+	kfree(p);
+	module_put(THIS_MODULE);
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+	const struct cpt_pram_block *x = a, *y = b;
+
+	if (x->pos < y->pos)
+		return -1;
+	return x->pos > y->pos;
+}
+
+static int rst_pram_load_blocks(struct cpt_pram *p)
+{
+	unsigned long size = 0;
+	struct cpt_pram_block b, *blocks;
+	ssize_t ret;
+
+	while ((ret = pram_read(&p->meta_stream, &b, sizeof(b))) == sizeof(b)) {
+		if (p->nr_blocks == size) {
+			size = size ? size * 2 : PAGE_SIZE / sizeof(b);
+			blocks = vmalloc(size * sizeof(b));
+			if (!blocks)
+				return -ENOMEM;
+			if (p->blocks) {
+				memcpy(blocks, p->blocks,
+				       p->nr_blocks * sizeof(b));
+				vfree(p->blocks);
+			}
+			p->blocks = blocks;
+		}
+		if (b.end < b.start || (b.end - b.start) & ~PAGE_MASK)
+			return -EINVAL;
+		p->blocks[p->nr_blocks++] = b;
+		p->nr_pages = max_t(unsigned long, p->nr_pages,
+				    b.index + (b.end - b.start) / PAGE_SIZE);
+	}
+	if (ret)
+		return ret < 0 ? ret : -EINVAL;
+
+	sort(p->blocks, p->nr_blocks, sizeof(b), cmp_block, NULL);
+	return 0;
+}
+
+static int rst_pram_load_pages(struct cpt_pram *p)
+{
+	struct page *page;
+	unsigned long i;
+
+	if (!p->nr_pages)
+		return 0;
+
+	p->pages = vmalloc(p->nr_pages * sizeof(struct page *));
+	if (!p->pages)
+		return -ENOMEM;
+
+	for (i = 0; i < p->nr_pages; i++) {
+		page = pram_pop_page(&p->pages_stream);
+		if (IS_ERR(page)) {
+			/* restore fails only if the block is needed */
+			page = NULL;
+		} else if (!page)
+			break;
+		p->pages[i] = page;
+		if (!(i % 1024))
+			cond_resched();
+	}
+	for (; i < p->nr_pages; i++)
+		p->pages[i] = NULL;
+	return 0;
+}
+
+static void rst_pram_free(struct cpt_pram *p)
+{
+	unsigned long i;
+
+	if (p->pages) {
+		for (i = 0; i < p->nr_pages; i++)
+			if (p->pages[i])
+				put_page(p->pages[i]);
+		vfree(p->pages);
+	}
+	vfree(p->blocks);
+	pram_close(&p->pages_stream, 0);
+	pram_close(&p->meta_stream, 0);
+	kfree(p);
+}
+
+static int rst_pram_open(cpt_context_t *ctx)
+{
+	char meta[CPT_PRAM_NAME_MAX], pages[CPT_PRAM_NAME_MAX];
+	struct cpt_pram *p;
+	int err;
+
+	if (ctx->pram_stream)
+		return 0;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	cpt_pram_names(ctx, meta, pages);
+	err = pram_open(meta, PRAM_READ, &p->meta_stream);
+	if (err) {
+		kfree(p);
+		/* the image has no pram page blocks then */
+		return err == -ENOENT ? 0 : err;
+	}
+	err = pram_open(pages, PRAM_READ, &p->pages_stream);
+	if (err) {
+		pram_close(&p->meta_stream, 0);
+		kfree(p);
+		return err;
+	}
+
+	err = rst_pram_load_blocks(p);
+	if (!err)
+		err = rst_pram_load_pages(p);
+	if (err) {
+		rst_pram_free(p);
+		return err;
+	}
+
+	__module_get(THIS_MODULE);
+	ctx->pram_stream = &p->pages_stream;
+	dprintk_ctx("loaded %lu pages from pram\n", p->nr_pages);
+	return 0;
+}
+
+static struct cpt_pram_block *rst_pram_find_block(struct cpt_pram *p,
+						  loff_t pos)
+{
+	unsigned long lo = 0, hi = p->nr_blocks, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p->blocks[mid].pos == pos)
+			return &p->blocks[mid];
+		if (p->blocks[mid].pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static int rst_pram_install(struct mm_struct *mm, unsigned long addr,
+			    struct page *page)
+{
+	struct vm_area_struct *vma;
+	int err = -EBUSY;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, addr);
+	if (vma && vma->vm_start <= addr &&
+	    !vma->vm_file && !(vma->vm_flags & VM_SHARED))
+		err = install_anon_page(mm, vma, addr, page);
+	up_read(&mm->mmap_sem);
+	if (!err)
+		return 0;
+
+	/* already populated or not private anonymous memory */
+	if (mm != current->mm)
+		err = -EINVAL;
+	else if (copy_to_user((void __user *)addr, page_address(page),
+			      PAGE_SIZE))
+		err = -EFAULT;
+	else
+		err = 0;
+	if (!err)
+		put_page(page);
+	return err;
+}
+
+static int rst_pram_undump(struct mm_struct *mm,
+			   unsigned long start, unsigned long end,
+			   loff_t pos, struct cpt_context *ctx)
+{
+	struct cpt_pram_block *b;
+	struct cpt_pram *p;
+	struct page *page;
+	unsigned long addr, i;
+	int err;
+
+	if (!ctx->pram_stream)
+		return -ENOENT;
+
+	p = cpt_pram(ctx);
+	b = rst_pram_find_block(p, pos);
+	if (!b || b->start != start || b->end != end)
+		return -ENOENT;
+
+	for (addr = start, i = b->index; addr < end; addr += PAGE_SIZE, i++) {
+		page = i < p->nr_pages ? xchg(&p->pages[i], NULL) : NULL;
+		if (!page)
+			return -EIO;
+		err = rst_pram_install(mm, addr, page);
+		if (err) {
+			put_page(page);
+			return err;
+		}
+		cond_resched();
+	}
+	return 0;
+}
+
+static void rst_pram_close(cpt_context_t *ctx)
+{
+	if (!ctx->pram_stream)
+		return;
+
+	rst_pram_free(cpt_pram(ctx));
+	ctx->pram_stream = NULL;
+	module_put(THIS_MODULE);
+}
+
+static struct cpt_pram_ops pram_ops = {
+	.cpt_open	= cpt_pram_open,
+	.cpt_dump	= cpt_pram_dump,
+	.cpt_close	= cpt_pram_close,
+	.rst_open	= rst_pram_open,
+	.rst_undump	= rst_pram_undump,
+	.rst_close	= rst_pram_close,
+};
+
+static int __init init_cpt_pram(void)
+{
+	if (cpt_pram_ops)
+		return -EBUSY;
+	cpt_pram_ops = &pram_ops;
+	return 0;
+}
+
+static void __exit exit_cpt_pram(void)
+{
+	cpt_pram_ops = NULL;
+}
+
+module_init(init_cpt_pram);
+module_exit(exit_cpt_pram);
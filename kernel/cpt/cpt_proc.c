@@ -99,6 +99,8 @@ void cpt_context_release(cpt_context_t *ctx)
 	ctx->ctx_state = CPT_CTX_ERROR;
 
 #ifdef CONFIG_VZ_CHECKPOINT_ITER
+	cpt_postcopy_release(ctx);
+	kfree(ctx->iter_stats);
 	if (ctx->pagein_file_out)
 		fput(ctx->pagein_file_out);
 	if (ctx->pagein_file_in)
@@ -106,6 +108,7 @@ void cpt_context_release(cpt_context_t *ctx)
 #endif
 	if (ctx->objcount)
 		eprintk_ctx("%d objects leaked\n", ctx->objcount);
+	cpt_object_release_hash(ctx);
 	if (ctx->file)
 		fput(ctx->file);
 	cpt_flush_error(ctx);
@@ -283,6 +286,7 @@ static int cpt_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 	int err = 0;
 	cpt_context_t *ctx;
 	struct file *dfile = NULL;
+	struct cpt_stat_mark sm;
 	int try;
 
 	unlock_kernel();
@@ -480,6 +484,42 @@ static int cpt_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 	case CPT_ITER:
 		err = cpt_iteration(ctx);
 		break;
+	case CPT_GET_ITER_STATS:
+		if (ctx->iter_stats == NULL) {
+			err = -ENOENT;
+			break;
+		}
+		if (copy_to_user((void __user *)arg, ctx->iter_stats,
+				 sizeof(struct cpt_iter_stats)))
+			err = -EFAULT;
+		break;
+	case CPT_SET_POSTCOPY:
+		if (ctx->ctx_state == CPT_CTX_DUMPING) {
+			err = -EBUSY;
+			break;
+		}
+		ctx->postcopy = !!arg;
+		if (!ctx->postcopy)
+			cpt_postcopy_release(ctx);
+		break;
+	case CPT_PAGEIND:
+		if (!ctx->postcopy) {
+			err = -EINVAL;
+			break;
+		}
+		err = cpt_postcopy_serve(ctx);
+		break;
+	case CPT_SET_INCREMENTAL:
+		if (ctx->ctx_state == CPT_CTX_DUMPING) {
+			err = -EBUSY;
+			break;
+		}
+		if (arg > CPT_INCR_DELTA) {
+			err = -EINVAL;
+			break;
+		}
+		ctx->incremental = arg;
+		break;
 #endif
 	case CPT_SET_VEID:
 		if (ctx->ctx_state > 0) {
@@ -496,6 +536,17 @@ static int cpt_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 		ctx->dst_cpu_flags = arg;
 		ctx->src_cpu_flags = test_cpu_caps_and_features();
 		break;
+	case CPT_SET_PACK:
+		if (ctx->ctx_state == CPT_CTX_DUMPING) {
+			err = -EBUSY;
+			break;
+		}
+		if (arg & ~CPT_PACK_MASK) {
+			err = -EINVAL;
+			break;
+		}
+		ctx->pack_flags = arg;
+		break;
 	case CPT_SET_PRAM:
 		if (arg)
 			err = cpt_open_pram(ctx);
@@ -554,10 +605,17 @@ static int cpt_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 			err = -ENOENT;
 			break;
 		}
+		cpt_stat_start(&sm, ctx);
 		err = cpt_resume(ctx);
+		cpt_stat_end(CPT_STAT_RESUME, &sm, ctx);
 		if (!err)
 			ctx->ctx_state = CPT_CTX_IDLE;
 		break;
+	case CPT_GET_STATS:
+		if (copy_to_user((void __user *)arg, &ctx->stats,
+				 sizeof(struct cpt_stats)))
+			err = -EFAULT;
+		break;
 	case CPT_KILL:
 		if (ctx->ctx_state == CPT_CTX_IDLE) {
 			err = -ENOENT;
@@ -700,6 +758,10 @@ static struct ctl_table_header *cpt_control;
 
 static int zero = 0;
 static int one = 1;
+static int dump_threads_max = CPT_MAX_DUMP_THREADS;
+#ifdef CONFIG_VZ_CHECKPOINT_ITER
+static int hundred = 100;
+#endif
 
 static ctl_table tunables_table[] = {
 	{
@@ -730,6 +792,48 @@ static ctl_table tunables_table[] = {
                 .mode           = 0644,
                 .proc_handler   = &proc_dointvec,
 	},
+	{
+		.ctl_name	= CTL_UNNUMBERED,
+		.procname	= "dump_threads",
+		.data		= &cpt_dump_threads,
+		.maxlen		= sizeof(cpt_dump_threads),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &dump_threads_max,
+	},
+	{
+		.ctl_name	= CTL_UNNUMBERED,
+		.procname	= "dump_thp",
+		.data		= &cpt_dump_thp,
+		.maxlen		= sizeof(cpt_dump_thp),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+#ifdef CONFIG_VZ_CHECKPOINT_ITER
+	{
+		.ctl_name	= CTL_UNNUMBERED,
+		.procname	= "iter_converge_percent",
+		.data		= &cpt_iter_converge,
+		.maxlen		= sizeof(cpt_iter_converge),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &hundred,
+	},
+	{
+		.ctl_name	= CTL_UNNUMBERED,
+		.procname	= "iter_soft_dirty",
+		.data		= &cpt_iter_soft_dirty,
+		.maxlen		= sizeof(cpt_iter_soft_dirty),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+#endif
 	{ .ctl_name = 0 }
 };
 static ctl_table control_table[] = {
@@ -17,6 +17,7 @@
 #include <linux/slab.h>
 #include <linux/file.h>
 #include <linux/mm.h>
+#include <linux/highmem.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
 #include <linux/socket.h>
@@ -234,6 +235,45 @@ static void dump_unix_skb_cb(struct cpt_skb_image *v, struct sk_buff *skb,
 	ucred->gid = UNIXCB(skb).cred ? UNIXCB(skb).cred->gid : -1;
 }
 
+/*
+ * Page frags are written right from their pages, like the memory dumper
+ * does, so big queues are not bounced through tmpbuf a page at a time.
+ * Only frag_list and highmem frags crossing a page are still copied.
+ */
+static void dump_skb_data(struct sk_buff *skb, struct cpt_context *ctx)
+{
+	int offset = skb_headlen(skb);
+	int i;
+
+	ctx->write(skb->head, (skb->data - skb->head) + offset, ctx);
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		char *vaddr;
+
+		if (PageHighMem(frag->page) &&
+		    frag->page_offset + frag->size > PAGE_SIZE)
+			break;
+
+		vaddr = kmap(frag->page);
+		ctx->write(vaddr + frag->page_offset, frag->size, ctx);
+		kunmap(frag->page);
+		offset += frag->size;
+	}
+
+	while (offset < skb->len) {
+		int copy = skb->len - offset;
+		if (copy > PAGE_SIZE)
+			copy = PAGE_SIZE;
+		(void)cpt_get_buf(ctx);
+		if (skb_copy_bits(skb, offset, ctx->tmpbuf, copy))
+			BUG();
+		ctx->write(ctx->tmpbuf, copy, ctx);
+		__cpt_release_buf(ctx);
+		offset += copy;
+	}
+}
+
 int cpt_dump_skb(int type, int owner, struct sk_buff *skb,
 		 struct sock *sk, struct cpt_context *ctx)
 {
@@ -337,23 +377,7 @@ int cpt_dump_skb(int type, int owner, struct sk_buff *skb,
 		ob.cpt_size = skb->len + v->cpt_hspace;
 
 		ctx->write(&ob, sizeof(ob), ctx);
-
-		ctx->write(skb->head, (skb->data-skb->head) + (skb->len-skb->data_len), ctx);
-		if (skb->data_len) {
-			int offset = skb->len - skb->data_len;
-			while (offset < skb->len) {
-				int copy = skb->len - offset;
-				if (copy > PAGE_SIZE)
-					copy = PAGE_SIZE;
-				(void)cpt_get_buf(ctx);
-				if (skb_copy_bits(skb, offset, ctx->tmpbuf, copy))
-					BUG();
-				ctx->write(ctx->tmpbuf, copy, ctx);
-				__cpt_release_buf(ctx);
-				offset += copy;
-			}
-		}
-
+		dump_skb_data(skb, ctx);
 		ctx->align(ctx);
 		cpt_close_object(ctx);
 		cpt_pop_object(&saved_obj2, ctx);
@@ -723,6 +747,8 @@ int cpt_dump_socket(cpt_object_t *obj, struct sock *sk, int index, int parent, s
 	v->cpt_peer = -1;
 	v->cpt_socketpair = 0;
 	v->cpt_sockflags = 0;
+	if (sk->sk_reuseport)
+		v->cpt_sockflags |= CPT_SOCK_REUSEPORT;
 
 	v->cpt_laddrlen = 0;
 	if (sock) {
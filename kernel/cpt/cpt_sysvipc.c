@@ -24,6 +24,7 @@
 #include <linux/pipe_fs_i.h>
 #include <linux/mman.h>
 #include <linux/shm.h>
+#include <linux/hugetlb.h>
 #include <linux/sem.h>
 #include <linux/msg.h>
 #include <asm/uaccess.h>
@@ -66,6 +67,10 @@ static int dump_one_shm(struct shmid_kernel *shp, void *arg)
 #else
 	v->cpt_mlockuser = -1;
 #endif
+	v->cpt_flags = 0;
+	if (!is_file_hugepages(shp->shm_file) &&
+	    sysvipc_shm_interleaved(shp->shm_file))
+		v->cpt_flags |= CPT_SHM_INTERLEAVE;
 	return 1;
 }
 
@@ -29,6 +29,7 @@
 #include <linux/cpt_image.h>
 #include <linux/icmp.h>
 #include <linux/ip.h>
+#include <linux/vmalloc.h>
 
 #if defined(CONFIG_VE_IPTABLES) && \
     (defined(CONFIG_NF_CONNTRACK) || defined(CONFIG_NF_CONNTRACK_MODULE))
@@ -54,6 +55,27 @@ struct ct_holder
 	int index;
 };
 
+/*
+ * The section is read in chunks of CT_READ_SIZE. Conntracks without
+ * helpers and expectations are inserted CT_INSERT_BATCH at once, with
+ * nf_conntrack_lock taken once per batch.
+ */
+#define CT_READ_SIZE	(16*PAGE_SIZE)
+#define CT_INSERT_BATCH	64
+
+struct ct_reader
+{
+	char		*buf;
+	loff_t		start;
+	int		len;
+};
+
+struct ct_batch
+{
+	int		nr;
+	struct nf_conn	*ct[CT_INSERT_BATCH];
+};
+
 static int decode_tuple(struct cpt_ipct_tuple *v,
 			 struct nf_conntrack_tuple *tuple, int dir,
 			 cpt_context_t *ctx)
@@ -243,11 +265,87 @@ static unsigned long get_ct_timestamp(struct nf_conn *ct)
 	return expires;
 }
 
+/*
+ * Called under rcu_read_lock(). Returns 0, if ct is inserted, 1, if it
+ * is dropped in favour of a newer duplicate, or error. ct is to be freed
+ * by caller in the latter cases.
+ */
+static int insert_one_ct(struct nf_conn *ct, cpt_context_t *ctx)
+{
+	struct net *net = nf_ct_net(ct);
+	struct nf_conn *cd;
+	int err;
+
+insert:
+	cd = NULL;
+	err = __nf_conntrack_hash_check_insert(ct, &cd);
+
+	if (err < 0 && cd) {
+		unsigned long t_ct, t_cd;
+
+		eprintk_ctx("duplicated conntrack detected, "
+			    "dropping old one\n");
+		err = 1;
+		t_ct = get_ct_timestamp(ct);
+		t_cd = get_ct_timestamp(cd);
+		if (time_before(t_cd, t_ct)) {
+			rcu_read_unlock();
+			if (del_timer(&cd->timeout)) {
+				death_by_timeout((unsigned long)cd);
+				NF_CT_STAT_INC_ATOMIC(net, early_drop);
+			}
+			nf_ct_put(cd);
+			rcu_read_lock();
+			goto insert;
+		}
+		nf_ct_put(cd);
+	}
+	return err;
+}
+
+static int rst_flush_ct_batch(struct ct_batch *bt, cpt_context_t *ctx)
+{
+	int i, left, err = 0;
+
+	left = nf_conntrack_hash_insert_batch(bt->ct, bt->nr);
+
+	/* Clashing ones resolve duplicates one by one */
+	rcu_read_lock();
+	for (i = 0; left && i < bt->nr; i++) {
+		struct nf_conn *ct = bt->ct[i];
+		int ret;
+
+		if (ct == NULL)
+			continue;
+		left--;
+
+		ret = err ? : insert_one_ct(ct, ctx);
+		if (ret) {
+			nf_conntrack_free(ct);
+			if (ret < 0)
+				err = ret;
+		} else {
+			nf_ct_put(ct);
+		}
+	}
+	rcu_read_unlock();
+
+	bt->nr = 0;
+	return err;
+}
+
+static void rst_drop_ct_batch(struct ct_batch *bt)
+{
+	while (bt->nr)
+		nf_conntrack_free(bt->ct[--bt->nr]);
+}
+
 static int undump_one_ct(struct cpt_ip_conntrack_image *ci, loff_t pos,
-			 struct ct_holder **ct_list, cpt_context_t *ctx)
+			 struct ct_holder **ct_list, struct ct_batch *bt,
+			 cpt_context_t *ctx)
 {
 	int err = 0;
-	struct nf_conn *ct, *cd;
+	struct nf_conn *ct;
 	struct ct_holder *c;
 	struct nf_conntrack_tuple orig, repl;
 	struct nf_conn_nat *nat;
@@ -327,32 +425,18 @@ static int undump_one_ct(struct cpt_ip_conntrack_image *ci, loff_t pos,
 	}
 
 	ct->timeout.expires = jiffies + ci->cpt_timeout;
-insert:
-	cd = NULL;
-	err = __nf_conntrack_hash_check_insert(ct, &cd);
 
-	if (err < 0) {
-		if (cd) {
-			unsigned long t_ct, t_cd;
-
-			eprintk_ctx("duplicated conntrack detected, "
-				    "dropping old one\n");
-			err = 0;
-			t_ct = get_ct_timestamp(ct);
-			t_cd = get_ct_timestamp(cd);
-			if (time_before(t_cd, t_ct)) {
-				rcu_read_unlock();
-				if (del_timer(&cd->timeout)) {
-					death_by_timeout((unsigned long)cd);
-					NF_CT_STAT_INC_ATOMIC(net, early_drop);
-				}
-				nf_ct_put(cd);
-				rcu_read_lock();
-				goto insert;
-			}
-		}
-		goto err2;
+	if (bt && nfct_help(ct) == NULL && ci->cpt_next <= ci->cpt_hdrlen) {
+		rcu_read_unlock();
+		bt->ct[bt->nr++] = ct;
+		if (bt->nr == CT_INSERT_BATCH)
+			err = rst_flush_ct_batch(bt, ctx);
+		return err;
 	}
+
+	err = insert_one_ct(ct, ctx);
+	if (err)
+		goto err2;
 	if (ci->cpt_next > ci->cpt_hdrlen)
 		err = undump_expect_list(ct, ci, pos, *ct_list, ctx);
         rcu_read_unlock();
@@ -367,9 +451,7 @@ insert:
 err2:
 	rcu_read_unlock();
 	nf_conntrack_free(ct);
-	if (cd)
-		nf_ct_put(cd);
-	return err;
+	return err > 0 ? 0 : err;
 }
 
 struct ip_ct_tcp_state_compat /*2.6.18*/
@@ -471,6 +553,38 @@ static void convert_conntrack_image(struct cpt_ip_conntrack_image *ci)
 	memcpy(pt, po, size);
 }
 
+/* Image of a conntrack at pos, with its expectations, from rd->buf */
+static struct cpt_object_hdr *ct_get_object(struct ct_reader *rd, loff_t pos,
+					    loff_t end, cpt_context_t *ctx)
+{
+	struct cpt_object_hdr *hdr;
+	int err;
+
+	if (pos < rd->start ||
+	    pos + sizeof(*hdr) > rd->start + rd->len ||
+	    ((struct cpt_object_hdr *)(rd->buf + (pos - rd->start)))->cpt_next >
+	     rd->start + rd->len - pos) {
+		rd->start = pos;
+		rd->len = min_t(loff_t, CT_READ_SIZE, end - pos);
+		err = ctx->pread(rd->buf, rd->len, ctx, pos);
+		if (err) {
+			rd->len = 0;
+			return ERR_PTR(err);
+		}
+	}
+
+	hdr = (struct cpt_object_hdr *)(rd->buf + (pos - rd->start));
+	if (pos + sizeof(*hdr) > end ||
+	    hdr->cpt_object != CPT_OBJ_NET_CONNTRACK ||
+	    hdr->cpt_hdrlen < sizeof(*hdr) ||
+	    hdr->cpt_hdrlen > hdr->cpt_next ||
+	    hdr->cpt_next > rd->start + rd->len - pos) {
+		eprintk_ctx("%s: bad conntrack image @%lld\n", __func__, pos);
+		return ERR_PTR(-EINVAL);
+	}
+	return hdr;
+}
+
 int rst_restore_ip_conntrack(struct cpt_context * ctx)
 {
 	int err = 0;
@@ -480,6 +594,8 @@ int rst_restore_ip_conntrack(struct cpt_context * ctx)
 	struct cpt_ip_conntrack_image ci;
 	struct ct_holder *c;
 	struct ct_holder *ct_list = NULL;
+	struct ct_reader rd;
+	struct ct_batch *bt;
 
 	if (sec == CPT_NULL)
 		return 0;
@@ -493,28 +609,51 @@ int rst_restore_ip_conntrack(struct cpt_context * ctx)
 	if (h.cpt_section != CPT_SECT_NET_CONNTRACK || h.cpt_hdrlen < sizeof(h))
 		return -EINVAL;
 
+	rd.buf = vmalloc(CT_READ_SIZE);
+	bt = kmalloc(sizeof(*bt), GFP_KERNEL);
+	if (rd.buf == NULL || bt == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	rd.start = rd.len = 0;
+	bt->nr = 0;
+
 	endsec = sec + h.cpt_next;
 	sec += h.cpt_hdrlen;
 	while (sec < endsec) {
-		err = rst_get_object(CPT_OBJ_NET_CONNTRACK, sec, &ci, ctx);
-		if (err)
+		struct cpt_object_hdr *hdr;
+
+		hdr = ct_get_object(&rd, sec, endsec, ctx);
+		if (IS_ERR(hdr)) {
+			err = PTR_ERR(hdr);
 			break;
+		}
+		memset(&ci, 0, sizeof(ci));
+		memcpy(&ci, hdr, min_t(int, hdr->cpt_hdrlen, sizeof(ci)));
 
-		if (ctx->image_version < CPT_VERSION_32)
+		/* converted images are inserted one by one, as before */
+		if (ctx->image_version < CPT_VERSION_32) {
 			convert_conntrack_image(&ci);
-
-		err = undump_one_ct(&ci, sec, &ct_list, ctx);
+			err = undump_one_ct(&ci, sec, &ct_list, NULL, ctx);
+		} else
+			err = undump_one_ct(&ci, sec, &ct_list, bt, ctx);
 		if (err) {
 			eprintk_ctx("Can't undump ct\n");
 			break;
 		}
 		sec += ci.cpt_next;
 	}
+	if (!err)
+		err = rst_flush_ct_batch(bt, ctx);
+	rst_drop_ct_batch(bt);
 
+out:
 	while ((c = ct_list) != NULL) {
 		ct_list = c->next;
 		kfree(c);
 	}
+	kfree(bt);
+	vfree(rd.buf);
 
 	return err;
 }
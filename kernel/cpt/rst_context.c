@@ -84,6 +84,8 @@ static ssize_t file_pread(void *addr, size_t count, struct cpt_context *ctx, lof
 	if (file)
 		err = file->f_op->read(file, addr, count, &pos);
 	set_fs(oldfs);
+	if (err > 0)
+		atomic64_add(err, &ctx->stat_read);
 	if (err != count) {
 		eprintk_ctx("%s: read failed - addr: 0x%p, count: %ld, pos: %Ld, read: %ld\n",
 				__func__, addr, count, pos, err);
@@ -138,6 +140,8 @@ void rst_context_init(struct cpt_context *ctx)
 	ctx->align = file_align;
 	for (i=0; i < CPT_SECT_MAX; i++)
 		ctx->sections[i] = CPT_NULL;
+	mutex_init(&ctx->rst_lock);
+	init_waitqueue_head(&ctx->rst_wait);
 	cpt_object_init(ctx);
 }
 
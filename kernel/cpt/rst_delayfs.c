@@ -1535,6 +1535,7 @@ int rst_freeze_delayfs(cpt_context_t *ctx)
 
 		list_move(&obj->o_list,
 				&dctx->object_array[CPT_DOBJ_VFSMOUNT_REF]);
+		cpt_obj_unhash(obj);
 		ctx->objcount--;
 		mnt = obj->o_obj;
 		si = mnt->mnt_sb->s_fs_info;
@@ -1545,6 +1546,7 @@ int rst_freeze_delayfs(cpt_context_t *ctx)
 		if (obj->o_flags & CPT_FILE_DELAYFS) {
 			list_move(&obj->o_list,
 					&dctx->object_array[CPT_DOBJ_FILE]);
+			cpt_obj_unhash(obj);
 			ctx->objcount--;
 		}
 	return 0;
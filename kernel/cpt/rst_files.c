@@ -79,18 +79,7 @@ static int rst_filejob_queue(loff_t pos, cpt_context_t *ctx)
 static void _anon_pipe_buf_release(struct pipe_inode_info *pipe,
 				  struct pipe_buffer *buf)
 {
-	struct page *page = buf->page;
-
-	/*
-	 * If nobody else uses this page, and we don't already have a
-	 * temporary page, let's keep track of it as a one-deep
-	 * allocation cache. (Otherwise just release our reference to it)
-	 */
-	if (page_count(page) == 1 && !pipe->tmp_page)
-		pipe->tmp_page = page;
-	else
-		page_cache_release(page);
-
+	pipe_recycle_page(pipe, buf->page);
 	module_put(THIS_MODULE);
 }
 
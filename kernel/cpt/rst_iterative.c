@@ -25,6 +25,8 @@
 #include <linux/cpt_image.h>
 #include <linux/rbtree.h>
 #include <linux/mmgang.h>
+#include <linux/kthread.h>
+#include <linux/virtinfo.h>
 
 #include <linux/cpt_obj.h>
 #include <linux/cpt_context.h>
@@ -50,6 +52,9 @@ struct swp_node
 	int			keep;
 };
 
+static struct swp_node *rst_postcopy_page(u64 pfn, cpt_context_t *ctx);
+static void rst_pagein_demand(struct page *page);
+
 static inline struct swp_node * rb_lookup_pfn(u64 pfn, cpt_context_t *ctx)
 {
 	struct rb_node *n = ctx->iter_rb_root.rb_node;
@@ -69,7 +74,8 @@ static inline struct swp_node * rb_lookup_pfn(u64 pfn, cpt_context_t *ctx)
 	return NULL;
 }
 
-static inline int rb_insert_pfn(u64 pfn, swp_entry_t ent, cpt_context_t *ctx)
+static inline struct swp_node *
+rb_insert_pfn(u64 pfn, swp_entry_t ent, cpt_context_t *ctx)
 {
 	struct rb_node **p = &ctx->iter_rb_root.rb_node;
 	struct rb_node *parent = NULL;
@@ -90,7 +96,7 @@ static inline int rb_insert_pfn(u64 pfn, swp_entry_t ent, cpt_context_t *ctx)
 
 	pd = kmalloc(sizeof(struct swp_node), GFP_KERNEL);
 	if (pd == NULL)
-		return -ENOMEM;
+		return NULL;
 	memset(pd, 0, sizeof(struct swp_node));
 	rb_link_node(&pd->rb_hash, parent, p);
 	rb_insert_color(&pd->rb_hash, &ctx->iter_rb_root);
@@ -98,7 +104,7 @@ out:
 	pd->pfn = pfn;
 	pd->ent = ent;
 	pd->anon = NULL;
-	return 0;
+	return pd;
 }
 
 static int iter_clone(struct mm_struct * mm,
@@ -143,6 +149,11 @@ int rst_iter(struct vm_area_struct *vma, u64 pfn,
 	struct swp_node *swn;
 
 	swn = rb_lookup_pfn(pfn, ctx);
+	if (swn == NULL && ctx->postcopy) {
+		swn = rst_postcopy_page(pfn, ctx);
+		if (IS_ERR(swn))
+			return PTR_ERR(swn);
+	}
 	if (swn == NULL) {
 		eprintk_ctx("rst_iter: missing pfn %lx\n", (unsigned long)pfn);
 		return -EINVAL;
@@ -154,6 +165,8 @@ int rst_iter(struct vm_area_struct *vma, u64 pfn,
 		page = read_swap_cache_async(swn->ent, GFP_HIGHUSER, vma, addr);
 		if (page) {
 			err = -EIO;
+			if (!PageUptodate(page))
+				rst_pagein_demand(page);
 			wait_on_page_locked(page);
 			if (PageUptodate(page))
 				err = iter_clone(mm, addr, page, ctx);
@@ -179,6 +192,9 @@ int rst_iter(struct vm_area_struct *vma, u64 pfn,
 	if (pte_none(*pte)) {
 		if (swap_duplicate(swn->ent) < 0)
 			BUG();
+		/* the entry may be a placeholder, see do_swap_page() */
+		if (ctx->postcopy)
+			set_bit(MMF_POSTCOPY, &mm->flags);
 		set_pte(pte, swp_entry_to_pte(swn->ent));
 		inc_mm_counter(mm, swap_usage);
 		if (list_empty(&mm->mmlist)) {
@@ -221,6 +237,11 @@ rst_iter_chunk(struct file *file, loff_t pos,
 		struct swp_node *swn;
 
 		swn = rb_lookup_pfn(pfn, ctx);
+		if (swn == NULL && ctx->postcopy) {
+			swn = rst_postcopy_page(pfn, ctx);
+			if (IS_ERR(swn))
+				return PTR_ERR(swn);
+		}
 		if (swn == NULL) {
 			eprintk_ctx("rst_iter_shmem: missing pfn %lx\n", pfn);
 			return -EINVAL;
@@ -340,6 +361,24 @@ dirty_page:
 	return new_page;
 }
 
+static int rst_iter_ub(cpt_context_t *ctx)
+{
+	struct user_beancounter *ub;
+
+	if (ctx->iter_ub)
+		return 0;
+
+	if (ctx->ve_id == 0) {
+		ub = get_beancounter_longterm(mm_ub_top(&init_mm));
+	} else {
+		ub = get_beancounter_byuid(ctx->ve_id, 1);
+		if (ub == NULL)
+			return -ENOMEM;
+	}
+	ctx->iter_ub = ub;
+	return 0;
+}
+
 int rst_iteration(cpt_context_t *ctx)
 {
 	int err = 0;
@@ -358,22 +397,15 @@ int rst_iteration(cpt_context_t *ctx)
 	if (file == NULL)
 		return -EBADF;
 #ifndef ITER_DEBUG
-	if (ctx->pagein_file_out == NULL)
+	/* Streams of incremental snapshots are read from files */
+	if (ctx->pagein_file_out == NULL && !ctx->incremental)
 		return -EBADF;
 #endif
 
+	err = rst_iter_ub(ctx);
+	if (err)
+		goto out;
 	ub = ctx->iter_ub;
-	if (ub == NULL) {
-		if (ctx->ve_id == 0) {
-			ub = get_beancounter_longterm(mm_ub_top(&init_mm));
-		} else {
-			ub = get_beancounter_byuid(ctx->ve_id, 1);
-			err = -ENOMEM;
-			if (ub == NULL)
-				goto out;
-		}
-		ctx->iter_ub = ub;
-	}
 	get_beancounter(ub);
 
 	for (;;) {
@@ -472,8 +504,8 @@ int rst_iteration(cpt_context_t *ctx)
 			break;
 		}
 
-		err = rb_insert_pfn(rep.handle, ent, ctx);
-		if (err) {
+		if (rb_insert_pfn(rep.handle, ent, ctx) == NULL) {
+			err = -ENOMEM;
 			eprintk_ctx("Failed to add swap enry to tree\n");
 			free_swap_and_cache(ent);
 			break;
@@ -483,7 +515,7 @@ int rst_iteration(cpt_context_t *ctx)
 
 out:
 #ifndef ITER_DEBUG
-	if (!err) {
+	if (!err && ctx->pagein_file_out) {
 		struct pgin_request req;
 		req.rmid = PGIN_RMID;
 		req.size = PGIN_STOP;
@@ -502,7 +534,8 @@ out:
 	}
 #endif
 	if (err) {
-		fput(ctx->pagein_file_out);
+		if (ctx->pagein_file_out)
+			fput(ctx->pagein_file_out);
 		ctx->pagein_file_out = NULL;
 		fput(ctx->pagein_file_in);
 		ctx->pagein_file_in = NULL;
@@ -533,3 +566,466 @@ free_ub:
 		ctx->iter_ub = NULL;
 	}
 }
+
+/* Post-copy restore.
+ *
+ * With ctx->postcopy set, CPT_OBJ_ITERPAGES may refer to pfns which were
+ * not transferred by iterations. For such a pfn we allocate a placeholder:
+ * a locked, not uptodate page in swap cache, so that rst_iter() installs
+ * swap pte for it as usual. Tasks touching it sleep in do_swap_page()
+ * until the pager thread fetches the contents from source page server
+ * and unlocks the page. Pager prefetches everything in pfn order, pages
+ * somebody waits for (VIRTINFO_PAGEIN) go first. When the channel breaks,
+ * pending pages are unlocked not uptodate and their users get SIGBUS.
+ */
+
+#define RST_PAGER_BATCH		32
+#define RST_PAGER_DEMAND	64
+
+struct rst_pager
+{
+	atomic_t		refcnt;
+	spinlock_t		lock;
+	struct radix_tree_root	pending;	/* source pfn -> placeholder */
+	unsigned long		nr_pending;
+	unsigned long		cursor;		/* next pfn to prefetch */
+	unsigned long		demand[RST_PAGER_DEMAND];
+	int			demand_nr;
+	int			sealed;		/* no more placeholders */
+	int			error;
+	wait_queue_head_t	wq;
+	struct list_head	list;
+	struct file		*file_in;
+	struct file		*file_out;
+	int			ve_id;
+	unsigned long		nr_fetched;
+	unsigned long		nr_demand;
+	struct pgin_request	req[RST_PAGER_BATCH];
+};
+
+static LIST_HEAD(rst_pagers);
+static DEFINE_SPINLOCK(rst_pagers_lock);
+
+static void rst_pager_put(struct rst_pager *pgr)
+{
+	if (atomic_dec_and_test(&pgr->refcnt))
+		kfree(pgr);
+}
+
+static void rst_pagein_demand(struct page *page)
+{
+	struct rst_pager *pgr;
+
+	spin_lock(&rst_pagers_lock);
+	list_for_each_entry(pgr, &rst_pagers, list) {
+		spin_lock(&pgr->lock);
+		/* page->index keeps source pfn until the page is uptodate */
+		if (radix_tree_lookup(&pgr->pending, page->index) == page) {
+			if (pgr->demand_nr < RST_PAGER_DEMAND)
+				pgr->demand[pgr->demand_nr++] = page->index;
+			pgr->nr_demand++;
+			spin_unlock(&pgr->lock);
+			wake_up(&pgr->wq);
+			break;
+		}
+		spin_unlock(&pgr->lock);
+	}
+	spin_unlock(&rst_pagers_lock);
+}
+
+static int rst_pagein_notify(struct vnotifier_block *self,
+			     unsigned long event, void *arg, int old_ret)
+{
+	if (event == VIRTINFO_PAGEIN)
+		rst_pagein_demand(arg);
+	return old_ret;
+}
+
+static struct vnotifier_block rst_pagein_nb = {
+	.notifier_call = rst_pagein_notify,
+};
+
+static int rst_pager_collect(struct rst_pager *pgr)
+{
+	struct page *pages[RST_PAGER_BATCH];
+	int i, j, nr = 0, found;
+
+	spin_lock(&pgr->lock);
+	for (i = 0; i < pgr->demand_nr && nr < RST_PAGER_BATCH; i++) {
+		unsigned long pfn = pgr->demand[i];
+
+		if (!radix_tree_lookup(&pgr->pending, pfn))
+			continue;
+		for (j = 0; j < nr; j++)
+			if (pgr->req[j].index == pfn)
+				break;
+		if (j == nr)
+			pgr->req[nr++].index = pfn;
+	}
+	pgr->demand_nr = 0;
+
+	while (nr < RST_PAGER_BATCH) {
+		found = radix_tree_gang_lookup(&pgr->pending, (void **)pages,
+					       pgr->cursor,
+					       RST_PAGER_BATCH - nr);
+		if (!found) {
+			if (!pgr->cursor)
+				break;
+			pgr->cursor = 0;
+			continue;
+		}
+		for (i = 0; i < found; i++) {
+			unsigned long pfn = pages[i]->index;
+
+			for (j = 0; j < nr; j++)
+				if (pgr->req[j].index == pfn)
+					break;
+			if (j == nr)
+				pgr->req[nr++].index = pfn;
+		}
+		pgr->cursor = pages[found - 1]->index + 1;
+		break;
+	}
+	spin_unlock(&pgr->lock);
+
+	for (i = 0; i < nr; i++) {
+		pgr->req[i].rmid = PGIN_RMID;
+		pgr->req[i].size = PAGE_SIZE;
+		pgr->req[i].handle = pgr->req[i].index;
+	}
+	return nr;
+}
+
+static int rst_pager_send(struct rst_pager *pgr, void *buf, int len)
+{
+	struct file *file = pgr->file_out;
+	mm_segment_t oldfs;
+	int err;
+
+	oldfs = get_fs(); set_fs(KERNEL_DS);
+	err = vfs_write(file, buf, len, &file->f_pos);
+	set_fs(oldfs);
+	if (err < 0)
+		return err;
+	if (err != len)
+		return -EIO;
+	return 0;
+}
+
+static int rst_pager_recv(struct rst_pager *pgr, void *scratch)
+{
+	struct pgin_reply rep;
+	struct page *page;
+	void *dst;
+	int err;
+
+	err = nread(pgr->file_in, (void*)&rep, sizeof(rep));
+	if (err)
+		return err;
+	if (rep.rmid != PGIN_RMID) {
+		eprintk("CT: %d: pagein stream corrupt\n", pgr->ve_id);
+		return -EINVAL;
+	}
+
+	spin_lock(&pgr->lock);
+	page = radix_tree_delete(&pgr->pending, rep.handle);
+	if (page)
+		pgr->nr_pending--;
+	spin_unlock(&pgr->lock);
+
+	if (rep.error) {
+		eprintk("CT: %d: source failed pfn %Lx: %d\n", pgr->ve_id,
+			(unsigned long long)rep.handle, rep.error);
+		if (page) {
+			SetPageError(page);
+			unlock_page(page);
+			page_cache_release(page);
+		}
+		return 0;
+	}
+
+	if (page == NULL)
+		return nread(pgr->file_in, scratch, PAGE_SIZE);
+
+	dst = kmap(page);
+	err = nread(pgr->file_in, dst, PAGE_SIZE);
+	kunmap(page);
+	if (!err) {
+		SetPageUptodate(page);
+		pgr->nr_fetched++;
+	}
+	unlock_page(page);
+	page_cache_release(page);
+	return err;
+}
+
+static void rst_pager_drain(struct rst_pager *pgr)
+{
+	struct page *pages[16];
+	int i, nr;
+
+	spin_lock(&pgr->lock);
+	while ((nr = radix_tree_gang_lookup(&pgr->pending,
+					    (void **)pages, 0, 16)) > 0) {
+		for (i = 0; i < nr; i++) {
+			radix_tree_delete(&pgr->pending, pages[i]->index);
+			pgr->nr_pending--;
+			spin_unlock(&pgr->lock);
+			SetPageError(pages[i]);
+			unlock_page(pages[i]);
+			page_cache_release(pages[i]);
+			spin_lock(&pgr->lock);
+		}
+	}
+	spin_unlock(&pgr->lock);
+}
+
+static int rst_pager_thread(void *arg)
+{
+	struct rst_pager *pgr = arg;
+	void *scratch;
+	int err = 0;
+
+	scratch = (void *)__get_free_page(GFP_KERNEL);
+	if (scratch == NULL)
+		err = -ENOMEM;
+
+	while (!err) {
+		int i, nr;
+
+		wait_event_interruptible(pgr->wq, pgr->nr_pending ||
+					 pgr->sealed || pgr->error);
+		if (pgr->error) {
+			err = pgr->error;
+			break;
+		}
+		if (!pgr->nr_pending && pgr->sealed)
+			break;
+
+		nr = rst_pager_collect(pgr);
+		if (!nr)
+			continue;
+		err = rst_pager_send(pgr, pgr->req, nr * sizeof(pgr->req[0]));
+		for (i = 0; i < nr && !err; i++)
+			err = rst_pager_recv(pgr, scratch);
+	}
+
+	spin_lock(&pgr->lock);
+	if (!pgr->error)
+		pgr->error = err ? : -ESRCH;
+	spin_unlock(&pgr->lock);
+
+	if (pgr->nr_pending) {
+		eprintk("CT: %d: post-copy aborted (%d), %lu pages lost\n",
+			pgr->ve_id, err, pgr->nr_pending);
+		rst_pager_drain(pgr);
+	}
+
+	/* Channel is in sync, let source release the pages */
+	if (!err || err == -EINTR) {
+		struct pgin_request req;
+
+		req.rmid = PGIN_RMID;
+		req.size = PGIN_STOP;
+		req.index = 0;
+		req.handle = 0;
+		rst_pager_send(pgr, &req, sizeof(req));
+	}
+	if (!err)
+		printk(KERN_INFO "CT: %d: post-copy done, %lu pages, "
+		       "%lu on demand\n", pgr->ve_id, pgr->nr_fetched,
+		       pgr->nr_demand);
+
+	if (scratch)
+		free_page((unsigned long)scratch);
+
+	spin_lock(&rst_pagers_lock);
+	list_del(&pgr->list);
+	spin_unlock(&rst_pagers_lock);
+
+	fput(pgr->file_in);
+	fput(pgr->file_out);
+	rst_pager_put(pgr);
+	module_put_and_exit(0);
+}
+
+static struct rst_pager *rst_pager_start(cpt_context_t *ctx)
+{
+	struct rst_pager *pgr;
+	struct task_struct *tsk;
+
+	if (ctx->pagein_file_in == NULL || ctx->pagein_file_out == NULL)
+		return ERR_PTR(-EBADF);
+
+	pgr = kzalloc(sizeof(*pgr), GFP_KERNEL);
+	if (pgr == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	atomic_set(&pgr->refcnt, 2);
+	spin_lock_init(&pgr->lock);
+	INIT_RADIX_TREE(&pgr->pending, GFP_ATOMIC);
+	init_waitqueue_head(&pgr->wq);
+	pgr->ve_id = ctx->ve_id;
+	get_file(ctx->pagein_file_in);
+	pgr->file_in = ctx->pagein_file_in;
+	get_file(ctx->pagein_file_out);
+	pgr->file_out = ctx->pagein_file_out;
+
+	spin_lock(&rst_pagers_lock);
+	list_add(&pgr->list, &rst_pagers);
+	spin_unlock(&rst_pagers_lock);
+
+	__module_get(THIS_MODULE);
+	tsk = kthread_run(rst_pager_thread, pgr, "cpt_pager/%d", ctx->ve_id);
+	if (IS_ERR(tsk)) {
+		module_put(THIS_MODULE);
+		spin_lock(&rst_pagers_lock);
+		list_del(&pgr->list);
+		spin_unlock(&rst_pagers_lock);
+		fput(pgr->file_in);
+		fput(pgr->file_out);
+		kfree(pgr);
+		return ERR_PTR(PTR_ERR(tsk));
+	}
+	return pgr;
+}
+
+static int rst_pager_add(struct rst_pager *pgr, u64 pfn, struct page *page)
+{
+	int err;
+
+	err = radix_tree_preload(GFP_KERNEL);
+	if (err)
+		return err;
+
+	spin_lock(&pgr->lock);
+	err = pgr->error ? : -EBUSY;
+	if (!pgr->error && !pgr->sealed) {
+		err = radix_tree_insert(&pgr->pending, pfn, page);
+		if (!err)
+			pgr->nr_pending++;
+	}
+	spin_unlock(&pgr->lock);
+	radix_tree_preload_end();
+
+	if (!err)
+		wake_up(&pgr->wq);
+	return err;
+}
+
+/* Cf. dontread_swap_cache(), only the page stays locked and not uptodate. */
+static struct swp_node *rst_postcopy_page(u64 pfn, cpt_context_t *ctx)
+{
+	struct user_beancounter *ub;
+	struct swp_node *swn;
+	struct page *page;
+	swp_entry_t ent;
+	int err;
+
+	if (ctx->pager == NULL) {
+		struct rst_pager *pgr = rst_pager_start(ctx);
+
+		if (IS_ERR(pgr)) {
+			eprintk_ctx("Failed to start pager: %ld\n", PTR_ERR(pgr));
+			return ERR_CAST(pgr);
+		}
+		ctx->pager = pgr;
+	}
+
+	err = rst_iter_ub(ctx);
+	if (err)
+		return ERR_PTR(err);
+	ub = ctx->iter_ub;
+
+	if (get_nr_swap_pages() < total_swap_pages * swap_percent / 100) {
+		eprintk_ctx("Swap pages barrier\n");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	page = alloc_page(GFP_HIGHUSER);
+	if (page == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	err = gang_add_user_page(page, get_ub_gs(ub), GFP_KERNEL);
+	if (err) {
+		page_cache_release(page);
+		return ERR_PTR(err);
+	}
+
+	err = -ENOMEM;
+	ent = get_swap_page(ub);
+	if (!ent.val)
+		goto out_page;
+
+	__set_page_locked(page);
+	SetPageSwapBacked(page);
+	err = add_to_swap_cache(page, ent, GFP_KERNEL);
+	if (err) {
+		ClearPageSwapBacked(page);
+		__clear_page_locked(page);
+		swapcache_free(ent, NULL);
+		goto out_page;
+	}
+	SetPageDirty(page);
+	page->index = pfn;
+
+	if (swap_duplicate(ent) < 0)
+		BUG();
+	swn = rb_insert_pfn(pfn, ent, ctx);
+	if (swn == NULL) {
+		err = -ENOMEM;
+		free_swap_and_cache(ent);
+		goto out_cache;
+	}
+
+	lru_cache_add_anon(page);
+	err = rst_pager_add(ctx->pager, pfn, page);
+	if (err) {
+		swn->ent.val = 0;
+		free_swap_and_cache(ent);
+		delete_from_swap_cache(page);
+		unlock_page(page);
+		page_cache_release(page);
+		return ERR_PTR(err);
+	}
+	/* Our reference is handed over to pager */
+	return swn;
+
+out_cache:
+	delete_from_swap_cache(page);
+	unlock_page(page);
+out_page:
+	gang_del_user_page(page);
+	page_cache_release(page);
+	return ERR_PTR(err);
+}
+
+/* Called when restore is over: pager fetches what is left and quits */
+void rst_pager_seal(cpt_context_t *ctx, int abort)
+{
+	struct rst_pager *pgr = ctx->pager;
+
+	if (pgr == NULL)
+		return;
+
+	spin_lock(&pgr->lock);
+	pgr->sealed = 1;
+	if (abort && !pgr->error)
+		pgr->error = -EINTR;
+	spin_unlock(&pgr->lock);
+	wake_up(&pgr->wq);
+
+	ctx->pager = NULL;
+	rst_pager_put(pgr);
+}
+
+int rst_pagein_init(void)
+{
+	virtinfo_notifier_register(VITYPE_GENERAL, &rst_pagein_nb);
+	return 0;
+}
+
+void rst_pagein_exit(void)
+{
+	virtinfo_notifier_unregister(VITYPE_GENERAL, &rst_pagein_nb);
+}
@@ -26,6 +26,8 @@
 #include <linux/rmap.h>
 #include <linux/hash.h>
 #include <linux/binfmts.h>
+#include <linux/khugepaged.h>
+#include <linux/lzo.h>
 #include <asm/pgalloc.h>
 #include <asm/tlb.h>
 #include <asm/tlbflush.h>
@@ -495,6 +497,180 @@ static int copy_mm_pages(struct mm_struct *src, unsigned long start,
 
 #include <linux/proc_fs.h>
 
+/* Read the data of packed page record at @pos into @dst, see dump_packed_page() */
+static int rst_read_packed(struct cpt_packed_page *pp, loff_t pos, void *dst,
+			   void *buf, cpt_context_t *ctx)
+{
+	size_t len = PAGE_SIZE;
+	int err;
+
+	switch (pp->cpt_type) {
+	case CPT_PACKED_RAW:
+		if (pp->cpt_len != PAGE_SIZE)
+			return -EINVAL;
+		return ctx->pread(dst, PAGE_SIZE, ctx, pos);
+	case CPT_PACKED_LZO:
+		if (pp->cpt_len >= PAGE_SIZE)
+			return -EINVAL;
+		err = ctx->pread(buf, pp->cpt_len, ctx, pos);
+		if (err)
+			return err;
+		if (lzo1x_decompress_safe(buf, pp->cpt_len, dst, &len) !=
+		    LZO_E_OK || len != PAGE_SIZE)
+			return -EINVAL;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static int rst_undump_packed(struct mm_struct *mm, unsigned long start,
+			     unsigned long end, loff_t pos, cpt_context_t *ctx)
+{
+	struct vm_area_struct *vma;
+	struct cpt_packed_page pp;
+	void *page, *buf;
+	unsigned long addr;
+	int has_file;
+	int err = -ENOMEM;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, start);
+	has_file = vma && vma->vm_file;
+	up_read(&mm->mmap_sem);
+
+	page = (void *)__get_free_page(GFP_KERNEL);
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!page || !buf)
+		goto out;
+
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		err = ctx->pread(&pp, sizeof(pp), ctx, pos);
+		if (err)
+			break;
+		pos += sizeof(pp);
+
+		switch (pp.cpt_type) {
+		case CPT_PACKED_ZERO:
+			/* Fresh anonymous memory is zero already */
+			if (has_file &&
+			    clear_user((void __user *)addr, PAGE_SIZE))
+				err = -EFAULT;
+			break;
+		case CPT_PACKED_DUP: {
+			struct cpt_packed_page ref;
+
+			err = ctx->pread(&ref, sizeof(ref), ctx, pp.cpt_ref);
+			if (!err)
+				err = rst_read_packed(&ref,
+						      pp.cpt_ref + sizeof(ref),
+						      page, buf, ctx);
+			if (!err && copy_to_user((void __user *)addr, page,
+						 PAGE_SIZE))
+				err = -EFAULT;
+			break;
+		}
+		case CPT_PACKED_RAW:
+			err = -EINVAL;
+			if (pp.cpt_len == PAGE_SIZE)
+				err = ctx->pread(cpt_ptr_import(addr),
+						 PAGE_SIZE, ctx, pos);
+			break;
+		default:
+			err = rst_read_packed(&pp, pos, page, buf, ctx);
+			if (!err && copy_to_user((void __user *)addr, page,
+						 PAGE_SIZE))
+				err = -EFAULT;
+		}
+		if (err) {
+			eprintk_ctx("bad packed page %d at 0x%lx: %d\n",
+				    pp.cpt_type, addr, err);
+			break;
+		}
+		pos += pp.cpt_len;
+	}
+
+out:
+	kfree(buf);
+	if (page)
+		free_page((unsigned long)page);
+	return err;
+}
+
+/*
+ * The area was mapped by transparent huge pages when dumped. Let write
+ * faults of the data read allocate huge pages again, if vma flags and
+ * THP settings here allow it. handle_mm_fault() falls back to 4k pages
+ * itself, when a huge page cannot be allocated or charged.
+ */
+static int rst_undump_huge(struct mm_struct *mm, struct cpt_vma_image *vmai,
+			   struct cpt_page_block *pgb, loff_t pos,
+			   cpt_context_t *ctx)
+{
+	struct vm_area_struct *vma;
+	int err;
+
+	down_write(&mm->mmap_sem);
+	vma = find_vma(mm, pgb->cpt_start);
+	if (vma == NULL || vma->vm_start > pgb->cpt_start) {
+		up_write(&mm->mmap_sem);
+		eprintk_ctx("lost vm_area_struct\n");
+		return -ESRCH;
+	}
+	if (!(vmai->cpt_flags & VM_NOHUGEPAGE)) {
+		vma->vm_flags &= ~VM_NOHUGEPAGE;
+		vma->vm_flags |= vmai->cpt_flags & VM_HUGEPAGE;
+	}
+	up_write(&mm->mmap_sem);
+
+	rst_tree_unlock(ctx);
+	if (pgb->cpt_content == CPT_CONTENT_DATA) {
+		err = ctx->pread(cpt_ptr_import(pgb->cpt_start),
+				 pgb->cpt_end - pgb->cpt_start, ctx, pos);
+		if (err)
+			eprintk_ctx("%s: huge pages read failed: 0x%Lx - 0x%Lx\n",
+				    __func__, pgb->cpt_start, pgb->cpt_end);
+	} else if (pgb->cpt_content == CPT_CONTENT_PACKED) {
+		err = rst_undump_packed(mm, pgb->cpt_start, pgb->cpt_end,
+					pos, ctx);
+	} else {
+		eprintk_ctx("%s: unsupported cpt content: %d\n", __func__,
+			    pgb->cpt_content);
+		err = -EINVAL;
+	}
+	rst_tree_lock(ctx);
+
+	/* The rest of the vma is restored with 4k pages */
+	down_write(&mm->mmap_sem);
+	vma = find_vma(mm, pgb->cpt_start);
+	if (vma)
+		vma->vm_flags |= VM_NOHUGEPAGE;
+	up_write(&mm->mmap_sem);
+	return err;
+}
+
+/*
+ * Source mm of CPT_OBJ_COPYPAGES is restored before ours in a serial
+ * restore. With subtrees restored concurrently it may be still in
+ * progress in another subtree.
+ */
+static cpt_object_t *rst_source_mm(loff_t pos, struct cpt_context *ctx)
+{
+	cpt_object_t *mobj;
+	unsigned int gen;
+
+	for (;;) {
+		gen = ctx->rst_mm_gen;
+		mobj = lookup_cpt_obj_bypos(CPT_OBJ_MM, pos, ctx);
+		if (mobj || ctx->rst_failed || !rst_mm_pending(pos, ctx))
+			return mobj;
+
+		rst_tree_unlock(ctx);
+		wait_event(ctx->rst_wait,
+			   ctx->rst_mm_gen != gen || ctx->rst_failed);
+		rst_tree_lock(ctx);
+	}
+}
+
 #ifdef ARCH_HAS_SETUP_ADDITIONAL_PAGES
 static int cpt_setup_vdso(unsigned long addr, int is_rhel5)
 {
@@ -522,6 +698,7 @@ static int do_rst_vma(struct cpt_vma_image *vmai, loff_t vmapos, loff_t mmpos,
 	struct file *file = NULL;
 	unsigned long prot;
 	int checked = 0;
+	int huge = 0;
 
 	if (vmai->cpt_type == CPT_VMA_VDSO || vmai->cpt_type == CPT_VMA_VDSO_OLD) {
 		if (ctx->vdso == NULL || !test_thread_flag(TIF_IA32)) {
@@ -681,7 +858,7 @@ static int do_rst_vma(struct cpt_vma_image *vmai, loff_t vmapos, loff_t mmpos,
 					goto out;
 				}
 
-				mobj = lookup_cpt_obj_bypos(CPT_OBJ_MM, u.cpb.cpt_source, ctx);
+				mobj = rst_source_mm(u.cpb.cpt_source, ctx);
 				if (!mobj) {
 					eprintk_ctx("lost mm_struct to clone pages from\n");
 					err = -ESRCH;
@@ -789,6 +966,19 @@ static int do_rst_vma(struct cpt_vma_image *vmai, loff_t vmapos, loff_t mmpos,
 				offset += u.cpb.cpt_next;
 				continue;
 			}
+			if (u.pb.cpt_object == CPT_OBJ_HUGEPAGES) {
+				pos = offset + sizeof(u.pb);
+				if (!(prot&PROT_WRITE))
+					sc_mprotect(vmai->cpt_start, vmai->cpt_end-vmai->cpt_start, prot | PROT_WRITE);
+				err = rst_undump_huge(mm, vmai, &u.pb, pos, ctx);
+				if (!(prot&PROT_WRITE))
+					sc_mprotect(vmai->cpt_start, vmai->cpt_end-vmai->cpt_start, prot);
+				if (err)
+					goto out;
+				huge = 1;
+				offset += u.pb.cpt_next;
+				continue;
+			}
 			if (u.pb.cpt_object != CPT_OBJ_PAGES) {
 				eprintk_ctx("unknown vma fix object %d\n", u.pb.cpt_object);
 				err = -EINVAL;
@@ -886,13 +1076,21 @@ static int do_rst_vma(struct cpt_vma_image *vmai, loff_t vmapos, loff_t mmpos,
 							goto out;
 					}
 
+					rst_tree_unlock(ctx);
 					err = ctx->pread(cpt_ptr_import(u.pb.cpt_start), 
 							 u.pb.cpt_end-u.pb.cpt_start,
 							 ctx, pos);
+					rst_tree_lock(ctx);
 					if (err) {
 						eprintk_ctx("%s: VMA context read failed: 0x%Lx - 0x%Lx\n", __func__, vmai->cpt_start, vmai->cpt_end);
 						goto out;
 					}
+				} else if (u.pb.cpt_content == CPT_CONTENT_PACKED) {
+					rst_tree_unlock(ctx);
+					err = rst_undump_packed(mm, u.pb.cpt_start, u.pb.cpt_end, pos, ctx);
+					rst_tree_lock(ctx);
+					if (err)
+						goto out;
 				} else if (u.pb.cpt_content == CPT_CONTENT_PRAM) {
 					err = rst_undump_pram(mm, u.pb.cpt_start, u.pb.cpt_end, pos, ctx);
 					if (err) {
@@ -919,8 +1117,13 @@ check:
 		vma = find_vma(mm, addr);
 		if (vma) {
 
-			if (!(vmai->cpt_flags & VM_NOHUGEPAGE))
+			if (!(vmai->cpt_flags & VM_NOHUGEPAGE)) {
 				vma->vm_flags &= ~VM_NOHUGEPAGE;
+				vma->vm_flags |= vmai->cpt_flags & VM_HUGEPAGE;
+				/* Collapse areas restored with 4k pages later */
+				if (huge || (vma->vm_flags & VM_HUGEPAGE))
+					khugepaged_enter_vma_merge(vma);
+			}
 
 			if ((vma->vm_flags^vmai->cpt_flags)&VM_READHINTMASK) {
 				VM_ClearReadHint(vma);
@@ -1245,6 +1448,9 @@ int rst_mm_complete(struct cpt_task_image *ti, struct cpt_context *ctx)
 	if (mobj != NULL) {
 		err = 0;
 		cpt_obj_setpos(mobj, ti->cpt_mm, ctx);
+		/* See rst_source_mm() */
+		ctx->rst_mm_gen++;
+		wake_up_all(&ctx->rst_wait);
 	}
 
 out:
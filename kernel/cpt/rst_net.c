@@ -818,8 +818,13 @@ int rst_restore_net(struct cpt_context *ctx)
 		err = rst_restore_route(ctx);
 	if (!err)
 		err = rst_restore_iptables(ctx);
-	if (!err)
+	if (!err) {
+		struct cpt_stat_mark m;
+
+		cpt_stat_start(&m, ctx);
 		err = rst_restore_ip_conntrack(ctx);
+		cpt_stat_end(CPT_STAT_RST_CONNTRACK, &m, ctx);
+	}
 	if (!err)
 		err = rst_restore_snmp(ctx);
 	return err;
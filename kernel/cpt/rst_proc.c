@@ -115,6 +115,7 @@ void rst_context_release(cpt_context_t *ctx)
 		ctx->error_msg = NULL;
 	}
 #ifdef CONFIG_VZ_CHECKPOINT_ITER
+	rst_pager_seal(ctx, 1);
 	rst_drop_iter_rbtree(ctx);
 	if (ctx->pagein_file_out)
 		fput(ctx->pagein_file_out);
@@ -127,6 +128,7 @@ void rst_context_release(cpt_context_t *ctx)
 		free_page((unsigned long)ctx->vdso);
 	if (ctx->objcount)
 		eprintk_ctx("%d objects leaked\n", ctx->objcount);
+	cpt_object_release_hash(ctx);
 	kfree(ctx);
 
 	spin_lock(&cpt_context_lock);
@@ -198,6 +200,7 @@ static int rst_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 	int err = 0;
 	cpt_context_t *ctx;
 	struct file *dfile = NULL;
+	struct cpt_stat_mark sm;
 
 	unlock_kernel();
 
@@ -359,6 +362,20 @@ static int rst_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 	case CPT_ITER:
 		err = rst_iteration(ctx);
 		break;
+	case CPT_SET_POSTCOPY:
+		if (ctx->ctx_state > 0) {
+			err = -EBUSY;
+			break;
+		}
+		ctx->postcopy = !!arg;
+		break;
+	case CPT_SET_INCREMENTAL:
+		if (ctx->ctx_state > 0) {
+			err = -EBUSY;
+			break;
+		}
+		ctx->incremental = !!arg;
+		break;
 #endif
 	case CPT_SET_LOCKFD:
 	case CPT_SET_LOCKFD2:
@@ -426,6 +443,9 @@ static int rst_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 		rst_iteration(ctx);
 #endif
 		err = vps_rst_undump(ctx);
+#ifdef CONFIG_VZ_CHECKPOINT_ITER
+		rst_pager_seal(ctx, err);
+#endif
 		if (err) {
 			int ret;
 
@@ -446,10 +466,17 @@ static int rst_ioctl(struct inode * inode, struct file * file, unsigned int cmd,
 			err = -ENOENT;
 			break;
 		}
+		cpt_stat_start(&sm, ctx);
 		err = rst_resume(ctx);
+		cpt_stat_end(CPT_STAT_RESUME, &sm, ctx);
 		if (!err)
 			ctx->ctx_state = CPT_CTX_IDLE;
 		break;
+	case CPT_GET_STATS:
+		if (copy_to_user((void __user *)arg, &ctx->stats,
+				 sizeof(struct cpt_stats)))
+			err = -EFAULT;
+		break;
 	case CPT_KILL:
 		if (!ctx->ctx_state) {
 			err = -ENOENT;
@@ -571,6 +598,9 @@ static int __init init_rst(void)
 
 	proc_ent->read_proc = proc_read;
 	proc_ent->data = NULL;
+#ifdef CONFIG_VZ_CHECKPOINT_ITER
+	rst_pagein_init();
+#endif
 	return 0;
 
 err_out:
@@ -584,6 +614,9 @@ module_init(init_rst);
 
 static void __exit exit_rst(void)
 {
+#ifdef CONFIG_VZ_CHECKPOINT_ITER
+	rst_pagein_exit();
+#endif
 	remove_proc_entry("rst", NULL);
 	unregister_sysctl_table(ctl_header);
 
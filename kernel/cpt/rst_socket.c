@@ -17,6 +17,7 @@
 #include <linux/slab.h>
 #include <linux/file.h>
 #include <linux/mm.h>
+#include <linux/highmem.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
 #include <linux/namei.h>
@@ -55,6 +56,7 @@ static int setup_sock_common(struct sock *sk, struct cpt_sock_image *si,
 		sk->sk_socket->state = si->cpt_sstate;
 	}
 	sk->sk_reuse = si->cpt_reuse;
+	sk->sk_reuseport = !!(si->cpt_sockflags & CPT_SOCK_REUSEPORT);
 	sk->sk_shutdown = si->cpt_shutdown;
 	sk->sk_userlocks = si->cpt_userlocks;
 	sk->sk_no_check = si->cpt_no_check;
@@ -1242,6 +1244,68 @@ static void fix_tcp_skb_cb_flags(struct sk_buff *skb, int tcp,
 	}
 }
 
+/*
+ * The data of big TCP skbs is put into page frags instead of one high
+ * order linear area, and the image is read right into them. Queued TCP
+ * data is never pulled linearly, other sockets keep linear skbs.
+ */
+static struct sk_buff *rst_alloc_skb(struct sock *sk, struct cpt_skb_image *v)
+{
+	struct sk_buff *skb;
+	int i, nr;
+
+	nr = DIV_ROUND_UP(v->cpt_len, PAGE_SIZE);
+	if (sk->sk_type != SOCK_STREAM || sk->sk_protocol != IPPROTO_TCP ||
+	    v->cpt_len <= PAGE_SIZE || nr > MAX_SKB_FRAGS) {
+		skb = alloc_skb(v->cpt_len + v->cpt_hspace + v->cpt_tspace,
+				GFP_KERNEL);
+		if (skb) {
+			skb_reserve(skb, v->cpt_hspace);
+			skb_put(skb, v->cpt_len);
+		}
+		return skb;
+	}
+
+	skb = alloc_skb(v->cpt_hspace, GFP_KERNEL);
+	if (skb == NULL)
+		return NULL;
+	skb_reserve(skb, v->cpt_hspace);
+
+	for (i = 0; i < nr; i++) {
+		int size = min_t(int, v->cpt_len - i * PAGE_SIZE, PAGE_SIZE);
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		if (page == NULL) {
+			kfree_skb(skb);
+			return NULL;
+		}
+		skb_fill_page_desc(skb, i, page, 0, size);
+		skb->len += size;
+		skb->data_len += size;
+		skb->truesize += PAGE_SIZE;
+	}
+	return skb;
+}
+
+static int rst_skb_data(struct sk_buff *skb, loff_t pos,
+			struct cpt_context *ctx)
+{
+	int len = (skb->data - skb->head) + skb_headlen(skb);
+	int i, err;
+
+	err = ctx->pread(skb->head, len, ctx, pos);
+	for (i = 0; i < skb_shinfo(skb)->nr_frags && !err; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+		pos += len;
+		len = frag->size;
+		err = ctx->pread(kmap(frag->page) + frag->page_offset, len,
+				 ctx, pos);
+		kunmap(frag->page);
+	}
+	return err;
+}
+
 struct sk_buff * rst_skb(struct sock *sk, loff_t *pos_p, __u32 *owner,
 			 __u32 *queue, struct cpt_context *ctx)
 {
@@ -1263,11 +1327,9 @@ struct sk_buff * rst_skb(struct sock *sk, loff_t *pos_p, __u32 *owner,
 	if (queue)
 		*queue = v.cpt_queue;
 
-	skb = alloc_skb(v.cpt_len + v.cpt_hspace + v.cpt_tspace, GFP_KERNEL);
+	skb = rst_alloc_skb(sk, &v);
 	if (skb == NULL)
 		return ERR_PTR(-ENOMEM);
-	skb_reserve(skb, v.cpt_hspace);
-	skb_put(skb, v.cpt_len);
 #ifdef NET_SKBUFF_DATA_USES_OFFSET
 	skb->transport_header = v.cpt_h;
 	skb->network_header = v.cpt_nh;
@@ -1335,7 +1397,7 @@ struct sk_buff * rst_skb(struct sock *sk, loff_t *pos_p, __u32 *owner,
 					return ERR_PTR(-EINVAL);
 				}
 
-				err = ctx->pread(skb->head, u.b.cpt_size, ctx, pos+u.b.cpt_hdrlen);
+				err = rst_skb_data(skb, pos+u.b.cpt_hdrlen, ctx);
 				if (err) {
 					kfree_skb(skb);
 					return ERR_PTR(err);
@@ -198,6 +198,10 @@ struct file * rst_sysv_shm_itself(loff_t pos, struct cpt_context *ctx)
 	revert_creds(curr_cred);
 	if (!IS_ERR(file)) {
 		err = fixup_shm(file, &u.shmi);
+		/* before the data, the pages are placed by the policy */
+		if (err != -EEXIST && cpt_object_has(&u.shmi, cpt_flags))
+			sysvipc_shm_set_interleave(file,
+				u.shmi.cpt_flags & CPT_SHM_INTERLEAVE);
 		if (err != -EEXIST && dpos < epos) {
 			err = fixup_shm_data(file, dpos, epos, ctx);
 			if (err) {
@@ -59,7 +59,7 @@ static int restore_one_bc(struct cpt_beancounter_image *v,
 	}
 	if (bc == NULL)
 		return -ENOMEM;
-	obj->o_obj = bc;
+	cpt_obj_setobj(obj, bc, ctx);
 
 	if (ctx->image_version < CPT_VERSION_18 &&
 			CPT_VERSION_MINOR(ctx->image_version) < 1)
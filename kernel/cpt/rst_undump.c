@@ -18,6 +18,8 @@
 #include <linux/file.h>
 #include <linux/fs_struct.h>
 #include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
 #include <linux/errno.h>
 #include <linux/pagemap.h>
 #include <linux/poll.h>
@@ -62,6 +64,8 @@ struct thr_context {
 	int error;
 	struct cpt_context *ctx;
 	cpt_object_t	*tobj;
+	struct task_struct *tsk;
+	struct list_head list;
 };
 
 static int rst_clone_children(cpt_object_t *obj, struct cpt_context *ctx);
@@ -92,6 +96,7 @@ static int vps_rst_veinfo(struct cpt_task_image *init_ti, struct cpt_context *ct
 	ns->shm_ctlall = i->shm_ctl_all ? : 0xFFFFFFFFU;
 	ns->shm_ctlmax = i->shm_ctl_max ? : 0xFFFFFFFFU;
 	ns->shm_ctlmni = i->shm_ctl_mni;
+	ns->shm_interleave = i->shm_interleave;
 
 	ns->msg_ctlmax = i->msg_ctl_max;
 	ns->msg_ctlmni = i->msg_ctl_mni;
@@ -129,6 +134,7 @@ static int vps_rst_veinfo(struct cpt_task_image *init_ti, struct cpt_context *ct
 
 	if (cpt_object_has(i, aio_max_nr))
 		ve->aio_max_nr = i->aio_max_nr;
+	ve->timer_slack_ns = i->timer_slack_ns;
 
 	if (cpt_object_has(i, cpt_ve_bcap))
 		memcpy(&ve->ve_cap_bset, &i->cpt_ve_bcap,
@@ -276,6 +282,7 @@ static int hook(void *arg)
 	struct cpt_context *ctx;
 	cpt_object_t *tobj;
 	struct cpt_task_image *ti;
+	struct cpt_stat_mark m;
 	int err = 0;
 	int exiting = 0;
 
@@ -287,6 +294,8 @@ static int hook(void *arg)
 	tobj = thr_ctx->tobj;
 	ti = tobj->o_image;
 
+	rst_tree_lock(ctx);
+
 	current->fs->umask = 0;
 
 	if (ti->cpt_pid == 1) {
@@ -356,17 +365,24 @@ static int hook(void *arg)
 			goto out;
 		}
 
-		if ((err = rst_restore_net(ctx)) != 0) {
+		cpt_stat_start(&m, ctx);
+		err = rst_restore_net(ctx);
+		cpt_stat_end(CPT_STAT_RST_NET, &m, ctx);
+		if (err) {
 			eprintk_ctx("rst_restore_net: %d\n", err);
 			goto out;
 		}
 
+		cpt_stat_start(&m, ctx);
 		err = rst_sockets(ctx);
+		cpt_stat_end(CPT_STAT_RST_SOCKETS, &m, ctx);
 		if (err) {
 			eprintk_ctx("rst_sockets: %d\n", err);
 			goto out;
 		}
+		cpt_stat_start(&m, ctx);
 		err = rst_sysv_ipc(ctx);
+		cpt_stat_end(CPT_STAT_RST_SYSV, &m, ctx);
 		if (err) {
 			eprintk_ctx("rst_sysv_ipc: %d\n", err);
 			goto out;
@@ -383,7 +399,10 @@ static int hook(void *arg)
 		goto out;
 	}
 
-	if ((err = rst_mm_complete(ti, ctx)) != 0) {
+	cpt_stat_start(&m, ctx);
+	err = rst_mm_complete(ti, ctx);
+	cpt_stat_end(CPT_STAT_RST_MM, &m, ctx);
+	if (err) {
 		eprintk_ctx("rst_mm: %d\n", err);
 		goto out;
 	}
@@ -510,7 +529,10 @@ static int hook(void *arg)
 		goto out;
 	}
 
-	if ((err = rst_files(ti, ctx)) != 0) {
+	cpt_stat_start(&m, ctx);
+	err = rst_files(ti, ctx);
+	cpt_stat_end(CPT_STAT_RST_FILES, &m, ctx);
+	if (err) {
 		eprintk_ctx("rst_files: %d\n", err);
 		if (err == -EMFILE) {
 			eprintk(KERN_ERR "rst_files: to many open files. \
@@ -554,7 +576,10 @@ static int hook(void *arg)
 			goto out;
 		}
 #endif
-		if ((err = rst_sockets_complete(ctx)) != 0) {
+		cpt_stat_start(&m, ctx);
+		err = rst_sockets_complete(ctx);
+		cpt_stat_end(CPT_STAT_RST_SOCKETS, &m, ctx);
+		if (err) {
 			eprintk_ctx("rst_sockets_complete: %d\n", err);
 			goto out_sock;
 		}
@@ -594,6 +619,13 @@ out_sock:
 	if (err && ti->cpt_pid == 1)
 		rst_put_delayed_sockets(ctx);
 
+	if (err) {
+		/* Nobody is to wait for mms of this subtree */
+		ctx->rst_failed = 1;
+		wake_up_all(&ctx->rst_wait);
+	}
+	rst_tree_unlock(ctx);
+
 	thr_ctx->error = err;
 	complete(&thr_ctx->task_done);
 
@@ -681,11 +713,11 @@ static int rst_basic_init_task(cpt_object_t *obj, struct cpt_context *ctx)
 
 static int make_baby(cpt_object_t *cobj,
 		     struct cpt_task_image *pi,
+		     struct thr_context *thr_ctx,
 		     struct cpt_context *ctx)
 {
 	unsigned long flags;
 	struct cpt_task_image *ci = cobj->o_image;
-	struct thr_context thr_ctx;
 	struct task_struct *tsk;
 	pid_t pid;
 	struct fs_struct *tfs = NULL;
@@ -705,11 +737,11 @@ static int make_baby(cpt_object_t *cobj,
 		}
 	}
 
-	thr_ctx.ctx = ctx;
-	thr_ctx.error = 0;
-	init_completion(&thr_ctx.init_complete);
-	init_completion(&thr_ctx.task_done);
-	thr_ctx.tobj = cobj;
+	thr_ctx->ctx = ctx;
+	thr_ctx->error = 0;
+	init_completion(&thr_ctx->init_complete);
+	init_completion(&thr_ctx->task_done);
+	thr_ctx->tobj = cobj;
 
 #if 0
 	set_task_ubs(ci, ctx);
@@ -724,7 +756,7 @@ static int make_baby(cpt_object_t *cobj,
 		spin_unlock(&tfs->lock);
 		current->fs = tfs;
 	}
-	pid = local_kernel_thread(hook, &thr_ctx, flags, ci->cpt_pid);
+	pid = local_kernel_thread(hook, thr_ctx, flags, ci->cpt_pid);
 	if (tfs) {
 		current->fs = NULL;
 		spin_lock(&tfs->lock);
@@ -743,8 +775,8 @@ static int make_baby(cpt_object_t *cobj,
 	if (tsk == NULL)
 		return -ESRCH;
 	cpt_obj_setobj(cobj, tsk, ctx);
-	thr_ctx.tobj = cobj;
-	wait_for_completion(&thr_ctx.init_complete);
+	thr_ctx->tsk = tsk;
+	wait_for_completion(&thr_ctx->init_complete);
 	wait_task_inactive(cobj->o_obj, 0);
 	rst_basic_init_task(cobj, ctx);
 
@@ -757,22 +789,38 @@ static int make_baby(cpt_object_t *cobj,
 	}
 
 	wake_up_process(tsk);
-	wait_for_completion(&thr_ctx.task_done);
+	return 0;
+}
+
+static int wait_baby(struct thr_context *thr_ctx, struct cpt_context *ctx)
+{
+	struct task_struct *tsk = thr_ctx->tsk;
+
+	rst_tree_unlock(ctx);
+	wait_for_completion(&thr_ctx->task_done);
 	wait_task_inactive(tsk, 0);
+	rst_tree_lock(ctx);
 
-	if (thr_ctx.error) {
+	if (thr_ctx->error) {
 		put_task_struct(tsk);
-		cpt_obj_setobj(cobj, NULL, ctx);
+		cpt_obj_setobj(thr_ctx->tobj, NULL, ctx);
 	}
 
-	return thr_ctx.error;
+	return thr_ctx->error;
 }
 
+/*
+ * A child whose subtree shares nothing with the rest of the tree is left
+ * to restore itself, while we go on with its siblings. Others are
+ * restored one by one, as before.
+ */
 static int rst_clone_children(cpt_object_t *obj, struct cpt_context *ctx)
 {
-	int err = 0;
+	int err = 0, err2;
 	struct cpt_task_image *ti = obj->o_image;
 	cpt_object_t *cobj;
+	struct thr_context *thr_ctx, *tmp;
+	LIST_HEAD(running);
 
 	for_each_object(cobj, CPT_OBJ_TASK) {
 		struct cpt_task_image *ci = cobj->o_image;
@@ -781,13 +829,209 @@ static int rst_clone_children(cpt_object_t *obj, struct cpt_context *ctx)
 		if ((ci->cpt_rppid == ti->cpt_pid && ci->cpt_tgid == ci->cpt_pid) ||
 		    (ci->cpt_leader == ti->cpt_pid &&
 		     ci->cpt_tgid != ci->cpt_pid && ci->cpt_pid != 1)) {
-			err = make_baby(cobj, ti, ctx);
+			thr_ctx = kmalloc(sizeof(*thr_ctx), GFP_KERNEL);
+			if (thr_ctx == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+			err = make_baby(cobj, ti, thr_ctx, ctx);
+			if (err) {
+				eprintk_ctx("make_baby: %d\n", err);
+				kfree(thr_ctx);
+				break;
+			}
+			if (!(cobj->o_flags & CPT_TASK_SHARING)) {
+				list_add_tail(&thr_ctx->list, &running);
+				continue;
+			}
+			err = wait_baby(thr_ctx, ctx);
+			kfree(thr_ctx);
 			if (err) {
 				eprintk_ctx("make_baby: %d\n", err);
-				return err;
+				break;
 			}
 		}
 	}
+
+	list_for_each_entry_safe(thr_ctx, tmp, &running, list) {
+		err2 = wait_baby(thr_ctx, ctx);
+		if (err2) {
+			eprintk_ctx("make_baby: %d\n", err2);
+			if (!err)
+				err = err2;
+		}
+		list_del(&thr_ctx->list);
+		kfree(thr_ctx);
+	}
+	return err;
+}
+
+/*
+ * Mark tasks which may not be restored concurrently with their siblings:
+ * those whose subtree has a task sharing mm, files, fs, signal, sighand
+ * or semundo with a task outside of the subtree. For every two tasks
+ * sharing an object, this is the path from both of them up to their
+ * common ancestor. o_parent of a task object is set to its parent in
+ * the restore tree.
+ */
+#define RST_TREF_BITS	12
+
+struct rst_tref
+{
+	struct hlist_node	hash;
+	loff_t			key;
+	cpt_object_t		*obj;
+};
+
+struct rst_tref_table
+{
+	struct hlist_head	head[1 << RST_TREF_BITS];
+	struct rst_tref		*refs;
+	int			nr;
+};
+
+static cpt_object_t *rst_tref_find(struct rst_tref_table *t, loff_t key)
+{
+	struct rst_tref *r;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(r, n, &t->head[hash_64(key, RST_TREF_BITS)], hash)
+		if (r->key == key)
+			return r->obj;
+	return NULL;
+}
+
+/* Returns the task which was seen with @key first, or NULL */
+static cpt_object_t *rst_tref_add(struct rst_tref_table *t, loff_t key,
+				  cpt_object_t *obj)
+{
+	struct rst_tref *r;
+	cpt_object_t *first;
+
+	first = rst_tref_find(t, key);
+	if (first)
+		return first;
+	r = &t->refs[t->nr++];
+	r->key = key;
+	r->obj = obj;
+	hlist_add_head(&r->hash, &t->head[hash_64(key, RST_TREF_BITS)]);
+	return NULL;
+}
+
+static int rst_task_depth(cpt_object_t *obj, int max)
+{
+	int depth = 0;
+
+	while ((obj = obj->o_parent) != NULL && depth < max)
+		depth++;
+	return depth;
+}
+
+static void rst_mark_sharing(cpt_object_t *a, cpt_object_t *b, int max)
+{
+	int da = rst_task_depth(a, max);
+	int db = rst_task_depth(b, max);
+
+	for (; da > db; da--, a = a->o_parent)
+		a->o_flags |= CPT_TASK_SHARING;
+	for (; db > da; db--, b = b->o_parent)
+		b->o_flags |= CPT_TASK_SHARING;
+	for (; a != b && da >= 0; da--) {
+		a->o_flags |= CPT_TASK_SHARING;
+		b->o_flags |= CPT_TASK_SHARING;
+		a = a->o_parent;
+		b = b->o_parent;
+	}
+}
+
+static int rst_find_sharing(struct cpt_context *ctx)
+{
+	struct rst_tref_table *t;
+	cpt_object_t *obj, *first;
+	int i, nr = 0;
+
+	for_each_object(obj, CPT_OBJ_TASK)
+		nr++;
+
+	t = vmalloc(sizeof(*t));
+	if (t == NULL)
+		return -ENOMEM;
+	t->refs = vmalloc(sizeof(struct rst_tref) * nr * 7);
+	if (t->refs == NULL) {
+		vfree(t);
+		return -ENOMEM;
+	}
+	t->nr = 0;
+	for (i = 0; i < (1 << RST_TREF_BITS); i++)
+		INIT_HLIST_HEAD(&t->head[i]);
+
+	/* pids are keyed negative, image positions are not */
+	for_each_object(obj, CPT_OBJ_TASK) {
+		struct cpt_task_image *ti = obj->o_image;
+
+		rst_tref_add(t, -(loff_t)ti->cpt_pid - 2, obj);
+	}
+
+	for_each_object(obj, CPT_OBJ_TASK) {
+		struct cpt_task_image *ti = obj->o_image;
+		pid_t ppid = 0;
+
+		obj->o_parent = NULL;
+		obj->o_flags &= ~CPT_TASK_SHARING;
+		if (ti->cpt_tgid == ti->cpt_pid)
+			ppid = ti->cpt_rppid;
+		else if (ti->cpt_pid != 1)
+			ppid = ti->cpt_leader;
+		if (ppid && ppid != ti->cpt_pid)
+			obj->o_parent = rst_tref_find(t, -(loff_t)ppid - 2);
+	}
+
+	for_each_object(obj, CPT_OBJ_TASK) {
+		struct cpt_task_image *ti = obj->o_image;
+		loff_t shared[] = { ti->cpt_mm, ti->cpt_files, ti->cpt_fs,
+				    ti->cpt_signal, ti->cpt_sighand,
+				    ti->cpt_sysvsem_undo };
+
+		for (i = 0; i < ARRAY_SIZE(shared); i++) {
+			if (shared[i] == CPT_NULL)
+				continue;
+			first = rst_tref_add(t, shared[i], obj);
+			if (first)
+				rst_mark_sharing(obj, first, nr);
+		}
+	}
+
+	vfree(t->refs);
+	vfree(t);
+	return 0;
+}
+
+/*
+ * An mm at @pos is still to be restored by a task of another subtree.
+ * Tasks of our own subtree are not forked until we are done.
+ */
+int rst_mm_pending(loff_t pos, struct cpt_context *ctx)
+{
+	cpt_object_t *obj, *self = NULL, *p;
+	int max = 0;
+
+	for_each_object(obj, CPT_OBJ_TASK) {
+		if (obj->o_obj == current)
+			self = obj;
+		max++;
+	}
+
+	for_each_object(obj, CPT_OBJ_TASK) {
+		struct cpt_task_image *ti = obj->o_image;
+		int depth = 0;
+
+		if (ti->cpt_mm != pos)
+			continue;
+		for (p = obj; p && p != self && depth <= max; p = p->o_parent)
+			depth++;
+		if (p == NULL)
+			return 1;
+	}
 	return 0;
 }
 
@@ -833,7 +1077,7 @@ static int read_task_images(struct cpt_context *ctx)
 			return err;
 		start += ti->cpt_next;
 	}
-	return 0;
+	return rst_find_sharing(ctx);
 }
 
 
@@ -915,6 +1159,10 @@ int vps_rst_undump(struct cpt_context *ctx)
 {
 	int err;
 	unsigned long umask;
+	struct cpt_stat_mark um, m;
+
+	cpt_stat_reset(ctx);
+	cpt_stat_start(&um, ctx);
 
 	set_ubc_unlimited(ctx, get_exec_ub_top());
 
@@ -946,8 +1194,11 @@ int vps_rst_undump(struct cpt_context *ctx)
 	if (err == 0)
 		err = rst_open_pram(ctx);
 
-	if (err == 0)
+	if (err == 0) {
+		cpt_stat_start(&m, ctx);
 		err = rst_undump_ubc(ctx);
+		cpt_stat_end(CPT_STAT_RST_UBC, &m, ctx);
+	}
 
 	if (err == 0)
 		err = vps_rst_restore_tree(ctx);
@@ -956,6 +1207,7 @@ int vps_rst_undump(struct cpt_context *ctx)
 		err = rst_restore_process(ctx);
 
 	current->fs->umask = umask;
+	cpt_stat_end(CPT_STAT_UNDUMP, &um, ctx);
 
         return err;
 }
@@ -113,6 +113,9 @@ struct cpuset {
 	/* for custom sched domain */
 	int relax_domain_level;
 
+	/* the only node of tasks and memory, see update_home_node() */
+	int home_node;
+
 	/* used for walking a cpuset heirarchy */
 	struct list_head stack_list;
 };
@@ -194,8 +197,12 @@ static inline int is_spread_slab(const struct cpuset *cs)
 	return test_bit(CS_SPREAD_SLAB, &cs->flags);
 }
 
+#define CPUSET_HOME_NODE_NONE	(-1)
+#define CPUSET_HOME_NODE_AUTO	(-2)
+
 static struct cpuset top_cpuset = {
 	.flags = ((1 << CS_CPU_EXCLUSIVE) | (1 << CS_MEM_EXCLUSIVE)),
+	.home_node = CPUSET_HOME_NODE_NONE,
 };
 
 /*
@@ -900,6 +907,9 @@ static int update_cpumask(struct cpuset *cs,
 		return 0;
 	}
 
+	/* an explicit mask ends home node placement */
+	cs->home_node = CPUSET_HOME_NODE_NONE;
+
 	if (!cpumask_empty(cs->cpuset_cpus_allowed) && !update_allowed)
 		cpuset_cpus_allowed = cs->cpuset_cpus_allowed;
 
@@ -1159,6 +1169,8 @@ static int update_nodemask(struct cpuset *cs,
 		return 0;
 	}
 
+	cs->home_node = CPUSET_HOME_NODE_NONE;
+
 	if (!nodes_empty(cs->cpuset_mems_allowed) && !update_allowed)
 		cpuset_mems_allowed = &cs->cpuset_mems_allowed;
 
@@ -1205,6 +1217,128 @@ done:
 	return retval;
 }
 
+/* node with most of the pages of the beancounter, else with most free */
+static int cpuset_pick_home_node(struct cpuset *cs, const nodemask_t *mems,
+				 const struct cpumask *cpus)
+{
+	struct user_beancounter *ub;
+	unsigned long pages, best_pages = 0;
+	int node, best = -1;
+
+	ub = get_cpuset_beancounter(cs);
+#ifdef CONFIG_MEMORY_GANGS
+	if (ub) {
+		struct zone *zone;
+		enum lru_list lru;
+
+		for_each_node_mask(node, *mems) {
+			if (!cpumask_intersects(cpumask_of_node(node), cpus))
+				continue;
+			pages = 0;
+			for_each_populated_zone(zone) {
+				if (zone_to_nid(zone) != node)
+					continue;
+				for_each_lru(lru)
+					pages += mem_zone_gang(get_ub_gs(ub),
+						zone)->lruvec.nr_pages[lru];
+			}
+			if (pages > best_pages) {
+				best = node;
+				best_pages = pages;
+			}
+		}
+	}
+#endif
+	if (ub)
+		put_beancounter_longterm(ub);
+	if (best >= 0)
+		return best;
+
+	for_each_node_mask(node, *mems) {
+		if (!cpumask_intersects(cpumask_of_node(node), cpus))
+			continue;
+		pages = node_page_state(node, NR_FREE_PAGES);
+		if (best < 0 || pages > best_pages) {
+			best = node;
+			best_pages = pages;
+		}
+	}
+	return best;
+}
+
+/*
+ * Keeps tasks of the cpuset on the cpus of one node and their memory
+ * there, within the cpus and mems allowed to the cpuset. When the home
+ * node changes, pages of the beancounter of the cpuset are moved to the
+ * new one in the background by gangs migration. The node is picked by
+ * the kernel for CPUSET_HOME_NODE_AUTO, CPUSET_HOME_NODE_NONE spreads
+ * the cpuset over all it is allowed again.
+ *
+ * Call with cgroup_mutex held.
+ */
+static int update_home_node(struct cpuset *cs, s64 val)
+{
+	const struct cpumask *allowed_cpus = cpu_active_mask;
+	const nodemask_t *allowed_mems = &node_states[N_HIGH_MEMORY];
+	struct user_beancounter *ub;
+	nodemask_t oldmems, mems;
+	cpumask_var_t cpus;
+	int node = val;
+	int retval;
+
+	if (cs == &top_cpuset)
+		return -EACCES;
+
+	if (val < CPUSET_HOME_NODE_AUTO || val >= nr_node_ids)
+		return -EINVAL;
+
+	if (!cpumask_empty(cs->cpuset_cpus_allowed))
+		allowed_cpus = cs->cpuset_cpus_allowed;
+	if (!nodes_empty(cs->cpuset_mems_allowed))
+		allowed_mems = &cs->cpuset_mems_allowed;
+
+	if (!alloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	if (node == CPUSET_HOME_NODE_NONE) {
+		cpumask_copy(cpus, allowed_cpus);
+		mems = *allowed_mems;
+	} else {
+		if (node == CPUSET_HOME_NODE_AUTO)
+			node = cpuset_pick_home_node(cs, allowed_mems,
+						     allowed_cpus);
+		retval = -EINVAL;
+		if (node < 0 || !node_isset(node, *allowed_mems))
+			goto out;
+		cpumask_and(cpus, cpumask_of_node(node), allowed_cpus);
+		if (cpumask_empty(cpus))
+			goto out;
+		mems = nodemask_of_node(node);
+	}
+
+	guarantee_online_mems(cs, &oldmems);
+
+	retval = update_cpumask(cs, cpus, 0);
+	if (!retval)
+		retval = update_nodemask(cs, &mems, 0);
+	if (retval)
+		goto out;
+
+	cs->home_node = node;
+	if (node < 0 || nodes_equal(oldmems, mems))
+		goto out;
+
+	ub = get_cpuset_beancounter(cs);
+	if (ub) {
+		cancel_gangs_migration(get_ub_gs(ub));
+		schedule_gangs_migration(get_ub_gs(ub), &oldmems, &mems);
+		put_beancounter_longterm(ub);
+	}
+out:
+	free_cpumask_var(cpus);
+	return retval;
+}
+
 int current_cpuset_is_being_rebound(void)
 {
 	return task_cs(current) == cpuset_being_rebound;
@@ -1536,6 +1670,7 @@ typedef enum {
 	FILE_MEM_HARDWALL,
 	FILE_SCHED_LOAD_BALANCE,
 	FILE_SCHED_RELAX_DOMAIN_LEVEL,
+	FILE_HOME_NODE,
 	FILE_MEMORY_PRESSURE_ENABLED,
 	FILE_MEMORY_PRESSURE,
 	FILE_SPREAD_PAGE,
@@ -1606,6 +1741,9 @@ static int cpuset_write_s64(struct cgroup *cgrp, struct cftype *cft, s64 val)
 	case FILE_SCHED_RELAX_DOMAIN_LEVEL:
 		retval = update_relax_domain_level(cs, val);
 		break;
+	case FILE_HOME_NODE:
+		retval = update_home_node(cs, val);
+		break;
 	default:
 		retval = -EINVAL;
 		break;
@@ -1870,6 +2008,8 @@ static s64 cpuset_read_s64(struct cgroup *cont, struct cftype *cft)
 	switch (type) {
 	case FILE_SCHED_RELAX_DOMAIN_LEVEL:
 		return cs->relax_domain_level;
+	case FILE_HOME_NODE:
+		return cs->home_node;
 	default:
 		BUG();
 	}
@@ -1961,6 +2101,13 @@ static struct cftype files[] = {
 		.private = FILE_SCHED_RELAX_DOMAIN_LEVEL,
 	},
 
+	{
+		.name = "home_node",
+		.read_s64 = cpuset_read_s64,
+		.write_s64 = cpuset_write_s64,
+		.private = FILE_HOME_NODE,
+	},
+
 	{
 		.name = "memory_migrate",
 		.read_u64 = cpuset_read_u64,
@@ -2099,6 +2246,7 @@ static struct cgroup_subsys_state *cpuset_create(
 	nodes_clear(cs->ve_mems_allowed);
 	fmeter_init(&cs->fmeter);
 	cs->relax_domain_level = -1;
+	cs->home_node = CPUSET_HOME_NODE_NONE;
 
 	cs->parent = parent;
 	number_of_cpusets++;
@@ -36,6 +36,7 @@
 #include <linux/ftrace_event.h>
 #include <linux/mm_types.h>
 #include <linux/mman.h>
+#include <linux/ve.h>
 
 #include "internal.h"
 
@@ -3323,6 +3324,7 @@ static struct file *perf_fget_light(int fd, int *fput_needed)
 static int perf_event_set_output(struct perf_event *event,
 				 struct perf_event *output_event);
 static int perf_event_set_filter(struct perf_event *event, void __user *arg);
+static int perf_event_set_ve(struct perf_event *event, u32 ve_id);
 
 static long perf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
@@ -3380,6 +3382,9 @@ static long perf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case PERF_EVENT_IOC_SET_FILTER:
 		return perf_event_set_filter(event, (void __user *)arg);
 
+	case PERF_EVENT_IOC_SET_VE:
+		return perf_event_set_ve(event, arg);
+
 	default:
 		return -ENOTTY;
 	}
@@ -4965,6 +4970,42 @@ static void perf_log_throttle(struct perf_event *event, int enable)
 	perf_output_end(&handle);
 }
 
+/*
+ * VE scoping of samples: checked on overflow against the VE current runs
+ * in, so a host wide event can sample one container only, without the
+ * context switch hooks cgroup events need.
+ */
+#ifdef CONFIG_VE
+static inline bool perf_event_ve_match(struct perf_event *event)
+{
+	return event->ve_id == PERF_EVENT_VE_ANY ||
+		event->ve_id == get_exec_env()->veid;
+}
+
+static int perf_event_set_ve(struct perf_event *event, u32 ve_id)
+{
+	struct perf_event *child;
+
+	mutex_lock(&event->child_mutex);
+	event->ve_id = ve_id;
+	list_for_each_entry(child, &event->child_list, child_list)
+		child->ve_id = ve_id;
+	mutex_unlock(&event->child_mutex);
+
+	return 0;
+}
+#else
+static inline bool perf_event_ve_match(struct perf_event *event)
+{
+	return true;
+}
+
+static int perf_event_set_ve(struct perf_event *event, u32 ve_id)
+{
+	return -EINVAL;
+}
+#endif
+
 /*
  * Generic event overflow handling, sampling.
  */
@@ -5010,6 +5051,13 @@ static int __perf_event_overflow(struct perf_event *event,
 			perf_adjust_period(event, delta, hwc->last_period, true);
 	}
 
+	/*
+	 * The period is accounted above for a sample out of the VE too, so
+	 * that the frequency stays right, only the output is left out.
+	 */
+	if (!perf_event_ve_match(event))
+		return ret;
+
 	/*
 	 * XXX event_limit might not quite work as expected on inherited
 	 * events
@@ -6270,6 +6318,10 @@ perf_event_alloc(struct perf_event_attr *attr, int cpu,
 	event->oncpu		= -1;
 
 	event->parent		= parent_event;
+#ifdef CONFIG_VE
+	event->ve_id		= parent_event ? parent_event->ve_id :
+						 PERF_EVENT_VE_ANY;
+#endif
 
 	event->ns		= get_pid_ns(task_active_pid_ns(current));
 	event->id		= atomic64_inc_return(&perf_event_id);
@@ -18,7 +18,12 @@
 #include <linux/pid_namespace.h>
 #include <linux/syscalls.h>
 #include <linux/fairsched.h>
+#include <linux/vzcalluser.h>
+#include <linux/kernel_stat.h>
+#include <linux/vmalloc.h>
 #include <linux/uaccess.h>
+#include <linux/ve.h>
+#include <linux/ve_proto.h>
 
 static struct cgroup *fairsched_root, *fairsched_host;
 
@@ -223,6 +228,25 @@ static int get_user_cpu_mask(unsigned long __user *user_mask_ptr, unsigned len,
 	return copy_from_user(new_mask, user_mask_ptr, len) ? -EFAULT : 0;
 }
 
+/* RPS steers packets of the devices of the VE to its CPUs only */
+static void fairsched_set_ve_cpus(unsigned int id, const struct cpumask *mask)
+{
+#ifdef CONFIG_RPS
+	struct ve_struct *ve;
+
+	ve = get_ve_by_id(id);
+	if (ve == NULL)
+		return;
+
+	ve->rps_pinned = 0;
+	smp_wmb();
+	cpumask_copy(&ve->rps_cpus, mask);
+	smp_wmb();
+	ve->rps_pinned = !cpumask_subset(cpu_online_mask, mask);
+	put_ve(ve);
+#endif
+}
+
 SYSCALL_DEFINE3(fairsched_cpumask, unsigned int, id, unsigned int, len,
 		unsigned long __user *, user_mask_ptr)
 {
@@ -255,6 +279,8 @@ SYSCALL_DEFINE3(fairsched_cpumask, unsigned int, id, unsigned int, len,
 		cgroup_lock();
 		retval = cgroup_set_cpumask(cgrp, new_mask);
 		cgroup_unlock();
+		if (retval == 0)
+			fairsched_set_ve_cpus(id, new_mask);
 	}
 
 	free_cpumask_var(new_mask);
@@ -384,6 +410,120 @@ int fairsched_move_task(int id, struct task_struct *tsk)
 }
 EXPORT_SYMBOL(fairsched_move_task);
 
+/* Pins the node against removal, put it with cgroup_kernel_close() */
+struct cgroup *fairsched_open_node(int id)
+{
+	return fairsched_open(id);
+}
+EXPORT_SYMBOL(fairsched_open_node);
+
+static void fairsched_fill_stat(struct vz_fairsched_stat *st,
+				struct cgroup *cgrp)
+{
+	struct kernel_cpustat kstat;
+	unsigned long avenrun[3], tmp;
+	u64 nr_throttled;
+	int i;
+
+	st->weight = FSCHWEIGHT_BASE / sched_cgroup_get_shares(cgrp);
+	st->rate = sched_cgroup_get_rate(cgrp);
+	st->nr_cpus = sched_cgroup_get_nr_cpus(cgrp);
+	st->nr_running = sched_cgroup_get_nr_running(cgrp);
+
+	cpu_cgroup_get_throttled(cgrp, &nr_throttled, &st->throttled_time);
+	st->nr_throttled = nr_throttled;
+
+	cpu_cgroup_get_stat(cgrp, &kstat);
+	st->user_jif = cputime64_to_clock_t(kstat.cpustat[USER]);
+	st->nice_jif = cputime64_to_clock_t(kstat.cpustat[NICE]);
+	st->system_jif = cputime64_to_clock_t(kstat.cpustat[SYSTEM]);
+
+	if (cpu_cgroup_get_avenrun(cgrp, avenrun))
+		memset(avenrun, 0, sizeof(avenrun));
+	for (i = 0; i < 3; i++) {
+		tmp = avenrun[i] + (FIXED_1/200);
+		st->avenrun[i].val_int = LOAD_INT(tmp);
+		st->avenrun[i].val_frac = LOAD_FRAC(tmp);
+	}
+}
+
+/*
+ * Binary counterpart of /proc/fairsched: fills up to *nr stats of the nodes
+ * visible from the current VE, sets *nr to the number of such nodes and
+ * returns the number of filled entries.
+ */
+int fairsched_get_stats(struct vz_fairsched_stat __user *buf,
+			unsigned int *nr)
+{
+	struct vz_fairsched_stat *stats;
+	struct cgroup **cgrps;
+	struct dentry *root, *dentry;
+	unsigned int i, nr_nodes = 0, len = *nr;
+	int id, err;
+
+	root = fairsched_root->dentry;
+	mutex_lock(&root->d_inode->i_mutex);
+
+	spin_lock(&dcache_lock);
+	list_for_each_entry(dentry, &root->d_subdirs, d_u.d_child) {
+		if (d_unhashed(dentry) || !dentry->d_inode ||
+				!S_ISDIR(dentry->d_inode->i_mode))
+			continue;
+		nr_nodes++;
+	}
+	spin_unlock(&dcache_lock);
+
+	len = min(len, nr_nodes);
+	err = -ENOMEM;
+	stats = vmalloc(max(len, 1U) * sizeof(*stats));
+	cgrps = vmalloc(max(len, 1U) * sizeof(*cgrps));
+	if (stats == NULL || cgrps == NULL)
+		goto out;
+
+	/* nodes can't go away while the root is locked */
+	i = nr_nodes = 0;
+	spin_lock(&dcache_lock);
+	list_for_each_entry_reverse(dentry, &root->d_subdirs, d_u.d_child) {
+		if (d_unhashed(dentry) || !dentry->d_inode ||
+				!S_ISDIR(dentry->d_inode->i_mode))
+			continue;
+		id = fairsched_node_id(dentry->d_name.name);
+		if (id < 0)
+			continue;
+		if (!ve_accessible_veid(id, get_exec_env()->veid))
+			continue;
+		nr_nodes++;
+		if (i == len)
+			continue;
+		memset(stats + i, 0, sizeof(*stats));
+		stats[i].id = id;
+		cgrps[i++] = dentry->d_fsdata; /* __d_cgrp */
+	}
+	spin_unlock(&dcache_lock);
+
+	len = i;
+	for (i = 0; i < len; i++)
+		fairsched_fill_stat(stats + i, cgrps[i]);
+
+	mutex_unlock(&root->d_inode->i_mutex);
+
+	err = -EFAULT;
+	if (copy_to_user(buf, stats, len * sizeof(*stats)))
+		goto out_free;
+
+	*nr = nr_nodes;
+	err = len;
+	goto out_free;
+
+out:
+	mutex_unlock(&root->d_inode->i_mutex);
+out_free:
+	vfree(cgrps);
+	vfree(stats);
+	return err;
+}
+EXPORT_SYMBOL(fairsched_get_stats);
+
 #ifdef CONFIG_PROC_FS
 
 /*********************************************************************/
@@ -394,7 +534,6 @@ EXPORT_SYMBOL(fairsched_move_task);
 
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
-#include <linux/vmalloc.h>
 
 struct fairsched_node_dump {
 	int id;
@@ -738,6 +877,25 @@ int fairsched_get_cpu_stat(int id, struct kernel_cpustat *kstat)
 }
 EXPORT_SYMBOL(fairsched_get_cpu_stat);
 
+#ifdef CONFIG_VE
+int fairsched_get_lat_hist(int id, unsigned long *wait,
+			   unsigned long *throttle)
+{
+	struct cgroup *cgrp;
+	int err;
+
+	cgrp = fairsched_open(id);
+	if (IS_ERR(cgrp))
+		return PTR_ERR(cgrp);
+
+	err = cpu_cgroup_get_lat_hist(cgrp, wait, throttle);
+	cgroup_kernel_close(cgrp);
+
+	return err;
+}
+EXPORT_SYMBOL(fairsched_get_lat_hist);
+#endif
+
 #endif /* CONFIG_PROC_FS */
 
 int __init fairsched_init(void)
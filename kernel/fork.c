@@ -322,6 +322,7 @@ static int dup_mmap(struct mm_struct *mm, struct mm_struct *oldmm)
 	struct mempolicy *pol;
 
 	down_write(&oldmm->mmap_sem);
+	mm_vma_write_begin(oldmm);
 	flush_cache_dup_mm(oldmm);
 	/*
 	 * Not linked in yet - no deadlock potential:
@@ -442,6 +443,7 @@ out:
 	ub_page_table_commit(mm);
 	up_write(&mm->mmap_sem);
 	flush_tlb_mm(oldmm);
+	mm_vma_write_end(oldmm);
 	up_write(&oldmm->mmap_sem);
 	return retval;
 fail_nomem_anon_vma_fork:
@@ -488,11 +490,15 @@ static inline struct mm_struct *allocate_mm(struct user_beancounter *ub)
 static inline void set_mm_ub(struct mm_struct *mm, struct user_beancounter *ub)
 {
 	mm->mm_ub = get_beancounter_longterm(ub);
+	mm->privvm_reserve = 0;
+	/* the mm keeps the hash it was born with, see hash_futex() */
+	mm->mm_futex_hash = ACCESS_ONCE(top_beancounter(ub)->ub_futex_hash);
 }
 
 static inline void put_mm_ub(struct mm_struct *mm)
 {
 	VM_BUG_ON(mm->page_table_precharge);
+	ub_privvm_release(mm);
 	ub_kmem_uncharge(mm_ub_top(mm),
 			mm_cachep->objuse + (mm->nr_ptds << PAGE_SHIFT));
 	put_beancounter_longterm(mm->mm_ub);
@@ -543,6 +549,10 @@ static struct mm_struct * mm_init(struct mm_struct * mm, struct task_struct *p)
 	mm->nr_ptes = 0;
 	mm->nr_ptds = 0;
 	mm->page_table_precharge = 0;
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	seqcount_init(&mm->vma_seq);
+	mm->vma_seq_nest = 0;
+#endif
 	set_mm_counter(mm, file_rss, 0);
 	set_mm_counter(mm, anon_rss, 0);
 	set_mm_counter(mm, swap_usage, 0);
@@ -1709,7 +1719,8 @@ void __init proc_caches_init(void)
 			SLAB_NOTRACK|SLAB_UBC, sighand_ctor);
 	signal_cachep = kmem_cache_create("signal_cache",
 			sizeof(struct signal_struct), 0,
-			SLAB_HWCACHE_ALIGN|SLAB_PANIC|SLAB_NOTRACK|SLAB_UBC, NULL);
+			SLAB_HWCACHE_ALIGN|SLAB_PANIC|SLAB_NOTRACK|SLAB_UBC|
+			SLAB_UB_PAGES, NULL);
 	files_cachep = kmem_cache_create("files_cache",
 			sizeof(struct files_struct), 0,
 			SLAB_HWCACHE_ALIGN|SLAB_PANIC|SLAB_NOTRACK|SLAB_UBC, NULL);
@@ -1719,7 +1730,13 @@ void __init proc_caches_init(void)
 	mm_cachep = kmem_cache_create("mm_struct",
 			sizeof(struct mm_struct), ARCH_MIN_MMSTRUCT_ALIGN,
 			SLAB_HWCACHE_ALIGN|SLAB_PANIC|SLAB_NOTRACK, NULL);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/* handle_speculative_fault() looks at vmas from under RCU */
+	__vm_area_cachep = KMEM_CACHE(vm_area_struct,
+			SLAB_PANIC | SLAB_DESTROY_BY_RCU);
+#else
 	__vm_area_cachep = KMEM_CACHE(vm_area_struct, SLAB_PANIC);
+#endif
 	mmap_init();
 	nsproxy_cache_init();
 }
@@ -9,6 +9,7 @@
 #include <linux/module.h>
 #include <linux/syscalls.h>
 #include <linux/freezer.h>
+#include <linux/ve.h>
 
 /*
  * freezing is complete, mark current process as frozen
@@ -22,6 +23,19 @@ static inline void frozen_process(void)
 	clear_freeze_flag(current);
 }
 
+/* Tell checkpointing, that waits for the container to freeze */
+static inline void ve_frozen_process(void)
+{
+#ifdef CONFIG_VE
+	struct ve_struct *ve = VE_TASK_INFO(current)->owner_env;
+
+	if (atomic_read(&ve->suspend)) {
+		atomic_inc(&ve->suspend_frozen);
+		wake_up(&ve->suspend_wq);
+	}
+#endif
+}
+
 /* Refrigerator is place where frozen processes are stored :-). */
 void refrigerator(void)
 {
@@ -46,6 +60,8 @@ void refrigerator(void)
 	recalc_sigpending(); /* We sent fake signal, clean it up */
 	spin_unlock_irq(&current->sighand->siglock);
 
+	ve_frozen_process();
+
 	for (;;) {
 		set_current_state(TASK_UNINTERRUPTIBLE);
 		if (!frozen(current))
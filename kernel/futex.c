@@ -61,6 +61,9 @@
 #include <linux/nsproxy.h>
 #include <linux/bootmem.h>
 #include <linux/hugetlb.h>
+#include <linux/vmalloc.h>
+
+#include <bc/beancounter.h>
 
 #include <asm/futex.h>
 
@@ -137,6 +140,17 @@ static unsigned long __read_mostly futex_hashsize;
 
 static struct futex_hash_bucket *futex_queues;
 
+/*
+ * Private futex hash of a VE. Process-private futexes of the mms born
+ * in the VE after the hash was set are hashed there, so that futex storms
+ * of one VE don't share buckets with others. The hash lives as long as
+ * the beancounter of the VE, mms pin it through mm_ub.
+ */
+struct futex_hash {
+	unsigned long size;
+	struct futex_hash_bucket queues[0];
+};
+
 static inline void futex_get_mm(union futex_key *key)
 {
 	atomic_inc(&key->private.mm->mm_count);
@@ -190,6 +204,14 @@ static struct futex_hash_bucket *hash_futex(union futex_key *key)
 	u32 hash = jhash2((u32*)&key->both.word,
 			  (sizeof(key->both.word)+sizeof(key->both.ptr))/4,
 			  key->both.offset);
+#ifdef CONFIG_BEANCOUNTERS
+	if (!(key->both.offset & (FUT_OFF_INODE|FUT_OFF_MMSHARED)) &&
+	    key->private.mm && key->private.mm->mm_futex_hash) {
+		struct futex_hash *fh = key->private.mm->mm_futex_hash;
+
+		return &fh->queues[hash & (fh->size - 1)];
+	}
+#endif
 	return &futex_queues[hash & (futex_hashsize - 1)];
 }
 
@@ -2119,7 +2141,7 @@ static int futex_wait(u32 __user *uaddr, int fshared,
 				      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 		hrtimer_init_sleeper(to, current);
 		hrtimer_set_expires_range_ns(&to->timer, *abs_time,
-					     current->timer_slack_ns);
+				ve_timer_slack(*abs_time, current->timer_slack_ns));
 	}
 
 retry:
@@ -2529,7 +2551,7 @@ static int futex_wait_requeue_pi(u32 __user *uaddr, int fshared,
 				      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 		hrtimer_init_sleeper(to, current);
 		hrtimer_set_expires_range_ns(&to->timer, *abs_time,
-					     current->timer_slack_ns);
+				ve_timer_slack(*abs_time, current->timer_slack_ns));
 	}
 
 	/*
@@ -2969,11 +2991,60 @@ SYSCALL_DEFINE6(futex, u32 __user *, uaddr, int, op, u32, val,
 	return do_futex(uaddr, op, val, tp, uaddr2, val2, val3);
 }
 
+static void futex_init_queues(struct futex_hash_bucket *queues,
+			      unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++) {
+		atomic_set(&queues[i].waiters, 0);
+		plist_head_init(&queues[i].chain, &queues[i].lock);
+		spin_lock_init(&queues[i].lock);
+	}
+}
+
+#ifdef CONFIG_BEANCOUNTERS
+/*
+ * Sets the private futex hash of a VE, the hash can't be replaced since
+ * live mms still use it. Gets rounded up to the power of two.
+ */
+int ub_futex_hash_init(struct user_beancounter *ub, unsigned long size)
+{
+	struct futex_hash *fh;
+
+	if (!size || size > futex_hashsize)
+		return -EINVAL;
+
+	if (ub->ub_futex_hash)
+		return -EBUSY;
+
+	size = roundup_pow_of_two(size);
+	fh = vmalloc(sizeof(*fh) + size * sizeof(struct futex_hash_bucket));
+	if (!fh)
+		return -ENOMEM;
+
+	fh->size = size;
+	futex_init_queues(fh->queues, size);
+
+	/* implies a barrier, the hash is set up before it's seen */
+	if (cmpxchg(&ub->ub_futex_hash, NULL, fh) != NULL) {
+		vfree(fh);
+		return -EBUSY;
+	}
+	return 0;
+}
+EXPORT_SYMBOL(ub_futex_hash_init);
+
+void ub_futex_hash_free(struct user_beancounter *ub)
+{
+	vfree(ub->ub_futex_hash);
+}
+#endif
+
 static int __init futex_init(void)
 {
 	u32 curval;
 	unsigned int futex_shift;
-	unsigned long i;
 
 #if CONFIG_BASE_SMALL
 	futex_hashsize = 16;
@@ -3002,11 +3073,7 @@ static int __init futex_init(void)
 	if (curval == -EFAULT)
 		futex_cmpxchg_enabled = 1;
 
-	for (i = 0; i < futex_hashsize; i++) {
-		atomic_set(&futex_queues[i].waiters, 0);
-		plist_head_init(&futex_queues[i].chain, &futex_queues[i].lock);
-		spin_lock_init(&futex_queues[i].lock);
-	}
+	futex_init_queues(futex_queues, futex_hashsize);
 
 	return 0;
 }
@@ -1614,6 +1614,28 @@ out:
 }
 EXPORT_SYMBOL(hrtimer_nanosleep_restart);
 
+#ifdef CONFIG_VE
+/*
+ * Idle containers are full of periodic timers, and each waking the cpus
+ * up on its own keeps the host out of the deep C-states. With a VE
+ * timer_slack_ns set, the hard expiry of a sleep of its task is moved
+ * past its own slack to the next multiple of that step, so the sleepers
+ * of the VE wake up together. @expires is absolute on the timer clock.
+ */
+unsigned long ve_timer_slack(ktime_t expires, unsigned long slack)
+{
+	unsigned long step = VE_TASK_INFO(current)->owner_env->timer_slack_ns;
+	u64 hard;
+
+	if (!step || rt_task(current) || expires.tv64 < 0)
+		return slack;
+
+	hard = ktime_to_ns(expires) + slack + step - 1;
+	hard -= do_div(hard, step);
+	return hard - ktime_to_ns(expires);
+}
+#endif
+
 long hrtimer_nanosleep(struct timespec *rqtp, struct timespec __user *rmtp,
 		       const enum hrtimer_mode mode, const clockid_t clockid)
 {
@@ -1621,13 +1643,18 @@ long hrtimer_nanosleep(struct timespec *rqtp, struct timespec __user *rmtp,
 	struct hrtimer_sleeper t;
 	int ret = 0;
 	unsigned long slack;
+	ktime_t expires;
 
 	slack = current->timer_slack_ns;
 	if (rt_task(current))
 		slack = 0;
 
 	hrtimer_init_on_stack(&t.timer, clockid, mode);
-	hrtimer_set_expires_range_ns(&t.timer, timespec_to_ktime(*rqtp), slack);
+	expires = timespec_to_ktime(*rqtp);
+	/* off by the time it takes to start the timer for relative ones */
+	slack = ve_timer_slack(mode == HRTIMER_MODE_ABS ? expires :
+			ktime_add_safe(expires, t.timer.base->get_time()), slack);
+	hrtimer_set_expires_range_ns(&t.timer, expires, slack);
 	if (do_nanosleep(&t, mode))
 		goto out;
 
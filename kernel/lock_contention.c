@@ -0,0 +1,338 @@
+/*
+ * kernel/lock_contention.c
+ *
+ * Sampled lock contention statistics
+ *
+ * lock_stat needs lockdep and is far too expensive for production. This
+ * only looks at acquisitions which found the lock taken in the first
+ * place: every Nth of them on a cpu is timed until the lock is got and
+ * accounted per lock address and call site in a per-cpu table. Nothing
+ * is done on the uncontended path, so it can be left on.
+ *
+ * Code for /proc/lock_contention:
+ *
+ *  cat /proc/lock_contention		- the sites, most waited for first
+ *  echo N > /proc/lock_contention	- clear and sample every Nth, 0 is off
+ */
+#include <linux/module.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/kallsyms.h>
+#include <linux/hardirq.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/hash.h>
+#include <linux/math64.h>
+#include <linux/sort.h>
+#include <asm/uaccess.h>
+
+#define LC_HASH_BITS	8
+#define LC_HASH_SIZE	(1UL << LC_HASH_BITS)
+#define LC_PROBE	8
+
+/* the sites of all cpus are merged into one table of this size to show */
+#define LC_MERGE_BITS	12
+#define LC_MERGE_SIZE	(1UL << LC_MERGE_BITS)
+
+struct lock_contention_site {
+	unsigned long		lock;
+	unsigned long		ip;
+	unsigned long		count;
+	unsigned long long	wait_total;
+	unsigned long long	wait_max;
+};
+
+struct lock_contention_cpu {
+	unsigned long		countdown;
+	unsigned long		contended;
+	unsigned long		dropped;
+	struct lock_contention_site sites[LC_HASH_SIZE];
+};
+
+int lock_contention_period __read_mostly;
+EXPORT_SYMBOL(lock_contention_period);
+
+static DEFINE_PER_CPU(struct lock_contention_cpu, lock_contention);
+static DEFINE_MUTEX(lock_contention_mutex);
+
+static inline unsigned long lc_hash(unsigned long lock, unsigned long ip,
+				    int bits)
+{
+	return hash_long(lock ^ (ip << 1), bits);
+}
+
+/*
+ * Called when a lock was found taken, before waiting for it. Returns the
+ * start time if this one is sampled and 0 if not.
+ */
+unsigned long long __lock_contention_begin(void)
+{
+	struct lock_contention_cpu *lc;
+	unsigned long long now = 0;
+	unsigned long flags;
+	int period;
+
+	if (unlikely(in_nmi()))
+		return 0;
+
+	local_irq_save(flags);
+	period = lock_contention_period;
+	lc = &__get_cpu_var(lock_contention);
+	if (likely(period)) {
+		lc->contended++;
+		if (lc->countdown)
+			lc->countdown--;
+		else {
+			lc->countdown = period - 1;
+			now = sched_clock() ?: 1;
+		}
+	}
+	local_irq_restore(flags);
+
+	return now;
+}
+EXPORT_SYMBOL(__lock_contention_begin);
+
+/* Called with the lock got, for the sampled acquisitions only */
+void lock_contention_end(void *lock, unsigned long ip,
+			 unsigned long long start)
+{
+	struct lock_contention_site *site;
+	struct lock_contention_cpu *lc;
+	unsigned long long wait;
+	unsigned long flags, h;
+	int i;
+
+	wait = sched_clock() - start;
+	/* a sleeping waiter might have come back on a cpu lagging behind */
+	if ((long long)wait < 0)
+		wait = 0;
+
+	local_irq_save(flags);
+	/* cleared meanwhile */
+	if (unlikely(!lock_contention_period))
+		goto out;
+
+	lc = &__get_cpu_var(lock_contention);
+	h = lc_hash((unsigned long)lock, ip, LC_HASH_BITS);
+	for (i = 0; i < LC_PROBE; i++) {
+		site = &lc->sites[(h + i) & (LC_HASH_SIZE - 1)];
+		if (!site->lock) {
+			site->lock = (unsigned long)lock;
+			site->ip = ip;
+		} else if (site->lock != (unsigned long)lock || site->ip != ip)
+			continue;
+
+		site->count++;
+		site->wait_total += wait;
+		if (wait > site->wait_max)
+			site->wait_max = wait;
+		goto out;
+	}
+	lc->dropped++;
+out:
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(lock_contention_end);
+
+struct lock_contention_seq {
+	int			period;
+	unsigned long		contended;
+	unsigned long		dropped;
+	struct lock_contention_site *iter_end;
+	struct lock_contention_site sites[LC_MERGE_SIZE];
+};
+
+static void lc_merge(struct lock_contention_seq *data,
+		     struct lock_contention_site *s)
+{
+	struct lock_contention_site *site;
+	unsigned long h;
+	int i;
+
+	h = lc_hash(s->lock, s->ip, LC_MERGE_BITS);
+	for (i = 0; i < LC_MERGE_SIZE; i++) {
+		site = &data->sites[(h + i) & (LC_MERGE_SIZE - 1)];
+		if (!site->lock) {
+			site->lock = s->lock;
+			site->ip = s->ip;
+		} else if (site->lock != s->lock || site->ip != s->ip)
+			continue;
+
+		site->count += s->count;
+		site->wait_total += s->wait_total;
+		site->wait_max = max(site->wait_max, s->wait_max);
+		return;
+	}
+	data->dropped += s->count;
+}
+
+static int lc_cmp(const void *a, const void *b)
+{
+	const struct lock_contention_site *sa = a, *sb = b;
+
+	if (sa->wait_total == sb->wait_total)
+		return 0;
+	return sa->wait_total < sb->wait_total ? 1 : -1;
+}
+
+static void lc_fill(struct lock_contention_seq *data)
+{
+	struct lock_contention_site *iter, *end;
+	int cpu, i;
+
+	data->period = lock_contention_period;
+	for_each_possible_cpu(cpu) {
+		struct lock_contention_cpu *lc = &per_cpu(lock_contention, cpu);
+
+		data->contended += lc->contended;
+		data->dropped += lc->dropped;
+		/* unlocked, the sites being updated meanwhile are off a bit */
+		for (i = 0; i < LC_HASH_SIZE; i++) {
+			struct lock_contention_site s = lc->sites[i];
+
+			if (s.lock && s.count)
+				lc_merge(data, &s);
+		}
+	}
+
+	/* pack the used sites to the front */
+	end = data->sites + LC_MERGE_SIZE;
+	i = 0;
+	for (iter = data->sites; iter < end; iter++)
+		if (iter->lock)
+			data->sites[i++] = *iter;
+	data->iter_end = data->sites + i;
+
+	sort(data->sites, i, sizeof(struct lock_contention_site), lc_cmp, NULL);
+}
+
+static void *lc_start(struct seq_file *m, loff_t *pos)
+{
+	struct lock_contention_seq *data = m->private;
+	struct lock_contention_site *iter;
+
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+
+	iter = data->sites + (*pos - 1);
+	if (iter >= data->iter_end)
+		iter = NULL;
+
+	return iter;
+}
+
+static void *lc_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return lc_start(m, pos);
+}
+
+static void lc_stop(struct seq_file *m, void *v)
+{
+}
+
+static int lc_show(struct seq_file *m, void *v)
+{
+	struct lock_contention_seq *data = m->private;
+	struct lock_contention_site *site = v;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(m, "period: %d contended: %lu dropped: %lu\n",
+			   data->period, data->contended, data->dropped);
+		seq_printf(m, "%12s %10s %14s %12s %-32s %s\n", "samples",
+			   "avg-ns", "total-ns", "max-ns", "lock", "site");
+		return 0;
+	}
+
+	seq_printf(m, "%12lu %10llu %14llu %12llu %-32pS %pS\n", site->count,
+		   div64_u64(site->wait_total, site->count), site->wait_total,
+		   site->wait_max, (void *)site->lock, (void *)site->ip);
+	return 0;
+}
+
+static const struct seq_operations lock_contention_ops = {
+	.start	= lc_start,
+	.next	= lc_next,
+	.stop	= lc_stop,
+	.show	= lc_show,
+};
+
+static int lock_contention_open(struct inode *inode, struct file *file)
+{
+	struct lock_contention_seq *data;
+	int res;
+
+	data = vmalloc(sizeof(struct lock_contention_seq));
+	if (!data)
+		return -ENOMEM;
+	memset(data, 0, sizeof(struct lock_contention_seq));
+
+	res = seq_open(file, &lock_contention_ops);
+	if (!res) {
+		struct seq_file *m = file->private_data;
+
+		lc_fill(data);
+		m->private = data;
+	} else
+		vfree(data);
+
+	return res;
+}
+
+static ssize_t lock_contention_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	char kbuf[16];
+	unsigned long period;
+	int cpu;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+	if (strict_strtoul(strstrip(kbuf), 10, &period) || period > INT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&lock_contention_mutex);
+	/* nobody is in the irq-off parts above once this is over */
+	lock_contention_period = 0;
+	synchronize_sched();
+
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu(lock_contention, cpu), 0,
+		       sizeof(struct lock_contention_cpu));
+
+	lock_contention_period = period;
+	mutex_unlock(&lock_contention_mutex);
+
+	return count;
+}
+
+static int lock_contention_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *seq = file->private_data;
+
+	vfree(seq->private);
+	return seq_release(inode, file);
+}
+
+static const struct file_operations proc_lock_contention_operations = {
+	.open		= lock_contention_open,
+	.write		= lock_contention_write,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= lock_contention_release,
+};
+
+static int __init lock_contention_proc_init(void)
+{
+	proc_create("lock_contention", S_IRUSR | S_IWUSR, NULL,
+		    &proc_lock_contention_operations);
+	return 0;
+}
+
+__initcall(lock_contention_proc_init);
@@ -515,6 +515,7 @@ __mutex_lock_common(struct mutex *lock, long state, unsigned int subclass,
 {
 	struct task_struct *task = current;
 	struct mutex_waiter waiter;
+	unsigned long long lc_start = 0;
 	unsigned long flags;
 	int ret;
 
@@ -633,6 +634,7 @@ slowpath:
 	waiter.task = task;
 
 	lock_contended(&lock->dep_map, ip);
+	lc_start = lock_contention_begin();
 
 	for (;;) {
 		/*
@@ -681,6 +683,8 @@ slowpath:
 skip_wait:
 	/* got the lock - cleanup and rejoice! */
 	lock_acquired(&lock->dep_map, ip);
+	if (unlikely(lc_start))
+		lock_contention_end(lock, ip, lc_start);
 	mutex_set_owner(lock);
 
 	if (!__builtin_constant_p(ww_ctx == NULL)) {
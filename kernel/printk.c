@@ -331,6 +331,7 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 	int do_clear = 0;
 	char c;
 	int error = 0;
+	spinlock_t *lock = ve_logbuf_lock;
 
 	if (!ve_is_super(get_exec_env()) && (type == 6 || type == 7))
 		goto out;
@@ -360,18 +361,18 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 		if (error)
 			goto out;
 		i = 0;
-		spin_lock_irq(&logbuf_lock);
+		spin_lock_irq(lock);
 		while (!error && (ve_log_start != ve_log_end) && i < len) {
 			c = VE_LOG_BUF(ve_log_start);
 			ve_log_start++;
-			spin_unlock_irq(&logbuf_lock);
+			spin_unlock_irq(lock);
 			error = __put_user(c,buf);
 			buf++;
 			i++;
 			cond_resched();
-			spin_lock_irq(&logbuf_lock);
+			spin_lock_irq(lock);
 		}
-		spin_unlock_irq(&logbuf_lock);
+		spin_unlock_irq(lock);
 		if (!error)
 			error = i;
 		break;
@@ -392,7 +393,7 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 		if (ve_log_buf == NULL)
 			goto out;
 		count = len;
-		spin_lock_irq(&logbuf_lock);
+		spin_lock_irq(lock);
 		if (count > ve_log_buf_len)
 			count = ve_log_buf_len;
 		if (count > ve_logged_chars)
@@ -411,12 +412,12 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 			if (j + ve_log_buf_len < ve_log_end)
 				break;
 			c = VE_LOG_BUF(j);
-			spin_unlock_irq(&logbuf_lock);
+			spin_unlock_irq(lock);
 			error = __put_user(c,&buf[count-1-i]);
 			cond_resched();
-			spin_lock_irq(&logbuf_lock);
+			spin_lock_irq(lock);
 		}
-		spin_unlock_irq(&logbuf_lock);
+		spin_unlock_irq(lock);
 		if (error)
 			break;
 		error = i;
@@ -651,6 +652,8 @@ static int have_callable_console(void)
  * See the vsnprintf() documentation for format string extensions over C99.
  */
 
+#define VE_LOG_LINE_LEN		1024
+
 static inline int ve_log_init(void)
 {
 #ifdef CONFIG_VE
@@ -666,7 +669,8 @@ static inline int ve_log_init(void)
 		return 0;
 	}
 
-	ve_log_buf = kmalloc(ve_log_buf_len, GFP_ATOMIC);
+	/* the line being formatted lives right after the ring */
+	ve_log_buf = kmalloc(ve_log_buf_len + VE_LOG_LINE_LEN, GFP_ATOMIC);
 	if (!ve_log_buf)
 		return -ENOMEM;
 
@@ -756,63 +760,15 @@ static inline void printk_delay(void)
 	}
 }
 
-asmlinkage int __vprintk(const char *fmt, va_list args)
+/*
+ * Copy the formatted message @p into the log of the current VE, with the
+ * level and time tokens prepended to each of its lines. Called with the
+ * lock of that log held, returns the number of the token chars emitted.
+ */
+static int log_emit_msg(char *p, int *new_line, unsigned int cpu)
 {
-	int printed_len = 0;
 	int current_log_level = default_message_loglevel;
-	unsigned long flags;
-	int this_cpu;
-	char *p;
-	int err, need_wake;
-
-	boot_delay_msec();
-	printk_delay();
-
-	preempt_disable();
-	/* This stops the holder of console_sem just where we want him */
-	raw_local_irq_save(flags);
-	this_cpu = smp_processor_id();
-
-	/*
-	 * Ouch, printk recursed into itself!
-	 */
-	if (unlikely(printk_cpu == this_cpu)) {
-		/*
-		 * If a crash is occurring during printk() on this CPU,
-		 * then try to get the crash message out but make sure
-		 * we can't deadlock. Otherwise just return to avoid the
-		 * recursion and return - but flag the recursion so that
-		 * it can be printed at the next appropriate moment:
-		 */
-		if (!oops_in_progress) {
-			recursion_bug = 1;
-			goto out_restore_irqs;
-		}
-		zap_locks();
-	}
-
-	lockdep_off();
-	spin_lock(&logbuf_lock);
-	printk_cpu = this_cpu;
-
-	err = ve_log_init();
-	if (err) {
-		spin_unlock(&logbuf_lock);
-		printed_len = err;
-		goto out_lockdep;
-	}
-
-	if (recursion_bug) {
-		recursion_bug = 0;
-		strcpy(printk_buf, recursion_bug_msg);
-		printed_len = strlen(recursion_bug_msg);
-	}
-	/* Emit the output into the temporary buffer */
-	printed_len += vscnprintf(printk_buf + printed_len,
-				  sizeof(printk_buf) - printed_len, fmt, args);
-
-
-	p = printk_buf;
+	int len = 0;
 
 	/* Do we have a loglevel in the string? */
 	if (p[0] == '<') {
@@ -823,9 +779,9 @@ asmlinkage int __vprintk(const char *fmt, va_list args)
 				current_log_level = c - '0';
 			/* Fallthrough - make sure we're on a new line */
 			case 'd': /* KERN_DEFAULT */
-				if (!new_text_line) {
+				if (!*new_line) {
 					emit_log_char('\n');
-					new_text_line = 1;
+					*new_line = 1;
 				}
 			/* Fallthrough - skip the loglevel */
 			case 'c': /* KERN_CONT */
@@ -840,13 +796,13 @@ asmlinkage int __vprintk(const char *fmt, va_list args)
 	 * appropriate log level tags, we insert them here
 	 */
 	for ( ; *p; p++) {
-		if (new_text_line) {
+		if (*new_line) {
 			/* Always output the token */
 			emit_log_char('<');
 			emit_log_char(current_log_level + '0');
 			emit_log_char('>');
-			printed_len += 3;
-			new_text_line = 0;
+			len += 3;
+			*new_line = 0;
 
 			if (printk_time) {
 				/* Follow the token with the time */
@@ -855,7 +811,7 @@ asmlinkage int __vprintk(const char *fmt, va_list args)
 				unsigned long long t;
 				unsigned long nanosec_rem;
 
-				t = cpu_clock(printk_cpu);
+				t = cpu_clock(cpu);
 				nanosec_rem = do_div(t, 1000000000);
 				tlen = sprintf(tbuf, "[%5lu.%06lu] ",
 						(unsigned long) t,
@@ -863,7 +819,7 @@ asmlinkage int __vprintk(const char *fmt, va_list args)
 
 				for (tp = tbuf; tp < tbuf + tlen; tp++)
 					emit_log_char(*tp);
-				printed_len += tlen;
+				len += tlen;
 			}
 			if (test_taint(TAINT_BIT_BY_ZOMBIE)) {
 				/* len is 21 */
@@ -879,8 +835,66 @@ asmlinkage int __vprintk(const char *fmt, va_list args)
 
 		emit_log_char(*p);
 		if (*p == '\n')
-			new_text_line = 1;
+			*new_line = 1;
 	}
+	return len;
+}
+
+/* Called in the context of ve0 only, the VEs log via ve_log_vprintk() */
+static int __vprintk(const char *fmt, va_list args)
+{
+	int printed_len = 0;
+	unsigned long flags;
+	int this_cpu;
+	int err;
+
+	boot_delay_msec();
+	printk_delay();
+
+	preempt_disable();
+	/* This stops the holder of console_sem just where we want him */
+	raw_local_irq_save(flags);
+	this_cpu = smp_processor_id();
+
+	/*
+	 * Ouch, printk recursed into itself!
+	 */
+	if (unlikely(printk_cpu == this_cpu)) {
+		/*
+		 * If a crash is occurring during printk() on this CPU,
+		 * then try to get the crash message out but make sure
+		 * we can't deadlock. Otherwise just return to avoid the
+		 * recursion and return - but flag the recursion so that
+		 * it can be printed at the next appropriate moment:
+		 */
+		if (!oops_in_progress) {
+			recursion_bug = 1;
+			goto out_restore_irqs;
+		}
+		zap_locks();
+	}
+
+	lockdep_off();
+	spin_lock(&logbuf_lock);
+	printk_cpu = this_cpu;
+
+	err = ve_log_init();
+	if (err) {
+		spin_unlock(&logbuf_lock);
+		printed_len = err;
+		goto out_lockdep;
+	}
+
+	if (recursion_bug) {
+		recursion_bug = 0;
+		strcpy(printk_buf, recursion_bug_msg);
+		printed_len = strlen(recursion_bug_msg);
+	}
+	/* Emit the output into the temporary buffer */
+	printed_len += vscnprintf(printk_buf + printed_len,
+				  sizeof(printk_buf) - printed_len, fmt, args);
+
+	printed_len += log_emit_msg(printk_buf, &new_text_line, printk_cpu);
 
 	/*
 	 * Try to acquire and then immediately release the
@@ -892,27 +906,79 @@ asmlinkage int __vprintk(const char *fmt, va_list args)
 	 * will release 'logbuf_lock' regardless of whether it
 	 * actually gets the semaphore or not.
 	 */
-	if (!ve_is_super(get_exec_env())) {
-		need_wake = (ve_log_start != ve_log_end);
-		printk_cpu = UINT_MAX;
-		spin_unlock(&logbuf_lock);
-		lockdep_on();
-		raw_local_irq_restore(flags);
-		if (!oops_in_progress && need_wake)
-			wake_up_interruptible(&ve_log_wait);
-		goto out_preempt;
-	} else if (acquire_console_semaphore_for_printk(this_cpu))
+	if (acquire_console_semaphore_for_printk(this_cpu))
 		release_console_sem();
 
 out_lockdep:
 	lockdep_on();
 out_restore_irqs:
 	raw_local_irq_restore(flags);
-
-out_preempt:
 	preempt_enable();
 	return printed_len;
 }
+
+#ifdef CONFIG_VE
+/*
+ * A container writes to its own small ring under its own lock, so one
+ * filling its log (iptables LOG, segfaults) does not make the other cpus
+ * spin on logbuf_lock. The ring is only read by the syslog of the VE.
+ */
+static int ve_log_vprintk(struct ve_struct *ve, const char *fmt, va_list args)
+{
+	unsigned long flags;
+	int printed_len, need_wake;
+	char *line;
+
+	spin_lock_irqsave(&ve->log_lock, flags);
+	if (ve_log_init()) {
+		spin_unlock_irqrestore(&ve->log_lock, flags);
+		return -ENOMEM;
+	}
+
+	line = ve->log_buf + VE_DEFAULT_LOG_BUF_LEN;
+	printed_len = vscnprintf(line, VE_LOG_LINE_LEN, fmt, args);
+	printed_len += log_emit_msg(line, &ve->log_new_line,
+				    smp_processor_id());
+	need_wake = (ve_log_start != ve_log_end);
+	spin_unlock_irqrestore(&ve->log_lock, flags);
+
+	if (!oops_in_progress && need_wake)
+		wake_up_interruptible(&ve_log_wait);
+	return printed_len;
+}
+
+#define VE_LOG_RATELIMIT_INTERVAL	(5 * HZ)
+#define VE_LOG_RATELIMIT_BURST		100
+
+/*
+ * Called for each ve_printk() of a container before anything is logged,
+ * returns 0 if the message is to be dropped. When a new interval starts
+ * *missed is set to how many were dropped during the previous one.
+ */
+static int ve_log_ratelimit(struct ve_struct *ve, int *missed)
+{
+	unsigned long flags;
+	int ret = 1;
+
+	*missed = 0;
+	spin_lock_irqsave(&ve->log_lock, flags);
+	if (time_after_eq(jiffies,
+			  ve->log_rl_begin + VE_LOG_RATELIMIT_INTERVAL)) {
+		*missed = ve->log_rl_missed;
+		ve->log_rl_begin = jiffies;
+		ve->log_rl_printed = 0;
+		ve->log_rl_missed = 0;
+	}
+	if (ve->log_rl_printed < VE_LOG_RATELIMIT_BURST)
+		ve->log_rl_printed++;
+	else {
+		ve->log_rl_missed++;
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&ve->log_lock, flags);
+	return ret;
+}
+#endif
 EXPORT_SYMBOL(printk);
 EXPORT_SYMBOL(vprintk);
 
@@ -932,12 +998,28 @@ asmlinkage int ve_vprintk(int dst, const char *fmt, va_list args)
 	int printed_len;
 	va_list args2;
 
+#ifdef CONFIG_VE
+	struct ve_struct *ve = get_exec_env();
+	int missed;
+
+	if (!ve_is_super(ve)) {
+		if (!ve_log_ratelimit(ve, &missed))
+			return 0;
+		if (missed)
+			ve_printk(dst, KERN_WARNING "CT: %d: %d kernel "
+					"messages suppressed\n",
+					ve->veid, missed);
+	}
+#endif
+
 	printed_len = 0;
 	va_copy(args2, args);
 	if (ve_is_super(get_exec_env()) || (dst & VE0_LOG))
 		printed_len = vprintk(fmt, args);
+#ifdef CONFIG_VE
 	if (!ve_is_super(get_exec_env()) && (dst & VE_LOG))
-		printed_len = __vprintk(fmt, args2);
+		printed_len = ve_log_vprintk(get_exec_env(), fmt, args2);
+#endif
 	return printed_len;
 }
 
@@ -250,6 +250,8 @@ struct cfs_bandwidth {
 	u64 quota, runtime;
 	s64 hierarchal_quota;
 	u64 runtime_expires;
+	/* runtime left unused accrues up to quota + burst */
+	u64 burst, runtime_snap;
 
 	int idle, timer_active;
 	struct hrtimer period_timer, slack_timer;
@@ -261,9 +263,19 @@ struct cfs_bandwidth {
 	/* statistics */
 	int nr_periods, nr_throttled;
 	u64 throttled_time;
+	int nr_bursts;
+	u64 burst_time;
 #endif
 };
 
+/*
+ * Usage of a task group on the pcpus of one vcpu, folded in by the ticks
+ * on those pcpus and taken by update_tg_vcpustat().
+ */
+struct vcpustat_acc {
+	atomic64_t cpustat[IOWAIT + 1];	/* USER .. IOWAIT */
+} ____cacheline_aligned_in_smp;
+
 /* task group related information */
 struct task_group {
 #ifdef CONFIG_CGROUP_SCHED
@@ -309,12 +321,19 @@ struct task_group {
 	struct kernel_cpustat __percpu *cpustat;
 	struct taskstats __percpu *taskstats;
 	unsigned long		avenrun[3];	/* loadavg data */
+	atomic_long_t		calc_load_tasks;
 	struct timespec start_time;
 
 	struct kernel_cpustat *cpustat_last;
 	struct kernel_cpustat *vcpustat;
+	struct vcpustat_acc *vcpustat_acc;
 	ktime_t vcpustat_last_update;
 	spinlock_t vcpustat_lock;
+#ifdef CONFIG_VE
+	/* runqueue wait of the tasks and throttled time of the cfs_rqs */
+	struct kstat_lat_pcpu_struct sched_lat;
+	struct kstat_lat_pcpu_struct throttle_lat;
+#endif
 #ifndef __GENKSYMS__
 	struct cfs_bandwidth cfs_bandwidth;
 #endif
@@ -324,6 +343,7 @@ struct task_group {
 	unsigned long cpu_rate;
 	unsigned int nr_cpus;
 	atomic_t nr_cpus_active;
+	cpumask_var_t pack_mask;	/* see select_packed_cpu() */
 #endif
 };
 
@@ -501,6 +521,7 @@ struct cfs_rq {
 #endif
 	unsigned long nr_iowait;
 	unsigned long nr_unint;
+	long calc_load_active;	/* folded into tg->calc_load_tasks */
 
 	u64 exec_clock;
 	u64 min_vruntime;
@@ -898,6 +919,7 @@ struct rq {
 	/* calc_load related fields */
 	unsigned long calc_load_update;
 	long calc_load_active;
+	int calc_load_tg_idle;
 
 #ifdef CONFIG_SCHED_HRTICK
 #ifdef CONFIG_SMP
@@ -957,6 +979,7 @@ EXPORT_SYMBOL(kstat_glb_lock);
 
 static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, glob_kstat_lat);
 static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, glob_kstat_page_in);
+static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, glob_kstat_swap_in);
 static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, alloc_kstat_lat[KSTAT_ALLOCSTAT_NR]);
 
 static DEFINE_PER_CPU(struct kstat_perf_pcpu_snap_struct, kstat_pcpu_ttfp);
@@ -971,6 +994,7 @@ void __init kstat_init(void)
 
 	kstat_glob.sched_lat.cur = &per_cpu_var(glob_kstat_lat);
 	kstat_glob.page_in.cur = &per_cpu_var(glob_kstat_page_in);
+	kstat_glob.swap_in.cur = &per_cpu_var(glob_kstat_swap_in);
 	for ( i = 0 ; i < KSTAT_ALLOCSTAT_NR ; i++)
 		kstat_glob.alloc_lat[i].cur = &per_cpu_var(alloc_kstat_lat[i]);
 
@@ -1404,6 +1428,12 @@ static inline void update_sched_lat(struct task_struct *t, u64 now)
 				cpu, now - ve_wstamp);
 		KSTAT_LAT_PCPU_ADD(&t->ve_task_info.exec_env->sched_lat_ve,
 				cpu, now - ve_wstamp);
+#ifdef CONFIG_CGROUP_SCHED
+		/* root task group is covered by kstat_glob */
+		if (task_group(t)->sched_lat.cur)
+			KSTAT_LAT_PCPU_ADD(&task_group(t)->sched_lat,
+					cpu, now - ve_wstamp);
+#endif
 	}
 }
 
@@ -2185,6 +2215,7 @@ static inline void double_unlock_balance(struct rq *this_rq, struct rq *busiest)
 #endif
 
 static void calc_load_account_active(struct rq *this_rq);
+static void calc_load_account_tg_idle(struct rq *this_rq);
 static void update_sysctl(void);
 static void update_cpu_load(struct rq *this_rq);
 static int get_update_sysctl_factor(void);
@@ -3592,23 +3623,14 @@ calc_load(unsigned long load, unsigned long exp, unsigned long active)
 #ifdef CONFIG_VE
 static void calc_load_ve(void)
 {
-	unsigned long flags, nr_unint, nr_active;
+	unsigned long flags, nr_unint;
+	long nr_active;
 	struct task_group *tg;
-	int i;
 
 	rcu_read_lock();
 	list_for_each_entry_rcu(tg, &task_groups, list) {
-		nr_active = 0;
-		for_each_possible_cpu(i) {
-#ifdef CONFIG_FAIR_GROUP_SCHED
-			nr_active += tg->cfs_rq[i]->nr_running;
-			nr_active += tg->cfs_rq[i]->nr_unint;
-#endif
-#ifdef CONFIG_RT_GROUP_SCHED
-			nr_active += tg->rt_rq[i]->rt_nr_running;
-#endif
-		}
-		nr_active *= FIXED_1;
+		nr_active = atomic_long_read(&tg->calc_load_tasks);
+		nr_active = nr_active > 0 ? nr_active * FIXED_1 : 0;
 
 		tg->avenrun[0] = calc_load(tg->avenrun[0], EXP_1, nr_active);
 		tg->avenrun[1] = calc_load(tg->avenrun[1], EXP_5, nr_active);
@@ -3670,6 +3692,48 @@ static void calc_load_account_active(struct rq *this_rq)
 	}
 }
 
+#if defined(CONFIG_VE) && defined(CONFIG_FAIR_GROUP_SCHED)
+/*
+ * Like calc_load_account_active(), but for the groups having tasks on this
+ * cpu: a cfs_rq is kept on the leaf list while it has active tasks or a
+ * nonzero folded count, so it's enough to walk the list. Rt tasks are
+ * accounted in their groups directly, see inc_rt_group().
+ */
+static void calc_load_account_tg(struct rq *this_rq)
+{
+	struct cfs_rq *cfs_rq;
+	long nr_active, delta;
+
+	for_each_leaf_cfs_rq(this_rq, cfs_rq) {
+		nr_active = cfs_rq->nr_running;
+		nr_active += (long) cfs_rq->nr_unint;
+
+		if (nr_active != cfs_rq->calc_load_active) {
+			delta = nr_active - cfs_rq->calc_load_active;
+			cfs_rq->calc_load_active = nr_active;
+			atomic_long_add(delta, &cfs_rq->tg->calc_load_tasks);
+		}
+	}
+}
+
+/*
+ * Going idle after the fold at tick, the groups the cpu was running are
+ * folded once more, so that their load is not overestimated while the cpu
+ * sleeps without ticks. Later idle entries in the same period are cheap.
+ */
+static void calc_load_account_tg_idle(struct rq *this_rq)
+{
+	if (this_rq->calc_load_tg_idle)
+		return;
+
+	this_rq->calc_load_tg_idle = 1;
+	calc_load_account_tg(this_rq);
+}
+#else
+static inline void calc_load_account_tg(struct rq *this_rq) { }
+static inline void calc_load_account_tg_idle(struct rq *this_rq) { }
+#endif
+
 /*
  * The exact cpuload at various idx values, calculated at every tick would be
  * load = (2^idx - 1) / 2^idx * load + 1 / 2^idx * cur_load
@@ -3788,6 +3852,8 @@ static void update_cpu_load_active(struct rq *this_rq)
 	if (time_after_eq(jiffies, this_rq->calc_load_update)) {
 		this_rq->calc_load_update += LOAD_FREQ;
 		calc_load_account_active(this_rq);
+		calc_load_account_tg(this_rq);
+		this_rq->calc_load_tg_idle = 0;
 	}
 }
 
@@ -3909,7 +3975,8 @@ int can_migrate_task(struct task_struct *p, struct rq *rq, int this_cpu,
 	 * We do not migrate tasks that are:
 	 * 1) running (obviously), or
 	 * 2) cannot be migrated to this CPU due to cpus_allowed, or
-	 * 3) are cache-hot on their current CPU.
+	 * 3) are cache-hot on their current CPU, or
+	 * 4) would leave the cpus their container is packed on.
 	 */
 	if (!cpumask_test_cpu(this_cpu, &p->cpus_allowed)) {
 		schedstat_inc(p, se.nr_failed_migrations_affine);
@@ -3917,6 +3984,9 @@ int can_migrate_task(struct task_struct *p, struct rq *rq, int this_cpu,
 	}
 	*all_pinned = 0;
 
+	if (!force && cpulimit_pack_keep(p, this_cpu))
+		return 0;
+
 	if (task_running(rq, p)) {
 		schedstat_inc(p, se.nr_failed_migrations_running);
 		return 0;
@@ -6101,6 +6171,49 @@ unsigned long long thread_group_sched_runtime(struct task_struct *p)
 	return ns;
 }
 
+#ifdef CONFIG_CGROUP_SCHED
+/* ticks of usage a pcpu accumulates before it is folded into its vcpu */
+#define VCPUSTAT_BATCH	8
+
+/*
+ * tg->cpustat_last of a pcpu holds what it has folded already: usage and
+ * the sleep and iowait sums of the group entity.
+ */
+static void tg_fold_vcpustat(struct task_group *tg,
+			     struct kernel_cpustat *kcpustat, int cpu)
+{
+	struct kernel_cpustat *last = tg->cpustat_last + cpu;
+	struct vcpustat_acc *acc;
+	int i;
+
+	if (kernel_cpustat_total_usage(kcpustat) -
+	    kernel_cpustat_total_usage(last) < VCPUSTAT_BATCH)
+		return;
+
+	acc = tg->vcpustat_acc + cpu % tg_nr_cpus(tg);
+	for (i = USER; i <= SYSTEM; i++) {
+		atomic64_add(kcpustat->cpustat[i] - last->cpustat[i],
+			     &acc->cpustat[i]);
+		last->cpustat[i] = kcpustat->cpustat[i];
+	}
+
+#if defined(CONFIG_SCHEDSTATS) && defined(CONFIG_FAIR_GROUP_SCHED)
+	{
+		struct sched_entity *se = tg->se[cpu];
+		u64 sleep, iowait;
+
+		sleep = se->sum_sleep_runtime - last->cpustat[IDLE];
+		iowait = se->iowait_sum - last->cpustat[IOWAIT];
+		atomic64_add(sleep > iowait ? sleep - iowait : 0,
+			     &acc->cpustat[IDLE]);
+		atomic64_add(iowait, &acc->cpustat[IOWAIT]);
+		last->cpustat[IDLE] = se->sum_sleep_runtime;
+		last->cpustat[IOWAIT] = se->iowait_sum;
+	}
+#endif
+}
+#endif
+
 static inline void task_group_account_field(struct task_struct *p,
 						u64 tmp, int index)
 {
@@ -6113,6 +6226,8 @@ static inline void task_group_account_field(struct task_struct *p,
 	while (tg) {
 		kcpustat = this_cpu_ptr(tg->cpustat);
 		kcpustat->cpustat[index] += tmp;
+		if (tg->vcpustat_acc)
+			tg_fold_vcpustat(tg, kcpustat, smp_processor_id());
 		tg = tg->parent;
 	}
 	rcu_read_unlock();
@@ -6669,6 +6784,8 @@ need_resched_nonpreemptible:
 		if (prev->se.on_rq && prev != this_rq()->idle)
 			write_wakeup_stamp(prev, rq->clock);
 		update_sched_lat(next, rq->clock);
+		ve_hwstat_switch(prev->ve_task_info.exec_env,
+				next->ve_task_info.exec_env);
 
 		/* because next & prev are protected with
 		 * runqueue lock we may not worry about
@@ -8675,6 +8792,25 @@ static void migrate_nr_uninterruptible(struct rq *rq_src)
 	rq_src->nr_uninterruptible = 0;
 	rq_dest->nr_iothrottled += rq_src->nr_iothrottled;
 	rq_src->nr_iothrottled = 0;
+#if defined(CONFIG_VE) && defined(CONFIG_FAIR_GROUP_SCHED)
+	{
+		struct task_group *tg;
+		struct cfs_rq *cfs_src, *cfs_dest;
+
+		/* the same for the groups, folded on the tick of rq_dest */
+		rcu_read_lock();
+		list_for_each_entry_rcu(tg, &task_groups, list) {
+			cfs_src = tg->cfs_rq[cpu_of(rq_src)];
+			cfs_dest = tg->cfs_rq[cpu_of(rq_dest)];
+			if (!cfs_src->nr_unint)
+				continue;
+			cfs_dest->nr_unint += cfs_src->nr_unint;
+			cfs_src->nr_unint = 0;
+			list_add_leaf_cfs_rq(cfs_dest);
+		}
+		rcu_read_unlock();
+	}
+#endif
 	double_rq_unlock(rq_src, rq_dest);
 	local_irq_restore(flags);
 }
@@ -8798,6 +8934,18 @@ static void migrate_dead_tasks(unsigned int dead_cpu)
  */
 static void calc_global_load_remove(struct rq *rq)
 {
+#if defined(CONFIG_VE) && defined(CONFIG_FAIR_GROUP_SCHED)
+	struct task_group *tg;
+	struct cfs_rq *cfs_rq;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(tg, &task_groups, list) {
+		cfs_rq = tg->cfs_rq[cpu_of(rq)];
+		atomic_long_sub(cfs_rq->calc_load_active, &tg->calc_load_tasks);
+		cfs_rq->calc_load_active = 0;
+	}
+	rcu_read_unlock();
+#endif
 	atomic_long_sub(rq->calc_load_active, &calc_load_tasks);
 	rq->calc_load_active = 0;
 }
@@ -11293,6 +11441,9 @@ static void free_fair_sched_group(struct task_group *tg)
 
 	kfree(tg->cfs_rq);
 	kfree(tg->se);
+#ifdef CONFIG_CFS_CPULIMIT
+	free_cpumask_var(tg->pack_mask);
+#endif
 }
 
 static
@@ -11309,6 +11460,10 @@ int alloc_fair_sched_group(struct task_group *tg, struct task_group *parent)
 	tg->se = kzalloc(sizeof(se) * nr_cpu_ids, GFP_KERNEL);
 	if (!tg->se)
 		goto err;
+#ifdef CONFIG_CFS_CPULIMIT
+	if (!zalloc_cpumask_var(&tg->pack_mask, GFP_KERNEL))
+		goto err;
+#endif
 
 	tg->shares = NICE_0_LOAD;
 	tg->orig_shares = tg->shares;
@@ -11448,6 +11603,11 @@ static void free_sched_group(struct task_group *tg)
 	free_percpu(tg->taskstats);
 	kfree(tg->cpustat_last);
 	kfree(tg->vcpustat);
+	kfree(tg->vcpustat_acc);
+#ifdef CONFIG_VE
+	free_percpu(tg->sched_lat.cur);
+	free_percpu(tg->throttle_lat.cur);
+#endif
 	kfree(tg);
 }
 
@@ -11486,6 +11646,21 @@ struct task_group *sched_create_group(struct task_group *parent)
 	if (!tg->vcpustat)
 		goto err;
 
+	tg->vcpustat_acc = kcalloc(nr_cpu_ids, sizeof(struct vcpustat_acc),
+				   GFP_KERNEL);
+	if (!tg->vcpustat_acc)
+		goto err;
+
+#ifdef CONFIG_VE
+	tg->sched_lat.cur = alloc_percpu(struct kstat_lat_pcpu_snap_struct);
+	if (!tg->sched_lat.cur)
+		goto err;
+
+	tg->throttle_lat.cur = alloc_percpu(struct kstat_lat_pcpu_snap_struct);
+	if (!tg->throttle_lat.cur)
+		goto err;
+#endif
+
 	tg->vcpustat_last_update = ktime_set(0, 0);
 	spin_lock_init(&tg->vcpustat_lock);
 
@@ -11589,8 +11764,13 @@ void __sched_move_task(struct task_struct *tsk)
 				tsk->sched_class->nr_iowait_inc)
 			tsk->sched_class->nr_iowait_inc(tsk);
 
-		if (task_contributes_to_load(tsk))
+		if (task_contributes_to_load(tsk)) {
 			task_cfs_rq(tsk)->nr_unint++;
+#if defined(CONFIG_VE) && defined(CONFIG_FAIR_GROUP_SCHED)
+			/* to be folded by calc_load_account_tg() */
+			list_add_leaf_cfs_rq(task_cfs_rq(tsk));
+#endif
+		}
 
 		check_inc_sleeping(rq, tsk);
 	}
@@ -12171,10 +12351,14 @@ static DEFINE_MUTEX(cfs_constraints_mutex);
 const u64 max_cfs_quota_period = 1 * NSEC_PER_SEC; /* 1s */
 const u64 min_cfs_quota_period = 1 * NSEC_PER_MSEC; /* 1ms */
 
+/* longest run over quota a group may have credit for */
+const u64 max_cfs_burst = 10 * NSEC_PER_SEC; /* 10s */
+
 static int __cfs_schedulable(struct task_group *tg, u64 period, u64 runtime);
 
 /* call with cfs_constraints_mutex held */
-static int __tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota)
+static int __tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota,
+				  u64 burst)
 {
 	int i, ret = 0, runtime_enabled;
 	struct cfs_bandwidth *cfs_b = tg_cfs_bandwidth(tg);
@@ -12198,6 +12382,9 @@ static int __tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota)
 	if (period > max_cfs_quota_period)
 		return -EINVAL;
 
+	if (burst > max_cfs_burst)
+		return -EINVAL;
+
 	ret = __cfs_schedulable(tg, period, quota);
 	if (ret)
 		return ret;
@@ -12206,7 +12393,12 @@ static int __tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota)
 	spin_lock_irq(&cfs_b->lock);
 	cfs_b->period = ns_to_ktime(period);
 	cfs_b->quota = quota;
+	cfs_b->burst = burst;
 
+	/* credit is not carried over a change of the limits */
+	cfs_b->runtime = 0;
+	cfs_b->runtime_snap = 0;
+	cfs_b->runtime_expires = sched_clock_cpu(smp_processor_id());
 	__refill_cfs_bandwidth_runtime(cfs_b);
 	update_cfs_bandwidth_idle_scale(cfs_b);
 	/* restart the period timer (if active) to handle new period expiry */
@@ -12234,12 +12426,13 @@ static int __tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota)
 
 static void tg_update_cpu_limit(struct task_group *tg);
 
-static int tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota)
+static int tg_set_cfs_bandwidth(struct task_group *tg, u64 period, u64 quota,
+				u64 burst)
 {
 	int ret;
 
 	mutex_lock(&cfs_constraints_mutex);
-	ret = __tg_set_cfs_bandwidth(tg, period, quota);
+	ret = __tg_set_cfs_bandwidth(tg, period, quota, burst);
 	tg_update_cpu_limit(tg);
 	mutex_unlock(&cfs_constraints_mutex);
 
@@ -12256,7 +12449,8 @@ int tg_set_cfs_quota(struct task_group *tg, long cfs_quota_us)
 	else
 		quota = (u64)cfs_quota_us * NSEC_PER_USEC;
 
-	return tg_set_cfs_bandwidth(tg, period, quota);
+	return tg_set_cfs_bandwidth(tg, period, quota,
+				    tg_cfs_bandwidth(tg)->burst);
 }
 
 long tg_get_cfs_quota(struct task_group *tg)
@@ -12282,7 +12476,8 @@ int tg_set_cfs_period(struct task_group *tg, long cfs_period_us)
 	if (period <= 0)
 		return -EINVAL;
 
-	return tg_set_cfs_bandwidth(tg, period, quota);
+	return tg_set_cfs_bandwidth(tg, period, quota,
+				    tg_cfs_bandwidth(tg)->burst);
 }
 
 long tg_get_cfs_period(struct task_group *tg)
@@ -12295,6 +12490,30 @@ long tg_get_cfs_period(struct task_group *tg)
 	return cfs_period_us;
 }
 
+int tg_set_cfs_burst(struct task_group *tg, long cfs_burst_us)
+{
+	u64 quota, period, burst;
+
+	if (cfs_burst_us < 0)
+		return -EINVAL;
+
+	period = ktime_to_ns(tg_cfs_bandwidth(tg)->period);
+	quota = tg_cfs_bandwidth(tg)->quota;
+	burst = (u64)cfs_burst_us * NSEC_PER_USEC;
+
+	return tg_set_cfs_bandwidth(tg, period, quota, burst);
+}
+
+long tg_get_cfs_burst(struct task_group *tg)
+{
+	u64 burst_us;
+
+	burst_us = tg_cfs_bandwidth(tg)->burst;
+	do_div(burst_us, NSEC_PER_USEC);
+
+	return burst_us;
+}
+
 static s64 cpu_cfs_quota_read_s64(struct cgroup *cgrp, struct cftype *cft)
 {
 	return tg_get_cfs_quota(cgroup_tg(cgrp));
@@ -12317,6 +12536,19 @@ static int cpu_cfs_period_write_u64(struct cgroup *cgrp, struct cftype *cftype,
 	return tg_set_cfs_period(cgroup_tg(cgrp), cfs_period_us);
 }
 
+static u64 cpu_cfs_burst_read_u64(struct cgroup *cgrp, struct cftype *cft)
+{
+	return tg_get_cfs_burst(cgroup_tg(cgrp));
+}
+
+static int cpu_cfs_burst_write_u64(struct cgroup *cgrp, struct cftype *cftype,
+				u64 cfs_burst_us)
+{
+	if (cfs_burst_us > LONG_MAX / NSEC_PER_USEC)
+		return -EINVAL;
+	return tg_set_cfs_burst(cgroup_tg(cgrp), cfs_burst_us);
+}
+
 struct cfs_schedulable_data {
 	struct task_group *tg;
 	u64 period, quota;
@@ -12404,11 +12636,57 @@ static int cpu_stats_show(struct cgroup *cgrp, struct cftype *cft,
 	cb->fill(cb, "nr_periods", cfs_b->nr_periods);
 	cb->fill(cb, "nr_throttled", cfs_b->nr_throttled);
 	cb->fill(cb, "throttled_time", cfs_b->throttled_time);
+	cb->fill(cb, "nr_bursts", cfs_b->nr_bursts);
+	cb->fill(cb, "burst_time", cfs_b->burst_time);
 
 	return 0;
 }
 
 #ifdef CONFIG_CFS_CPULIMIT
+/*
+ * Picks tg->nr_cpus online cpus of the smallest sched domain that has as
+ * many, so that they share the cache if possible. Consecutive containers
+ * start from different cpus so that they do not pile up on the same ones.
+ * Is not redone on cpu hotplug, offline cpus are skipped on wakeup.
+ */
+static void tg_update_pack_mask(struct task_group *tg)
+{
+	static int pack_next;
+	const struct cpumask *span = cpu_online_mask;
+	struct sched_domain *sd;
+	unsigned int i, nr = tg->nr_cpus;
+	int cpu;
+
+	if (tg == &root_task_group)
+		return;
+
+	cpumask_clear(tg->pack_mask);
+	if (!nr || nr >= num_online_cpus() || tg->parent != &root_task_group)
+		return;
+
+	rcu_read_lock_sched();
+	cpu = cpumask_next(pack_next, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+
+	for_each_domain(cpu, sd) {
+		if (cpumask_weight(sched_domain_span(sd)) >= nr) {
+			span = sched_domain_span(sd);
+			break;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		cpumask_set_cpu(cpu, tg->pack_mask);
+		cpu = cpumask_next(cpu, span);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(span);
+	}
+	rcu_read_unlock_sched();
+
+	pack_next = cpu;
+}
+
 static void tg_update_cpu_limit(struct task_group *tg)
 {
 	long quota, period;
@@ -12424,6 +12702,7 @@ static void tg_update_cpu_limit(struct task_group *tg)
 
 	tg->cpu_rate = rate;
 	tg->nr_cpus = 0;
+	tg_update_pack_mask(tg);
 }
 
 static int tg_set_cpu_limit(struct task_group *tg,
@@ -12443,10 +12722,12 @@ static int tg_set_cpu_limit(struct task_group *tg,
 	}
 
 	mutex_lock(&cfs_constraints_mutex);
-	ret = __tg_set_cfs_bandwidth(tg, period, quota);
+	ret = __tg_set_cfs_bandwidth(tg, period, quota,
+				     tg_cfs_bandwidth(tg)->burst);
 	if (!ret) {
 		tg->cpu_rate = cpu_rate;
 		tg->nr_cpus = nr_cpus;
+		tg_update_pack_mask(tg);
 	}
 	mutex_unlock(&cfs_constraints_mutex);
 
@@ -12682,9 +12963,35 @@ static void fixup_vcpustat_delta(struct kernel_cpustat *cur,
 	cur->cpustat[STEAL] = 0;
 }
 
+/* takes what the pcpus of vcpu @i have folded since the last time */
+static void tg_take_vcpustat(struct task_group *tg, int i,
+			     struct kernel_cpustat *delta)
+{
+	struct vcpustat_acc *acc = tg->vcpustat_acc + i;
+	int j;
+
+	kernel_cpustat_zero(delta);
+	for (j = USER; j <= IOWAIT; j++)
+		delta->cpustat[j] = atomic64_xchg(&acc->cpustat[j], 0);
+}
+
+static u64 tg_peek_vcpustat_usage(struct task_group *tg, int i)
+{
+	struct vcpustat_acc *acc = tg->vcpustat_acc + i;
+
+	return atomic64_read(&acc->cpustat[USER]) +
+	       atomic64_read(&acc->cpustat[NICE]) +
+	       atomic64_read(&acc->cpustat[SYSTEM]);
+}
+
+/*
+ * The usage is folded into tg->vcpustat_acc by the ticks, so this costs
+ * O(vcpus) rather than O(pcpus). Up to VCPUSTAT_BATCH ticks per pcpu may
+ * be not folded yet, they show up on a later read.
+ */
 static void update_tg_vcpustat(struct task_group *tg)
 {
-	int i, j;
+	int i;
 	int nr_vcpus;
 	int vcpu_rate;
 	ktime_t now;
@@ -12701,16 +13008,13 @@ static void update_tg_vcpustat(struct task_group *tg)
 		vcpu_rate = MAX_CPU_RATE;
 
 	if (!ktime_to_ns(tg->vcpustat_last_update)) {
-		/* on the first read initialize vcpu i stat as a sum of stats
-		 * over pcpus j such that j % nr_vcpus == i */
+		/* on the first read take the stats as they are */
 		for (i = 0; i < nr_vcpus; i++) {
-			for (j = i; j < nr_cpu_ids; j += nr_vcpus) {
-				if (!cpu_possible(j))
-					continue;
-				kernel_cpustat_add(tg->vcpustat + i,
-						   per_cpu_ptr(tg->cpustat, j),
-						   tg->vcpustat + i);
-			}
+			tg_take_vcpustat(tg, i, &stat_delta);
+			stat_delta.cpustat[USED] = TICK_NSEC *
+				kernel_cpustat_total_usage(&stat_delta);
+			kernel_cpustat_add(tg->vcpustat + i, &stat_delta,
+					   tg->vcpustat + i);
 		}
 		goto out_update_last;
 	}
@@ -12722,12 +13026,6 @@ static void update_tg_vcpustat(struct task_group *tg)
 	if (max_usage < 10)
 		goto out_unlock;
 
-	/* temporarily copy per cpu usage delta to tg->cpustat_last */
-	for_each_possible_cpu(i)
-		kernel_cpustat_sub(per_cpu_ptr(tg->cpustat, i),
-				   tg->cpustat_last + i,
-				   tg->cpustat_last + i);
-
 	/* proceed to calculating per vcpu delta */
 	kernel_cpustat_zero(&stat_rem);
 
@@ -12735,26 +13033,20 @@ again:
 	for (i = 0; i < nr_vcpus; i++) {
 		int exceeds_max;
 
-		kernel_cpustat_zero(&stat_delta);
-		for (j = i; j < nr_cpu_ids; j += nr_vcpus) {
-			if (!cpu_possible(j))
-				continue;
-			kernel_cpustat_add(&stat_delta,
-					   tg->cpustat_last + j, &stat_delta);
-		}
-
-		exceeds_max = kernel_cpustat_total_usage(&stat_delta) >=
-								max_usage;
+		exceeds_max = tg_peek_vcpustat_usage(tg, i) >= max_usage;
 		/*
 		 * On the first pass calculate delta for vcpus with usage >
 		 * max_usage in order to accumulate excess in stat_rem.
 		 *
 		 * Once the remainder is accumulated, proceed to the rest of
-		 * vcpus so that it will be distributed among them.
+		 * vcpus so that it will be distributed among them. A vcpu
+		 * which has grown over max_usage in between is left for the
+		 * next read.
 		*/
 		if (exceeds_max != first_pass)
 			continue;
 
+		tg_take_vcpustat(tg, i, &stat_delta);
 		fixup_vcpustat_delta(&stat_delta, &stat_rem, max_usage);
 		kernel_cpustat_add(tg->vcpustat + i, &stat_delta,
 				   tg->vcpustat + i);
@@ -12765,8 +13057,6 @@ again:
 		goto again;
 	}
 out_update_last:
-	for_each_possible_cpu(i)
-		tg->cpustat_last[i] = *per_cpu_ptr(tg->cpustat, i);
 	tg->vcpustat_last_update = now;
 out_unlock:
 	spin_unlock(&tg->vcpustat_lock);
@@ -12793,7 +13083,9 @@ int cpu_cgroup_proc_stat(struct cgroup *cgrp, struct cftype *cft,
 	jif = boottime.tv_sec + tg->start_time.tv_sec;
 
 	for_each_possible_cpu(i) {
-		cpu_cgroup_update_stat(tg, i);
+		/* vcpustat does not need per-cpu stats */
+		if (!virt)
+			cpu_cgroup_update_stat(tg, i);
 
 		/* root task group has autogrouping, so this doesn't hold */
 #ifdef CONFIG_FAIR_GROUP_SCHED
@@ -12884,9 +13176,6 @@ void cpu_cgroup_get_stat(struct cgroup *cgrp, struct kernel_cpustat *kstat)
 	int nr_vcpus = tg_nr_cpus(tg);
 	int i;
 
-	for_each_possible_cpu(i)
-		cpu_cgroup_update_stat(tg, i);
-
 	update_tg_vcpustat(tg);
 
 	kernel_cpustat_zero(kstat);
@@ -12894,6 +13183,60 @@ void cpu_cgroup_get_stat(struct cgroup *cgrp, struct kernel_cpustat *kstat)
 		kernel_cpustat_add(tg->vcpustat + i, kstat, kstat);
 }
 
+#ifdef CONFIG_VE
+int cpu_cgroup_get_lat_hist(struct cgroup *cgrp, unsigned long *wait,
+			    unsigned long *throttle)
+{
+	struct task_group *tg = cgroup_tg(cgrp);
+
+	if (tg == &root_task_group)
+		return -ENOSYS;
+
+	KSTAT_LAT_PCPU_HIST(&tg->sched_lat, wait);
+	KSTAT_LAT_PCPU_HIST(&tg->throttle_lat, throttle);
+	return 0;
+}
+
+static void cpu_cgroup_show_hist(struct seq_file *p, const char *name,
+				 unsigned long *hist)
+{
+	int i;
+
+	seq_printf(p, "%s", name);
+	for (i = 0; i < KSTAT_LAT_HIST_NR; i++)
+		seq_printf(p, " %lu", hist[i]);
+	seq_putc(p, '\n');
+}
+
+static int cpu_cgroup_sched_lat_show(struct cgroup *cgrp, struct cftype *cft,
+				     struct seq_file *p)
+{
+	unsigned long wait[KSTAT_LAT_HIST_NR], throttle[KSTAT_LAT_HIST_NR];
+	int err;
+
+	err = cpu_cgroup_get_lat_hist(cgrp, wait, throttle);
+	if (err)
+		return err;
+
+	cpu_cgroup_show_hist(p, "wait", wait);
+	cpu_cgroup_show_hist(p, "throttle", throttle);
+	return 0;
+}
+#endif
+
+void cpu_cgroup_get_throttled(struct cgroup *cgrp, u64 *nr_throttled,
+			      u64 *throttled_time)
+{
+#ifdef CONFIG_CFS_BANDWIDTH
+	struct cfs_bandwidth *cfs_b = tg_cfs_bandwidth(cgroup_tg(cgrp));
+
+	*nr_throttled = cfs_b->nr_throttled;
+	*throttled_time = cfs_b->throttled_time;
+#else
+	*nr_throttled = *throttled_time = 0;
+#endif
+}
+
 int cpu_cgroup_get_avenrun(struct cgroup *cgrp, unsigned long *avenrun)
 {
 	struct task_group *tg = cgroup_tg(cgrp);
@@ -13031,6 +13374,11 @@ static struct cftype cpu_files[] = {
 		.read_u64 = cpu_cfs_period_read_u64,
 		.write_u64 = cpu_cfs_period_write_u64,
 	},
+	{
+		.name = "cfs_burst_us",
+		.read_u64 = cpu_cfs_burst_read_u64,
+		.write_u64 = cpu_cfs_burst_write_u64,
+	},
 	{
 		.name = "stat",
 		.read_map = cpu_stats_show,
@@ -13076,6 +13424,12 @@ static struct cftype cpu_files[] = {
 		.name = "delayacct.total",
 		.read_map = cpu_cgroup_delay_show,
 	},
+#ifdef CONFIG_VE
+	{
+		.name = "sched_lat",
+		.read_seq_string = cpu_cgroup_sched_lat_show,
+	},
+#endif
 };
 
 static int cpu_cgroup_populate(struct cgroup_subsys *ss, struct cgroup *cont)
@@ -13255,9 +13609,6 @@ static int cpuacct_percpu_seq_read(struct cgroup *cgroup, struct cftype *cft,
 	int i;
 
 	if (virt) {
-		for_each_possible_cpu(i)
-			cpu_cgroup_update_stat(tg, i);
-
 		update_tg_vcpustat(tg);
 
 		for(i = 0; i < nr_vcpus; i++) {
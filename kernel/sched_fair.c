@@ -111,6 +111,7 @@ unsigned int sysctl_sched_cfs_bandwidth_slice = 5000UL;
 
 #ifdef CONFIG_CFS_CPULIMIT
 unsigned int sysctl_sched_vcpu_hotslice = 5000000UL;
+unsigned int sysctl_sched_cpulimit_pack = 0;
 #endif
 
 static const struct sched_class fair_sched_class;
@@ -1035,7 +1036,8 @@ static void update_cfs_load(struct cfs_rq *cfs_rq, int global_update)
 		cfs_rq->load_period /= 2;
 		cfs_rq->load_avg /= 2;
 	}
-	if (!cfs_rq->curr && !cfs_rq->nr_running && !cfs_rq->load_avg)
+	if (!cfs_rq->curr && !cfs_rq->nr_running && !cfs_rq->load_avg &&
+	    !cfs_rq->nr_unint && !cfs_rq->calc_load_active)
 		list_del_leaf_cfs_rq(cfs_rq);
 }
 
@@ -1690,6 +1692,34 @@ static void update_cfs_bandwidth_idle_scale(struct cfs_bandwidth *cfs_b)
 		cfs_b->idle_scale_inv = 0;
 }
 
+/*
+ * With burst set, runtime a group does not use is kept as credit, up to
+ * quota + burst in total, and periods passed while the timer was inactive
+ * count as unused. Only what was spent over the quota counts as burst.
+ */
+static void __refill_cfs_bandwidth_burst(struct cfs_bandwidth *cfs_b, u64 now)
+{
+	u64 period = ktime_to_ns(cfs_b->period);
+	u64 limit = cfs_b->quota + cfs_b->burst;
+	u64 used, nr = 1;
+
+	if (cfs_b->runtime_snap > cfs_b->runtime) {
+		used = cfs_b->runtime_snap - cfs_b->runtime;
+		if (used > cfs_b->quota) {
+			cfs_b->nr_bursts++;
+			cfs_b->burst_time += used - cfs_b->quota;
+		}
+	}
+
+	if ((s64)(now - cfs_b->runtime_expires) > 0) {
+		nr += div64_u64(now - cfs_b->runtime_expires, period);
+		nr = min(nr, div64_u64(cfs_b->burst, cfs_b->quota) + 1);
+	}
+
+	cfs_b->runtime = min(cfs_b->runtime + nr * cfs_b->quota, limit);
+	cfs_b->runtime_snap = cfs_b->runtime;
+}
+
 /*
  * Replenish runtime according to assigned quota and update expiration time.
  * We use sched_clock_cpu directly instead of rq->clock to avoid adding
@@ -1707,7 +1737,10 @@ static void __refill_cfs_bandwidth_runtime(struct cfs_bandwidth *cfs_b)
 		return;
 
 	now = sched_clock_cpu(smp_processor_id());
-	cfs_b->runtime = cfs_b->quota;
+	if (cfs_b->burst)
+		__refill_cfs_bandwidth_burst(cfs_b, now);
+	else
+		cfs_b->runtime = cfs_b->quota;
 	cfs_b->runtime_expires = now + ktime_to_ns(cfs_b->period);
 }
 
@@ -1818,10 +1851,24 @@ static inline int throttled_hierarchy(struct cfs_rq *cfs_rq)
 	return cfs_rq->throttle_count;
 }
 
+/*
+ * A task enqueued on a cfs_rq which has used up its runtime, while the pool
+ * of the group is empty too, is throttled by check_enqueue_throttle() right
+ * away. Reads cfs_b->runtime without the lock, it is only a hint.
+ */
+static inline int throttled_on_arrival(struct cfs_rq *cfs_rq)
+{
+	struct cfs_bandwidth *cfs_b = tg_cfs_bandwidth(cfs_rq->tg);
+
+	return cfs_rq->runtime_enabled && cfs_rq->runtime_remaining <= 0 &&
+	       !ACCESS_ONCE(cfs_b->runtime);
+}
+
 /*
  * Ensure that neither of the group entities corresponding to src_cpu or
  * dest_cpu are members of a throttled hierarchy when performing group
- * load-balance operations.
+ * load-balance operations, and that tasks pulled to dest_cpu would not be
+ * throttled there on arrival.
  */
 static inline int throttled_lb_pair(struct task_group *tg,
 				    int src_cpu, int dest_cpu)
@@ -1832,7 +1879,8 @@ static inline int throttled_lb_pair(struct task_group *tg,
 	dest_cfs_rq = tg->cfs_rq[dest_cpu];
 
 	return throttled_hierarchy(src_cfs_rq) ||
-	       throttled_hierarchy(dest_cfs_rq);
+	       throttled_hierarchy(dest_cfs_rq) ||
+	       throttled_on_arrival(dest_cfs_rq);
 }
 
 /* updated child weight may affect parent so we have to do this bottom up */
@@ -1960,12 +2008,18 @@ static void unthrottle_cfs_rq(struct cfs_rq *cfs_rq)
 	struct sched_entity *se;
 	int enqueue = 1;
 	long task_delta;
+	u64 throttled;
 
 	se = cfs_rq->tg->se[cpu_of(rq_of(cfs_rq))];
 
 	cfs_rq->throttled = 0;
+	throttled = rq->clock - cfs_rq->throttled_timestamp;
+#ifdef CONFIG_VE
+	/* the slot of the cpu is serialized by its rq->lock */
+	KSTAT_LAT_PCPU_ADD(&cfs_rq->tg->throttle_lat, cpu_of(rq), throttled);
+#endif
 	spin_lock(&cfs_b->lock);
-	cfs_b->throttled_time += rq->clock - cfs_rq->throttled_timestamp;
+	cfs_b->throttled_time += throttled;
 	list_del_rcu(&cfs_rq->throttled_list);
 	spin_unlock(&cfs_b->lock);
 	cfs_rq->throttled_timestamp = 0;
@@ -2692,6 +2746,79 @@ static inline int cpu_is_runnable(struct cfs_rq *cfs_rq, int cpu)
 	return !cfs_rq || cfs_rq_active(cpu_cfs_rq(cfs_rq, cpu));
 }
 
+#ifdef CONFIG_CFS_CPULIMIT
+static inline struct cpumask *task_pack_mask(struct task_struct *p)
+{
+	struct cfs_rq *cfs_rq;
+
+	if (!sysctl_sched_cpulimit_pack)
+		return NULL;
+
+	cfs_rq = top_cfs_rq_of(&p->se);
+	if (!cfs_rq || cpumask_empty(cfs_rq->tg->pack_mask))
+		return NULL;
+	return cfs_rq->tg->pack_mask;
+}
+
+/*
+ * In the packing mode tasks of a container limited in the number of cpus
+ * are woken on the cpus of its tg->pack_mask, and leave them only when
+ * all of those are busy. Returns -1 if there is no idle one.
+ */
+static int select_packed_cpu(struct task_struct *p, int new_cpu)
+{
+	struct cpumask *mask = task_pack_mask(p);
+	int prev_cpu = task_cpu(p);
+	int cpu;
+
+	if (!mask)
+		return -1;
+
+	if (cpumask_test_cpu(new_cpu, mask) && idle_cpu(new_cpu))
+		return new_cpu;
+
+	if (cpumask_test_cpu(prev_cpu, mask) && idle_cpu(prev_cpu) &&
+	    cpu_active(prev_cpu) && cpumask_test_cpu(prev_cpu, &p->cpus_allowed))
+		return prev_cpu;
+
+	for_each_cpu_and(cpu, mask, &p->cpus_allowed) {
+		if (cpu_active(cpu) && idle_cpu(cpu))
+			return cpu;
+	}
+
+	return -1;
+}
+
+/* the balancer leaves the task alone while its own cpus can take it */
+static int cpulimit_pack_keep(struct task_struct *p, int dst_cpu)
+{
+	struct cpumask *mask = task_pack_mask(p);
+	int src_cpu = task_cpu(p);
+	int cpu;
+
+	if (!mask || cpumask_test_cpu(dst_cpu, mask) ||
+	    !cpumask_test_cpu(src_cpu, mask))
+		return 0;
+
+	for_each_cpu_and(cpu, mask, &p->cpus_allowed) {
+		if (cpu != src_cpu && cpu_active(cpu) && idle_cpu(cpu))
+			return 1;
+	}
+
+	return 0;
+}
+#else
+static inline int select_packed_cpu(struct task_struct *p, int new_cpu)
+{
+	return -1;
+}
+
+static inline int cpulimit_pack_keep(struct task_struct *p, int dst_cpu)
+{
+	return 0;
+}
+#endif
+
 static int select_runnable_cpu(struct task_struct *p, int new_cpu)
 {
 	struct cfs_rq *cfs_rq;
@@ -2735,6 +2862,7 @@ select_task_rq_fair(struct rq *rq, struct task_struct *p, int sd_flag, int wake_
 	int cpu = smp_processor_id();
 	int prev_cpu = task_cpu(p);
 	int new_cpu = cpu;
+	int packed_cpu;
 	int want_affine = 0;
 	int want_sd = 1;
 	int sync = wake_flags & WF_SYNC;
@@ -2802,6 +2930,10 @@ select_task_rq_fair(struct rq *rq, struct task_struct *p, int sd_flag, int wake_
 	if (check_cpulimit_spread(task_cfs_rq(p), new_cpu) <= 0)
 		return select_runnable_cpu(p, new_cpu);
 
+	packed_cpu = select_packed_cpu(p, new_cpu);
+	if (packed_cpu >= 0)
+		return packed_cpu;
+
 	if (affine_sd)
 		return select_idle_sibling(p, new_cpu);
 
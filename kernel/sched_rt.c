@@ -802,8 +802,13 @@ inc_rt_group(struct sched_rt_entity *rt_se, struct rt_rq *rt_rq)
 	if (rt_se_boosted(rt_se))
 		rt_rq->rt_nr_boosted++;
 
-	if (rt_rq->tg)
+	if (rt_rq->tg) {
 		start_rt_bandwidth(&rt_rq->tg->rt_bandwidth);
+#ifdef CONFIG_VE
+		/* rt tasks are few, no need to batch like calc_load_account_tg() */
+		atomic_long_inc(&rt_rq->tg->calc_load_tasks);
+#endif
+	}
 }
 
 static void
@@ -812,6 +817,10 @@ dec_rt_group(struct sched_rt_entity *rt_se, struct rt_rq *rt_rq)
 	if (rt_se_boosted(rt_se))
 		rt_rq->rt_nr_boosted--;
 
+#ifdef CONFIG_VE
+	if (rt_rq->tg)
+		atomic_long_dec(&rt_rq->tg->calc_load_tasks);
+#endif
 	WARN_ON(!rt_rq->rt_nr_running && rt_rq->rt_nr_boosted);
 }
 
@@ -58,6 +58,7 @@
 #include <linux/ve_task.h>
 #include <linux/mmgang.h>
 #include <linux/mnt_namespace.h>
+#include <linux/page_replica.h>
 
 #include <asm/uaccess.h>
 #include <asm/processor.h>
@@ -568,6 +569,15 @@ static struct ctl_table kern_table[] = {
 		.extra1		= &zero,
 		.extra2		= &one,
 	},
+	{
+		.procname	= "sched_cpulimit_pack",
+		.data		= &sysctl_sched_cpulimit_pack,
+		.maxlen		= sizeof(unsigned int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
 #endif
 #ifdef CONFIG_PROVE_LOCKING
 	{
@@ -981,6 +991,17 @@ static struct ctl_table kern_table[] = {
 		.extra1		= &zero,
 		.extra2		= &one,
 	},
+#ifdef CONFIG_VE_HWSTAT
+	{
+		.procname	= "ve_hwstat",
+		.data		= &ve_hwstat_active,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &ve_hwstat_sysctl_handler,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+#endif
 #endif
 	{
 		.ctl_name	= KERN_PANIC_ON_OOPS,
@@ -1192,6 +1213,14 @@ static struct ctl_table kern_table[] = {
 		.strategy	= &sysctl_data,
 	},
 #endif
+	{
+		.ctl_name	= CTL_UNNUMBERED,
+		.procname	= "timer_slack_ns",
+		.maxlen		= sizeof(unsigned long),
+		.extra1		= (void *)offsetof(struct ve_struct, timer_slack_ns),
+		.mode		= 0644 | S_ISVTX,
+		.proc_handler	= &proc_doulongvec_minmax,
+	},
 #if defined(CONFIG_S390) && defined(CONFIG_SMP)
 	{
 		.ctl_name	= KERN_SPIN_RETRY,
@@ -1782,6 +1811,18 @@ static struct ctl_table vm_table[] = {
 		.extra2		= &one_hundred,
 	},
 #endif
+#ifdef CONFIG_PAGECACHE_REPLICATION
+	{
+		.ctl_name	= CTL_UNNUMBERED,
+		.procname	= "pagecache_replication",
+		.data		= &sysctl_pagecache_replication,
+		.maxlen		= sizeof(sysctl_pagecache_replication),
+		.mode		= 0644,
+		.proc_handler	= &pagecache_replication_sysctl_handler,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+#endif
 #ifdef CONFIG_SMP
 	{
 		.ctl_name	= CTL_UNNUMBERED,
@@ -1985,6 +2026,19 @@ static struct ctl_table vm_table[] = {
 		.strategy	= &sysctl_intvec,
 	},
 #endif
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+	{
+		.procname	= "vswap_compress",
+		.ctl_name	= CTL_UNNUMBERED,
+		.data		= &sysctl_vswap_compress,
+		.maxlen		= sizeof(sysctl_vswap_compress),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.strategy	= &sysctl_intvec,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+#endif
 
 /*
  * NOTE: do not add new entries to this table unless you have read
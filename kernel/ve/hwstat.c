@@ -0,0 +1,242 @@
+/*
+ *  kernel/ve/hwstat.c
+ *
+ *  Copyright (C) 2000-2005  SWsoft
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * Per-VE hardware counters
+ *
+ * Every cpu runs one pinned cpu-wide perf counter of each kind. On a
+ * context switch between tasks of different VEs the counters are read
+ * locally and what they counted since the previous such switch is added
+ * to the per-cpu totals of the VE switched from. Switches inside of a VE
+ * cost nothing but a compare, and there is no per-task perf context.
+ */
+
+#include <linux/sched.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
+#include <linux/perf_event.h>
+#include <linux/sysctl.h>
+#include <linux/ve.h>
+
+static struct perf_event_attr ve_hw_attr[VE_HW_NR] = {
+	[VE_HW_CYCLES] = {
+		.type		= PERF_TYPE_HARDWARE,
+		.config		= PERF_COUNT_HW_CPU_CYCLES,
+		.size		= sizeof(struct perf_event_attr),
+		.pinned		= 1,
+	},
+	[VE_HW_INSTRUCTIONS] = {
+		.type		= PERF_TYPE_HARDWARE,
+		.config		= PERF_COUNT_HW_INSTRUCTIONS,
+		.size		= sizeof(struct perf_event_attr),
+		.pinned		= 1,
+	},
+	[VE_HW_LLC_MISSES] = {
+		.type		= PERF_TYPE_HARDWARE,
+		.config		= PERF_COUNT_HW_CACHE_MISSES,
+		.size		= sizeof(struct perf_event_attr),
+		.pinned		= 1,
+	},
+};
+
+struct ve_hw_cpu {
+	struct perf_event	*event[VE_HW_NR];
+	u64			start[VE_HW_NR];
+};
+
+static DEFINE_PER_CPU(struct ve_hw_cpu, ve_hw_cpu);
+
+int ve_hwstat_active __read_mostly;
+static int ve_hwstat_on;
+static DEFINE_MUTEX(ve_hwstat_mutex);
+
+/* Must be called on the cpu the event counts on, with irqs off */
+static inline bool ve_hw_read(struct perf_event *event, u64 *val)
+{
+	if (!event || event->state != PERF_EVENT_STATE_ACTIVE ||
+	    event->oncpu != smp_processor_id())
+		return false;
+
+	event->pmu->read(event);
+	*val = local64_read(&event->count);
+	return true;
+}
+
+void __ve_hwstat_switch(struct ve_struct *prev)
+{
+	struct ve_hw_cpu *hc = &__get_cpu_var(ve_hw_cpu);
+	struct ve_hw_stat *st;
+	u64 now;
+	int i;
+
+	st = per_cpu_ptr(prev->hw_stat, smp_processor_id());
+	for (i = 0; i < VE_HW_NR; i++) {
+		if (!ve_hw_read(hc->event[i], &now))
+			continue;
+		st->cnt[i] += now - hc->start[i];
+		hc->start[i] = now;
+	}
+}
+
+void ve_hwstat_get(struct ve_struct *ve, u64 *cnt)
+{
+	struct ve_hw_stat *st;
+	int cpu, i;
+
+	memset(cnt, 0, VE_HW_NR * sizeof(u64));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(ve->hw_stat, cpu);
+		for (i = 0; i < VE_HW_NR; i++)
+			cnt[i] += st->cnt[i];
+	}
+}
+EXPORT_SYMBOL(ve_hwstat_get);
+
+static void ve_hwstat_start_cpu(void *unused)
+{
+	struct ve_hw_cpu *hc = &__get_cpu_var(ve_hw_cpu);
+	unsigned long flags;
+	int i;
+
+	local_irq_save(flags);
+	for (i = 0; i < VE_HW_NR; i++)
+		ve_hw_read(hc->event[i], &hc->start[i]);
+	local_irq_restore(flags);
+}
+
+static void ve_hwstat_release_cpu(int cpu)
+{
+	struct ve_hw_cpu *hc = &per_cpu(ve_hw_cpu, cpu);
+	int i;
+
+	for (i = 0; i < VE_HW_NR; i++) {
+		if (!hc->event[i])
+			continue;
+		perf_event_release_kernel(hc->event[i]);
+		hc->event[i] = NULL;
+	}
+}
+
+static int ve_hwstat_create_cpu(int cpu)
+{
+	struct ve_hw_cpu *hc = &per_cpu(ve_hw_cpu, cpu);
+	struct perf_event *event;
+	int i;
+
+	for (i = 0; i < VE_HW_NR; i++) {
+		event = perf_event_create_kernel_counter(&ve_hw_attr[i], cpu,
+				NULL, NULL, NULL);
+		if (IS_ERR(event)) {
+			printk(KERN_WARNING "VE: can't count hw event %d "
+					"on cpu%d: %ld\n", i, cpu,
+					PTR_ERR(event));
+			ve_hwstat_release_cpu(cpu);
+			return PTR_ERR(event);
+		}
+		hc->event[i] = event;
+	}
+
+	smp_call_function_single(cpu, ve_hwstat_start_cpu, NULL, 1);
+	return 0;
+}
+
+/* Both are called with cpu hotplug and ve_hwstat_mutex held */
+static int ve_hwstat_enable(void)
+{
+	int cpu, err;
+
+	for_each_online_cpu(cpu) {
+		err = ve_hwstat_create_cpu(cpu);
+		if (err)
+			goto fail;
+	}
+	ve_hwstat_on = 1;
+	ve_hwstat_active = 1;
+	return 0;
+
+fail:
+	for_each_online_cpu(cpu)
+		ve_hwstat_release_cpu(cpu);
+	return err;
+}
+
+static void ve_hwstat_disable(void)
+{
+	int cpu;
+
+	ve_hwstat_active = 0;
+	ve_hwstat_on = 0;
+	/* nobody is in __ve_hwstat_switch() once this is over */
+	synchronize_sched();
+	for_each_online_cpu(cpu)
+		ve_hwstat_release_cpu(cpu);
+}
+
+int ve_hwstat_sysctl_handler(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct ctl_table t;
+	int on, err;
+
+	/* the cpu notifier takes the mutex from under hotplug */
+	get_online_cpus();
+	mutex_lock(&ve_hwstat_mutex);
+	on = ve_hwstat_on;
+	t = *table;
+	t.data = &on;
+	err = proc_dointvec_minmax(&t, write, buffer, lenp, ppos);
+	if (err || !write || on == ve_hwstat_on)
+		goto out;
+
+	if (on)
+		err = ve_hwstat_enable();
+	else
+		ve_hwstat_disable();
+out:
+	mutex_unlock(&ve_hwstat_mutex);
+	put_online_cpus();
+	return err;
+}
+
+static int __cpuinit ve_hwstat_cpu_callback(struct notifier_block *nfb,
+		unsigned long action, void *hcpu)
+{
+	int cpu = (long)hcpu;
+
+	switch (action) {
+	case CPU_ONLINE:
+	case CPU_ONLINE_FROZEN:
+		mutex_lock(&ve_hwstat_mutex);
+		if (ve_hwstat_on)
+			ve_hwstat_create_cpu(cpu);
+		mutex_unlock(&ve_hwstat_mutex);
+		break;
+	case CPU_DEAD:
+	case CPU_DEAD_FROZEN:
+		mutex_lock(&ve_hwstat_mutex);
+		ve_hwstat_release_cpu(cpu);
+		mutex_unlock(&ve_hwstat_mutex);
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block __cpuinitdata ve_hwstat_cpu_notifier = {
+	.notifier_call = ve_hwstat_cpu_callback,
+};
+
+static int __init ve_hwstat_init(void)
+{
+	register_cpu_notifier(&ve_hwstat_cpu_notifier);
+	return 0;
+}
+core_initcall(ve_hwstat_init);
@@ -80,6 +80,7 @@ struct ve_struct ve0 = {
 	.user_ns		= &init_user_ns,
 	.is_running		= 1,
 	.op_sem			= __RWSEM_INITIALIZER(ve0.op_sem),
+	.suspend_wq		= __WAIT_QUEUE_HEAD_INITIALIZER(ve0.suspend_wq),
 #ifdef CONFIG_VE_IPTABLES
 	.ipt_mask		= VE_IP_ALL,	/* everything is allowed */
 #endif
@@ -144,6 +145,12 @@ EXPORT_SYMBOL(ve_cleanup_list);
 EXPORT_SYMBOL(ve_cleanup_thread);
 
 static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, ve0_lat_stats);
+static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, ve0_alloc_lat);
+static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, ve0_page_in);
+static DEFINE_PER_CPU(struct kstat_lat_pcpu_snap_struct, ve0_swap_in);
+#ifdef CONFIG_VE_HWSTAT
+static DEFINE_PER_CPU(struct ve_hw_stat, ve0_hw_stat);
+#endif
 
 void init_ve0(void)
 {
@@ -151,6 +158,12 @@ void init_ve0(void)
 
 	ve = get_ve0();
 	ve->sched_lat_ve.cur = &per_cpu_var(ve0_lat_stats);
+	ve->alloc_lat_ve.cur = &per_cpu_var(ve0_alloc_lat);
+	ve->page_in_ve.cur = &per_cpu_var(ve0_page_in);
+	ve->swap_in_ve.cur = &per_cpu_var(ve0_swap_in);
+#ifdef CONFIG_VE_HWSTAT
+	ve->hw_stat = &per_cpu_var(ve0_hw_stat);
+#endif
 	list_add_rcu(&ve->ve_list, &ve_list_head);
 	INIT_LIST_HEAD(&ve->_kthread_create_list);
 	spin_lock_init(&ve->aio_nr_lock);
@@ -50,9 +50,11 @@
 #include <linux/pid.h>
 #include <net/pkt_sched.h>
 #include <bc/beancounter.h>
+#include <bc/vmpages.h>
 #include <linux/nsproxy.h>
 #include <linux/kobject.h>
 #include <linux/freezer.h>
+#include <linux/futex.h>
 #include <linux/pid_namespace.h>
 #include <linux/tty.h>
 #include <linux/mount.h>
@@ -182,6 +184,37 @@ out_unlock:
 	goto out_free;
 }
 
+#ifdef CONFIG_VE_HWSTAT
+static int ve_get_hw_stat(struct vzctl_hwstatctl __user *arg)
+{
+	struct vzctl_hwstatctl s;
+	struct ve_struct *ve;
+	u64 cnt[VE_HW_NR];
+
+	if (copy_from_user(&s, arg, sizeof(s)))
+		return -EFAULT;
+	if (!ve_is_super(get_exec_env()) && (s.veid != get_exec_env()->veid))
+		return -EPERM;
+
+	mutex_lock(&ve_list_lock);
+	ve = __find_ve_by_id(s.veid);
+	if (ve == NULL) {
+		mutex_unlock(&ve_list_lock);
+		return -ESRCH;
+	}
+	ve_hwstat_get(ve, cnt);
+	mutex_unlock(&ve_list_lock);
+
+	s.pad = 0;
+	s.cycles = cnt[VE_HW_CYCLES];
+	s.instructions = cnt[VE_HW_INSTRUCTIONS];
+	s.llc_misses = cnt[VE_HW_LLC_MISSES];
+	if (copy_to_user(arg, &s, sizeof(s)))
+		return -EFAULT;
+	return 0;
+}
+#endif
+
 extern int ve_devt_add(struct ve_struct *ve, unsigned type, dev_t devt,
 		       unsigned mask);
 
@@ -752,6 +785,11 @@ static int init_printk(struct ve_struct *ve)
 	ve->_log_end = &tmp->log_end;
 	ve->_logged_chars = &tmp->logged_chars;
 	/* ve->log_buf will be initialized later by ve_log_init() */
+	spin_lock_init(&ve->log_lock);
+	ve->log_new_line = 1;
+	ve->log_rl_begin = jiffies;
+	ve->log_rl_printed = 0;
+	ve->log_rl_missed = 0;
 	return 0;
 }
 
@@ -765,25 +803,71 @@ static void fini_printk(struct ve_struct *ve)
 	kfree(ve->_log_wait);
 }
 
-static void fini_venet(struct ve_struct *ve)
+/*
+ * VEs picked up by vzmond in one pass are cleaned up by parallel helpers,
+ * which wait for packets in flight together: the last helper to kill the
+ * sockets of its VE waits for the grace period on behalf of the batch.
+ */
+struct ve_cleanup_batch {
+	spinlock_t		lock;
+	struct list_head	list;		/* VEs not taken by helpers yet */
+	atomic_t		nr_unsynced;
+	atomic_t		refcnt;
+	struct completion	synced;
+};
+
+static void ve_cleanup_batch_sync(struct ve_cleanup_batch *batch, int wait)
+{
+	if (atomic_dec_and_test(&batch->nr_unsynced)) {
+		synchronize_net();
+		complete_all(&batch->synced);
+	} else if (wait)
+		wait_for_completion(&batch->synced);
+}
+
+static void ve_cleanup_batch_put(struct ve_cleanup_batch *batch)
+{
+	if (atomic_dec_and_test(&batch->refcnt))
+		kfree(batch);
+}
+
+static void fini_venet(struct ve_struct *ve, struct ve_cleanup_batch *batch)
 {
 #ifdef CONFIG_INET
 	tcp_v4_kill_ve_sockets(ve);
-	synchronize_net();
 #endif
+	if (batch != NULL)
+		ve_cleanup_batch_sync(batch, 1);
+	else
+		synchronize_net();
 }
 
 static int init_ve_sched(struct ve_struct *ve, unsigned int vcpus)
 {
+	struct cgroup *cgrp;
 	int err;
 
 	err = fairsched_new_node(ve->veid, vcpus);
+	if (err)
+		return err;
 
-	return err;
+	/* kept open for enter, see ve_attach_cgroups() */
+	cgrp = fairsched_open_node(ve->veid);
+	if (IS_ERR(cgrp)) {
+		fairsched_drop_node(ve->veid, 1);
+		return PTR_ERR(cgrp);
+	}
+	ve->ve_sched_cgroup = cgrp;
+
+	return 0;
 }
 
 static void fini_ve_sched(struct ve_struct *ve, int leave)
 {
+	if (ve->ve_sched_cgroup) {
+		cgroup_kernel_close(ve->ve_sched_cgroup);
+		ve->ve_sched_cgroup = NULL;
+	}
 	fairsched_drop_node(ve->veid, leave);
 }
 
@@ -843,17 +927,28 @@ static int init_ve_netns(struct ve_struct *ve)
 	return 0;
 }
 
-static void fini_ve_netns(struct ve_struct *ve)
+/*
+ * Netns is torn down from netns_wq, the caller may do the stages which
+ * don't depend on it before waiting for the completion.
+ */
+static int fini_ve_netns_start(struct ve_struct *ve, struct completion *done)
 {
 	struct net *net;
-	DECLARE_COMPLETION_ONSTACK(sysfs_completion);
 
 	net = ve->ve_netns;
 	if (!net)
-		return; /* it isn't initialized yet */
-	net->sysfs_completion = &sysfs_completion;
+		return 0; /* it isn't initialized yet */
+	net->sysfs_completion = done;
 	put_net(net);
-	wait_for_completion(&sysfs_completion);
+	return 1;
+}
+
+static void fini_ve_netns(struct ve_struct *ve)
+{
+	DECLARE_COMPLETION_ONSTACK(sysfs_completion);
+
+	if (fini_ve_netns_start(ve, &sysfs_completion))
+		wait_for_completion(&sysfs_completion);
 }
 
 static inline void switch_ve_namespaces(struct ve_struct *ve,
@@ -899,6 +994,7 @@ static int init_ve_struct(struct ve_struct *ve, envid_t veid,
 	ve->features = get_ve_features(data, datalen);
 	INIT_LIST_HEAD(&ve->vetask_lh);
 	init_rwsem(&ve->op_sem);
+	init_waitqueue_head(&ve->suspend_wq);
 
 	ve->start_timespec = current->start_time;
 	ve->real_start_timespec = current->real_start_time;
@@ -987,6 +1083,19 @@ static void put_ve_root(struct ve_struct *ve)
 	path_put(&ve->root_path);
 }
 
+/* return free pages of the per-beancounter slab caches of a stopped VE */
+static void fini_ve_slab(struct ve_struct *ve)
+{
+	struct user_beancounter *ub;
+
+	ub = get_beancounter_byuid(ve->veid, 0);
+	if (ub == NULL)
+		return;
+
+	slab_shrink_ub(ub);
+	put_beancounter(ub);
+}
+
 static void set_ve_caps(struct ve_struct *ve, struct task_struct *tsk)
 {
 	/* required for real_setdevperms from register_ve_<fs> above */
@@ -1034,7 +1143,7 @@ static void init_ve_cred(struct ve_struct *ve, struct cred *new)
 	ve->user_ns = new->user->user_ns;
 }
 
-static void ve_move_task(struct ve_struct *new)
+static void __ve_move_task(struct ve_struct *new)
 {
 	struct task_struct *tsk = current;
 	struct ve_struct *old;
@@ -1075,8 +1184,31 @@ static void ve_move_task(struct ve_struct *new)
 
 	real_put_ve(old);
 	get_ve(new);
+}
+
+static void ve_move_task(struct ve_struct *new)
+{
+	__ve_move_task(new);
+	cgroup_kernel_attach(new->ve_cgroup, current);
+}
+
+/*
+ * Moves the task into the fairsched node and the container cgroup of
+ * the VE in one go, both are opened when the VE starts.
+ */
+static int ve_attach_cgroups(struct ve_struct *ve, struct task_struct *tsk)
+{
+	struct cgroup *cgrps[] = { ve->ve_sched_cgroup, ve->ve_cgroup };
 
-	cgroup_kernel_attach(new->ve_cgroup, tsk);
+#ifdef CONFIG_VZ_FAIRSCHED
+	if (!ve->ve_sched_cgroup) {
+		int err = fairsched_move_task(ve->veid, tsk);
+
+		if (err)
+			return err;
+	}
+#endif
+	return cgroup_kernel_attach_many(cgrps, ARRAY_SIZE(cgrps), tsk);
 }
 
 #ifdef CONFIG_VE_IPTABLES
@@ -1106,18 +1238,41 @@ static __u64 setup_iptables_mask(__u64 init_mask)
 
 #endif
 
+static inline void free_ve_cpustats(struct ve_struct *ve)
+{
+	free_percpu(ve->sched_lat_ve.cur);
+	ve->sched_lat_ve.cur = NULL;
+	free_percpu(ve->alloc_lat_ve.cur);
+	ve->alloc_lat_ve.cur = NULL;
+	free_percpu(ve->page_in_ve.cur);
+	ve->page_in_ve.cur = NULL;
+	free_percpu(ve->swap_in_ve.cur);
+	ve->swap_in_ve.cur = NULL;
+#ifdef CONFIG_VE_HWSTAT
+	free_percpu(ve->hw_stat);
+	ve->hw_stat = NULL;
+#endif
+}
+
 static inline int init_ve_cpustats(struct ve_struct *ve)
 {
 	ve->sched_lat_ve.cur = alloc_percpu(struct kstat_lat_pcpu_snap_struct);
-	if (ve->sched_lat_ve.cur == NULL)
-		return -ENOMEM;
+	ve->alloc_lat_ve.cur = alloc_percpu(struct kstat_lat_pcpu_snap_struct);
+	ve->page_in_ve.cur = alloc_percpu(struct kstat_lat_pcpu_snap_struct);
+	ve->swap_in_ve.cur = alloc_percpu(struct kstat_lat_pcpu_snap_struct);
+	if (ve->sched_lat_ve.cur == NULL || ve->alloc_lat_ve.cur == NULL ||
+	    ve->page_in_ve.cur == NULL || ve->swap_in_ve.cur == NULL)
+		goto nomem;
+#ifdef CONFIG_VE_HWSTAT
+	ve->hw_stat = alloc_percpu(struct ve_hw_stat);
+	if (ve->hw_stat == NULL)
+		goto nomem;
+#endif
 	return 0;
-}
 
-static inline void free_ve_cpustats(struct ve_struct *ve)
-{
-	free_percpu(ve->sched_lat_ve.cur);
-	ve->sched_lat_ve.cur = NULL;
+nomem:
+	free_ve_cpustats(ve);
+	return -ENOMEM;
 }
 
 static int alone_in_pgrp(struct task_struct *tsk)
@@ -1222,6 +1377,107 @@ int init_kthreadd(struct ve_struct *ve)
 	return 0;
 }
 
+/*
+ * Pool of VE skeletons: ve_struct with its per-cpu statistics allocated
+ * in advance, so that a start does not wait for the percpu allocator.
+ * Everything else a VE is made of is set up under its exec_env and
+ * charged to its beancounter, so it can't be prepared before the start.
+ */
+#define VE_PREALLOC_MAX		64
+
+static int ve_prealloc;
+static int ve_prealloc_max = VE_PREALLOC_MAX;
+static LIST_HEAD(ve_prealloc_list);
+static int ve_prealloc_nr;
+static DEFINE_SPINLOCK(ve_prealloc_lock);
+
+static struct ve_struct *alloc_ve_skeleton(void)
+{
+	struct ve_struct *ve;
+
+	ve = kzalloc(sizeof(struct ve_struct), GFP_KERNEL);
+	if (ve == NULL)
+		return NULL;
+
+	if (init_ve_cpustats(ve) < 0) {
+		kfree(ve);
+		return NULL;
+	}
+	return ve;
+}
+
+static void free_ve_skeleton(struct ve_struct *ve)
+{
+	free_ve_cpustats(ve);
+	kfree(ve);
+}
+
+static void ve_prealloc_refill(struct work_struct *work)
+{
+	struct ve_struct *ve;
+
+	while (1) {
+		spin_lock(&ve_prealloc_lock);
+		if (ve_prealloc_nr > ve_prealloc) {
+			ve = list_first_entry(&ve_prealloc_list,
+					struct ve_struct, ve_list);
+			list_del(&ve->ve_list);
+			ve_prealloc_nr--;
+			spin_unlock(&ve_prealloc_lock);
+			free_ve_skeleton(ve);
+			continue;
+		}
+		if (ve_prealloc_nr == ve_prealloc) {
+			spin_unlock(&ve_prealloc_lock);
+			break;
+		}
+		spin_unlock(&ve_prealloc_lock);
+
+		ve = alloc_ve_skeleton();
+		if (ve == NULL)
+			break;
+
+		spin_lock(&ve_prealloc_lock);
+		list_add_tail(&ve->ve_list, &ve_prealloc_list);
+		ve_prealloc_nr++;
+		spin_unlock(&ve_prealloc_lock);
+	}
+}
+
+static DECLARE_WORK(ve_prealloc_work, ve_prealloc_refill);
+
+static struct ve_struct *get_ve_skeleton(void)
+{
+	struct ve_struct *ve = NULL;
+
+	spin_lock(&ve_prealloc_lock);
+	if (ve_prealloc_nr) {
+		ve = list_first_entry(&ve_prealloc_list,
+				struct ve_struct, ve_list);
+		list_del(&ve->ve_list);
+		ve_prealloc_nr--;
+	}
+	spin_unlock(&ve_prealloc_lock);
+
+	if (ve_prealloc)
+		schedule_work(&ve_prealloc_work);
+	if (ve == NULL)
+		ve = alloc_ve_skeleton();
+	return ve;
+}
+
+static void fini_ve_prealloc(void)
+{
+	struct ve_struct *ve, *tmp;
+
+	ve_prealloc = 0;
+	cancel_work_sync(&ve_prealloc_work);
+	list_for_each_entry_safe(ve, tmp, &ve_prealloc_list, ve_list)
+		free_ve_skeleton(ve);
+	INIT_LIST_HEAD(&ve_prealloc_list);
+	ve_prealloc_nr = 0;
+}
+
 static int do_env_create(envid_t veid, unsigned int flags, u32 class_id,
 			 env_create_param_t *data, int datalen)
 {
@@ -1269,8 +1525,13 @@ static int do_env_create(envid_t veid, unsigned int flags, u32 class_id,
 	VZTRACE("%s: veid=%d classid=%d pid=%d\n",
 		__FUNCTION__, veid, class_id, current->pid);
 
+	/*
+	 * cpustats come with the skeleton, they should be there before
+	 * adding to list because if calc_load_ve finds this ve in list
+	 * it will be very surprised
+	 */
 	err = -ENOMEM;
-	ve = kzalloc(sizeof(struct ve_struct), GFP_KERNEL);
+	ve = get_ve_skeleton();
 	if (ve == NULL)
 		goto err_struct;
 
@@ -1280,14 +1541,6 @@ static int do_env_create(envid_t veid, unsigned int flags, u32 class_id,
 	if (flags & VE_LOCK)
 		ve->is_locked = 1;
 
-	/*
-	 * this should be done before adding to list
-	 * because if calc_load_ve finds this ve in
-	 * list it will be very surprised
-	 */
-	if ((err = init_ve_cpustats(ve)) < 0)
-		goto err_cpu_stats;
-
 	if ((err = init_ve_cgroups(ve)))
 		goto err_cgroup;
 
@@ -1386,7 +1639,7 @@ err_uns:
 err_creds:
 	mntget(ve->proc_mnt);
 err_vpid:
-	fini_venet(ve);
+	fini_venet(ve, NULL);
 	fini_ve_meminfo(ve);
 err_meminf:
 	fini_ve_devpts(ve);
@@ -1454,9 +1707,7 @@ err_struct:
 err_exist:
 	fini_ve_cgroups(ve);
 err_cgroup:
-	free_ve_cpustats(ve);
-err_cpu_stats:
-	kfree(ve);
+	free_ve_skeleton(ve);
 	module_put(THIS_MODULE);
 	goto err_struct;
 }
@@ -1543,14 +1794,16 @@ static int do_env_enter(struct ve_struct *ve, unsigned int flags)
 	if (!thread_group_leader(tsk) || !thread_group_empty(tsk))
 		goto out_up;
 
-#ifdef CONFIG_VZ_FAIRSCHED
-	err = fairsched_move_task(ve->veid, current);
+	/*
+	 * Everything is switched to what was prepared at VE start: its
+	 * nsproxy, init_cred and both cgroups opened, no lookups here.
+	 */
+	err = ve_attach_cgroups(ve, tsk);
 	if (err)
 		goto out_up;
-#endif
 	switch_ve_namespaces(ve, tsk);
 	set_exec_env(ve);
-	ve_move_task(ve);
+	__ve_move_task(ve);
 
 	if (alone_in_pgrp(tsk) && !(flags & VE_SKIPLOCK))
 		pid_ns_attach_task(ve->ve_ns->pid_ns, tsk);
@@ -1570,16 +1823,18 @@ out_up:
 
 extern void fini_ve_devices(struct ve_struct *ve);
 
-static void env_cleanup(struct ve_struct *ve)
+static void env_cleanup(struct ve_struct *ve, struct ve_cleanup_batch *batch)
 {
 	struct ve_struct *old_ve;
+	DECLARE_COMPLETION_ONSTACK(netns_completion);
+	int netns_pending;
 
 	VZTRACE("real_do_env_cleanup\n");
 
 	down_read(&ve->op_sem);
 	old_ve = set_exec_env(ve);
 
-	fini_venet(ve);
+	fini_venet(ve, batch);
 
 	/* no new packets in flight beyond this point */
 
@@ -1594,14 +1849,17 @@ static void env_cleanup(struct ve_struct *ve)
 	fini_ve_devices(ve);
 
 	fini_ve_namespaces(ve, NULL);
-	fini_ve_netns(ve);
+	netns_pending = fini_ve_netns_start(ve, &netns_completion);
 	fini_ve_proc(ve);
+	if (netns_pending)
+		wait_for_completion(&netns_completion);
 	fini_ve_sysfs(ve);
 	fini_ve_devtmpfs(ve);
 
 	ve_hook_iterate_fini(VE_CLEANUP_CHAIN, ve);
 
 	put_ve_root(ve);
+	fini_ve_slab(ve);
 
 	(void)set_exec_env(old_ve);
 	fini_printk(ve);	/* no printk can happen in ve context anymore */
@@ -1613,43 +1871,90 @@ static void env_cleanup(struct ve_struct *ve)
 }
 
 static DECLARE_COMPLETION(vzmond_complete);
+
+static struct ve_struct *ve_cleanup_batch_next(struct ve_cleanup_batch *batch)
+{
+	struct ve_struct *ve;
+
+	spin_lock(&batch->lock);
+	ve = list_first_entry(&batch->list, struct ve_struct, cleanup_list);
+	list_del(&ve->cleanup_list);
+	spin_unlock(&batch->lock);
+	return ve;
+}
+
 static int vzmond_helper(void *arg)
 {
 	char name[18];
+	struct ve_cleanup_batch *batch;
 	struct ve_struct *ve;
 
-	ve = (struct ve_struct *)arg;
+	batch = (struct ve_cleanup_batch *)arg;
+	ve = ve_cleanup_batch_next(batch);
 	snprintf(name, sizeof(name), "vzmond/%d", ve->veid);
 	daemonize(name);
-	env_cleanup(ve);
+	env_cleanup(ve, batch);
+	ve_cleanup_batch_put(batch);
 	module_put_and_exit(0);
 }
 
 static void do_pending_env_cleanups(void)
 {
-	int err;
+	int err, nr = 0;
+	struct ve_cleanup_batch *batch;
 	struct ve_struct *ve;
 
-	spin_lock(&ve_cleanup_lock);
-	while (1) {
-		if (list_empty(&ve_cleanup_list) || need_resched())
-			break;
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (batch == NULL) {
+		/* clean up one by one, each waiting for its own packets */
+		spin_lock(&ve_cleanup_lock);
+		while (!list_empty(&ve_cleanup_list)) {
+			ve = list_first_entry(&ve_cleanup_list,
+					struct ve_struct, cleanup_list);
+			list_del(&ve->cleanup_list);
+			spin_unlock(&ve_cleanup_lock);
+
+			env_cleanup(ve, NULL);
 
-		ve = list_first_entry(&ve_cleanup_list,
-				struct ve_struct, cleanup_list);
-		list_del(&ve->cleanup_list);
+			spin_lock(&ve_cleanup_lock);
+		}
 		spin_unlock(&ve_cleanup_lock);
+		return;
+	}
 
+	spin_lock_init(&batch->lock);
+	INIT_LIST_HEAD(&batch->list);
+	init_completion(&batch->synced);
+
+	spin_lock(&ve_cleanup_lock);
+	list_splice_init(&ve_cleanup_list, &batch->list);
+	spin_unlock(&ve_cleanup_lock);
+
+	list_for_each_entry(ve, &batch->list, cleanup_list)
+		nr++;
+	if (nr == 0) {
+		kfree(batch);
+		return;
+	}
+
+	atomic_set(&batch->nr_unsynced, nr);
+	atomic_set(&batch->refcnt, nr);
+
+	while (nr--) {
 		__module_get(THIS_MODULE);
-		err = kernel_thread(vzmond_helper, (void *)ve, 0);
+		err = kernel_thread(vzmond_helper, (void *)batch, 0);
 		if (err < 0) {
-			env_cleanup(ve);
+			/*
+			 * the rest of the batch is not spawned yet, so don't
+			 * wait for it at the barrier
+			 */
+			ve = ve_cleanup_batch_next(batch);
+			ve_cleanup_batch_sync(batch, 0);
+			env_cleanup(ve, NULL);
+			ve_cleanup_batch_put(batch);
 			module_put(THIS_MODULE);
 		}
-
-		spin_lock(&ve_cleanup_lock);
 	}
-	spin_unlock(&ve_cleanup_lock);
 }
 
 static inline int have_pending_cleanups(void)
@@ -2164,6 +2469,212 @@ static struct file_operations proc_vestat_operations = {
         .release = seq_release
 };
 
+static void sched_lat_show_hist(struct seq_file *m, envid_t veid,
+		const char *name, unsigned long *hist)
+{
+	int i;
+
+	seq_printf(m, "%10u %-8s", veid, name);
+	for (i = 0; i < KSTAT_LAT_HIST_NR; i++)
+		seq_printf(m, " %lu", hist[i]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * Log2 histograms of runqueue wait of the tasks of a VE and of the time
+ * its cpu cgroup stayed throttled, counts are since the VE start.
+ */
+static int sched_lat_seq_show(struct seq_file *m, void *v)
+{
+	struct list_head *entry;
+	struct ve_struct *ve, *curve;
+	unsigned long wait[KSTAT_LAT_HIST_NR], throttle[KSTAT_LAT_HIST_NR];
+	int i;
+
+	entry = (struct list_head *)v;
+	ve = list_entry(entry, struct ve_struct, ve_list);
+
+	curve = get_exec_env();
+	if (entry == ve_list_head.next ||
+	    (!ve_is_super(curve) && ve == curve)) {
+		seq_printf(m, "Version: 1.0\n%10s %-8s", "VEID", "lat_ns>=");
+		seq_printf(m, " 0");
+		for (i = 1; i < KSTAT_LAT_HIST_NR; i++)
+			seq_printf(m, " %llu", 1ULL << (i + 9));
+		seq_putc(m, '\n');
+	}
+
+	if (ve_is_super(ve))
+		return 0;
+
+	KSTAT_LAT_PCPU_HIST(&ve->sched_lat_ve, wait);
+	sched_lat_show_hist(m, ve->veid, "wait", wait);
+	if (fairsched_get_lat_hist(ve->veid, wait, throttle) == 0)
+		sched_lat_show_hist(m, ve->veid, "throttle", throttle);
+	return 0;
+}
+
+static struct seq_operations sched_lat_seq_op = {
+	.start	= ve_seq_start,
+	.next	= ve_seq_next,
+	.stop	= ve_seq_stop,
+	.show	= sched_lat_seq_show,
+};
+
+static int sched_lat_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &sched_lat_seq_op);
+}
+
+static struct file_operations proc_sched_lat_operations = {
+	.open		= sched_lat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
+static void lat_hist_put(struct seq_file *m, envid_t veid, int type,
+		struct kstat_lat_snap_struct *s)
+{
+	struct vzstat_lat_rec rec;
+	int i;
+
+	rec.veid = veid;
+	rec.type = type;
+	rec.count = s->count;
+	rec.totlat = s->totlat;
+	for (i = 0; i < KSTAT_LAT_HIST_NR; i++)
+		rec.hist[i] = s->hist[i];
+	seq_write(m, &rec, sizeof(rec));
+}
+
+static void lat_hist_put_pcpu(struct seq_file *m, envid_t veid, int type,
+		struct kstat_lat_pcpu_struct *p)
+{
+	struct kstat_lat_snap_struct s;
+
+	KSTAT_LAT_PCPU_SUM(p, &s);
+	lat_hist_put(m, veid, type, &s);
+}
+
+static void lat_hist_show_host(struct seq_file *m)
+{
+	struct kstat_lat_snap_struct s, all;
+	int i, j;
+
+	lat_hist_put_pcpu(m, 0, VZSTAT_LAT_SCHED, &kstat_glob.sched_lat);
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < KSTAT_ALLOCSTAT_NR; i++) {
+		KSTAT_LAT_PCPU_SUM(&kstat_glob.alloc_lat[i], &s);
+		lat_hist_put(m, 0, VZSTAT_LAT_ALLOC_KIND + i, &s);
+
+		all.count += s.count;
+		all.totlat += s.totlat;
+		for (j = 0; j < KSTAT_LAT_HIST_NR; j++)
+			all.hist[j] += s.hist[j];
+	}
+	lat_hist_put(m, 0, VZSTAT_LAT_ALLOC, &all);
+
+	lat_hist_put_pcpu(m, 0, VZSTAT_LAT_PAGE_IN, &kstat_glob.page_in);
+	lat_hist_put_pcpu(m, 0, VZSTAT_LAT_SWAP_IN, &kstat_glob.swap_in);
+}
+
+/*
+ * The same histograms as in /proc/vz/sched_lat and more, in binary
+ * records which monitoring can read and diff without parsing.
+ */
+static int lat_hist_seq_show(struct seq_file *m, void *v)
+{
+	struct list_head *entry;
+	struct ve_struct *ve, *curve;
+
+	entry = (struct list_head *)v;
+	ve = list_entry(entry, struct ve_struct, ve_list);
+
+	curve = get_exec_env();
+	if (entry == ve_list_head.next ||
+	    (!ve_is_super(curve) && ve == curve)) {
+		struct vzstat_lat_hdr hdr = {
+			.version	= VZSTAT_LAT_VERSION,
+			.rec_size	= sizeof(struct vzstat_lat_rec),
+			.hist_nr	= KSTAT_LAT_HIST_NR,
+		};
+
+		seq_write(m, &hdr, sizeof(hdr));
+	}
+
+	if (ve_is_super(ve)) {
+		lat_hist_show_host(m);
+		return 0;
+	}
+
+	lat_hist_put_pcpu(m, ve->veid, VZSTAT_LAT_SCHED, &ve->sched_lat_ve);
+	lat_hist_put_pcpu(m, ve->veid, VZSTAT_LAT_ALLOC, &ve->alloc_lat_ve);
+	lat_hist_put_pcpu(m, ve->veid, VZSTAT_LAT_PAGE_IN, &ve->page_in_ve);
+	lat_hist_put_pcpu(m, ve->veid, VZSTAT_LAT_SWAP_IN, &ve->swap_in_ve);
+	return 0;
+}
+
+static struct seq_operations lat_hist_seq_op = {
+	.start	= ve_seq_start,
+	.next	= ve_seq_next,
+	.stop	= ve_seq_stop,
+	.show	= lat_hist_seq_show,
+};
+
+static int lat_hist_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &lat_hist_seq_op);
+}
+
+static struct file_operations proc_lat_hist_operations = {
+	.open		= lat_hist_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
+#ifdef CONFIG_VE_HWSTAT
+static int hwstat_seq_show(struct seq_file *m, void *v)
+{
+	struct ve_struct *ve;
+	u64 cnt[VE_HW_NR];
+
+	ve = list_entry((struct list_head *)v, struct ve_struct, ve_list);
+	if (ve == list_entry(ve_list_head.next, struct ve_struct, ve_list) ||
+	    (!ve_is_super(get_exec_env()) && ve == get_exec_env()))
+		seq_printf(m, "%10s %20s %20s %20s\n", "veid", "cycles",
+				"instructions", "llc_misses");
+
+	ve_hwstat_get(ve, cnt);
+	seq_printf(m, "%10u %20llu %20llu %20llu\n", ve->veid,
+			(unsigned long long)cnt[VE_HW_CYCLES],
+			(unsigned long long)cnt[VE_HW_INSTRUCTIONS],
+			(unsigned long long)cnt[VE_HW_LLC_MISSES]);
+	return 0;
+}
+
+static struct seq_operations hwstat_seq_op = {
+	.start	= ve_seq_start,
+	.next	= ve_seq_next,
+	.stop	= ve_seq_stop,
+	.show	= hwstat_seq_show,
+};
+
+static int hwstat_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &hwstat_seq_op);
+}
+
+static struct file_operations proc_hwstat_operations = {
+	.open		= hwstat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+#endif
+
 static struct seq_operations devperms_seq_op = {
 	.start  = ve_seq_start,
 	.next   = ve_seq_next,
@@ -2266,6 +2777,23 @@ static int __init init_vecalls_proc(void)
 	if (!de)
 		printk(KERN_WARNING "VZMON: can't make vestat proc entry\n");
 
+	de = proc_create("sched_lat", S_IFREG | S_IRUSR, glob_proc_vz_dir,
+			&proc_sched_lat_operations);
+	if (!de)
+		printk(KERN_WARNING "VZMON: can't make sched_lat proc entry\n");
+
+	de = proc_create("lat_hist", S_IFREG | S_IRUSR, glob_proc_vz_dir,
+			&proc_lat_hist_operations);
+	if (!de)
+		printk(KERN_WARNING "VZMON: can't make lat_hist proc entry\n");
+
+#ifdef CONFIG_VE_HWSTAT
+	de = proc_create("hwstat", S_IFREG | S_IRUSR, glob_proc_vz_dir,
+			&proc_hwstat_operations);
+	if (!de)
+		printk(KERN_WARNING "VZMON: can't make hwstat proc entry\n");
+#endif
+
 	de = proc_create("devperms", S_IFREG | S_IRUSR, proc_vz_dir,
 			&proc_devperms_ops);
 	if (!de)
@@ -2289,6 +2817,11 @@ static void fini_vecalls_proc(void)
 	remove_proc_entry("version", proc_vz_dir);
 	remove_proc_entry("devperms", proc_vz_dir);
 	remove_proc_entry("vestat", glob_proc_vz_dir);
+	remove_proc_entry("sched_lat", glob_proc_vz_dir);
+	remove_proc_entry("lat_hist", glob_proc_vz_dir);
+#ifdef CONFIG_VE_HWSTAT
+	remove_proc_entry("hwstat", glob_proc_vz_dir);
+#endif
 	remove_proc_entry("veinfo", glob_proc_vz_dir);
 }
 #else
@@ -2550,6 +3083,84 @@ static int ve_configure_mount_options(struct ve_struct *ve, unsigned int val,
 	return 0;
 }
 
+/* the modes are kept in the top beancounter, mm/huge_memory.c finds it */
+static int ve_configure_thp(struct ve_struct *ve, unsigned int val)
+{
+	struct user_beancounter *ub;
+
+	if (val & ~(VE_THP_MASK | (VE_THP_MASK << VE_THP_DEFRAG_SHIFT)))
+		return -EINVAL;
+
+	ub = get_beancounter_byuid(ve->veid, 0);
+	if (ub == NULL)
+		return -ESRCH;
+
+	ub->ub_thp_mode = val;
+	put_beancounter(ub);
+	return 0;
+}
+
+static int ve_configure_swap(struct ve_struct *ve, unsigned int size,
+			     char *data)
+{
+	struct user_beancounter *ub;
+	int err;
+
+	ub = get_beancounter_byuid(ve->veid, 0);
+	if (ub == NULL)
+		return -ESRCH;
+
+	err = ub_swap_set_prefer(ub, size ? data : "");
+	put_beancounter(ub);
+	return err;
+}
+
+/* soft limit of page cache of the VE, 0 drops it */
+static int ve_configure_pagecache(struct ve_struct *ve, unsigned int val)
+{
+	struct user_beancounter *ub;
+
+	ub = get_beancounter_byuid(ve->veid, 0);
+	if (ub == NULL)
+		return -ESRCH;
+
+	ub->ub_cache_limit = val;
+	put_beancounter(ub);
+	return 0;
+}
+
+/* direct compaction budget of the VE in ms per second, 0 drops it */
+static int ve_configure_compact(struct ve_struct *ve, unsigned int val)
+{
+	struct user_beancounter *ub;
+
+	if (val > MSEC_PER_SEC)
+		return -EINVAL;
+
+	ub = get_beancounter_byuid(ve->veid, 0);
+	if (ub == NULL)
+		return -ESRCH;
+
+	ub->ub_compact_budget = val;
+	put_beancounter(ub);
+	return 0;
+}
+
+/* private futex hash of the VE, can be set only once */
+static int ve_configure_futex(struct ve_struct *ve, unsigned int val)
+{
+	struct user_beancounter *ub;
+	int err;
+
+	ub = get_beancounter_byuid(ve->veid, 0);
+	if (ub == NULL)
+		return -ESRCH;
+
+	err = ub_futex_hash_init(ub, val);
+	put_beancounter(ub);
+	return err;
+}
+
 static int ve_configure(envid_t veid, unsigned int key,
 			unsigned int val, unsigned int size, char *data)
 {
@@ -2575,6 +3186,21 @@ static int ve_configure(envid_t veid, unsigned int key,
 	case VE_CONFIGURE_MOUNT_OPTIONS:
 		err = ve_configure_mount_options(ve, val, size, data);
 		break;
+	case VE_CONFIGURE_THP:
+		err = ve_configure_thp(ve, val);
+		break;
+	case VE_CONFIGURE_SWAP:
+		err = ve_configure_swap(ve, size, data);
+		break;
+	case VE_CONFIGURE_PAGECACHE:
+		err = ve_configure_pagecache(ve, val);
+		break;
+	case VE_CONFIGURE_COMPACT:
+		err = ve_configure_compact(ve, val);
+		break;
+	case VE_CONFIGURE_FUTEX:
+		err = ve_configure_futex(ve, val);
+		break;
  	}
 
 	real_put_ve(ve);
@@ -2714,6 +3340,25 @@ free_data:
 	    case VZCTL_VE_CONFIGURE:
 		err = ve_configure_ioctl((struct vzctl_ve_configure *)arg);
 		break;
+	    case VZCTL_GET_FAIRSCHED_STATS: {
+			struct vzctl_fairsched_stats s;
+			err = -EFAULT;
+			if (copy_from_user(&s, (void __user *)arg, sizeof(s)))
+				break;
+			err = -EINVAL;
+			if (s.version != VZ_FAIRSCHED_STAT_VERSION)
+				break;
+			err = fairsched_get_stats(s.stats, &s.nr);
+			if (err >= 0 && put_user(s.nr,
+				&((struct vzctl_fairsched_stats __user *)arg)->nr))
+				err = -EFAULT;
+		}
+		break;
+#ifdef CONFIG_VE_HWSTAT
+	    case VZCTL_GET_HW_STAT:
+		err = ve_get_hw_stat((struct vzctl_hwstatctl __user *)arg);
+		break;
+#endif
 	}
 	return err;
 }
@@ -2773,6 +3418,21 @@ int compat_vzcalls_ioctl(struct file *file, unsigned int cmd,
 		err = ve_set_meminfo(cs.veid, cs.val);
 		break;
 	}
+	case VZCTL_COMPAT_GET_FAIRSCHED_STATS: {
+		struct compat_vzctl_fairsched_stats cs;
+
+		err = -EFAULT;
+		if (copy_from_user(&cs, (void *)arg, sizeof(cs)))
+			break;
+		err = -EINVAL;
+		if (cs.version != VZ_FAIRSCHED_STAT_VERSION)
+			break;
+		err = fairsched_get_stats(compat_ptr(cs.stats), &cs.nr);
+		if (err >= 0 && put_user(cs.nr,
+			&((struct compat_vzctl_fairsched_stats __user *)arg)->nr))
+			err = -EFAULT;
+		break;
+	}
 	default:
 		err = vzcalls_ioctl(file, cmd, arg);
 		break;
@@ -2812,6 +3472,18 @@ static inline void fini_vecalls_ioctls(void)
 
 #ifdef CONFIG_SYSCTL
 static struct ctl_table_header *table_header;
+static int zero;
+
+static int ve_prealloc_sysctl_handler(ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	int ret;
+
+	ret = proc_dointvec_minmax(table, write, buffer, lenp, ppos);
+	if (!ret && write)
+		schedule_work(&ve_prealloc_work);
+	return ret;
+}
 
 static ctl_table kernel_table[] = {
 	{
@@ -2821,6 +3493,15 @@ static ctl_table kernel_table[] = {
 		.mode		= 0644,
 		.proc_handler	= &proc_dointvec,
 	},
+	{
+		.procname	= "ve_prealloc",
+		.data		= &ve_prealloc,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= &ve_prealloc_sysctl_handler,
+		.extra1		= &zero,
+		.extra2		= &ve_prealloc_max,
+	},
 	{ 0 }
 };
 
@@ -2902,6 +3583,7 @@ static void __exit vecalls_exit(void)
 	fini_vecalls_proc();
 	fini_vzmond();
 	fini_vecalls_sysctl();
+	fini_ve_prealloc();
 	fini_vecalls_cgroups();
 }
 
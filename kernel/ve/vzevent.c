@@ -4,6 +4,13 @@
 #include <net/sock.h>
 #include <linux/netlink.h>
 #include <linux/errno.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ve.h>
 #include <linux/ve_proto.h>
 #include <linux/vzevent.h>
 
@@ -14,6 +21,14 @@ static int reboot_event;
 module_param(reboot_event, int, 0644);
 MODULE_PARM_DESC(reboot_event, "Enable reboot events");
 
+static unsigned int ring_size = 1024;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Binary events kept for listeners to catch up");
+
+static unsigned int batch_delay = HZ / 50;
+module_param(batch_delay, uint, 0644);
+MODULE_PARM_DESC(batch_delay, "Jiffies to gather binary events for a message");
+
 /*
  * NOTE: the original idea was to send events via kobject_uevent(),
  * however, it turns out that it has negative consequences like
@@ -40,6 +55,137 @@ static char *action_to_string(int action)
 	}
 }
 
+/*
+ * Binary events go to a ring and are broadcast from a work, all those
+ * queued since the last run in one message. A listener which did not
+ * read in time just loses the message, the sender never waits for it,
+ * and tells that from the seq gap.
+ */
+#define VZEV_BATCH_MAX	((int)(PAGE_SIZE / sizeof(struct vzevent_rec)))
+
+static struct vzevent_rec *vzev_ring;
+static u32 vzev_head;		/* seq of the next event */
+static u32 vzev_sent;		/* seq of the first event not broadcast */
+static DEFINE_SPINLOCK(vzev_lock);
+
+static void vzevent_flush(struct work_struct *work);
+static DECLARE_DELAYED_WORK(vzev_work, vzevent_flush);
+
+static inline struct vzevent_rec *vzev_rec(u32 seq)
+{
+	return &vzev_ring[seq & (ring_size - 1)];
+}
+
+static void vzevent_queue(int event, envid_t veid)
+{
+	struct vzevent_rec *rec;
+
+	spin_lock(&vzev_lock);
+	rec = vzev_rec(vzev_head);
+	rec->seq = vzev_head++;
+	rec->event = event;
+	rec->reserved = 0;
+	rec->veid = veid;
+	/* not broadcast in time, those have been overwritten */
+	if (vzev_head - vzev_sent > ring_size)
+		vzev_sent = vzev_head - ring_size;
+	spin_unlock(&vzev_lock);
+
+	schedule_delayed_work(&vzev_work, batch_delay);
+}
+
+static void vzevent_flush(struct work_struct *work)
+{
+	struct sk_buff *skb;
+	int nr;
+
+	do {
+		if (!netlink_has_listeners(vzev_sock, VZ_EVGRP_BIN)) {
+			spin_lock(&vzev_lock);
+			vzev_sent = vzev_head;
+			spin_unlock(&vzev_lock);
+			return;
+		}
+
+		skb = alloc_skb(VZEV_BATCH_MAX * sizeof(struct vzevent_rec),
+				GFP_KERNEL);
+		if (!skb) {
+			schedule_delayed_work(&vzev_work, HZ);
+			return;
+		}
+
+		spin_lock(&vzev_lock);
+		nr = min_t(u32, vzev_head - vzev_sent, VZEV_BATCH_MAX);
+		for (; nr; nr--)
+			memcpy(skb_put(skb, sizeof(struct vzevent_rec)),
+			       vzev_rec(vzev_sent++),
+			       sizeof(struct vzevent_rec));
+		spin_unlock(&vzev_lock);
+
+		if (!skb->len) {
+			kfree_skb(skb);
+			return;
+		}
+		(void)netlink_broadcast(vzev_sock, skb, 0, VZ_EVGRP_BIN,
+					GFP_KERNEL);
+	} while (vzev_head != vzev_sent);
+}
+
+/* The events still in the ring, oldest first. Called under vzev_lock */
+static struct vzevent_rec *vzev_seq_rec(loff_t pos)
+{
+	u32 nr = min(vzev_head, ring_size);
+
+	if (pos >= nr)
+		return NULL;
+	return vzev_rec(vzev_head - nr + pos);
+}
+
+static void *vzev_seq_start(struct seq_file *m, loff_t *pos)
+{
+	spin_lock(&vzev_lock);
+	return vzev_seq_rec(*pos);
+}
+
+static void *vzev_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return vzev_seq_rec(*pos);
+}
+
+static void vzev_seq_stop(struct seq_file *m, void *v)
+{
+	spin_unlock(&vzev_lock);
+}
+
+static int vzev_seq_show(struct seq_file *m, void *v)
+{
+	struct vzevent_rec *rec = v;
+
+	seq_printf(m, "%u %s %u\n", rec->seq,
+		   action_to_string(rec->event) ? : "?", rec->veid);
+	return 0;
+}
+
+static const struct seq_operations vzev_seq_ops = {
+	.start	= vzev_seq_start,
+	.next	= vzev_seq_next,
+	.stop	= vzev_seq_stop,
+	.show	= vzev_seq_show,
+};
+
+static int vzev_seq_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &vzev_seq_ops);
+}
+
+static const struct file_operations proc_vzevents_operations = {
+	.open		= vzev_seq_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
 static int do_vzevent_send(int event, char *msg, int len)
 {
 	struct sk_buff *skb;
@@ -71,6 +217,10 @@ int vzevent_send(int event, const char *attrs_fmt, ...)
 	struct ve_struct *ve;
 	char *page;
 
+	/* no formatting for nobody */
+	if (!netlink_has_listeners(vzev_sock, VZ_EVGRP_ALL))
+		return 0;
+
 	err = -ENOMEM;
 	page = (char *)__get_free_page(GFP_KERNEL);
 	if (!page)
@@ -94,6 +244,7 @@ static int ve_start(void *data)
 	struct ve_struct *ve;
 
 	ve = (struct ve_struct *)data;
+	vzevent_queue(VE_EVENT_START, ve->veid);
 	vzevent_send(VE_EVENT_START, "%d", ve->veid);
 	return 0;
 }
@@ -108,6 +259,7 @@ static void ve_stop(void *data)
 		event = VE_EVENT_REBOOT;
 
 	ve = (struct ve_struct *)data;
+	vzevent_queue(event, ve->veid);
 	vzevent_send(event, "%d", ve->veid);
 }
 
@@ -120,9 +272,17 @@ static struct ve_hook ve_start_stop_hook = {
 
 static int __init init_vzevent(void)
 {
+	ring_size = roundup_pow_of_two(max(ring_size, 1U));
+	vzev_ring = vmalloc(ring_size * sizeof(struct vzevent_rec));
+	if (vzev_ring == NULL)
+		return -ENOMEM;
+
 	vzev_sock = netlink_kernel_create(&init_net, NETLINK_UEVENT, 0, NULL, NULL, THIS_MODULE);
-	if (vzev_sock == NULL)
+	if (vzev_sock == NULL) {
+		vfree(vzev_ring);
 		return -ENOMEM;
+	}
+	proc_create("vzevents", S_IRUSR, proc_vz_dir, &proc_vzevents_operations);
 	ve_hook_register(VE_SS_CHAIN, &ve_start_stop_hook);
 	return 0;
 }
@@ -130,7 +290,10 @@ static int __init init_vzevent(void)
 static void __exit exit_vzevent(void)
 {
 	ve_hook_unregister(&ve_start_stop_hook);
+	remove_proc_entry("vzevents", proc_vz_dir);
+	cancel_delayed_work_sync(&vzev_work);
 	netlink_kernel_release(vzev_sock);
+	vfree(vzev_ring);
 }
 
 MODULE_LICENSE("GPL");
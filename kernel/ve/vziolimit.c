@@ -9,6 +9,8 @@
 #include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/virtinfo.h>
+#include <linux/bio.h>
+#include <linux/genhd.h>
 #include <linux/vzctl.h>
 #include <linux/vziolimit.h>
 #include <asm/uaccess.h>
@@ -21,6 +23,9 @@ struct throttle {
        unsigned remain;		/* units/HZ */
        unsigned long time;	/* wall time in jiffies */
        long long state;		/* current state in units */
+       unsigned accrual;	/* percent of unused speed saved as credit */
+       long long credit_max;	/* maximum burst credit, units */
+       long long credit;	/* current burst credit, units */
 };
 
 /**
@@ -39,6 +44,37 @@ static void throttle_setup(struct throttle *th, unsigned speed,
 	th->speed = speed;
 }
 
+/**
+ * set burst credit, externally serialized
+ * @credit	maximum credit accumulated while idle (units)
+ * @accrual	percent of unused speed turned into credit
+ */
+static void throttle_setup_credit(struct throttle *th, unsigned credit,
+		unsigned accrual)
+{
+	th->accrual = min(accrual, 100U);
+	th->credit_max = credit;
+	if (th->credit > th->credit_max)
+		th->credit = th->credit_max;
+}
+
+/*
+ * Part of feed which doesn't fit into burst is not lost but saved as
+ * credit, so idle container can exceed burst later. Credit grows only
+ * from unused speed, so long-term rate is still bounded by speed.
+ */
+static void throttle_accrue(struct throttle *th, long long excess)
+{
+	if (!th->credit_max || excess <= 0)
+		return;
+
+	excess *= th->accrual;
+	do_div(excess, 100);
+	th->credit += excess;
+	if (th->credit > th->credit_max)
+		th->credit = th->credit_max;
+}
+
 /* externally serialized */
 static void throttle_charge(struct throttle *th, long long charge)
 {
@@ -52,11 +88,21 @@ static void throttle_charge(struct throttle *th, long long charge)
 		/* feed throttler as much as we can */
 		if (step <= ceiling)
 			th->state = step;
-		else if (th->state < ceiling)
+		else if (th->state < ceiling) {
+			throttle_accrue(th, step - ceiling);
 			th->state = ceiling;
+		} else
+			throttle_accrue(th, step - th->state);
 		th->time = now;
 	}
 
+	/* spend burst credit before delaying */
+	if (charge > th->state && th->credit) {
+		step = min(charge - th->state, th->credit);
+		th->credit -= step;
+		th->state += step;
+	}
+
 	if (charge > th->state) {
 		charge -= th->state;
 		step = charge * HZ;
@@ -88,14 +134,41 @@ static unsigned long throttle_timeout(struct throttle *th, unsigned long now)
 	return min(time - now, (unsigned long)th->latency);
 }
 
+#define IOLIMIT_MAX_DEVS	8
+
+/* per-disk limits, apply on top of beancounter-wide ones */
+struct iolimit_dev {
+	dev_t dev;		/* whole disk, 0 if slot is free */
+	struct throttle read;
+	struct throttle write;
+};
+
 struct iolimit {
 	struct throttle throttle;
 	struct throttle iops;
 	wait_queue_head_t wq;
+	atomic_long_t throttled_time;	/* jiffies spent in iolimit_wait */
+	atomic_long_t throttled;	/* number of waits */
+	int nr_devs;
+	struct iolimit_dev devs[IOLIMIT_MAX_DEVS];
 };
 
-static void iolimit_wait(struct iolimit *iolimit, unsigned long timeout)
+/* under ub_lock */
+static struct iolimit_dev *iolimit_find_dev(struct iolimit *iolimit,
+		dev_t dev)
+{
+	int i;
+
+	for (i = 0; i < IOLIMIT_MAX_DEVS; i++)
+		if (iolimit->devs[i].dev == dev)
+			return iolimit->devs + i;
+	return NULL;
+}
+
+static void iolimit_wait(struct iolimit *iolimit, struct throttle *th,
+		unsigned long timeout)
 {
+	unsigned long start = jiffies;
 	DEFINE_WAIT(wait);
 
 	do {
@@ -105,10 +178,12 @@ static void iolimit_wait(struct iolimit *iolimit, unsigned long timeout)
 		if (fatal_signal_pending(current))
 			break;
 		if (unlikely(timeout))
-			timeout = min(throttle_timeout(&iolimit->throttle,
-						jiffies), timeout);
+			timeout = min(throttle_timeout(th, jiffies), timeout);
 	} while (timeout);
 	finish_wait(&iolimit->wq, &wait);
+
+	atomic_long_inc(&iolimit->throttled);
+	atomic_long_add(jiffies - start, &iolimit->throttled_time);
 }
 
 static unsigned long iolimit_timeout(struct iolimit *iolimit)
@@ -119,6 +194,40 @@ static unsigned long iolimit_timeout(struct iolimit *iolimit)
 			throttle_timeout(&iolimit->iops, now));
 }
 
+/*
+ * Charge bio to read or write throttler of its disk and wait right away:
+ * timeout of per-disk throttler must not delay IO to other disks.
+ */
+static void iolimit_account_bio(struct iolimit *iolimit,
+		struct user_beancounter *ub, struct bio *bio)
+{
+	struct iolimit_dev *d;
+	struct throttle *th = NULL;
+	unsigned long flags, timeout = 0;
+
+	if (!iolimit->nr_devs || !bio->bi_bdev)
+		return;
+
+	spin_lock_irqsave(&ub->ub_lock, flags);
+	d = iolimit_find_dev(iolimit, disk_devt(bio->bi_bdev->bd_disk));
+	if (d) {
+		th = (bio_data_dir(bio) == WRITE) ? &d->write : &d->read;
+		if (th->speed) {
+			throttle_charge(th, bio->bi_size);
+			th->state -= bio->bi_size;
+			timeout = throttle_timeout(th, jiffies);
+		}
+	}
+	spin_unlock_irqrestore(&ub->ub_lock, flags);
+
+	/* writeback is charged, but never delayed */
+	if (!timeout || (current->flags & PF_FLUSHER) || current->bio_list)
+		return;
+
+	if (!fatal_signal_pending(current))
+		iolimit_wait(iolimit, th, timeout);
+}
+
 static void iolimit_balance_dirty(struct iolimit *iolimit,
 				  struct user_beancounter *ub,
 				  unsigned long write_chunk)
@@ -158,7 +267,8 @@ static int iolimit_virtinfo(struct vnotifier_block *nb,
 	if (!iolimit)
 		return old_ret;
 
-	if (!iolimit->throttle.speed && !iolimit->iops.speed)
+	if (!iolimit->throttle.speed && !iolimit->iops.speed &&
+	    !iolimit->nr_devs)
 		return NOTIFY_OK;
 
 	switch (cmd) {
@@ -197,7 +307,8 @@ static int iolimit_virtinfo(struct vnotifier_block *nb,
 				break;
 			timeout = iolimit_timeout(iolimit);
 			if (timeout && !fatal_signal_pending(current))
-				iolimit_wait(iolimit, timeout);
+				iolimit_wait(iolimit, &iolimit->throttle,
+						timeout);
 			break;
 		case VIRTINFO_IO_READAHEAD:
 		case VIRTINFO_IO_CONGESTION:
@@ -208,6 +319,9 @@ static int iolimit_virtinfo(struct vnotifier_block *nb,
 		case VIRTINFO_IO_BALANCE_DIRTY:
 			iolimit_balance_dirty(iolimit, ub, (unsigned long)arg);
 			break;
+		case VIRTINFO_IO_BIO:
+			iolimit_account_bio(iolimit, ub, arg);
+			break;
 	}
 
 	return NOTIFY_OK;
@@ -228,6 +342,85 @@ static void throttle_state(struct user_beancounter *ub,
 	spin_unlock_irq(&ub->ub_lock);
 }
 
+static void throttle_credit(struct user_beancounter *ub,
+		struct iolimit *iolimit, struct iolimit_credit *credit)
+{
+	spin_lock_irq(&ub->ub_lock);
+	credit->speed_credit = iolimit->throttle.credit_max;
+	credit->iops_credit = iolimit->iops.credit_max;
+	credit->accrual = iolimit->throttle.accrual;
+	spin_unlock_irq(&ub->ub_lock);
+}
+
+static void iolimit_stat(struct user_beancounter *ub,
+		struct iolimit *iolimit, struct iolimit_stat *stat)
+{
+	spin_lock_irq(&ub->ub_lock);
+	stat->tokens = iolimit->throttle.state;
+	stat->credit = iolimit->throttle.credit;
+	stat->iops_tokens = iolimit->iops.state;
+	stat->iops_credit = iolimit->iops.credit;
+	spin_unlock_irq(&ub->ub_lock);
+	stat->throttled = atomic_long_read(&iolimit->throttled);
+	stat->throttled_time =
+		jiffies_to_msecs(atomic_long_read(&iolimit->throttled_time));
+}
+
+/* under ub_lock */
+static int iolimit_setup_dev(struct iolimit *iolimit,
+		struct iolimit_dev_state *state)
+{
+	dev_t dev = new_decode_dev(state->dev);
+	struct iolimit_dev *d;
+	struct throttle *th;
+
+	if (!dev || state->rw > 1)
+		return -EINVAL;
+
+	d = iolimit_find_dev(iolimit, dev);
+	if (!d) {
+		if (!state->speed)
+			return 0;
+		d = iolimit_find_dev(iolimit, 0);
+		if (!d)
+			return -ENOSPC;
+		memset(d, 0, sizeof(*d));
+		d->dev = dev;
+		iolimit->nr_devs++;
+	}
+
+	th = state->rw ? &d->write : &d->read;
+	throttle_setup(th, state->speed, state->burst, state->latency);
+
+	/* slot without limits is released */
+	if (!d->read.speed && !d->write.speed) {
+		d->dev = 0;
+		iolimit->nr_devs--;
+	}
+	return 0;
+}
+
+/* under ub_lock */
+static int iolimit_dev_state(struct iolimit *iolimit,
+		struct iolimit_dev_state *state)
+{
+	struct iolimit_dev *d;
+	struct throttle *th;
+
+	if (state->rw > 1)
+		return -EINVAL;
+
+	d = iolimit_find_dev(iolimit, new_decode_dev(state->dev));
+	if (!state->dev || !d)
+		return -ENXIO;
+
+	th = state->rw ? &d->write : &d->read;
+	state->speed = th->speed;
+	state->burst = th->burst;
+	state->latency = jiffies_to_msecs(th->latency);
+	return 0;
+}
+
 static struct iolimit *iolimit_get(struct user_beancounter *ub)
 {
 	struct iolimit *iolimit = ub->private_data2;
@@ -256,16 +449,47 @@ static int iolimit_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct user_beancounter *ub;
 	struct iolimit *iolimit;
 	struct iolimit_state state;
+	struct iolimit_credit credit;
+	struct iolimit_stat stat;
+	struct iolimit_dev_state dev_state;
+	unsigned int id;
 	int err;
 
-	if (cmd != VZCTL_SET_IOLIMIT && cmd != VZCTL_GET_IOLIMIT &&
-	    cmd != VZCTL_SET_IOPSLIMIT && cmd != VZCTL_GET_IOPSLIMIT)
-		return -ENOTTY;
-
-	if (copy_from_user(&state, (void __user *)arg, sizeof(state)))
-		return -EFAULT;
+	switch (cmd) {
+		case VZCTL_SET_IOLIMIT:
+		case VZCTL_GET_IOLIMIT:
+		case VZCTL_SET_IOPSLIMIT:
+		case VZCTL_GET_IOPSLIMIT:
+			if (copy_from_user(&state, (void __user *)arg,
+						sizeof(state)))
+				return -EFAULT;
+			id = state.id;
+			break;
+		case VZCTL_SET_IOLIMIT_CREDIT:
+		case VZCTL_GET_IOLIMIT_CREDIT:
+			if (copy_from_user(&credit, (void __user *)arg,
+						sizeof(credit)))
+				return -EFAULT;
+			id = credit.id;
+			break;
+		case VZCTL_GET_IOLIMIT_STAT:
+			if (copy_from_user(&stat, (void __user *)arg,
+						sizeof(stat)))
+				return -EFAULT;
+			id = stat.id;
+			break;
+		case VZCTL_SET_IOLIMIT_DEV:
+		case VZCTL_GET_IOLIMIT_DEV:
+			if (copy_from_user(&dev_state, (void __user *)arg,
+						sizeof(dev_state)))
+				return -EFAULT;
+			id = dev_state.id;
+			break;
+		default:
+			return -ENOTTY;
+	}
 
-	ub = get_beancounter_byuid(state.id, 0);
+	ub = get_beancounter_byuid(id, 0);
 	if (!ub)
 		return -ENOENT;
 
@@ -316,6 +540,65 @@ static int iolimit_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				break;
 			err = 0;
 			break;
+		case VZCTL_SET_IOLIMIT_CREDIT:
+			iolimit = iolimit_get(ub);
+			err = -ENOMEM;
+			if (!iolimit)
+				break;
+			spin_lock_irq(&ub->ub_lock);
+			throttle_setup_credit(&iolimit->throttle,
+					credit.speed_credit, credit.accrual);
+			throttle_setup_credit(&iolimit->iops,
+					credit.iops_credit, credit.accrual);
+			spin_unlock_irq(&ub->ub_lock);
+			wake_up_all(&iolimit->wq);
+			err = 0;
+			break;
+		case VZCTL_GET_IOLIMIT_CREDIT:
+			err = -ENXIO;
+			if (!iolimit)
+				break;
+			throttle_credit(ub, iolimit, &credit);
+			err = -EFAULT;
+			if (copy_to_user((void __user *)arg, &credit, sizeof(credit)))
+				break;
+			err = 0;
+			break;
+		case VZCTL_GET_IOLIMIT_STAT:
+			err = -ENXIO;
+			if (!iolimit)
+				break;
+			iolimit_stat(ub, iolimit, &stat);
+			err = -EFAULT;
+			if (copy_to_user((void __user *)arg, &stat, sizeof(stat)))
+				break;
+			err = 0;
+			break;
+		case VZCTL_SET_IOLIMIT_DEV:
+			iolimit = iolimit_get(ub);
+			err = -ENOMEM;
+			if (!iolimit)
+				break;
+			spin_lock_irq(&ub->ub_lock);
+			err = iolimit_setup_dev(iolimit, &dev_state);
+			spin_unlock_irq(&ub->ub_lock);
+			wake_up_all(&iolimit->wq);
+			break;
+		case VZCTL_GET_IOLIMIT_DEV:
+			err = -ENXIO;
+			if (!iolimit)
+				break;
+			spin_lock_irq(&ub->ub_lock);
+			err = iolimit_dev_state(iolimit, &dev_state);
+			spin_unlock_irq(&ub->ub_lock);
+			if (err)
+				break;
+			err = -EFAULT;
+			if (copy_to_user((void __user *)arg, &dev_state,
+						sizeof(dev_state)))
+				break;
+			err = 0;
+			break;
 		default:
 			err = -ENOTTY;
 	}
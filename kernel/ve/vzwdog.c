@@ -26,11 +26,29 @@
 #include <asm/uaccess.h>
 #include <linux/kthread.h>
 #include <linux/freezer.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/swap.h>
 
 /* Staff regading kernel thread polling VE validity */
 static int sleep_timeout = 60;
 static struct task_struct *wdog_thread_tsk;
 
+/*
+ * A snapshot is taken every sleep_timeout and kept in a ring of the last
+ * snap_nr ones, for /proc/vz/wdog. The full report only goes to the
+ * console when a snapshot looks bad, or always with print_always.
+ */
+static unsigned int snap_nr = 60;
+static unsigned int lat_thresh_ms = 1000;
+static unsigned int unint_thresh;
+static int print_always;
+
+static struct vzwdog_snap *snap_ring;
+static u64 snap_seq;
+static DEFINE_MUTEX(snap_lock);
+
 static struct file *intr_file;
 static char page[PAGE_SIZE];
 
@@ -243,27 +261,36 @@ static int show_partitions_io(struct gendisk *gp)
 	return 0;
 }
 
-static int show_one_disk_io(struct device *dev, void *x)
+static struct gendisk *wdog_disk(struct device *dev)
 {
 	char *name;
 	char buf[BDEVNAME_SIZE];
 	struct gendisk *gd;
 
 	if (dev->type != &disk_type)
-		return 0;
+		return NULL;
 
 	gd = dev_to_disk(dev);
 
 	name = disk_name(gd, 0, buf);
 	if ((strlen(name) > 4) && (strncmp(name, "loop", 4) == 0) &&
 			isdigit(name[4]))
-		return 0;
+		return NULL;
 
 	if ((strlen(name) > 3) && (strncmp(name, "ram", 3) == 0) &&
 			isdigit(name[3]))
-		return 0;
+		return NULL;
 
-	show_partitions_io(gd);
+	return gd;
+}
+
+static int show_one_disk_io(struct device *dev, void *x)
+{
+	struct gendisk *gd;
+
+	gd = wdog_disk(dev);
+	if (gd)
+		show_partitions_io(gd);
 
 	return 0;
 }
@@ -305,6 +332,124 @@ static void wdog_print(void)
 	show_nrprocs();
 }
 
+static int snap_one_disk_io(struct device *dev, void *x)
+{
+	struct vzwdog_snap *s = x;
+	struct hd_struct *hd;
+	struct gendisk *gd;
+	int cpu, rw;
+
+	gd = wdog_disk(dev);
+	if (!gd)
+		return 0;
+
+	hd = &gd->part0;
+	cpu = part_stat_lock();
+	part_round_stats(cpu, hd);
+	part_stat_unlock();
+
+	s->disk_nr++;
+	s->disk_in_flight += part_in_flight(hd);
+	for (rw = 0; rw < 2; rw++) {
+		s->disk_ios[rw] += part_stat_read(hd, ios[rw]);
+		s->disk_sectors[rw] += part_stat_read(hd, sectors[rw]);
+		s->disk_ticks_ms[rw] +=
+			jiffies_to_msecs(part_stat_read(hd, ticks[rw]));
+	}
+	s->disk_io_ms += jiffies_to_msecs(part_stat_read(hd, io_ticks));
+	return 0;
+}
+
+static void snap_fill(struct vzwdog_snap *s)
+{
+	struct timespec ts;
+	struct sysinfo si;
+	int i, j, cpu;
+
+	memset(s, 0, sizeof(*s));
+	getnstimeofday(&ts);
+	s->time_ns = timespec_to_ns(&ts);
+	s->jiffies = get_jiffies_64();
+
+	s->nr_ve = nr_ve;
+	s->nr_running = nr_running();
+	s->nr_sleeping = nr_sleeping();
+	s->nr_unint = nr_uninterruptible();
+	s->nr_zombie = nr_zombie;
+	s->nr_dead = atomic_read(&nr_dead);
+	s->nr_stopped = nr_stopped();
+	s->nr_threads = nr_threads;
+
+	spin_lock_irq(&kstat_glb_lock);
+	s->sched_lat_max = max_sched_lat;
+	for (j = 0; j < 3; j++)
+		s->sched_lat_avg[j] = kstat_glob.sched_lat.avg[j];
+	for (i = 0; i < KSTAT_ALLOCSTAT_NR; i++) {
+		s->alloc_lat_max[i] = max_alloc_lat[i];
+		for (j = 0; j < 3; j++)
+			s->alloc_lat_avg[i][j] = kstat_glob.alloc_lat[i].avg[j];
+	}
+	spin_unlock_irq(&kstat_glb_lock);
+
+	for_each_possible_cpu(cpu)
+		s->irqs += kstat_cpu_irqs_sum(cpu);
+
+	si_meminfo(&si);
+	s->mem_total = si.totalram;
+	s->mem_free = si.freeram;
+	s->mem_cached = global_page_state(NR_FILE_PAGES);
+	s->mem_anon = global_page_state(NR_ANON_PAGES);
+	s->mem_slab = global_page_state(NR_SLAB_RECLAIMABLE) +
+		global_page_state(NR_SLAB_UNRECLAIMABLE);
+	s->swap_total = total_swap_pages;
+	s->swap_free = atomic_long_read(&nr_swap_pages);
+
+	class_for_each_device(&block_class, NULL, s, snap_one_disk_io);
+}
+
+static unsigned int snap_check(struct vzwdog_snap *s)
+{
+	u64 thresh = (u64)lat_thresh_ms * NSEC_PER_MSEC;
+	unsigned int flags = 0;
+	int i;
+
+	if (lat_thresh_ms) {
+		if (s->sched_lat_max > thresh)
+			flags |= VZWDOG_SNAP_SCHED_LAT;
+		for (i = 0; i < KSTAT_ALLOCSTAT_NR; i++)
+			if (s->alloc_lat_max[i] > thresh)
+				flags |= VZWDOG_SNAP_ALLOC_LAT;
+	}
+	if (unint_thresh && s->nr_unint > unint_thresh)
+		flags |= VZWDOG_SNAP_UNINT;
+
+	return flags;
+}
+
+static void wdog_snap(void)
+{
+	struct vzwdog_snap *s;
+
+	mutex_lock(&snap_lock);
+	s = &snap_ring[snap_seq % snap_nr];
+	snap_fill(s);
+	s->seq = snap_seq++;
+	s->flags = snap_check(s);
+	mutex_unlock(&snap_lock);
+
+	if (s->flags || print_always) {
+		if (s->flags)
+			printk("*** VZWDOG anomaly:%s%s%s ***\n",
+				s->flags & VZWDOG_SNAP_SCHED_LAT ?
+					" sched latency" : "",
+				s->flags & VZWDOG_SNAP_ALLOC_LAT ?
+					" alloc latency" : "",
+				s->flags & VZWDOG_SNAP_UNINT ?
+					" D state tasks" : "");
+		wdog_print();
+	}
+}
+
 static int wdog_loop(void* data)
 {
 	unsigned long next_print;
@@ -314,7 +459,7 @@ static int wdog_loop(void* data)
 	while (1) {
 		update_max_latencies();
 		if (time_is_before_eq_jiffies(next_print)) {
-			wdog_print();
+			wdog_snap();
 			reset_max_latencies();
 			next_print = jiffies + sleep_timeout * HZ;
 		}
@@ -329,18 +474,64 @@ static int wdog_loop(void* data)
 	return 0;
 }
 
+static int wdog_snap_show(struct seq_file *m, void *v)
+{
+	struct vzwdog_hdr hdr = {
+		.version	= VZWDOG_SNAP_VERSION,
+		.rec_size	= sizeof(struct vzwdog_snap),
+		.interval	= sleep_timeout,
+	};
+	u64 seq;
+
+	mutex_lock(&snap_lock);
+	seq = snap_seq > snap_nr ? snap_seq - snap_nr : 0;
+	hdr.nr = snap_seq - seq;
+	seq_write(m, &hdr, sizeof(hdr));
+	for (; seq < snap_seq; seq++)
+		seq_write(m, &snap_ring[seq % snap_nr],
+				sizeof(struct vzwdog_snap));
+	mutex_unlock(&snap_lock);
+	return 0;
+}
+
+static int wdog_snap_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wdog_snap_show, NULL);
+}
+
+static struct file_operations proc_wdog_operations = {
+	.open		= wdog_snap_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int __init wdog_init(void)
 {
 	struct file *file;
 
+	if (!snap_nr)
+		snap_nr = 1;
+	snap_ring = vmalloc(snap_nr * sizeof(struct vzwdog_snap));
+	if (!snap_ring)
+		return -ENOMEM;
+
 	file = filp_open("/proc/interrupts", 0, 0);
-	if (IS_ERR(file))
+	if (IS_ERR(file)) {
+		vfree(snap_ring);
 		return PTR_ERR(file);
+	}
 	intr_file = file;
 
+	if (!proc_create("wdog", S_IFREG | S_IRUSR, glob_proc_vz_dir,
+				&proc_wdog_operations))
+		printk(KERN_WARNING "VZWDOG: can't make wdog proc entry\n");
+
 	wdog_thread_tsk = kthread_run(wdog_loop, NULL, "vzwdog");
 	if (IS_ERR(wdog_thread_tsk)) {
+		remove_proc_entry("wdog", glob_proc_vz_dir);
 		filp_close(intr_file, NULL);
+		vfree(snap_ring);
 		return -EBUSY;
 	}
 	return 0;
@@ -349,10 +540,20 @@ static int __init wdog_init(void)
 static void __exit wdog_exit(void)
 {
 	kthread_stop(wdog_thread_tsk);
+	remove_proc_entry("wdog", glob_proc_vz_dir);
 	filp_close(intr_file, NULL);
+	vfree(snap_ring);
 }
 
 module_param(sleep_timeout, int, 0660);
+module_param(snap_nr, uint, 0440);
+MODULE_PARM_DESC(snap_nr, "Number of snapshots kept for /proc/vz/wdog");
+module_param(lat_thresh_ms, uint, 0660);
+MODULE_PARM_DESC(lat_thresh_ms, "Print when a latency is over it, 0 is off");
+module_param(unint_thresh, uint, 0660);
+MODULE_PARM_DESC(unint_thresh, "Print when more tasks are in D state, 0 is off");
+module_param(print_always, int, 0660);
+MODULE_PARM_DESC(print_always, "Print every interval, as older versions did");
 MODULE_AUTHOR("SWsoft <info@sw-soft.com>");
 MODULE_DESCRIPTION("Virtuozzo WDOG");
 MODULE_LICENSE("GPL v2");
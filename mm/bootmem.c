@@ -168,6 +168,135 @@ void __init free_bootmem_late(unsigned long addr, unsigned long size)
 	}
 }
 
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+static inline unsigned long bootmem_first_deferred(bootmem_data_t *bdata)
+{
+	pg_data_t *pgdat = NODE_DATA(bdata - bootmem_node_data);
+
+	return max(pgdat->first_deferred_pfn, bdata->node_min_pfn);
+}
+
+/*
+ * Struct pages of a node past first_deferred_pfn are set up by a kthread
+ * once the cpus are up, but for the reserved ones: their owners, pram
+ * in the first place, use them as soon as the memory is handed over.
+ *
+ * Returns the number of the pages left to bootmem_free_deferred(), the
+ * map included, they are accounted as released already.
+ */
+static unsigned long __init bootmem_init_deferred(pg_data_t *pgdat)
+{
+	bootmem_data_t *bdata = pgdat->bdata;
+	unsigned long node_end = pgdat->node_start_pfn +
+				 pgdat->node_spanned_pages;
+	unsigned long start, end, size, idx, pfn, count = 0;
+
+	if (!bdata->node_bootmem_map)
+		return 0;
+
+	start = bootmem_first_deferred(bdata);
+	end = bdata->node_low_pfn;
+	if (start < end) {
+		size = end - bdata->node_min_pfn;
+		count = end - start + bootmem_bootmap_pages(size);
+		idx = find_next_bit(bdata->node_bootmem_map, size,
+				    start - bdata->node_min_pfn);
+		while (idx < size) {
+			deferred_init_pfn(pgdat, bdata->node_min_pfn + idx);
+			count--;
+			idx = find_next_bit(bdata->node_bootmem_map, size,
+					    idx + 1);
+		}
+	}
+
+	/* nothing past the map is ever freed */
+	for (pfn = max(start, end); pfn < node_end; pfn++)
+		deferred_init_pfn(pgdat, pfn);
+
+	return count;
+}
+
+static unsigned long __init bootmem_free_range(bootmem_data_t *bdata,
+		unsigned long start, unsigned long end)
+{
+	unsigned long *map = bdata->node_bootmem_map;
+	unsigned long idx, count = 0;
+
+	while (start < end) {
+		idx = start - bdata->node_min_pfn;
+		if (!(idx & (BITS_PER_LONG - 1)) &&
+		    !(start & (BITS_PER_LONG - 1)) &&
+		    start + BITS_PER_LONG <= end &&
+		    !map[idx / BITS_PER_LONG]) {
+			__free_pages_bootmem(pfn_to_page(start),
+					     ilog2(BITS_PER_LONG));
+			count += BITS_PER_LONG;
+			start += BITS_PER_LONG;
+			continue;
+		}
+		if (!test_bit(idx, map)) {
+			__free_pages_bootmem(pfn_to_page(start), 0);
+			count++;
+		}
+		start++;
+	}
+	return count;
+}
+
+/**
+ * bootmem_free_deferred - initialise and release the deferred pages
+ * @pgdat: node to be released
+ *
+ * Runs in parallel for all the nodes, after free_all_bootmem_node() has
+ * released the rest of the node. Frees the bootmem map of the node too.
+ *
+ * Returns the number of pages released.
+ */
+unsigned long __init bootmem_free_deferred(pg_data_t *pgdat)
+{
+	bootmem_data_t *bdata = pgdat->bdata;
+	unsigned long *map = bdata->node_bootmem_map;
+	unsigned long start, end, chunk, size, idx, pages, count = 0;
+	struct page *page;
+
+	start = bootmem_first_deferred(bdata);
+	end = bdata->node_low_pfn;
+	if (start >= end)
+		return 0;
+	size = end - bdata->node_min_pfn;
+
+	/* a MAX_ORDER block at a time, so that its buddies are all set up */
+	for (; start < end; start = chunk) {
+		chunk = min(ALIGN(start + 1, MAX_ORDER_NR_PAGES), end);
+		idx = find_next_zero_bit(map, size, start - bdata->node_min_pfn);
+		while (idx < chunk - bdata->node_min_pfn) {
+			deferred_init_pfn(pgdat, bdata->node_min_pfn + idx);
+			idx = find_next_zero_bit(map, size, idx + 1);
+		}
+		count += bootmem_free_range(bdata, start, chunk);
+		cond_resched();
+	}
+
+	page = virt_to_page(map);
+	pages = bootmem_bootmap_pages(size);
+	count += pages;
+	while (pages--)
+		__free_pages_bootmem(page++, 0);
+
+	return count;
+}
+#else
+static inline unsigned long bootmem_first_deferred(bootmem_data_t *bdata)
+{
+	return ULONG_MAX;
+}
+
+static inline unsigned long bootmem_init_deferred(pg_data_t *pgdat)
+{
+	return 0;
+}
+#endif
+
 static unsigned long __init free_all_bootmem_core(bootmem_data_t *bdata)
 {
 	int aligned;
@@ -178,7 +307,8 @@ static unsigned long __init free_all_bootmem_core(bootmem_data_t *bdata)
 		return 0;
 
 	start = bdata->node_min_pfn;
-	end = bdata->node_low_pfn;
+	/* the deferred part is released by bootmem_free_deferred() */
+	end = min(bdata->node_low_pfn, bootmem_first_deferred(bdata));
 
 	/*
 	 * If the start is aligned to the machines wordsize, we might
@@ -204,7 +334,7 @@ static unsigned long __init free_all_bootmem_core(bootmem_data_t *bdata)
 		} else {
 			unsigned long off = 0;
 
-			while (vec && off < BITS_PER_LONG) {
+			while (vec && off < BITS_PER_LONG && start + off < end) {
 				if (vec & 1) {
 					page = pfn_to_page(start + off);
 					__free_pages_bootmem(page, 0);
@@ -217,12 +347,15 @@ static unsigned long __init free_all_bootmem_core(bootmem_data_t *bdata)
 		start += BITS_PER_LONG;
 	}
 
-	page = virt_to_page(bdata->node_bootmem_map);
-	pages = bdata->node_low_pfn - bdata->node_min_pfn;
-	pages = bootmem_bootmap_pages(pages);
-	count += pages;
-	while (pages--)
-		__free_pages_bootmem(page++, 0);
+	/* the map is still needed for the deferred part */
+	if (end == bdata->node_low_pfn) {
+		page = virt_to_page(bdata->node_bootmem_map);
+		pages = bdata->node_low_pfn - bdata->node_min_pfn;
+		pages = bootmem_bootmap_pages(pages);
+		count += pages;
+		while (pages--)
+			__free_pages_bootmem(page++, 0);
+	}
 
 	bdebug("nid=%td released=%lx\n", bdata - bootmem_node_data, count);
 
@@ -237,8 +370,12 @@ static unsigned long __init free_all_bootmem_core(bootmem_data_t *bdata)
  */
 unsigned long __init free_all_bootmem_node(pg_data_t *pgdat)
 {
+	unsigned long deferred;
+
+	/* before anything sets the reserved pages up for their owners */
+	deferred = bootmem_init_deferred(pgdat);
 	register_page_bootmem_info_node(pgdat);
-	return free_all_bootmem_core(pgdat->bdata);
+	return free_all_bootmem_core(pgdat->bdata) + deferred;
 }
 
 /**
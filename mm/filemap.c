@@ -127,12 +127,12 @@ void __remove_from_page_cache(struct page *page)
 	if (mapping_cap_account_dirty(mapping) &&
 			radix_tree_prev_tag_get(&mapping->page_tree,
 				PAGECACHE_TAG_DIRTY))
-		ub_io_account_cancel(mapping);
+		ub_io_account_cancel(mapping, page);
 
 	if (mapping_cap_account_writeback(mapping) &&
 			radix_tree_prev_tag_get(&mapping->page_tree,
 				PAGECACHE_TAG_WRITEBACK))
-		ub_io_writeback_dec(mapping);
+		ub_io_writeback_dec(mapping, page);
 
 	page->mapping = NULL;
 	/* Leave page->index set: truncation lookup relies upon it */
@@ -1103,6 +1103,18 @@ static void shrink_readahead_size_eio(struct file *filp,
 	ra->ra_pages /= 4;
 }
 
+/*
+ * A reader which keeps the readahead window at its maximum streams the
+ * file. In a container with a page cache limit the pages it reads are
+ * not marked accessed and stay on the inactive list, so they go before
+ * the hot cache and anon pages of the container.
+ */
+static inline int ra_streaming(struct file_ra_state *ra)
+{
+	return ra->ra_pages && ra->size >= ra->ra_pages &&
+		ub_cache_limited(get_exec_ub());
+}
+
 /**
  * do_generic_file_read - generic file read routine
  * @filp:	the file to read
@@ -1127,6 +1139,7 @@ static void do_generic_file_read(struct file *filp, loff_t *ppos,
 	pgoff_t prev_index;
 	unsigned long offset;      /* offset into pagecache page */
 	unsigned int prev_offset;
+	int streaming = ra_streaming(ra);
 	int error;
 
 	index = *ppos >> PAGE_CACHE_SHIFT;
@@ -1217,7 +1230,7 @@ page_ok:
 		 * When a sequential read accesses a page several times,
 		 * only mark it as accessed the first time.
 		 */
-		if (prev_index != index || offset != prev_offset)
+		if ((prev_index != index || offset != prev_offset) && !streaming)
 			mark_page_accessed(page);
 		prev_index = index;
 
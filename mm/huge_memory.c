@@ -18,6 +18,7 @@
 #include <linux/khugepaged.h>
 #include <linux/freezer.h>
 #include <linux/mman.h>
+#include <linux/vzcalluser.h>
 #include <asm/tlb.h>
 #include <asm/pgalloc.h>
 #include "internal.h"
@@ -39,6 +40,8 @@ unsigned long transparent_hugepage_flags __read_mostly =
 static unsigned int khugepaged_pages_to_scan __read_mostly = HPAGE_PMD_NR*8;
 static unsigned int khugepaged_pages_collapsed;
 static unsigned int khugepaged_full_scans;
+/* collapses per top beancounter in a full scan, 0 - no limit */
+static unsigned int khugepaged_ub_pages_to_collapse __read_mostly;
 static unsigned int khugepaged_scan_sleep_millisecs __read_mostly = 10000;
 /* during fragmentation poll the hugepage allocator once every minute */
 static unsigned int khugepaged_alloc_sleep_millisecs __read_mostly = 60000;
@@ -414,6 +417,31 @@ static ssize_t full_scans_show(struct kobject *kobj,
 static struct kobj_attribute full_scans_attr =
 	__ATTR_RO(full_scans);
 
+static ssize_t ub_pages_to_collapse_show(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 char *buf)
+{
+	return sprintf(buf, "%u\n", khugepaged_ub_pages_to_collapse);
+}
+static ssize_t ub_pages_to_collapse_store(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  const char *buf, size_t count)
+{
+	int err;
+	unsigned long pages;
+
+	err = strict_strtoul(buf, 10, &pages);
+	if (err || pages > UINT_MAX)
+		return -EINVAL;
+
+	khugepaged_ub_pages_to_collapse = pages;
+
+	return count;
+}
+static struct kobj_attribute ub_pages_to_collapse_attr =
+	__ATTR(ub_pages_to_collapse, 0644, ub_pages_to_collapse_show,
+	       ub_pages_to_collapse_store);
+
 static ssize_t khugepaged_defrag_show(struct kobject *kobj,
 				      struct kobj_attribute *attr, char *buf)
 {
@@ -470,6 +498,7 @@ static struct attribute *khugepaged_attr[] = {
 	&pages_to_scan_attr.attr,
 	&pages_collapsed_attr.attr,
 	&full_scans_attr.attr,
+	&ub_pages_to_collapse_attr.attr,
 	&scan_sleep_millisecs_attr.attr,
 	&alloc_sleep_millisecs_attr.attr,
 	NULL,
@@ -581,6 +610,80 @@ out:
 }
 __setup("transparent_hugepage=", setup_transparent_hugepage);
 
+#ifdef CONFIG_BEANCOUNTERS
+static unsigned long thp_mode_flags(unsigned long flags, unsigned int mode,
+		int enabled, int req_madv)
+{
+	switch (mode) {
+	case VE_THP_ALWAYS:
+		flags |= 1UL << enabled;
+		flags &= ~(1UL << req_madv);
+		break;
+	case VE_THP_MADVISE:
+		flags &= ~(1UL << enabled);
+		flags |= 1UL << req_madv;
+		break;
+	case VE_THP_NEVER:
+		flags &= ~((1UL << enabled) | (1UL << req_madv));
+		break;
+	}
+	return flags;
+}
+
+/*
+ * The global flags with the modes the VE of the mm has set with
+ * VE_CONFIGURE_THP. THP disabled globally stays disabled, there is no
+ * khugepaged then. The VE with defrag "never" does no compaction in
+ * khugepaged either, so it does not stall the others.
+ */
+unsigned long mm_thp_flags(struct mm_struct *mm)
+{
+	unsigned long flags = transparent_hugepage_flags;
+	unsigned int mode, defrag;
+
+	mode = ACCESS_ONCE(mm_ub_top(mm)->ub_thp_mode);
+	if (likely(!mode) || !khugepaged_enabled())
+		return flags;
+
+	defrag = (mode >> VE_THP_DEFRAG_SHIFT) & VE_THP_MASK;
+	flags = thp_mode_flags(flags, mode & VE_THP_MASK,
+			TRANSPARENT_HUGEPAGE_FLAG,
+			TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG);
+	flags = thp_mode_flags(flags, defrag,
+			TRANSPARENT_HUGEPAGE_DEFRAG_FLAG,
+			TRANSPARENT_HUGEPAGE_DEFRAG_REQ_MADV_FLAG);
+	if (defrag == VE_THP_NEVER)
+		flags &= ~(1UL << TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG);
+	return flags;
+}
+
+/*
+ * khugepaged collapses no more than ub_pages_to_collapse huge pages of a
+ * container in one full scan, the mms of it are skipped then.
+ */
+static int khugepaged_ub_over_budget(struct mm_struct *mm)
+{
+	struct user_beancounter *ub = mm_ub_top(mm);
+
+	if (!khugepaged_ub_pages_to_collapse || ub == get_ub0())
+		return 0;
+
+	if (ub->ub_thp_seqnr != khugepaged_full_scans) {
+		ub->ub_thp_seqnr = khugepaged_full_scans;
+		ub->ub_thp_collapsed = 0;
+	}
+	return ub->ub_thp_collapsed >= khugepaged_ub_pages_to_collapse;
+}
+
+static inline void khugepaged_ub_collapsed(struct mm_struct *mm)
+{
+	mm_ub_top(mm)->ub_thp_collapsed++;
+}
+#else
+#define khugepaged_ub_over_budget(mm)	(0)
+#define khugepaged_ub_collapsed(mm)	do { } while (0)
+#endif
+
 static void prepare_pmd_huge_pte(pgtable_t pgtable,
 				 struct mm_struct *mm)
 {
@@ -1719,6 +1822,7 @@ int khugepaged_enter_vma_merge(struct vm_area_struct *vma)
 		return khugepaged_enter(vma);
 	return 0;
 }
+EXPORT_SYMBOL(khugepaged_enter_vma_merge);
 
 void __khugepaged_exit(struct mm_struct *mm)
 {
@@ -1920,7 +2024,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	 * mmap_sem in read mode is good idea also to allow greater
 	 * scalability.
 	 */
-	new_page = alloc_hugepage_vma(khugepaged_defrag(), vma, address,
+	new_page = alloc_hugepage_vma(khugepaged_defrag_mm(mm), vma, address,
 				      node, __GFP_OTHER_NODE);
 	if (unlikely(!new_page)) {
 		up_read(&mm->mmap_sem);
@@ -1931,7 +2035,12 @@ static void collapse_huge_page(struct mm_struct *mm,
 	count_vm_event(THP_COLLAPSE_ALLOC);
 #endif
 
-	if (gang_add_user_page(new_page, get_mm_gang(mm), GFP_KERNEL)) {
+	/*
+	 * khugepaged does not reclaim a container or kill its tasks to make
+	 * room for a huge page, the collapse is just not done until it fits.
+	 */
+	if (gang_add_user_page(new_page, get_mm_gang(mm),
+				GFP_NOWAIT | __GFP_NOWARN)) {
 		up_read(&mm->mmap_sem);
 #ifdef CONFIG_NUMA
 		put_page(new_page);
@@ -1957,6 +2066,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	 * handled by the anon_vma lock + PG_lock.
 	 */
 	down_write(&mm->mmap_sem);
+	mm_vma_write_begin(mm);
 	if (unlikely(khugepaged_test_exit(mm)))
 		goto out;
 
@@ -1966,7 +2076,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	if (address < hstart || address + HPAGE_PMD_SIZE > hend)
 		goto out;
 
-	if ((!(vma->vm_flags & VM_HUGEPAGE) && !khugepaged_always()) ||
+	if ((!(vma->vm_flags & VM_HUGEPAGE) && !khugepaged_always(mm)) ||
 	    (vma->vm_flags & VM_NOHUGEPAGE))
 		goto out;
 
@@ -2057,7 +2167,9 @@ static void collapse_huge_page(struct mm_struct *mm,
 	*hpage = NULL;
 #endif
 	khugepaged_pages_collapsed++;
+	khugepaged_ub_collapsed(mm);
 out_up_write:
+	mm_vma_write_end(mm);
 	up_write(&mm->mmap_sem);
 	return;
 
@@ -2188,7 +2300,8 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 
 	mm = mm_slot->mm;
 	down_read(&mm->mmap_sem);
-	if (unlikely(khugepaged_test_exit(mm)))
+	if (unlikely(khugepaged_test_exit(mm)) ||
+	    khugepaged_ub_over_budget(mm))
 		vma = NULL;
 	else
 		vma = find_vma(mm, khugepaged_scan.address);
@@ -2204,7 +2317,7 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 		}
 
 		if ((!(vma->vm_flags & VM_HUGEPAGE) &&
-		     !khugepaged_always()) ||
+		     !khugepaged_always(mm)) ||
 		    (vma->vm_flags & VM_NOHUGEPAGE)) {
 		skip:
 			progress++;
@@ -95,6 +95,14 @@ extern void prep_compound_page(struct page *page, unsigned long order);
 #ifdef CONFIG_MEMORY_FAILURE
 extern bool is_free_buddy_page(struct page *page);
 #endif
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+extern void deferred_init_pfn(pg_data_t *pgdat, unsigned long pfn);
+
+/*
+ * in mm/bootmem.c
+ */
+extern unsigned long bootmem_free_deferred(pg_data_t *pgdat);
+#endif
 
 
 /*
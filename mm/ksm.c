@@ -36,6 +36,10 @@
 #include <linux/freezer.h>
 #include <linux/oom.h>
 #include <linux/numa.h>
+#include <linux/ve.h>
+#include <linux/vzcalluser.h>
+
+#include <bc/beancounter.h>
 
 #include <asm/tlbflush.h>
 #include "internal.h"
@@ -94,15 +98,17 @@
 /**
  * struct mm_slot - ksm information per mm that is being scanned
  * @link: link to the mm_slots hash list
- * @mm_list: link into the mm_slots list, rooted in ksm_mm_head
+ * @mm_list: link into the mm_slots list, rooted in mm_head of its ksm_worker
  * @rmap_list: head for this mm_slot's singly-linked list of rmap_items
  * @mm: the mm that this information is valid for
+ * @nid: home NUMA node, whose ksmd scans the mm when not merging across nodes
  */
 struct mm_slot {
 	struct hlist_node link;
 	struct list_head mm_list;
 	struct rmap_item *rmap_list;
 	struct mm_struct *mm;
+	int nid;
 };
 
 /**
@@ -112,7 +118,7 @@ struct mm_slot {
  * @rmap_list: link to the next rmap to be scanned in the rmap_list
  * @seqnr: count of completed full scans (needed when removing unstable node)
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is one ksm_scan instance of this cursor structure per ksm_worker.
  */
 struct ksm_scan {
 	struct mm_slot *mm_slot;
@@ -121,10 +127,35 @@ struct ksm_scan {
 	unsigned long seqnr;
 };
 
+/**
+ * struct ksm_worker - ksmd of a NUMA node
+ * @mm_head: head of the list of mm_slots this ksmd scans
+ * @scan: cursor of this ksmd
+ * @migrate_nodes: stable nodes of this ksmd pending proper placement
+ * @thread: the ksmd, NULL for a node without memory
+ * @pages_to_scan: pages to scan in one batch, 0 - ksm_thread_pages_to_scan
+ * @nid: NUMA node id, index of the trees this ksmd works on
+ *
+ * With merge_across_nodes there is one stable and one unstable tree and
+ * all mms are scanned by the ksmd of node 0. Otherwise the ksmd of a node
+ * scans the mms whose home is that node and only merges their pages on
+ * it in the trees of the node, and the trees and rmap_items of a node are
+ * only touched by its ksmd: so ksmds of different nodes run in parallel,
+ * holding ksm_thread_sem for read.
+ */
+struct ksm_worker {
+	struct mm_slot mm_head;
+	struct ksm_scan scan;
+	struct list_head migrate_nodes;
+	struct task_struct *thread;
+	unsigned int pages_to_scan;
+	int nid;
+};
+
 /**
  * struct stable_node - node of the stable rbtree
  * @node: rb node of this ksm page in the stable tree
- * @head: (overlaying parent) &migrate_nodes indicates temporarily on that list
+ * @head: (overlaying parent) migrate_nodes of a ksmd: temporarily on that list
  * @list: linked into migrate_nodes, pending placement in the proper node tree
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page (perhaps temporarily on wrong nid)
@@ -168,6 +199,9 @@ struct rmap_item {
 	struct mm_struct *mm;
 	unsigned long address;		/* + low bits used for flags below */
 	unsigned int oldchecksum;	/* when unstable */
+#ifdef CONFIG_BEANCOUNTERS
+	struct user_beancounter *ub;	/* when stable */
+#endif
 	union {
 		struct rb_node node;	/* when node of unstable tree */
 		struct {		/* when listed from stable tree */
@@ -177,6 +211,12 @@ struct rmap_item {
 	};
 };
 
+/* areas never merged */
+#define VM_KSM_EXCLUDE	(VM_SHARED    | VM_MAYSHARE | VM_PFNMAP    | \
+			 VM_IO        | VM_DONTEXPAND | VM_RESERVED | \
+			 VM_HUGETLB   | VM_INSERTPAGE | VM_NONLINEAR | \
+			 VM_MIXEDMAP  | VM_SAO)
+
 #define SEQNR_MASK	0x0ff	/* low bits of unstable tree seqnr */
 #define UNSTABLE_FLAG	0x100	/* is a node of the unstable tree */
 #define STABLE_FLAG	0x200	/* is listed from the stable tree */
@@ -187,34 +227,30 @@ static struct rb_root one_unstable_tree[1] = { RB_ROOT };
 static struct rb_root *root_stable_tree = one_stable_tree;
 static struct rb_root *root_unstable_tree = one_unstable_tree;
 
-/* Recently migrated nodes of stable tree, pending proper placement */
-static LIST_HEAD(migrate_nodes);
-
 #define MM_SLOTS_HASH_HEADS 1024
 static struct hlist_head *mm_slots_hash;
 
-static struct mm_slot ksm_mm_head = {
-	.mm_list = LIST_HEAD_INIT(ksm_mm_head.mm_list),
-};
-static struct ksm_scan ksm_scan = {
-	.mm_slot = &ksm_mm_head,
-};
+/* One per possible node, only node 0 when !CONFIG_NUMA */
+static struct ksm_worker *ksm_workers;
+
+/* Full scans completed by all ksmds, for the beancounter scan budget */
+static atomic_long_t ksm_scan_rounds = ATOMIC_LONG_INIT(0);
 
 static struct kmem_cache *rmap_item_cache;
 static struct kmem_cache *stable_node_cache;
 static struct kmem_cache *mm_slot_cache;
 
 /* The number of nodes in the stable tree */
-static unsigned long ksm_pages_shared;
+static atomic_long_t ksm_pages_shared = ATOMIC_LONG_INIT(0);
 
 /* The number of page slots additionally sharing those nodes */
-static unsigned long ksm_pages_sharing;
+static atomic_long_t ksm_pages_sharing = ATOMIC_LONG_INIT(0);
 
 /* The number of nodes in the unstable tree */
-static unsigned long ksm_pages_unshared;
+static atomic_long_t ksm_pages_unshared = ATOMIC_LONG_INIT(0);
 
 /* The number of rmap_items in use: to calculate pages_volatile */
-static unsigned long ksm_rmap_items;
+static atomic_long_t ksm_rmap_items = ATOMIC_LONG_INIT(0);
 
 /* Number of pages ksmd should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
@@ -222,6 +258,9 @@ static unsigned int ksm_thread_pages_to_scan = 100;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/* Pages ksmd may scan per beancounter in one full scan, 0 - no limit */
+static unsigned int ksm_ub_pages_to_scan;
+
 #ifdef CONFIG_NUMA
 /* Zeroed when merging across nodes is not allowed */
 static unsigned int ksm_merge_across_nodes = 1;
@@ -239,9 +278,21 @@ static unsigned long ksm_run = KSM_RUN_STOP;
 static void wait_while_offlining(void);
 
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
-static DEFINE_MUTEX(ksm_thread_mutex);
+/* Read by scanning ksmds, write excludes them all */
+static DECLARE_RWSEM(ksm_thread_sem);
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
+static inline struct ksm_worker *ksm_slot_worker(struct mm_slot *mm_slot)
+{
+	return ksm_workers + (ksm_merge_across_nodes ? 0 : mm_slot->nid);
+}
+
+/* The list a stable node is on when it is not in the stable tree */
+static inline struct list_head *migrate_nodes(struct stable_node *stable_node)
+{
+	return &ksm_workers[NUMA(stable_node->nid)].migrate_nodes;
+}
+
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
 		sizeof(struct __struct), __alignof__(struct __struct),\
 		(__flags), NULL)
@@ -284,13 +335,66 @@ static inline struct rmap_item *alloc_rmap_item(void)
 
 	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL);
 	if (rmap_item)
-		ksm_rmap_items++;
+		atomic_long_inc(&ksm_rmap_items);
 	return rmap_item;
 }
 
+#ifdef CONFIG_BEANCOUNTERS
+static inline void ksm_ub_get(struct rmap_item *rmap_item)
+{
+	rmap_item->ub = get_beancounter(mm_ub_top(rmap_item->mm));
+}
+
+static inline void ksm_ub_put(struct rmap_item *rmap_item)
+{
+	put_beancounter(rmap_item->ub);
+}
+
+static inline void ksm_ub_merged(struct rmap_item *rmap_item, int nr)
+{
+	atomic_long_add(nr, &rmap_item->ub->ub_ksm_merged);
+}
+
+/*
+ * A beancounter that used up its budget is skipped till the next full
+ * scan of some ksmd, so that one big container can't take all of ksmd's
+ * time.
+ */
+static bool ksm_ub_over_budget(struct mm_struct *mm)
+{
+	struct user_beancounter *ub = mm_ub_top(mm);
+	unsigned long seqnr;
+
+	if (!ksm_ub_pages_to_scan)
+		return false;
+
+	seqnr = atomic_long_read(&ksm_scan_rounds);
+	if (ub->ub_ksm_seqnr != seqnr) {
+		ub->ub_ksm_seqnr = seqnr;
+		ub->ub_ksm_scanned = 0;
+	}
+	return ub->ub_ksm_scanned >= ksm_ub_pages_to_scan;
+}
+
+static inline void ksm_ub_scanned(struct mm_struct *mm)
+{
+	mm_ub_top(mm)->ub_ksm_scanned++;
+}
+#else
+static inline void ksm_ub_get(struct rmap_item *rmap_item) { }
+static inline void ksm_ub_put(struct rmap_item *rmap_item) { }
+static inline void ksm_ub_merged(struct rmap_item *rmap_item, int nr) { }
+static inline bool ksm_ub_over_budget(struct mm_struct *mm)
+{
+	return false;
+}
+static inline void ksm_ub_scanned(struct mm_struct *mm) { }
+#endif
+
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
-	ksm_rmap_items--;
+	atomic_long_dec(&ksm_rmap_items);
+	ksm_ub_put(rmap_item);
 	rmap_item->mm = NULL;	/* debug safety */
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
@@ -516,15 +620,16 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
 
 	hlist_for_each_entry(rmap_item, hlist, &stable_node->hlist, hlist) {
 		if (rmap_item->hlist.next)
-			ksm_pages_sharing--;
+			atomic_long_dec(&ksm_pages_sharing);
 		else
-			ksm_pages_shared--;
+			atomic_long_dec(&ksm_pages_shared);
+		ksm_ub_merged(rmap_item, -1);
 		drop_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
 		cond_resched();
 	}
 
-	if (stable_node->head == &migrate_nodes)
+	if (stable_node->head == migrate_nodes(stable_node))
 		list_del(&stable_node->list);
 	else
 		rb_erase(&stable_node->node,
@@ -644,9 +749,10 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		put_page(page);
 
 		if (stable_node->hlist.first)
-			ksm_pages_sharing--;
+			atomic_long_dec(&ksm_pages_sharing);
 		else
-			ksm_pages_shared--;
+			atomic_long_dec(&ksm_pages_shared);
+		ksm_ub_merged(rmap_item, -1);
 
 		drop_anon_vma(rmap_item->anon_vma);
 		rmap_item->address &= PAGE_MASK;
@@ -660,12 +766,13 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		 * if this rmap_item was inserted by this scan, rather
 		 * than left over from before.
 		 */
-		age = (unsigned char)(ksm_scan.seqnr - rmap_item->address);
+		age = (unsigned char)(ksm_workers[NUMA(rmap_item->nid)].scan.seqnr -
+				      rmap_item->address);
 		BUG_ON(age > 1);
 		if (!age)
 			rb_erase(&rmap_item->node,
 				 root_unstable_tree + NUMA(rmap_item->nid));
-		ksm_pages_unshared--;
+		atomic_long_dec(&ksm_pages_unshared);
 		rmap_item->address &= PAGE_MASK;
 	}
 out:
@@ -773,16 +880,18 @@ static int remove_all_stable_nodes(void)
 			cond_resched();
 		}
 	}
-	list_for_each_safe(this, next, &migrate_nodes) {
-		stable_node = list_entry(this, struct stable_node, list);
-		if (remove_stable_node(stable_node))
-			err = -EBUSY;
-		cond_resched();
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		list_for_each_safe(this, next, &ksm_workers[nid].migrate_nodes) {
+			stable_node = list_entry(this, struct stable_node, list);
+			if (remove_stable_node(stable_node))
+				err = -EBUSY;
+			cond_resched();
+		}
 	}
 	return err;
 }
 
-static int unmerge_and_remove_all_rmap_items(void)
+static int unmerge_worker_rmap_items(struct ksm_worker *w)
 {
 	struct mm_slot *mm_slot;
 	struct mm_struct *mm;
@@ -790,12 +899,12 @@ static int unmerge_and_remove_all_rmap_items(void)
 	int err = 0;
 
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
+	w->scan.mm_slot = list_entry(w->mm_head.mm_list.next,
 						struct mm_slot, mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
-	for (mm_slot = ksm_scan.mm_slot;
-			mm_slot != &ksm_mm_head; mm_slot = ksm_scan.mm_slot) {
+	for (mm_slot = w->scan.mm_slot;
+			mm_slot != &w->mm_head; mm_slot = w->scan.mm_slot) {
 		mm = mm_slot->mm;
 		down_read(&mm->mmap_sem);
 		for (vma = mm->mmap; vma; vma = vma->vm_next) {
@@ -812,7 +921,7 @@ static int unmerge_and_remove_all_rmap_items(void)
 		remove_trailing_rmap_items(mm_slot, &mm_slot->rmap_list);
 
 		spin_lock(&ksm_mmlist_lock);
-		ksm_scan.mm_slot = list_entry(mm_slot->mm_list.next,
+		w->scan.mm_slot = list_entry(mm_slot->mm_list.next,
 						struct mm_slot, mm_list);
 		if (ksm_test_exit(mm)) {
 			hlist_del(&mm_slot->link);
@@ -829,18 +938,31 @@ static int unmerge_and_remove_all_rmap_items(void)
 		}
 	}
 
-	/* Clean up stable nodes, but don't worry if some are still busy */
-	remove_all_stable_nodes();
-	ksm_scan.seqnr = 0;
+	w->scan.seqnr = 0;
 	return 0;
 
 error:
 	up_read(&mm->mmap_sem);
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = &ksm_mm_head;
+	w->scan.mm_slot = &w->mm_head;
 	spin_unlock(&ksm_mmlist_lock);
 	return err;
 }
+
+static int unmerge_and_remove_all_rmap_items(void)
+{
+	int nid, err;
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		err = unmerge_worker_rmap_items(ksm_workers + nid);
+		if (err)
+			return err;
+	}
+
+	/* Clean up stable nodes, but don't worry if some are still busy */
+	remove_all_stable_nodes();
+	return 0;
+}
 #endif /* CONFIG_SYSFS */
 
 static u32 calc_checksum(struct page *page)
@@ -1169,14 +1291,18 @@ static struct page *stable_tree_search(struct page *page)
 	struct stable_node *stable_node;
 	struct stable_node *page_node;
 
+	nid = get_kpfn_nid(page_to_pfn(page));
 	page_node = page_stable_node(page);
-	if (page_node && page_node->head != &migrate_nodes) {
-		/* ksm page forked */
+	if (page_node && (page_node->head != migrate_nodes(page_node) ||
+			  nid != NUMA(page_node->nid))) {
+		/*
+		 * ksm page forked; or migrated to the node of another ksmd,
+		 * whose tree it must not join: then leave it on our list.
+		 */
 		get_page(page);
 		return page;
 	}
 
-	nid = get_kpfn_nid(page_to_pfn(page));
 	root = root_stable_tree + nid;
 again:
 	new = &root->rb_node;
@@ -1248,7 +1374,7 @@ replace:
 		rb_erase(&stable_node->node, root);
 		page = NULL;
 	}
-	stable_node->head = &migrate_nodes;
+	stable_node->head = migrate_nodes(stable_node);
 	list_add(&stable_node->list, stable_node->head);
 	return page;
 }
@@ -1388,12 +1514,12 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 	}
 
 	rmap_item->address |= UNSTABLE_FLAG;
-	rmap_item->address |= (ksm_scan.seqnr & SEQNR_MASK);
+	rmap_item->address |= (ksm_workers[nid].scan.seqnr & SEQNR_MASK);
 	DO_NUMA(rmap_item->nid = nid);
 	rb_link_node(&rmap_item->node, parent, new);
 	rb_insert_color(&rmap_item->node, root);
 
-	ksm_pages_unshared++;
+	atomic_long_inc(&ksm_pages_unshared);
 	return NULL;
 }
 
@@ -1410,9 +1536,10 @@ static void stable_tree_append(struct rmap_item *rmap_item,
 	hlist_add_head(&rmap_item->hlist, &stable_node->hlist);
 
 	if (rmap_item->hlist.next)
-		ksm_pages_sharing++;
+		atomic_long_inc(&ksm_pages_sharing);
 	else
-		ksm_pages_shared++;
+		atomic_long_inc(&ksm_pages_shared);
+	ksm_ub_merged(rmap_item, 1);
 }
 
 /*
@@ -1435,14 +1562,14 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 
 	stable_node = page_stable_node(page);
 	if (stable_node) {
-		if (stable_node->head != &migrate_nodes &&
+		if (stable_node->head != migrate_nodes(stable_node) &&
 		    get_kpfn_nid(stable_node->kpfn) != NUMA(stable_node->nid)) {
 			rb_erase(&stable_node->node,
 				 root_stable_tree + NUMA(stable_node->nid));
-			stable_node->head = &migrate_nodes;
+			stable_node->head = migrate_nodes(stable_node);
 			list_add(&stable_node->list, stable_node->head);
 		}
-		if (stable_node->head != &migrate_nodes &&
+		if (stable_node->head != migrate_nodes(stable_node) &&
 		    rmap_item->head == stable_node)
 			return;
 	}
@@ -1537,6 +1664,7 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	if (rmap_item) {
 		/* It has already been zeroed */
 		rmap_item->mm = mm_slot->mm;
+		ksm_ub_get(rmap_item);
 		rmap_item->address = addr;
 		rmap_item->rmap_list = *rmap_list;
 		*rmap_list = rmap_item;
@@ -1544,19 +1672,48 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+/*
+ * rmap_items left unvisited by a full scan must not stay in the unstable
+ * tree thrown away at its end, the stable ones are kept for the next scan.
+ */
+static void skip_unstable_rmap_items(struct rmap_item *rmap_item)
+{
+	for (; rmap_item; rmap_item = rmap_item->rmap_list)
+		if (rmap_item->address & UNSTABLE_FLAG)
+			remove_rmap_item_from_tree(rmap_item);
+}
+
+/*
+ * When not merging across nodes, the ksmd of a node only takes the pages
+ * of its node and the ksm pages in its trees: it must keep off the trees
+ * and rmap_items of the others.
+ */
+static inline bool ksm_foreign_page(struct ksm_worker *w, struct page *page)
+{
+	struct stable_node *stable_node;
+
+	if (ksm_merge_across_nodes)
+		return false;
+
+	stable_node = page_stable_node(page);
+	if (stable_node)
+		return NUMA(stable_node->nid) != w->nid;
+	return page_to_nid(page) != w->nid;
+}
+
+static struct rmap_item *scan_get_next_rmap_item(struct ksm_worker *w,
+						 struct page **page)
 {
 	struct mm_struct *mm;
 	struct mm_slot *slot;
 	struct vm_area_struct *vma;
 	struct rmap_item *rmap_item;
-	int nid;
 
-	if (list_empty(&ksm_mm_head.mm_list))
+	if (list_empty(&w->mm_head.mm_list))
 		return NULL;
 
-	slot = ksm_scan.mm_slot;
-	if (slot == &ksm_mm_head) {
+	slot = w->scan.mm_slot;
+	if (slot == &w->mm_head) {
 		/*
 		 * A number of pages can hang around indefinitely on per-cpu
 		 * pagevecs, raised page count preventing write_protect_page
@@ -1580,7 +1737,7 @@ static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 			struct list_head *this, *next;
 			struct page *page;
 
-			list_for_each_safe(this, next, &migrate_nodes) {
+			list_for_each_safe(this, next, &w->migrate_nodes) {
 				stable_node = list_entry(this,
 						struct stable_node, list);
 				page = get_ksm_page(stable_node, false);
@@ -1590,19 +1747,18 @@ static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 			}
 		}
 
-		for (nid = 0; nid < ksm_nr_node_ids; nid++)
-			root_unstable_tree[nid] = RB_ROOT;
+		root_unstable_tree[NUMA(w->nid)] = RB_ROOT;
 
 		spin_lock(&ksm_mmlist_lock);
 		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
+		w->scan.mm_slot = slot;
 		spin_unlock(&ksm_mmlist_lock);
 		/* We raced against exit of last slot on the list */
-		if (slot == &ksm_mm_head)
+		if (slot == &w->mm_head)
 			return NULL;
 next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		w->scan.address = 0;
+		w->scan.rmap_list = &slot->rmap_list;
 	}
 
 	mm = slot->mm;
@@ -1610,60 +1766,67 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, w->scan.address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (w->scan.address < vma->vm_start)
+			w->scan.address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			w->scan.address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (w->scan.address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
+			if (ksm_ub_over_budget(mm)) {
+				skip_unstable_rmap_items(*w->scan.rmap_list);
+				up_read(&mm->mmap_sem);
+				goto skip_mm;
+			}
+			*page = follow_page(vma, w->scan.address, FOLL_GET);
 			if (IS_ERR_OR_NULL(*page)) {
-				ksm_scan.address += PAGE_SIZE;
+				w->scan.address += PAGE_SIZE;
 				cond_resched();
 				continue;
 			}
-			if (PageAnon(*page) ||
-			    page_trans_compound_anon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
+			if ((PageAnon(*page) ||
+			     page_trans_compound_anon(*page)) &&
+			    !ksm_foreign_page(w, *page)) {
+				flush_anon_page(vma, *page, w->scan.address);
 				flush_dcache_page(*page);
 				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_list, ksm_scan.address);
+					w->scan.rmap_list, w->scan.address);
 				if (rmap_item) {
-					ksm_scan.rmap_list =
+					w->scan.rmap_list =
 							&rmap_item->rmap_list;
-					ksm_scan.address += PAGE_SIZE;
+					w->scan.address += PAGE_SIZE;
+					ksm_ub_scanned(mm);
 				} else
 					put_page(*page);
 				up_read(&mm->mmap_sem);
 				return rmap_item;
 			}
 			put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			w->scan.address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		w->scan.address = 0;
+		w->scan.rmap_list = &slot->rmap_list;
 	}
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_list);
+	remove_trailing_rmap_items(slot, w->scan.rmap_list);
 
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
+	w->scan.mm_slot = list_entry(slot->mm_list.next,
 						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	if (w->scan.address == 0) {
 		/*
 		 * We've completed a full scan of all vmas, holding mmap_sem
 		 * throughout, and found no VM_MERGEABLE: so do the same as
@@ -1685,28 +1848,37 @@ next_mm:
 		spin_unlock(&ksm_mmlist_lock);
 		up_read(&mm->mmap_sem);
 	}
-
+next_slot:
 	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
+	slot = w->scan.mm_slot;
+	if (slot != &w->mm_head)
 		goto next_mm;
 
-	ksm_scan.seqnr++;
+	w->scan.seqnr++;
+	atomic_long_inc(&ksm_scan_rounds);
 	return NULL;
+
+skip_mm:
+	spin_lock(&ksm_mmlist_lock);
+	w->scan.mm_slot = list_entry(slot->mm_list.next,
+						struct mm_slot, mm_list);
+	spin_unlock(&ksm_mmlist_lock);
+	goto next_slot;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @w - the ksmd scanning.
  * @scan_npages - number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_worker *w, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
 
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
+		rmap_item = scan_get_next_rmap_item(w, &page);
 		if (!rmap_item)
 			return;
 		cmp_and_merge_page(page, rmap_item);
@@ -1714,31 +1886,35 @@ static void ksm_do_scan(unsigned int scan_npages)
 	}
 }
 
-static int ksmd_should_run(void)
+/* ksmds just sleep while memory is going offline, see wait_while_offlining */
+static int ksmd_should_run(struct ksm_worker *w)
 {
-	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
+	return (ksm_run & (KSM_RUN_MERGE | KSM_RUN_OFFLINE)) == KSM_RUN_MERGE &&
+		!list_empty(&w->mm_head.mm_list);
 }
 
-static int ksm_scan_thread(void *nothing)
+static int ksm_scan_thread(void *arg)
 {
+	struct ksm_worker *w = arg;
+
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
-		wait_while_offlining();
-		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+		down_read(&ksm_thread_sem);
+		if (ksmd_should_run(w))
+			ksm_do_scan(w, w->pages_to_scan ? :
+					ksm_thread_pages_to_scan);
+		up_read(&ksm_thread_sem);
 
 		try_to_freeze();
 
-		if (ksmd_should_run()) {
+		if (ksmd_should_run(w)) {
 			schedule_timeout_interruptible(
 				msecs_to_jiffies(ksm_thread_sleep_millisecs));
 		} else {
 			wait_event_freezable(ksm_thread_wait,
-				ksmd_should_run() || kthread_should_stop());
+				ksmd_should_run(w) || kthread_should_stop());
 		}
 	}
 	return 0;
@@ -1755,10 +1931,7 @@ int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 		/*
 		 * Be somewhat over-protective for now!
 		 */
-		if (*vm_flags & (VM_MERGEABLE | VM_SHARED  | VM_MAYSHARE   |
-				 VM_PFNMAP    | VM_IO      | VM_DONTEXPAND |
-				 VM_RESERVED  | VM_HUGETLB | VM_INSERTPAGE |
-				 VM_NONLINEAR | VM_MIXEDMAP | VM_SAO))
+		if (*vm_flags & (VM_MERGEABLE | VM_KSM_EXCLUDE))
 			return 0;		/* just ignore the advice */
 
 		if (!test_bit(MMF_VM_MERGEABLE, &mm->flags)) {
@@ -1787,19 +1960,47 @@ int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 	return 0;
 }
 
-int __ksm_enter(struct mm_struct *mm)
+/*
+ * Private writable areas of a VE with VE_FEATURE_KSM are mergeable as if
+ * madvised so, for software that never heard of MADV_MERGEABLE. Is called
+ * for a new area of the current VE with mmap_sem held for write.
+ */
+void ksm_vma_auto(struct mm_struct *mm, unsigned long *vm_flags)
+{
+#ifdef CONFIG_VE
+	if (!(get_exec_env()->features & VE_FEATURE_KSM))
+		return;
+
+	if (!(*vm_flags & VM_WRITE) ||
+	    (*vm_flags & (VM_MERGEABLE | VM_KSM_EXCLUDE)))
+		return;
+
+	if (!test_bit(MMF_VM_MERGEABLE, &mm->flags) && __ksm_enter(mm))
+		return;
+
+	*vm_flags |= VM_MERGEABLE;
+#endif
+}
+
+static int ksm_enter_node(struct mm_struct *mm, int nid)
 {
 	struct mm_slot *mm_slot;
+	struct ksm_worker *w;
 	int needs_wakeup;
 
 	mm_slot = alloc_mm_slot();
 	if (!mm_slot)
 		return -ENOMEM;
 
-	/* Check ksm_run too?  Would need tighter locking */
-	needs_wakeup = list_empty(&ksm_mm_head.mm_list);
+	/* A node without memory has no ksmd */
+	if (!ksm_workers[nid].thread)
+		nid = 0;
+	mm_slot->nid = nid;
 
 	spin_lock(&ksm_mmlist_lock);
+	w = ksm_slot_worker(mm_slot);
+	/* Check ksm_run too?  Would need tighter locking */
+	needs_wakeup = list_empty(&w->mm_head.mm_list);
 	insert_to_mm_slots_hash(mm, mm_slot);
 	/*
 	 * When KSM_RUN_MERGE (or KSM_RUN_STOP),
@@ -1812,9 +2013,9 @@ int __ksm_enter(struct mm_struct *mm)
 	 * missed: then we might as well insert at the end of the list.
 	 */
 	if (ksm_run & KSM_RUN_UNMERGE)
-		list_add_tail(&mm_slot->mm_list, &ksm_mm_head.mm_list);
+		list_add_tail(&mm_slot->mm_list, &w->mm_head.mm_list);
 	else
-		list_add_tail(&mm_slot->mm_list, &ksm_scan.mm_slot->mm_list);
+		list_add_tail(&mm_slot->mm_list, &w->scan.mm_slot->mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
 	set_bit(MMF_VM_MERGEABLE, &mm->flags);
@@ -1826,9 +2027,33 @@ int __ksm_enter(struct mm_struct *mm)
 	return 0;
 }
 
+int __ksm_enter(struct mm_struct *mm)
+{
+	return ksm_enter_node(mm, numa_node_id());
+}
+
+/*
+ * The child shares the ksm pages of the parent, which are in the trees
+ * of the ksmd of the parent: let the same ksmd scan it.
+ */
+int __ksm_fork(struct mm_struct *mm, struct mm_struct *oldmm)
+{
+	struct mm_slot *mm_slot;
+	int nid = numa_node_id();
+
+	spin_lock(&ksm_mmlist_lock);
+	mm_slot = get_mm_slot(oldmm);
+	if (mm_slot)
+		nid = mm_slot->nid;
+	spin_unlock(&ksm_mmlist_lock);
+
+	return ksm_enter_node(mm, nid);
+}
+
 void __ksm_exit(struct mm_struct *mm)
 {
 	struct mm_slot *mm_slot;
+	struct ksm_scan *uninitialized_var(scan);
 	int easy_to_free = 0;
 
 	/*
@@ -1842,14 +2067,16 @@ void __ksm_exit(struct mm_struct *mm)
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot)
+		scan = &ksm_slot_worker(mm_slot)->scan;
+	if (mm_slot && scan->mm_slot != mm_slot) {
 		if (!mm_slot->rmap_list) {
 			hlist_del(&mm_slot->link);
 			list_del(&mm_slot->mm_list);
 			easy_to_free = 1;
 		} else {
 			list_move(&mm_slot->mm_list,
-				  &ksm_scan.mm_slot->mm_list);
+				  &scan->mm_slot->mm_list);
 		}
 	}
 	spin_unlock(&ksm_mmlist_lock);
@@ -2082,13 +2309,14 @@ static int just_wait(void *word)
 	return 0;
 }
 
+/* Called with ksm_thread_sem held for write */
 static void wait_while_offlining(void)
 {
 	while (ksm_run & KSM_RUN_OFFLINE) {
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		wait_on_bit(&ksm_run, ilog2(KSM_RUN_OFFLINE),
 				just_wait, TASK_UNINTERRUPTIBLE);
-		mutex_lock(&ksm_thread_mutex);
+		down_write(&ksm_thread_sem);
 	}
 }
 
@@ -2117,12 +2345,14 @@ static void ksm_check_stable_tree(unsigned long start_pfn,
 			cond_resched();
 		}
 	}
-	list_for_each_safe(this, next, &migrate_nodes) {
-		stable_node = list_entry(this, struct stable_node, list);
-		if (stable_node->kpfn >= start_pfn &&
-		    stable_node->kpfn < end_pfn)
-			remove_node_from_stable_tree(stable_node);
-		cond_resched();
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		list_for_each_safe(this, next, &ksm_workers[nid].migrate_nodes) {
+			stable_node = list_entry(this, struct stable_node, list);
+			if (stable_node->kpfn >= start_pfn &&
+			    stable_node->kpfn < end_pfn)
+				remove_node_from_stable_tree(stable_node);
+			cond_resched();
+		}
 	}
 }
 
@@ -2138,11 +2368,11 @@ static int ksm_memory_callback(struct notifier_block *self,
 		 * and remove_all_stable_nodes() while memory is going offline:
 		 * it is unsafe for them to touch the stable tree at this time.
 		 * But unmerge_ksm_pages(), rmap lookups and other entry points
-		 * which do not need the ksm_thread_mutex are all safe.
+		 * which do not need the ksm_thread_sem are all safe.
 		 */
-		mutex_lock(&ksm_thread_mutex);
+		down_write(&ksm_thread_sem);
 		ksm_run |= KSM_RUN_OFFLINE;
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		break;
 
 	case MEM_OFFLINE:
@@ -2158,12 +2388,13 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/* fallthrough */
 
 	case MEM_CANCEL_OFFLINE:
-		mutex_lock(&ksm_thread_mutex);
+		down_write(&ksm_thread_sem);
 		ksm_run &= ~KSM_RUN_OFFLINE;
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 
 		smp_mb();	/* wake_up_bit advises this */
 		wake_up_bit(&ksm_run, ilog2(KSM_RUN_OFFLINE));
+		wake_up_interruptible(&ksm_thread_wait);
 		break;
 	}
 	return NOTIFY_OK;
@@ -2231,6 +2462,66 @@ static ssize_t pages_to_scan_store(struct kobject *kobj,
 }
 KSM_ATTR(pages_to_scan);
 
+static ssize_t ub_pages_to_scan_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_ub_pages_to_scan);
+}
+
+static ssize_t ub_pages_to_scan_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
+{
+	int err;
+	unsigned long nr_pages;
+
+	err = strict_strtoul(buf, 10, &nr_pages);
+	if (err || nr_pages > UINT_MAX)
+		return -EINVAL;
+
+	ksm_ub_pages_to_scan = nr_pages;
+
+	return count;
+}
+KSM_ATTR(ub_pages_to_scan);
+
+#ifdef CONFIG_NUMA
+/*
+ * Pages the ksmd of a node scans in one batch: "nid pages" lines, 0 pages
+ * means pages_to_scan. Only used when not merging across nodes.
+ */
+static ssize_t node_pages_to_scan_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		if (ksm_workers[nid].thread)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%d %u\n",
+					 nid, ksm_workers[nid].pages_to_scan);
+	return len;
+}
+
+static ssize_t node_pages_to_scan_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned int nr_pages;
+	int nid;
+
+	if (sscanf(buf, "%d %u", &nid, &nr_pages) != 2)
+		return -EINVAL;
+	if (nid < 0 || nid >= nr_node_ids || !ksm_workers[nid].thread)
+		return -EINVAL;
+
+	ksm_workers[nid].pages_to_scan = nr_pages;
+
+	return count;
+}
+KSM_ATTR(node_pages_to_scan);
+#endif
+
 static ssize_t run_show(struct kobject *kobj, struct kobj_attribute *attr,
 			char *buf)
 {
@@ -2256,7 +2547,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 	 * on the list for when ksmd may be set running again).
 	 */
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	wait_while_offlining();
 	if (ksm_run != flags) {
 		ksm_run = flags;
@@ -2272,7 +2563,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 			}
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	if (flags & KSM_RUN_MERGE)
 		wake_up_interruptible(&ksm_thread_wait);
@@ -2282,6 +2573,42 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 KSM_ATTR(run);
 
 #ifdef CONFIG_NUMA
+/*
+ * Moves all mm_slots to the ksmds of the new mode, with ksm_thread_sem
+ * held for write. The unstable trees are thrown away and the cursors
+ * are reset, so each ksmd starts a new full scan.
+ */
+static void ksm_reassign_mm_slots(unsigned int merge_across_nodes)
+{
+	struct mm_slot *mm_slot, *next;
+	struct rmap_item *rmap_item;
+	LIST_HEAD(mm_slots);
+	int nid;
+
+	spin_lock(&ksm_mmlist_lock);
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		list_splice_init(&ksm_workers[nid].mm_head.mm_list, &mm_slots);
+		ksm_workers[nid].scan.mm_slot = &ksm_workers[nid].mm_head;
+	}
+	ksm_merge_across_nodes = merge_across_nodes;
+	list_for_each_entry_safe(mm_slot, next, &mm_slots, mm_list) {
+		/* No stable nodes are left, rmap_items are unstable at most */
+		for (rmap_item = mm_slot->rmap_list; rmap_item;
+		     rmap_item = rmap_item->rmap_list) {
+			if (!(rmap_item->address & UNSTABLE_FLAG))
+				continue;
+			atomic_long_dec(&ksm_pages_unshared);
+			rmap_item->address &= PAGE_MASK;
+		}
+		list_move_tail(&mm_slot->mm_list,
+			       &ksm_slot_worker(mm_slot)->mm_head.mm_list);
+	}
+	spin_unlock(&ksm_mmlist_lock);
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		root_unstable_tree[nid] = RB_ROOT;
+}
+
 static ssize_t merge_across_nodes_show(struct kobject *kobj,
 				struct kobj_attribute *attr, char *buf)
 {
@@ -2301,10 +2628,11 @@ static ssize_t merge_across_nodes_store(struct kobject *kobj,
 	if (knob > 1)
 		return -EINVAL;
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	wait_while_offlining();
 	if (ksm_merge_across_nodes != knob) {
-		if (ksm_pages_shared || remove_all_stable_nodes())
+		if (atomic_long_read(&ksm_pages_shared) ||
+		    remove_all_stable_nodes())
 			err = -EBUSY;
 		else if (root_stable_tree == one_stable_tree) {
 			struct rb_root *buf;
@@ -2328,11 +2656,13 @@ static ssize_t merge_across_nodes_store(struct kobject *kobj,
 			}
 		}
 		if (!err) {
-			ksm_merge_across_nodes = knob;
+			ksm_reassign_mm_slots(knob);
 			ksm_nr_node_ids = knob ? 1 : nr_node_ids;
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
+
+	wake_up_interruptible(&ksm_thread_wait);
 
 	return err ? err : count;
 }
@@ -2342,21 +2672,21 @@ KSM_ATTR(merge_across_nodes);
 static ssize_t pages_shared_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_shared);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_shared));
 }
 KSM_ATTR_RO(pages_shared);
 
 static ssize_t pages_sharing_show(struct kobject *kobj,
 				  struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_sharing);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_sharing));
 }
 KSM_ATTR_RO(pages_sharing);
 
 static ssize_t pages_unshared_show(struct kobject *kobj,
 				   struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_unshared));
 }
 KSM_ATTR_RO(pages_unshared);
 
@@ -2365,8 +2695,10 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = atomic_long_read(&ksm_rmap_items)
+				- atomic_long_read(&ksm_pages_shared)
+				- atomic_long_read(&ksm_pages_sharing)
+				- atomic_long_read(&ksm_pages_unshared);
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -2377,16 +2709,31 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 }
 KSM_ATTR_RO(pages_volatile);
 
+/* Full scans completed by the slowest ksmd having mms to scan */
 static ssize_t full_scans_show(struct kobject *kobj,
 			       struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_scan.seqnr);
+	unsigned long seqnr = ULONG_MAX;
+	struct ksm_worker *w;
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		w = ksm_workers + nid;
+		if (w->thread && !list_empty(&w->mm_head.mm_list))
+			seqnr = min(seqnr, w->scan.seqnr);
+	}
+	if (seqnr == ULONG_MAX)
+		seqnr = ksm_workers[0].scan.seqnr;
+	return sprintf(buf, "%lu\n", seqnr);
 }
 KSM_ATTR_RO(full_scans);
 
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
+#ifdef CONFIG_BEANCOUNTERS
+	&ub_pages_to_scan_attr.attr,
+#endif
 	&run_attr.attr,
 	&pages_shared_attr.attr,
 	&pages_sharing_attr.attr,
@@ -2395,6 +2742,7 @@ static struct attribute *ksm_attrs[] = {
 	&full_scans_attr.attr,
 #ifdef CONFIG_NUMA
 	&merge_across_nodes_attr.attr,
+	&node_pages_to_scan_attr.attr,
 #endif
 	NULL,
 };
@@ -2405,23 +2753,85 @@ static struct attribute_group ksm_attr_group = {
 };
 #endif /* CONFIG_SYSFS */
 
+static int __init ksm_workers_init(void)
+{
+	struct ksm_worker *w;
+	int nid;
+
+	ksm_workers = kcalloc(nr_node_ids, sizeof(*w), GFP_KERNEL);
+	if (!ksm_workers)
+		return -ENOMEM;
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		w = ksm_workers + nid;
+		INIT_LIST_HEAD(&w->mm_head.mm_list);
+		w->scan.mm_slot = &w->mm_head;
+		INIT_LIST_HEAD(&w->migrate_nodes);
+		w->nid = nid;
+	}
+	return 0;
+}
+
+static void ksm_workers_stop(void)
+{
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		if (ksm_workers[nid].thread)
+			kthread_stop(ksm_workers[nid].thread);
+}
+
+/*
+ * ksmd of node 0 is always there, the ksmds of other nodes with memory
+ * are bound to their cpus. A node onlined later is scanned by the ksmd
+ * of node 0.
+ */
+static int __init ksm_workers_start(void)
+{
+	struct task_struct *thread;
+	int nid;
+
+	thread = kthread_run(ksm_scan_thread, ksm_workers, "ksmd");
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+	ksm_workers[0].thread = thread;
+
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		if (!nid)
+			continue;
+		thread = kthread_create(ksm_scan_thread, ksm_workers + nid,
+					"ksmd/%d", nid);
+		if (IS_ERR(thread)) {
+			ksm_workers_stop();
+			return PTR_ERR(thread);
+		}
+		if (!cpumask_empty(cpumask_of_node(nid)))
+			set_cpus_allowed_ptr(thread, cpumask_of_node(nid));
+		ksm_workers[nid].thread = thread;
+		wake_up_process(thread);
+	}
+	return 0;
+}
+
 static int __init ksm_init(void)
 {
-	struct task_struct *ksm_thread;
 	int err;
 
-	err = ksm_slab_init();
+	err = ksm_workers_init();
 	if (err)
 		goto out;
 
+	err = ksm_slab_init();
+	if (err)
+		goto out_free0;
+
 	err = mm_slots_hash_init();
 	if (err)
 		goto out_free1;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
+	err = ksm_workers_start();
+	if (err) {
 		printk(KERN_ERR "ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
 		goto out_free2;
 	}
 
@@ -2429,7 +2839,7 @@ static int __init ksm_init(void)
 	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
 	if (err) {
 		printk(KERN_ERR "ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
+		ksm_workers_stop();
 		goto out_free2;
 	}
 #else
@@ -2447,6 +2857,8 @@ out_free2:
 	mm_slots_hash_free();
 out_free1:
 	ksm_slab_free();
+out_free0:
+	kfree(ksm_workers);
 out:
 	return err;
 }
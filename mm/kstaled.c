@@ -9,10 +9,54 @@
 #include <linux/freezer.h>
 #include <linux/ioport.h>
 #include <linux/backing-dev.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 static unsigned int kstaled_scan_secs;
 static DECLARE_WAIT_QUEUE_HEAD(kstaled_wait);
 
+/*
+ * Every node with memory is scanned by its own thread. A full pass over
+ * the node is spread over kstaled_scan_secs in KSTALED_TICK chunks, so
+ * the scanner does not burst.
+ */
+#define KSTALED_TICK		(HZ / 10)
+#define KSTALED_TICKS_PER_SEC	10
+
+/*
+ * Per-node byte map of page idle ages: how many consecutive scans found
+ * the page idle, saturated at 255. Allocated on first scan, pages which
+ * do not fit into map (hotplugged memory) are not aged.
+ */
+static unsigned char *kstaled_age_map[MAX_NUMNODES];
+static unsigned long kstaled_age_map_size[MAX_NUMNODES];
+
+static void kstaled_alloc_age_map(int nid)
+{
+	unsigned long size = node_spanned_pages(nid);
+
+	if (kstaled_age_map[nid] || !size)
+		return;
+	kstaled_age_map[nid] = vzalloc_node(size, nid);
+	if (kstaled_age_map[nid])
+		kstaled_age_map_size[nid] = size;
+}
+
+static unsigned char *kstaled_page_age(struct page *page)
+{
+	int nid = page_to_nid(page);
+	unsigned long idx = page_to_pfn(page) - node_start_pfn(nid);
+
+	if (!kstaled_age_map[nid] || idx >= kstaled_age_map_size[nid])
+		return NULL;
+	return kstaled_age_map[nid] + idx;
+}
+
+static int kstaled_age_bucket(unsigned char age)
+{
+	return min_t(int, ilog2(age), KSTALED_AGE_BUCKETS - 1);
+}
+
 struct kstaled_page_info {
 	int referenced_ptes;
 	int dirty_ptes;
@@ -107,10 +151,11 @@ static int kstaled_scan_page(struct page *page)
 	struct address_space *mapping;
 	struct gang *gang;
 	struct idle_page_stats *stats;
+	unsigned char *age;
 	int nr_pages = 1;
 	int swap_backed = 1;
 
-	if (!PageLRU(page))
+	if (!PageLRU(page) || PageUnevictable(page))
 		goto out;
 
 	if (!PageCompound(page)) {
@@ -128,7 +173,7 @@ static int kstaled_scan_page(struct page *page)
 
 	nr_pages = 1 << compound_trans_order(page);
 
-	if (PageMlocked(page))
+	if (PageMlocked(page) || PageUnevictable(page))
 		goto out_put_page;
 
 	if (!trylock_page(page))
@@ -155,9 +200,15 @@ static int kstaled_scan_page(struct page *page)
 	if (info.referenced_ptes || (info.vm_flags & VM_LOCKED))
 		goto out_put_page;
 
+	age = kstaled_page_age(page);
 	rcu_read_lock();
 	gang = page_gang(page);
 	stats = &gang->idle_scan_stats;
+	if (age) {
+		if (*age < U8_MAX)
+			(*age)++;
+		stats->idle_age[kstaled_age_bucket(*age)] += nr_pages;
+	}
 	if (info.dirty_ptes || PageDirty(page) || PageWriteback(page)) {
 		if (swap_backed)
 			stats->idle_dirty_swap += nr_pages;
@@ -166,47 +217,86 @@ static int kstaled_scan_page(struct page *page)
 	} else
 		stats->idle_clean += nr_pages;
 	rcu_read_unlock();
-
-out_put_page:
 	put_page(page);
-out:
 	return nr_pages;
 
 out_unlock_page:
 	unlock_page(page);
-	goto out_put_page;
+out_put_page:
+	put_page(page);
+out:
+	/* not found idle this time, whatever happened to the pfn meanwhile */
+	age = kstaled_page_age(page);
+	if (age)
+		*age = 0;
+	return nr_pages;
 }
 
+struct kstaled_node {
+	int nid;
+	unsigned long next_pfn;	/* where the current pass stopped */
+};
+
 static int kstaled_scan_pages_range(unsigned long start_pfn,
 				    unsigned long nr_pages, void *arg)
 {
+	struct kstaled_node *kn = arg;
 	unsigned long pfn = start_pfn;
 	unsigned long end_pfn = start_pfn + nr_pages;
+	struct page *page;
 
 	while (pfn < end_pfn) {
 		if (!pfn_valid(pfn)) {
 			pfn++;
 			continue;
 		}
-		pfn += kstaled_scan_page(pfn_to_page(pfn));
+		page = pfn_to_page(pfn);
+		/* node ranges may interleave */
+		if (page_to_nid(page) != kn->nid) {
+			pfn++;
+			continue;
+		}
+		pfn += kstaled_scan_page(page);
 		cond_resched();
 	}
 	return 0;
 }
 
-static void kstaled_do_scan(void)
+/*
+ * Scan next chunk of the node, returns true when the pass is complete.
+ */
+static bool kstaled_scan_node_chunk(struct kstaled_node *kn,
+				    unsigned int scan_secs)
 {
-	walk_system_ram_range(0, 1UL << MAX_PHYSMEM_BITS, NULL,
+	unsigned long start = node_start_pfn(kn->nid);
+	unsigned long end = start + node_spanned_pages(kn->nid);
+	unsigned long budget;
+
+	budget = DIV_ROUND_UP(node_spanned_pages(kn->nid),
+			scan_secs * KSTALED_TICKS_PER_SEC);
+
+	if (kn->next_pfn < start || kn->next_pfn >= end)
+		kn->next_pfn = start;
+	budget = min(budget, end - kn->next_pfn);
+
+	walk_system_ram_range(kn->next_pfn, budget, kn,
 			      kstaled_scan_pages_range);
+	kn->next_pfn += budget;
+
+	return kn->next_pfn >= end;
 }
 
-static void kstaled_update_stats(void)
+static void kstaled_update_stats(int nid)
 {
+	pg_data_t *pgdat = NODE_DATA(nid);
 	struct zone *zone;
 	struct gang *gang;
 
 	rcu_read_lock();
-	for_each_zone(zone) {
+	for (zone = pgdat->node_zones;
+	     zone < pgdat->node_zones + MAX_NR_ZONES; zone++) {
+		if (!populated_zone(zone))
+			continue;
 		for_each_gang(gang, zone) {
 			write_seqcount_begin(&gang->idle_page_stats_lock);
 			gang->idle_page_stats = gang->idle_scan_stats;
@@ -226,22 +316,35 @@ static inline int kstaled_should_run(void)
 
 static int kstaled_scan_thread(void *arg)
 {
+	struct kstaled_node kn = {
+		.nid = (long)arg,
+		.next_pfn = 0,
+	};
+	const struct cpumask *cpumask = cpumask_of_node(kn.nid);
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		if (kstaled_should_run()) {
-			kstaled_do_scan();
-			kstaled_update_stats();
+		unsigned int scan_secs = ACCESS_ONCE(kstaled_scan_secs);
+
+		if (scan_secs) {
+			kstaled_alloc_age_map(kn.nid);
+			if (kstaled_scan_node_chunk(&kn, scan_secs))
+				kstaled_update_stats(kn.nid);
 		}
 
 		try_to_freeze();
 
 		if (kstaled_should_run()) {
-			schedule_timeout_interruptible(kstaled_scan_secs * HZ);
+			schedule_timeout_interruptible(KSTALED_TICK);
 		} else {
-			/* zero idle page stats */
-			kstaled_update_stats();
+			/* zero idle page stats and restart pass */
+			kstaled_update_stats(kn.nid);
+			kn.next_pfn = 0;
 			wait_event_freezable(kstaled_wait,
 				kstaled_should_run() || kthread_should_stop());
 		}
@@ -282,24 +385,38 @@ static struct attribute_group kstaled_attr_group = {
 	.name = "kstaled",
 };
 
+static struct task_struct *kstaled_threads[MAX_NUMNODES];
+
 static __init int kstaled_init(void)
 {
-	int err;
+	int err, nid;
 	struct task_struct *kstaled_thread;
 
-	kstaled_thread = kthread_run(kstaled_scan_thread, NULL, "kstaled");
-	if (IS_ERR(kstaled_thread)) {
-		printk(KERN_ERR "Failed to start kstaled\n");
-		return PTR_ERR(kstaled_thread);
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		kstaled_thread = kthread_run(kstaled_scan_thread,
+				(void *)(long)nid, "kstaled/%d", nid);
+		if (IS_ERR(kstaled_thread)) {
+			printk(KERN_ERR "Failed to start kstaled/%d\n", nid);
+			err = PTR_ERR(kstaled_thread);
+			goto err_stop;
+		}
+		kstaled_threads[nid] = kstaled_thread;
 	}
 
 	err = sysfs_create_group(mm_kobj, &kstaled_attr_group);
 	if (err) {
 		printk(KERN_ERR "kstaled: register sysfs failed\n");
-		kthread_stop(kstaled_thread);
-		return err;
+		goto err_stop;
 	}
 
 	return 0;
+
+err_stop:
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		if (kstaled_threads[nid])
+			kthread_stop(kstaled_threads[nid]);
+		kstaled_threads[nid] = NULL;
+	}
+	return err;
 }
 module_init(kstaled_init);
@@ -59,6 +59,7 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/pram.h>
+#include <linux/page_replica.h>
 
 #include <bc/beancounter.h>
 #include <bc/io_acct.h>
@@ -678,6 +679,15 @@ copy_one_pte(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 					pte = swp_entry_to_pte(entry);
 					set_pte_at(src_mm, addr, src_pte, pte);
 				}
+			} else if (is_zvswap_entry(entry)) {
+				rss[2]++;
+				get_zvswap_entry(entry);
+				if (is_write_zvswap_entry(entry) &&
+				    is_cow_mapping(vm_flags)) {
+					entry = wprotect_zvswap_entry(entry);
+					pte = swp_entry_to_pte(entry);
+					set_pte_at(src_mm, addr, src_pte, pte);
+				}
 			}
 		}
 		goto out_set_pte;
@@ -1023,6 +1033,9 @@ static unsigned long zap_pte_range(struct mmu_gather *tlb,
 				swap_usage--;
 				put_vswap_page(page);
 				put_page(page);
+			} else if (is_zvswap_entry(ent)) {
+				swap_usage--;
+				put_zvswap_entry(ent);
 			}
 			if (unlikely(!free_swap_and_cache(ent)))
 				print_bad_pte(vma, addr, ptent, NULL);
@@ -2930,6 +2943,89 @@ out:
 	return ret;
 }
 
+/*
+ * The page was compressed and freed by reclaim, vswapin into a new one.
+ * A read-only entry can be shared with other mms, each gets its own copy.
+ */
+static int do_zvswap_page(struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, pte_t *page_table, pmd_t *pmd,
+		unsigned int flags, pte_t orig_pte)
+{
+	swp_entry_t entry = pte_to_swp_entry(orig_pte);
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t pte;
+	int ret = 0;
+
+	ub_percpu_inc(mm_ub_top(mm), vswapin);
+	ub_reclaim_rate_limit(mm_ub(mm), 1, 1);
+
+	if (unlikely(anon_vma_prepare(vma)))
+		return VM_FAULT_OOM;
+	page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
+	if (!page)
+		return VM_FAULT_OOM;
+
+	page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+	if (unlikely(!pte_same(*page_table, orig_pte))) {
+		pte_unmap_unlock(page_table, ptl);
+		goto out_free;
+	}
+	/* the pte pins the compressed copy until we take our own reference */
+	get_zvswap_entry(entry);
+	pte_unmap_unlock(page_table, ptl);
+
+	if (zvswap_load_page(entry, page)) {
+		ret = VM_FAULT_SIGBUS;
+		goto out_put;
+	}
+	__SetPageUptodate(page);
+
+	if (gang_add_user_page(page, get_mm_gang(mm), GFP_KERNEL)) {
+		ret = VM_FAULT_OOM;
+		goto out_put;
+	}
+
+	if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL)) {
+		gang_del_user_page(page);
+		ret = VM_FAULT_OOM;
+		goto out_put;
+	}
+
+	page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+	if (unlikely(!pte_same(*page_table, orig_pte)))
+		goto out_release;
+
+	__count_vm_event(VSWPIN);
+	inc_mm_counter(mm, anon_rss);
+	dec_mm_counter(mm, swap_usage);
+	pte = mk_pte(page, vma->vm_page_prot);
+	/* write entry was the only one, the new page is exclusive */
+	if (is_write_zvswap_entry(entry))
+		pte = maybe_mkwrite(pte_mkdirty(pte), vma);
+	flush_icache_page(vma, page);
+	set_pte_at(mm, address, page_table, pte);
+	page_add_new_anon_rmap(page, vma, address);
+	put_zvswap_entry(entry);
+
+	/* No need to invalidate - it was non-present before */
+	update_mmu_cache(vma, address, pte);
+	pte_unmap_unlock(page_table, ptl);
+	put_zvswap_entry(entry);
+	/* a write to a read-only copy faults again and goes to do_wp_page */
+	return 0;
+
+out_release:
+	pte_unmap_unlock(page_table, ptl);
+	mem_cgroup_uncharge_page(page);
+	gang_del_user_page(page);
+out_put:
+	put_zvswap_entry(entry);
+out_free:
+	page_cache_release(page);
+	return ret;
+}
+
 /*
  * We enter with non-exclusive mmap_sem (to exclude vma changes,
  * but allow concurrent faults), and pte mapped but not yet locked.
@@ -2965,6 +3061,9 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		} else if (is_vswap_entry(entry)) {
 			return do_vswap_page(mm, vma, address, page_table, pmd,
 					     flags, orig_pte);
+		} else if (is_zvswap_entry(entry)) {
+			return do_zvswap_page(mm, vma, address, page_table, pmd,
+					      flags, orig_pte);
 		} else if (is_hwpoison_entry(entry)) {
 			ret = VM_FAULT_HWPOISON;
 		} else {
@@ -3018,6 +3117,11 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		}
 	}
 
+	/* Page is still being fetched by post-copy restore: ask to hurry */
+	if (unlikely(test_bit(MMF_POSTCOPY, &mm->flags)) &&
+	    !PageUptodate(page))
+		virtinfo_notifier_call(VITYPE_GENERAL, VIRTINFO_PAGEIN, page);
+
 	locked = lock_page_or_retry(page, mm, flags);
 	delayacct_clear_flag(DELAYACCT_PF_SWAPIN);
 	if (!locked) {
@@ -3130,9 +3234,14 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 unlock:
 	pte_unmap_unlock(page_table, ptl);
 out:
-	spin_lock_irq(&kstat_glb_lock);
-	KSTAT_LAT_ADD(&kstat_glob.swap_in, get_cycles() - start);
-	spin_unlock_irq(&kstat_glb_lock);
+	start = get_cycles() - start;
+	local_irq_disable();
+	KSTAT_LAT_PCPU_ADD(&kstat_glob.swap_in, smp_processor_id(), start);
+#ifdef CONFIG_VE
+	KSTAT_LAT_PCPU_ADD(&get_exec_env()->swap_in_ve, smp_processor_id(),
+			start);
+#endif
+	local_irq_enable();
 	trace_mm_anon_pgin(mm, address);
 	return ret;
 out_nomap:
@@ -3323,9 +3432,15 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	else
 		VM_BUG_ON(!PageLocked(vmf.page));
 
+	vmf.page = page_replica_fault(vma, vmf.page, flags);
+
+	start = get_cycles() - start;
 	local_irq_disable();
-	KSTAT_LAT_PCPU_ADD(&kstat_glob.page_in, smp_processor_id(),
-			get_cycles() - start);
+	KSTAT_LAT_PCPU_ADD(&kstat_glob.page_in, smp_processor_id(), start);
+#ifdef CONFIG_VE
+	KSTAT_LAT_PCPU_ADD(&get_exec_env()->page_in_ve, smp_processor_id(),
+			start);
+#endif
 	local_irq_enable();
 
 	/*
@@ -3699,6 +3814,204 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 }
 EXPORT_SYMBOL(handle_mm_fault);
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+
+/*
+ * Speculative page faults
+ *
+ * A not-present fault in private anonymous memory whose page table is
+ * already there is handled here without mmap_sem. The vma is looked up in
+ * the rbtree under RCU, vmas being SLAB_DESTROY_BY_RCU, and copied. Whoever
+ * changes vmas, or ptes of anonymous vmas, under the write mmap_sem does it
+ * between mm_vma_write_begin() and mm_vma_write_end() and takes the pte
+ * lock on its way when it touches the ptes. So if mm->vma_seq stays the
+ * same until the pte lock is got, the copy is what the locked path would
+ * see and any later change will find the new pte. The page table is
+ * walked with irqs disabled like in get_user_pages_fast(), which keeps it
+ * from being freed until the pte lock is got.
+ *
+ * Anything else is VM_FAULT_RETRY and goes the locked path.
+ */
+
+#define SPF_VM_FLAGS_BAD	(VM_SHARED | VM_LOCKED | VM_GROWSDOWN | \
+				 VM_GROWSUP | VM_PFNMAP | VM_IO | \
+				 VM_MIXEDMAP | VM_HUGETLB | VM_NONLINEAR)
+
+/* covers the rbtree depth of the largest map_count with much to spare */
+#define SPF_MAX_DEPTH		64
+
+static struct vm_area_struct *spf_find_vma(struct mm_struct *mm,
+		unsigned long address)
+{
+	struct rb_node *rb_node;
+	struct vm_area_struct *vma;
+	int depth;
+
+	/* the tree may change under us, the vma_seq check catches that */
+	rb_node = rcu_dereference(mm->mm_rb.rb_node);
+	for (depth = 0; rb_node && depth < SPF_MAX_DEPTH; depth++) {
+		vma = rb_entry(rb_node, struct vm_area_struct, vm_rb);
+		if (address < vma->vm_start)
+			rb_node = rcu_dereference(rb_node->rb_left);
+		else if (address >= vma->vm_end)
+			rb_node = rcu_dereference(rb_node->rb_right);
+		else
+			return vma;
+	}
+	return NULL;
+}
+
+static int spf_vma_ok(struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, unsigned int flags)
+{
+	if (vma->vm_mm != mm ||
+	    address < vma->vm_start || address >= vma->vm_end)
+		return 0;
+	if (vma->vm_flags & SPF_VM_FLAGS_BAD)
+		return 0;
+	if (vma->vm_file || vma->vm_ops || !vma->anon_vma ||
+	    vma_policy(vma))
+		return 0;
+
+	if (flags & FAULT_FLAG_WRITE)
+		return vma->vm_flags & VM_WRITE;
+	return vma->vm_flags & (VM_READ | VM_EXEC | VM_WRITE);
+}
+
+/*
+ * Locks the pte of the address if vma_seq is still @seq and returns it
+ * mapped, or NULL.
+ */
+static pte_t *spf_lock_pte(struct mm_struct *mm, unsigned long address,
+		unsigned int seq, spinlock_t **ptlp)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd, pmdval;
+	pte_t *pte;
+	spinlock_t *ptl;
+
+	local_irq_disable();
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		goto out;
+	pud = pud_offset(pgd, address);
+	if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+		goto out;
+	pmd = pmd_offset(pud, address);
+	pmdval = *pmd;
+	barrier();
+	if (pmd_none(pmdval) || pmd_trans_huge(pmdval) ||
+	    unlikely(pmd_bad(pmdval)))
+		goto out;
+
+	ptl = pte_lockptr(mm, &pmdval);
+	pte = pte_offset_map(&pmdval, address);
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		goto out;
+	}
+	if (read_seqcount_retry(&mm->vma_seq, seq) ||
+	    pmd_val(*pmd) != pmd_val(pmdval)) {
+		pte_unmap_unlock(pte, ptl);
+		goto out;
+	}
+	/* the holders of the write mmap_sem wait for the lock now */
+	local_irq_enable();
+
+	*ptlp = ptl;
+	return pte;
+out:
+	local_irq_enable();
+	return NULL;
+}
+
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+		unsigned int flags)
+{
+	struct vm_area_struct *vma, copy;
+	struct page *page = NULL;
+	spinlock_t *ptl;
+	unsigned int seq;
+	pte_t *pte, entry;
+	int ret = VM_FAULT_RETRY;
+
+	seq = raw_seqcount_begin(&mm->vma_seq);
+	rcu_read_lock();
+	vma = spf_find_vma(mm, address);
+	if (vma)
+		copy = *vma;
+	rcu_read_unlock();
+	if (!vma || read_seqcount_retry(&mm->vma_seq, seq) ||
+	    !spf_vma_ok(mm, &copy, address, flags))
+		goto out;
+
+	if (!(flags & FAULT_FLAG_WRITE)) {
+		entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
+						copy.vm_page_prot));
+	} else {
+		if (unlikely(check_memory_limits(mm)))
+			goto out;
+		page = alloc_zeroed_user_highpage_movable(&copy, address);
+		if (!page)
+			goto out;
+		__SetPageUptodate(page);
+
+		if (gang_add_user_page(page, get_mm_gang(mm), GFP_KERNEL))
+			goto out_free_page;
+		if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL))
+			goto out_del_page;
+
+		entry = mk_pte(page, copy.vm_page_prot);
+		if (copy.vm_flags & VM_WRITE)
+			entry = pte_mkwrite(pte_mkdirty(entry));
+	}
+
+	pte = spf_lock_pte(mm, address, seq, &ptl);
+	if (!pte)
+		goto out_uncharge;
+
+	if (!pte_none(*pte)) {
+		/* raced with another fault, unless it's something to swap in */
+		if (pte_present(*pte))
+			ret = 0;
+		pte_unmap_unlock(pte, ptl);
+		goto out_uncharge;
+	}
+
+	if (page) {
+		trace_mm_anon_fault(mm, address);
+		inc_mm_counter(mm, anon_rss);
+		page_add_new_anon_rmap(page, &copy, address);
+	}
+	set_pte_at(mm, address, pte, entry);
+
+	/* No need to invalidate - it was non-present before */
+	update_mmu_cache(&copy, address, entry);
+	pte_unmap_unlock(pte, ptl);
+
+	count_vm_event(PGFAULT);
+	count_vm_event(SPF_FAULT);
+	return 0;
+
+out_uncharge:
+	if (page)
+		mem_cgroup_uncharge_page(page);
+out_del_page:
+	if (page)
+		gang_del_user_page(page);
+out_free_page:
+	if (page)
+		page_cache_release(page);
+out:
+	if (ret)
+		count_vm_event(SPF_FAULT_FALLBACK);
+	else
+		count_vm_event(PGFAULT);
+	return ret;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 static int __install_new_anon_page(struct mm_struct *mm,
 			struct vm_area_struct *vma, unsigned long addr,
 			pmd_t *pmd, struct page *page)
@@ -137,6 +137,9 @@ static void mincore_pte_range(struct vm_area_struct *vma, pmd_t *pmd,
 
 				/* vswap present if already mapped somewhere */
 				*vec = page_mapped(page);
+			} else if (is_zvswap_entry(entry)) {
+				/* compressed, no page until vswapin */
+				*vec = 0;
 			} else {
 #ifdef CONFIG_SWAP
 				pgoff = entry.val;
@@ -31,6 +31,7 @@
 #include <linux/virtinfo.h>
 #include <linux/random.h>
 #include <linux/khugepaged.h>
+#include <linux/ksm.h>
 
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
@@ -506,7 +507,9 @@ static void vma_link(struct mm_struct *mm, struct vm_area_struct *vma,
 		vma->vm_truncate_count = mapping->truncate_count;
 	}
 
+	mm_vma_write_begin(mm);
 	__vma_link(mm, vma, prev, rb_link, rb_parent);
+	mm_vma_write_end(mm);
 	__vma_link_file(vma);
 
 	if (mapping)
@@ -568,6 +571,7 @@ int vma_adjust(struct vm_area_struct *vma, unsigned long start,
 	long adjust_next = 0;
 	int remove_next = 0;
 
+	mm_vma_write_begin(mm);
 	if (next && !insert) {
 		struct vm_area_struct *exporter = NULL;
 
@@ -605,8 +609,10 @@ again:			remove_next = 1 + (end > next->vm_end);
 		 * shrinking vma had, to cover any anon pages imported.
 		 */
 		if (exporter && exporter->anon_vma && !importer->anon_vma) {
-			if (anon_vma_clone(importer, exporter))
+			if (anon_vma_clone(importer, exporter)) {
+				mm_vma_write_end(mm);
 				return -ENOMEM;
+			}
 			importer->anon_vma = exporter->anon_vma;
 		}
 	}
@@ -718,6 +724,7 @@ again:			remove_next = 1 + (end > next->vm_end);
 			goto again;
 		}
 	}
+	mm_vma_write_end(mm);
 
 	validate_mm(mm);
 
@@ -1274,6 +1281,8 @@ munmap_back:
 		goto charge_error;
 	ub_charged = 1;
 
+	ksm_vma_auto(mm, &vm_flags);
+
 	/*
 	 * Can we just expand an old mapping?
 	 */
@@ -2341,8 +2350,10 @@ int do_munmap(struct mm_struct *mm, unsigned long start, size_t len)
 	/*
 	 * Remove the vma's, and unmap the actual pages
 	 */
+	mm_vma_write_begin(mm);
 	detach_vmas_to_be_unmapped(mm, vma, prev, end);
 	unmap_region(mm, vma, prev, start, end);
+	mm_vma_write_end(mm);
 
 	/* Fix up all other VM information */
 	remove_vma_list(mm, vma);
@@ -2446,6 +2457,8 @@ static unsigned long __do_brk(unsigned long addr, unsigned long len, int soft)
 	if (security_vm_enough_memory(len >> PAGE_SHIFT))
 		goto fail_sec;
 
+	ksm_vma_auto(mm, &flags);
+
 	/* Can we just expand an old private anonymous mapping? */
 	vma = vma_merge(mm, prev, addr, addr + len, flags,
 					NULL, NULL, pgoff, NULL);
@@ -1114,6 +1114,7 @@ static void __gang_idle_page_stat(struct gang_set *gs, nodemask_t *nodemask,
 	struct gang *gang;
 	struct idle_page_stats *gang_stats;
 	unsigned seq;
+	int i;
 
 	for_each_zone_zonelist_nodemask(zone, z,
 			node_zonelist(numa_node_id(), GFP_KERNEL),
@@ -1125,6 +1126,8 @@ static void __gang_idle_page_stat(struct gang_set *gs, nodemask_t *nodemask,
 			stats->idle_clean += gang_stats->idle_clean;
 			stats->idle_dirty_file += gang_stats->idle_dirty_file;
 			stats->idle_dirty_swap += gang_stats->idle_dirty_swap;
+			for (i = 0; i < KSTALED_AGE_BUCKETS; i++)
+				stats->idle_age[i] += gang_stats->idle_age[i];
 		} while (read_seqcount_retry(&gang->idle_page_stats_lock, seq));
 	}
 }
@@ -1142,7 +1145,7 @@ void gang_idle_page_stat(struct gang_set *gs, bool acct_hier,
 
 	for_each_beancounter_tree(ub, get_gangs_ub(gs))
 		if (ub != get_gangs_ub(gs))
-			__gang_idle_page_stat(gs, nodemask, stats);
+			__gang_idle_page_stat(get_ub_gs(ub), nodemask, stats);
 }
 #endif /* CONFIG_KSTALED */
 
@@ -181,7 +181,7 @@ mprotect_fixup(struct vm_area_struct *vma, struct vm_area_struct **pprev,
 	error = -ENOMEM;
        if (!VM_UB_PRIVATE(oldflags, vma->vm_file) &&
             VM_UB_PRIVATE(newflags, vma->vm_file) &&
-            charge_beancounter_fast(mm_ub_top(mm), UB_PRIVVMPAGES, nrpages, UB_SOFT))
+            ub_privvm_charge(mm, nrpages, UB_SOFT))
 		goto fail_ch;
 
 	/*
@@ -230,6 +230,7 @@ success:
 	 * vm_flags and vm_page_prot are protected by the mmap_sem
 	 * held in write mode.
 	 */
+	mm_vma_write_begin(mm);
 	vma->vm_flags = newflags;
 	vma->vm_page_prot = pgprot_modify(vma->vm_page_prot,
 					  vm_get_page_prot(newflags));
@@ -250,12 +251,13 @@ success:
 	else
 		change_protection(vma, start, end, vma->vm_page_prot, dirty_accountable);
 	mmu_notifier_invalidate_range_end(mm, start, end);
+	mm_vma_write_end(mm);
 	vm_stat_account(mm, oldflags, vma->vm_file, -nrpages);
 	vm_stat_account(mm, newflags, vma->vm_file, nrpages);
 
        if (VM_UB_PRIVATE(oldflags, vma->vm_file) &&
                        !VM_UB_PRIVATE(newflags, vma->vm_file))
-               uncharge_beancounter_fast(mm_ub_top(mm), UB_PRIVVMPAGES, nrpages);
+               ub_privvm_uncharge(mm, nrpages);
 
 	perf_event_mmap(vma);
 	return 0;
@@ -265,7 +267,7 @@ fail:
 fail_sec:
        if (!VM_UB_PRIVATE(oldflags, vma->vm_file) &&
                        VM_UB_PRIVATE(newflags, vma->vm_file))
-               uncharge_beancounter_fast(mm_ub_top(mm), UB_PRIVVMPAGES, nrpages);
+               ub_privvm_uncharge(mm, nrpages);
 fail_ch:
 	return error;
 }
@@ -225,6 +225,7 @@ static unsigned long move_vma(struct vm_area_struct *vma,
 	if (!new_vma)
 		goto err_nomem;
 
+	mm_vma_write_begin(mm);
 	moved_len = move_page_tables(vma, old_addr, new_vma, new_addr, old_len);
 	if (moved_len < old_len) {
 		/*
@@ -238,6 +239,7 @@ static unsigned long move_vma(struct vm_area_struct *vma,
 		old_addr = new_addr;
 		new_addr = -ENOMEM;
 	}
+	mm_vma_write_end(mm);
 
 	/* Conceal VM_ACCOUNT so old reservation is not undone */
 	if (vm_flags & VM_ACCOUNT) {
@@ -32,6 +32,8 @@
 #include <linux/mempolicy.h>
 #include <linux/security.h>
 #include <linux/ptrace.h>
+#include <linux/ve.h>
+#include <linux/ve_proto.h>
 
 #include <bc/beancounter.h>
 #include <bc/oom_kill.h>
@@ -287,6 +289,24 @@ static enum oom_constraint constrained_alloc(struct zonelist *zonelist,
 }
 #endif
 
+/*
+ * The tasks of a container beancounter live in the VE of the same id:
+ * only those need to be scanned for a victim in it, not all the tasks
+ * of the host. Returns the referenced VE, VE0 for a full scan.
+ */
+static struct ve_struct *oom_scan_ve(struct user_beancounter *ub)
+{
+	struct ve_struct *ve = NULL;
+
+#ifdef CONFIG_VE
+	if (ub != NULL && top_beancounter(ub)->ub_uid)
+		ve = get_ve_by_id(top_beancounter(ub)->ub_uid);
+	if (ve == NULL)
+		ve = get_ve(get_ve0());
+#endif
+	return ve;
+}
+
 /*
  * Simple selection loop. We chose the process with the highest
  * number of 'points'. We expect the caller will lock the tasklist.
@@ -299,9 +319,13 @@ struct task_struct *select_bad_process(int *ppoints,
 {
 	struct task_struct *g, *p;
 	struct task_struct *chosen = NULL;
+	struct ve_struct *ve;
 	*ppoints = 0;
 
-	do_each_thread_all(g, p) {
+	ve = oom_scan_ve(ub);
+again:
+	for (g = p = __first_task_ve(ve); g != NULL;
+	     g = p = __next_task_ve(ve, g)) do {
 		int points;
 
 		if (p->exit_state)
@@ -326,7 +350,8 @@ struct task_struct *select_bad_process(int *ppoints,
 				chosen = p;
 				*ppoints = 1000;
 			} else {
-				return p;
+				chosen = p;
+				goto out;
 			}
 		}
 
@@ -337,6 +362,14 @@ struct task_struct *select_bad_process(int *ppoints,
 		}
 	} while_each_thread_all(g, p);
 
+	if (chosen == NULL && !ve_is_super(ve)) {
+		/* tasks entered into the beancounter from outside the VE */
+		put_ve(ve);
+		ve = get_ve(get_ve0());
+		goto again;
+	}
+out:
+	put_ve(ve);
 	return chosen;
 }
 
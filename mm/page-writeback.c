@@ -538,6 +538,42 @@ get_dirty_limits(unsigned long *pbackground, unsigned long *pdirty,
 	}
 }
 
+/*
+ * IO-less throttling against beancounter dirty limits: dirtier doesn't
+ * write back itself, background writeback does that for its ub, but it
+ * sleeps for as long as writeback needs to clean what it has dirtied.
+ */
+static void ub_balance_dirty_pages(struct backing_dev_info *bdi,
+				   struct user_beancounter *ub,
+				   unsigned long write_chunk)
+{
+	long ub_thresh, ub_background_thresh;
+	unsigned long dirty, pause;
+
+	if (!ub_dirty_limits(&ub_background_thresh, &ub_thresh, ub))
+		return;
+
+	ub_update_write_bandwidth(ub);
+	dirty = ub_stat_get(ub, dirty_pages) +
+		ub_stat_get(ub, writeback_pages);
+
+	if (dirty > ub_thresh) {
+		if (!test_bit(UB_DIRTY_EXCEEDED, &ub->ub_flags))
+			set_bit(UB_DIRTY_EXCEEDED, &ub->ub_flags);
+	} else if (test_bit(UB_DIRTY_EXCEEDED, &ub->ub_flags))
+		clear_bit(UB_DIRTY_EXCEEDED, &ub->ub_flags);
+
+	if (dirty > ub_background_thresh && !writeback_in_progress(bdi))
+		bdi_start_background_writeback(bdi, ub);
+
+	pause = ub_dirty_pause(ub, dirty, ub_background_thresh, ub_thresh,
+			       write_chunk);
+	if (pause && !fatal_signal_pending(current)) {
+		__set_current_state(TASK_KILLABLE);
+		io_schedule_timeout(pause);
+	}
+}
+
 /*
  * balance_dirty_pages() must be called by processes which are generating dirty
  * data.  It looks at the number of dirty pages in the machine and will force
@@ -572,7 +608,8 @@ static void balance_dirty_pages(struct address_space *mapping,
 		get_dirty_limits(&background_thresh, &dirty_thresh,
 				&bdi_thresh, bdi);
 
-		if (ub_dirty_limits(&ub_background_thresh, &ub_thresh, ub)) {
+		if (!ub_dirty_ioless &&
+		    ub_dirty_limits(&ub_background_thresh, &ub_thresh, ub)) {
 			ub_dirty = ub_stat_get(ub, dirty_pages);
 			ub_writeback = ub_stat_get(ub, writeback_pages);
 		} else {
@@ -696,8 +733,10 @@ static void balance_dirty_pages(struct address_space *mapping,
 			bdi->dirty_exceeded)
 		bdi->dirty_exceeded = 0;
 
-	if (ub_dirty + ub_writeback < ub_thresh &&
-	    test_bit(UB_DIRTY_EXCEEDED, &ub->ub_flags))
+	if (ub_dirty_ioless)
+		ub_balance_dirty_pages(bdi, ub, write_chunk);
+	else if (ub_dirty + ub_writeback < ub_thresh &&
+		 test_bit(UB_DIRTY_EXCEEDED, &ub->ub_flags))
 		clear_bit(UB_DIRTY_EXCEEDED, &ub->ub_flags);
 
 	virtinfo_notifier_call(VITYPE_IO, VIRTINFO_IO_BALANCE_DIRTY,
@@ -1293,7 +1332,7 @@ int __set_page_dirty_nobuffers(struct page *page)
 					!radix_tree_prev_tag_get(
 						&mapping->page_tree,
 						PAGECACHE_TAG_DIRTY))
-				ub_io_account_dirty(mapping);
+				ub_io_account_dirty(mapping, page);
 		}
 		spin_unlock_irq(&mapping->tree_lock);
 		if (mapping->host) {
@@ -1483,7 +1522,7 @@ int test_clear_page_writeback(struct page *page)
 			if (bdi_cap_account_writeback(bdi)) {
 				if (radix_tree_prev_tag_get(&mapping->page_tree,
 							PAGECACHE_TAG_WRITEBACK))
-					ub_io_writeback_dec(mapping);
+					ub_io_writeback_dec(mapping, page);
 				__dec_bdi_stat(bdi, BDI_WRITEBACK);
 				__bdi_writeout_inc(bdi);
 			}
@@ -1515,7 +1554,7 @@ int test_set_page_writeback(struct page *page)
 			if (bdi_cap_account_writeback(bdi)) {
 				if (!radix_tree_prev_tag_get(&mapping->page_tree,
 							PAGECACHE_TAG_WRITEBACK))
-					ub_io_writeback_inc(mapping);
+					ub_io_writeback_inc(mapping, page);
 				__inc_bdi_stat(bdi, BDI_WRITEBACK);
 			}
 		}
@@ -1527,7 +1566,7 @@ int test_set_page_writeback(struct page *page)
 					radix_tree_prev_tag_get(
 						&mapping->page_tree,
 						PAGECACHE_TAG_DIRTY))
-				ub_io_account_clean(mapping);
+				ub_io_account_clean(mapping, page);
 		}
 		radix_tree_tag_clear(&mapping->page_tree,
 				     page_index(page),
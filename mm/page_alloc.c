@@ -53,6 +53,7 @@
 #include <linux/memory.h>
 #include <linux/compaction.h>
 #include <linux/memcontrol.h>
+#include <linux/kthread.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -1964,6 +1965,8 @@ __alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
 {
 	struct page *page;
 	struct task_struct *p = current;
+	struct user_beancounter *ub;
+	u64 start;
 
 	if (!order)
 		return NULL;
@@ -1973,12 +1976,22 @@ __alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
 		return NULL;
 	}
 
+	/* the container has used up its direct compaction budget */
+	ub = get_exec_ub_top();
+	if (!ub_compact_allowed(ub)) {
+		*deferred_compaction = true;
+		return NULL;
+	}
+
+	start = ub_compact_start(ub);
 	p->flags |= PF_MEMALLOC;
 	*did_some_progress = try_to_compact_pages(zonelist, order, gfp_mask,
 						  nodemask, sync_migration,
 						  contended_compaction);
 	p->flags &= ~PF_MEMALLOC;
+	ub_compact_end(ub, start);
 	if (*did_some_progress != COMPACT_SKIPPED) {
+		ub_percpu_inc(ub, compact_stall);
 
 		/* Page migration frees to the PCP lists but we want merging */
 		drain_pages(get_cpu());
@@ -1992,6 +2005,7 @@ __alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
 			preferred_zone->compact_considered = 0;
 			preferred_zone->compact_defer_shift = 0;
 			count_vm_event(COMPACTSUCCESS);
+			ub_percpu_inc(ub, compact_success);
 			return page;
 		}
 
@@ -2001,6 +2015,7 @@ __alloc_pages_direct_compact(gfp_t gfp_mask, unsigned int order,
 		 * but not enough to satisfy watermarks.
 		 */
 		count_vm_event(COMPACTFAIL);
+		ub_percpu_inc(ub, compact_fail);
 
 		/*
 		 * As async compaction considers a subset of pageblocks, only
@@ -2394,6 +2409,7 @@ static void __alloc_collect_stats(gfp_t gfp_mask, unsigned int order,
 	local_irq_save(flags);
 	cpu = smp_processor_id();
 	KSTAT_LAT_PCPU_ADD(&kstat_glob.alloc_lat[ind], cpu, time);
+	KSTAT_LAT_PCPU_ADD(&get_exec_env()->alloc_lat_ve, cpu, time);
 	if (!page)
 		kstat_glob.alloc_fails[cpu][ind]++;
 	local_irq_restore(flags);
@@ -3569,6 +3585,44 @@ retry:
 	zone->nr_migrate_reserve_block = new_reserve;
 }
 
+static void __meminit __init_single_pfn(unsigned long pfn, unsigned long zone,
+		int nid)
+{
+	struct zone *z = &NODE_DATA(nid)->node_zones[zone];
+	struct page *page = pfn_to_page(pfn);
+
+	set_page_links(page, zone, nid, pfn);
+	mminit_verify_page_links(page, zone, nid, pfn);
+	init_page_count(page);
+	reset_page_mapcount(page);
+	SetPageReserved(page);
+	/*
+	 * Mark the block movable so that blocks are reserved for
+	 * movable at startup. This will force kernel allocations
+	 * to reserve their blocks rather than leaking throughout
+	 * the address space during boot when many long-lived
+	 * kernel allocations are made. Later some blocks near
+	 * the start are marked MIGRATE_RESERVE by
+	 * setup_zone_migrate_reserve()
+	 *
+	 * bitmap is created for zone's valid pfn range. but memmap
+	 * can be created for invalid pages (for alignment)
+	 * check here not to call set_pageblock_migratetype() against
+	 * pfn out of zone.
+	 */
+	if ((z->zone_start_pfn <= pfn)
+	    && (pfn < z->zone_start_pfn + z->spanned_pages)
+	    && !(pfn & (pageblock_nr_pages - 1)))
+		set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+
+	INIT_LIST_HEAD(&page->lru);
+#ifdef WANT_PAGE_VIRTUAL
+	/* The shift won't overflow because ZONE_NORMAL is below 4G. */
+	if (!is_highmem_idx(zone))
+		set_page_address(page, __va(pfn << PAGE_SHIFT));
+#endif
+}
+
 /*
  * Initially all pages are reserved - free ones are freed
  * up by free_all_bootmem() once the early boot process is
@@ -3577,15 +3631,18 @@ retry:
 void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		unsigned long start_pfn, enum memmap_context context)
 {
-	struct page *page;
 	unsigned long end_pfn = start_pfn + size;
 	unsigned long pfn;
-	struct zone *z;
 
 	if (highest_memmap_pfn < end_pfn - 1)
 		highest_memmap_pfn = end_pfn - 1;
 
-	z = &NODE_DATA(nid)->node_zones[zone];
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	/* the rest is done by deferred_init_pfn() */
+	if (context == MEMMAP_EARLY)
+		end_pfn = min(end_pfn, NODE_DATA(nid)->first_deferred_pfn);
+#endif
+
 	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
 		/*
 		 * There can be holes in boot-time mem_map[]s
@@ -3598,39 +3655,66 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 			if (!early_pfn_in_nid(pfn, nid))
 				continue;
 		}
-		page = pfn_to_page(pfn);
-		set_page_links(page, zone, nid, pfn);
-		mminit_verify_page_links(page, zone, nid, pfn);
-		init_page_count(page);
-		reset_page_mapcount(page);
-		SetPageReserved(page);
-		/*
-		 * Mark the block movable so that blocks are reserved for
-		 * movable at startup. This will force kernel allocations
-		 * to reserve their blocks rather than leaking throughout
-		 * the address space during boot when many long-lived
-		 * kernel allocations are made. Later some blocks near
-		 * the start are marked MIGRATE_RESERVE by
-		 * setup_zone_migrate_reserve()
-		 *
-		 * bitmap is created for zone's valid pfn range. but memmap
-		 * can be created for invalid pages (for alignment)
-		 * check here not to call set_pageblock_migratetype() against
-		 * pfn out of zone.
-		 */
-		if ((z->zone_start_pfn <= pfn)
-		    && (pfn < z->zone_start_pfn + z->spanned_pages)
-		    && !(pfn & (pageblock_nr_pages - 1)))
-			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+		__init_single_pfn(pfn, zone, nid);
+	}
+}
 
-		INIT_LIST_HEAD(&page->lru);
-#ifdef WANT_PAGE_VIRTUAL
-		/* The shift won't overflow because ZONE_NORMAL is below 4G. */
-		if (!is_highmem_idx(zone))
-			set_page_address(page, __va(pfn << PAGE_SHIFT));
-#endif
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/* The deferred part of a node is in its highest zone */
+void __init deferred_init_pfn(pg_data_t *pgdat, unsigned long pfn)
+{
+	if (!early_pfn_valid(pfn) || !early_pfn_in_nid(pfn, pgdat->node_id))
+		return;
+	__init_single_pfn(pfn, pgdat->nr_zones - 1, pgdat->node_id);
+}
+
+static atomic_t pgdat_init_n_undone __initdata;
+static __initdata DECLARE_COMPLETION(pgdat_init_all_done);
+
+static int __init deferred_init_memmap(void *data)
+{
+	pg_data_t *pgdat = data;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	unsigned long start = jiffies;
+	unsigned long nr_pages;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+
+	nr_pages = bootmem_free_deferred(pgdat);
+	printk(KERN_INFO "node %d: %lu deferred pages initialised in %ums\n",
+	       pgdat->node_id, nr_pages, jiffies_to_msecs(jiffies - start));
+
+	if (atomic_dec_and_test(&pgdat_init_n_undone))
+		complete(&pgdat_init_all_done);
+	return 0;
+}
+
+/*
+ * Runs the per-node kthreads and waits for them: nothing but the early
+ * boot allocations is ready for half initialised zones.
+ */
+void __init page_alloc_init_late(void)
+{
+	struct task_struct *p;
+	int nid;
+
+	atomic_set(&pgdat_init_n_undone, 1);
+	for_each_online_node(nid) {
+		pg_data_t *pgdat = NODE_DATA(nid);
+
+		if (pgdat->first_deferred_pfn == ULONG_MAX)
+			continue;
+
+		atomic_inc(&pgdat_init_n_undone);
+		p = kthread_run(deferred_init_memmap, pgdat, "pgdatinit%d", nid);
+		if (IS_ERR(p))
+			deferred_init_memmap(pgdat);
 	}
+	if (!atomic_dec_and_test(&pgdat_init_n_undone))
+		wait_for_completion(&pgdat_init_all_done);
 }
+#endif
 
 static void __meminit zone_init_free_lists(struct zone *zone)
 {
@@ -4430,6 +4514,48 @@ static inline int pageblock_default_order(unsigned int order)
 
 #endif /* CONFIG_HUGETLB_PAGE_SIZE_VARIABLE */
 
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/*
+ * What early boot allocates after mem_init(), the big system hashes in
+ * the first place, is to be found in the initialised part of a node.
+ */
+#define DEFERRED_INIT_MIN_PAGES	((2UL << 30) >> PAGE_SHIFT)
+
+static void __paginginit pgdat_init_deferred(struct pglist_data *pgdat,
+		unsigned long *zones_size)
+{
+	unsigned long zone_start_pfn = pgdat->node_start_pfn;
+	unsigned long start = 0, end = 0, size, pfn;
+	enum zone_type j;
+
+	pgdat->first_deferred_pfn = ULONG_MAX;
+	/* hot added nodes are not for boot */
+	if (system_state != SYSTEM_BOOTING)
+		return;
+
+	for (j = 0; j < MAX_NR_ZONES; j++) {
+		size = zone_spanned_pages_in_node(pgdat->node_id, j,
+						  zones_size);
+		if (size) {
+			start = zone_start_pfn;
+			end = zone_start_pfn + size;
+		}
+		zone_start_pfn += size;
+	}
+
+	pfn = pgdat->node_start_pfn + DEFERRED_INIT_MIN_PAGES +
+		(pgdat->node_spanned_pages >> 6);
+	pfn = ALIGN(max(pfn, start), MAX_ORDER_NR_PAGES);
+	if (pfn < end)
+		pgdat->first_deferred_pfn = pfn;
+}
+#else
+static inline void pgdat_init_deferred(struct pglist_data *pgdat,
+		unsigned long *zones_size)
+{
+}
+#endif
+
 /*
  * Set up the zone data structures:
  *   - mark all pages reserved
@@ -4449,6 +4575,7 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	pgdat->kswapd_max_order = 0;
 	pgdat_page_cgroup_init(pgdat);
+	pgdat_init_deferred(pgdat, zones_size);
 
 #ifdef CONFIG_MEMORY_GANGS
 	init_gang_set.gangs[nid] = pgdat->init_gangs;
@@ -0,0 +1,361 @@
+/*
+ * mm/page_replica.c
+ *
+ * Per-node replicas of read-only file text
+ *
+ * Containers made from one OS template run the same binaries and
+ * libraries, and with pfcache peers even share one page cache for them,
+ * so the text sits on whatever node read it first and the containers
+ * bound to the other nodes fetch their instructions remotely.
+ *
+ * When enabled, a read fault in a private executable mapping of a page
+ * that is on another node and already mapped by somebody maps a copy
+ * made on the local node instead. The copies are kept by node in the
+ * page_replica of the page's own address_space, off the LRU and not
+ * charged to anybody. They are only made from free memory, are given
+ * back through a shrinker and are all dropped as soon as the file may
+ * change: it is opened for writing, truncated or invalidated. Copies the
+ * faults made meanwhile of pages being truncated or invalidated are
+ * dropped as each such page leaves the page cache.
+ *
+ * A replica has ->mapping and ->index of its original, so rmap (peers
+ * included) and the zapping of a mapping find it like the original.
+ */
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/pagevec.h>
+#include <linux/rmap.h>
+#include <linux/radix-tree.h>
+#include <linux/slab.h>
+#include <linux/sysctl.h>
+#include <linux/module.h>
+#include <linux/page_replica.h>
+
+int sysctl_pagecache_replication __read_mostly;
+
+/* protects all the replica trees and the list */
+static DEFINE_SPINLOCK(page_replica_lock);
+static LIST_HEAD(page_replica_lru);
+static unsigned long nr_page_replicas;
+
+/* GFP_THISNODE fails rather than reclaim, replicas only use what is free */
+#define GFP_REPLICA	(GFP_HIGHUSER | GFP_THISNODE)
+
+static struct page_replica *page_replica_get(struct address_space *mapping)
+{
+	struct page_replica *rep = mapping->replica;
+	int nid;
+
+	if (likely(rep))
+		return rep;
+
+	rep = kmalloc(sizeof(struct page_replica) +
+		      nr_node_ids * sizeof(struct radix_tree_root), GFP_KERNEL);
+	if (!rep)
+		return NULL;
+
+	rep->nr_pages = 0;
+	for (nid = 0; nid < nr_node_ids; nid++)
+		INIT_RADIX_TREE(&rep->tree[nid], GFP_ATOMIC);
+
+	/*
+	 * Freed only together with the inode, see page_replica_free(). The
+	 * cmpxchg() is a full barrier against page_replica_collapse().
+	 */
+	if (cmpxchg(&mapping->replica, NULL, rep)) {
+		kfree(rep);
+		rep = mapping->replica;
+	}
+	return rep;
+}
+
+static struct page *page_replica_lookup(struct page_replica *rep, int nid,
+					pgoff_t index)
+{
+	struct page *page;
+
+	rcu_read_lock();
+repeat:
+	page = radix_tree_lookup(&rep->tree[nid], index);
+	if (page) {
+		if (!page_cache_get_speculative(page))
+			goto repeat;
+		if (unlikely(page != radix_tree_lookup(&rep->tree[nid],
+						       index))) {
+			page_cache_release(page);
+			goto repeat;
+		}
+	}
+	rcu_read_unlock();
+
+	return page;
+}
+
+static struct page *page_replica_create(struct address_space *mapping,
+					struct page *page, int nid)
+{
+	struct inode *inode = mapping->host;
+	struct page_replica *rep;
+	struct page *new;
+	int err;
+
+	rep = page_replica_get(mapping);
+	if (!rep)
+		return NULL;
+
+	new = alloc_pages_exact_node(nid, GFP_REPLICA, 0);
+	if (!new)
+		return NULL;
+
+	if (radix_tree_preload(GFP_KERNEL)) {
+		page_cache_release(new);
+		return NULL;
+	}
+
+	copy_highpage(new, page);
+	__set_page_locked(new);
+	__SetPageUptodate(new);
+	new->mapping = mapping;
+	new->index = page->index;
+
+	/*
+	 * Either page_replica_collapse() after get_write_access() takes the
+	 * lock later and finds this replica, or i_writecount is seen here.
+	 */
+	spin_lock(&page_replica_lock);
+	err = -ETXTBSY;
+	if (atomic_read(&inode->i_writecount) <= 0)
+		err = radix_tree_insert(&rep->tree[nid], page->index, new);
+	if (!err) {
+		page_cache_get(new);
+		list_add(&new->lru, &page_replica_lru);
+		rep->nr_pages++;
+		nr_page_replicas++;
+	}
+	spin_unlock(&page_replica_lock);
+	radix_tree_preload_end();
+
+	if (err) {
+		new->mapping = NULL;
+		__clear_page_locked(new);
+		page_cache_release(new);
+		return NULL;
+	}
+
+	count_vm_event(PGREPLICATE);
+	return new;
+}
+
+struct page *__page_replica_fault(struct vm_area_struct *vma,
+				  struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	struct page_replica *rep;
+	struct page *new;
+	int nid = numa_node_id();
+
+	if (page_to_nid(page) == nid || PageAnon(page) || !mapping ||
+	    PageSwapBacked(page) || !PageUptodate(page) || PageDirty(page) ||
+	    !page_mapped(page) ||
+	    atomic_read(&mapping->host->i_writecount) > 0)
+		return page;
+
+	rep = mapping->replica;
+	new = rep ? page_replica_lookup(rep, nid, page->index) : NULL;
+	if (new) {
+		/* somebody is dropping it, do not wait for that */
+		if (!trylock_page(new))
+			goto put;
+		if (unlikely(new->mapping != mapping)) {
+			unlock_page(new);
+			goto put;
+		}
+	} else {
+		new = page_replica_create(mapping, page, nid);
+		if (!new)
+			return page;
+	}
+
+	unlock_page(page);
+	page_cache_release(page);
+	return new;
+
+put:
+	page_cache_release(new);
+	return page;
+}
+
+/* Takes the replica off the ptes and frees it, the tree ref is passed */
+static void page_replica_drop(struct page *page)
+{
+	int tries = 2;
+
+	lock_page(page);
+	while (page_mapped(page) && tries--)
+		try_to_unmap(page, TTU_UNMAP | TTU_IGNORE_MLOCK |
+				   TTU_IGNORE_ACCESS);
+	WARN_ON_ONCE(page_mapped(page));
+	page->mapping = NULL;
+	unlock_page(page);
+	page_cache_release(page);
+	count_vm_event(PGREPLICATE_DROP);
+}
+
+/* under page_replica_lock */
+static void page_replica_unlink(struct page *page, struct list_head *list)
+{
+	struct page_replica *rep = page->mapping->replica;
+
+	radix_tree_delete(&rep->tree[page_to_nid(page)], page->index);
+	list_move(&page->lru, list);
+	rep->nr_pages--;
+	nr_page_replicas--;
+}
+
+/*
+ * The caller keeps the inode and makes sure that no replicas are made on
+ * top of the contents that are going to change: either i_writecount is up
+ * already or this is a truncate or an invalidate which unmaps the file.
+ */
+void __page_replica_collapse(struct address_space *mapping)
+{
+	struct page_replica *rep = mapping->replica;
+	struct page *pages[PAGEVEC_SIZE];
+	struct page *page, *tmp;
+	LIST_HEAD(list);
+	int nid, i, nr;
+
+	spin_lock(&page_replica_lock);
+	for (nid = 0; nid < nr_node_ids && rep->nr_pages; nid++) {
+		while ((nr = radix_tree_gang_lookup(&rep->tree[nid],
+					(void **)pages, 0, PAGEVEC_SIZE)))
+			for (i = 0; i < nr; i++)
+				page_replica_unlink(pages[i], &list);
+	}
+	spin_unlock(&page_replica_lock);
+
+	list_for_each_entry_safe(page, tmp, &list, lru) {
+		list_del(&page->lru);
+		page_replica_drop(page);
+	}
+}
+
+/*
+ * The original at @index is locked and already out of the page cache, so
+ * no more copies of it can be made and any found here are of it: a copy
+ * is only made from a locked page cache page.
+ */
+void __page_replica_invalidate(struct address_space *mapping, pgoff_t index)
+{
+	struct page_replica *rep = mapping->replica;
+	struct page *page, *tmp;
+	LIST_HEAD(list);
+	int nid;
+
+	spin_lock(&page_replica_lock);
+	for (nid = 0; nid < nr_node_ids && rep->nr_pages; nid++) {
+		page = radix_tree_lookup(&rep->tree[nid], index);
+		if (page)
+			page_replica_unlink(page, &list);
+	}
+	spin_unlock(&page_replica_lock);
+
+	list_for_each_entry_safe(page, tmp, &list, lru) {
+		list_del(&page->lru);
+		page_replica_drop(page);
+	}
+}
+
+/* From __destroy_inode(), nobody can fault the file in any more */
+void page_replica_free(struct address_space *mapping)
+{
+	struct page_replica *rep = mapping->replica;
+
+	if (!rep)
+		return;
+
+	if (rep->nr_pages)
+		__page_replica_collapse(mapping);
+	mapping->replica = NULL;
+	kfree(rep);
+}
+
+/*
+ * Drops up to nr of the oldest replicas. A replica is only unlinked here
+ * while its inode can be pinned, the rest are left to the collapse on
+ * the inode eviction.
+ */
+static unsigned long page_replica_scan(unsigned long nr)
+{
+	struct page *page, *tmp;
+	struct inode *inode;
+	LIST_HEAD(list);
+	LIST_HEAD(busy);
+	unsigned long dropped = 0;
+
+	spin_lock(&page_replica_lock);
+	while (nr-- && !list_empty(&page_replica_lru)) {
+		page = list_entry(page_replica_lru.prev, struct page, lru);
+		if (!igrab(page->mapping->host)) {
+			list_move(&page->lru, &busy);
+			continue;
+		}
+		page_replica_unlink(page, &list);
+	}
+	list_splice(&busy, &page_replica_lru);
+	spin_unlock(&page_replica_lock);
+
+	list_for_each_entry_safe(page, tmp, &list, lru) {
+		list_del(&page->lru);
+		inode = page->mapping->host;
+		page_replica_drop(page);
+		iput(inode);
+		dropped++;
+	}
+
+	return dropped;
+}
+
+static int page_replica_shrink(struct shrinker *shrink, int nr_to_scan,
+			       gfp_t gfp_mask)
+{
+	if (nr_to_scan) {
+		/* the final iput() may have to evict the inode */
+		if (!(gfp_mask & __GFP_FS))
+			return -1;
+		page_replica_scan(nr_to_scan);
+	}
+
+	return min(nr_page_replicas, (unsigned long)INT_MAX);
+}
+
+static struct shrinker page_replica_shrinker = {
+	.shrink	= page_replica_shrink,
+	/* a replica is only a copy away */
+	.seeks	= 1,
+};
+
+int pagecache_replication_sysctl_handler(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	int err;
+
+	err = proc_dointvec_minmax(table, write, buffer, lenp, ppos);
+	if (err || !write || sysctl_pagecache_replication)
+		return err;
+
+	/* switched off, faults make no more replicas */
+	while (nr_page_replicas && page_replica_scan(nr_page_replicas))
+		cond_resched();
+
+	return 0;
+}
+
+static int __init page_replica_init(void)
+{
+	register_shrinker(&page_replica_shrinker);
+	return 0;
+}
+module_init(page_replica_init);
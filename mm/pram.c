@@ -9,6 +9,7 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/kobject.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/memcontrol.h>
 #include <linux/mm.h>
@@ -16,6 +17,7 @@
 #include <linux/mmgang.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/nodemask.h>
 #include <linux/page-flags.h>
 #include <linux/percpu.h>
 #include <linux/pfn.h>
@@ -24,6 +26,7 @@
 #include <linux/string.h>
 #include <linux/sysfs.h>
 #include <linux/types.h>
+#include <linux/vmalloc.h>
 #include <asm/cpufeature.h>
 
 #define PRAM_MAGIC		0x7072616D
@@ -51,6 +54,10 @@ struct pram_chain {
 
 	/* v2 fields */
 	__u32			csum_mode;
+
+	/* statistics of the save, zero if saved by an older kernel */
+	__u64			save_ns;	/* open to close */
+	__u64			csum_ns;
 };
 
 typedef __u32 (*csum_func_t)(const void *);
@@ -80,6 +87,47 @@ static const struct pram_csum_mode * const csum_mode_list[] = {
 
 static const struct pram_csum_mode *csum_mode;
 
+/* counters since boot, see /sys/kernel/pram_stats */
+struct pram_stats {
+	atomic64_t	streams_saved;
+	atomic64_t	streams_loaded;
+	atomic64_t	pages_pushed;
+	atomic64_t	pages_popped;
+	atomic64_t	pages_relocated;	/* pushed from banned regions */
+	atomic64_t	csum_errors;
+	atomic64_t	save_ns;
+	atomic64_t	save_csum_ns;
+	atomic64_t	load_ns;
+	atomic64_t	load_csum_ns;
+	atomic64_t	grow_pages;
+	atomic64_t	grow_ns;
+};
+static struct pram_stats pram_stats;
+
+static inline u64 pram_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/* if set, data pages are verified when popped instead of on load */
+static int pram_csum_lazy;
+
+/* links are checksummed by a thread per online cpu, each taking
+ * PRAM_CSUM_BATCH links at a time; small chains are done inline */
+#define PRAM_CSUM_BATCH		16
+
+typedef void (*link_func_t)(struct pram_chain *, struct pram_link *);
+
+struct pram_csum_struct {
+	struct pram_chain *chain;
+	link_func_t func;
+	unsigned long *links;
+	long nr_links;
+	atomic_long_t next;
+	atomic_t nr_running;
+	struct completion done;
+};
+
 #define PRAM_STATE_SAVE		1
 #define PRAM_STATE_LOAD		2
 
@@ -130,11 +178,25 @@ static unsigned long nr_banned_pages;
 static LIST_HEAD(banned_pages);
 static DEFINE_SPINLOCK(banned_pages_lock);
 
-/* pool of free pages available for pram;
+/* pools of free pages available for pram, one per node;
  * allocated by sysctl pram_prealloc */
-static unsigned long page_pool_size;
-static LIST_HEAD(page_pool);
-static DEFINE_SPINLOCK(page_pool_lock);
+struct pram_page_pool {
+	spinlock_t lock;
+	unsigned long size;
+	struct list_head pages;
+};
+static struct pram_page_pool page_pools[MAX_NUMNODES];
+static atomic_long_t page_pool_size;	/* sum over all the pools */
+
+/* the pool is grown by a thread per online cpu allocating on its node,
+ * each taking PRAM_GROW_CHUNK pages of the target at a time */
+#define PRAM_GROW_CHUNK		1024
+
+struct pram_grow_struct {
+	atomic_long_t left;
+	atomic_t nr_running;
+	struct completion done;
+};
 
 struct pram_prealloc_struct {
 	int nr_pages;
@@ -539,7 +601,15 @@ static int page_banned(struct page *page)
 	return 0;
 }
 
-static struct page *__pram_alloc_new_page(gfp_t gfpmask)
+static inline struct page *pram_alloc_node_page(int nid, gfp_t gfpmask)
+{
+	if (nid < 0)
+		return alloc_page(gfpmask);
+	return alloc_pages_node(nid, gfpmask | __GFP_THISNODE, 0);
+}
+
+/* nid < 0 means any node, according to the memory policy */
+static struct page *__pram_alloc_new_page(int nid, gfp_t gfpmask)
 {
 	struct page *page;
 	int page_list_len = 0;
@@ -551,11 +621,11 @@ static struct page *__pram_alloc_new_page(gfp_t gfpmask)
 	 * be freed later.
 	 */
 
-	page = alloc_page(gfpmask);
+	page = pram_alloc_node_page(nid, gfpmask);
 	while (page && page_banned(page)) {
 		page_list_len++;
 		list_add(&page->lru, &page_list);
-		page = alloc_page(gfpmask | __GFP_COLD);
+		page = pram_alloc_node_page(nid, gfpmask | __GFP_COLD);
 	}
 
 	if (page_list_len > 0) {
@@ -568,26 +638,95 @@ static struct page *__pram_alloc_new_page(gfp_t gfpmask)
 	return page;
 }
 
+static unsigned long __page_pool_take(struct pram_page_pool *pool,
+				      unsigned long nr, struct list_head *list)
+{
+	struct page *page;
+	unsigned long taken = 0;
+
+	if (!pool->size)
+		return 0;
+
+	spin_lock(&pool->lock);
+	if (nr >= pool->size) {
+		taken = pool->size;
+		list_splice_init(&pool->pages, list);
+	} else {
+		while (taken < nr) {
+			BUG_ON(list_empty(&pool->pages));
+			page = list_entry(pool->pages.next, struct page, lru);
+			list_move(&page->lru, list);
+			taken++;
+		}
+	}
+	pool->size -= taken;
+	spin_unlock(&pool->lock);
+
+	atomic_long_sub(taken, &page_pool_size);
+	return taken;
+}
+
+/* moves up to @nr pages from the pools to @list, from node @nid first */
+static unsigned long page_pool_take(int nid, unsigned long nr,
+				    struct list_head *list)
+{
+	unsigned long taken;
+	int n;
+
+	taken = __page_pool_take(&page_pools[nid], nr, list);
+	for_each_node_state(n, N_HIGH_MEMORY) {
+		if (taken >= nr || !atomic_long_read(&page_pool_size))
+			break;
+		if (n != nid)
+			taken += __page_pool_take(&page_pools[n],
+						  nr - taken, list);
+	}
+	return taken;
+}
+
+/* empties @list into the pools of nodes its pages belong to */
+static void page_pool_add(struct list_head *list)
+{
+	struct page *page, *tmp;
+	struct pram_page_pool *pool;
+	unsigned long nr;
+	int nid;
+
+	while (!list_empty(list)) {
+		nid = page_to_nid(list_entry(list->next, struct page, lru));
+		pool = &page_pools[nid];
+		nr = 0;
+
+		spin_lock(&pool->lock);
+		list_for_each_entry_safe(page, tmp, list, lru) {
+			if (page_to_nid(page) != nid)
+				continue;
+			list_move(&page->lru, &pool->pages);
+			nr++;
+		}
+		pool->size += nr;
+		spin_unlock(&pool->lock);
+
+		atomic_long_add(nr, &page_pool_size);
+	}
+}
+
 static struct page *__pram_alloc_page(gfp_t gfpmask)
 {
 	struct page *page = NULL;
+	LIST_HEAD(list);
 
-	if (page_pool_size) {
-		spin_lock(&page_pool_lock);
-		if (page_pool_size) {
-			BUG_ON(list_empty(&page_pool));
-			page = list_entry(page_pool.next, struct page, lru);
-			list_del_init(&page->lru);
-			page_pool_size--;
-		}
-		spin_unlock(&page_pool_lock);
+	if (atomic_long_read(&page_pool_size) &&
+	    page_pool_take(numa_node_id(), 1, &list)) {
+		page = list_entry(list.next, struct page, lru);
+		list_del_init(&page->lru);
 
-		if (page && (gfpmask & __GFP_ZERO))
+		if (gfpmask & __GFP_ZERO)
 			clear_highpage(page);
 	}
 
 	if (!page)
-		page = __pram_alloc_new_page(gfpmask);
+		page = __pram_alloc_new_page(-1, gfpmask);
 
 	return page;
 }
@@ -620,7 +759,7 @@ static struct page *pram_alloc_page(gfp_t gfpmask)
 
 static void __init pram_init_preallocs(void)
 {
-	int cpu;
+	int cpu, nid;
 	struct pram_prealloc_struct *p;
 
 	for_each_possible_cpu(cpu) {
@@ -628,6 +767,12 @@ static void __init pram_init_preallocs(void)
 		p->nr_pages = 0;
 		INIT_LIST_HEAD(&p->pages);
 	}
+
+	for (nid = 0; nid < MAX_NUMNODES; nid++) {
+		spin_lock_init(&page_pools[nid].lock);
+		page_pools[nid].size = 0;
+		INIT_LIST_HEAD(&page_pools[nid].pages);
+	}
 }
 
 static inline int pram_prealloc_size(size_t size)
@@ -678,8 +823,17 @@ int __pram_prealloc(gfp_t gfp_mask, int n, ...)
 
 	preempt_enable();
 
-	for (n = 0; n < nr_pages; n++) {
-		page = __pram_alloc_page(gfp_mask);
+	/* refill from the local pool at once, allocate the rest */
+	n = 0;
+	if (atomic_long_read(&page_pool_size)) {
+		n = page_pool_take(numa_node_id(), nr_pages, &pages);
+		if (gfp_mask & __GFP_ZERO)
+			list_for_each_entry(page, &pages, lru)
+				clear_highpage(page);
+	}
+
+	for (; n < nr_pages; n++) {
+		page = __pram_alloc_new_page(-1, gfp_mask);
 		if (!page)
 			break;
 		list_add(&page->lru, &pages);
@@ -812,6 +966,8 @@ static void pram_stream_init(struct pram_stream *stream,
 	stream->data_page = NULL;
 	stream->data_offset = 0;
 	stream->gfp_mask = gfp_mask;
+	stream->csum_lazy = 0;
+	stream->start_ns = pram_now();
 }
 
 static int pram_create(const char *name, gfp_t gfp_mask,
@@ -880,6 +1036,7 @@ static int __pram_push_page(struct pram_stream *stream, struct page *page)
 
 	link->page[offset].pfn = page_to_pfn(page);
 	offset++;
+	atomic64_inc(&pram_stats.pages_pushed);
 
 	stream->offset = offset;
 	SetPageDirty(virt_to_page(stream->chain));
@@ -924,6 +1081,7 @@ int pram_push_page(struct pram_stream *stream, struct page *page,
 			return -ENOMEM;
 		copy_highpage(new, page);
 		page = new;
+		atomic64_inc(&pram_stats.pages_relocated);
 	}
 
 	ret = __pram_push_page(stream, page);
@@ -1016,6 +1174,7 @@ static inline int pram_check_data_csum(struct pram_chain *chain,
 		csum = p->csum + 1;
 
 	if (p->csum != csum) {
+		atomic64_inc(&pram_stats.csum_errors);
 		if (printk_ratelimit())
 			printk(KERN_WARNING "PRAM: pfn:%lx corrupted\n",
 			       (unsigned long)p->pfn);
@@ -1025,37 +1184,141 @@ static inline int pram_check_data_csum(struct pram_chain *chain,
 	return 1;
 }
 
-static void pram_update_csum(struct pram_chain *chain)
+static void pram_csum_links(struct pram_csum_struct *cs)
 {
-	int i;
+	long i, end;
+
+	for (;;) {
+		i = atomic_long_add_return(PRAM_CSUM_BATCH, &cs->next) -
+			PRAM_CSUM_BATCH;
+		if (i >= cs->nr_links)
+			break;
+		end = min(i + PRAM_CSUM_BATCH, cs->nr_links);
+		for (; i < end; i++)
+			cs->func(cs->chain, pfn_to_kaddr(cs->links[i]));
+		cond_resched();
+	}
+}
+
+static int pram_csum_thread(void *data)
+{
+	struct pram_csum_struct *cs = data;
+
+	pram_csum_links(cs);
+	if (atomic_dec_and_test(&cs->nr_running))
+		complete(&cs->done);
+	return 0;
+}
+
+/*
+ * Calls @func for each link of @chain. Links are independent from each
+ * other, so if there are many, they are processed by several threads.
+ */
+static void pram_for_each_link(struct pram_chain *chain, link_func_t func)
+{
+	struct pram_csum_struct cs;
+	struct task_struct *tsk;
 	unsigned long link_pfn;
 	struct pram_link *link;
-	struct pram_page *p;
-	const struct pram_csum_mode *cur_csum_mode = pram_get_csum_mode();
+	long nr_links = 0;
+	int cpu, nr_threads;
 
-	chain->csum_mode = cur_csum_mode->id;
 	for (link_pfn = chain->link_pfn; link_pfn; link_pfn = link->link_pfn) {
 		link = pfn_to_kaddr(link_pfn);
-		for (i = 0; i < PRAM_LINK_CAPACITY; i++) {
-			p = &link->page[i];
-			if (!p->pfn)
-				break;
-			pram_csum_data(p, cur_csum_mode->func);
+		nr_links++;
+	}
+
+	cs.links = NULL;
+	if (nr_links > 2 * PRAM_CSUM_BATCH && num_online_cpus() > 1)
+		cs.links = vmalloc(nr_links * sizeof(unsigned long));
+	if (!cs.links) {
+		for (link_pfn = chain->link_pfn; link_pfn;
+		     link_pfn = link->link_pfn) {
+			link = pfn_to_kaddr(link_pfn);
+			func(chain, link);
+			cond_resched();
 		}
-		link->magic = PRAM_MAGIC_V2;
-		link->csum = pram_meta_csum(link);
+		return;
+	}
+
+	nr_links = 0;
+	for (link_pfn = chain->link_pfn; link_pfn; link_pfn = link->link_pfn) {
+		link = pfn_to_kaddr(link_pfn);
+		cs.links[nr_links++] = link_pfn;
+	}
+
+	cs.chain = chain;
+	cs.func = func;
+	cs.nr_links = nr_links;
+	atomic_long_set(&cs.next, 0);
+	atomic_set(&cs.nr_running, 1);
+	init_completion(&cs.done);
+
+	/* the caller is one of the workers */
+	nr_threads = DIV_ROUND_UP(nr_links, PRAM_CSUM_BATCH) - 1;
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		if (cpu == raw_smp_processor_id())
+			continue;
+		if (nr_threads-- <= 0)
+			break;
+		tsk = kthread_create(pram_csum_thread, &cs, "pram_csum/%d", cpu);
+		if (IS_ERR(tsk))
+			break;
+		kthread_bind(tsk, cpu);
+		atomic_inc(&cs.nr_running);
+		wake_up_process(tsk);
+	}
+	put_online_cpus();
+
+	pram_csum_links(&cs);
+	if (!atomic_dec_and_test(&cs.nr_running))
+		wait_for_completion(&cs.done);
+
+	vfree(cs.links);
+}
+
+static void pram_update_link_csum(struct pram_chain *chain,
+				  struct pram_link *link)
+{
+	const struct pram_csum_mode *m = csum_mode_list[chain->csum_mode];
+	struct pram_page *p;
+	int i;
+
+	for (i = 0; i < PRAM_LINK_CAPACITY; i++) {
+		p = &link->page[i];
+		if (!p->pfn)
+			break;
+		pram_csum_data(p, m->func);
 	}
+	link->magic = PRAM_MAGIC_V2;
+	link->csum = pram_meta_csum(link);
+}
+
+static void pram_update_csum(struct pram_chain *chain)
+{
+	chain->csum_mode = pram_get_csum_mode()->id;
+	pram_for_each_link(chain, pram_update_link_csum);
 }
 
 static void pram_save(struct pram_stream *stream)
 {
 	struct pram_chain *chain = stream->chain;
+	u64 start, csum_ns;
 
 	chain->last_link_sz = stream->offset;
 	chain->last_page_sz =
 		stream->data_page ? stream->data_offset : PAGE_SIZE;
 
+	start = pram_now();
 	pram_update_csum(chain);
+	csum_ns = pram_now() - start;
+
+	chain->save_ns = pram_now() - stream->start_ns;
+	chain->csum_ns = csum_ns;
+	atomic64_inc(&pram_stats.streams_saved);
+	atomic64_add(chain->save_ns, &pram_stats.save_ns);
+	atomic64_add(csum_ns, &pram_stats.save_csum_ns);
 
 	mutex_lock(&pram_mutex);
 	chain->magic = PRAM_MAGIC_V2;
@@ -1076,36 +1339,51 @@ static void pram_discard(struct pram_stream *stream)
 	__pram_destroy(chain);
 }
 
-static void pram_prepare_data_load(struct pram_chain *chain)
+static void __pram_prepare_link_load(struct pram_chain *chain,
+				     struct pram_link *link, int verify)
 {
-	int i;
-	unsigned long link_pfn;
-	struct pram_link *link;
 	struct pram_page *p;
 	struct page *page;
+	int i;
 
-	for (link_pfn = chain->link_pfn; link_pfn; link_pfn = link->link_pfn) {
-		link = pfn_to_kaddr(link_pfn);
-		for (i = 0; i < PRAM_LINK_CAPACITY; i++) {
-			p = &link->page[i];
-			if (!p->pfn)
-				continue;
-			page = pfn_to_page(p->pfn);
-			if (!pram_check_data_csum(chain, p)) {
-				ClearPageReserved(page);
-				put_page(page);
-				p->pfn = 0;
-				continue;
-			}
-
-			VM_BUG_ON(page_mapped(page));
-			VM_BUG_ON(!PageAnon(page) && page->mapping);
-			page->mapping = (void *)chain + PAGE_MAPPING_ANON;
+	for (i = 0; i < PRAM_LINK_CAPACITY; i++) {
+		p = &link->page[i];
+		if (!p->pfn)
+			continue;
+		page = pfn_to_page(p->pfn);
+		if (verify && !pram_check_data_csum(chain, p)) {
+			ClearPageReserved(page);
+			put_page(page);
+			p->pfn = 0;
+			continue;
 		}
-		cond_resched();
+
+		VM_BUG_ON(page_mapped(page));
+		VM_BUG_ON(!PageAnon(page) && page->mapping);
+		page->mapping = (void *)chain + PAGE_MAPPING_ANON;
 	}
 }
 
+static void pram_prepare_link_load(struct pram_chain *chain,
+				   struct pram_link *link)
+{
+	__pram_prepare_link_load(chain, link, 1);
+}
+
+static void pram_prepare_link_load_lazy(struct pram_chain *chain,
+					struct pram_link *link)
+{
+	__pram_prepare_link_load(chain, link, 0);
+}
+
+static void pram_prepare_data_load(struct pram_chain *chain, int lazy)
+{
+	if (lazy || chain->csum_mode == PRAM_CSUM_NONE)
+		pram_for_each_link(chain, pram_prepare_link_load_lazy);
+	else
+		pram_for_each_link(chain, pram_prepare_link_load);
+}
+
 static int pram_load(const char *name, struct pram_stream *stream)
 {
 	struct pram_chain *chain;
@@ -1127,9 +1405,16 @@ unlock:
 	mutex_unlock(&pram_mutex);
 
 	if (!ret) {
+		int lazy = pram_csum_lazy;
+		u64 start = pram_now();
+
 		PRAM_SET_CHAIN_STATE(chain, PRAM_STATE_LOAD);
-		pram_prepare_data_load(chain);
+		pram_prepare_data_load(chain, lazy);
+		atomic64_add(pram_now() - start, &pram_stats.load_csum_ns);
+
 		pram_stream_init(stream, chain, 0);
+		stream->csum_lazy = lazy;
+		stream->start_ns = start;
 	}
 	return ret;
 }
@@ -1188,6 +1473,12 @@ next:
 		if (__pram_del_page(stream->chain, page))
 			/* already removed */
 			page = NULL;
+		else if (stream->csum_lazy &&
+			 !pram_check_data_csum(stream->chain, p)) {
+			put_page(page);
+			page = ERR_PTR(-EIO);
+		} else
+			atomic64_inc(&pram_stats.pages_popped);
 	} else
 		page = ERR_PTR(-EIO);
 
@@ -1308,6 +1599,9 @@ EXPORT_SYMBOL(pram_read);
 
 static void pram_release(struct pram_stream *stream)
 {
+	atomic64_inc(&pram_stats.streams_loaded);
+	atomic64_add(pram_now() - stream->start_ns, &pram_stats.load_ns);
+
 	if (stream->data_page)
 		put_page(stream->data_page);
 	__pram_destroy(stream->chain);
@@ -1627,27 +1921,105 @@ static ssize_t pram_banned_show(struct kobject *kboj,
 
 static struct kobj_attribute pram_banned_attr = __ATTR_RO(pram_banned);
 
+static long pram_grow_take(atomic_long_t *left)
+{
+	long old, chunk;
+
+	do {
+		old = atomic_long_read(left);
+		chunk = min(old, (long)PRAM_GROW_CHUNK);
+		if (chunk <= 0)
+			return 0;
+	} while (atomic_long_cmpxchg(left, old, old - chunk) != old);
+
+	return chunk;
+}
+
+static int pram_grow_thread(void *data)
+{
+	struct pram_grow_struct *g = data;
+	struct page *page;
+	LIST_HEAD(allocated);
+	long chunk, nr;
+	int nid = numa_node_id();
+
+	/* cpus of memoryless nodes allocate wherever they can */
+	if (!node_state(nid, N_HIGH_MEMORY))
+		nid = -1;
+
+	while ((chunk = pram_grow_take(&g->left)) > 0) {
+		for (nr = 0; nr < chunk; nr++) {
+			page = __pram_alloc_new_page(nid, GFP_KERNEL);
+			if (!page)
+				break;
+			list_add(&page->lru, &allocated);
+		}
+		page_pool_add(&allocated);
+
+		if (nr < chunk) {
+			/* the node is exhausted, leave the rest to others */
+			atomic_long_add(chunk - nr, &g->left);
+			break;
+		}
+		cond_resched();
+	}
+
+	if (atomic_dec_and_test(&g->nr_running))
+		complete(&g->done);
+	return 0;
+}
+
 static int page_pool_grow(unsigned long target_size)
 {
+	struct pram_grow_struct g;
+	struct task_struct *tsk;
 	struct page *page;
 	LIST_HEAD(allocated);
-	unsigned long nr_allocated = 0;
-	int err = 0;
+	long left, grown;
+	int cpu, nr_threads, err = 0;
+	u64 start = pram_now();
+
+	left = target_size - atomic_long_read(&page_pool_size);
+	if (left <= 0)
+		return 0;
+	grown = atomic_long_read(&page_pool_size);
+
+	atomic_long_set(&g.left, left);
+	atomic_set(&g.nr_running, 1);
+	init_completion(&g.done);
+
+	nr_threads = DIV_ROUND_UP(left, PRAM_GROW_CHUNK);
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		if (nr_threads-- <= 0)
+			break;
+		tsk = kthread_create(pram_grow_thread, &g, "pram_grow/%d", cpu);
+		if (IS_ERR(tsk))
+			break;
+		kthread_bind(tsk, cpu);
+		atomic_inc(&g.nr_running);
+		wake_up_process(tsk);
+	}
+	put_online_cpus();
+
+	if (!atomic_dec_and_test(&g.nr_running))
+		wait_for_completion(&g.done);
 
-	while (nr_allocated + page_pool_size < target_size) {
-		page = __pram_alloc_new_page(GFP_KERNEL);
+	/* what the threads failed to allocate on their nodes */
+	for (left = atomic_long_read(&g.left); left > 0; left--) {
+		page = __pram_alloc_new_page(-1, GFP_KERNEL);
 		if (!page) {
 			err = -ENOMEM;
 			break;
 		}
 		list_add(&page->lru, &allocated);
-		nr_allocated++;
 	}
+	page_pool_add(&allocated);
 
-	spin_lock(&page_pool_lock);
-	list_splice(&allocated, &page_pool);
-	page_pool_size += nr_allocated;
-	spin_unlock(&page_pool_lock);
+	grown = atomic_long_read(&page_pool_size) - grown;
+	if (grown > 0)
+		atomic64_add(grown, &pram_stats.grow_pages);
+	atomic64_add(pram_now() - start, &pram_stats.grow_ns);
 
 	return err;
 }
@@ -1656,17 +2028,15 @@ static void page_pool_shrink(unsigned long target_size)
 {
 	struct page *page, *tmp;
 	LIST_HEAD(throw_away);
+	long excess;
+	int nid;
 
-	spin_lock(&page_pool_lock);
-	if (page_pool_size <= target_size) {
-		spin_unlock(&page_pool_lock);
-		return;
-	}
-	list_for_each_entry(page, &page_pool, lru)
-		if (--page_pool_size <= target_size)
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		excess = atomic_long_read(&page_pool_size) - target_size;
+		if (excess <= 0)
 			break;
-	list_cut_position(&throw_away, &page_pool, &page->lru);
-	spin_unlock(&page_pool_lock);
+		__page_pool_take(&page_pools[nid], excess, &throw_away);
+	}
 
 	list_for_each_entry_safe(page, tmp, &throw_away, lru)
 		__free_page(page);
@@ -1675,7 +2045,7 @@ static void page_pool_shrink(unsigned long target_size)
 static ssize_t pram_prealloc_show(struct kobject *kobj,
 		struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", page_pool_size);
+	return sprintf(buf, "%lu\n", atomic_long_read(&page_pool_size));
 }
 
 static ssize_t pram_prealloc_store(struct kobject *kobj,
@@ -1689,9 +2059,9 @@ static ssize_t pram_prealloc_store(struct kobject *kobj,
 		return -EINVAL;
 
 	mutex_lock(&mutex);
-	if (page_pool_size > target_size)
+	if (atomic_long_read(&page_pool_size) > target_size)
 		page_pool_shrink(target_size);
-	else if (page_pool_size < target_size)
+	else if (atomic_long_read(&page_pool_size) < target_size)
 		err = page_pool_grow(target_size);
 	mutex_unlock(&mutex);
 
@@ -1740,12 +2110,141 @@ static ssize_t pram_csum_mode_store(struct kobject *kobj,
 static struct kobj_attribute pram_csum_mode_attr = __ATTR(pram_csum_mode,
 		0644, pram_csum_mode_show, pram_csum_mode_store);
 
+static ssize_t pram_csum_lazy_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", pram_csum_lazy);
+}
+
+static ssize_t pram_csum_lazy_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (strict_strtoul(buf, 10, &val))
+		return -EINVAL;
+	pram_csum_lazy = !!val;
+	return count;
+}
+
+static struct kobj_attribute pram_csum_lazy_attr = __ATTR(pram_csum_lazy,
+		0644, pram_csum_lazy_show, pram_csum_lazy_store);
+
+static ssize_t pram_stats_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	struct page *page;
+	int nr_chains = 0;
+
+	mutex_lock(&pram_mutex);
+	list_for_each_entry(page, &pram_list, lru)
+		nr_chains++;
+	mutex_unlock(&pram_mutex);
+
+#define PRAM_STAT(name) \
+	(unsigned long long)atomic64_read(&pram_stats.name)
+	return sprintf(buf,
+		"nr_chains %d\n"
+		"streams_saved %llu\n"
+		"streams_loaded %llu\n"
+		"pages_pushed %llu\n"
+		"pages_popped %llu\n"
+		"pages_relocated %llu\n"
+		"csum_errors %llu\n"
+		"save_ns %llu\n"
+		"save_csum_ns %llu\n"
+		"load_ns %llu\n"
+		"load_csum_ns %llu\n"
+		"grow_pages %llu\n"
+		"grow_ns %llu\n"
+		"banned_pages %lu\n"
+		"prealloc_pages %lu\n",
+		nr_chains,
+		PRAM_STAT(streams_saved),
+		PRAM_STAT(streams_loaded),
+		PRAM_STAT(pages_pushed),
+		PRAM_STAT(pages_popped),
+		PRAM_STAT(pages_relocated),
+		PRAM_STAT(csum_errors),
+		PRAM_STAT(save_ns),
+		PRAM_STAT(save_csum_ns),
+		PRAM_STAT(load_ns),
+		PRAM_STAT(load_csum_ns),
+		PRAM_STAT(grow_pages),
+		PRAM_STAT(grow_ns),
+		nr_banned_pages,
+		atomic_long_read(&page_pool_size));
+#undef PRAM_STAT
+}
+
+static struct kobj_attribute pram_stats_attr =
+	__ATTR(pram_stats, 0444, pram_stats_show, NULL);
+
+/* number of pages (data and link) held by a chain */
+static unsigned long pram_chain_nr_pages(struct pram_chain *chain)
+{
+	struct pram_link *link;
+	unsigned long link_pfn, nr_pages = 0;
+	int i;
+
+	for (link_pfn = chain->link_pfn; link_pfn; link_pfn = link->link_pfn) {
+		link = pfn_to_kaddr(link_pfn);
+		for (i = 0; i < PRAM_LINK_CAPACITY; i++)
+			if (link->page[i].pfn)
+				nr_pages++;
+		nr_pages++;
+	}
+	return nr_pages;
+}
+
+/* one line per chain: name state pages save_ns csum_ns;
+ * pages are not counted for chains being saved or loaded */
+static ssize_t pram_streams_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	struct page *page;
+	struct pram_chain *chain;
+	const char *state;
+	int len = 0;
+
+	mutex_lock(&pram_mutex);
+	list_for_each_entry(page, &pram_list, lru) {
+		chain = page_address(page);
+		switch (PRAM_CHAIN_STATE(chain)) {
+		case PRAM_STATE_SAVE:
+			state = "saving";
+			break;
+		case PRAM_STATE_LOAD:
+			state = "loading";
+			break;
+		default:
+			state = "saved";
+		}
+		/* links of busy chains change under us */
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%s %s %lu %llu %llu\n", chain->name, state,
+				 PRAM_CHAIN_BUSY(chain) ? 0 :
+				 pram_chain_nr_pages(chain),
+				 (unsigned long long)chain->save_ns,
+				 (unsigned long long)chain->csum_ns);
+	}
+	mutex_unlock(&pram_mutex);
+
+	return len;
+}
+
+static struct kobj_attribute pram_streams_attr =
+	__ATTR(pram_streams, 0444, pram_streams_show, NULL);
+
 static struct attribute *pram_attrs[] = {
 	&pram_attr.attr,
 	&pram_low_attr.attr,
 	&pram_banned_attr.attr,
 	&pram_prealloc_attr.attr,
 	&pram_csum_mode_attr.attr,
+	&pram_csum_lazy_attr.attr,
+	&pram_stats_attr.attr,
+	&pram_streams_attr.attr,
 	NULL,
 };
 
@@ -70,6 +70,7 @@ static struct vfsmount *shm_mnt;
 #include <linux/seq_file.h>
 #include <linux/magic.h>
 #include <linux/pram.h>
+#include <linux/ramfs.h>
 
 #include <bc/vmpages.h>
 #include <bc/kmem.h>
@@ -77,6 +78,8 @@ static struct vfsmount *shm_mnt;
 #include <asm/uaccess.h>
 #include <asm/pgtable.h>
 
+#include "internal.h"
+
 #define BLOCKS_PER_PAGE  (PAGE_CACHE_SIZE/512)
 #define VM_ACCT(size)    (PAGE_CACHE_ALIGN(size) >> PAGE_SHIFT)
 
@@ -1163,12 +1166,37 @@ static int shmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return ret;
 }
 
-int install_shmem_page(struct vm_area_struct *vma,
-		       unsigned long addr, struct page *page)
+/*
+ * A page on lru left from before a reboot without kexec still belongs to
+ * the beancounter it was charged to; move it to the one of the mapping.
+ */
+static int shmem_recharge_page(struct page *page, struct gang_set *gs)
+{
+	int err;
+
+	if (page_in_gang(page, gs))
+		return 0;
+
+	lru_add_drain();
+	if (isolate_lru_page(page))
+		/* not on lru, leave it where it is */
+		return 0;
+	err = gang_mod_user_page(page, gs, GFP_KERNEL);
+	putback_lru_page(page);
+	return err;
+}
+
+/**
+ * shmem_insert_page - add a page from pram to a shmem inode
+ * @inode: the inode
+ * @index: page offset in the file
+ * @page: the page, as popped from pram
+ *
+ * Charges the page to the beancounter of the inode and accounts it to the
+ * filesystem limits. The caller keeps its reference to the page.
+ */
+int shmem_insert_page(struct inode *inode, pgoff_t index, struct page *page)
 {
-	unsigned long index = (((addr & PAGE_MASK)
-			- vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
-	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
 	struct address_space *mapping = inode->i_mapping;
 	struct shmem_inode_info *info = SHMEM_I(inode);
 	struct shmem_sb_info *sbinfo = SHMEM_SB(inode->i_sb);
@@ -1186,6 +1214,10 @@ int install_shmem_page(struct vm_area_struct *vma,
 		if (err)
 			return err;
 		lru_cache_add_anon(page);
+	} else {
+		err = shmem_recharge_page(page, get_mapping_gang(mapping));
+		if (err)
+			return err;
 	}
 
 	err = shmem_acct_block(info);
@@ -1218,8 +1250,52 @@ int install_shmem_page(struct vm_area_struct *vma,
 
 	return 0;
 }
+
+int install_shmem_page(struct vm_area_struct *vma,
+		       unsigned long addr, struct page *page)
+{
+	unsigned long index = (((addr & PAGE_MASK)
+			- vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+
+	return shmem_insert_page(inode, index, page);
+}
 EXPORT_SYMBOL(install_shmem_page);
 
+/**
+ * shmem_read_swapped_pages - bring swapped out pages of an inode to memory
+ * @inode: the inode
+ *
+ * Used before handing the page cache of the inode over to pram, which only
+ * sees pages actually in the mapping.
+ */
+int shmem_read_swapped_pages(struct inode *inode)
+{
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	pgoff_t index, end;
+	struct page *page;
+	int error;
+
+	end = DIV_ROUND_UP(i_size_read(inode), PAGE_CACHE_SIZE);
+	for (index = 0; index < end && info->swapped; index++) {
+		page = find_get_page(inode->i_mapping, index);
+		if (!radix_tree_exceptional_entry(page)) {
+			if (page)
+				page_cache_release(page);
+			continue;
+		}
+		error = shmem_getpage(inode, index, &page, SGP_READ, NULL);
+		if (error)
+			return error;
+		if (page) {
+			unlock_page(page);
+			page_cache_release(page);
+		}
+		cond_resched();
+	}
+	return 0;
+}
+
 #ifdef CONFIG_NUMA
 static int shmem_set_policy(struct vm_area_struct *vma, struct mempolicy *mpol)
 {
@@ -2060,6 +2136,17 @@ static int shmem_parse_options(char *options, struct shmem_sb_info *sbinfo,
 		} else if (!strcmp(this_char,"mpol")) {
 			if (mpol_parse_str(value, &sbinfo->mpol, 1))
 				goto bad_val;
+#ifdef CONFIG_PRAMFS
+		} else if (!strcmp(this_char,"pram_name")) {
+			if (remount)
+				continue;
+			if (!*value || strlen(value) >= PRAM_FS_NAME_MAX)
+				goto bad_val;
+			kfree(sbinfo->pram_name);
+			sbinfo->pram_name = kstrdup(value, GFP_KERNEL);
+			if (!sbinfo->pram_name)
+				goto bad_val;
+#endif
 		} else {
 			printk(KERN_ERR "tmpfs: Bad mount option %s\n",
 			       this_char);
@@ -2135,6 +2222,10 @@ static int shmem_show_options(struct seq_file *seq, struct vfsmount *vfs)
 	if (sbinfo->gid != 0)
 		seq_printf(seq, ",gid=%u", sbinfo->gid);
 	shmem_show_mpol(seq, sbinfo->mpol);
+#ifdef CONFIG_PRAMFS
+	if (sbinfo->pram_name)
+		seq_printf(seq, ",pram_name=%s", sbinfo->pram_name);
+#endif
 	return 0;
 }
 #endif /* CONFIG_TMPFS */
@@ -2144,6 +2235,9 @@ static void shmem_put_super(struct super_block *sb)
 	struct shmem_sb_info *sbinfo = SHMEM_SB(sb);
 
 	percpu_counter_destroy(&sbinfo->used_blocks);
+#ifdef CONFIG_PRAMFS
+	kfree(sbinfo->pram_name);
+#endif
 	kfree(sbinfo);
 	sb->s_fs_info = NULL;
 }
@@ -2372,17 +2466,93 @@ int is_shmem_vma(struct vm_area_struct *vma)
 }
 EXPORT_SYMBOL(is_shmem_vma);
 
+#ifdef CONFIG_PRAMFS
+/*
+ * With pram_name=<name>, contents of the filesystem are saved to pram on
+ * umount and loaded back on the next mount with the same name in the same
+ * container, e.g. after a kexec. Files are recreated in the context of the
+ * mount, so their pages are charged to the beancounter of the container.
+ */
+static void shmem_pram_basename(struct shmem_sb_info *sbinfo,
+				char *buf, size_t size)
+{
+	snprintf(buf, size, "shmem.%u.%s.",
+		 sbinfo->pram_veid, sbinfo->pram_name);
+}
+
+static void shmem_pram_load(struct vfsmount *mnt)
+{
+	struct shmem_sb_info *sbinfo = SHMEM_SB(mnt->mnt_sb);
+	char *buf;
+	int err = -ENOMEM;
+
+	sbinfo->pram_veid = VEID(get_exec_env());
+
+	buf = (char *)__get_free_page(GFP_TEMPORARY);
+	if (buf) {
+		shmem_pram_basename(sbinfo, buf, PAGE_SIZE);
+		err = pram_fs_load_tree(mnt, buf);
+		free_page((unsigned long)buf);
+	}
+	if (!err)
+		printk(KERN_INFO "tmpfs (pram_name=%s): loaded\n",
+		       sbinfo->pram_name);
+	else if (err != -ENOENT)
+		printk(KERN_ERR "tmpfs (pram_name=%s): "
+		       "failed to load contents: %d\n",
+		       sbinfo->pram_name, err);
+	/* the filesystem is usable anyway */
+	sbinfo->pram_save = 1;
+}
+
+static void shmem_pram_save(struct super_block *sb)
+{
+	struct shmem_sb_info *sbinfo = SHMEM_SB(sb);
+	char *buf;
+	int err = -ENOMEM;
+
+	buf = (char *)__get_free_page(GFP_TEMPORARY);
+	if (buf) {
+		shmem_pram_basename(sbinfo, buf, PAGE_SIZE);
+		err = pram_fs_save_tree(sb->s_root, buf);
+		free_page((unsigned long)buf);
+	}
+	if (err)
+		printk(KERN_ERR "tmpfs (pram_name=%s): "
+		       "failed to save contents: %d\n",
+		       sbinfo->pram_name, err);
+}
+#endif
+
 static int shmem_get_sb(struct file_system_type *fs_type,
 	int flags, const char *dev_name, void *data, struct vfsmount *mnt)
 {
-	return get_sb_nodev(fs_type, flags, data, shmem_fill_super, mnt);
+	int err;
+
+	err = get_sb_nodev(fs_type, flags, data, shmem_fill_super, mnt);
+#ifdef CONFIG_PRAMFS
+	if (!err && SHMEM_SB(mnt->mnt_sb)->pram_name)
+		shmem_pram_load(mnt);
+#endif
+	return err;
+}
+
+static void shmem_kill_sb(struct super_block *sb)
+{
+#ifdef CONFIG_PRAMFS
+	struct shmem_sb_info *sbinfo = SHMEM_SB(sb);
+
+	if (sbinfo && sbinfo->pram_save)
+		shmem_pram_save(sb);
+#endif
+	kill_litter_super(sb);
 }
 
 struct file_system_type shmem_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "tmpfs",
 	.get_sb		= shmem_get_sb,
-	.kill_sb	= kill_litter_super,
+	.kill_sb	= shmem_kill_sb,
 };
 EXPORT_SYMBOL(shmem_fs_type);
 
@@ -2559,8 +2729,7 @@ int shmem_zero_setup(struct vm_area_struct *vma)
 	if (vma->vm_file)
 		fput(vma->vm_file);
 	else if (vma->vm_flags & VM_WRITE)
-               uncharge_beancounter_fast(mm_ub_top(vma->vm_mm), UB_PRIVVMPAGES,
-                               size >> PAGE_SHIFT);
+               ub_privvm_uncharge(vma->vm_mm, size >> PAGE_SHIFT);
 
 	vma->vm_file = file;
 	vma->vm_ops = &shmem_vm_ops;
@@ -167,14 +167,14 @@
 			 SLAB_STORE_USER | \
 			 SLAB_RECLAIM_ACCOUNT | SLAB_PANIC | \
 			 SLAB_DESTROY_BY_RCU | SLAB_MEM_SPREAD | \
-			 SLAB_UBC | SLAB_NO_CHARGE | \
+			 SLAB_UBC | SLAB_NO_CHARGE | SLAB_UB_PAGES | \
 			 SLAB_DEBUG_OBJECTS | SLAB_NOLEAKTRACE | SLAB_NOTRACK)
 #else
 # define CREATE_MASK	(SLAB_HWCACHE_ALIGN | \
 			 SLAB_CACHE_DMA | \
 			 SLAB_RECLAIM_ACCOUNT | SLAB_PANIC | \
 			 SLAB_DESTROY_BY_RCU | SLAB_MEM_SPREAD | \
-			 SLAB_UBC | SLAB_NO_CHARGE | \
+			 SLAB_UBC | SLAB_NO_CHARGE | SLAB_UB_PAGES | \
 			 SLAB_DEBUG_OBJECTS | SLAB_NOLEAKTRACE | SLAB_NOTRACK)
 #endif
 
@@ -806,16 +806,245 @@ struct user_beancounter **ub_slab_ptr(struct kmem_cache *cachep, void *obj)
 
 struct user_beancounter *slab_ub(void *obj)
 {
-	return *ub_slab_ptr(virt_to_cache(obj), obj);
+	struct kmem_cache *cachep = virt_to_cache(obj);
+
+	if (cachep->ub != NULL)
+		return cachep->ub;
+	return *ub_slab_ptr(cachep, obj);
 }
 
 EXPORT_SYMBOL(slab_ub);
 
+/*
+ * Per-beancounter caches. Objects of a SLAB_UB_PAGES cache allocated in
+ * a container come from a child cache of its top beancounter, thus each
+ * slab page of the child holds objects of one container only and is
+ * charged to its kmemsize as a whole. Objects are not charged one by one
+ * and a stopped container does not pin pages shared with the others.
+ *
+ * A child is created by keventd on the first allocation of the container,
+ * until then objects come from the parent and are charged as usual. It is
+ * destroyed with the beancounter, each slab page holds a reference to it.
+ */
+static DEFINE_MUTEX(ub_slab_mutex);
+static struct kmem_cache *ub_slab_parents[UB_SLAB_CACHES];
+
+#define set_cache_ub_align(cachep, a)	((cachep)->ub_align = (a))
+
+struct ub_slab_work {
+	struct work_struct	work;
+	struct kmem_cache	*parent;
+	int			idx;
+	struct user_beancounter	*ub;
+};
+
+static struct kmem_cache *ub_slab_cache_create(struct kmem_cache *parent,
+		struct user_beancounter *ub)
+{
+	struct kmem_cache *cachep;
+	char *name;
+
+	name = kasprintf(GFP_KERNEL, "%s(%u)", parent->name, ub->ub_uid);
+	if (name == NULL)
+		return NULL;
+
+	cachep = kmem_cache_create(name, obj_size(parent), parent->ub_align,
+			parent->flags & CREATE_MASK & ~(SLAB_UBC | SLAB_NO_CHARGE |
+				SLAB_UB_PAGES | SLAB_PANIC), parent->ctor);
+	if (cachep == NULL) {
+		kfree(name);
+		return NULL;
+	}
+
+	/* not visible to allocations yet */
+	cachep->ub = ub;
+	list_add(&cachep->ub_list, &parent->ub_list);
+	return cachep;
+}
+
+static void ub_slab_cache_destroy(struct kmem_cache *cachep)
+{
+	const char *name = cachep->name;
+
+	list_del(&cachep->ub_list);
+	if (kmem_cache_shrink(cachep)) {
+		printk(KERN_ERR "UB: cache %s is busy, leaking it\n", name);
+		return;
+	}
+	kmem_cache_destroy(cachep);
+	kfree(name);
+}
+
+static void ub_slab_cache_work(struct work_struct *work)
+{
+	struct ub_slab_work *w = container_of(work, struct ub_slab_work, work);
+	struct user_beancounter *ub = w->ub;
+	struct kmem_cache *cachep;
+
+	mutex_lock(&ub_slab_mutex);
+	/* the parent may be gone */
+	if (ub_slab_parents[w->idx] == w->parent &&
+	    ub->ub_slab_caches[w->idx] == NULL) {
+		cachep = ub_slab_cache_create(w->parent, ub);
+		if (cachep != NULL) {
+			smp_wmb();
+			ub->ub_slab_caches[w->idx] = cachep;
+		}
+	}
+	clear_bit(w->idx, &ub->ub_slab_pending);
+	mutex_unlock(&ub_slab_mutex);
+
+	put_beancounter(ub);
+	kfree(w);
+}
+
+static struct kmem_cache *__ub_slab_cache(struct kmem_cache *parent)
+{
+	struct user_beancounter *ub;
+	struct kmem_cache *cachep;
+	struct ub_slab_work *w;
+	int idx = parent->ub_slab_idx;
+
+	ub = get_exec_ub_top();
+	if (ub == get_ub0())
+		return parent;
+
+	cachep = ACCESS_ONCE(ub->ub_slab_caches[idx]);
+	if (likely(cachep != NULL)) {
+		smp_read_barrier_depends();
+		return cachep;
+	}
+
+	if (test_and_set_bit(idx, &ub->ub_slab_pending))
+		return parent;
+
+	w = kmalloc(sizeof(*w), GFP_ATOMIC | __GFP_NOWARN);
+	if (w == NULL) {
+		clear_bit(idx, &ub->ub_slab_pending);
+		return parent;
+	}
+
+	INIT_WORK(&w->work, ub_slab_cache_work);
+	w->parent = parent;
+	w->idx = idx;
+	w->ub = get_beancounter(ub);
+	schedule_work(&w->work);
+	return parent;
+}
+
+static inline struct kmem_cache *ub_slab_cache(struct kmem_cache *cachep)
+{
+	if (likely(!(cachep->flags & SLAB_UB_PAGES)))
+		return cachep;
+	return __ub_slab_cache(cachep);
+}
+
+/* the object may come from a child of the cache it is freed to */
+static inline struct kmem_cache *ub_slab_obj_cache(struct kmem_cache *cachep,
+		void *objp)
+{
+	if (likely(!(cachep->flags & SLAB_UB_PAGES)))
+		return cachep;
+	return virt_to_cache(objp);
+}
+
+static inline int ub_slab_page_charge(struct kmem_cache *cachep,
+		struct page *page, gfp_t flags)
+{
+	if (likely(cachep->ub == NULL))
+		return 0;
+	return ub_page_charge(page, cachep->gfporder, cachep->ub, flags);
+}
+
+/*
+ * Drops the reference of the page to the owner, the child is destroyed
+ * after a sched rcu period in ubcleand, thus the callers of slab_destroy()
+ * may go on with the cache.
+ */
+static inline void ub_slab_page_uncharge(struct kmem_cache *cachep,
+		struct page *page)
+{
+	ub_page_uncharge(page, cachep->gfporder);
+}
+
+static void ub_slab_register(struct kmem_cache *cachep)
+{
+	int idx;
+
+	mutex_lock(&ub_slab_mutex);
+	for (idx = 0; idx < UB_SLAB_CACHES; idx++)
+		if (ub_slab_parents[idx] == NULL)
+			break;
+
+	if (idx < UB_SLAB_CACHES) {
+		INIT_LIST_HEAD(&cachep->ub_list);
+		cachep->ub_slab_idx = idx;
+		ub_slab_parents[idx] = cachep;
+	} else {
+		printk(KERN_WARNING "UB: no room for %s children\n",
+				cachep->name);
+		cachep->flags &= ~SLAB_UB_PAGES;
+	}
+	mutex_unlock(&ub_slab_mutex);
+}
+
+/* the caller guarantees there are no allocations, like for the parent */
+static void ub_slab_unregister(struct kmem_cache *parent)
+{
+	struct kmem_cache *cachep, *tmp;
+	int idx = parent->ub_slab_idx;
+
+	mutex_lock(&ub_slab_mutex);
+	ub_slab_parents[idx] = NULL;
+	list_for_each_entry_safe(cachep, tmp, &parent->ub_list, ub_list) {
+		cachep->ub->ub_slab_caches[idx] = NULL;
+		ub_slab_cache_destroy(cachep);
+	}
+	mutex_unlock(&ub_slab_mutex);
+}
+
+/* Is called on stop of the container to return its free slab pages */
+void slab_shrink_ub(struct user_beancounter *ub)
+{
+	int idx;
+
+	mutex_lock(&ub_slab_mutex);
+	for (idx = 0; idx < UB_SLAB_CACHES; idx++)
+		if (ub->ub_slab_caches[idx] != NULL)
+			kmem_cache_shrink(ub->ub_slab_caches[idx]);
+	mutex_unlock(&ub_slab_mutex);
+}
+EXPORT_SYMBOL(slab_shrink_ub);
+
+/* Is called by ubcleand, no slab pages of the beancounter are left */
+void slab_destroy_ub(struct user_beancounter *ub)
+{
+	struct kmem_cache *cachep;
+	int idx;
+
+	mutex_lock(&ub_slab_mutex);
+	for (idx = 0; idx < UB_SLAB_CACHES; idx++) {
+		cachep = ub->ub_slab_caches[idx];
+		if (cachep == NULL)
+			continue;
+		ub->ub_slab_caches[idx] = NULL;
+		ub_slab_cache_destroy(cachep);
+	}
+	mutex_unlock(&ub_slab_mutex);
+}
+
 #else
 #define UB_ALIGN(flags)		1
 #define UB_EXTRA(flags)		0
 #define set_cache_objuse(c)	do { } while (0)
 #define init_slab_ubps(c, s)	do { } while (0)
+#define set_cache_ub_align(c, a)	do { } while (0)
+#define ub_slab_cache(c)		(c)
+#define ub_slab_obj_cache(c, o)		(c)
+#define ub_slab_page_charge(c, p, f)	(0)
+#define ub_slab_page_uncharge(c, p)	do { } while (0)
+#define ub_slab_register(c)		do { } while (0)
+#define ub_slab_unregister(c)		do { } while (0)
 #endif
 
 static size_t slab_mgmt_size_noalign(size_t nr_objs, int flags)
@@ -1818,6 +2047,11 @@ static void *kmem_getpages(struct kmem_cache *cachep, gfp_t flags, int nodeid)
 	if (!page)
 		return NULL;
 
+	if (ub_slab_page_charge(cachep, page, flags)) {
+		__free_pages(page, cachep->gfporder);
+		return NULL;
+	}
+
 	nr_pages = (1 << cachep->gfporder);
 	if (cachep->flags & SLAB_RECLAIM_ACCOUNT)
 		add_zone_page_state(page_zone(page),
@@ -1850,6 +2084,7 @@ static void kmem_freepages(struct kmem_cache *cachep, void *addr)
 	const unsigned long nr_freed = i;
 
 	kmemcheck_free_shadow(page, cachep->gfporder);
+	ub_slab_page_uncharge(cachep, page);
 
 	if (cachep->flags & SLAB_RECLAIM_ACCOUNT)
 		sub_zone_page_state(page_zone(page),
@@ -2531,6 +2766,7 @@ kmem_cache_create (const char *name, size_t size, size_t align,
 	}
 	cachep->ctor = ctor;
 	cachep->name = name;
+	set_cache_ub_align(cachep, align);
 
 	if (setup_cpu_cache(cachep, gfp)) {
 		__kmem_cache_destroy(cachep);
@@ -2551,6 +2787,9 @@ oops:
 		mutex_unlock(&cache_chain_mutex);
 		put_online_cpus();
 	}
+	/* children are created under ub_slab_mutex */
+	if (cachep && (cachep->flags & SLAB_UB_PAGES))
+		ub_slab_register(cachep);
 	return cachep;
 }
 EXPORT_SYMBOL(kmem_cache_create);
@@ -2732,6 +2971,9 @@ void kmem_cache_destroy(struct kmem_cache *cachep)
 {
 	BUG_ON(!cachep || in_interrupt());
 
+	if (cachep->flags & SLAB_UB_PAGES)
+		ub_slab_unregister(cachep);
+
 	/* Find the cache in the chain of caches. */
 	get_online_cpus();
 	mutex_lock(&cache_chain_mutex);
@@ -3521,6 +3763,7 @@ __cache_alloc_node(struct kmem_cache *cachep, gfp_t flags, int nodeid,
 	void *ptr;
 
 	flags &= gfp_allowed_mask;
+	cachep = ub_slab_cache(cachep);
 
 	lockdep_trace_alloc(flags);
 	WARN_ON((flags & __GFP_FS) && current->journal_info);
@@ -3608,6 +3851,7 @@ __cache_alloc(struct kmem_cache *cachep, gfp_t flags, void *caller)
 	void *objp;
 
 	flags &= gfp_allowed_mask;
+	cachep = ub_slab_cache(cachep);
 
 	lockdep_trace_alloc(flags);
 
@@ -3992,6 +4236,7 @@ void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 {
 	unsigned long flags;
 
+	cachep = ub_slab_obj_cache(cachep, objp);
 	local_irq_save(flags);
 	debug_check_no_locks_freed(objp, obj_size(cachep));
 	if (!(cachep->flags & SLAB_DEBUG_OBJECTS))
@@ -4618,6 +4863,30 @@ static int check_ubcs_on_cache(struct kmem_cache *c,
 	return sum;
 }
 
+/* Objects of a per-beancounter cache, all belong to its owner */
+static int check_objs_on_cache(struct kmem_cache *c)
+{
+	int node, sum = 0;
+	struct kmem_list3 *l3;
+	unsigned long flags;
+	struct slab *slab;
+
+	for_each_online_node(node) {
+		l3 = c->nodelists[node];
+		if (l3 == NULL)
+			continue;
+
+		spin_lock_irqsave(&l3->list_lock, flags);
+		list_for_each_entry(slab, &l3->slabs_full, list)
+			sum += slab->inuse;
+		list_for_each_entry(slab, &l3->slabs_partial, list)
+			sum += slab->inuse;
+		spin_unlock_irqrestore(&l3->list_lock, flags);
+	}
+
+	return sum;
+}
+
 void slab_walk_ub(struct user_beancounter *ub,
 		void (*show)(const char *name, int count, void *v), void *v)
 {
@@ -4629,6 +4898,9 @@ void slab_walk_ub(struct user_beancounter *ub,
 		if (c->flags & SLAB_UBC) {
 			cnt = check_ubcs_on_cache(c, ub);
 			show(c->name, cnt, v);
+		} else if (c->ub == ub) {
+			cnt = check_objs_on_cache(c);
+			show(c->name, cnt, v);
 		}
 	}
 	mutex_unlock(&cache_chain_mutex);
@@ -401,6 +401,16 @@ void kmem_mark_nocharge(struct kmem_cache *cachep)
 {
 	cachep->flags |= SLAB_NO_CHARGE;
 }
+
+/* SLAB_UB_PAGES is not supported, objects are charged one by one */
+void slab_shrink_ub(struct user_beancounter *ub)
+{
+}
+EXPORT_SYMBOL(slab_shrink_ub);
+
+void slab_destroy_ub(struct user_beancounter *ub)
+{
+}
 #else
 static inline void inc_cache_grown(struct kmem_cache *s)
 {
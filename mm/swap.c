@@ -339,11 +339,13 @@ void activate_page(struct page *page)
 		if (page->mapping && !PageAnon(page) && !page_mapped(page)) {
 			struct gang_set *gs = get_mapping_gang(page->mapping);
 
-			if (!page_in_gang(page, gs)) {
+			/* the page lock pins page->mapping for recharge */
+			if (!page_in_gang(page, gs) && trylock_page(page)) {
 				ClearPageLRU(page);
 				spin_unlock_irq(&lruvec->lru_lock);
 				gang_mod_user_page(page, gs,
 						GFP_ATOMIC|__GFP_NOFAIL);
+				unlock_page(page);
 				local_irq_disable();
 				lruvec = lock_page_lru(page);
 				SetPageLRU(page);
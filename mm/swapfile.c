@@ -235,13 +235,17 @@ static int wait_for_discard(void *word)
 #define LATENCY_LIMIT		256
 
 static inline unsigned long scan_swap_map(struct swap_info_struct *si,
-					  unsigned char usage)
+					  unsigned char usage,
+					  unsigned int *cluster_next,
+					  unsigned int *cluster_nr)
 {
 	unsigned long offset;
 	unsigned long scan_base;
 	unsigned long last_in_cluster = 0;
 	int latency_ration = LATENCY_LIMIT;
 	int found_free_cluster = 0;
+	/* clusters of containers must not overlap each other */
+	int aligned = (cluster_next != &si->cluster_next);
 
 	/*
 	 * We try to cluster swap pages by allocating them sequentially
@@ -252,14 +256,16 @@ static inline unsigned long scan_swap_map(struct swap_info_struct *si,
 	 * overall disk seek times between swap pages.  -- sct
 	 * But we do now try to find an empty cluster.  -Andrea
 	 * And we let swap pages go all over an SSD partition.  Hugh
+	 * Each container has a cursor of its own, its clusters are aligned,
+	 * so that what it swaps out together is written out sequentially.
 	 */
 
 	si->flags += SWP_SCANNING;
-	scan_base = offset = si->cluster_next;
+	scan_base = offset = *cluster_next;
 
-	if (unlikely(!si->cluster_nr--)) {
+	if (unlikely(!(*cluster_nr)--)) {
 		if (si->pages - si->inuse_pages < SWAPFILE_CLUSTER) {
-			si->cluster_nr = SWAPFILE_CLUSTER - 1;
+			*cluster_nr = SWAPFILE_CLUSTER - 1;
 			goto checks;
 		}
 		if (si->flags & SWP_PAGE_DISCARD) {
@@ -287,17 +293,22 @@ static inline unsigned long scan_swap_map(struct swap_info_struct *si,
 		 */
 		if (!(si->flags & SWP_SOLIDSTATE))
 			scan_base = offset = si->lowest_bit;
+		if (aligned)
+			offset = round_up(offset, SWAPFILE_CLUSTER);
 		last_in_cluster = offset + SWAPFILE_CLUSTER - 1;
 
 		/* Locate the first empty (unaligned) cluster */
 		for (; last_in_cluster <= si->highest_bit; offset++) {
-			if (si->swap_map[offset])
+			if (si->swap_map[offset]) {
+				if (aligned)
+					offset = round_up(offset + 1,
+						SWAPFILE_CLUSTER) - 1;
 				last_in_cluster = offset + SWAPFILE_CLUSTER;
-			else if (offset == last_in_cluster) {
+			} else if (offset == last_in_cluster) {
 				spin_lock(&swap_lock);
 				offset -= SWAPFILE_CLUSTER - 1;
-				si->cluster_next = offset;
-				si->cluster_nr = SWAPFILE_CLUSTER - 1;
+				*cluster_next = offset;
+				*cluster_nr = SWAPFILE_CLUSTER - 1;
 				found_free_cluster = 1;
 				goto checks;
 			}
@@ -308,17 +319,22 @@ static inline unsigned long scan_swap_map(struct swap_info_struct *si,
 		}
 
 		offset = si->lowest_bit;
+		if (aligned)
+			offset = round_up(offset, SWAPFILE_CLUSTER);
 		last_in_cluster = offset + SWAPFILE_CLUSTER - 1;
 
 		/* Locate the first empty (unaligned) cluster */
 		for (; last_in_cluster < scan_base; offset++) {
-			if (si->swap_map[offset])
+			if (si->swap_map[offset]) {
+				if (aligned)
+					offset = round_up(offset + 1,
+						SWAPFILE_CLUSTER) - 1;
 				last_in_cluster = offset + SWAPFILE_CLUSTER;
-			else if (offset == last_in_cluster) {
+			} else if (offset == last_in_cluster) {
 				spin_lock(&swap_lock);
 				offset -= SWAPFILE_CLUSTER - 1;
-				si->cluster_next = offset;
-				si->cluster_nr = SWAPFILE_CLUSTER - 1;
+				*cluster_next = offset;
+				*cluster_nr = SWAPFILE_CLUSTER - 1;
 				found_free_cluster = 1;
 				goto checks;
 			}
@@ -330,7 +346,7 @@ static inline unsigned long scan_swap_map(struct swap_info_struct *si,
 
 		offset = scan_base;
 		spin_lock(&swap_lock);
-		si->cluster_nr = SWAPFILE_CLUSTER - 1;
+		*cluster_nr = SWAPFILE_CLUSTER - 1;
 		si->lowest_alloc = 0;
 	}
 
@@ -370,7 +386,7 @@ checks:
 		spin_unlock(&swap_avail_lock);
 	}
 	si->swap_map[offset] = usage;
-	si->cluster_next = offset + 1;
+	*cluster_next = offset + 1;
 	si->flags -= SWP_SCANNING;
 
 	if (si->lowest_alloc) {
@@ -467,15 +483,136 @@ no_page:
 	return 0;
 }
 
+#ifdef CONFIG_BC_SWAP_ACCOUNTING
+
+/*
+ * Pages of a container are allocated from its own cursor in the area,
+ * the one of ub0 is the cursor of the area itself. Under swap_lock.
+ */
+static unsigned long ub_scan_swap_map(struct swap_info_struct *si,
+				      struct user_beancounter *ub)
+{
+	ub = top_beancounter(ub);
+	if (ub == get_ub0())
+		return scan_swap_map(si, SWAP_HAS_CACHE,
+				&si->cluster_next, &si->cluster_nr);
+
+	if (ub->ub_swap_cluster_type != si->type + 1) {
+		ub->ub_swap_cluster_type = si->type + 1;
+		ub->ub_swap_cluster_next = si->cluster_next;
+		ub->ub_swap_cluster_nr = 0;
+	}
+	return scan_swap_map(si, SWAP_HAS_CACHE,
+			&ub->ub_swap_cluster_next, &ub->ub_swap_cluster_nr);
+}
+
+/*
+ * A container may be given a swap area of its own, e.g. a partition of
+ * a dedicated disk, its pages go there while that has room and to the
+ * common areas by priority after that.
+ */
+static swp_entry_t ub_get_swap_page(struct user_beancounter *ub)
+{
+	struct swap_info_struct *si;
+	pgoff_t offset = 0;
+	int type;
+
+	type = ACCESS_ONCE(top_beancounter(ub)->ub_swap_prefer) - 1;
+	if (type < 0)
+		return (swp_entry_t) {0};
+
+	spin_lock(&swap_lock);
+	si = swap_info[type];
+	if ((si->flags & SWP_WRITEOK) && si->highest_bit)
+		offset = ub_scan_swap_map(si, ub);
+	if (offset)
+		ub_swapentry_get(si, offset, ub);
+	spin_unlock(&swap_lock);
+
+	return offset ? swp_entry(type, offset) : (swp_entry_t) {0};
+}
+
+/* Is called by swapoff, before the type of the area may be reused */
+static void ub_swap_forget(int type)
+{
+	struct user_beancounter *ub;
+
+	rcu_read_lock();
+	for_each_top_beancounter(ub) {
+		if (ub->ub_swap_prefer == type + 1)
+			ub->ub_swap_prefer = 0;
+		if (ub->ub_swap_cluster_type == type + 1)
+			ub->ub_swap_cluster_type = 0;
+	}
+	rcu_read_unlock();
+}
+
+/* An empty path drops the preferred area of the beancounter */
+int ub_swap_set_prefer(struct user_beancounter *ub, const char *path)
+{
+	struct swap_info_struct *p;
+	struct address_space *mapping;
+	struct file *file;
+	int err = -EINVAL;
+
+	if (!*path) {
+		ub->ub_swap_prefer = 0;
+		return 0;
+	}
+
+	file = filp_open(path, O_RDONLY|O_LARGEFILE, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	mapping = file->f_mapping;
+	spin_lock(&swap_lock);
+	plist_for_each_entry(p, &swap_active_head, list) {
+		if ((p->flags & SWP_WRITEOK) &&
+		    p->swap_file->f_mapping == mapping) {
+			ub->ub_swap_prefer = p->type + 1;
+			err = 0;
+			break;
+		}
+	}
+	spin_unlock(&swap_lock);
+
+	filp_close(file, NULL);
+	return err;
+}
+EXPORT_SYMBOL(ub_swap_set_prefer);
+
+#else
+
+static inline unsigned long ub_scan_swap_map(struct swap_info_struct *si,
+					     struct user_beancounter *ub)
+{
+	return scan_swap_map(si, SWAP_HAS_CACHE,
+			&si->cluster_next, &si->cluster_nr);
+}
+
+static inline swp_entry_t ub_get_swap_page(struct user_beancounter *ub)
+{
+	return (swp_entry_t) {0};
+}
+
+static inline void ub_swap_forget(int type) { }
+
+#endif
+
 swp_entry_t get_swap_page(struct user_beancounter *ub)
 {
 	struct swap_info_struct *si, *next;
+	swp_entry_t entry;
 	pgoff_t offset;
 
 	if (get_nr_swap_pages() <= 0)
 		goto noswap;
 	atomic_long_dec(&nr_swap_pages);
 
+	entry = ub_get_swap_page(ub);
+	if (entry.val)
+		return entry;
+
 	spin_lock(&swap_avail_lock);
 
 start_over:
@@ -503,7 +640,7 @@ start_over:
 		}
 
 		/* This is called for allocating swap entry for cache */
-		offset = scan_swap_map(si, SWAP_HAS_CACHE);
+		offset = ub_scan_swap_map(si, ub);
 		if (offset) { 
 			/* store swap entry owner */
 			ub_swapentry_get(si, offset, ub);
@@ -535,6 +672,7 @@ nextsi:
 noswap:
 	return (swp_entry_t) {0};
 }
+EXPORT_SYMBOL(get_swap_page);
 
 #ifdef CONFIG_BC_SWAP_ACCOUNTING
 
@@ -557,7 +695,8 @@ swp_entry_t get_swap_page_of_type(int type)
 	if (si && (si->flags & SWP_WRITEOK)) {
 		atomic_long_dec(&nr_swap_pages);
 		/* This is called for allocating swap entry, not cache */
-		offset = scan_swap_map(si, 1);
+		offset = scan_swap_map(si, 1, &si->cluster_next,
+				&si->cluster_nr);
 		if (offset) {
 			spin_unlock(&swap_lock);
 			return swp_entry(type, offset);
@@ -2326,6 +2465,7 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	swap_map = p->swap_map;
 	p->swap_map = NULL;
 	p->flags = 0;
+	ub_swap_forget(p->type);
 	spin_unlock(&swap_lock);
 	mutex_unlock(&swapon_mutex);
 	vfree(swap_map);
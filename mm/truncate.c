@@ -16,6 +16,7 @@
 #include <linux/highmem.h>
 #include <linux/pagevec.h>
 #include <linux/task_io_accounting_ops.h>
+#include <linux/page_replica.h>
 #include <linux/buffer_head.h>	/* grr. try_to_release_page,
 				   do_invalidatepage */
 #include "internal.h"
@@ -106,6 +107,7 @@ truncate_complete_page(struct address_space *mapping, struct page *page)
 
 	clear_page_mlock(page);
 	remove_from_page_cache(page);
+	page_replica_invalidate(mapping, page->index);
 	ClearPageMappedToDisk(page);
 	page_cache_release(page);	/* pagecache ref */
 	return 0;
@@ -211,6 +213,7 @@ void truncate_inode_pages_range(struct address_space *mapping,
 	pgoff_t end;
 	int i;
 
+	page_replica_collapse(mapping);
 	if (mapping->nrpages == 0)
 		return;
 
@@ -402,6 +405,7 @@ invalidate_complete_page2(struct address_space *mapping, struct page *page)
 	__remove_from_page_cache(page);
 	spin_unlock_irq(&mapping->tree_lock);
 	mem_cgroup_uncharge_cache_page(page);
+	page_replica_invalidate(mapping, page->index);
 
 	if (IS_AOP_EXT(inode)) {
 		freepage = EXT_AOPS(mapping->a_ops)->freepage;
@@ -446,6 +450,7 @@ int invalidate_inode_pages2_range(struct address_space *mapping,
 	int ret2 = 0;
 	int did_range_unmap = 0;
 
+	page_replica_collapse(mapping);
 	pagevec_init(&pvec, 0);
 	index = start;
 	while (index <= end && pagevec_lookup(&pvec, mapping, index,
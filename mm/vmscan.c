@@ -822,6 +822,16 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 				case SWAP_MLOCK:
 					goto cull_mlocked;
 				}
+				if (vswap_compress_page(page)) {
+					/* vswap ptes point to compressed copy */
+					sc->nr_reclaim_swapout++;
+					unlock_page(page);
+					if (put_page_testzero(page))
+						goto free_it;
+					gang_del_user_page(page);
+					nr_reclaimed++;
+					continue;
+				}
 			} else {
 				if (!(sc->gfp_mask & __GFP_IO))
 					goto keep_locked;
@@ -2818,7 +2828,16 @@ unsigned long try_to_free_gang_pages(struct gang_set *gs, gfp_t gfp_mask)
 	if (test_bit(UB_PAGECACHE_ISOLATION, &get_gangs_ub(gs)->ub_flags))
 		sc.may_shade_file = 0;
 
-	progress = do_try_to_free_pages(zonelist, &sc);
+	/* over its page cache limit the beancounter gives away cache first */
+	progress = 0;
+	if (ub_cache_over_limit(get_gangs_ub(gs))) {
+		sc.may_swap = 0;
+		progress = do_try_to_free_pages(zonelist, &sc);
+		sc.may_swap = 1;
+	}
+
+	if (!progress)
+		progress = do_try_to_free_pages(zonelist, &sc);
 
 	if (sc.nr_reclaim_swapout) {
 		ub_percpu_add(top_beancounter(get_gangs_ub(gs)),
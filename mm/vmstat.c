@@ -808,6 +808,9 @@ static const char * const vmstat_text[] = {
 #ifdef CONFIG_MEMORY_VSWAP
 	"nr_vswap",
 #endif
+#ifdef CONFIG_MEMORY_VSWAP_COMPRESS
+	"nr_vswap_pool",
+#endif
 #ifdef CONFIG_NUMA
 	"numa_hit",
 	"numa_miss",
@@ -887,6 +890,16 @@ static const char * const vmstat_text[] = {
 	"thp_collapse_alloc_failed",
 	"thp_split",
 #endif
+
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	"speculative_pgfault",
+	"speculative_pgfault_fallback",
+#endif
+
+#ifdef CONFIG_PAGECACHE_REPLICATION
+	"pgreplicate",
+	"pgreplicate_drop",
+#endif
 };
 
 #ifdef CONFIG_MEMORY_GANGS
@@ -0,0 +1,343 @@
+/*
+ *  mm/vswap_compress.c
+ *
+ *  Copyright (C) 2012  Parallels
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * Compressed tier of vswap. A page that got vswapped out of a container
+ * and is referenced only by its vswap ptes is LZO-compressed into a slot
+ * of the pool and the ptes are switched to zvswap entries pointing to the
+ * slot, then the page itself is freed. Pool pages are host memory, but
+ * each slot is charged to UB_SWAPPAGES of the container the page was
+ * taken from until the last zvswap pte is gone, like a page that went
+ * to vswap shadow. A container over its swap limit is not compressed.
+ *
+ * Slots come in classes of ZVSWAP_CLASS_SIZE steps and are carved out of
+ * whole lowmem pages, each pool page serves one class. The entry offset
+ * is the pfn of the pool page and the index of the slot in it. Each
+ * zvswap pte holds a reference to the slot, a fault decompresses it into
+ * a fresh page owned by the faulting mm.
+ */
+
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/rmap.h>
+#include <linux/ksm.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/lzo.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/init.h>
+#include <linux/mmgang.h>
+#include <asm/pgtable.h>
+
+#include <bc/beancounter.h>
+
+#define ZVSWAP_CLASS_SHIFT	7
+#define ZVSWAP_CLASS_SIZE	(1 << ZVSWAP_CLASS_SHIFT)
+/* a page compressed worse than that is not worth the trouble */
+#define ZVSWAP_NR_CLASSES	(PAGE_SIZE * 3 / 4 / ZVSWAP_CLASS_SIZE)
+#define ZVSWAP_MAX_SIZE		(ZVSWAP_NR_CLASSES * ZVSWAP_CLASS_SIZE)
+
+#define ZVSWAP_SLOT_BITS	(PAGE_SHIFT - ZVSWAP_CLASS_SHIFT)
+#define ZVSWAP_SLOT_MASK	((1UL << ZVSWAP_SLOT_BITS) - 1)
+
+#define ZVSWAP_GFP	(GFP_NOWAIT | __GFP_NOWARN | __GFP_NOMEMALLOC)
+
+int sysctl_vswap_compress;
+
+struct zvswap_slot {
+	atomic_t	refs;		/* zvswap ptes */
+	unsigned int	len;		/* of compressed data */
+	struct user_beancounter *ub;	/* UB_SWAPPAGES charged */
+	unsigned char	data[0];
+};
+
+/*
+ * Pool page: page->objects is the class, page->inuse is the number of
+ * busy slots, page->freelist links free ones. Pages with free slots are
+ * on the class partial list.
+ */
+struct zvswap_class {
+	spinlock_t		lock;
+	unsigned int		size;
+	unsigned int		objects;
+	struct list_head	partial;
+};
+
+static struct zvswap_class zvswap_classes[ZVSWAP_NR_CLASSES];
+
+struct zvswap_buf {
+	void		*wrkmem;
+	unsigned char	*dst;
+};
+
+static DEFINE_PER_CPU(struct zvswap_buf, zvswap_buf);
+static int zvswap_ready;
+
+static struct page *zvswap_new_page(struct zvswap_class *c)
+{
+	struct page *page;
+	void *addr, **slot;
+	unsigned int i;
+
+	page = alloc_page(ZVSWAP_GFP);
+	if (!page)
+		return NULL;
+
+	addr = page_address(page);
+	page->objects = c - zvswap_classes;
+	page->inuse = 0;
+	page->freelist = addr;
+	for (i = 0; i < c->objects; i++) {
+		slot = addr + i * c->size;
+		*slot = (i + 1 < c->objects) ? addr + (i + 1) * c->size : NULL;
+	}
+	inc_zone_page_state(page, NR_VSWAP_POOL);
+	return page;
+}
+
+static void zvswap_free_page(struct page *page)
+{
+	page->freelist = NULL;
+	reset_page_mapcount(page);
+	dec_zone_page_state(page, NR_VSWAP_POOL);
+	__free_page(page);
+}
+
+static struct zvswap_slot *zvswap_alloc(unsigned int size,
+					 unsigned long *handle)
+{
+	struct zvswap_class *c;
+	struct page *page;
+	void **slot;
+
+	c = zvswap_classes + (size - 1) / ZVSWAP_CLASS_SIZE;
+
+	spin_lock(&c->lock);
+	if (list_empty(&c->partial)) {
+		spin_unlock(&c->lock);
+		page = zvswap_new_page(c);
+		if (!page)
+			return NULL;
+		spin_lock(&c->lock);
+		list_add(&page->lru, &c->partial);
+	}
+	page = list_first_entry(&c->partial, struct page, lru);
+	slot = page->freelist;
+	page->freelist = *slot;
+	if (++page->inuse == c->objects)
+		list_del_init(&page->lru);
+	spin_unlock(&c->lock);
+
+	*handle = (page_to_pfn(page) << ZVSWAP_SLOT_BITS) |
+		  (((void *)slot - page_address(page)) / c->size);
+	return (struct zvswap_slot *)slot;
+}
+
+static void zvswap_free(struct page *page, struct zvswap_slot *slot)
+{
+	struct zvswap_class *c = zvswap_classes + page->objects;
+	int empty;
+
+	spin_lock(&c->lock);
+	*(void **)slot = page->freelist;
+	page->freelist = slot;
+	if (page->inuse-- == c->objects)
+		list_add(&page->lru, &c->partial);
+	empty = !page->inuse;
+	if (empty)
+		list_del(&page->lru);
+	spin_unlock(&c->lock);
+
+	if (empty)
+		zvswap_free_page(page);
+}
+
+static struct zvswap_slot *zvswap_entry_slot(swp_entry_t entry,
+					      struct page **zpage)
+{
+	unsigned long handle = swp_offset(entry);
+	struct page *page = pfn_to_page(handle >> ZVSWAP_SLOT_BITS);
+
+	*zpage = page;
+	return page_address(page) +
+		(handle & ZVSWAP_SLOT_MASK) * zvswap_classes[page->objects].size;
+}
+
+/* Caller must hold the pte lock of a zvswap pte or a reference of its own */
+void get_zvswap_entry(swp_entry_t entry)
+{
+	struct zvswap_slot *slot;
+	struct page *zpage;
+
+	slot = zvswap_entry_slot(entry, &zpage);
+	VM_BUG_ON(!atomic_read(&slot->refs));
+	atomic_inc(&slot->refs);
+}
+
+void put_zvswap_entry(swp_entry_t entry)
+{
+	struct zvswap_slot *slot;
+	struct page *zpage;
+
+	slot = zvswap_entry_slot(entry, &zpage);
+	if (atomic_dec_and_test(&slot->refs)) {
+		uncharge_beancounter_fast(slot->ub, UB_SWAPPAGES, 1);
+		put_beancounter_longterm(slot->ub);
+		zvswap_free(zpage, slot);
+	}
+}
+
+/* Decompresses the slot into the page, caller holds a reference */
+int zvswap_load_page(swp_entry_t entry, struct page *page)
+{
+	struct zvswap_slot *slot;
+	struct page *zpage;
+	size_t len = PAGE_SIZE;
+	void *dst;
+	int err;
+
+	slot = zvswap_entry_slot(entry, &zpage);
+	dst = kmap_atomic(page, KM_USER0);
+	err = lzo1x_decompress_safe(slot->data, slot->len, dst, &len);
+	kunmap_atomic(dst, KM_USER0);
+
+	if (err != LZO_E_OK || len != PAGE_SIZE)
+		return -EIO;
+	return 0;
+}
+
+static int zvswap_convert_pte(struct page *page, struct vm_area_struct *vma,
+			      unsigned long addr, void *data)
+{
+	unsigned long handle = *(unsigned long *)data;
+	struct mm_struct *mm = vma->vm_mm;
+	swp_entry_t entry;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *ptep, pte;
+	spinlock_t *ptl;
+
+	pgd = pgd_offset(mm, addr);
+	if (!pgd_present(*pgd))
+		goto out;
+
+	pud = pud_offset(pgd, addr);
+	if (!pud_present(*pud))
+		goto out;
+
+	pmd = pmd_offset(pud, addr);
+	if (!pmd_present(*pmd) || pmd_trans_huge(*pmd))
+		goto out;
+
+	ptep = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	pte = *ptep;
+
+	if (!is_swap_pte(pte))
+		goto out_unlock;
+
+	entry = pte_to_swp_entry(pte);
+	if (!is_vswap_entry(entry) || vswap_entry_to_page(entry) != page)
+		goto out_unlock;
+
+	entry = swp_entry(is_write_vswap_entry(entry) ?
+			  SWP_ZVSWAP_WRITE : SWP_ZVSWAP_READ, handle);
+	get_zvswap_entry(entry);
+	set_pte_at(mm, addr, ptep, swp_entry_to_pte(entry));
+	/* our isolation reference keeps the page */
+	put_vswap_page(page);
+	put_page(page);
+out_unlock:
+	pte_unmap_unlock(ptep, ptl);
+out:
+	return SWAP_AGAIN;
+}
+
+/*
+ * Is called by reclaim for a locked isolated page just added to vswap.
+ * Returns 1 if all its vswap ptes were switched to the compressed copy
+ * and only the isolation reference is left.
+ */
+int vswap_compress_page(struct page *page)
+{
+	struct user_beancounter *ub = get_gang_ub(page_gang(page));
+	struct zvswap_slot *slot = NULL;
+	struct zvswap_buf *buf;
+	unsigned long handle;
+	size_t len;
+	void *src;
+	int err;
+
+	VM_BUG_ON(!PageLocked(page));
+
+	if (!sysctl_vswap_compress || !zvswap_ready)
+		return 0;
+
+	/* pinned pages must stay, their contents may change under us */
+	if (!PageVSwap(page) || PageKsm(page) ||
+	    page_count(page) != page_vswapcount(page) + 1)
+		return 0;
+
+	/* what gang_mod_shadow_page() would charge for staying in vswap */
+	if (charge_beancounter_fast(ub, UB_SWAPPAGES, 1, UB_SOFT | UB_TEST))
+		return 0;
+
+	buf = &get_cpu_var(zvswap_buf);
+	src = kmap_atomic(page, KM_USER0);
+	err = lzo1x_1_compress(src, PAGE_SIZE, buf->dst, &len, buf->wrkmem);
+	kunmap_atomic(src, KM_USER0);
+	if (err == LZO_E_OK && sizeof(*slot) + len <= ZVSWAP_MAX_SIZE)
+		slot = zvswap_alloc(sizeof(*slot) + len, &handle);
+	if (slot) {
+		atomic_set(&slot->refs, 1);
+		slot->len = len;
+		slot->ub = get_beancounter_longterm(ub);
+		memcpy(slot->data, buf->dst, len);
+	}
+	put_cpu_var(zvswap_buf);
+
+	if (!slot) {
+		uncharge_beancounter_fast(ub, UB_SWAPPAGES, 1);
+		return 0;
+	}
+
+	rmap_walk(page, zvswap_convert_pte, &handle);
+	put_zvswap_entry(swp_entry(SWP_ZVSWAP_READ, handle));
+
+	return !PageVSwap(page);
+}
+
+static int __init zvswap_init(void)
+{
+	struct zvswap_buf *buf;
+	int i, cpu;
+
+	for (i = 0; i < ZVSWAP_NR_CLASSES; i++) {
+		spin_lock_init(&zvswap_classes[i].lock);
+		zvswap_classes[i].size = (i + 1) * ZVSWAP_CLASS_SIZE;
+		zvswap_classes[i].objects = PAGE_SIZE / zvswap_classes[i].size;
+		INIT_LIST_HEAD(&zvswap_classes[i].partial);
+	}
+
+	for_each_possible_cpu(cpu) {
+		buf = &per_cpu(zvswap_buf, cpu);
+		buf->wrkmem = kmalloc(LZO1X_1_MEM_COMPRESS, GFP_KERNEL);
+		buf->dst = kmalloc(lzo1x_worst_compress(PAGE_SIZE), GFP_KERNEL);
+		if (!buf->wrkmem || !buf->dst) {
+			printk(KERN_ERR "vswap: no memory for compression\n");
+			return -ENOMEM;
+		}
+	}
+
+	zvswap_ready = 1;
+	return 0;
+}
+late_initcall(zvswap_init);
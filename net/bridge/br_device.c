@@ -377,6 +377,7 @@ out_unreg:
 	unregister_netdevice(dev);
 	goto out;
 out_free:
+	br_fdb_hash_fini(br);
 	free_netdev(dev);
 	goto out;
 }
@@ -467,6 +468,7 @@ static void br_dev_free(struct net_device *dev)
 {
 	struct net_bridge *br = netdev_priv(dev);
 
+	br_fdb_hash_fini(br);
 	free_percpu(br->stats);
 	free_netdev(dev);
 }
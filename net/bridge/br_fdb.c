@@ -20,13 +20,18 @@
 #include <linux/etherdevice.h>
 #include <linux/jhash.h>
 #include <linux/random.h>
+#include <linux/vmalloc.h>
 #include <asm/atomic.h>
 #include <asm/unaligned.h>
 #include "br_private.h"
 
+/* buckets aged under one hold of hash_lock */
+#define BR_FDB_GC_BATCH	64
+
 static struct kmem_cache *br_fdb_cache __read_mostly;
 static int fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 		      const unsigned char *addr);
+static void fdb_rehash_work(struct work_struct *work);
 
 static u32 fdb_salt __read_mostly;
 
@@ -48,6 +53,63 @@ void br_fdb_fini(void)
 	kmem_cache_destroy(br_fdb_cache);
 }
 
+static struct net_bridge_fdb_htable *fdb_htable_alloc(unsigned int max)
+{
+	struct net_bridge_fdb_htable *ht;
+	size_t size = max * sizeof(struct hlist_head);
+
+	ht = kzalloc(sizeof(*ht), GFP_KERNEL);
+	if (!ht)
+		return NULL;
+
+	if (size <= PAGE_SIZE)
+		ht->hash = kzalloc(size, GFP_KERNEL);
+	else
+		ht->hash = __vmalloc(size, GFP_KERNEL | __GFP_ZERO, PAGE_KERNEL);
+	if (!ht->hash) {
+		kfree(ht);
+		return NULL;
+	}
+
+	ht->max = max;
+	return ht;
+}
+
+static void fdb_htable_free(struct net_bridge_fdb_htable *ht)
+{
+	if (is_vmalloc_addr(ht->hash))
+		vfree(ht->hash);
+	else
+		kfree(ht->hash);
+	kfree(ht);
+}
+
+int br_fdb_hash_init(struct net_bridge *br)
+{
+	br->fdb_hash = fdb_htable_alloc(BR_HASH_SIZE);
+	if (!br->fdb_hash)
+		return -ENOMEM;
+
+	INIT_WORK(&br->fdb_rehash_work, fdb_rehash_work);
+	return 0;
+}
+
+/* called on free of the bridge device, entries left are not seen by anyone */
+void br_fdb_hash_fini(struct net_bridge *br)
+{
+	struct net_bridge_fdb_htable *ht = br->fdb_hash;
+	struct net_bridge_fdb_entry *f;
+	struct hlist_node *h, *n;
+	int i;
+
+	cancel_work_sync(&br->fdb_rehash_work);
+
+	for (i = 0; i < ht->max; i++)
+		hlist_for_each_entry_safe(f, h, n, &ht->hash[i], hlist[ht->ver])
+			kmem_cache_free(br_fdb_cache, f);
+	fdb_htable_free(ht);
+}
+
 
 /* if topology_changing then use forward_delay (default 15 sec)
  * otherwise keep longer (default 5 minutes)
@@ -64,11 +126,12 @@ static inline int has_expired(const struct net_bridge *br,
 		&& time_before_eq(fdb->ageing_timer + hold_time(br), jiffies);
 }
 
-static inline int br_mac_hash(const unsigned char *mac)
+static inline int br_mac_hash(const struct net_bridge_fdb_htable *ht,
+			      const unsigned char *mac)
 {
 	/* use 1 byte of OUI cnd 3 bytes of NIC */
 	u32 key = get_unaligned((u32 *)(mac + 2));
-	return jhash_1word(key, fdb_salt) & (BR_HASH_SIZE - 1);
+	return jhash_1word(key, fdb_salt) & (ht->max - 1);
 }
 
 static void fdb_rcu_free(struct rcu_head *head)
@@ -78,26 +141,66 @@ static void fdb_rcu_free(struct rcu_head *head)
 	kmem_cache_free(br_fdb_cache, ent);
 }
 
-static inline void fdb_delete(struct net_bridge_fdb_entry *f)
+static inline void fdb_delete(struct net_bridge *br,
+			      struct net_bridge_fdb_entry *f)
 {
-	hlist_del_rcu(&f->hlist);
+	struct net_bridge_fdb_htable *ht = br->fdb_hash;
+
+	hlist_del_rcu(&f->hlist[ht->ver]);
+	ht->size--;
 	call_rcu(&f->rcu, fdb_rcu_free);
 }
 
+/*
+ * Doubles the hash. Entries are linked into the new one by their other
+ * hlist node, so readers still walking the old one find them there.
+ */
+static void fdb_rehash_work(struct work_struct *work)
+{
+	struct net_bridge *br = container_of(work, struct net_bridge,
+					     fdb_rehash_work);
+	struct net_bridge_fdb_htable *ht, *old;
+	struct net_bridge_fdb_entry *f;
+	struct hlist_node *h;
+	int i;
+
+	/* only we change the size */
+	ht = fdb_htable_alloc(br->fdb_hash->max * 2);
+	if (!ht)
+		return;
+
+	spin_lock_bh(&br->hash_lock);
+	old = br->fdb_hash;
+	ht->size = old->size;
+	ht->ver = old->ver ^ 1;
+	for (i = 0; i < old->max; i++)
+		hlist_for_each_entry(f, h, &old->hash[i], hlist[old->ver])
+			hlist_add_head(&f->hlist[ht->ver],
+				       &ht->hash[br_mac_hash(ht, f->addr.addr)]);
+	rcu_assign_pointer(br->fdb_hash, ht);
+	spin_unlock_bh(&br->hash_lock);
+
+	synchronize_rcu();
+	fdb_htable_free(old);
+}
+
 void br_fdb_changeaddr(struct net_bridge_port *p, const unsigned char *newaddr)
 {
 	struct net_bridge *br = p->br;
+	struct net_bridge_fdb_htable *ht;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
+	ht = br->fdb_hash;
 
 	/* Search all chains since old address/hash is unknown */
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	for (i = 0; i < ht->max; i++) {
 		struct hlist_node *h;
-		hlist_for_each(h, &br->hash[i]) {
+		hlist_for_each(h, &ht->hash[i]) {
 			struct net_bridge_fdb_entry *f;
 
-			f = hlist_entry(h, struct net_bridge_fdb_entry, hlist);
+			f = hlist_entry(h, struct net_bridge_fdb_entry,
+					hlist[ht->ver]);
 			if (f->dst == p && f->is_local) {
 				/* maybe another port has same hw addr? */
 				struct net_bridge_port *op;
@@ -111,7 +214,7 @@ void br_fdb_changeaddr(struct net_bridge_port *p, const unsigned char *newaddr)
 				}
 
 				/* delete old one */
-				fdb_delete(f);
+				fdb_delete(br, f);
 				goto insert;
 			}
 		}
@@ -127,12 +230,14 @@ void br_fdb_change_mac_address(struct net_bridge *br, const u8 *newaddr)
 {
 	struct net_bridge_fdb_entry *f;
 
+	spin_lock_bh(&br->hash_lock);
 	/* If old entry was unassociated with any port, then delete it. */
 	f = __br_fdb_get(br, br->dev->dev_addr);
 	if (f && f->is_local && !f->dst)
-		fdb_delete(f);
+		fdb_delete(br, f);
 
 	fdb_insert(br, NULL, newaddr);
+	spin_unlock_bh(&br->hash_lock);
 }
 
 void br_fdb_cleanup(unsigned long _data)
@@ -140,23 +245,35 @@ void br_fdb_cleanup(unsigned long _data)
 	struct net_bridge *br = (struct net_bridge *)_data;
 	unsigned long delay = hold_time(br);
 	unsigned long next_timer = jiffies + br->forward_delay;
-	int i;
+	struct net_bridge_fdb_htable *ht;
+	int i = 0;
 
+	/*
+	 * Let the learning on other CPUs in between batches. A rehash in
+	 * between may move entries past us, they are aged on the next run.
+	 */
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	ht = br->fdb_hash;
+	while (i < ht->max) {
 		struct net_bridge_fdb_entry *f;
 		struct hlist_node *h, *n;
 
-		hlist_for_each_entry_safe(f, h, n, &br->hash[i], hlist) {
+		hlist_for_each_entry_safe(f, h, n, &ht->hash[i], hlist[ht->ver]) {
 			unsigned long this_timer;
 			if (f->is_static)
 				continue;
 			this_timer = f->ageing_timer + delay;
 			if (time_before_eq(this_timer, jiffies))
-				fdb_delete(f);
+				fdb_delete(br, f);
 			else if (time_before(this_timer, next_timer))
 				next_timer = this_timer;
 		}
+
+		if (++i % BR_FDB_GC_BATCH == 0) {
+			spin_unlock_bh(&br->hash_lock);
+			spin_lock_bh(&br->hash_lock);
+			ht = br->fdb_hash;
+		}
 	}
 	spin_unlock_bh(&br->hash_lock);
 
@@ -168,15 +285,17 @@ void br_fdb_cleanup(unsigned long _data)
 /* Completely flush all dynamic entries in forwarding database.*/
 void br_fdb_flush(struct net_bridge *br)
 {
+	struct net_bridge_fdb_htable *ht;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	ht = br->fdb_hash;
+	for (i = 0; i < ht->max; i++) {
 		struct net_bridge_fdb_entry *f;
 		struct hlist_node *h, *n;
-		hlist_for_each_entry_safe(f, h, n, &br->hash[i], hlist) {
+		hlist_for_each_entry_safe(f, h, n, &ht->hash[i], hlist[ht->ver]) {
 			if (!f->is_static)
-				fdb_delete(f);
+				fdb_delete(br, f);
 		}
 	}
 	spin_unlock_bh(&br->hash_lock);
@@ -189,15 +308,18 @@ void br_fdb_delete_by_port(struct net_bridge *br,
 			   const struct net_bridge_port *p,
 			   int do_all)
 {
+	struct net_bridge_fdb_htable *ht;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	ht = br->fdb_hash;
+	for (i = 0; i < ht->max; i++) {
 		struct hlist_node *h, *g;
 
-		hlist_for_each_safe(h, g, &br->hash[i]) {
+		hlist_for_each_safe(h, g, &ht->hash[i]) {
 			struct net_bridge_fdb_entry *f
-				= hlist_entry(h, struct net_bridge_fdb_entry, hlist);
+				= hlist_entry(h, struct net_bridge_fdb_entry,
+					      hlist[ht->ver]);
 			if (f->dst != p)
 				continue;
 
@@ -220,7 +342,7 @@ void br_fdb_delete_by_port(struct net_bridge *br,
 				}
 			}
 
-			fdb_delete(f);
+			fdb_delete(br, f);
 		skip_delete: ;
 		}
 	}
@@ -231,10 +353,12 @@ void br_fdb_delete_by_port(struct net_bridge *br,
 struct net_bridge_fdb_entry *__br_fdb_get(struct net_bridge *br,
 					  const unsigned char *addr)
 {
+	struct net_bridge_fdb_htable *ht = rcu_dereference(br->fdb_hash);
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *fdb;
 
-	hlist_for_each_entry_rcu(fdb, h, &br->hash[br_mac_hash(addr)], hlist) {
+	hlist_for_each_entry_rcu(fdb, h, &ht->hash[br_mac_hash(ht, addr)],
+				 hlist[ht->ver]) {
 		if (!compare_ether_addr(fdb->addr.addr, addr)) {
 			if (unlikely(has_expired(br, fdb)))
 				break;
@@ -275,14 +399,16 @@ int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 {
 	struct __fdb_entry *fe = buf;
 	int i, num = 0;
+	struct net_bridge_fdb_htable *ht;
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *f;
 
 	memset(buf, 0, maxnum*sizeof(struct __fdb_entry));
 
 	rcu_read_lock();
-	for (i = 0; i < BR_HASH_SIZE; i++) {
-		hlist_for_each_entry_rcu(f, h, &br->hash[i], hlist) {
+	ht = rcu_dereference(br->fdb_hash);
+	for (i = 0; i < ht->max; i++) {
+		hlist_for_each_entry_rcu(f, h, &ht->hash[i], hlist[ht->ver]) {
 			if (num >= maxnum)
 				goto out;
 
@@ -319,35 +445,41 @@ int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 	return num;
 }
 
-static inline struct net_bridge_fdb_entry *fdb_find(struct hlist_head *head,
-						    const unsigned char *addr)
+static inline struct net_bridge_fdb_entry *
+fdb_find(struct net_bridge_fdb_htable *ht, const unsigned char *addr)
 {
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *fdb;
 
-	hlist_for_each_entry_rcu(fdb, h, head, hlist) {
+	hlist_for_each_entry_rcu(fdb, h, &ht->hash[br_mac_hash(ht, addr)],
+				 hlist[ht->ver]) {
 		if (!compare_ether_addr(fdb->addr.addr, addr))
 			return fdb;
 	}
 	return NULL;
 }
 
-static struct net_bridge_fdb_entry *fdb_create(struct hlist_head *head,
+/* Called under hash_lock */
+static struct net_bridge_fdb_entry *fdb_create(struct net_bridge *br,
 					       struct net_bridge_port *source,
 					       const unsigned char *addr,
 					       int is_local)
 {
+	struct net_bridge_fdb_htable *ht = br->fdb_hash;
 	struct net_bridge_fdb_entry *fdb;
 
 	fdb = kmem_cache_alloc(br_fdb_cache, GFP_ATOMIC);
 	if (fdb) {
 		memcpy(fdb->addr.addr, addr, ETH_ALEN);
-		hlist_add_head_rcu(&fdb->hlist, head);
-
 		fdb->dst = source;
 		fdb->is_local = is_local;
 		fdb->is_static = is_local;
 		fdb->ageing_timer = jiffies;
+		hlist_add_head_rcu(&fdb->hlist[ht->ver],
+				   &ht->hash[br_mac_hash(ht, addr)]);
+
+		if (++ht->size > ht->max && ht->max < BR_FDB_HASH_MAX)
+			schedule_work(&br->fdb_rehash_work);
 	}
 	return fdb;
 }
@@ -355,13 +487,12 @@ static struct net_bridge_fdb_entry *fdb_create(struct hlist_head *head,
 static int fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 		  const unsigned char *addr)
 {
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
 	if (!is_valid_ether_addr(addr))
 		return -EINVAL;
 
-	fdb = fdb_find(head, addr);
+	fdb = fdb_find(br->fdb_hash, addr);
 	if (fdb) {
 		/* it is okay to have multiple ports with same
 		 * address, just use the first one.
@@ -372,10 +503,10 @@ static int fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 		printk(KERN_WARNING "%s adding interface with same address "
 		       "as a received packet\n",
 		       source ? source->dev->name : br->dev->name);
-		fdb_delete(fdb);
+		fdb_delete(br, fdb);
 	}
 
-	if (!fdb_create(head, source, addr, 1))
+	if (!fdb_create(br, source, addr, 1))
 		return -ENOMEM;
 
 	return 0;
@@ -395,7 +526,6 @@ int br_fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 		   const unsigned char *addr)
 {
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
 	/* some users want to always flood. */
@@ -407,7 +537,7 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 	      source->state == BR_STATE_FORWARDING))
 		return;
 
-	fdb = fdb_find(head, addr);
+	fdb = fdb_find(rcu_dereference(br->fdb_hash), addr);
 	if (likely(fdb)) {
 		/* attempt to update an entry for a local interface */
 		if (unlikely(fdb->is_local)) {
@@ -416,14 +546,20 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 				       "own address as source address\n",
 				       source->dev->name);
 		} else {
-			/* fastpath: update of existing entry */
-			fdb->dst = source;
-			fdb->ageing_timer = jiffies;
+			/*
+			 * fastpath: update of existing entry, at most once a
+			 * tick, not to bounce its cacheline between the CPUs
+			 * forwarding from the same MAC
+			 */
+			if (unlikely(fdb->dst != source))
+				fdb->dst = source;
+			if (fdb->ageing_timer != jiffies)
+				fdb->ageing_timer = jiffies;
 		}
 	} else {
 		spin_lock(&br->hash_lock);
-		if (!fdb_find(head, addr))
-			fdb_create(head, source, addr, 0);
+		if (!fdb_find(br->fdb_hash, addr))
+			fdb_create(br, source, addr, 0);
 		/* else  we lose race and someone else inserts
 		 * it first, don't bother updating
 		 */
@@ -210,6 +210,11 @@ struct net_device *new_bridge_dev(struct net *net, const char *name)
 	spin_lock_init(&br->lock);
 	INIT_LIST_HEAD(&br->port_list);
 	spin_lock_init(&br->hash_lock);
+	if (br_fdb_hash_init(br)) {
+		free_percpu(br->stats);
+		free_netdev(dev);
+		return NULL;
+	}
 
 	br->bridge_id.prio[0] = 0x80;
 	br->bridge_id.prio[1] = 0x00;
@@ -325,6 +330,7 @@ int br_add_bridge(struct net *net, const char *name)
 	return ret;
 
 out_free:
+	br_fdb_hash_fini(netdev_priv(dev));
 	free_netdev(dev);
 	goto out;
 }
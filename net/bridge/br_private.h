@@ -25,6 +25,8 @@
 
 #define BR_HASH_BITS 8
 #define BR_HASH_SIZE (1 << BR_HASH_BITS)
+/* fdb hash is doubled up to that when it has more entries than buckets */
+#define BR_FDB_HASH_MAX (1 << 16)
 
 #define BR_HOLD_TIME (1*HZ)
 
@@ -83,7 +85,7 @@ struct bridge_mcast_querier {
 
 struct net_bridge_fdb_entry
 {
-	struct hlist_node		hlist;
+	struct hlist_node		hlist[2];
 	struct net_bridge_port		*dst;
 
 	struct rcu_head			rcu;
@@ -93,6 +95,14 @@ struct net_bridge_fdb_entry
 	unsigned char			is_static;
 };
 
+struct net_bridge_fdb_htable
+{
+	struct hlist_head		*hash;
+	u32				size;
+	u32				max;
+	u32				ver;
+};
+
 struct net_bridge_port_group {
 	struct net_bridge_port		*port;
 	struct net_bridge_port_group	*next;
@@ -186,7 +196,8 @@ struct net_bridge
 	struct net_device		*master_dev;
 	unsigned char			via_phys_dev;
 	spinlock_t			hash_lock;
-	struct hlist_head		hash[BR_HASH_SIZE];
+	struct net_bridge_fdb_htable	*fdb_hash;
+	struct work_struct		fdb_rehash_work;
 	struct list_head		age_list;
 #ifdef CONFIG_BRIDGE_NETFILTER
 	struct rtable 			fake_rtable;
@@ -328,6 +339,8 @@ static inline void br_netpoll_disable(struct net_bridge_port *p)
 /* br_fdb.c */
 extern int br_fdb_init(void);
 extern void br_fdb_fini(void);
+extern int br_fdb_hash_init(struct net_bridge *br);
+extern void br_fdb_hash_fini(struct net_bridge *br);
 extern void br_fdb_flush(struct net_bridge *br);
 extern void br_fdb_changeaddr(struct net_bridge_port *p,
 			      const unsigned char *newaddr);
@@ -2804,6 +2804,30 @@ set_rps_cpu(struct net_device *dev, struct sk_buff *skb,
 	return rflow;
 }
 
+static inline int rps_cpu_allowed(struct ve_struct *ve, int cpu)
+{
+	return !ve->rps_pinned || cpumask_test_cpu(cpu, &ve->rps_cpus);
+}
+
+/*
+ * The VE owning the device is pinned to some CPUs by its fairsched node,
+ * take the next one of them in the map. Falls back to the hashed CPU if
+ * the map has none.
+ */
+static u16 rps_map_ve_cpu(struct ve_struct *ve, struct rps_map *map,
+			  unsigned int idx)
+{
+	unsigned int i;
+	u16 cpu;
+
+	for (i = 1; i < map->len; i++) {
+		cpu = map->cpus[(idx + i) % map->len];
+		if (cpumask_test_cpu(cpu, &ve->rps_cpus))
+			return cpu;
+	}
+	return map->cpus[idx];
+}
+
 /*
  * get_rps_cpu is called from netif_receive_skb and returns the target
  * CPU from the RPS map of the receiving queue for a given skb.
@@ -2921,7 +2945,8 @@ got_hash:
 			rflow = set_rps_cpu(dev, skb, rflow, next_cpu);
 		}
 
-		if (tcpu != RPS_NO_CPU && cpu_online(tcpu)) {
+		if (tcpu != RPS_NO_CPU && cpu_online(tcpu) &&
+		    rps_cpu_allowed(dev->owner_env, tcpu)) {
 			*rflowp = rflow;
 			cpu = tcpu;
 			goto done;
@@ -2930,7 +2955,11 @@ got_hash:
 
 	map = rcu_dereference(rxqueue->rps_map);
 	if (map) {
-		tcpu = map->cpus[((u32) (skb->rxhash * map->len)) >> 16];
+		unsigned int idx = ((u32) (skb->rxhash * map->len)) >> 16;
+
+		tcpu = map->cpus[idx];
+		if (unlikely(!rps_cpu_allowed(dev->owner_env, tcpu)))
+			tcpu = rps_map_ve_cpu(dev->owner_env, map, idx);
 
 		if (cpu_online(tcpu)) {
 			cpu = tcpu;
@@ -138,6 +138,7 @@
 
 #ifdef CONFIG_INET
 #include <net/tcp.h>
+#include <bc/tcp.h>
 #endif
 
 #include <net/busy_poll.h>
@@ -1733,6 +1734,16 @@ EXPORT_SYMBOL(sk_wait_data);
  *	rmem allocation. This function assumes that protocols which have
  *	memory_pressure use sk_wmem_queued as write buffer accounting.
  */
+/* TCP of a beancounter has its own memory pressure, see bc/tcp.h */
+static inline int sk_under_memory_pressure(struct sock *sk)
+{
+	struct proto *prot = sk->sk_prot;
+
+	if (prot->memory_pressure == &tcp_memory_pressure)
+		return ub_tcp_sk_pressure(sk);
+	return *prot->memory_pressure;
+}
+
 int __sk_mem_schedule(struct sock *sk, int size, int kind)
 {
 	struct proto *prot = sk->sk_prot;
@@ -1774,7 +1785,7 @@ int __sk_mem_schedule(struct sock *sk, int size, int kind)
 	if (prot->memory_pressure) {
 		int alloc;
 
-		if (!*prot->memory_pressure)
+		if (!sk_under_memory_pressure(sk))
 			return 1;
 		alloc = percpu_counter_read_positive(prot->sockets_allocated);
 		if (prot->sysctl_mem[2] > alloc *
@@ -2389,6 +2400,7 @@ int proto_register(struct proto *prot, int alloc_slab)
 		prot->slab = kmem_cache_create(prot->name,
 					sk_alloc_size(prot->obj_size), 0,
 					SLAB_HWCACHE_ALIGN | SLAB_UBC |
+						SLAB_UB_PAGES |
 						proto_slab_flags(prot),
 					NULL);
 
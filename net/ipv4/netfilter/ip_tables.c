@@ -1280,6 +1280,148 @@ __do_replace(struct net *net, const char *name, unsigned int valid_hooks,
 	return ret;
 }
 
+/*
+ * Reloading an unchanged ruleset is common when the firewall scripts of
+ * a VE are reapplied, and a full replace costs a translated copy of the
+ * table per CPU. The user-supplied blob is compared with the translated
+ * table: entry headers, names and revisions of matches and targets and
+ * their data. Kernel state kept in the data of a match or target (e.g.
+ * pointers to private structures) makes them differ, so such rulesets
+ * always go through the full replace.
+ */
+static bool
+same_entry_elems(const struct ipt_entry *ue, const struct ipt_entry *ke)
+{
+	const struct xt_entry_match *um, *km;
+	const struct xt_entry_target *ut, *kt;
+	unsigned int off;
+
+	for (off = sizeof(*ke); off < ke->target_offset;
+	     off += km->u.match_size) {
+		um = (void *)ue + off;
+		km = (void *)ke + off;
+		if (um->u.match_size != km->u.match_size ||
+		    strncmp(um->u.user.name, km->u.kernel.match->name,
+			    sizeof(um->u.user.name)) != 0 ||
+		    um->u.user.revision != km->u.kernel.match->revision ||
+		    memcmp(um->data, km->data,
+			   km->u.match_size - sizeof(*km)) != 0)
+			return false;
+	}
+
+	ut = (void *)ue + ke->target_offset;
+	kt = (void *)ke + ke->target_offset;
+	return ut->u.target_size == kt->u.target_size &&
+	       strncmp(ut->u.user.name, kt->u.kernel.target->name,
+		       sizeof(ut->u.user.name)) == 0 &&
+	       ut->u.user.revision == kt->u.kernel.target->revision &&
+	       memcmp(ut->data, kt->data,
+		      kt->u.target_size - sizeof(*kt)) == 0;
+}
+
+static bool
+same_ruleset(const struct xt_table_info *private,
+	     const struct ipt_replace *repl, const void *blob)
+{
+	const void *base = private->entries[raw_smp_processor_id()];
+	const struct ipt_entry *ue, *ke;
+	unsigned int off, i;
+
+	if (repl->size != private->size ||
+	    repl->num_entries != private->number ||
+	    repl->num_counters != private->number)
+		return false;
+
+	for (i = 0; i < NF_INET_NUMHOOKS; i++) {
+		if (!(repl->valid_hooks & (1 << i)))
+			continue;
+		if (repl->hook_entry[i] != private->hook_entry[i] ||
+		    repl->underflow[i] != private->underflow[i])
+			return false;
+	}
+
+	/* offsets of the user blob are trusted once they match ours */
+	for (off = 0; off < private->size; off += ke->next_offset) {
+		ue = blob + off;
+		ke = base + off;
+		if (memcmp(ue, ke, offsetof(struct ipt_entry, comefrom)) != 0 ||
+		    !same_entry_elems(ue, ke))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Counters start from zero as after a full replace, userspace restores
+ * saved ones with IPT_SO_SET_ADD_COUNTERS.
+ */
+static inline int clear_entry_counter(struct ipt_entry *e, void *unused)
+{
+	e->counters.bcnt = e->counters.pcnt = 0;
+	return 0;
+}
+
+static void clear_counters(struct xt_table_info *private)
+{
+	unsigned int cpu;
+
+	local_bh_disable();
+	for_each_possible_cpu(cpu) {
+		xt_info_wrlock(cpu);
+		IPT_ENTRY_ITERATE(private->entries[cpu], private->size,
+				  clear_entry_counter, NULL);
+		xt_info_wrunlock(cpu);
+	}
+	local_bh_enable();
+}
+
+/*
+ * Returns 1 if the table already holds the ruleset of @repl, the counters
+ * are then cleared and the old ones are copied to the user as on replace.
+ */
+static int
+replace_same_ruleset(struct net *net, const struct ipt_replace *repl,
+		     const void *blob)
+{
+	struct xt_table *t;
+	struct xt_table_info *private;
+	struct xt_counters *counters;
+	int ret = 0;
+
+	t = xt_find_table_lock(net, AF_INET, repl->name);
+	if (!t || IS_ERR(t))
+		return 0;
+
+	private = t->private;
+	if (repl->valid_hooks != t->valid_hooks ||
+	    !same_ruleset(private, repl, blob))
+		goto out;
+
+	counters = ub_vmalloc_best(repl->num_counters *
+				   sizeof(struct xt_counters));
+	if (!counters) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	get_counters(private, counters);
+	clear_counters(private);
+	xt_table_unlock(t);
+	module_put(t->me);
+
+	ret = 1;
+	if (copy_to_user(repl->counters, counters,
+			 sizeof(struct xt_counters) * repl->num_counters) != 0)
+		ret = -EFAULT;
+	vfree(counters);
+	return ret;
+
+out:
+	xt_table_unlock(t);
+	module_put(t->me);
+	return ret;
+}
+
 static int
 do_replace(struct net *net, void __user *user, unsigned int len)
 {
@@ -1287,6 +1429,7 @@ do_replace(struct net *net, void __user *user, unsigned int len)
 	struct ipt_replace tmp;
 	struct xt_table_info *newinfo;
 	void *loc_cpu_entry;
+	void *blob;
 
 	if (copy_from_user(&tmp, user, sizeof(tmp)) != 0)
 		return -EFAULT;
@@ -1296,17 +1439,31 @@ do_replace(struct net *net, void __user *user, unsigned int len)
 		return -ENOMEM;
 	tmp.name[sizeof(tmp.name)-1] = 0;
 
+	blob = ub_vmalloc_best(tmp.size ? : 1);
+	if (!blob)
+		return -ENOMEM;
+
+	if (copy_from_user(blob, user + sizeof(tmp), tmp.size) != 0) {
+		vfree(blob);
+		return -EFAULT;
+	}
+
+	ret = replace_same_ruleset(net, &tmp, blob);
+	if (ret != 0) {
+		vfree(blob);
+		return ret < 0 ? ret : 0;
+	}
+
 	newinfo = xt_alloc_table_info(tmp.size);
-	if (!newinfo)
+	if (!newinfo) {
+		vfree(blob);
 		return -ENOMEM;
+	}
 
 	/* choose the copy that is on our node/cpu */
 	loc_cpu_entry = newinfo->entries[raw_smp_processor_id()];
-	if (copy_from_user(loc_cpu_entry, user + sizeof(tmp),
-			   tmp.size) != 0) {
-		ret = -EFAULT;
-		goto free_newinfo;
-	}
+	memcpy(loc_cpu_entry, blob, tmp.size);
+	vfree(blob);
 
 	ret = translate_table(tmp.name, tmp.valid_hooks,
 			      newinfo, loc_cpu_entry, tmp.size, tmp.num_entries,
@@ -259,6 +259,25 @@ static DEFINE_PER_CPU(struct rt_cache_stat, rt_cache_stat);
 #define RT_CACHE_STAT_INC(field) \
 	(__raw_get_cpu_var(rt_cache_stat).field++)
 
+/*
+ * Lookups are also accounted to the namespace they are done in, so that
+ * a VE sees its own hit rate. GC is host wide and is counted globally only.
+ */
+#define RT_NET_STAT_INC(net, field) do {				\
+	struct rt_cache_stat *__st = (net)->ipv4.rt_cache_stat;		\
+									\
+	RT_CACHE_STAT_INC(field);					\
+	if (__st)							\
+		per_cpu_ptr(__st, raw_smp_processor_id())->field++;	\
+} while (0)
+
+static struct rt_cache_stat *rt_net_stat_cpu(struct net *net, int cpu)
+{
+	if (net->ipv4.rt_cache_stat)
+		return per_cpu_ptr(net->ipv4.rt_cache_stat, cpu);
+	return &per_cpu(rt_cache_stat, cpu);
+}
+
 static inline unsigned int rt_hash(__be32 daddr, __be32 saddr, int idx,
 		int genid)
 {
@@ -435,7 +454,7 @@ static void *rt_cpu_seq_start(struct seq_file *seq, loff_t *pos)
 		if (!cpu_possible(cpu))
 			continue;
 		*pos = cpu+1;
-		return &per_cpu(rt_cache_stat, cpu);
+		return rt_net_stat_cpu(seq_file_net(seq), cpu);
 	}
 	return NULL;
 }
@@ -448,7 +467,7 @@ static void *rt_cpu_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 		if (!cpu_possible(cpu))
 			continue;
 		*pos = cpu+1;
-		return &per_cpu(rt_cache_stat, cpu);
+		return rt_net_stat_cpu(seq_file_net(seq), cpu);
 	}
 	return NULL;
 
@@ -503,7 +522,8 @@ static const struct seq_operations rt_cpu_seq_ops = {
 
 static int rt_cpu_seq_open(struct inode *inode, struct file *file)
 {
-	return seq_open(file, &rt_cpu_seq_ops);
+	return seq_open_net(inode, file, &rt_cpu_seq_ops,
+			sizeof(struct seq_net_private));
 }
 
 static const struct file_operations rt_cpu_seq_fops = {
@@ -511,7 +531,7 @@ static const struct file_operations rt_cpu_seq_fops = {
 	.open	 = rt_cpu_seq_open,
 	.read	 = seq_read,
 	.llseek	 = seq_lseek,
-	.release = seq_release,
+	.release = seq_release_net,
 };
 
 #ifdef CONFIG_NET_CLS_ROUTE
@@ -713,6 +733,28 @@ static inline int rt_is_expired(struct rtable *rth)
 	return rth->rt_genid != rt_genid(dev_net(rth->u.dst.dev));
 }
 
+#ifdef CONFIG_NET_NS
+/*
+ * A flush of one namespace expires only its own entries, chains without
+ * them are skipped without taking the bucket lock.
+ */
+static int rt_chain_expired(unsigned int hash)
+{
+	struct rtable *rth;
+	int ret = 0;
+
+	rcu_read_lock_bh();
+	for (rth = rcu_dereference(rt_hash_table[hash].chain); rth;
+	     rth = rcu_dereference(rth->u.dst.rt_next))
+		if (rt_is_expired(rth)) {
+			ret = 1;
+			break;
+		}
+	rcu_read_unlock_bh();
+	return ret;
+}
+#endif
+
 /*
  * Perform a full scan of hash table and free all entries.
  * Can be called by a softirq or a process.
@@ -730,6 +772,10 @@ static void rt_do_flush(int process_context)
 		rth = rt_hash_table[i].chain;
 		if (!rth)
 			continue;
+#ifdef CONFIG_NET_NS
+		if (!rt_chain_expired(i))
+			continue;
+#endif
 
 		spin_lock_bh(rt_hash_lock_addr(i));
 #ifdef CONFIG_NET_NS
@@ -1967,7 +2013,7 @@ static int ip_route_input_mc(struct sk_buff *skb, __be32 daddr, __be32 saddr,
 	if (!ipv4_is_local_multicast(daddr) && IN_DEV_MFORWARD(in_dev))
 		rth->u.dst.input = ip_mr_input;
 #endif
-	RT_CACHE_STAT_INC(in_slow_mc);
+	RT_NET_STAT_INC(dev_net(dev), in_slow_mc);
 
 	in_dev_put(in_dev);
 	hash = rt_hash(daddr, saddr, dev->ifindex, rt_genid(dev_net(dev)));
@@ -1989,7 +2035,7 @@ static void ip_handle_martian_source(struct net_device *dev,
 				     __be32 daddr,
 				     __be32 saddr)
 {
-	RT_CACHE_STAT_INC(in_martian_src);
+	RT_NET_STAT_INC(dev_net(dev), in_martian_src);
 #ifdef CONFIG_IP_ROUTE_VERBOSE
 	if (IN_DEV_LOG_MARTIANS(in_dev) && net_ratelimit()) {
 		/*
@@ -2218,7 +2264,7 @@ static int ip_route_input_slow(struct sk_buff *skb, __be32 daddr, __be32 saddr,
 	}
 	free_res = 1;
 
-	RT_CACHE_STAT_INC(in_slow_tot);
+	RT_NET_STAT_INC(net, in_slow_tot);
 
 	if (res.type == RTN_BROADCAST)
 		goto brd_input;
@@ -2264,7 +2310,7 @@ brd_input:
 	}
 	flags |= RTCF_BROADCAST;
 	res.type = RTN_BROADCAST;
-	RT_CACHE_STAT_INC(in_brd);
+	RT_NET_STAT_INC(net, in_brd);
 
 local_input:
 	rth = dst_alloc(&ipv4_dst_ops);
@@ -2311,7 +2357,7 @@ local_input:
 	goto done;
 
 no_route:
-	RT_CACHE_STAT_INC(in_no_route);
+	RT_NET_STAT_INC(net, in_no_route);
 	spec_dst = inet_select_addr(dev, 0, RT_SCOPE_UNIVERSE);
 	res.type = RTN_UNREACHABLE;
 	if (err == -ESRCH)
@@ -2322,7 +2368,7 @@ no_route:
 	 *	Do not cache martian addresses: they should be logged (RFC1812)
 	 */
 martian_destination:
-	RT_CACHE_STAT_INC(in_martian_dst);
+	RT_NET_STAT_INC(net, in_martian_dst);
 #ifdef CONFIG_IP_ROUTE_VERBOSE
 	if (IN_DEV_LOG_MARTIANS(in_dev) && net_ratelimit())
 		printk(KERN_WARNING "martian destination %pI4 from %pI4, dev %s\n",
@@ -2374,12 +2420,12 @@ int ip_route_input(struct sk_buff *skb, __be32 daddr, __be32 saddr,
 		    net_eq(dev_net(rth->u.dst.dev), net) &&
 		    !rt_is_expired(rth)) {
 			dst_use(&rth->u.dst, jiffies);
-			RT_CACHE_STAT_INC(in_hit);
+			RT_NET_STAT_INC(net, in_hit);
 			rcu_read_unlock();
 			skb_dst_set(skb, &rth->u.dst);
 			return 0;
 		}
-		RT_CACHE_STAT_INC(in_hlist_search);
+		RT_NET_STAT_INC(net, in_hlist_search);
 	}
 	rcu_read_unlock();
 
@@ -2511,7 +2557,7 @@ static int __mkroute_output(struct rtable **result,
 	rth->u.dst.obsolete = -1;
 	rth->rt_genid = rt_genid(dev_net(dev_out));
 
-	RT_CACHE_STAT_INC(out_slow_tot);
+	RT_NET_STAT_INC(dev_net(dev_out), out_slow_tot);
 
 	if (flags & RTCF_LOCAL) {
 		rth->u.dst.input = ip_local_deliver;
@@ -2522,7 +2568,7 @@ static int __mkroute_output(struct rtable **result,
 		if (flags & RTCF_LOCAL &&
 		    !(dev_out->flags & IFF_LOOPBACK)) {
 			rth->u.dst.output = ip_mc_output;
-			RT_CACHE_STAT_INC(out_slow_mc);
+			RT_NET_STAT_INC(dev_net(dev_out), out_slow_mc);
 		}
 #ifdef CONFIG_IP_MROUTE
 		if (res->type == RTN_MULTICAST) {
@@ -2795,12 +2841,12 @@ int __ip_route_output_key(struct net *net, struct rtable **rp,
 		    net_eq(dev_net(rth->u.dst.dev), net) &&
 		    !rt_is_expired(rth)) {
 			dst_use(&rth->u.dst, jiffies);
-			RT_CACHE_STAT_INC(out_hit);
+			RT_NET_STAT_INC(net, out_hit);
 			rcu_read_unlock_bh();
 			*rp = rth;
 			return 0;
 		}
-		RT_CACHE_STAT_INC(out_hlist_search);
+		RT_NET_STAT_INC(net, out_hlist_search);
 	}
 	rcu_read_unlock_bh();
 
@@ -3490,6 +3536,29 @@ static __net_initdata struct pernet_operations rt_secret_timer_ops = {
 	.exit = rt_secret_timer_exit,
 };
 
+static __net_init int rt_cache_stat_init(struct net *net)
+{
+	/* the global stats are the ones of the host */
+	if (net_eq(net, &init_net))
+		return 0;
+
+	net->ipv4.rt_cache_stat = alloc_percpu(struct rt_cache_stat);
+	if (net->ipv4.rt_cache_stat == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+static __net_exit void rt_cache_stat_exit(struct net *net)
+{
+	free_percpu(net->ipv4.rt_cache_stat);
+	net->ipv4.rt_cache_stat = NULL;
+}
+
+static __net_initdata struct pernet_operations rt_cache_stat_ops = {
+	.init = rt_cache_stat_init,
+	.exit = rt_cache_stat_exit,
+};
+
 
 #ifdef CONFIG_NET_CLS_ROUTE
 struct ip_rt_acct *ip_rt_acct __read_mostly;
@@ -3551,6 +3620,9 @@ int __init ip_rt_init(void)
 	if (register_pernet_subsys(&rt_secret_timer_ops))
 		printk(KERN_ERR "Unable to setup rt_secret_timer\n");
 
+	if (register_pernet_subsys(&rt_cache_stat_ops))
+		printk(KERN_ERR "Unable to setup rt_cache_stat\n");
+
 	if (ip_rt_proc_init())
 		printk(KERN_ERR "Unable to create route proc files\n");
 #ifdef CONFIG_XFRM
@@ -26,6 +26,7 @@
 static int zero;
 static int gso_max_segs = GSO_MAX_SEGS;
 static int tcp_retr1_max = 255;
+static int one_hundred = 100;
 static int ip_local_port_range_min[] = { 1, 1 };
 static int ip_local_port_range_max[] = { 65535, 65535 };
 static int tcp_syn_retries_min = 1;
@@ -710,6 +711,13 @@ static struct ctl_table ipv4_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "tcp_pacing",
+		.data		= &sysctl_tcp_pacing,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 #ifdef CONFIG_NET_DMA
 	{
 		.ctl_name	= NET_TCP_DMA_COPYBREAK,
@@ -853,6 +861,16 @@ static struct ctl_table ipv4_table[] = {
 		.mode           = 0644,
 		.proc_handler   = proc_dointvec,
 	},
+	{
+		.procname       = "tcp_max_tw_ub_share",
+		.data           = &sysctl_tcp_max_tw_ub_share,
+		.maxlen         = sizeof(int),
+		.mode           = 0644,
+		.proc_handler   = proc_dointvec_minmax,
+		.strategy	= sysctl_intvec,
+		.extra1		= &zero,
+		.extra2		= &one_hundred,
+	},
 	{
 		.procname	= "tcp_use_sg",
 		.data		= &sysctl_tcp_use_sg,
@@ -2083,10 +2083,8 @@ adjudge_to_death:
 		}
 	}
 	if (sk->sk_state != TCP_CLOSE) {
-		int orphans = ub_get_orphan_count(sk);
-
 		sk_mem_reclaim(sk);
-		if (ub_too_many_orphans(sk, orphans)) {
+		if (ub_too_many_orphans(sk, 0)) {
 			if (net_ratelimit()) {
 				int ubid = 0;
 #ifdef CONFIG_BEANCOUNTERS
@@ -2094,7 +2092,8 @@ adjudge_to_death:
 					   sock_bc(sk)->ub->ub_uid : 0;
 #endif
 				printk(KERN_INFO "TCP: too many of orphaned "
-				       "sockets (%d in CT%d)\n", orphans, ubid);
+				       "sockets (%d in CT%d)\n",
+				       ub_get_orphan_count(sk), ubid);
 			}
 			tcp_set_state(sk, TCP_CLOSE);
 			tcp_send_active_reset(sk, GFP_ATOMIC);
@@ -3033,6 +3032,7 @@ void __init tcp_init(void)
 	percpu_counter_init(&tcp_sockets_allocated, 0);
 	percpu_counter_init(&tcp_orphan_count, 0);
 	percpu_counter_init(&get_ub0()->ub_orphan_count, 0);
+	percpu_counter_init(&get_ub0()->ub_tw_count, 0);
 	tcp_hashinfo.bind_bucket_cachep =
 		kmem_cache_create("tcp_bind_bucket",
 				  sizeof(struct inet_bind_bucket), 0,
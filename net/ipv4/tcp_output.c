@@ -53,6 +53,9 @@ int sysctl_tcp_workaround_signed_windows __read_mostly = 0;
 /* Default TSQ limit of four TSO segments */
 int sysctl_tcp_limit_output_bytes __read_mostly = 262144;
 
+/* Space out the packets of a flow at sk_pacing_rate */
+int sysctl_tcp_pacing __read_mostly = 0;
+
 /* This limits the percentage of the congestion window which we
  * will allow a single TSO frame to consume.  Building TSO frames
  * which are too large can cause TCP streams to be bursty.
@@ -757,6 +760,62 @@ void tcp_wfree(struct sk_buff *skb)
 	}
 }
 
+/*
+ * Pacing timer expired: let the tasklet send the next packets, as
+ * tcp_wfree() does for a throttled socket. Like it, keeps a reference
+ * on sk_wmem_alloc until tcp_tasklet_func() is done with the socket.
+ */
+enum hrtimer_restart tcp_pace_kick(struct hrtimer *timer)
+{
+	struct tcp_sock *tp = container_of(timer, struct tcp_sock, pacing_timer);
+	struct sock *sk = (struct sock *)tp;
+	struct tsq_tasklet *tsq;
+	unsigned long flags;
+
+	if (test_and_set_bit(TSQ_QUEUED, &tp->tsq_flags))
+		return HRTIMER_NORESTART;
+
+	if (!atomic_inc_not_zero(&sk->sk_wmem_alloc)) {
+		clear_bit(TSQ_QUEUED, &tp->tsq_flags);
+		return HRTIMER_NORESTART;
+	}
+
+	clear_bit(TSQ_THROTTLED, &tp->tsq_flags);
+	local_irq_save(flags);
+	tsq = &__get_cpu_var(tsq_tasklet);
+	list_add(&tp->tsq_node, &tsq->head);
+	tasklet_schedule(&tsq->tasklet);
+	local_irq_restore(flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static inline int tcp_pacing_check(struct sock *sk)
+{
+	return sysctl_tcp_pacing &&
+	       hrtimer_active(&tcp_sk(sk)->pacing_timer);
+}
+
+/*
+ * Holds the next packet of the flow back for the time this one takes to
+ * go out at sk_pacing_rate. The rate is not known before the first RTT
+ * sample, the flow is not paced until then.
+ */
+static void tcp_internal_pacing(struct sock *sk, const struct sk_buff *skb)
+{
+	u32 rate = sk_extended(sk)->sk_pacing_rate;
+	u64 len_ns;
+
+	if (!sysctl_tcp_pacing || !rate || rate == ~0U)
+		return;
+
+	len_ns = (u64)skb->len * NSEC_PER_SEC;
+	do_div(len_ns, rate);
+	hrtimer_start(&tcp_sk(sk)->pacing_timer,
+		      ktime_add_ns(ktime_get(), len_ns),
+		      HRTIMER_MODE_ABS_PINNED);
+}
+
 static int skb_header_size(struct sock *sk, int tcp_hlen)
 {
 	struct ip_options *opt = inet_sk(sk)->opt;
@@ -1768,6 +1827,9 @@ static int tcp_write_xmit(struct sock *sk, unsigned int mss_now, int nonagle,
 	while ((skb = tcp_send_head(sk))) {
 		unsigned int limit;
 
+		if (tcp_pacing_check(sk))
+			break;
+
 		tso_segs = tcp_init_tso_segs(sk, skb, mss_now);
 		BUG_ON(!tso_segs);
 
@@ -1797,9 +1859,14 @@ static int tcp_write_xmit(struct sock *sk, unsigned int mss_now, int nonagle,
 		 * Alas, some drivers / subsystems require a fair amount
 		 * of queued bytes to ensure line rate.
 		 * One example is wifi aggregation (802.11 AMPDU)
+		 * The limit only holds data back in the write queue, where it
+		 * stays charged to UB_TCPSNDBUF, so it does not change what
+		 * the beancounter of the socket sees.
 		 */
-		limit = max_t(unsigned int, sysctl_tcp_limit_output_bytes,
+		limit = max_t(unsigned int, 2 * skb->truesize,
 			      sk_extended(sk)->sk_pacing_rate >> 10);
+		limit = min_t(unsigned int, limit,
+			      sysctl_tcp_limit_output_bytes);
 
 		if (atomic_read(&sk->sk_wmem_alloc) > limit) {
 			set_bit(TSQ_THROTTLED, &tp->tsq_flags);
@@ -1834,6 +1901,7 @@ static int tcp_write_xmit(struct sock *sk, unsigned int mss_now, int nonagle,
 		 * This call will increment packets_out.
 		 */
 		tcp_event_new_data_sent(sk, skb);
+		tcp_internal_pacing(sk, skb);
 
 		tcp_minshall_update(tp, mss_now, skb);
 		sent_pkts += tcp_skb_pcount(skb);
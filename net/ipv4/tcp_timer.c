@@ -41,6 +41,9 @@ void tcp_init_xmit_timers(struct sock *sk)
 {
 	inet_csk_init_xmit_timers(sk, &tcp_write_timer, &tcp_delack_timer,
 				  &tcp_keepalive_timer);
+	hrtimer_init(&tcp_sk(sk)->pacing_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS_PINNED);
+	tcp_sk(sk)->pacing_timer.function = tcp_pace_kick;
 }
 
 EXPORT_SYMBOL(tcp_init_xmit_timers);
@@ -68,27 +71,26 @@ static void tcp_write_err(struct sock *sk)
 static int tcp_out_of_resources(struct sock *sk, int do_reset)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
-	int orphans = ub_get_orphan_count(sk);
-	int orph = orphans;
+	int shift = 0;
 
 	/* If peer does not open window for long time, or did not transmit
 	 * anything for long time, penalize it. */
 	if ((s32)(tcp_time_stamp - tp->lsndtime) > 2*TCP_RTO_MAX || !do_reset)
-		orphans <<= 1;
+		shift++;
 
 	/* If some dubious ICMP arrived, penalize even more. */
 	if (sk->sk_err_soft)
-		orphans <<= 1;
+		shift++;
 
-	if (ub_too_many_orphans(sk, orphans)) {
+	if (ub_too_many_orphans(sk, shift)) {
 		if (net_ratelimit()) {
-			int ubid = 0;
+			int ubid = 0, orph = ub_get_orphan_count(sk);
 #ifdef CONFIG_BEANCOUNTERS
 			ubid = sock_has_ubc(sk) ?
 					sock_bc(sk)->ub->ub_uid : 0;
 #endif
 			printk(KERN_INFO "Orphaned socket dropped "
-			       "(%d,%d in CT%d)\n", orph, orphans, ubid);
+			       "(%d,%d in CT%d)\n", orph, orph << shift, ubid);
 		}
 		/* Catch exceptional cases, when connection requires reset.
 		 *      1. Last segment was sent recently. */
@@ -241,7 +243,7 @@ static void tcp_delack_timer(unsigned long data)
 	TCP_CHECK_TIMER(sk);
 
 out:
-	if (tcp_memory_pressure)
+	if (ub_tcp_sk_pressure(sk))
 		sk_mem_reclaim(sk);
 out_unlock:
 	bh_unlock_sock(sk);
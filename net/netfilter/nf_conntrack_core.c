@@ -64,8 +64,16 @@ EXPORT_SYMBOL_GPL(nf_conntrack_htable_size);
 struct nf_conn nf_conntrack_untracked __read_mostly;
 EXPORT_SYMBOL_GPL(nf_conntrack_untracked);
 
-static int nf_conntrack_hash_rnd_initted;
-static unsigned int nf_conntrack_hash_rnd;
+/*
+ * Tables of VEs start with this number of buckets and grow on demand up to
+ * the size matching their nf_conntrack_max.
+ */
+static unsigned int nf_conntrack_ve_htable_size __read_mostly = 1024;
+module_param_named(ve_hashsize, nf_conntrack_ve_htable_size, uint, 0644);
+
+/* serializes resizes of the hash tables and cpt dumps of them */
+DEFINE_MUTEX(nf_conntrack_resize_mutex);
+EXPORT_SYMBOL_GPL(nf_conntrack_resize_mutex);
 
 static u_int32_t __hash_conntrack(const struct nf_conntrack_tuple *tuple,
 				  unsigned int size, unsigned int rnd)
@@ -88,8 +96,12 @@ static u_int32_t __hash_conntrack(const struct nf_conntrack_tuple *tuple,
 static inline u_int32_t hash_conntrack(const struct net *net,
 				       const struct nf_conntrack_tuple *tuple)
 {
-	return __hash_conntrack(tuple, net->ct.htable_size,
-				nf_conntrack_hash_rnd);
+	u_int32_t hash;
+
+	hash = __hash_conntrack(tuple, net->ct.htable_size, net->ct.hash_rnd);
+	/* The table is read after its size, see nf_conntrack_hash_grow() */
+	smp_rmb();
+	return hash;
 }
 
 bool
@@ -318,13 +330,15 @@ __nf_conntrack_find(struct net *net, const struct nf_conntrack_tuple *tuple)
 {
 	struct nf_conntrack_tuple_hash *h;
 	struct hlist_nulls_node *n;
-	unsigned int hash = hash_conntrack(net, tuple);
+	unsigned int hash, sequence;
 
 	/* Disable BHs the entire time since we normally need to disable them
 	 * at least once for the stats anyway.
 	 */
 	local_bh_disable();
 begin:
+	sequence = read_seqcount_begin(&net->ct.generation);
+	hash = hash_conntrack(net, tuple);
 	hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[hash], hnnode) {
 		if (nf_ct_key_equal(h, tuple)) {
 			NF_CT_STAT_INC(net, found);
@@ -340,6 +354,9 @@ begin:
 	 */
 	if (get_nulls_value(n) != hash)
 		goto begin;
+	/* the conntrack might have been moved to a resized table */
+	if (read_seqcount_retry(&net->ct.generation, sequence))
+		goto begin;
 	local_bh_enable();
 
 	return NULL;
@@ -386,29 +403,41 @@ static void __nf_conntrack_hash_insert(struct nf_conn *ct,
 			   &net->ct.hash[repl_hash]);
 }
 
-int
-__nf_conntrack_hash_check_insert(struct nf_conn *ct, struct nf_conn **cd)
+/* See if there's one in the list already, including reverse */
+static struct nf_conntrack_tuple_hash *
+__nf_conntrack_clash(struct nf_conn *ct, unsigned int hash,
+		     unsigned int repl_hash)
 {
 	struct net *net = nf_ct_net(ct);
-	unsigned int hash, repl_hash;
 	struct nf_conntrack_tuple_hash *h;
 	struct hlist_nulls_node *n;
 
-	hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	repl_hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-
-
-	spin_lock_bh(&nf_conntrack_lock);
-
-	/* See if there's one in the list already, including reverse */
 	hlist_nulls_for_each_entry(h, n, &net->ct.hash[hash], hnnode)
 		if (nf_ct_tuple_equal(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple,
 				      &h->tuple))
-			goto out;
+			return h;
 	hlist_nulls_for_each_entry(h, n, &net->ct.hash[repl_hash], hnnode)
 		if (nf_ct_tuple_equal(&ct->tuplehash[IP_CT_DIR_REPLY].tuple,
 				      &h->tuple))
-			goto out;
+			return h;
+	return NULL;
+}
+
+int
+__nf_conntrack_hash_check_insert(struct nf_conn *ct, struct nf_conn **cd)
+{
+	struct net *net = nf_ct_net(ct);
+	unsigned int hash, repl_hash;
+	struct nf_conntrack_tuple_hash *h;
+
+	spin_lock_bh(&nf_conntrack_lock);
+
+	hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+	repl_hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+
+	h = __nf_conntrack_clash(ct, hash, repl_hash);
+	if (h)
+		goto out;
 
 	add_timer(&ct->timeout);
 	smp_wmb();
@@ -431,6 +460,44 @@ out:
 }
 EXPORT_SYMBOL(__nf_conntrack_hash_check_insert);
 
+/*
+ * Inserts a batch of unconfirmed conntracks taking nf_conntrack_lock once.
+ * Inserted ones are replaced with NULL in cts[], references to them are
+ * passed to the hash table. Clashing ones are left to the caller, returns
+ * the number of them.
+ */
+int nf_conntrack_hash_insert_batch(struct nf_conn **cts, int nr)
+{
+	int i, left = 0;
+
+	spin_lock_bh(&nf_conntrack_lock);
+	for (i = 0; i < nr; i++) {
+		struct nf_conn *ct = cts[i];
+		struct net *net = nf_ct_net(ct);
+		unsigned int hash, repl_hash;
+
+		hash = hash_conntrack(net,
+				&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+		repl_hash = hash_conntrack(net,
+				&ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+		if (__nf_conntrack_clash(ct, hash, repl_hash)) {
+			left++;
+			continue;
+		}
+
+		add_timer(&ct->timeout);
+		smp_wmb();
+		atomic_set(&ct->ct_general.use, 1);
+		__nf_conntrack_hash_insert(ct, hash, repl_hash);
+		NF_CT_STAT_INC(net, insert);
+		cts[i] = NULL;
+	}
+	spin_unlock_bh(&nf_conntrack_lock);
+
+	return left;
+}
+EXPORT_SYMBOL(nf_conntrack_hash_insert_batch);
+
 int
 nf_conntrack_hash_check_insert(struct nf_conn *ct)
 {
@@ -460,9 +527,6 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 	if (CTINFO2DIR(ctinfo) != IP_CT_DIR_ORIGINAL)
 		return NF_ACCEPT;
 
-	hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
-	repl_hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
-
 	/* We're not in hash table, and we refuse to set up related
 	   connections for unconfirmed conns.  But packet copies and
 	   REJECT will give spurious warnings here. */
@@ -475,6 +539,10 @@ __nf_conntrack_confirm(struct sk_buff *skb)
 
 	spin_lock_bh(&nf_conntrack_lock);
 
+	/* The size of the table may change until the lock is taken */
+	hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple);
+	repl_hash = hash_conntrack(net, &ct->tuplehash[IP_CT_DIR_REPLY].tuple);
+
 	/* We have to check the DYING flag inside the lock to prevent
 	   a race against nf_ct_get_next_corpse() possibly called from
 	   user context, else we insert an already 'dead' hash, blocking
@@ -541,12 +609,15 @@ nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
 	struct net *net = nf_ct_net(ignored_conntrack);
 	struct nf_conntrack_tuple_hash *h;
 	struct hlist_nulls_node *n;
-	unsigned int hash = hash_conntrack(net, tuple);
+	unsigned int hash, sequence;
 
 	/* Disable BHs the entire time since we need to disable them at
 	 * least once for the stats anyway.
 	 */
 	rcu_read_lock_bh();
+begin:
+	sequence = read_seqcount_begin(&net->ct.generation);
+	hash = hash_conntrack(net, tuple);
 	hlist_nulls_for_each_entry_rcu(h, n, &net->ct.hash[hash], hnnode) {
 		if (nf_ct_tuplehash_to_ctrack(h) != ignored_conntrack &&
 		    nf_ct_tuple_equal(tuple, &h->tuple)) {
@@ -556,6 +627,8 @@ nf_conntrack_tuple_taken(const struct nf_conntrack_tuple *tuple,
 		}
 		NF_CT_STAT_INC(net, searched);
 	}
+	if (read_seqcount_retry(&net->ct.generation, sequence))
+		goto begin;
 	rcu_read_unlock_bh();
 
 	return 0;
@@ -564,6 +637,21 @@ EXPORT_SYMBOL_GPL(nf_conntrack_tuple_taken);
 
 #define NF_CT_EVICTION_RANGE	8
 
+/* Host table is sized by the hashsize parameter only */
+static unsigned int nf_ct_htable_limit(struct net *net)
+{
+	unsigned int max;
+
+	if (net_eq(net, &init_net))
+		return net->ct.htable_size;
+
+	max = net->ct.max ? net->ct.max : init_net.ct.max;
+	if (!max)
+		return nf_conntrack_htable_size;
+	return max_t(unsigned int, nf_conntrack_ve_htable_size,
+			DIV_ROUND_UP(max, 4));
+}
+
 /* There's a small race here where we may free a just-assured
    connection.  Too bad: we're in trouble anyway. */
 static noinline int early_drop(struct net *net, unsigned int hash)
@@ -607,6 +695,40 @@ static noinline int early_drop(struct net *net, unsigned int hash)
 	return dropped;
 }
 
+/*
+ * Conntracks of a netns are counted in percpu deltas folded into ct.count
+ * in batches, allocation and freeing on different CPUs do not bounce it.
+ * ct.count lags behind by up to NF_CT_COUNT_BATCH per CPU, which fast
+ * paths can live with, the exact count is only taken near ct.max.
+ */
+#define NF_CT_COUNT_BATCH	32
+
+static void nf_ct_count_add(struct net *net, int val)
+{
+	unsigned long flags;
+	int *pcpu;
+
+	local_irq_save(flags);
+	pcpu = per_cpu_ptr(net->ct.pcpu_count, smp_processor_id());
+	*pcpu += val;
+	if (*pcpu > NF_CT_COUNT_BATCH || *pcpu < -NF_CT_COUNT_BATCH) {
+		atomic_add(*pcpu, &net->ct.count);
+		*pcpu = 0;
+	}
+	local_irq_restore(flags);
+}
+
+unsigned int nf_conntrack_count(struct net *net)
+{
+	int cpu, count;
+
+	count = atomic_read(&net->ct.count);
+	for_each_possible_cpu(cpu)
+		count += *per_cpu_ptr(net->ct.pcpu_count, cpu);
+	return max(count, 0);
+}
+EXPORT_SYMBOL_GPL(nf_conntrack_count);
+
 struct nf_conn *nf_conntrack_alloc(struct net *net,
 				   const struct nf_conntrack_tuple *orig,
 				   const struct nf_conntrack_tuple *repl,
@@ -616,21 +738,22 @@ struct nf_conn *nf_conntrack_alloc(struct net *net,
 	struct nf_conn *ct;
 	struct user_beancounter *old_ub;
 	unsigned int ct_max = net->ct.max ? net->ct.max : init_net.ct.max;
-
-	if (unlikely(!nf_conntrack_hash_rnd_initted)) {
-		get_random_bytes(&nf_conntrack_hash_rnd,
-				sizeof(nf_conntrack_hash_rnd));
-		nf_conntrack_hash_rnd_initted = 1;
-	}
+	unsigned int count, slack;
 
 	/* We don't want any race condition at early drop stage */
-	atomic_inc(&net->ct.count);
+	nf_ct_count_add(net, 1);
+	count = atomic_read(&net->ct.count);
 
-	if (ct_max &&
-	    unlikely(atomic_read(&net->ct.count) > ct_max)) {
+	if (unlikely(count > 2 * net->ct.htable_size) &&
+	    net->ct.htable_size < nf_ct_htable_limit(net))
+		schedule_work(&net->ct.resize_work);
+
+	slack = NF_CT_COUNT_BATCH * num_online_cpus();
+	if (ct_max && unlikely(count + slack > ct_max) &&
+	    nf_conntrack_count(net) > ct_max) {
 		unsigned int hash = hash_conntrack(net, orig);
 		if (!early_drop(net, hash)) {
-			atomic_dec(&net->ct.count);
+			nf_ct_count_add(net, -1);
 			if (net_ratelimit())
 				ve_printk(VE_LOG_BOTH, KERN_WARNING "VE%u: "
 				       "nf_conntrack: table full, dropping"
@@ -648,7 +771,7 @@ struct nf_conn *nf_conntrack_alloc(struct net *net,
 	(void)set_exec_ub(old_ub);
 	if (ct == NULL) {
 		pr_debug("nf_conntrack_alloc: Can't alloc conntrack.\n");
-		atomic_dec(&net->ct.count);
+		nf_ct_count_add(net, -1);
 		return ERR_PTR(-ENOMEM);
 	}
 	/*
@@ -688,8 +811,9 @@ void nf_conntrack_free(struct nf_conn *ct)
 	nf_ct_ext_destroy(ct);
 	nf_ct_ext_free(ct);
 	kmem_cache_free(net->ct.nf_conntrack_cachep, ct);
-	smp_mb__before_atomic_dec();
-	atomic_dec(&net->ct.count);
+	/* the cache is destroyed once the count drops to zero */
+	smp_wmb();
+	nf_ct_count_add(net, -1);
 }
 EXPORT_SYMBOL_GPL(nf_conntrack_free);
 
@@ -1217,22 +1341,25 @@ static void nf_conntrack_cleanup_init_net(void)
 
 static void nf_conntrack_cleanup_net(struct net *net)
 {
+	cancel_work_sync(&net->ct.resize_work);
  i_see_dead_people:
 	nf_ct_iterate_cleanup(net, kill_all, NULL);
 	nf_ct_release_dying_list(net);
-	if (atomic_read(&net->ct.count) != 0) {
+	if (nf_conntrack_count(net) != 0) {
 		schedule();
 		goto i_see_dead_people;
 	}
 
 	nf_ct_free_hashtable(net->ct.hash, net->ct.hash_vmalloc,
 			     net->ct.htable_size);
+	put_beancounter(net->ct.ub);
 	nf_conntrack_ecache_fini(net);
 	nf_conntrack_acct_fini(net);
 	nf_conntrack_expect_fini(net);
 	kmem_cache_destroy(net->ct.nf_conntrack_cachep);
 	kfree(net->ct.slabname);
 	free_percpu(net->ct.stat);
+	free_percpu(net->ct.pcpu_count);
 }
 
 /* Mishearing the voices in his head, our hero wonders how he's
@@ -1288,12 +1415,90 @@ void *nf_ct_alloc_hashtable(unsigned int *sizep, int *vmalloced, int nulls)
 }
 EXPORT_SYMBOL_GPL(nf_ct_alloc_hashtable);
 
+/* Moves all the conntracks of @net to @hash, nf_conntrack_lock is held */
+static void nf_conntrack_rehash(struct net *net, struct hlist_nulls_head *hash,
+				unsigned int hashsize)
+{
+	struct nf_conntrack_tuple_hash *h;
+	unsigned int i, bucket;
+
+	for (i = 0; i < net->ct.htable_size; i++) {
+		while (!hlist_nulls_empty(&net->ct.hash[i])) {
+			h = hlist_nulls_entry(net->ct.hash[i].first,
+					struct nf_conntrack_tuple_hash, hnnode);
+			hlist_nulls_del_rcu(&h->hnnode);
+			bucket = __hash_conntrack(&h->tuple, hashsize,
+						  net->ct.hash_rnd);
+			hlist_nulls_add_head_rcu(&h->hnnode, &hash[bucket]);
+		}
+	}
+}
+
+/*
+ * Lookups compute the bucket from the size and only then read the table,
+ * so a table is published before its size and may only grow: a lookup
+ * seeing the old size indexes either table within bounds. Lookups that
+ * missed the conntracks being moved are retried by ct.generation.
+ */
+static int nf_conntrack_hash_grow(struct net *net, unsigned int hashsize)
+{
+	struct hlist_nulls_head *hash, *old_hash;
+	unsigned int old_size;
+	int vmalloced, old_vmalloced;
+
+	hash = nf_ct_alloc_hashtable(&hashsize, &vmalloced, 1);
+	if (!hash)
+		return -ENOMEM;
+
+	spin_lock_bh(&nf_conntrack_lock);
+	if (hashsize <= net->ct.htable_size) {
+		spin_unlock_bh(&nf_conntrack_lock);
+		nf_ct_free_hashtable(hash, vmalloced, hashsize);
+		return 0;
+	}
+
+	write_seqcount_begin(&net->ct.generation);
+	nf_conntrack_rehash(net, hash, hashsize);
+	old_size = net->ct.htable_size;
+	old_vmalloced = net->ct.hash_vmalloc;
+	old_hash = net->ct.hash;
+
+	net->ct.hash_vmalloc = vmalloced;
+	rcu_assign_pointer(net->ct.hash, hash);
+	smp_wmb();
+	net->ct.htable_size = hashsize;
+	write_seqcount_end(&net->ct.generation);
+	spin_unlock_bh(&nf_conntrack_lock);
+
+	synchronize_net();
+	nf_ct_free_hashtable(old_hash, old_vmalloced, old_size);
+	return 0;
+}
+
+static void nf_conntrack_resize_work(struct work_struct *work)
+{
+	struct net *net = container_of(work, struct net, ct.resize_work);
+	struct user_beancounter *old_ub;
+	unsigned int hashsize;
+
+	mutex_lock(&nf_conntrack_resize_mutex);
+	hashsize = min(net->ct.htable_size * 2, nf_ct_htable_limit(net));
+	if (hashsize > net->ct.htable_size) {
+		old_ub = set_exec_ub(net->ct.ub);
+		if (nf_conntrack_hash_grow(net, hashsize) && net_ratelimit())
+			printk(KERN_WARNING "VE%u: nf_conntrack: can't grow "
+			       "hash to %u buckets\n",
+			       net->owner_ve->veid, hashsize);
+		(void)set_exec_ub(old_ub);
+	}
+	mutex_unlock(&nf_conntrack_resize_mutex);
+}
+
 int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
 {
-	int i, bucket, vmalloced, old_vmalloced;
+	int vmalloced, old_vmalloced;
 	unsigned int hashsize, old_size;
 	struct hlist_nulls_head *hash, *old_hash;
-	struct nf_conntrack_tuple_hash *h;
 
 	if (current->nsproxy->net_ns != &init_net)
 		return -EOPNOTSUPP;
@@ -1310,22 +1515,15 @@ int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
 	if (!hash)
 		return -ENOMEM;
 
-	/* Lookups in the old hash might happen in parallel, which means we
-	 * might get false negatives during connection lookup. New connections
-	 * created because of a false negative won't make it into the hash
-	 * though since that required taking the lock.
+	/* Lookups in the old hash might happen in parallel, a lookup that
+	 * got a false negative during the switch is retried by the generation
+	 * count. New connections created because of a false negative won't
+	 * make it into the hash though since that required taking the lock.
 	 */
+	mutex_lock(&nf_conntrack_resize_mutex);
 	spin_lock_bh(&nf_conntrack_lock);
-	for (i = 0; i < init_net.ct.htable_size; i++) {
-		while (!hlist_nulls_empty(&init_net.ct.hash[i])) {
-			h = hlist_nulls_entry(init_net.ct.hash[i].first,
-					struct nf_conntrack_tuple_hash, hnnode);
-			hlist_nulls_del_rcu(&h->hnnode);
-			bucket = __hash_conntrack(&h->tuple, hashsize,
-						  nf_conntrack_hash_rnd);
-			hlist_nulls_add_head_rcu(&h->hnnode, &hash[bucket]);
-		}
-	}
+	write_seqcount_begin(&init_net.ct.generation);
+	nf_conntrack_rehash(&init_net, hash, hashsize);
 	old_size = init_net.ct.htable_size;
 	old_vmalloced = init_net.ct.hash_vmalloc;
 	old_hash = init_net.ct.hash;
@@ -1333,8 +1531,11 @@ int nf_conntrack_set_hashsize(const char *val, struct kernel_param *kp)
 	init_net.ct.htable_size = nf_conntrack_htable_size = hashsize;
 	init_net.ct.hash_vmalloc = vmalloced;
 	init_net.ct.hash = hash;
+	write_seqcount_end(&init_net.ct.generation);
 	spin_unlock_bh(&nf_conntrack_lock);
+	mutex_unlock(&nf_conntrack_resize_mutex);
 
+	synchronize_net();
 	nf_ct_free_hashtable(old_hash, old_vmalloced, old_size);
 	return 0;
 }
@@ -1407,8 +1608,16 @@ static int nf_conntrack_init_net(struct net *net)
 
 	atomic_set(&net->ct.count, 0);
 	net->ct.max = init_net.ct.max;
+	/* seeded before any conntrack of the netns can be hashed */
+	get_random_bytes(&net->ct.hash_rnd, sizeof(net->ct.hash_rnd));
+	seqcount_init(&net->ct.generation);
 	INIT_HLIST_NULLS_HEAD(&net->ct.unconfirmed, UNCONFIRMED_NULLS_VAL);
 	INIT_HLIST_NULLS_HEAD(&net->ct.dying, DYING_NULLS_VAL);
+	net->ct.pcpu_count = alloc_percpu(int);
+	if (!net->ct.pcpu_count) {
+		ret = -ENOMEM;
+		goto err_pcpu_count;
+	}
 	net->ct.stat = alloc_percpu(struct ip_conntrack_stat);
 	if (!net->ct.stat) {
 		ret = -ENOMEM;
@@ -1431,6 +1640,10 @@ static int nf_conntrack_init_net(struct net *net)
 	}
 
 	net->ct.htable_size = nf_conntrack_htable_size;
+	if (!net_eq(net, &init_net))
+		net->ct.htable_size = min(nf_conntrack_ve_htable_size,
+					  nf_conntrack_htable_size);
+	INIT_WORK(&net->ct.resize_work, nf_conntrack_resize_work);
 	net->ct.hash = nf_ct_alloc_hashtable(&net->ct.htable_size,
 					     &net->ct.hash_vmalloc, 1);
 	if (!net->ct.hash) {
@@ -1438,6 +1651,7 @@ static int nf_conntrack_init_net(struct net *net)
 		printk(KERN_ERR "Unable to create nf_conntrack_hash\n");
 		goto err_hash;
 	}
+	net->ct.ub = get_beancounter(get_exec_ub());
 	ret = nf_conntrack_expect_init(net);
 	if (ret < 0)
 		goto err_expect;
@@ -1455,6 +1669,7 @@ err_ecache:
 err_acct:
 	nf_conntrack_expect_fini(net);
 err_expect:
+	put_beancounter(net->ct.ub);
 	nf_ct_free_hashtable(net->ct.hash, net->ct.hash_vmalloc,
 			     net->ct.htable_size);
 err_hash:
@@ -1464,6 +1679,8 @@ err_cache:
 err_slabname:
 	free_percpu(net->ct.stat);
 err_stat:
+	free_percpu(net->ct.pcpu_count);
+err_pcpu_count:
 	return ret;
 }
 
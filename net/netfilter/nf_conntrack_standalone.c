@@ -245,7 +245,7 @@ static void ct_cpu_seq_stop(struct seq_file *seq, void *v)
 static int ct_cpu_seq_show(struct seq_file *seq, void *v)
 {
 	struct net *net = seq_file_net(seq);
-	unsigned int nr_conntracks = atomic_read(&net->ct.count);
+	unsigned int nr_conntracks = nf_conntrack_count(net);
 	const struct ip_conntrack_stat *st = v;
 
 	if (v == SEQ_START_TOKEN) {
@@ -342,6 +342,19 @@ static int log_invalid_proto_max = 255;
 
 static struct ctl_table_header *nf_ct_netfilter_header;
 
+/* the sysctl data is the lagging ct.count, report the exact one */
+int nf_conntrack_count_sysctl(ctl_table *table, int write,
+			      void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	struct net *net = container_of(table->data, struct net, ct.count);
+	int count = nf_conntrack_count(net);
+	ctl_table tmp = *table;
+
+	tmp.data = &count;
+	return proc_dointvec(&tmp, write, buffer, lenp, ppos);
+}
+EXPORT_SYMBOL_GPL(nf_conntrack_count_sysctl);
+
 static ctl_table nf_ct_sysctl_table[] = {
 	{
 		.ctl_name	= NET_NF_CONNTRACK_MAX,
@@ -358,7 +371,7 @@ static ctl_table nf_ct_sysctl_table[] = {
 		.data		= &init_net.ct.count,
 		.maxlen		= sizeof(int),
 		.mode		= 0444,
-		.proc_handler	= proc_dointvec,
+		.proc_handler	= nf_conntrack_count_sysctl,
 		.strategy	= sysctl_intvec,
 	},
 	{
@@ -66,6 +66,7 @@
 static void	 xprt_init(struct rpc_xprt *xprt, struct net *net);
 static void	xprt_request_init(struct rpc_task *, struct rpc_xprt *);
 static void	xprt_connect_status(struct rpc_task *task);
+static void	xprt_trim_free_slots(struct rpc_xprt *xprt);
 static int      __xprt_get_cong(struct rpc_xprt *, struct rpc_task *);
 
 static DEFINE_SPINLOCK(xprt_list_lock);
@@ -615,6 +616,7 @@ static void xprt_autoclose(struct work_struct *work)
 	xprt->ops->close(xprt);
 	clear_bit(XPRT_CLOSE_WAIT, &xprt->state);
 	xprt_release_write(xprt, NULL);
+	xprt_trim_free_slots(xprt);
 }
 
 /**
@@ -1010,8 +1012,16 @@ out:
 	return req;
 }
 
+/*
+ * Slots grown above min_reqs stay on the free list while no more than half
+ * of all the slots are free, so that a busy transport does not allocate and
+ * free a slot for every request and does not lose them to a GFP_NOWAIT
+ * failure. What a past load left is trimmed when the transport idles.
+ */
 static bool xprt_dynamic_free_slot(struct rpc_xprt *xprt, struct rpc_rqst *req)
 {
+	if (xprt->free_reqs < atomic_read(&xprt->num_reqs) / 2)
+		return false;
 	if (atomic_add_unless(&xprt->num_reqs, -1, xprt->min_reqs)) {
 		kfree(req);
 		return true;
@@ -1027,6 +1037,7 @@ void xprt_alloc_slot(struct rpc_xprt *xprt, struct rpc_task *task)
 	if (!list_empty(&xprt->free)) {
 		req = list_entry(xprt->free.next, struct rpc_rqst, rq_list);
 		list_del(&req->rq_list);
+		xprt->free_reqs--;
 		goto out_init_req;
 	}
 	req = xprt_dynamic_alloc_slot(xprt, GFP_NOWAIT|__GFP_NOWARN);
@@ -1074,11 +1085,27 @@ static void xprt_free_slot(struct rpc_xprt *xprt, struct rpc_rqst *req)
 	if (!xprt_dynamic_free_slot(xprt, req)) {
 		memset(req, 0, sizeof(*req));	/* mark unused */
 		list_add(&req->rq_list, &xprt->free);
+		xprt->free_reqs++;
 	}
 	xprt_wake_up_backlog(xprt);
 	spin_unlock(&xprt->reserve_lock);
 }
 
+static void xprt_trim_free_slots(struct rpc_xprt *xprt)
+{
+	struct rpc_rqst *req, *tmp;
+
+	spin_lock(&xprt->reserve_lock);
+	list_for_each_entry_safe(req, tmp, &xprt->free, rq_list) {
+		if (!atomic_add_unless(&xprt->num_reqs, -1, xprt->min_reqs))
+			break;
+		list_del(&req->rq_list);
+		xprt->free_reqs--;
+		kfree(req);
+	}
+	spin_unlock(&xprt->reserve_lock);
+}
+
 static void xprt_free_all_slots(struct rpc_xprt *xprt)
 {
 	struct rpc_rqst *req;
@@ -1109,6 +1136,7 @@ struct rpc_xprt *xprt_alloc(struct net *net, size_t size,
 			break;
 		list_add(&req->rq_list, &xprt->free);
 	}
+	xprt->free_reqs = i;
 	if (i < num_prealloc)
 		goto out_free;
 	if (max_alloc > num_prealloc)
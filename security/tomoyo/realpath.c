@@ -93,12 +93,12 @@ int tomoyo_realpath_from_path2(struct path *path, char *newname,
 		struct path tmp;
 
 		get_fs_root(current->fs, &root);
-		spin_lock(&vfsmount_lock);
+		br_read_lock(vfsmount_lock);
 		if (root.mnt && root.mnt->mnt_ns)
 			ns_root.mnt = mntget(root.mnt->mnt_ns->root);
 		if (ns_root.mnt)
 			ns_root.dentry = dget(ns_root.mnt->mnt_root);
-		spin_unlock(&vfsmount_lock);
+		br_read_unlock(vfsmount_lock);
 		spin_lock(&dcache_lock);
 		tmp = ns_root;
 		sp = __d_path(path, &tmp, newname, newname_len);
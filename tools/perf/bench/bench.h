@@ -33,6 +33,10 @@ extern int bench_mem_memcpy(int argc, const char **argv,
 extern int bench_futex_hash(int argc, const char **argv, const char *prefix);
 extern int bench_futex_wake(int argc, const char **argv, const char *prefix);
 extern int bench_futex_requeue(int argc, const char **argv, const char *prefix);
+extern int bench_vz_ubc(int argc, const char **argv, const char *prefix);
+extern int bench_vz_ve(int argc, const char **argv, const char *prefix);
+extern int bench_vz_venet(int argc, const char **argv, const char *prefix);
+extern int bench_vz_quota(int argc, const char **argv, const char *prefix);
 
 #define BENCH_FORMAT_DEFAULT_STR	"default"
 #define BENCH_FORMAT_DEFAULT		0
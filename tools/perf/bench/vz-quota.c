@@ -0,0 +1,158 @@
+/*
+ * vz-quota: Allocate and free disk space and inodes under vzquota.
+ *
+ * Each worker creates a file in a private subdirectory of --dir, writes
+ * a few blocks to it and unlinks it, in a loop. Every round charges one
+ * inode and the blocks to the quota of the tree and then uncharges them,
+ * so when --dir is in the private area of a VE with the quota on, this
+ * measures the alloc/free rate of vzquota. With --fsync the blocks are
+ * allocated for real before the unlink, not just reserved.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/stat.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+#include "vz.h"
+
+#include <err.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *dir      = NULL;
+static unsigned int nworkers = 0;
+static unsigned int nsecs    = 10;
+/* size of a file, in KB */
+static unsigned int size     = 4;
+static bool do_fsync = false, silent = false;
+static char *buf;
+
+static const struct option options[] = {
+	OPT_STRING(  'd', "dir",     &dir,      "DIR", "Specify the directory to work in"),
+	OPT_UINTEGER('t', "workers", &nworkers, "Specify amount of worker processes"),
+	OPT_UINTEGER('r', "runtime", &nsecs,    "Specify runtime (in seconds)"),
+	OPT_UINTEGER('S', "size",    &size,     "Specify size of a file (in KB)"),
+	OPT_BOOLEAN( 'f', "fsync",   &do_fsync, "Fsync each file before the unlink"),
+	OPT_BOOLEAN( 's', "silent",  &silent,   "Silent mode: do not display data/details"),
+	OPT_END()
+};
+
+static const char * const bench_vz_quota_usage[] = {
+	"perf bench vz quota --dir <dir> <options>",
+	NULL
+};
+
+static void worker_path(char *path, unsigned int i, const char *name)
+{
+	snprintf(path, PATH_MAX, "%s/vz-quota.%d.%u%s%s", dir, getpid(), i,
+		 name ? "/" : "", name ? name : "");
+}
+
+static int workerfn(struct vz_worker *w, unsigned int i)
+{
+	char wdir[PATH_MAX], path[PATH_MAX];
+	size_t len = (size_t)size << 10;
+	int fd, ret = -1;
+	ssize_t n;
+
+	worker_path(wdir, i, NULL);
+	worker_path(path, i, "file");
+	if (mkdir(wdir, 0700))
+		return -1;
+
+	while (!vz_done) {
+		fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+		if (fd < 0) {
+			/* out of inodes in the quota */
+			if (errno == EDQUOT) {
+				w->failed++;
+				continue;
+			}
+			goto out;
+		}
+		n = write(fd, buf, len);
+		if (n == (ssize_t)len && do_fsync && fsync(fd))
+			n = -1;
+		close(fd);
+		if (n != (ssize_t)len && errno != EDQUOT)
+			goto out;
+		if (unlink(path))
+			goto out;
+		if (n != (ssize_t)len) {
+			w->failed++;
+			continue;
+		}
+		w->ops++;
+		w->bytes += len;
+	}
+	ret = 0;
+out:
+	unlink(path);
+	rmdir(wdir);
+	return ret;
+}
+
+int bench_vz_quota(int argc, const char **argv,
+		   const char *prefix __maybe_unused)
+{
+	struct stats throughput_stats;
+	struct vz_worker *worker;
+	struct timeval runtime;
+	unsigned long long failed = 0, bytes = 0;
+	unsigned long runtime_us;
+	unsigned int i;
+	double total;
+
+	argc = parse_options(argc, argv, options, bench_vz_quota_usage, 0);
+	if (argc || !dir) {
+		usage_with_options(bench_vz_quota_usage, options);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!nworkers)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!size)
+		size = 1;
+
+	buf = malloc((size_t)size << 10);
+	worker = vz_alloc_workers(nworkers);
+	if (!buf || !worker)
+		err(EXIT_FAILURE, "alloc");
+	memset(buf, 0x5a, (size_t)size << 10);
+
+	printf("Run summary [PID %d]: %d workers, each allocating and freeing "
+	       "%d KB files in %s%s for %d secs.\n\n", getpid(), nworkers,
+	       size, dir, do_fsync ? " (fsynced)" : "", nsecs);
+
+	if (vz_run_workers(worker, nworkers, nsecs, workerfn, &runtime))
+		errx(EXIT_FAILURE, "some workers failed");
+
+	runtime_us = runtime.tv_sec * 1000000UL + runtime.tv_usec;
+	if (!runtime_us)
+		runtime_us = 1;
+
+	init_stats(&throughput_stats);
+	for (i = 0; i < nworkers; i++) {
+		unsigned long t = worker[i].ops * 1000000ULL / runtime_us;
+
+		update_stats(&throughput_stats, t);
+		failed += worker[i].failed;
+		bytes += worker[i].bytes;
+		if (!silent)
+			printf("[worker %3d] alloc+free: %lu ops/sec\n", i, t);
+	}
+
+	total = avg_stats(&throughput_stats);
+	printf("%sAveraged %ld alloc+free ops/sec (+- %.2f%%), total: %.0f ops/sec, "
+	       "%.2f MB/sec\n", !silent ? "\n" : "", (long)total,
+	       rel_stddev_stats(stddev_stats(&throughput_stats), total),
+	       total * nworkers, bytes * 1e6 / runtime_us / (1 << 20));
+	if (failed)
+		printf("Failed over quota: %llu\n", failed);
+
+	vz_free_workers(worker, nworkers);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * vz-ubc: Charge and uncharge a beancounter from a bunch of processes.
+ *
+ * Each worker maps and unmaps a private writable anonymous area in a loop,
+ * every mmap charges the privvmpages of the beancounter of the worker and
+ * every munmap uncharges it. With --touch the pages are faulted in too,
+ * what adds physpages and kmem (page tables) charges to each round.
+ *
+ * All workers share one beancounter, so this measures how the charge
+ * paths scale with the number of cpus charging it at once.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/stat.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+#include "vz.h"
+
+#include <err.h>
+#include <string.h>
+
+static unsigned int nworkers = 0;
+static unsigned int nsecs    = 10;
+/* size of the area, in pages */
+static unsigned int npages   = 16;
+static unsigned int ubid     = 0;
+static bool touch = false, silent = false;
+
+static const struct option options[] = {
+	OPT_UINTEGER('t', "workers", &nworkers, "Specify amount of worker processes"),
+	OPT_UINTEGER('r', "runtime", &nsecs,    "Specify runtime (in seconds)"),
+	OPT_UINTEGER('p', "pages",   &npages,   "Specify amount of pages mapped per round"),
+	OPT_UINTEGER('u', "ub",      &ubid,     "Run in the beancounter with this id (needs root)"),
+	OPT_BOOLEAN( 'T', "touch",   &touch,    "Fault the pages in before unmapping"),
+	OPT_BOOLEAN( 's', "silent",  &silent,   "Silent mode: do not display data/details"),
+	OPT_END()
+};
+
+static const char * const bench_vz_ubc_usage[] = {
+	"perf bench vz ubc <options>",
+	NULL
+};
+
+static int workerfn(struct vz_worker *w, unsigned int i __maybe_unused)
+{
+	size_t len = (size_t)npages * page_size;
+	unsigned int j;
+	char *p;
+
+	while (!vz_done) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			/* hit the limit, this is a charge failure */
+			if (errno == ENOMEM) {
+				w->failed++;
+				continue;
+			}
+			return -1;
+		}
+		if (touch)
+			for (j = 0; j < npages; j++)
+				p[(size_t)j * page_size] = 1;
+		munmap(p, len);
+		w->ops++;
+	}
+	return 0;
+}
+
+int bench_vz_ubc(int argc, const char **argv,
+		 const char *prefix __maybe_unused)
+{
+	struct stats throughput_stats;
+	struct vz_worker *worker;
+	struct timeval runtime;
+	unsigned long long failed = 0;
+	unsigned long runtime_us;
+	unsigned int i;
+	double total;
+
+	argc = parse_options(argc, argv, options, bench_vz_ubc_usage, 0);
+	if (argc) {
+		usage_with_options(bench_vz_ubc_usage, options);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!nworkers)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!npages)
+		npages = 1;
+
+	if (ubid && vz_setluid(ubid))
+		err(EXIT_FAILURE, "setluid %u", ubid);
+
+	worker = vz_alloc_workers(nworkers);
+	if (!worker)
+		err(EXIT_FAILURE, "mmap");
+
+	printf("Run summary [PID %d]: %d workers, each (un)charging %d pages%s "
+	       "for %d secs.\n\n", getpid(), nworkers, npages,
+	       touch ? " (touched)" : "", nsecs);
+
+	if (vz_run_workers(worker, nworkers, nsecs, workerfn, &runtime))
+		errx(EXIT_FAILURE, "some workers failed");
+
+	runtime_us = runtime.tv_sec * 1000000UL + runtime.tv_usec;
+	if (!runtime_us)
+		runtime_us = 1;
+
+	init_stats(&throughput_stats);
+	for (i = 0; i < nworkers; i++) {
+		unsigned long t = worker[i].ops * 1000000ULL / runtime_us;
+
+		update_stats(&throughput_stats, t);
+		failed += worker[i].failed;
+		if (!silent)
+			printf("[worker %3d] charges: %lu ops/sec\n", i, t);
+	}
+
+	total = avg_stats(&throughput_stats);
+	printf("%sAveraged %ld charge+uncharge ops/sec (+- %.2f%%), total: %.0f ops/sec\n",
+	       !silent ? "\n" : "", (long)total,
+	       rel_stddev_stats(stddev_stats(&throughput_stats), total),
+	       total * nworkers);
+	if (failed)
+		printf("Failed charges: %llu\n", failed);
+
+	vz_free_workers(worker, nworkers);
+	return 0;
+}
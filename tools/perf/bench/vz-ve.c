@@ -0,0 +1,181 @@
+/*
+ * vz-ve: Create and destroy empty VEs one after another.
+ *
+ * A forked child creates a VE through the VZCTL_ENV_CREATE ioctl, what
+ * makes it the init of the VE, reports how long the ioctl took and exits.
+ * The VE is then gone once its cleanup is over, the parent polls for that
+ * with VE_TEST and reports the time from the exit of the init on.
+ *
+ * The VE gets no private area, network or limits set up, so this is the
+ * cost of the kernel part of vzctl start/stop only. Needs root.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/stat.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+#include "vz.h"
+
+#include <err.h>
+#include <string.h>
+
+static unsigned int nves    = 100;
+static unsigned int veid    = 1000000;
+static unsigned int repeat  = 1;
+static bool silent = false;
+
+static struct stats create_stats, destroy_stats;
+
+static const struct option options[] = {
+	OPT_UINTEGER('n', "nves",    &nves,    "Specify amount of VEs to create per run"),
+	OPT_UINTEGER('i', "veid",    &veid,    "Specify the first VE id to use"),
+	OPT_UINTEGER('r', "repeat",  &repeat,  "Specify amount of times to repeat the run"),
+	OPT_BOOLEAN( 's', "silent",  &silent,  "Silent mode: do not display data/details"),
+	OPT_END()
+};
+
+static const char * const bench_vz_ve_usage[] = {
+	"perf bench vz ve <options>",
+	NULL
+};
+
+static unsigned long tv_us(struct timeval *tv)
+{
+	return tv->tv_sec * 1000000UL + tv->tv_usec;
+}
+
+struct ve_create_res {
+	int		err;
+	struct timeval	runtime;
+};
+
+/* Returns the create time in us, or -1 with errno set */
+static long ve_create_one(int fd, vz_envid_t id)
+{
+	struct ve_create_res r = { .err = EPIPE };
+	struct timeval start, end;
+	int res[2], status;
+	pid_t pid;
+
+	if (pipe(res))
+		return -1;
+
+	pid = fork();
+	if (pid < 0) {
+		close(res[0]);
+		close(res[1]);
+		return -1;
+	}
+	if (!pid) {
+		close(res[0]);
+		gettimeofday(&start, NULL);
+		r.err = 0;
+		if (vz_env_create(fd, id, VE_CREATE | VE_EXCLUSIVE) < 0)
+			r.err = errno;
+		gettimeofday(&end, NULL);
+		timersub(&end, &start, &r.runtime);
+		/* the VE goes away with us */
+		if (write(res[1], &r, sizeof(r)) != sizeof(r))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(res[1]);
+	if (read(res[0], &r, sizeof(r)) != sizeof(r))
+		r.err = EPIPE;
+	close(res[0]);
+	if (waitpid(pid, &status, 0) < 0)
+		return -1;
+
+	if (r.err) {
+		errno = r.err;
+		return -1;
+	}
+	return tv_us(&r.runtime);
+}
+
+/* Returns the time it took for the VE to go away, in us, or -1 */
+static long ve_wait_gone(int fd, vz_envid_t id)
+{
+	struct timeval start, end, runtime;
+
+	gettimeofday(&start, NULL);
+	while (!vz_env_create(fd, id, VE_TEST))
+		usleep(100);
+	if (errno != ESRCH)
+		return -1;
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &runtime);
+	return tv_us(&runtime);
+}
+
+static void print_summary(void)
+{
+	double create_avg = avg_stats(&create_stats);
+	double destroy_avg = avg_stats(&destroy_stats);
+
+	printf("Created VEs in %.4f ms (+-%.2f%%), destroyed in %.4f ms (+-%.2f%%)\n",
+	       create_avg / 1e3,
+	       rel_stddev_stats(stddev_stats(&create_stats), create_avg),
+	       destroy_avg / 1e3,
+	       rel_stddev_stats(stddev_stats(&destroy_stats), destroy_avg));
+}
+
+int bench_vz_ve(int argc, const char **argv,
+		const char *prefix __maybe_unused)
+{
+	unsigned int i, j;
+	long create, destroy;
+	int fd;
+
+	argc = parse_options(argc, argv, options, bench_vz_ve_usage, 0);
+	if (argc) {
+		usage_with_options(bench_vz_ve_usage, options);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(VZCTL_DEVICE, O_RDWR);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s", VZCTL_DEVICE);
+
+	printf("Run summary [PID %d]: creating and destroying %d VEs "
+	       "(ids %u-%u), %d times.\n\n",
+	       getpid(), nves, veid, veid + nves - 1, repeat);
+
+	init_stats(&create_stats);
+	init_stats(&destroy_stats);
+
+	for (j = 0; j < repeat; j++) {
+		struct stats run_create, run_destroy;
+
+		init_stats(&run_create);
+		init_stats(&run_destroy);
+
+		for (i = 0; i < nves; i++) {
+			create = ve_create_one(fd, veid + i);
+			if (create < 0)
+				err(EXIT_FAILURE, "create VE %u", veid + i);
+			destroy = ve_wait_gone(fd, veid + i);
+			if (destroy < 0)
+				err(EXIT_FAILURE, "destroy VE %u", veid + i);
+
+			update_stats(&create_stats, create);
+			update_stats(&destroy_stats, destroy);
+			update_stats(&run_create, create);
+			update_stats(&run_destroy, destroy);
+		}
+
+		if (!silent) {
+			printf("[Run %d]: create %.4f ms, destroy %.4f ms, "
+			       "max %.4f/%.4f ms\n", j + 1,
+			       avg_stats(&run_create) / 1e3,
+			       avg_stats(&run_destroy) / 1e3,
+			       run_create.max / 1e3, run_destroy.max / 1e3);
+		}
+	}
+
+	print_summary();
+	close(fd);
+	return 0;
+}
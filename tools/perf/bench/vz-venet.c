@@ -0,0 +1,219 @@
+/*
+ * vz-venet: Push traffic from the host to a running VE through venet.
+ *
+ * A forked child enters the VE given with --veid and receives on a socket
+ * bound there, the parent sends to the address of the VE from the host
+ * for the runtime. By default small UDP datagrams are sent, to measure
+ * the packet rate of the venet path; with --tcp one stream is pushed for
+ * throughput instead. The address must be one of the VE, so that the
+ * packets do go through the venet device. Needs root.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+#include "vz.h"
+
+#include <err.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static unsigned int veid    = 0;
+static const char *addr     = NULL;
+static unsigned int port    = 5001;
+static unsigned int len     = 0;
+static unsigned int nsecs   = 10;
+static bool tcp = false;
+
+static const struct option options[] = {
+	OPT_UINTEGER('i', "veid",    &veid,    "Specify the id of a running VE"),
+	OPT_STRING(  'a', "addr",    &addr,    "IP", "Specify an IPv4 address of the VE"),
+	OPT_UINTEGER('P', "port",    &port,    "Specify the port to use in the VE"),
+	OPT_UINTEGER('l', "length",  &len,     "Specify size of a write (default 64, --tcp 64k)"),
+	OPT_UINTEGER('r', "runtime", &nsecs,   "Specify runtime (in seconds)"),
+	OPT_BOOLEAN( 'T', "tcp",     &tcp,     "Send a TCP stream instead of UDP datagrams"),
+	OPT_END()
+};
+
+static const char * const bench_vz_venet_usage[] = {
+	"perf bench vz venet --veid <id> --addr <ip> <options>",
+	NULL
+};
+
+static int receiver_socket(void)
+{
+	struct timeval tv = { .tv_usec = 100000 };
+	struct sockaddr_in sin;
+	int s, one = 1;
+
+	s = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (s < 0)
+		return -1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* a timeout for the receiver to notice it was told to stop */
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    (tcp && listen(s, 1))) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* Runs in the VE, reports readiness or errno through @ready */
+static int receiver(struct vz_worker *w, int fd, int ready)
+{
+	int s = -1, c, error = 0;
+	ssize_t n;
+	char *buf;
+
+	buf = malloc(len);
+	if (!buf || vz_env_create(fd, veid, VE_ENTER) < 0 ||
+	    (s = receiver_socket()) < 0)
+		error = errno;
+	if (write(ready, &error, sizeof(error)) != sizeof(error) || error)
+		return -1;
+
+	c = s;
+	if (tcp) {
+		while ((c = accept(s, NULL, NULL)) < 0)
+			if (vz_done || (errno != EAGAIN && errno != EINTR))
+				return -1;
+	}
+
+	while (!vz_done) {
+		n = recv(c, buf, len, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!n)
+			break;
+		w->ops++;
+		w->bytes += n;
+	}
+	return 0;
+}
+
+static int sender_socket(void)
+{
+	struct sockaddr_in sin;
+	int s;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (!inet_aton(addr, &sin.sin_addr))
+		errx(EXIT_FAILURE, "bad address %s", addr);
+
+	s = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+	if (s < 0 || connect(s, (struct sockaddr *)&sin, sizeof(sin)))
+		return -1;
+	return s;
+}
+
+int bench_vz_venet(int argc, const char **argv,
+		   const char *prefix __maybe_unused)
+{
+	struct timeval start, end, runtime;
+	struct vz_worker *rx, tx = { 0 };
+	double secs;
+	int fd, s, ready[2], error, status;
+	ssize_t n;
+	char *buf;
+	pid_t pid;
+
+	argc = parse_options(argc, argv, options, bench_vz_venet_usage, 0);
+	if (argc || !veid || !addr) {
+		usage_with_options(bench_vz_venet_usage, options);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!len)
+		len = tcp ? 65536 : 64;
+	buf = calloc(1, len);
+	rx = vz_alloc_workers(1);
+	if (!buf || !rx)
+		err(EXIT_FAILURE, "alloc");
+
+	fd = open(VZCTL_DEVICE, O_RDWR);
+	if (fd < 0)
+		err(EXIT_FAILURE, "open %s", VZCTL_DEVICE);
+	if (pipe(ready))
+		err(EXIT_FAILURE, "pipe");
+
+	signal(SIGUSR1, vz_toggle_done);
+	pid = fork();
+	if (pid < 0)
+		err(EXIT_FAILURE, "fork");
+	if (!pid) {
+		close(ready[0]);
+		_exit(receiver(rx, fd, ready[1]) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	close(ready[1]);
+	if (read(ready[0], &error, sizeof(error)) != sizeof(error))
+		errx(EXIT_FAILURE, "receiver died");
+	if (error) {
+		errno = error;
+		err(EXIT_FAILURE, "receiver in VE %u", veid);
+	}
+
+	s = sender_socket();
+	if (s < 0)
+		err(EXIT_FAILURE, "connect to %s:%u", addr, port);
+
+	printf("Run summary [PID %d]: sending %s of %d bytes to VE %u (%s:%u) "
+	       "for %d secs.\n\n", getpid(), tcp ? "TCP writes" : "UDP datagrams",
+	       len, veid, addr, port, nsecs);
+
+	signal(SIGALRM, vz_toggle_done);
+	alarm(nsecs);
+	gettimeofday(&start, NULL);
+	while (!vz_done) {
+		n = send(s, buf, len, 0);
+		if (n < 0) {
+			/* nobody listens yet or an ICMP came back */
+			if (errno == ECONNREFUSED || errno == ENOBUFS ||
+			    errno == EINTR)
+				continue;
+			err(EXIT_FAILURE, "send");
+		}
+		tx.ops++;
+		tx.bytes += n;
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &runtime);
+	close(s);
+
+	kill(pid, SIGUSR1);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		errx(EXIT_FAILURE, "receiver failed");
+
+	secs = runtime.tv_sec + runtime.tv_usec / 1e6;
+	printf("Sent:     %12llu %s, %10.0f/sec, %10.2f MB/sec\n",
+	       tx.ops, tcp ? "writes" : "packets", tx.ops / secs,
+	       tx.bytes / secs / 1e6);
+	printf("Received: %12llu %s, %10.0f/sec, %10.2f MB/sec\n",
+	       rx->ops, tcp ? "reads  " : "packets", rx->ops / secs,
+	       rx->bytes / secs / 1e6);
+	if (!tcp && tx.ops)
+		printf("Lost:     %12.2f%%\n",
+		       100.0 * (tx.ops - min(rx->ops, tx.ops)) / tx.ops);
+
+	vz_free_workers(rx, 1);
+	free(buf);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Glibc independent wrappers of the OpenVZ kernel interfaces used by
+ * the vz benchmarks. The definitions mirror include/linux/vzcalluser.h,
+ * which drags in kernel only headers and can't be used here.
+ */
+
+#ifndef _VZ_H
+#define _VZ_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+
+#define VZCTL_DEVICE	"/dev/vzctl"
+
+typedef unsigned vz_envid_t;
+
+struct vz_env_create {
+	vz_envid_t	veid;
+	unsigned	flags;
+#define VE_CREATE	1	/* Create VE, VE_ENTER added automatically */
+#define VE_EXCLUSIVE	2	/* Fail if exists */
+#define VE_ENTER	4	/* Enter existing VE */
+#define VE_TEST		8	/* Test if VE exists */
+	__u32		class_id;
+};
+
+#define VZCTLTYPE	'.'
+#define VZCTL_ENV_CREATE	_IOW(VZCTLTYPE, 5, struct vz_env_create)
+
+#ifndef __NR_setluid
+# if defined(__x86_64__)
+#  define __NR_setluid		501
+# elif defined(__i386__)
+#  define __NR_setluid		511
+# endif
+#endif
+
+/**
+ * vz_env_create() - VZCTL_ENV_CREATE ioctl wrapper
+ * @fd:		open descriptor of VZCTL_DEVICE
+ * @veid:	id of the VE
+ * @flags:	VE_* flags above
+ *
+ * Returns the veid the caller ended up in for VE_CREATE and VE_ENTER,
+ * 0 for VE_TEST of an existing VE, -1 with errno set otherwise.
+ */
+static inline int vz_env_create(int fd, vz_envid_t veid, unsigned flags)
+{
+	struct vz_env_create s = {
+		.veid	= veid,
+		.flags	= flags,
+	};
+
+	return ioctl(fd, VZCTL_ENV_CREATE, &s);
+}
+
+/**
+ * vz_setluid() - move the caller to the beancounter @uid
+ */
+static inline int vz_setluid(uid_t uid)
+{
+#ifdef __NR_setluid
+	return syscall(__NR_setluid, uid);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Counters shared between the parent and the forked workers */
+struct vz_worker {
+	unsigned long long	ops;
+	unsigned long long	bytes;
+	unsigned long long	failed;
+} __attribute__((aligned(64)));
+
+/*
+ * Workers are processes, not threads: each one has its own mm and files,
+ * so they contend only on what the container accounting shares.
+ */
+static inline struct vz_worker *vz_alloc_workers(unsigned int nr)
+{
+	void *p;
+
+	p = mmap(NULL, nr * sizeof(struct vz_worker), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static inline void vz_free_workers(struct vz_worker *w, unsigned int nr)
+{
+	munmap(w, nr * sizeof(struct vz_worker));
+}
+
+static volatile sig_atomic_t vz_done;
+
+static inline void vz_toggle_done(int sig __maybe_unused)
+{
+	vz_done = 1;
+}
+
+/**
+ * vz_run_workers() - run @fn in @nr forked workers for @nsecs seconds
+ * @fn:		loops until vz_done is set, accounting its work in @w
+ * @runtime:	actual time the workers were let to run
+ *
+ * Returns the number of workers which failed.
+ */
+static inline int vz_run_workers(struct vz_worker *w, unsigned int nr,
+				 unsigned int nsecs,
+				 int (*fn)(struct vz_worker *w, unsigned int i),
+				 struct timeval *runtime)
+{
+	struct timeval start, end;
+	unsigned int i, nfailed = 0;
+	pid_t *pids;
+	int go[2], status;
+	char c;
+
+	pids = calloc(nr, sizeof(*pids));
+	if (!pids || pipe(go))
+		return nr;
+
+	signal(SIGUSR1, vz_toggle_done);
+	for (i = 0; i < nr; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			nfailed += nr - i;
+			nr = i;
+			break;
+		}
+		if (!pids[i]) {
+			close(go[1]);
+			/* all start at once, when the parent closes the pipe */
+			if (read(go[0], &c, 1) < 0)
+				_exit(EXIT_FAILURE);
+			_exit(fn(&w[i], i) ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	close(go[0]);
+	gettimeofday(&start, NULL);
+	close(go[1]);
+	sleep(nsecs);
+	for (i = 0; i < nr; i++)
+		kill(pids[i], SIGUSR1);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, runtime);
+
+	for (i = 0; i < nr; i++) {
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			nfailed++;
+	}
+	signal(SIGUSR1, SIG_DFL);
+	free(pids);
+	return nfailed;
+}
+
+#endif /* _VZ_H */
@@ -13,6 +13,7 @@
  *  mem   ... memory access performance
  *  numa  ... NUMA scheduling and MM performance
  *  futex ... Futex performance
+ *  vz    ... Container primitives performance
  */
 #include "perf.h"
 #include "util/util.h"
@@ -62,6 +63,15 @@ static struct bench futex_benchmarks[] = {
 	{ NULL,		NULL,						NULL			}
 };
 
+static struct bench vz_benchmarks[] = {
+	{ "ubc",	"Benchmark for beancounter charge/uncharge",	bench_vz_ubc		},
+	{ "ve",		"Benchmark for VE create/destroy",		bench_vz_ve		},
+	{ "venet",	"Benchmark for host to VE traffic over venet",	bench_vz_venet		},
+	{ "quota",	"Benchmark for vzquota alloc/free",		bench_vz_quota		},
+	{ "all",	"Test all vz benchmarks",			NULL			},
+	{ NULL,		NULL,						NULL			}
+};
+
 struct collection {
 	const char	*name;
 	const char	*summary;
@@ -75,6 +85,7 @@ static struct collection collections[] = {
 	{ "numa",	"NUMA scheduling and MM benchmarks",		numa_benchmarks		},
 #endif
 	{"futex",       "Futex stressing benchmarks",                   futex_benchmarks        },
+	{ "vz",		"Container primitives benchmarks",		vz_benchmarks		},
 	{ "all",	"All benchmarks",				NULL			},
 	{ NULL,		NULL,						NULL			}
 };
@@ -167,6 +167,14 @@ try_again:
 		goto out;
 	}
 
+	if (opts->ve_id != PERF_EVENT_VE_ANY &&
+	    perf_evlist__set_ve(evlist, opts->ve_id)) {
+		error("failed to scope events to VE %u with %d (%s)\n",
+		      opts->ve_id, errno, strerror(errno));
+		rc = -1;
+		goto out;
+	}
+
 	if (perf_evlist__mmap(evlist, opts->mmap_pages, false) < 0) {
 		if (errno == EPERM) {
 			pr_err("Permission error mapping pages.\n"
@@ -780,6 +788,7 @@ static struct record record = {
 		.user_freq	     = UINT_MAX,
 		.user_interval	     = ULLONG_MAX,
 		.freq		     = 4000,
+		.ve_id		     = PERF_EVENT_VE_ANY,
 		.target		     = {
 			.uses_mmap   = true,
 			.default_per_cpu = true,
@@ -858,6 +867,8 @@ const struct option record_options[] = {
 	OPT_CALLBACK('G', "cgroup", &record.evlist, "name",
 		     "monitor event in cgroup name only",
 		     parse_cgroups),
+	OPT_UINTEGER(0, "ve", &record.opts.ve_id,
+		     "sample only while in the OpenVZ container with this id"),
 	OPT_UINTEGER('D', "delay", &record.opts.initial_delay,
 		  "ms to wait before starting measurement after program start"),
 	OPT_STRING('u', "uid", &record.opts.target.uid_str, "user",
@@ -63,6 +63,7 @@ struct record_opts {
 	u16	     stack_dump_size;
 	bool	     sample_transaction;
 	unsigned     initial_delay;
+	unsigned int ve_id;
 };
 
 #endif
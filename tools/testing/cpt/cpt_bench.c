@@ -0,0 +1,671 @@
+/*
+ *  tools/testing/cpt/cpt_bench.c
+ *
+ *  Copyright (C) 2012  Parallels
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * Checkpoint/restore benchmark. Loads a running CT with a synthetic
+ * workload of the requested size, then checkpoints it to an image, kills
+ * it and restores it from the image with the cpt/rst ioctls, the way an
+ * offline migration to the same host does. For each cycle it reports the
+ * time of every phase the kernel has stats for (CPT_GET_STATS), the image
+ * size and the downtime, i.e. the time from the start of suspend until
+ * the restored CT runs again.
+ *
+ * The CT must be set up and started with vzctl, with the private area
+ * mounted at -R. The workload is left running in the CT unless
+ * -C is given, the CT itself is left running in any case.
+ *
+ * The last line of the output is a summary of all cycles in key=value
+ * form, to be compared between kernels.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../../../include/linux/cpt_ioctl.h"
+
+#define CPT_DEVICE	"/proc/cpt"
+#define RST_DEVICE	"/proc/rst"
+#define VZCTL_DEVICE	"/dev/vzctl"
+
+/* linux/vzcalluser.h is not usable from userspace as is */
+struct vzctl_env_create {
+	unsigned	veid;
+	unsigned	flags;
+	__u32		class_id;
+};
+
+#define VE_ENTER	4
+#define VE_TEST		8
+#define VZCTL_ENV_CREATE	_IOW('.', 5, struct vzctl_env_create)
+
+#define WORK_DIR	"/tmp"
+#define WORK_TICK_MS	10
+/* conntrack drops idle udp entries after 30 secs */
+#define WORK_CT_REFRESH	10
+
+static const char *usage =
+"Usage: %s -v veid -R root [options]\n"
+"\n"
+"  -v veid	id of a running CT\n"
+"  -R root	path the root of the CT is mounted at\n"
+"  -i image	image file (default ./cpt_bench.img)\n"
+"  -c cycles	checkpoint/restore cycles (default 1)\n"
+"  -p procs	processes of the workload (default 1)\n"
+"  -m rss	resident memory of the workload in MB (default 64)\n"
+"  -d rate	pages the workload dirties, MB/sec (default 0)\n"
+"  -s sockets	established loopback TCP connections (default 0)\n"
+"  -n entries	conntrack entries, UDP flows over loopback (default 0)\n"
+"  -f files	open regular files (default 0)\n"
+"  -P flags	CPT_SET_PACK flags for the dump (default 0)\n"
+"  -C		kill the workload and remove its files at the end\n"
+"\n"
+"The counts are totals, spread over the processes evenly.\n";
+
+struct params {
+	unsigned	veid;
+	const char	*root;
+	const char	*image;
+	unsigned	cycles;
+	unsigned	procs;
+	unsigned	rss_mb;
+	unsigned	dirty_mb;
+	unsigned	sockets;
+	unsigned	conntrack;
+	unsigned	files;
+	unsigned	pack;
+	int		cleanup;
+};
+
+static struct params p = {
+	.image	= "cpt_bench.img",
+	.cycles	= 1,
+	.procs	= 1,
+	.rss_mb	= 64,
+};
+
+static const char *phase_names[CPT_STAT_MAX] = {
+	[CPT_STAT_SUSPEND]		= "suspend",
+	[CPT_STAT_STOP_TASKS]		= "  stop_tasks",
+	[CPT_STAT_SUSPEND_NET]		= "  suspend_net",
+	[CPT_STAT_COLLECT]		= "  collect",
+	[CPT_STAT_DUMP]			= "dump",
+	[CPT_STAT_DUMP_FILES]		= "  files",
+	[CPT_STAT_DUMP_NET]		= "  net",
+	[CPT_STAT_DUMP_VM]		= "  vm",
+	[CPT_STAT_DUMP_SYSV]		= "  sysv",
+	[CPT_STAT_DUMP_TASKS]		= "  tasks",
+	[CPT_STAT_DUMP_SOCKETS]		= "  sockets",
+	[CPT_STAT_DUMP_CONNTRACK]	= "  conntrack",
+	[CPT_STAT_UNDUMP]		= "undump",
+	[CPT_STAT_RST_UBC]		= "  ubc",
+	[CPT_STAT_RST_NET]		= "  net",
+	[CPT_STAT_RST_CONNTRACK]	= "  conntrack",
+	[CPT_STAT_RST_SOCKETS]		= "  sockets",
+	[CPT_STAT_RST_SYSV]		= "  sysv",
+	[CPT_STAT_RST_MM]		= "  mm",
+	[CPT_STAT_RST_FILES]		= "  files",
+	[CPT_STAT_RESUME]		= "resume",
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int ve_ioctl(int fd, unsigned veid, unsigned flags)
+{
+	struct vzctl_env_create s = {
+		.veid	= veid,
+		.flags	= flags,
+	};
+
+	return ioctl(fd, VZCTL_ENV_CREATE, &s);
+}
+
+/*
+ * Moves the caller into the CT the way vzctl enter does: a new session
+ * first, so that the caller gets a pid in the CT pid namespace.
+ */
+static int enter_ct(void)
+{
+	int fd;
+
+	fd = open(VZCTL_DEVICE, O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (chroot(p.root) || chdir("/")) {
+		close(fd);
+		return -1;
+	}
+	setsid();
+	if (ve_ioctl(fd, p.veid, VE_ENTER) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static unsigned share(unsigned total, unsigned i)
+{
+	return total / p.procs + (i < total % p.procs);
+}
+
+static void file_name(char *buf, size_t len, pid_t pid, unsigned j)
+{
+	snprintf(buf, len, WORK_DIR "/cpt_bench.%d.%u", pid, j);
+}
+
+/* Workload setup, these return nonzero on failure */
+static int work_files(unsigned nr)
+{
+	char name[64];
+	unsigned j;
+	int fd;
+
+	for (j = 0; j < nr; j++) {
+		file_name(name, sizeof(name), getpid(), j);
+		fd = open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+		if (fd < 0 || write(fd, name, strlen(name)) < 0)
+			return 1;
+	}
+	return 0;
+}
+
+static int work_sockets(unsigned nr)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	unsigned j;
+	int l, s, a;
+
+	if (!nr)
+		return 0;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	l = socket(AF_INET, SOCK_STREAM, 0);
+	if (l < 0 || bind(l, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    listen(l, 128) || getsockname(l, (struct sockaddr *)&sin, &len))
+		return 1;
+
+	for (j = 0; j < nr; j++) {
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		if (s < 0 || connect(s, (struct sockaddr *)&sin, sizeof(sin)))
+			return 1;
+		a = accept(l, NULL, NULL);
+		if (a < 0)
+			return 1;
+		/* leave some data queued both ways */
+		if (write(s, "c", 1) != 1 || write(a, "s", 1) != 1)
+			return 1;
+	}
+	return 0;
+}
+
+static int *work_flows(unsigned nr)
+{
+	struct sockaddr_in sin;
+	unsigned j;
+	int *fds;
+
+	fds = calloc(nr + 1, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(9);	/* discard */
+
+	/* each socket gets its own source port, so its own entry */
+	for (j = 0; j < nr; j++) {
+		fds[j] = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fds[j] < 0 ||
+		    connect(fds[j], (struct sockaddr *)&sin, sizeof(sin)))
+			return NULL;
+	}
+	fds[nr] = -1;
+	return fds;
+}
+
+static void work_flows_send(int *fds)
+{
+	for (; *fds >= 0; fds++)
+		send(*fds, "x", 1, MSG_DONTWAIT);
+}
+
+static char *work_mem(size_t len)
+{
+	long psize = sysconf(_SC_PAGESIZE);
+	size_t off;
+	char *m;
+
+	if (!len)
+		return NULL;
+
+	m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+		return NULL;
+
+	/* distinct contents, so that neither zero nor dedup packing helps */
+	for (off = 0; off < len; off += psize)
+		*(unsigned long *)(m + off) = off ^ (unsigned long)getpid();
+	return m;
+}
+
+/* Dirties its share of the rate, keeps the flows alive, forever */
+static void work_loop(char *mem, size_t len, unsigned dirty_mb, int *flows)
+{
+	long psize = sysconf(_SC_PAGESIZE);
+	unsigned long pages, per_tick, ticks = 0, j;
+	size_t off = 0;
+	struct timespec next;
+
+	pages = ((unsigned long)dirty_mb << 20) / psize;
+	per_tick = pages * WORK_TICK_MS / 1000;
+	if (pages && !per_tick)
+		per_tick = 1;
+	if (!mem)
+		per_tick = 0;
+
+	if (!per_tick && flows[0] < 0)
+		for (;;)
+			pause();
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;; ticks++) {
+		for (j = 0; j < per_tick; j++) {
+			mem[off]++;
+			off += psize;
+			if (off >= len)
+				off = 0;
+		}
+		if (!(ticks % (WORK_CT_REFRESH * 1000 / WORK_TICK_MS)))
+			work_flows_send(flows);
+
+		next.tv_nsec += WORK_TICK_MS * 1000000L;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+}
+
+static void worker(unsigned i, int ready)
+{
+	size_t len = ((size_t)share(p.rss_mb, i)) << 20;
+	pid_t pid = getpid();
+	int *flows;
+	char *mem;
+
+	mem = work_mem(len);
+	flows = work_flows(share(p.conntrack, i));
+	if ((len && !mem) || !flows || work_files(share(p.files, i)) ||
+	    work_sockets(share(p.sockets, i)))
+		pid = -errno;
+
+	/* nothing may refer outside of the CT when it is checkpointed */
+	if (write(ready, &pid, sizeof(pid)) != sizeof(pid) || pid < 0)
+		_exit(1);
+	close(ready);
+
+	work_loop(mem, len, share(p.dirty_mb, i), flows);
+}
+
+/* Starts the workload in the CT, returns the pids of its processes there */
+static pid_t *start_workload(void)
+{
+	pid_t *pids, pid;
+	int ready[2], status, fd;
+	unsigned i;
+
+	pids = calloc(p.procs, sizeof(*pids));
+	if (!pids || pipe(ready))
+		die("start workload");
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		close(ready[0]);
+		if (enter_ct()) {
+			pid = -errno;
+			for (i = 0; i < p.procs; i++)
+				if (write(ready[1], &pid, sizeof(pid)) < 0)
+					break;
+			_exit(1);
+		}
+
+		fd = open("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2(fd, 0);
+			dup2(fd, 1);
+			dup2(fd, 2);
+			close(fd);
+		}
+
+		/* the workers get reparented to the init of the CT */
+		for (i = 0; i < p.procs; i++) {
+			pid = fork();
+			if (!pid)
+				worker(i, ready[1]);
+			if (pid < 0) {
+				pid = -errno;
+				if (write(ready[1], &pid, sizeof(pid)) < 0)
+					break;
+			}
+		}
+		_exit(0);
+	}
+
+	close(ready[1]);
+	for (i = 0; i < p.procs; i++) {
+		if (read(ready[0], &pids[i], sizeof(pids[i])) != sizeof(pids[i])) {
+			fprintf(stderr, "workload died\n");
+			exit(1);
+		}
+		if (pids[i] < 0) {
+			errno = -pids[i];
+			die("workload setup");
+		}
+	}
+	close(ready[0]);
+	waitpid(pid, &status, 0);
+	return pids;
+}
+
+static void stop_workload(pid_t *pids)
+{
+	char name[64];
+	unsigned i, j;
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		if (enter_ct())
+			_exit(1);
+		for (i = 0; i < p.procs; i++) {
+			kill(pids[i], SIGKILL);
+			for (j = 0; j < share(p.files, i); j++) {
+				file_name(name, sizeof(name), pids[i], j);
+				unlink(name);
+			}
+		}
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+}
+
+struct cycle {
+	unsigned long long	downtime;	/* us */
+	unsigned long long	image;		/* bytes */
+	struct cpt_stats	cpt;
+	struct cpt_stats	rst;
+};
+
+static int get_stats(int fd, struct cpt_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	/* older kernels don't have the stats */
+	if (ioctl(fd, CPT_GET_STATS, st) < 0)
+		return -1;
+	return 0;
+}
+
+static void checkpoint(int img, struct cycle *c)
+{
+	int fd;
+
+	fd = open(CPT_DEVICE, O_RDWR);
+	if (fd < 0)
+		die(CPT_DEVICE);
+
+	if (ioctl(fd, CPT_SET_VEID, p.veid) < 0 ||
+	    ioctl(fd, CPT_SET_DUMPFD, img) < 0)
+		die("cpt setup");
+	if (p.pack && ioctl(fd, CPT_SET_PACK, p.pack) < 0)
+		die("CPT_SET_PACK");
+
+	if (ioctl(fd, CPT_SUSPEND, 0) < 0)
+		die("CPT_SUSPEND");
+	if (ioctl(fd, CPT_DUMP, 0) < 0) {
+		ioctl(fd, CPT_RESUME, 0);
+		die("CPT_DUMP");
+	}
+	get_stats(fd, &c->cpt);
+	if (ioctl(fd, CPT_KILL, 0) < 0)
+		die("CPT_KILL");
+	close(fd);
+}
+
+static void wait_ct_gone(void)
+{
+	int fd;
+
+	fd = open(VZCTL_DEVICE, O_RDWR);
+	if (fd < 0)
+		die(VZCTL_DEVICE);
+	while (!ve_ioctl(fd, p.veid, VE_TEST))
+		usleep(1000);
+	if (errno != ESRCH)
+		die("VE_TEST");
+	close(fd);
+}
+
+/*
+ * The restore is done from a child chrooted to the CT root, as vzctl
+ * does, the stats come back through a pipe.
+ */
+static void restore(int img, struct cycle *c)
+{
+	int fd, res[2], status;
+	pid_t pid;
+
+	if (pipe(res))
+		die("pipe");
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		close(res[0]);
+		fd = open(RST_DEVICE, O_RDWR);
+		if (fd < 0)
+			die(RST_DEVICE);
+		if (chroot(p.root) || chdir("/"))
+			die("chroot");
+		if (ioctl(fd, CPT_SET_VEID, p.veid) < 0 ||
+		    ioctl(fd, CPT_SET_DUMPFD, img) < 0)
+			die("rst setup");
+		if (ioctl(fd, CPT_UNDUMP, 0) < 0)
+			die("CPT_UNDUMP");
+		if (ioctl(fd, CPT_RESUME, 0) < 0) {
+			ioctl(fd, CPT_KILL, 0);
+			die("CPT_RESUME");
+		}
+		get_stats(fd, &c->rst);
+		if (write(res[1], &c->rst, sizeof(c->rst)) != sizeof(c->rst))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(res[1]);
+	if (read(res[0], &c->rst, sizeof(c->rst)) != sizeof(c->rst)) {
+		fprintf(stderr, "restore failed, CT %u is down\n", p.veid);
+		exit(1);
+	}
+	close(res[0]);
+	waitpid(pid, &status, 0);
+}
+
+static void run_cycle(struct cycle *c)
+{
+	unsigned long long start;
+	struct stat st;
+	int img;
+
+	img = open(p.image, O_CREAT | O_RDWR | O_TRUNC, 0600);
+	if (img < 0)
+		die(p.image);
+
+	start = now_us();
+	checkpoint(img, c);
+	if (fstat(img, &st))
+		die("fstat");
+	c->image = st.st_size;
+
+	wait_ct_gone();
+	if (lseek(img, 0, SEEK_SET))
+		die("lseek");
+	restore(img, c);
+	c->downtime = now_us() - start;
+
+	close(img);
+}
+
+static void print_phases(struct cpt_stats *st, int from, int to)
+{
+	int i;
+
+	for (i = from; i <= to && i < (int)st->nr_phases; i++) {
+		if (!st->phase[i].count || !phase_names[i])
+			continue;
+		printf("  %-16s %10.3f ms %12llu bytes %6u times\n",
+		       phase_names[i], st->phase[i].usecs / 1e3,
+		       (unsigned long long)st->phase[i].bytes,
+		       st->phase[i].count);
+	}
+}
+
+static void print_cycle(unsigned n, struct cycle *c)
+{
+	printf("cycle %u: downtime %.3f ms, image %llu bytes\n",
+	       n, c->downtime / 1e3, c->image);
+	if (!c->cpt.nr_phases && !c->rst.nr_phases) {
+		printf("  no phase stats from the kernel\n");
+		return;
+	}
+	print_phases(&c->cpt, CPT_STAT_SUSPEND, CPT_STAT_DUMP_CONNTRACK);
+	print_phases(&c->rst, CPT_STAT_UNDUMP, CPT_STAT_RESUME);
+}
+
+static void print_summary(struct cycle *c)
+{
+	unsigned long long down = 0, down_max = 0, image = 0;
+	unsigned long long cpt[CPT_STAT_MAX] = { 0 };
+	unsigned i, k;
+
+	for (i = 0; i < p.cycles; i++) {
+		down += c[i].downtime;
+		if (c[i].downtime > down_max)
+			down_max = c[i].downtime;
+		image += c[i].image;
+		for (k = 0; k < CPT_STAT_MAX; k++)
+			cpt[k] += c[i].cpt.phase[k].usecs +
+				  c[i].rst.phase[k].usecs;
+	}
+
+	printf("summary: cycles=%u procs=%u rss_mb=%u dirty_mb=%u sockets=%u "
+	       "conntrack=%u files=%u downtime_ms=%.3f downtime_max_ms=%.3f "
+	       "image_bytes=%llu suspend_ms=%.3f dump_ms=%.3f undump_ms=%.3f "
+	       "resume_ms=%.3f\n",
+	       p.cycles, p.procs, p.rss_mb, p.dirty_mb, p.sockets,
+	       p.conntrack, p.files, down / 1e3 / p.cycles, down_max / 1e3,
+	       image / p.cycles,
+	       cpt[CPT_STAT_SUSPEND] / 1e3 / p.cycles,
+	       cpt[CPT_STAT_DUMP] / 1e3 / p.cycles,
+	       cpt[CPT_STAT_UNDUMP] / 1e3 / p.cycles,
+	       cpt[CPT_STAT_RESUME] / 1e3 / p.cycles);
+}
+
+int main(int argc, char **argv)
+{
+	struct cycle *cycles;
+	pid_t *pids;
+	unsigned i;
+	int c;
+
+	while ((c = getopt(argc, argv, "v:R:i:c:p:m:d:s:n:f:P:C")) != -1) {
+		switch (c) {
+		case 'v': p.veid = strtoul(optarg, NULL, 0); break;
+		case 'R': p.root = optarg; break;
+		case 'i': p.image = optarg; break;
+		case 'c': p.cycles = strtoul(optarg, NULL, 0); break;
+		case 'p': p.procs = strtoul(optarg, NULL, 0); break;
+		case 'm': p.rss_mb = strtoul(optarg, NULL, 0); break;
+		case 'd': p.dirty_mb = strtoul(optarg, NULL, 0); break;
+		case 's': p.sockets = strtoul(optarg, NULL, 0); break;
+		case 'n': p.conntrack = strtoul(optarg, NULL, 0); break;
+		case 'f': p.files = strtoul(optarg, NULL, 0); break;
+		case 'P': p.pack = strtoul(optarg, NULL, 0); break;
+		case 'C': p.cleanup = 1; break;
+		default:
+			fprintf(stderr, usage, argv[0]);
+			return 1;
+		}
+	}
+	if (!p.veid || !p.root || !p.procs || !p.cycles) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	cycles = calloc(p.cycles, sizeof(*cycles));
+	if (!cycles)
+		die("calloc");
+
+	pids = start_workload();
+	printf("CT %u: %u procs, %u MB rss, %u MB/s dirtied, %u sockets, "
+	       "%u flows, %u files\n", p.veid, p.procs, p.rss_mb, p.dirty_mb,
+	       p.sockets, p.conntrack, p.files);
+
+	for (i = 0; i < p.cycles; i++) {
+		run_cycle(&cycles[i]);
+		print_cycle(i + 1, &cycles[i]);
+	}
+
+	if (p.cleanup)
+		stop_workload(pids);
+	unlink(p.image);
+
+	print_summary(cycles);
+	return 0;
+}
@@ -0,0 +1,665 @@
+/*
+ *  tools/testing/ploop/ploop_bench.c
+ *
+ *  Copyright (C) 2012  Parallels
+ *  All rights reserved.
+ *
+ *  Licensing governed by "linux/COPYING.SWsoft" file.
+ *
+ */
+
+/*
+ * ploop I/O benchmark. Creates an image, sets a ploop device up over it
+ * with the requested io engine, runs an I/O pattern against the device
+ * with O_DIRECT from a number of processes and optionally takes a
+ * snapshot and merges it back in the middle of the run. Reports:
+ *
+ *  - IOPS and bandwidth;
+ *  - latency distribution as seen by the processes, and the per-phase
+ *    one of the device (/sys/block/ploopN/pstate/latency);
+ *  - write amplification: what the image files grew by and how many
+ *    BAT pages were written (map_*_writes of pstat), against the bytes
+ *    written to the device;
+ *  - CPU time per I/O, of the benchmark and of the ploop threads;
+ *  - how long the snapshot and the merge took.
+ *
+ * The image must be on a filesystem the io engine supports: local for
+ * direct and kaio, NFS for nfs.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <linux/types.h>
+
+#include "../../../include/linux/ploop/ploop_if.h"
+
+/* ploop1 images are little-endian */
+#define cpu_to_le32(x)	(x)
+#include "../../../drivers/block/ploop/ploop1_image.h"
+
+#define NR_BUCKETS	32	/* log2 of us */
+#define PREFILL_BS	(1 << 20)
+
+static const char *usage =
+"Usage: %s -d /dev/ploopN -i image [options]\n"
+"\n"
+"  -d dev	ploop device, must not be in use\n"
+"  -i image	base image to create, a snapshot goes to image.1\n"
+"  -F fmt	image format: ploop1 (default), raw\n"
+"  -V ver	ploop1 version: 1 or 2 (default)\n"
+"  -e io		io engine: auto (default), direct, kaio, nfs\n"
+"  -s size	device size in MB (default 1024)\n"
+"  -c log	cluster size, log2 of sectors (default 11, 1MB)\n"
+"  -b bs		I/O size in bytes (default 4096)\n"
+"  -p pattern	rand (default) or seq\n"
+"  -u		unaligned: offsets shifted by a sector\n"
+"  -r percent	reads in the mix (default 0)\n"
+"  -o		overwrite: fill the device first, so nothing is allocated\n"
+"  -j jobs	processes doing I/O (default 1)\n"
+"  -t secs	runtime (default 30)\n"
+"  -S secs	take a snapshot that many seconds into the run\n"
+"  -M secs	merge the snapshot back that many seconds into the run\n"
+"  -k		keep the images\n";
+
+struct params {
+	const char	*dev;
+	const char	*image;
+	int		raw;
+	int		version;
+	int		io;
+	unsigned	size_mb;
+	unsigned	cluster_log;
+	unsigned	bs;
+	int		seq;
+	int		unaligned;
+	unsigned	read_pct;
+	int		overwrite;
+	unsigned	jobs;
+	unsigned	secs;
+	unsigned	snap_at;
+	unsigned	merge_at;
+	int		keep;
+};
+
+static struct params p = {
+	.version	= PLOOP_FMT_V2,
+	.io		= PLOOP_IO_AUTO,
+	.size_mb	= 1024,
+	.cluster_log	= 11,
+	.bs		= 4096,
+	.jobs		= 1,
+	.secs		= 30,
+};
+
+/* Per job results, in memory shared with the parent */
+struct job {
+	unsigned long long	reads;
+	unsigned long long	writes;
+	unsigned long long	rbytes;
+	unsigned long long	wbytes;
+	unsigned long long	lat_sum;	/* us */
+	unsigned long long	lat_max;
+	unsigned long long	hist[NR_BUCKETS];
+	int			err;
+} __attribute__((aligned(64)));
+
+/* What the device and its files looked like at some point */
+struct snap {
+	unsigned long long	image_bytes;	/* allocated, all deltas */
+	unsigned long long	bat_writes;
+	unsigned long long	ploop_ticks;	/* cpu of ploop threads */
+};
+
+static char snap_image[4096];
+static int snap_fd = -1;
+static int taken, merged;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const char *dev_name(void)
+{
+	const char *s = strrchr(p.dev, '/');
+
+	return s ? s + 1 : p.dev;
+}
+
+static unsigned long long sysfs_read(const char *dir, const char *name)
+{
+	unsigned long long val = 0;
+	char path[256];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s/%s",
+		 dev_name(), dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%llu", &val) != 1)
+		val = 0;
+	fclose(f);
+	return val;
+}
+
+static void sysfs_write(const char *dir, const char *name, const char *val)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/%s/%s",
+		 dev_name(), dir, name);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return;
+	if (write(fd, val, strlen(val)) < 0)
+		perror(path);
+	close(fd);
+}
+
+/* utime + stime of the main and the completion threads of the device */
+static unsigned long long ploop_thread_ticks(void)
+{
+	unsigned long long ticks = 0, ut, st;
+	char path[300], comm[64], buf[1024], *s;
+	const char *name = dev_name();
+	size_t len = strlen(name);
+	struct dirent *de;
+	DIR *d;
+	FILE *f;
+
+	d = opendir("/proc");
+	if (!d)
+		return 0;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (!fgets(buf, sizeof(buf), f)) {
+			fclose(f);
+			continue;
+		}
+		fclose(f);
+
+		/* pid (comm) state ppid ... utime stime */
+		s = strrchr(buf, ')');
+		if (!s || sscanf(buf, "%*d (%63[^)]", comm) != 1)
+			continue;
+		if (strncmp(comm, name, len) || (comm[len] && comm[len] != '/'))
+			continue;
+		if (sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			   "%llu %llu", &ut, &st) == 2)
+			ticks += ut + st;
+	}
+	closedir(d);
+	return ticks;
+}
+
+static unsigned long long file_bytes(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st))
+		return 0;
+	return (unsigned long long)st.st_blocks << 9;
+}
+
+static void take_snap(struct snap *s)
+{
+	s->image_bytes = file_bytes(p.image);
+	if (taken && !merged)
+		s->image_bytes += file_bytes(snap_image);
+	s->bat_writes = sysfs_read("pstat", "map_single_writes") +
+			sysfs_read("pstat", "map_multi_writes");
+	s->ploop_ticks = ploop_thread_ticks();
+}
+
+/* Writes an empty ploop1 image: the header and a zeroed BAT */
+static int create_ploop1(const char *path)
+{
+	struct ploop_pvd_header vh;
+	__u64 sectors = (__u64)p.size_mb << 11;
+	__u32 len;
+	void *buf;
+	int fd;
+
+	memset(&vh, 0, sizeof(vh));
+	len = generate_pvd_header(&vh, sectors, 1 << p.cluster_log, p.version);
+	buf = calloc(1, len);
+	if (!buf)
+		return -1;
+	memcpy(buf, &vh, sizeof(vh));
+
+	fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0 || pwrite(fd, buf, len, 0) != (ssize_t)len || fsync(fd)) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return fd;
+}
+
+static int create_image(const char *path, int raw)
+{
+	int fd;
+
+	if (!raw)
+		return create_ploop1(path);
+
+	fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0 || ftruncate(fd, (off_t)p.size_mb << 20))
+		return -1;
+	return fd;
+}
+
+static int add_delta(int dev, unsigned long cmd, int fd, int raw)
+{
+	struct ploop_ctl_delta req;
+
+	memset(&req, 0, sizeof(req));
+	req.c.pctl_format = raw ? PLOOP_FMT_RAW : PLOOP_FMT_PLOOP1;
+	req.c.pctl_cluster_log = p.cluster_log;
+	req.c.pctl_chunks = 1;
+	req.f.pctl_fd = fd;
+	req.f.pctl_type = p.io;
+
+	return ioctl(dev, cmd, &req);
+}
+
+static void prefill(void)
+{
+	unsigned long long off, size = (unsigned long long)p.size_mb << 20;
+	void *buf;
+	int fd;
+
+	fd = open(p.dev, O_WRONLY | O_DIRECT);
+	if (fd < 0 || posix_memalign(&buf, 4096, PREFILL_BS))
+		die("prefill");
+	memset(buf, 0xa5, PREFILL_BS);
+	for (off = 0; off < size; off += PREFILL_BS)
+		if (pwrite(fd, buf, PREFILL_BS, off) != PREFILL_BS)
+			die("prefill");
+	if (fsync(fd))
+		die("prefill fsync");
+	close(fd);
+	free(buf);
+}
+
+static void account(struct job *j, unsigned long long us)
+{
+	int b = 0;
+
+	while (b < NR_BUCKETS - 1 && (2ULL << b) <= us)
+		b++;
+	j->hist[b]++;
+	j->lat_sum += us;
+	if (us > j->lat_max)
+		j->lat_max = us;
+}
+
+static void run_job(unsigned i, struct job *j, unsigned long long end)
+{
+	unsigned long long size = (unsigned long long)p.size_mb << 20;
+	unsigned long long nblocks, region, blk = 0, start, t;
+	unsigned shift = p.unaligned ? 512 : 0;
+	unsigned seed = getpid() ^ now_us();
+	off_t off;
+	ssize_t n;
+	void *buf;
+	int fd, rd;
+
+	fd = open(p.dev, O_RDWR | O_DIRECT);
+	if (fd < 0 || posix_memalign(&buf, 4096, p.bs)) {
+		j->err = errno;
+		return;
+	}
+	memset(buf, i + 1, p.bs);
+
+	nblocks = (size - shift) / p.bs;
+	/* sequential jobs write own parts of the device */
+	region = nblocks / p.jobs;
+	if (!region)
+		region = 1;
+
+	while ((start = now_us()) < end) {
+		if (p.seq) {
+			off = ((region * i + blk) % nblocks) * p.bs + shift;
+			if (++blk == region)
+				blk = 0;
+		} else
+			off = (rand_r(&seed) % nblocks) * p.bs + shift;
+
+		rd = p.read_pct && (unsigned)(rand_r(&seed) % 100) < p.read_pct;
+		if (rd)
+			n = pread(fd, buf, p.bs, off);
+		else
+			n = pwrite(fd, buf, p.bs, off);
+		if (n != (ssize_t)p.bs) {
+			j->err = n < 0 ? errno : EIO;
+			break;
+		}
+
+		t = now_us();
+		account(j, t - start);
+		if (rd) {
+			j->reads++;
+			j->rbytes += n;
+		} else {
+			j->writes++;
+			j->wbytes += n;
+		}
+	}
+	close(fd);
+}
+
+static double event(int dev, const char *what, unsigned long cmd)
+{
+	unsigned long long start = now_us();
+	int ret;
+
+	if (cmd == PLOOP_IOC_SNAPSHOT) {
+		snap_fd = create_image(snap_image, 0);
+		if (snap_fd < 0)
+			die(snap_image);
+		ret = add_delta(dev, cmd, snap_fd, 0);
+		if (!ret)
+			taken = 1;
+	} else {
+		ret = ioctl(dev, cmd, 0);
+		/* the snapshot is in the base image now */
+		if (!ret)
+			merged = 1;
+	}
+	if (ret < 0)
+		die(what);
+	return (now_us() - start) / 1e3;
+}
+
+static unsigned long long percentile(unsigned long long *hist,
+				     unsigned long long total, double pct)
+{
+	unsigned long long sum = 0, want = total * pct / 100;
+	int b;
+
+	for (b = 0; b < NR_BUCKETS; b++) {
+		sum += hist[b];
+		if (sum > want)
+			break;
+	}
+	/* upper bound of the bucket */
+	return 2ULL << b;
+}
+
+static void print_device_latency(void)
+{
+	char path[256], name[32];
+	unsigned long long sum, cnt, h;
+	FILE *f;
+	int c;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/pstate/latency",
+		 dev_name());
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	printf("device latency, per request phase:\n");
+	while (fscanf(f, "%31s %llu", name, &sum) == 2) {
+		cnt = 0;
+		while ((c = fgetc(f)) == ' ' && fscanf(f, "%llu", &h) == 1)
+			cnt += h;
+		if (cnt)
+			printf("  %-8s %10llu reqs, avg %8.1f us\n",
+			       name, cnt, (double)sum / cnt);
+	}
+	fclose(f);
+}
+
+static void report(struct job *jobs, struct snap *s0, struct snap *s1,
+		   struct rusage *ru, double secs, double snap_ms,
+		   double merge_ms)
+{
+	unsigned long long hist[NR_BUCKETS] = { 0 };
+	unsigned long long reads = 0, writes = 0, rbytes = 0, wbytes = 0;
+	unsigned long long lat_sum = 0, lat_max = 0, ios, growth, bat;
+	double cpu_us, ploop_us, backing;
+	unsigned i, b;
+
+	for (i = 0; i < p.jobs; i++) {
+		reads += jobs[i].reads;
+		writes += jobs[i].writes;
+		rbytes += jobs[i].rbytes;
+		wbytes += jobs[i].wbytes;
+		lat_sum += jobs[i].lat_sum;
+		if (jobs[i].lat_max > lat_max)
+			lat_max = jobs[i].lat_max;
+		for (b = 0; b < NR_BUCKETS; b++)
+			hist[b] += jobs[i].hist[b];
+	}
+	ios = reads + writes;
+	if (!ios)
+		ios = 1;
+
+	printf("%s %s, %s io, %u MB, cluster %u KB, %s%s %u bytes, "
+	       "%u%% reads, %u jobs, %u secs\n",
+	       p.dev, p.raw ? "raw" : p.version == PLOOP_FMT_V1 ?
+	       "ploop1 v1" : "ploop1 v2",
+	       p.io == PLOOP_IO_DIRECT ? "direct" : p.io == PLOOP_IO_KAIO ?
+	       "kaio" : p.io == PLOOP_IO_NFS ? "nfs" : "auto",
+	       p.size_mb, 1 << (p.cluster_log - 1),
+	       p.seq ? "seq" : "rand", p.unaligned ? " unaligned" : "",
+	       p.bs, p.read_pct, p.jobs, p.secs);
+	if (p.overwrite)
+		printf("overwriting a filled device\n");
+
+	printf("iops: %.0f (read %.0f, write %.0f), bw: %.2f MB/s\n",
+	       ios / secs, reads / secs, writes / secs,
+	       (rbytes + wbytes) / secs / (1 << 20));
+
+	printf("latency: avg %.1f us, p50 <%llu us, p90 <%llu us, "
+	       "p99 <%llu us, p99.9 <%llu us, max %llu us\n",
+	       (double)lat_sum / ios, percentile(hist, ios, 50),
+	       percentile(hist, ios, 90), percentile(hist, ios, 99),
+	       percentile(hist, ios, 99.9), lat_max);
+	for (b = 0; b < NR_BUCKETS; b++)
+		if (hist[b])
+			printf("  <%10llu us %10llu\n", 2ULL << b, hist[b]);
+
+	print_device_latency();
+
+	/*
+	 * What hit the backing store besides the data itself: the growth of
+	 * the images beyond the bytes written (allocation of whole clusters)
+	 * and the BAT pages.
+	 */
+	growth = s1->image_bytes > s0->image_bytes ?
+		 s1->image_bytes - s0->image_bytes : 0;
+	bat = s1->bat_writes - s0->bat_writes;
+	backing = wbytes + (growth > wbytes ? growth - wbytes : 0) +
+		  bat * 4096.0;
+	printf("write amplification: %.2f (written %llu, images grew %llu, "
+	       "BAT writes %llu)\n", wbytes ? backing / wbytes : 0,
+	       wbytes, growth, bat);
+
+	cpu_us = ru->ru_utime.tv_sec * 1e6 + ru->ru_utime.tv_usec +
+		 ru->ru_stime.tv_sec * 1e6 + ru->ru_stime.tv_usec;
+	ploop_us = (s1->ploop_ticks - s0->ploop_ticks) * 1e6 /
+		   sysconf(_SC_CLK_TCK);
+	printf("cpu per io: %.2f us (jobs %.2f, ploop threads %.2f)\n",
+	       (cpu_us + ploop_us) / ios, cpu_us / ios, ploop_us / ios);
+
+	if (snap_ms >= 0)
+		printf("snapshot: %.3f ms\n", snap_ms);
+	if (merge_ms >= 0)
+		printf("merge: %.3f ms\n", merge_ms);
+}
+
+static int parse_io(const char *s)
+{
+	if (!strcmp(s, "auto"))
+		return PLOOP_IO_AUTO;
+	if (!strcmp(s, "direct"))
+		return PLOOP_IO_DIRECT;
+	if (!strcmp(s, "kaio"))
+		return PLOOP_IO_KAIO;
+	if (!strcmp(s, "nfs"))
+		return PLOOP_IO_NFS;
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	double snap_ms = -1, merge_ms = -1, secs;
+	unsigned long long start, end, t;
+	struct snap s0, s1;
+	struct rusage ru;
+	struct job *jobs;
+	int c, dev, img, status, failed = 0;
+	unsigned i;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "d:i:F:V:e:s:c:b:p:ur:oj:t:S:M:k")) != -1) {
+		switch (c) {
+		case 'd': p.dev = optarg; break;
+		case 'i': p.image = optarg; break;
+		case 'F': p.raw = !strcmp(optarg, "raw"); break;
+		case 'V': p.version = atoi(optarg) == 1 ? PLOOP_FMT_V1 :
+				      PLOOP_FMT_V2; break;
+		case 'e': p.io = parse_io(optarg); break;
+		case 's': p.size_mb = strtoul(optarg, NULL, 0); break;
+		case 'c': p.cluster_log = strtoul(optarg, NULL, 0); break;
+		case 'b': p.bs = strtoul(optarg, NULL, 0); break;
+		case 'p': p.seq = !strcmp(optarg, "seq"); break;
+		case 'u': p.unaligned = 1; break;
+		case 'r': p.read_pct = strtoul(optarg, NULL, 0); break;
+		case 'o': p.overwrite = 1; break;
+		case 'j': p.jobs = strtoul(optarg, NULL, 0); break;
+		case 't': p.secs = strtoul(optarg, NULL, 0); break;
+		case 'S': p.snap_at = strtoul(optarg, NULL, 0); break;
+		case 'M': p.merge_at = strtoul(optarg, NULL, 0); break;
+		case 'k': p.keep = 1; break;
+		default:
+			fprintf(stderr, usage, argv[0]);
+			return 1;
+		}
+	}
+	if (!p.dev || !p.image || p.io < 0 || !p.jobs || !p.size_mb ||
+	    !p.bs || p.bs % 512 || p.cluster_log < 3 || p.read_pct > 100 ||
+	    (p.merge_at && (!p.snap_at || p.merge_at <= p.snap_at)) ||
+	    p.snap_at >= p.secs || p.merge_at >= p.secs) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+	snprintf(snap_image, sizeof(snap_image), "%s.1", p.image);
+
+	jobs = mmap(NULL, p.jobs * sizeof(*jobs), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (jobs == MAP_FAILED)
+		die("mmap");
+
+	img = create_image(p.image, p.raw);
+	if (img < 0)
+		die(p.image);
+	dev = open(p.dev, O_RDONLY);
+	if (dev < 0)
+		die(p.dev);
+	if (add_delta(dev, PLOOP_IOC_ADD_DELTA, img, p.raw) < 0)
+		die("PLOOP_IOC_ADD_DELTA");
+	if (ioctl(dev, PLOOP_IOC_START, 0) < 0) {
+		ioctl(dev, PLOOP_IOC_CLEAR, 0);
+		die("PLOOP_IOC_START");
+	}
+
+	if (p.overwrite)
+		prefill();
+
+	sysfs_write("pstate", "latency", "0");
+	take_snap(&s0);
+
+	start = now_us();
+	end = start + p.secs * 1000000ULL;
+	for (i = 0; i < p.jobs; i++) {
+		pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (!pid) {
+			run_job(i, &jobs[i], end);
+			_exit(0);
+		}
+	}
+
+	/* the snapshot and the merge are done while the jobs run */
+	if (p.snap_at) {
+		t = start + p.snap_at * 1000000ULL;
+		while (now_us() < t)
+			usleep(t - now_us());
+		snap_ms = event(dev, "PLOOP_IOC_SNAPSHOT", PLOOP_IOC_SNAPSHOT);
+	}
+	if (p.merge_at) {
+		t = start + p.merge_at * 1000000ULL;
+		while (now_us() < t)
+			usleep(t - now_us());
+		merge_ms = event(dev, "PLOOP_IOC_MERGE", PLOOP_IOC_MERGE);
+	}
+
+	while (wait(&status) > 0)
+		;
+	secs = (now_us() - start) / 1e6;
+	getrusage(RUSAGE_CHILDREN, &ru);
+
+	if (ioctl(dev, PLOOP_IOC_SYNC, 0) < 0)
+		perror("PLOOP_IOC_SYNC");
+	take_snap(&s1);
+
+	for (i = 0; i < p.jobs; i++) {
+		if (jobs[i].err) {
+			errno = jobs[i].err;
+			perror("job");
+			failed = 1;
+		}
+	}
+
+	report(jobs, &s0, &s1, &ru, secs, snap_ms, merge_ms);
+
+	if (ioctl(dev, PLOOP_IOC_STOP, 0) < 0 ||
+	    ioctl(dev, PLOOP_IOC_CLEAR, 0) < 0)
+		perror("stopping the device");
+	close(dev);
+	close(img);
+	if (snap_fd >= 0)
+		close(snap_fd);
+	if (!p.keep) {
+		unlink(p.image);
+		if (taken)
+			unlink(snap_image);
+	}
+	return failed;
+}